@@ -0,0 +1,401 @@
+/*
+ * Broadcast fan-out benchmark
+ *
+ * Drives a Hub with N loopback TCP clients and measures what a fan-out costs the
+ * server: throughput, p50/p99 delivery latency, send syscalls per delivered
+ * message and heap bytes per message left queued on slow consumers.
+ *
+ * Build from the repository root (libuv, zlib and OpenSSL headers required):
+ *
+ *   g++ -std=c++17 -O2 -DUSE_LIBUV -I uWebSockets/src benchmarks/broadcast.cpp uWebSockets/src/*.cpp \
+ *       -luv -lssl -lcrypto -lz -lpthread -Wl,--wrap=send,--wrap=sendmsg -o broadcast
+ *
+ * The --wrap flags let the benchmark count the send syscalls the server makes, without
+ * them the syscall column reads 0.
+ *
+ * Usage: ./broadcast [key=value ...]
+ *
+ *   clients=500      simulated clients (two fds each, mind ulimit -n)
+ *   topics=1         topics for path=publish, client i subscribes to topic i % topics
+ *   rounds=1000      every client receives one message per round
+ *   payload=64       message size in bytes
+ *   compress=0       permessage-deflate negotiated and requested on every send
+ *   slow=0.0         fraction of clients that never read, with a tiny receive buffer
+ *   path=broadcast   send (WebSocket::send per socket, through sendTransformed),
+ *                    broadcast (Group::broadcast), prepared (Group::prepareMessage
+ *                    and sendPrepared) or publish (Group::publish per topic)
+ *   burst=1          rounds sent per loop iteration
+ *   chunk=0          Group::setSendChunkSize, small frames queued on slow clients share chunks
+ *
+ */
+
+#include "Hub.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::atomic<uint64_t> sendSyscalls(0);
+
+extern "C" {
+    ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+    ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+
+    ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags) {
+        sendSyscalls++;
+        return __real_send(fd, buf, len, flags);
+    }
+
+    ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) {
+        sendSyscalls++;
+        return __real_sendmsg(fd, msg, flags);
+    }
+}
+
+struct Options {
+    int clients = 500;
+    int topics = 1;
+    int rounds = 1000;
+    size_t payload = 64;
+    bool compress = false;
+    double slow = 0.0;
+    std::string path = "broadcast";
+    int burst = 1;
+    size_t chunk = 0;
+};
+
+static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// one fast client as seen by the reader thread: skips the 101 response, then walks server frames
+struct Client {
+    int fd;
+    bool handshaken = false;
+    std::string buffer;
+    int received = 0;
+};
+
+struct Reader {
+    std::vector<Client> clients;
+    std::vector<std::atomic<int64_t>> *sendTimes;
+    std::vector<int64_t> latencies;
+    std::atomic<int64_t> delivered{0};
+    std::atomic<int64_t> lastDelivery{0};
+    std::atomic<bool> stop{false};
+
+    // consumes complete frames from the front of the buffer
+    void parse(Client &client) {
+        size_t offset = 0;
+        if (!client.handshaken) {
+            size_t end = client.buffer.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                return;
+            }
+            client.handshaken = true;
+            offset = end + 4;
+        }
+
+        int64_t arrival = now();
+        int frames = 0;
+        while (client.buffer.length() - offset >= 2) {
+            const unsigned char *header = (const unsigned char *) client.buffer.data() + offset;
+            size_t available = client.buffer.length() - offset;
+            uint64_t length = header[1] & 127;
+            size_t headerLength = 2;
+            if (length == 126) {
+                if (available < 4) {
+                    break;
+                }
+                length = (header[2] << 8) | header[3];
+                headerLength = 4;
+            } else if (length == 127) {
+                if (available < 10) {
+                    break;
+                }
+                length = 0;
+                for (int i = 0; i < 8; i++) {
+                    length = (length << 8) | header[2 + i];
+                }
+                headerLength = 10;
+            }
+
+            if (available < headerLength + length) {
+                break;
+            }
+            offset += headerLength + length;
+
+            // frames arrive in send order, so the n-th frame of a client belongs to round n
+            if (client.received < (int) sendTimes->size()) {
+                latencies.push_back(arrival - (*sendTimes)[client.received].load(std::memory_order_relaxed));
+            }
+            client.received++;
+            frames++;
+        }
+
+        client.buffer.erase(0, offset);
+        if (frames) {
+            delivered += frames;
+            lastDelivery = arrival;
+        }
+    }
+
+    void run() {
+        int epfd = epoll_create1(0);
+        for (size_t i = 0; i < clients.size(); i++) {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.u64 = i;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &event);
+        }
+
+        char buffer[65536];
+        epoll_event events[256];
+        while (!stop) {
+            int count = epoll_wait(epfd, events, 256, 10);
+            for (int i = 0; i < count; i++) {
+                Client &client = clients[events[i].data.u64];
+                ssize_t length;
+                while ((length = recv(client.fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                    client.buffer.append(buffer, length);
+                }
+                parse(client);
+            }
+        }
+        close(epfd);
+    }
+};
+
+static Options parseOptions(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        if (equals == std::string::npos) {
+            fprintf(stderr, "ignoring %s, expected key=value\n", argv[i]);
+            continue;
+        }
+
+        std::string key = argument.substr(0, equals), value = argument.substr(equals + 1);
+        if (key == "clients") {
+            options.clients = std::max(1, atoi(value.c_str()));
+        } else if (key == "topics") {
+            options.topics = std::max(1, atoi(value.c_str()));
+        } else if (key == "rounds") {
+            options.rounds = std::max(1, atoi(value.c_str()));
+        } else if (key == "payload") {
+            options.payload = strtoul(value.c_str(), nullptr, 10);
+        } else if (key == "compress") {
+            options.compress = atoi(value.c_str()) != 0;
+        } else if (key == "slow") {
+            options.slow = std::min(1.0, std::max(0.0, atof(value.c_str())));
+        } else if (key == "path") {
+            options.path = value;
+        } else if (key == "burst") {
+            options.burst = std::max(1, atoi(value.c_str()));
+        } else if (key == "chunk") {
+            options.chunk = strtoul(value.c_str(), nullptr, 10);
+        } else {
+            fprintf(stderr, "ignoring unknown option %s\n", key.c_str());
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[]) {
+    Options options = parseOptions(argc, argv);
+    if (options.path != "send" && options.path != "broadcast" && options.path != "prepared" && options.path != "publish") {
+        fprintf(stderr, "unknown path %s\n", options.path.c_str());
+        return 1;
+    }
+
+    uWS::Hub hub(options.compress ? uWS::PERMESSAGE_DEFLATE : 0);
+    hub.getDefaultGroup().setSendChunkSize(options.chunk);
+    std::vector<uWS::WebSocket *> webSockets;
+    hub.onConnection([&webSockets](uWS::WebSocket *ws) {
+        webSockets.push_back(ws);
+    });
+
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    if (bind(listenFd, (sockaddr *) &address, sizeof(address)) || listen(listenFd, 512) || getsockname(listenFd, (sockaddr *) &address, &addressLength)) {
+        perror("listen");
+        return 1;
+    }
+
+    int slowClients = (int) (options.clients * options.slow);
+    std::vector<std::atomic<int64_t>> sendTimes(options.rounds);
+    Reader reader;
+    reader.sendTimes = &sendTimes;
+    reader.latencies.reserve((size_t) (options.clients - slowClients) * options.rounds);
+    std::vector<int> slowFds;
+
+    const char *extensions = options.compress ? "permessage-deflate" : "";
+    for (int i = 0; i < options.clients; i++) {
+        int clientFd = socket(AF_INET, SOCK_STREAM, 0);
+        bool slow = i < slowClients;
+        if (slow) {
+            // a consumer that stalls almost immediately and leaves everything queued on the server
+            int receiveBuffer = 4096;
+            setsockopt(clientFd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+        }
+        if (connect(clientFd, (sockaddr *) &address, sizeof(address))) {
+            perror("connect");
+            return 1;
+        }
+
+        int serverFd = accept(listenFd, nullptr, nullptr);
+        if (serverFd == -1) {
+            perror("accept");
+            return 1;
+        }
+        fcntl(serverFd, F_SETFL, fcntl(serverFd, F_GETFL) | O_NONBLOCK);
+        if (slow) {
+            // loopback send buffers would otherwise soak up megabytes before anything queues
+            int sendBuffer = 4096;
+            setsockopt(serverFd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+        }
+        hub.upgrade(serverFd, "dGhlIHNhbXBsZSBub25jZQ==", nullptr, extensions, strlen(extensions), nullptr, 0);
+
+        if (slow) {
+            slowFds.push_back(clientFd);
+        } else {
+            Client client;
+            client.fd = clientFd;
+            reader.clients.push_back(std::move(client));
+        }
+    }
+    close(listenFd);
+
+    if (options.path == "publish") {
+        for (size_t i = 0; i < webSockets.size(); i++) {
+            std::string topic = std::to_string(i % options.topics);
+            hub.getDefaultGroup().subscribe(webSockets[i], topic.data(), topic.length());
+        }
+    }
+
+    std::string payload(options.payload, 'x');
+    for (size_t i = 0; i < payload.length(); i++) {
+        payload[i] = 'a' + (i * 7) % 26;
+    }
+
+    // the frame every client gets, for turning queued bytes into queued messages
+    uWS::WebSocket::PreparedMessage *frame = hub.getDefaultGroup().prepareMessage(payload.data(), payload.length(), uWS::OpCode::BINARY, options.compress);
+    size_t frameLength = frame->length;
+    uWS::WebSocket::finalizeMessage(frame);
+
+    std::thread readerThread([&reader]() {
+        reader.run();
+    });
+
+    // let the 101 responses drain before measuring
+    for (int i = 0; i < 100; i++) {
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+
+    size_t heapBefore = heapInUse();
+    uint64_t syscallsBefore = sendSyscalls;
+    int64_t start = now();
+
+    for (int round = 0; round < options.rounds; ) {
+        for (int burst = 0; burst < options.burst && round < options.rounds; burst++, round++) {
+            sendTimes[round].store(now(), std::memory_order_relaxed);
+            if (options.path == "send") {
+                hub.getDefaultGroup().forEach([&payload, &options](uWS::WebSocket *ws) {
+                    ws->send(payload.data(), payload.length(), uWS::OpCode::BINARY, nullptr, nullptr, options.compress);
+                });
+            } else if (options.path == "broadcast") {
+                hub.getDefaultGroup().broadcast(payload.data(), payload.length(), uWS::OpCode::BINARY, options.compress);
+            } else if (options.path == "prepared") {
+                uWS::WebSocket::PreparedMessage *preparedMessage = hub.getDefaultGroup().prepareMessage(payload.data(), payload.length(), uWS::OpCode::BINARY, options.compress);
+                hub.getDefaultGroup().broadcast(preparedMessage);
+                uWS::WebSocket::finalizeMessage(preparedMessage);
+            } else {
+                for (int topic = 0; topic < options.topics; topic++) {
+                    std::string name = std::to_string(topic);
+                    hub.getDefaultGroup().publish(name.data(), name.length(), payload.data(), payload.length(), uWS::OpCode::BINARY, options.compress);
+                }
+            }
+        }
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+
+    // wait for the fast clients, the slow ones keep their backlog on the server
+    int64_t expected = (int64_t) reader.clients.size() * options.rounds;
+    int64_t deadline = now() + 30 * 1000000000LL;
+    while (reader.delivered < expected && now() < deadline) {
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+    int64_t end = reader.lastDelivery ? (int64_t) reader.lastDelivery : now();
+    uint64_t syscalls = sendSyscalls - syscallsBefore;
+
+    size_t queuedBytes = 0;
+    for (int i = 0; i < slowClients; i++) {
+        queuedBytes += webSockets[i]->getBufferedAmount();
+    }
+    size_t heapGrowth = heapInUse() - heapBefore;
+
+    reader.stop = true;
+    readerThread.join();
+
+    std::vector<int64_t> &latencies = reader.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, (size_t) (latencies.size() * p))] / 1000.0;
+    };
+
+    double seconds = (end - start) / 1e9;
+    int64_t delivered = reader.delivered;
+    int64_t attempted = (int64_t) options.clients * options.rounds;
+    printf("path=%s clients=%d topics=%d rounds=%d payload=%zu compress=%d slow=%.2f burst=%d chunk=%zu\n",
+           options.path.c_str(), options.clients, options.topics, options.rounds, options.payload, options.compress, options.slow, options.burst, options.chunk);
+    printf("delivered %lld of %lld to fast clients in %.3f s: %.0f msg/s\n",
+           (long long) delivered, (long long) expected, seconds, seconds > 0 ? delivered / seconds : 0.0);
+    printf("latency p50 %.1f us, p99 %.1f us\n", percentile(0.50), percentile(0.99));
+    printf("send syscalls %llu, %.3f per message\n", (unsigned long long) syscalls, (double) syscalls / attempted);
+    if (slowClients && queuedBytes) {
+        double queuedMessages = (double) queuedBytes / frameLength;
+        printf("queued on slow clients: %zu bytes, ~%.0f messages, %.1f heap bytes per queued message\n",
+               queuedBytes, queuedMessages, heapGrowth / queuedMessages);
+    } else {
+        printf("queued on slow clients: none\n");
+    }
+
+    for (int fd : slowFds) {
+        close(fd);
+    }
+    for (Client &client : reader.clients) {
+        close(client.fd);
+    }
+    hub.getDefaultGroup().close();
+    for (int i = 0; i < 100; i++) {
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+    return delivered == expected ? 0 : 2;
+}
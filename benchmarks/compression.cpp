@@ -0,0 +1,379 @@
+/*
+ * permessage-deflate benchmark
+ *
+ * Runs Hub::deflate and Hub::inflate, the calls WebSocket makes for every compressed
+ * message, over generated corpora without sockets or a loop, and sweeps the compression
+ * settings of a group. For each combination it reports deflate and inflate MB/s of
+ * uncompressed payload, the compression ratio, the zlib memory each socket carries and
+ * the p99 of a single call.
+ *
+ * Build from the repository root (libuv, zlib and OpenSSL headers required):
+ *
+ *   g++ -std=c++17 -O2 -DUSE_LIBUV -I uWebSockets/src benchmarks/compression.cpp uWebSockets/src/*.cpp \
+ *       -luv -lssl -lcrypto -lz -lpthread -o compression
+ *
+ * Add -DUWS_LIBDEFLATE and -ldeflate to measure the libdeflate backend of the shared and
+ * thread windows instead, which has levels only and ignores memLevel and strategy.
+ *
+ * Usage: ./compression [key=value ...]
+ *
+ *   corpus=all           chat, ticks, snapshot or all
+ *   windows=all          shared (the hub's compressor, no context kept between messages),
+ *                        sliding (a compressor and inflater per socket, SLIDING_DEFLATE_WINDOW),
+ *                        thread (Hub::deflateOnThread, what threadpool deflation runs) or all
+ *   levels=1,6,9         zlib levels, 0 to 9
+ *   windowBits=15        of the sliding windows, 9 to 15. The others always use 15
+ *   memLevels=8          1 to 9
+ *   strategies=0         0 default, 1 filtered, 2 huffman only, 3 rle, 4 fixed
+ *   sockets=64           sliding windows, message i goes to socket i % sockets
+ *   megabytes=16         uncompressed payload per combination
+ *
+ * Lists are comma separated. Corpora:
+ *
+ *   chat      JSON chat messages of 60 to 300 bytes, rooms, users and words repeat
+ *   ticks     JSON quotes of about 70 bytes for 40 symbols
+ *   snapshot  JSON order books of about 180 KB, each a little moved from the one before
+ *
+ * Every message is inflated right after it is deflated and compared with what went in.
+ * Per socket memory is what zlib allocated for the socket's compressor and inflater, counted
+ * through zalloc, and 0 for the windows shared by the hub.
+ *
+ */
+
+#include "Hub.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// reaches the protected compression calls of Hub
+struct BenchHub : uWS::Hub {
+    BenchHub() : uWS::Hub(uWS::PERMESSAGE_DEFLATE) {}
+
+    using uWS::Hub::allocateDefaultCompressor;
+    using uWS::Hub::deflate;
+    using uWS::Hub::deflateOnThread;
+    using uWS::Hub::inflate;
+};
+
+struct Options {
+    std::vector<std::string> corpora = {"chat", "ticks", "snapshot"};
+    std::vector<std::string> windows = {"shared", "sliding", "thread"};
+    std::vector<int> levels = {1, 6, 9};
+    std::vector<int> windowBits = {15};
+    std::vector<int> memLevels = {8};
+    std::vector<int> strategies = {0};
+    int sockets = 64;
+    size_t megabytes = 16;
+};
+
+struct Corpus {
+    std::string name;
+    std::vector<std::string> messages;
+};
+
+static Corpus generateChat(std::mt19937 &random) {
+    static const char *words[] = {"the", "deploy", "is", "green", "again", "anyone", "seen", "latency", "on", "eu-west",
+                                  "lunch", "?", "merged", "thanks", "looks", "good", "to", "me", "rollback", "please",
+                                  "ok", "graph", "spikes", "after", "restart", "ping", "me", "when", "done", ":)"};
+    Corpus corpus = {"chat", {}};
+    char buffer[512];
+    uint64_t timestamp = 1700000000000;
+    for (int i = 0; i < 4096; i++) {
+        std::string text;
+        size_t count = 2 + random() % 40;
+        for (size_t j = 0; j < count; j++) {
+            text += (j ? " " : "") + std::string(words[random() % (sizeof(words) / sizeof(words[0]))]);
+        }
+        timestamp += random() % 5000;
+        snprintf(buffer, sizeof(buffer), "{\"type\":\"message\",\"room\":\"room-%u\",\"user\":\"user%05u\",\"ts\":%llu,\"text\":\"%s\"}",
+                 (unsigned int) (random() % 16), (unsigned int) (random() % 500), (unsigned long long) timestamp, text.substr(0, 200).c_str());
+        corpus.messages.push_back(buffer);
+    }
+    return corpus;
+}
+
+static Corpus generateTicks(std::mt19937 &random) {
+    Corpus corpus = {"ticks", {}};
+    std::vector<std::string> symbols;
+    std::vector<double> prices;
+    for (int i = 0; i < 40; i++) {
+        symbols.push_back(std::string(1, 'A' + i % 26) + std::string(1, 'A' + (i * 7) % 26) + std::string(1, 'A' + (i * 13) % 26));
+        prices.push_back(10 + random() % 500);
+    }
+
+    char buffer[256];
+    uint64_t timestamp = 1700000000000;
+    for (int i = 0; i < 16384; i++) {
+        size_t symbol = random() % symbols.size();
+        prices[symbol] = std::max(1.0, prices[symbol] + ((int) (random() % 21) - 10) / 100.0);
+        timestamp += random() % 20;
+        snprintf(buffer, sizeof(buffer), "{\"s\":\"%s\",\"b\":%.2f,\"a\":%.2f,\"bs\":%u,\"as\":%u,\"t\":%llu}",
+                 symbols[symbol].c_str(), prices[symbol], prices[symbol] + 0.01 * (1 + random() % 3),
+                 (unsigned int) (100 * (1 + random() % 50)), (unsigned int) (100 * (1 + random() % 50)), (unsigned long long) timestamp);
+        corpus.messages.push_back(buffer);
+    }
+    return corpus;
+}
+
+static Corpus generateSnapshots(std::mt19937 &random) {
+    Corpus corpus = {"snapshot", {}};
+    const int LEVELS = 4000;
+    std::vector<unsigned int> bidSizes(LEVELS), askSizes(LEVELS);
+    for (int i = 0; i < LEVELS; i++) {
+        bidSizes[i] = random() % 100000;
+        askSizes[i] = random() % 100000;
+    }
+
+    char buffer[64];
+    for (int seq = 0; seq < 16; seq++) {
+        // a fortieth of the levels change between snapshots
+        for (int i = 0; i < LEVELS / 40; i++) {
+            bidSizes[random() % LEVELS] = random() % 100000;
+            askSizes[random() % LEVELS] = random() % 100000;
+        }
+
+        std::string snapshot = "{\"symbol\":\"BTC-USD\",\"seq\":" + std::to_string(1000000 + seq) + ",\"bids\":[";
+        for (int i = 0; i < LEVELS; i++) {
+            snprintf(buffer, sizeof(buffer), "%s[\"%.2f\",\"%u.%04u\"]", i ? "," : "", 42000.0 - i * 0.5, bidSizes[i] / 10000, bidSizes[i] % 10000);
+            snapshot += buffer;
+        }
+        snapshot += "],\"asks\":[";
+        for (int i = 0; i < LEVELS; i++) {
+            snprintf(buffer, sizeof(buffer), "%s[\"%.2f\",\"%u.%04u\"]", i ? "," : "", 42000.5 + i * 0.5, askSizes[i] / 10000, askSizes[i] % 10000);
+            snapshot += buffer;
+        }
+        corpus.messages.push_back(snapshot + "]}");
+    }
+    return corpus;
+}
+
+// counts what zlib allocates for the sliding windows, which is all they ever take
+static voidpf countingAlloc(voidpf opaque, uInt items, uInt size) {
+    *(size_t *) opaque += (size_t) items * size;
+    return calloc(items, size);
+}
+
+static void countingFree(voidpf, voidpf address) {
+    free(address);
+}
+
+static double percentile(std::vector<int64_t> &samples, double p) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, (size_t) (samples.size() * p))] / 1000.0;
+}
+
+struct Result {
+    size_t messages = 0, inputBytes = 0, outputBytes = 0, socketBytes = 0;
+    int64_t deflateNanoseconds = 0, inflateNanoseconds = 0;
+    std::vector<int64_t> deflateTimes, inflateTimes;
+    bool failed = false;
+};
+
+static Result run(BenchHub &hub, const Corpus &corpus, const std::string &window, const uWS::CompressionSettings &settings,
+                  int windowBits, int sockets, size_t megabytes) {
+    Result result;
+    bool sliding = window == "sliding", thread = window == "thread";
+
+    std::vector<z_stream> compressors, inflaters;
+    if (sliding) {
+        compressors.resize(sockets);
+        inflaters.resize(sockets);
+        for (int i = 0; i < sockets; i++) {
+            compressors[i] = {};
+            compressors[i].zalloc = countingAlloc;
+            compressors[i].zfree = countingFree;
+            compressors[i].opaque = &result.socketBytes;
+            BenchHub::allocateDefaultCompressor(&compressors[i], windowBits, settings);
+
+            inflaters[i] = {};
+            inflaters[i].zalloc = countingAlloc;
+            inflaters[i].zfree = countingFree;
+            inflaters[i].opaque = &result.socketBytes;
+            inflateInit2(&inflaters[i], -windowBits);
+        }
+    }
+
+    std::string input, deflated, threadOutput;
+    size_t wanted = megabytes * 1024 * 1024;
+    for (size_t i = 0; result.inputBytes < wanted && !result.failed; i++) {
+        const std::string &message = corpus.messages[i % corpus.messages.size()];
+        z_stream *compressor = sliding ? &compressors[i % sockets] : nullptr;
+        z_stream *inflater = sliding ? &inflaters[i % sockets] : nullptr;
+
+        // deflate may write to what it is given, so each call gets a copy, made outside the clock
+        input = message;
+        size_t length = input.length();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (thread) {
+            threadOutput.clear();
+            length = BenchHub::deflateOnThread(input.data(), length, settings, threadOutput);
+            deflated.assign(threadOutput.data(), length);
+        } else {
+            char *output = hub.deflate(&input[0], length, compressor, settings);
+            deflated.assign(output, length);
+        }
+        std::chrono::steady_clock::time_point deflatedAt = std::chrono::steady_clock::now();
+
+        length = deflated.length();
+        char *inflated = hub.inflate(&deflated[0], length, 16 * 1024 * 1024, inflater);
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+        if (!inflated || length != message.length() || memcmp(inflated, message.data(), length)) {
+            fprintf(stderr, "%s %s: message %zu did not inflate to what was deflated\n", corpus.name.c_str(), window.c_str(), i);
+            result.failed = true;
+        }
+
+        int64_t deflateTime = std::chrono::duration_cast<std::chrono::nanoseconds>(deflatedAt - start).count();
+        int64_t inflateTime = std::chrono::duration_cast<std::chrono::nanoseconds>(end - deflatedAt).count();
+        result.deflateTimes.push_back(deflateTime);
+        result.inflateTimes.push_back(inflateTime);
+        result.deflateNanoseconds += deflateTime;
+        result.inflateNanoseconds += inflateTime;
+        result.messages++;
+        result.inputBytes += message.length();
+        result.outputBytes += deflated.length();
+    }
+
+    for (int i = 0; sliding && i < sockets; i++) {
+        deflateEnd(&compressors[i]);
+        inflateEnd(&inflaters[i]);
+    }
+    if (sliding) {
+        result.socketBytes /= sockets;
+    }
+    return result;
+}
+
+static std::vector<int> parseList(const std::string &value, int min, int max) {
+    std::vector<int> list;
+    for (size_t start = 0; start <= value.length(); ) {
+        size_t comma = value.find(',', start);
+        if (comma == std::string::npos) {
+            comma = value.length();
+        }
+        if (comma > start) {
+            list.push_back(std::min(max, std::max(min, atoi(value.substr(start, comma - start).c_str()))));
+        }
+        start = comma + 1;
+    }
+    return list;
+}
+
+static std::vector<std::string> parseNames(const std::string &value, const std::vector<std::string> &all) {
+    if (value == "all") {
+        return all;
+    }
+    std::vector<std::string> names;
+    for (size_t start = 0; start <= value.length(); ) {
+        size_t comma = value.find(',', start);
+        if (comma == std::string::npos) {
+            comma = value.length();
+        }
+        std::string name = value.substr(start, comma - start);
+        if (std::find(all.begin(), all.end(), name) != all.end()) {
+            names.push_back(name);
+        } else if (name.length()) {
+            fprintf(stderr, "ignoring unknown %s\n", name.c_str());
+        }
+        start = comma + 1;
+    }
+    return names;
+}
+
+static Options parseOptions(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        if (equals == std::string::npos) {
+            fprintf(stderr, "ignoring %s, expected key=value\n", argv[i]);
+            continue;
+        }
+
+        std::string key = argument.substr(0, equals), value = argument.substr(equals + 1);
+        if (key == "corpus") {
+            options.corpora = parseNames(value, {"chat", "ticks", "snapshot"});
+        } else if (key == "windows") {
+            options.windows = parseNames(value, {"shared", "sliding", "thread"});
+        } else if (key == "levels") {
+            options.levels = parseList(value, 0, 9);
+        } else if (key == "windowBits") {
+            options.windowBits = parseList(value, 9, 15);
+        } else if (key == "memLevels") {
+            options.memLevels = parseList(value, 1, 9);
+        } else if (key == "strategies") {
+            options.strategies = parseList(value, 0, 4);
+        } else if (key == "sockets") {
+            options.sockets = std::max(1, atoi(value.c_str()));
+        } else if (key == "megabytes") {
+            options.megabytes = std::max<size_t>(1, strtoul(value.c_str(), nullptr, 10));
+        } else {
+            fprintf(stderr, "ignoring unknown option %s\n", key.c_str());
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[]) {
+    Options options = parseOptions(argc, argv);
+    BenchHub hub;
+
+    std::mt19937 random(1234);
+    std::vector<Corpus> corpora;
+    for (const std::string &name : options.corpora) {
+        corpora.push_back(name == "chat" ? generateChat(random) : name == "ticks" ? generateTicks(random) : generateSnapshots(random));
+    }
+
+#ifdef UWS_LIBDEFLATE
+    printf("shared and thread windows deflate with libdeflate, sliding ones with zlib\n");
+#else
+    printf("all windows deflate with zlib\n");
+#endif
+    printf("%-9s %-8s %5s %4s %4s %5s %10s %10s %7s %11s %11s %11s\n", "corpus", "window", "level", "wb", "mem", "strat",
+           "deflate", "inflate", "ratio", "socket", "deflate p99", "inflate p99");
+
+    bool failed = false;
+    for (Corpus &corpus : corpora) {
+        size_t corpusBytes = 0;
+        for (std::string &message : corpus.messages) {
+            corpusBytes += message.length();
+        }
+        printf("# %s: %zu messages, %.0f bytes on average\n", corpus.name.c_str(), corpus.messages.size(), (double) corpusBytes / corpus.messages.size());
+
+        for (const std::string &window : options.windows) {
+            // only sliding windows have other window bits
+            std::vector<int> windowBits = window == "sliding" ? options.windowBits : std::vector<int>{15};
+            for (int level : options.levels) {
+                for (int bits : windowBits) {
+                    for (int memLevel : options.memLevels) {
+                        for (int strategy : options.strategies) {
+                            uWS::CompressionSettings settings;
+                            settings.level = level;
+                            settings.memLevel = memLevel;
+                            settings.strategy = strategy;
+
+                            Result result = run(hub, corpus, window, settings, bits, options.sockets, options.megabytes);
+                            failed |= result.failed;
+                            double megabytes = result.inputBytes / 1048576.0;
+                            printf("%-9s %-8s %5d %4d %4d %5d %5.0f MB/s %5.0f MB/s %6.2fx %8.1f KB %8.1f us %8.1f us\n",
+                                   corpus.name.c_str(), window.c_str(), level, bits, memLevel, strategy,
+                                   megabytes / (result.deflateNanoseconds / 1e9), megabytes / (result.inflateNanoseconds / 1e9),
+                                   (double) result.inputBytes / result.outputBytes, result.socketBytes / 1024.0,
+                                   percentile(result.deflateTimes, 0.99), percentile(result.inflateTimes, 0.99));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Raw Hub server of the end-to-end benchmark
+ *
+ * What benchmarks/echo.js starts for server=hub: a plain Hub on port answering its load
+ * profiles the way its dist/uws.js and ws servers do, so the three are measured by the same
+ * clients and the same numbers. Not meant to be run on its own.
+ *
+ * Build from the repository root (libuv, zlib and OpenSSL headers required):
+ *
+ *   g++ -std=c++17 -O2 -DUSE_LIBUV -I uWebSockets/src benchmarks/echo.cpp uWebSockets/src/*.cpp \
+ *       -luv -lssl -lcrypto -lz -lpthread -o echo
+ *
+ * Usage: ./echo port scenario burst compression
+ *
+ *   scenario   echo (every message is sent back), push (the first message of more than
+ *              a byte is kept and each later one answered with burst copies of it) or
+ *              flood (every burst-th message of a client is answered with a 1 byte ack)
+ *   compression  1 for permessage-deflate, every send then asks to be compressed
+ *
+ * Prints ready once listening and runs until killed.
+ *
+ */
+
+#include "Hub.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        fprintf(stderr, "usage: %s port scenario burst compression\n", argv[0]);
+        return 1;
+    }
+
+    int port = atoi(argv[1]);
+    std::string scenario = argv[2];
+    uintptr_t burst = std::max(1, atoi(argv[3]));
+    bool compression = atoi(argv[4]) != 0;
+    if (scenario != "echo" && scenario != "push" && scenario != "flood") {
+        fprintf(stderr, "unknown scenario %s\n", scenario.c_str());
+        return 1;
+    }
+
+    uWS::Hub hub(compression ? uWS::PERMESSAGE_DEFLATE : 0);
+    std::string pushPayload;
+    hub.onMessage([&scenario, burst, compression, &pushPayload](uWS::WebSocket *ws, char *message, size_t length, uWS::OpCode opCode) {
+        if (scenario == "echo") {
+            ws->send(message, length, opCode, nullptr, nullptr, compression);
+        } else if (scenario == "push") {
+            if (length > 1) {
+                pushPayload.assign(message, length);
+                return;
+            }
+            for (uintptr_t i = 0; i < burst; i++) {
+                ws->send(pushPayload.data(), pushPayload.length(), uWS::OpCode::BINARY, nullptr, nullptr, compression);
+            }
+        } else {
+            // messages of this client so far, in its user data
+            uintptr_t received = (uintptr_t) ws->getUserData() + 1;
+            ws->setUserData((void *) received);
+            if (received % burst == 0) {
+                ws->send("a", 1, uWS::OpCode::BINARY);
+            }
+        }
+    });
+
+    if (!hub.listen(port)) {
+        fprintf(stderr, "could not listen on port %d\n", port);
+        return 1;
+    }
+    printf("ready\n");
+    fflush(stdout);
+    uv_run(hub.getLoop(), UV_RUN_DEFAULT);
+    return 0;
+}
@@ -0,0 +1,502 @@
+/*
+ * End-to-end echo and throughput benchmark
+ *
+ * Runs the same load profiles against dist/uws.js, the ws package and the raw Hub of
+ * echo.cpp, each a server process of its own, and reports what each costs: messages per
+ * second, the server's CPU and resident set size, and latency percentiles as the clients
+ * see them. The baseline for what the README promises over ws.
+ *
+ * From the repository root, with the addon built, `npm install --no-save ws` for the
+ * baseline and echo.cpp built to ./echo for the raw Hub (see there):
+ *
+ *   node benchmarks/echo.js [key=value ...]
+ *
+ *   server=uws        uws, ws or hub
+ *   scenario=echo     echo (every client keeps one message in flight and the server sends it
+ *                     back, latency is the round trip), push (a 1 byte request answered with
+ *                     burst messages, latency is request to the last of them) or flood
+ *                     (clients send as fast as the socket takes it and the server acks every
+ *                     burst-th, latency is that message written to its ack)
+ *   clients=100       connections, spread over the client processes
+ *   messages=1000     per client: echoes, or messages pushed or flooded (a multiple of burst)
+ *   payload=64        message size in bytes, JSON-like text that deflates about 3:1
+ *   compression=0     permessage-deflate without context takeover, every send compressed
+ *   burst=16          messages per push request and per flood ack
+ *   workers=1         client processes, raise it when the client CPU nears 100%
+ *   port=3031         where the server listens
+ *   hub=./echo        the echo.cpp binary for server=hub
+ *   suite=0           1 runs every scenario with 16 B, 1 KB, 64 KB and 1 MB payloads, with
+ *                     compression off and on, against every one of servers=uws,ws,hub.
+ *                     messages is lowered so no run moves more than about 512 MB
+ *
+ * A message per second is one echoed, pushed or flooded message. CPU is that of the server
+ * process over the measured part, 100% being one core, peak RSS its high water mark since it
+ * started. Both come from /proc, so Linux only. Every run starts a new server.
+ *
+ */
+
+'use strict';
+
+const childProcess = require('child_process');
+const fs = require('fs');
+const net = require('net');
+const path = require('path');
+const zlib = require('zlib');
+const { performance } = require('perf_hooks');
+
+const SEC_KEY = 'dGhlIHNhbXBsZSBub25jZQ==';
+const RUN_TIMEOUT = 60000;
+
+function parseOptions(args) {
+    const options = {
+        server: 'uws', scenario: 'echo', clients: 100, messages: 1000, payload: 64, compression: 0, burst: 16,
+        workers: 1, port: 3031, hub: './echo', suite: 0, servers: 'uws,ws,hub', role: 'driver'
+    };
+    for (const argument of args) {
+        const equals = argument.indexOf('=');
+        if (equals === -1) {
+            console.error(`ignoring ${argument}, expected key=value`);
+            continue;
+        }
+        const key = argument.slice(0, equals), value = argument.slice(equals + 1);
+        if (!(key in options)) {
+            console.error(`ignoring unknown option ${key}`);
+        } else {
+            options[key] = typeof options[key] === 'number' ? Math.max(0, parseInt(value, 10) || 0) : value;
+        }
+    }
+    options.clients = Math.max(1, options.clients);
+    options.burst = Math.max(1, options.burst);
+    options.workers = Math.max(1, Math.min(options.workers, options.clients));
+    return options;
+}
+
+// words of a market data feed, picked by an LCG so every run and server gets the same bytes
+function makePayload(length) {
+    const words = ['{"symbol":"', 'BTC-USD', 'ETH-USD', '","price":', '.', ',"size":', ',"side":"', 'buy', 'sell', '"}', ',"ts":'];
+    let seed = 1, text = '';
+    while (text.length < length) {
+        seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+        text += words[seed % words.length] + (seed >> 8) % 10000;
+    }
+    return Buffer.from(text.slice(0, length));
+}
+
+// a final binary frame, masked with an all zero mask which leaves the payload as it is
+function buildFrame(payload, compressed) {
+    if (compressed) {
+        const deflated = zlib.deflateRawSync(payload, { flush: zlib.constants.Z_SYNC_FLUSH });
+        // permessage-deflate leaves out the 00 00 ff ff a sync flush ends in
+        payload = deflated.slice(0, deflated.length - 4);
+    }
+    const length = payload.length;
+    const headerLength = length < 126 ? 2 : length < 65536 ? 4 : 10;
+    const frame = Buffer.alloc(headerLength + 4 + length);
+    frame[0] = compressed ? 0xc2 : 0x82;
+    if (length < 126) {
+        frame[1] = 0x80 | length;
+    } else if (length < 65536) {
+        frame[1] = 0x80 | 126;
+        frame.writeUInt16BE(length, 2);
+    } else {
+        frame[1] = 0x80 | 127;
+        frame.writeUInt32BE(Math.floor(length / 4294967296), 2);
+        frame.writeUInt32BE(length >>> 0, 6);
+    }
+    payload.copy(frame, headerLength + 4);
+    return frame;
+}
+
+// the server side, for uws and ws. echo.cpp does the same for the raw Hub
+function serve(options) {
+    const compress = !!options.compression;
+    const sendOptions = { binary: true, compress: compress };
+    let pushPayload = null;
+
+    const onConnection = (webSocket) => {
+        let received = 0;
+        webSocket.on('message', (message) => {
+            if (options.scenario === 'echo') {
+                webSocket.send(message, sendOptions);
+            } else if (options.scenario === 'push') {
+                if (message.byteLength > 1) {
+                    // uws hands out an ArrayBuffer only valid during the call
+                    pushPayload = Buffer.from(message instanceof ArrayBuffer ? new Uint8Array(message) : message);
+                    return;
+                }
+                for (let i = 0; i < options.burst; i++) {
+                    webSocket.send(pushPayload, sendOptions);
+                }
+            } else if (++received % options.burst === 0) {
+                webSocket.send(Buffer.from('a'), { binary: true });
+            }
+        });
+    };
+
+    if (options.server === 'uws') {
+        const uws = require('../dist/uws.js');
+        const server = new uws.Server({ perMessageDeflate: compress ? {} : false });
+        if (!server.listen(options.port, onConnection)) {
+            throw new Error(`could not listen on port ${options.port}`);
+        }
+        process.stdout.write('ready\n');
+    } else {
+        const WebSocket = require('ws');
+        const server = new WebSocket.Server({ port: options.port, perMessageDeflate: compress ? { threshold: 0 } : false }, () => {
+            process.stdout.write('ready\n');
+        });
+        server.on('connection', onConnection);
+    }
+}
+
+// the client side of one process: its share of the connections, each a frame parser skipping payloads
+function runClients(options, count, done) {
+    const payload = makePayload(options.payload);
+    const frames = {};
+    const messages = options.scenario === 'echo' ? options.messages : Math.ceil(options.messages / options.burst) * options.burst;
+    // samples per client: every echo, every push request or every flood ack
+    const samples = options.scenario === 'echo' ? messages : messages / options.burst;
+    const latencies = new Float64Array(count * samples);
+    let latencyCount = 0, delivered = 0, finished = 0, open = 0;
+    const clients = [];
+    let cpuBefore, deadline;
+
+    const report = () => {
+        clearTimeout(deadline);
+        done({
+            delivered: delivered,
+            latencies: Array.from(latencies.subarray(0, latencyCount)),
+            cpu: cpuBefore ? process.cpuUsage(cpuBefore) : { user: 0, system: 0 }
+        });
+        for (const client of clients) {
+            client.socket.destroy();
+        }
+    };
+
+    const frameFor = (client, request) => {
+        const key = (request ? 'r' : 'p') + (client.compressed ? 'c' : '');
+        if (!frames[key]) {
+            frames[key] = buildFrame(request ? Buffer.from('p') : payload, client.compressed);
+        }
+        return frames[key];
+    };
+
+    const finish = (client) => {
+        if (!client.finished) {
+            client.finished = true;
+            if (++finished === count) {
+                report();
+            }
+        }
+    };
+
+    const flood = (client) => {
+        const frame = frameFor(client, false);
+        while (client.sent < messages) {
+            const writable = client.socket.write(frame);
+            if (++client.sent % options.burst === 0) {
+                client.ackTimes.push(performance.now());
+            }
+            if (!writable) {
+                client.socket.once('drain', () => flood(client));
+                return;
+            }
+        }
+    };
+
+    const start = (client) => {
+        if (options.scenario === 'echo') {
+            client.sentAt = performance.now();
+            client.socket.write(frameFor(client, false));
+        } else if (options.scenario === 'push') {
+            client.sentAt = performance.now();
+            client.socket.write(frameFor(client, true));
+        } else {
+            flood(client);
+        }
+    };
+
+    const onMessage = (client) => {
+        const now = performance.now();
+        if (options.scenario === 'echo') {
+            latencies[latencyCount++] = now - client.sentAt;
+            delivered++;
+            if (++client.received < messages) {
+                start(client);
+            } else {
+                finish(client);
+            }
+        } else if (options.scenario === 'push') {
+            delivered++;
+            if (++client.received % options.burst === 0) {
+                latencies[latencyCount++] = now - client.sentAt;
+                if (client.received < messages) {
+                    start(client);
+                } else {
+                    finish(client);
+                }
+            }
+        } else {
+            latencies[latencyCount++] = now - client.ackTimes.shift();
+            delivered += options.burst;
+            if (++client.received * options.burst >= messages) {
+                finish(client);
+            }
+        }
+    };
+
+    // walks server frames, only their headers are looked at
+    const onData = (client, data) => {
+        if (!client.handshaken) {
+            client.head = client.head ? Buffer.concat([client.head, data]) : data;
+            const end = client.head.indexOf('\r\n\r\n');
+            if (end === -1) {
+                return;
+            }
+            const response = client.head.toString('latin1', 0, end);
+            if (!response.startsWith('HTTP/1.1 101')) {
+                console.error(`upgrade refused: ${response.split('\r\n')[0]}`);
+                process.exit(1);
+            }
+            client.compressed = /permessage-deflate/i.test(response);
+            client.handshaken = true;
+            data = client.head.slice(end + 4);
+            client.head = null;
+            if (++open === count) {
+                process.send({ type: 'open' });
+            }
+        }
+
+        let offset = 0;
+        while (offset < data.length) {
+            if (client.remaining) {
+                const skipped = Math.min(client.remaining, data.length - offset);
+                offset += skipped;
+                if (!(client.remaining -= skipped) && client.fin) {
+                    onMessage(client);
+                }
+                continue;
+            }
+
+            if (client.partial) {
+                data = Buffer.concat([client.partial, data.slice(offset)]);
+                client.partial = null;
+                offset = 0;
+            }
+            const available = data.length - offset;
+            let length = available >= 2 ? data[offset + 1] & 127 : 0;
+            const headerLength = length === 126 ? 4 : length === 127 ? 10 : 2;
+            if (available < headerLength) {
+                client.partial = Buffer.from(data.slice(offset));
+                return;
+            }
+            if (length === 126) {
+                length = data.readUInt16BE(offset + 2);
+            } else if (length === 127) {
+                length = data.readUInt32BE(offset + 2) * 4294967296 + data.readUInt32BE(offset + 6);
+            }
+            // control frames, like pings, are not messages
+            client.fin = (data[offset] & 0x80) && (data[offset] & 0x0f) < 8;
+            offset += headerLength;
+            client.remaining = length;
+            if (!length && client.fin) {
+                onMessage(client);
+            }
+        }
+    };
+
+    const upgrade = 'GET / HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n' +
+        `Sec-WebSocket-Key: ${SEC_KEY}\r\nSec-WebSocket-Version: 13\r\n` +
+        (options.compression ? 'Sec-WebSocket-Extensions: permessage-deflate; client_no_context_takeover; server_no_context_takeover\r\n' : '') + '\r\n';
+    for (let i = 0; i < count; i++) {
+        const client = {
+            socket: net.connect(options.port, '127.0.0.1'), handshaken: false, compressed: false, head: null, partial: null,
+            remaining: 0, fin: false, sent: 0, received: 0, sentAt: 0, ackTimes: [], finished: false
+        };
+        client.socket.setNoDelay(true);
+        client.socket.on('connect', () => client.socket.write(upgrade));
+        client.socket.on('data', (data) => onData(client, data));
+        client.socket.on('error', (error) => {
+            console.error(`client: ${error.message}`);
+            finish(client);
+        });
+        clients.push(client);
+    }
+
+    process.on('message', (message) => {
+        if (message.type === 'start') {
+            cpuBefore = process.cpuUsage();
+            deadline = setTimeout(report, RUN_TIMEOUT);
+            if (options.scenario === 'push') {
+                // the payload to push, once
+                for (const client of clients) {
+                    client.socket.write(frameFor(client, false));
+                }
+            }
+            clients.forEach(start);
+        }
+    });
+}
+
+const clockTicks = (() => {
+    try {
+        return parseInt(childProcess.execSync('getconf CLK_TCK').toString(), 10) || 100;
+    } catch (e) {
+        return 100;
+    }
+})();
+
+// user plus system time in ms and the peak and current RSS in MB of a process, null off Linux
+function processStats(pid) {
+    try {
+        const stat = fs.readFileSync(`/proc/${pid}/stat`, 'latin1');
+        const fields = stat.slice(stat.lastIndexOf(')') + 2).split(' ');
+        const status = fs.readFileSync(`/proc/${pid}/status`, 'latin1');
+        const kilobytes = (name) => parseInt((status.match(new RegExp(`${name}:\\s+(\\d+)`)) || [0, 0])[1], 10);
+        return {
+            cpu: (parseInt(fields[11], 10) + parseInt(fields[12], 10)) * 1000 / clockTicks,
+            peakRss: kilobytes('VmHWM') / 1024,
+            rss: kilobytes('VmRSS') / 1024
+        };
+    } catch (e) {
+        return null;
+    }
+}
+
+function startServer(options) {
+    return new Promise((resolve, reject) => {
+        const args = [String(options.port), options.scenario, String(options.burst), String(options.compression)];
+        const server = options.server === 'hub' ? childProcess.spawn(path.resolve(options.hub), args) :
+            childProcess.spawn(process.execPath, [__filename, 'role=server', `server=${options.server}`, `port=${options.port}`,
+                `scenario=${options.scenario}`, `burst=${options.burst}`, `compression=${options.compression}`]);
+        let output = '';
+        server.stderr.on('data', (data) => process.stderr.write(data));
+        server.stdout.on('data', (data) => {
+            output += data;
+            if (output.indexOf('ready\n') !== -1) {
+                resolve(server);
+            }
+        });
+        server.on('error', reject);
+        server.on('exit', (code) => reject(new Error(`${options.server} server exited with ${code} before listening`)));
+    });
+}
+
+function percentile(sorted, p) {
+    return sorted.length ? sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))] * 1000 : 0;
+}
+
+async function run(options) {
+    const server = await startServer(options);
+    const workers = [];
+    const results = [];
+    let startedAt = 0, serverBefore = null;
+
+    await new Promise((resolve, reject) => {
+        let opened = 0;
+        for (let i = 0; i < options.workers; i++) {
+            const count = Math.floor(options.clients / options.workers) + (i < options.clients % options.workers ? 1 : 0);
+            const worker = childProcess.fork(__filename, ['role=client']);
+            worker.on('message', (message) => {
+                if (message.type === 'open' && ++opened === options.workers) {
+                    serverBefore = processStats(server.pid);
+                    startedAt = performance.now();
+                    workers.forEach((worker) => worker.send({ type: 'start' }));
+                } else if (message.type === 'result') {
+                    message.result.endedAt = performance.now();
+                    if (results.push(message.result) === options.workers) {
+                        resolve();
+                    }
+                }
+            });
+            worker.on('exit', (code) => {
+                if (results.length < options.workers) {
+                    server.kill();
+                    reject(new Error(`client process exited with ${code}`));
+                }
+            });
+            worker.send({ type: 'run', options: options, count: count });
+            workers.push(worker);
+        }
+    });
+
+    const serverAfter = processStats(server.pid);
+    const exited = new Promise((resolve) => server.on('exit', resolve));
+    server.kill();
+    workers.forEach((worker) => worker.kill());
+    await exited;
+
+    const seconds = (Math.max(...results.map((result) => result.endedAt)) - startedAt) / 1000;
+    const delivered = results.reduce((sum, result) => sum + result.delivered, 0);
+    const latencies = [].concat(...results.map((result) => result.latencies)).sort((a, b) => a - b);
+    const clientCpu = Math.max(...results.map((result) => (result.cpu.user + result.cpu.system) / 1000));
+    return {
+        messagesPerSecond: delivered / seconds,
+        megabytesPerSecond: delivered * options.payload / seconds / 1e6,
+        serverCpu: serverBefore && serverAfter ? (serverAfter.cpu - serverBefore.cpu) / seconds / 10 : NaN,
+        clientCpu: clientCpu / seconds / 10,
+        peakRss: serverAfter ? serverAfter.peakRss : NaN,
+        latencies: [0.5, 0.9, 0.99, 0.999].map((p) => percentile(latencies, p)),
+        complete: delivered === options.clients * (options.scenario === 'echo' ? options.messages : Math.ceil(options.messages / options.burst) * options.burst)
+    };
+}
+
+function printHeader() {
+    console.log('server  scenario  payload  deflate      msg/s     MB/s  cpu %  client %  peak RSS MB  p50 us  p90 us  p99 us  p99.9 us');
+}
+
+function printResult(options, result) {
+    const column = (value, width, digits) => (Number.isNaN(value) ? 'n/a' : value.toFixed(digits || 0)).padStart(width);
+    console.log(options.server.padEnd(6) + '  ' + options.scenario.padEnd(8) + column(options.payload, 9) + column(options.compression, 9) +
+        column(result.messagesPerSecond, 11) + column(result.megabytesPerSecond, 9, 1) + column(result.serverCpu, 7) + column(result.clientCpu, 10) +
+        column(result.peakRss, 13, 1) + result.latencies.map((latency, i) => column(latency, i === 3 ? 10 : 8)).join('') +
+        (result.complete ? '' : '  incomplete'));
+}
+
+async function main() {
+    const options = parseOptions(process.argv.slice(2));
+    if (options.role === 'server') {
+        serve(options);
+        return;
+    }
+    if (options.role === 'client') {
+        process.once('message', (message) => {
+            runClients(message.options, message.count, (result) => process.send({ type: 'result', result: result }));
+        });
+        return;
+    }
+
+    const runs = [];
+    if (options.suite) {
+        for (const server of options.servers.split(',')) {
+            for (const scenario of ['echo', 'push', 'flood']) {
+                for (const payload of [16, 1024, 65536, 1048576]) {
+                    for (const compression of [0, 1]) {
+                        const messages = Math.max(options.burst, Math.min(options.messages, Math.floor(512e6 / (options.clients * payload))));
+                        runs.push(Object.assign({}, options, { server, scenario, payload, compression, messages }));
+                    }
+                }
+            }
+        }
+    } else {
+        runs.push(options);
+    }
+
+    for (const spec of runs) {
+        if (['uws', 'ws', 'hub'].indexOf(spec.server) === -1 || ['echo', 'push', 'flood'].indexOf(spec.scenario) === -1) {
+            console.error(`unknown server ${spec.server} or scenario ${spec.scenario}`);
+            process.exit(1);
+        }
+    }
+
+    printHeader();
+    for (const options of runs) {
+        try {
+            printResult(options, await run(options));
+        } catch (e) {
+            console.error(`${options.server} ${options.scenario} payload=${options.payload} compression=${options.compression}: ${e.message}`);
+        }
+    }
+}
+
+main();
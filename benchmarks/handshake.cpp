@@ -0,0 +1,493 @@
+/*
+ * Connection storm and handshake rate benchmark
+ *
+ * Opens N loopback connections with at most C handshakes in flight and measures how fast
+ * the server turns them into WebSockets: upgrades per second, p50/p99 handshake latency
+ * as the client sees it (connect to 101), loop thread CPU and heap per upgrade. The parts
+ * of an upgrade that need no socket, the accept key (SHA-1 and base64) and extension
+ * negotiation, are timed on their own first.
+ *
+ * Build from the repository root (libuv, zlib and OpenSSL headers required):
+ *
+ *   g++ -std=c++17 -O2 -DUSE_LIBUV -I uWebSockets/src benchmarks/handshake.cpp uWebSockets/src/*.cpp \
+ *       -luv -lssl -lcrypto -lz -lpthread -o handshake
+ *
+ * Usage: ./handshake [key=value ...]
+ *
+ *   connections=1000  connections opened, all stay open until the end (two fds each,
+ *                     the soft fd limit is raised to the hard one)
+ *   concurrency=64    handshakes in flight at once, the storm
+ *   flow=ticket       ticket (the benchmark accepts, does TLS and hands the fd to
+ *                     Hub::upgrade, the way the Node addon does with a ticket) or native
+ *                     (Hub::listen accepts and parses the upgrade request itself)
+ *   deflate=0         the client offers permessage-deflate and the hub accepts it
+ *   tls=0             full TLS handshakes (no resumption) with a throwaway P-256 certificate
+ *   port=3230         port for flow=native
+ *
+ * Latency includes waiting in the accept queue, which is what a reconnect storm costs
+ * the last client in line. For flow=ticket the Hub::upgrade call is also timed alone.
+ * The loop thread polls without blocking, so its CPU per upgrade is an upper bound.
+ *
+ */
+
+#include "Hub.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// operator new calls made on the loop thread, the allocations of an upgrade
+static thread_local bool countAllocations = false;
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+    if (countAllocations) {
+        allocations++;
+    }
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+struct Options {
+    int connections = 1000;
+    int concurrency = 64;
+    std::string flow = "ticket";
+    bool deflate = false;
+    bool tls = false;
+    int port = 3230;
+};
+
+static const char SEC_KEY[] = "dGhlIHNhbXBsZSBub25jZQ==";
+static const char DEFLATE_OFFER[] = "permessage-deflate; client_max_window_bits";
+
+static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t threadCpuTime() {
+    rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000LL + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+static size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    // the main arena, which is the loop thread's, the client thread allocates from its own
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static double percentile(std::vector<int64_t> &samples, double p) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, (size_t) (samples.size() * p))] / 1000.0;
+}
+
+// the per upgrade work that needs no socket, the same calls WebSocket::upgrade and Hub::answerUpgrade make
+static void benchmarkComponents(bool deflate) {
+    const int iterations = 200000;
+    char accept[32];
+    unsigned int checksum = 0;
+
+    int64_t start = now();
+    for (int i = 0; i < iterations; i++) {
+        unsigned char shaInput[] = "XXXXXXXXXXXXXXXXXXXXXXXX258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        memcpy(shaInput, SEC_KEY, 24);
+        shaInput[i % 24] ^= 1;
+        unsigned char shaDigest[SHA_DIGEST_LENGTH];
+        SHA1(shaInput, sizeof(shaInput) - 1, shaDigest);
+        EVP_EncodeBlock((unsigned char *) accept, shaDigest, SHA_DIGEST_LENGTH);
+        checksum += accept[i % 28];
+    }
+    double keyNs = (double) (now() - start) / iterations;
+
+    std::string offer = deflate ? DEFLATE_OFFER : "";
+    start = now();
+    for (int i = 0; i < iterations; i++) {
+        uWS::ExtensionsNegotiator extensionsNegotiator(deflate ? uWS::PERMESSAGE_DEFLATE : 0);
+        extensionsNegotiator.readOffer(offer);
+        checksum += extensionsNegotiator.generateOffer().length();
+    }
+    double negotiationNs = (double) (now() - start) / iterations;
+
+    printf("accept key (SHA-1 + base64) %.0f ns, extension negotiation %.0f ns (checksum %u)\n", keyNs, negotiationNs, checksum & 1);
+}
+
+// a throwaway self-signed P-256 certificate for the server side
+static SSL_CTX *createServerContext() {
+    EVP_PKEY *key = nullptr;
+    EVP_PKEY_CTX *keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    if (!keyContext || EVP_PKEY_keygen_init(keyContext) <= 0 || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(keyContext, &key) <= 0) {
+        EVP_PKEY_CTX_free(keyContext);
+        return nullptr;
+    }
+    EVP_PKEY_CTX_free(keyContext);
+
+    X509 *certificate = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+    X509_set_pubkey(certificate, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(certificate), "CN", MBSTRING_ASC, (const unsigned char *) "localhost", -1, -1, 0);
+    X509_set_issuer_name(certificate, X509_get_subject_name(certificate));
+    X509_sign(certificate, key, EVP_sha256());
+
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(context, certificate);
+    SSL_CTX_use_PrivateKey(context, key);
+    // every connection of the storm is a first one
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(context, SSL_OP_NO_TICKET);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return context;
+}
+
+// one client connection, walked from connect to the 101 by the client thread
+struct Connection {
+    enum Stage {
+        CONNECTING,
+        HANDSHAKING,
+        READING,
+        DONE,
+        FAILED
+    };
+
+    int fd = -1;
+    SSL *ssl = nullptr;
+    Stage stage = CONNECTING;
+    int64_t start = 0;
+    std::string response;
+};
+
+struct Storm {
+    Options options;
+    sockaddr_in address = {};
+    SSL_CTX *clientContext = nullptr;
+    std::string request;
+    std::vector<Connection> connections;
+    std::vector<int64_t> latencies;
+    std::atomic<int> finished{0};
+    std::atomic<int> failed{0};
+    std::atomic<int64_t> lastUpgrade{0};
+    int epfd = -1;
+
+    void watch(Connection &connection, uint32_t events, int op = EPOLL_CTL_MOD) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.ptr = &connection;
+        epoll_ctl(epfd, op, connection.fd, &event);
+    }
+
+    void open(Connection &connection) {
+        connection.start = now();
+        connection.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int enabled = 1;
+        setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+        if (connect(connection.fd, (sockaddr *) &address, sizeof(address)) && errno != EINPROGRESS) {
+            fail(connection);
+            return;
+        }
+        watch(connection, EPOLLOUT, EPOLL_CTL_ADD);
+    }
+
+    void fail(Connection &connection) {
+        connection.stage = Connection::FAILED;
+        failed++;
+        finished++;
+    }
+
+    // the native flow sends the request, in the ticket flow the harness read it already
+    void sendRequest(Connection &connection) {
+        if (options.flow == "native") {
+            int sent = connection.ssl ? SSL_write(connection.ssl, request.data(), (int) request.length())
+                                      : (int) send(connection.fd, request.data(), request.length(), MSG_NOSIGNAL);
+            if (sent != (int) request.length()) {
+                fail(connection);
+                return;
+            }
+        }
+        connection.stage = Connection::READING;
+        watch(connection, EPOLLIN);
+    }
+
+    void handshake(Connection &connection) {
+        int result = SSL_connect(connection.ssl);
+        if (result == 1) {
+            sendRequest(connection);
+            return;
+        }
+        int error = SSL_get_error(connection.ssl, result);
+        if (error == SSL_ERROR_WANT_READ) {
+            watch(connection, EPOLLIN);
+        } else if (error == SSL_ERROR_WANT_WRITE) {
+            watch(connection, EPOLLOUT);
+        } else {
+            fail(connection);
+        }
+    }
+
+    void progress(Connection &connection) {
+        if (connection.stage == Connection::CONNECTING) {
+            int error = 0;
+            socklen_t errorLength = sizeof(error);
+            getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+            if (error) {
+                fail(connection);
+            } else if (options.tls) {
+                connection.ssl = SSL_new(clientContext);
+                SSL_set_fd(connection.ssl, connection.fd);
+                connection.stage = Connection::HANDSHAKING;
+                handshake(connection);
+            } else {
+                sendRequest(connection);
+            }
+        } else if (connection.stage == Connection::HANDSHAKING) {
+            handshake(connection);
+        } else if (connection.stage == Connection::READING) {
+            char buffer[1024];
+            int length;
+            while ((length = connection.ssl ? SSL_read(connection.ssl, buffer, sizeof(buffer))
+                                            : (int) recv(connection.fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                connection.response.append(buffer, length);
+            }
+            if (connection.response.find("\r\n\r\n") != std::string::npos) {
+                int64_t end = now();
+                if (connection.response.compare(0, 12, "HTTP/1.1 101")) {
+                    fail(connection);
+                    return;
+                }
+                latencies.push_back(end - connection.start);
+                lastUpgrade = end;
+                connection.stage = Connection::DONE;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, connection.fd, nullptr);
+                finished++;
+            } else if (length == 0 || (!connection.ssl && errno != EAGAIN)) {
+                fail(connection);
+            }
+        }
+    }
+
+    // keeps concurrency handshakes in flight until every connection got its answer
+    void run(int64_t deadline) {
+        epfd = epoll_create1(0);
+        int opened = 0;
+        epoll_event events[256];
+        while (finished < options.connections && now() < deadline) {
+            while (opened < options.connections && opened - finished < options.concurrency) {
+                open(connections[opened++]);
+            }
+            int count = epoll_wait(epfd, events, 256, 10);
+            for (int i = 0; i < count; i++) {
+                progress(*static_cast<Connection *>(events[i].data.ptr));
+            }
+        }
+        close(epfd);
+    }
+};
+
+static Options parseOptions(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        if (equals == std::string::npos) {
+            fprintf(stderr, "ignoring %s, expected key=value\n", argv[i]);
+            continue;
+        }
+
+        std::string key = argument.substr(0, equals), value = argument.substr(equals + 1);
+        if (key == "connections") {
+            options.connections = std::max(1, atoi(value.c_str()));
+        } else if (key == "concurrency") {
+            options.concurrency = std::max(1, atoi(value.c_str()));
+        } else if (key == "flow") {
+            options.flow = value;
+        } else if (key == "deflate") {
+            options.deflate = atoi(value.c_str()) != 0;
+        } else if (key == "tls") {
+            options.tls = atoi(value.c_str()) != 0;
+        } else if (key == "port") {
+            options.port = atoi(value.c_str());
+        } else {
+            fprintf(stderr, "ignoring unknown option %s\n", key.c_str());
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[]) {
+    Storm storm;
+    Options &options = storm.options = parseOptions(argc, argv);
+    if (options.flow != "ticket" && options.flow != "native") {
+        fprintf(stderr, "unknown flow %s\n", options.flow.c_str());
+        return 1;
+    }
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    benchmarkComponents(options.deflate);
+
+    SSL_CTX *serverContext = nullptr;
+    if (options.tls) {
+        serverContext = createServerContext();
+        storm.clientContext = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_session_cache_mode(storm.clientContext, SSL_SESS_CACHE_OFF);
+        if (!serverContext || !storm.clientContext) {
+            fprintf(stderr, "could not set up TLS\n");
+            return 1;
+        }
+    }
+
+    uWS::Hub hub(options.deflate ? uWS::PERMESSAGE_DEFLATE : 0);
+    int connected = 0;
+    hub.onConnection([&connected](uWS::WebSocket *ws) {
+        connected++;
+    });
+
+    storm.address.sin_family = AF_INET;
+    storm.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listenFd = -1;
+    if (options.flow == "ticket") {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        socklen_t addressLength = sizeof(storm.address);
+        if (bind(listenFd, (sockaddr *) &storm.address, sizeof(storm.address)) || listen(listenFd, 4096) ||
+            getsockname(listenFd, (sockaddr *) &storm.address, &addressLength)) {
+            perror("listen");
+            return 1;
+        }
+    } else {
+        if (!hub.listen(options.port, "127.0.0.1", serverContext, 4096)) {
+            fprintf(stderr, "could not listen on port %d\n", options.port);
+            return 1;
+        }
+        storm.address.sin_port = htons(options.port);
+    }
+
+    storm.request = std::string("GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n") +
+                    "Sec-WebSocket-Key: " + SEC_KEY + "\r\nSec-WebSocket-Version: 13\r\n" +
+                    (options.deflate ? std::string("Sec-WebSocket-Extensions: ") + DEFLATE_OFFER + "\r\n" : "") + "\r\n";
+    storm.connections.resize(options.connections);
+    storm.latencies.reserve(options.connections);
+
+    size_t heapBefore = heapInUse();
+    int64_t cpuBefore = threadCpuTime();
+    int64_t start = now();
+    int64_t deadline = start + 60 * 1000000000LL;
+    std::thread clientThread([&storm, deadline]() {
+        storm.run(deadline);
+    });
+
+    const char *extensions = options.deflate ? DEFLATE_OFFER : "";
+    std::vector<int64_t> upgradeTimes;
+    upgradeTimes.reserve(options.connections);
+    countAllocations = true;
+    while (storm.finished < options.connections && now() < deadline) {
+        if (listenFd != -1) {
+            int fd;
+            while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK)) != -1) {
+                SSL *ssl = nullptr;
+                if (serverContext) {
+                    // the TLS handshake Node does before the upgrade request reaches the addon
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+                    ssl = SSL_new(serverContext);
+                    SSL_set_fd(ssl, fd);
+                    if (SSL_accept(ssl) != 1) {
+                        SSL_free(ssl);
+                        close(fd);
+                        continue;
+                    }
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                }
+                int64_t upgradeStart = now();
+                hub.upgrade(fd, SEC_KEY, ssl, extensions, strlen(extensions), nullptr, 0);
+                upgradeTimes.push_back(now() - upgradeStart);
+            }
+        }
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+    countAllocations = false;
+    int64_t cpu = threadCpuTime() - cpuBefore;
+    size_t heapGrowth = heapInUse() - heapBefore;
+    uint64_t upgradeAllocations = allocations;
+    clientThread.join();
+
+    int upgraded = options.connections - storm.failed;
+    double seconds = ((storm.lastUpgrade ? (int64_t) storm.lastUpgrade : now()) - start) / 1e9;
+    printf("flow=%s connections=%d concurrency=%d deflate=%d tls=%d\n",
+           options.flow.c_str(), options.connections, options.concurrency, options.deflate, options.tls);
+    printf("upgraded %d of %d (%d WebSockets) in %.3f s: %.0f upgrades/s\n",
+           upgraded, options.connections, connected, seconds, seconds > 0 ? upgraded / seconds : 0.0);
+    printf("handshake latency p50 %.1f us, p99 %.1f us\n", percentile(storm.latencies, 0.50), percentile(storm.latencies, 0.99));
+    if (upgradeTimes.size()) {
+        printf("Hub::upgrade call p50 %.1f us, p99 %.1f us\n", percentile(upgradeTimes, 0.50), percentile(upgradeTimes, 0.99));
+    }
+    if (connected) {
+        printf("loop thread %.1f us CPU, %.1f allocations and %.0f heap bytes per upgrade\n",
+               cpu / 1000.0 / connected, (double) upgradeAllocations / connected, (double) heapGrowth / connected);
+    }
+
+    for (Connection &connection : storm.connections) {
+        if (connection.ssl) {
+            SSL_free(connection.ssl);
+        }
+        if (connection.fd != -1) {
+            close(connection.fd);
+        }
+    }
+    if (listenFd != -1) {
+        close(listenFd);
+    } else {
+        hub.stopListening();
+    }
+    hub.getDefaultGroup().close();
+    for (int i = 0; i < 100; i++) {
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+    if (storm.clientContext) {
+        SSL_CTX_free(storm.clientContext);
+    }
+    if (serverContext) {
+        SSL_CTX_free(serverContext);
+    }
+    return upgraded == options.connections ? 0 : 2;
+}
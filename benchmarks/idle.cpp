@@ -0,0 +1,345 @@
+/*
+ * Idle connection memory benchmark
+ *
+ * Opens N WebSockets that then sit idle and reports what each one costs the process:
+ * resident set size, heap and what the Group accounts for itself (Group::getMemoryStats),
+ * per connection. Run it once per compression mode, with and without TLS, to see what a
+ * socket layout or zlib change does to the number of connections an instance holds.
+ *
+ * Build from the repository root (libuv, zlib and OpenSSL headers required):
+ *
+ *   g++ -std=c++17 -O2 -DUSE_LIBUV -I uWebSockets/src benchmarks/idle.cpp uWebSockets/src/*.cpp \
+ *       -luv -lssl -lcrypto -lz -lpthread -o idle
+ *
+ * Usage: ./idle [key=value ...]
+ *
+ *   connections=10000  idle WebSockets, two fds each (socketpairs handed to Hub::upgrade).
+ *                      The soft fd limit is raised to the hard one, a million connections
+ *                      need ulimit -n and fs.nr_open above two million
+ *   compression=none   none, shared (permessage-deflate with the shared compressor) or
+ *                      sliding (SLIDING_DEFLATE_WINDOW, a deflate window per socket)
+ *   inflate=0          the group lets clients keep their context (Group::setInflateWindow),
+ *                      an inflate window per socket
+ *   window=15          window bits of sliding and inflate windows
+ *   tls=0              TLS on every connection, with a throwaway P-256 certificate
+ *   warm=1             one compressed message each way once the socket is up, so the windows
+ *                      allocated on first use exist as they would on a socket that ever talked
+ *   batch=1000         connections opened between two loop iterations
+ *
+ * The client ends keep nothing but their fd, a TLS client is freed after its handshake and
+ * first message, so what grows is the server side. Kernel socket buffers are not part of
+ * the RSS, see /proc/net/sockstat for those.
+ *
+ */
+
+#include "Hub.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct Options {
+    int connections = 10000;
+    std::string compression = "none";
+    bool inflate = false;
+    int window = 15;
+    bool tls = false;
+    bool warm = true;
+    int batch = 1000;
+};
+
+static const char SEC_KEY[] = "dGhlIHNhbXBsZSBub25jZQ==";
+static const char DEFLATE_OFFER[] = "permessage-deflate; client_max_window_bits";
+
+static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t residentSetSize() {
+    size_t pages = 0, resident = 0;
+    if (FILE *statm = fopen("/proc/self/statm", "r")) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// a throwaway self-signed P-256 certificate for the server side
+static SSL_CTX *createServerContext() {
+    EVP_PKEY *key = nullptr;
+    EVP_PKEY_CTX *keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    if (!keyContext || EVP_PKEY_keygen_init(keyContext) <= 0 || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(keyContext, &key) <= 0) {
+        EVP_PKEY_CTX_free(keyContext);
+        return nullptr;
+    }
+    EVP_PKEY_CTX_free(keyContext);
+
+    X509 *certificate = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+    X509_set_pubkey(certificate, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(certificate), "CN", MBSTRING_ASC, (const unsigned char *) "localhost", -1, -1, 0);
+    X509_set_issuer_name(certificate, X509_get_subject_name(certificate));
+    X509_sign(certificate, key, EVP_sha256());
+
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(context, certificate);
+    SSL_CTX_use_PrivateKey(context, key);
+    // session caches and tickets would be memory of the context, not of the connections
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(context, SSL_OP_NO_TICKET);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return context;
+}
+
+// both ends are ours and nonblocking, so the handshake is driven from one thread
+static bool handshake(SSL *client, SSL *server) {
+    bool clientDone = false, serverDone = false;
+    for (int i = 0; i < 1000 && !(clientDone && serverDone); i++) {
+        if (!clientDone) {
+            int result = SSL_connect(client);
+            if (result == 1) {
+                clientDone = true;
+            } else if (SSL_get_error(client, result) != SSL_ERROR_WANT_READ) {
+                return false;
+            }
+        }
+        if (!serverDone) {
+            int result = SSL_accept(server);
+            if (result == 1) {
+                serverDone = true;
+            } else if (SSL_get_error(server, result) != SSL_ERROR_WANT_READ) {
+                return false;
+            }
+        }
+    }
+    return clientDone && serverDone;
+}
+
+// a masked, compressed text frame as a client keeping its context sends it
+static std::string compressedClientFrame(int windowBits) {
+    const char message[] = "still here, still here, still here";
+    unsigned char compressed[256];
+    z_stream deflater = {};
+    deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY);
+    deflater.next_in = (Bytef *) message;
+    deflater.avail_in = sizeof(message) - 1;
+    deflater.next_out = compressed;
+    deflater.avail_out = sizeof(compressed);
+    deflate(&deflater, Z_SYNC_FLUSH);
+    // without the 00 00 ff ff every sync flush ends with
+    size_t length = sizeof(compressed) - deflater.avail_out - 4;
+    deflateEnd(&deflater);
+
+    std::string frame;
+    frame += (char) 0xc1;
+    frame += (char) (0x80 | length);
+    const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    frame.append((const char *) mask, 4);
+    for (size_t i = 0; i < length; i++) {
+        frame += (char) (compressed[i] ^ mask[i % 4]);
+    }
+    return frame;
+}
+
+static Options parseOptions(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        if (equals == std::string::npos) {
+            fprintf(stderr, "ignoring %s, expected key=value\n", argv[i]);
+            continue;
+        }
+
+        std::string key = argument.substr(0, equals), value = argument.substr(equals + 1);
+        if (key == "connections") {
+            options.connections = std::max(1, atoi(value.c_str()));
+        } else if (key == "compression") {
+            options.compression = value;
+        } else if (key == "inflate") {
+            options.inflate = atoi(value.c_str()) != 0;
+        } else if (key == "window") {
+            options.window = std::max(9, std::min(15, atoi(value.c_str())));
+        } else if (key == "tls") {
+            options.tls = atoi(value.c_str()) != 0;
+        } else if (key == "warm") {
+            options.warm = atoi(value.c_str()) != 0;
+        } else if (key == "batch") {
+            options.batch = std::max(1, atoi(value.c_str()));
+        } else {
+            fprintf(stderr, "ignoring unknown option %s\n", key.c_str());
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[]) {
+    Options options = parseOptions(argc, argv);
+    if (options.compression != "none" && options.compression != "shared" && options.compression != "sliding") {
+        fprintf(stderr, "unknown compression %s\n", options.compression.c_str());
+        return 1;
+    }
+    bool compressed = options.compression != "none";
+    if (options.inflate && !compressed) {
+        fprintf(stderr, "inflate=1 needs compression=shared or sliding\n");
+        return 1;
+    }
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if ((rlim_t) options.connections * 2 + 64 > limit.rlim_cur) {
+        fprintf(stderr, "%d connections need %d fds, the limit is %llu\n", options.connections, options.connections * 2 + 64, (unsigned long long) limit.rlim_cur);
+        return 1;
+    }
+
+    SSL_CTX *serverContext = nullptr, *clientContext = nullptr;
+    if (options.tls) {
+        serverContext = createServerContext();
+        clientContext = SSL_CTX_new(TLS_client_method());
+        if (!serverContext || !clientContext) {
+            fprintf(stderr, "could not set up TLS\n");
+            return 1;
+        }
+    }
+
+    int extensionOptions = 0;
+    if (compressed) {
+        extensionOptions = uWS::PERMESSAGE_DEFLATE | (options.compression == "sliding" ? uWS::SLIDING_DEFLATE_WINDOW : 0);
+    }
+    uWS::Hub hub(extensionOptions);
+    uWS::Group &group = hub.getDefaultGroup();
+    group.setDeflateWindow(options.window, 8);
+    if (options.inflate) {
+        group.setInflateWindow(options.window, (size_t) -1);
+    }
+
+    int connected = 0, received = 0;
+    const std::string greeting = "you are connection number ";
+    hub.onConnection([&connected, &options, &greeting](uWS::WebSocket *ws) {
+        connected++;
+        if (options.warm) {
+            std::string message = greeting + std::to_string(connected);
+            ws->send(message.data(), message.length(), uWS::OpCode::TEXT, nullptr, nullptr, true);
+        }
+    });
+    hub.onMessage([&received](uWS::WebSocket *ws, char *message, size_t length, uWS::OpCode opCode) {
+        received++;
+    });
+
+    // the baseline is the hub with its loop run once, the shared zlib state included
+    const char *extensions = compressed ? DEFLATE_OFFER : "";
+    std::string clientFrame = compressedClientFrame(options.window);
+    for (int i = 0; i < 100; i++) {
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+    malloc_trim(0);
+    size_t rssBefore = residentSetSize(), heapBefore = heapInUse();
+
+    std::vector<int> clientFds;
+    clientFds.reserve(options.connections);
+    int64_t start = now();
+    for (int opened = 0; opened < options.connections; ) {
+        for (int i = 0; i < options.batch && opened < options.connections; i++, opened++) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+                perror("socketpair");
+                return 1;
+            }
+            fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+            SSL *client = nullptr, *server = nullptr;
+            if (options.tls) {
+                client = SSL_new(clientContext);
+                server = SSL_new(serverContext);
+                SSL_set_fd(client, fds[0]);
+                SSL_set_fd(server, fds[1]);
+                if (!handshake(client, server)) {
+                    fprintf(stderr, "TLS handshake failed\n");
+                    return 1;
+                }
+            }
+            hub.upgrade(fds[1], SEC_KEY, server, extensions, strlen(extensions), nullptr, 0);
+
+            if (options.warm && options.inflate) {
+                int sent = client ? SSL_write(client, clientFrame.data(), (int) clientFrame.length())
+                                  : (int) send(fds[0], clientFrame.data(), clientFrame.length(), MSG_NOSIGNAL);
+                if (sent != (int) clientFrame.length()) {
+                    fprintf(stderr, "could not send the compressed frame\n");
+                    return 1;
+                }
+            }
+            if (client) {
+                SSL_free(client);
+            }
+            clientFds.push_back(fds[0]);
+        }
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+
+    // every queued 101 and greeting out, every client frame inflated
+    int expected = options.warm && options.inflate ? options.connections : 0;
+    int64_t deadline = now() + 60 * 1000000000LL;
+    do {
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    } while ((connected < options.connections || received < expected) && now() < deadline);
+    double seconds = (now() - start) / 1e9;
+
+    size_t rss = residentSetSize() - rssBefore, heap = heapInUse() - heapBefore;
+    uWS::MemoryStats memory = group.getMemoryStats();
+    size_t accounted = memory.queuedMessages + memory.fragmentBuffers + memory.deflateWindows + memory.pooledBlocks;
+
+    printf("connections=%d compression=%s inflate=%d window=%d tls=%d warm=%d\n",
+           options.connections, options.compression.c_str(), options.inflate, options.window, options.tls, options.warm);
+    printf("opened %d WebSockets in %.3f s, %d compressed frames received\n", connected, seconds, received);
+    if (connected) {
+        printf("per connection: RSS %.0f bytes, heap %.0f bytes, accounted %.0f bytes (deflate windows %.0f, queued %.0f)\n",
+               (double) rss / connected, (double) heap / connected, (double) accounted / connected,
+               (double) memory.deflateWindows / connected, (double) memory.queuedMessages / connected);
+        printf("RSS %.1f MiB for all of them, %.0f connections per GiB\n", rss / 1048576.0, rss ? connected * 1073741824.0 / rss : 0.0);
+    }
+
+    for (int fd : clientFds) {
+        close(fd);
+    }
+    group.close();
+    for (int i = 0; i < 100; i++) {
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+    if (clientContext) {
+        SSL_CTX_free(clientContext);
+    }
+    if (serverContext) {
+        SSL_CTX_free(serverContext);
+    }
+    return connected == options.connections && received == expected ? 0 : 2;
+}
@@ -0,0 +1,237 @@
+/*
+ * WebSocketProtocol::consume microbenchmark
+ *
+ * Feeds synthetic masked client frame streams straight into the parser through a dummy
+ * Impl, without sockets or a loop, and reports GB/s and ns per frame for each stream.
+ * Text payloads mix ASCII with multibyte UTF-8 so validation is part of the cost.
+ *
+ * Build from the repository root (libuv and OpenSSL headers required, nothing to link
+ * but the header only parser):
+ *
+ *   g++ -std=c++17 -O2 -DUSE_LIBUV -I uWebSockets/src benchmarks/parser.cpp -o parser
+ *
+ * Usage: ./parser [megabytes per stream, default 256]
+ *
+ * Streams:
+ *
+ *   tiny binary      16 byte binary frames
+ *   tiny text        16 byte text frames
+ *   medium text      1000 byte text frames (16 bit length)
+ *   long binary      256 KB binary frames (64 bit length)
+ *   fragmented text  4 fragments of 256 bytes per message
+ *   with pings       fragmented text with a ping between every fragment
+ *   split medium     medium text fed in random 1 to 2000 byte reads, through the spill path
+ *   split long       long binary fed in random reads of up to 64 KB
+ *
+ * Reads are copied into a padded receive buffer before consume, like the kernel does. That
+ * copy is timed on its own and left out of the reported numbers.
+ *
+ */
+
+#include "WebSocketProtocol.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+// stands in for WebSocket: validates text the way handleFragment does and counts what arrives
+struct BenchSocket : uWS::WebSocketState {
+    static const bool IS_SERVER = true;
+
+    size_t frames = 0, bytes = 0, messages = 0;
+    bool failed = false;
+    unsigned char utf8Tail[3], utf8TailLength = 0;
+
+    static bool refusePayloadLength(uint64_t length, uWS::WebSocketState *) {
+        return length > 16777216;
+    }
+
+    static bool setCompressed(uWS::WebSocketState *) {
+        return false;
+    }
+
+    static void forceClose(uWS::WebSocketState *webSocketState) {
+        static_cast<BenchSocket *>(webSocketState)->failed = true;
+    }
+
+    static bool handleFragment(char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin, uWS::WebSocketState *webSocketState) {
+        BenchSocket *socket = static_cast<BenchSocket *>(webSocketState);
+        bool textValidated = webSocketState->state.textValidated;
+        webSocketState->state.textValidated = false;
+
+        if (opCode == uWS::TEXT && !textValidated &&
+                !uWS::WebSocketProtocol<BenchSocket>::isValidUtf8Piece(socket->utf8Tail, socket->utf8TailLength, (unsigned char *) data, length, !remainingBytes && fin)) {
+            forceClose(webSocketState);
+            return true;
+        }
+
+        socket->bytes += length;
+        if (!remainingBytes) {
+            socket->frames++;
+            if (fin) {
+                socket->messages++;
+            }
+        }
+        return false;
+    }
+};
+
+struct Stream {
+    const char *name;
+    std::string data;
+    size_t frames = 0;
+    // read sizes to feed it in, empty means whole receive buffers
+    std::vector<size_t> reads;
+};
+
+static const size_t RECEIVE_BUFFER_SIZE = 300 * 1024;
+
+static std::mt19937 randomGenerator(1234);
+
+static void appendFrame(std::string &stream, uWS::OpCode opCode, bool fin, const std::string &payload) {
+    unsigned char header[14];
+    size_t headerLength = 2;
+    header[0] = (fin ? 128 : 0) | opCode;
+    if (payload.length() < 126) {
+        header[1] = 128 | (unsigned char) payload.length();
+    } else if (payload.length() < 65536) {
+        header[1] = 128 | 126;
+        header[2] = (unsigned char) (payload.length() >> 8);
+        header[3] = (unsigned char) payload.length();
+        headerLength = 4;
+    } else {
+        header[1] = 128 | 127;
+        for (int i = 0; i < 8; i++) {
+            header[2 + i] = (unsigned char) ((uint64_t) payload.length() >> (56 - 8 * i));
+        }
+        headerLength = 10;
+    }
+
+    unsigned char mask[4];
+    for (unsigned char &byte : mask) {
+        byte = (unsigned char) randomGenerator();
+    }
+    memcpy(header + headerLength, mask, 4);
+    stream.append((char *) header, headerLength + 4);
+
+    size_t offset = stream.length();
+    stream.append(payload);
+    for (size_t i = 0; i < payload.length(); i++) {
+        stream[offset + i] ^= mask[i & 3];
+    }
+}
+
+// roughly one multibyte character per eight ASCII ones
+static std::string textPayload(size_t length) {
+    static const char *characters[] = {"\xe4\xbd\xa0", "\xe5\xa5\xbd", "\xc3\xa9", "\xf0\x9f\x98\x80"};
+    std::string payload;
+    while (payload.length() < length) {
+        if (randomGenerator() % 9 == 0) {
+            const char *character = characters[randomGenerator() % 4];
+            if (payload.length() + strlen(character) > length) {
+                break;
+            }
+            payload += character;
+        } else {
+            payload += (char) ('a' + randomGenerator() % 26);
+        }
+    }
+    payload.resize(length, ' ');
+    return payload;
+}
+
+static std::string binaryPayload(size_t length) {
+    std::string payload(length, 0);
+    for (char &byte : payload) {
+        byte = (char) randomGenerator();
+    }
+    return payload;
+}
+
+static Stream wholeFrames(const char *name, uWS::OpCode opCode, size_t payloadLength, size_t streamLength) {
+    Stream stream = {name};
+    std::string payload = opCode == uWS::TEXT ? textPayload(payloadLength) : binaryPayload(payloadLength);
+    while (stream.data.length() < streamLength) {
+        appendFrame(stream.data, opCode, true, payload);
+        stream.frames++;
+    }
+    return stream;
+}
+
+static Stream fragmentedText(const char *name, bool pings, size_t streamLength) {
+    Stream stream = {name};
+    std::string payload = textPayload(4 * 256);
+    while (stream.data.length() < streamLength) {
+        for (int i = 0; i < 4; i++) {
+            appendFrame(stream.data, i ? uWS::NONE : uWS::TEXT, i == 3, payload.substr(i * 256, 256));
+            stream.frames++;
+            if (pings && i < 3) {
+                appendFrame(stream.data, uWS::PING, true, "ping");
+                stream.frames++;
+            }
+        }
+    }
+    return stream;
+}
+
+static void splitReads(Stream &stream, size_t maxRead) {
+    for (size_t offset = 0; offset < stream.data.length(); ) {
+        size_t read = std::min<size_t>(1 + randomGenerator() % maxRead, stream.data.length() - offset);
+        stream.reads.push_back(read);
+        offset += read;
+    }
+}
+
+// copies every read into the receive buffer, and parses it unless copyOnly
+static double feed(const Stream &stream, char *receiveBuffer, BenchSocket &socket, bool copyOnly) {
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    const char *data = stream.data.data();
+    size_t offset = 0, read = 0;
+    while (offset < stream.data.length()) {
+        size_t length = stream.reads.empty() ? std::min(RECEIVE_BUFFER_SIZE, stream.data.length() - offset) : stream.reads[read++];
+        memcpy(receiveBuffer, data + offset, length);
+        if (!copyOnly) {
+            uWS::WebSocketProtocol<BenchSocket>::consume(receiveBuffer, (unsigned int) length, &socket);
+        }
+        offset += length;
+    }
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    size_t streamLength = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 256) << 20;
+    // the parser writes before and after what it is given, like the real receive buffer allows
+    std::vector<char> memory(uWS::WebSocketProtocol<BenchSocket>::CONSUME_PRE_PADDING + RECEIVE_BUFFER_SIZE + uWS::WebSocketProtocol<BenchSocket>::CONSUME_POST_PADDING);
+    char *receiveBuffer = memory.data() + uWS::WebSocketProtocol<BenchSocket>::CONSUME_PRE_PADDING;
+
+    std::vector<Stream> streams;
+    streams.push_back(wholeFrames("tiny binary", uWS::BINARY, 16, streamLength / 4));
+    streams.push_back(wholeFrames("tiny text", uWS::TEXT, 16, streamLength / 4));
+    streams.push_back(wholeFrames("medium text", uWS::TEXT, 1000, streamLength));
+    streams.push_back(wholeFrames("long binary", uWS::BINARY, 256 * 1024, streamLength));
+    streams.push_back(fragmentedText("fragmented text", false, streamLength));
+    streams.push_back(fragmentedText("with pings", true, streamLength));
+    streams.push_back(wholeFrames("split medium", uWS::TEXT, 1000, streamLength));
+    splitReads(streams.back(), 2000);
+    streams.push_back(wholeFrames("split long", uWS::BINARY, 256 * 1024, streamLength));
+    splitReads(streams.back(), 64 * 1024);
+
+    printf("%-16s %10s %10s %10s %10s\n", "stream", "MB", "frames", "GB/s", "ns/frame");
+    int status = 0;
+    for (Stream &stream : streams) {
+        BenchSocket socket;
+        double copySeconds = feed(stream, receiveBuffer, socket, true);
+        double seconds = feed(stream, receiveBuffer, socket, false) - copySeconds;
+        if (socket.failed || socket.frames != stream.frames) {
+            fprintf(stderr, "%s: parsed %zu of %zu frames%s\n", stream.name, socket.frames, stream.frames, socket.failed ? ", closed by the parser" : "");
+            status = 1;
+        }
+
+        printf("%-16s %10.1f %10zu %10.2f %10.1f\n", stream.name, stream.data.length() / 1048576.0, stream.frames,
+               stream.data.length() / seconds / 1e9, seconds * 1e9 / stream.frames);
+    }
+    return status;
+}
@@ -0,0 +1,451 @@
+/*
+ * Traffic replay benchmark
+ *
+ * Plays a log of Group::startRecording back into a Hub: each recorded socket becomes copies
+ * simulated clients sending the frames it sent, at the pace it sent them or speed times as
+ * fast. Parser, compression and fan-out changes are then measured on the frame sizes and
+ * timing of real traffic instead of a synthetic mix. Reports messages per second, loop
+ * thread CPU and how far the clients fell behind the recorded schedule.
+ *
+ * Build from the repository root (libuv, zlib and OpenSSL headers required):
+ *
+ *   g++ -std=c++17 -O2 -DUSE_LIBUV -I uWebSockets/src benchmarks/replay.cpp uWebSockets/src/*.cpp \
+ *       -luv -lssl -lcrypto -lz -lpthread -o replay
+ *
+ * Usage: ./replay log [key=value ...]
+ *
+ *   copies=1          clients per recorded socket, two fds each (socketpairs handed to
+ *                     Hub::upgrade). The soft fd limit is raised to the hard one
+ *   speed=1           times the recorded pace, 0 for as fast as the sockets take it
+ *   handler=echo      what the server does with each message: echo (sent back, compressed
+ *                     with compression on), broadcast (Group::broadcast to every client)
+ *                     or none
+ *   compression=auto  permessage-deflate between the clients and the hub: on, off, or on
+ *                     when the log has compressed frames
+ *   record=           records the replay into this log too, for comparing it with the original
+ *
+ * Every client is connected before the replay starts and closed by the close of its socket
+ * in the log. A frame goes out at the time its last piece was read, so a frame the recorded
+ * client sent slowly arrives at once. Compressed frames replay right as long as the recorded
+ * clients kept no compression context, which is the default. The clients run on a thread of
+ * their own, CPU is that of the loop thread only.
+ *
+ */
+
+#include "Hub.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options {
+    std::string log;
+    int copies = 1;
+    double speed = 1;
+    std::string handler = "echo";
+    std::string compression = "auto";
+    std::string record;
+};
+
+static const char SEC_KEY[] = "dGhlIHNhbXBsZSBub25jZQ==";
+static const char DEFLATE_OFFER[] = "permessage-deflate; client_no_context_takeover; server_no_context_takeover";
+
+static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t threadCpuTime() {
+    rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000LL + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+// a frame of a recorded socket to send at, in microseconds from the start of the log, or its close
+struct Event {
+    int64_t at;
+    uint32_t socket;
+    bool close;
+    size_t offset, length;
+};
+
+// the log as frames ready to send, masked with an all zero mask which leaves the payload as it is
+struct Log {
+    std::vector<Event> events;
+    std::string frames;
+    uint32_t sockets = 0;
+    int64_t messages = 0;
+    bool compressed = false;
+
+    // false for a file that is not a log or ends within a record
+    bool read(const std::string &path) {
+        std::ifstream file(path, std::ios::binary);
+        std::stringstream stream;
+        stream << file.rdbuf();
+        std::string data = stream.str();
+        if (data.compare(0, 8, uWS::Group::RECORD_MAGIC) != 0) {
+            return false;
+        }
+
+        // the pieces of the frame a socket is in the middle of, and whether it is in a fragmented message
+        struct Socket {
+            std::string frame;
+            bool inMessage = false;
+        };
+        std::vector<Socket> pending;
+        size_t offset = 8;
+        auto varint = [&data, &offset](uint64_t &value) {
+            value = 0;
+            for (int shift = 0; offset < data.length(); shift += 7) {
+                unsigned char byte = data[offset++];
+                value |= (uint64_t) (byte & 127) << shift;
+                if (!(byte & 128)) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        int64_t at = 0;
+        uint64_t delta, id, length = 0;
+        while (offset < data.length()) {
+            if (!varint(delta) || !varint(id) || offset == data.length() || !id) {
+                return false;
+            }
+            unsigned char flags = data[offset++];
+            at += delta;
+            if (id > pending.size()) {
+                pending.resize(id);
+                sockets = (uint32_t) id;
+            }
+            if (flags & uWS::Group::RECORD_EVENT) {
+                if (flags == uWS::Group::RECORD_CLOSE) {
+                    events.push_back({at, (uint32_t) id - 1, true, 0, 0});
+                }
+                continue;
+            }
+            if (!varint(length) || data.length() - offset < length) {
+                return false;
+            }
+
+            Socket &socket = pending[id - 1];
+            socket.frame.append(data, offset, length);
+            offset += length;
+            if (!(flags & uWS::Group::RECORD_FRAME_END)) {
+                continue;
+            }
+
+            int opCode = flags & 15;
+            bool fin = flags & uWS::Group::RECORD_FIN;
+            // data frames after the first of a message are continuations, which do not repeat RSV1
+            bool continuation = false;
+            if (opCode < 3) {
+                continuation = socket.inMessage;
+                socket.inMessage = !fin;
+                messages += fin;
+            }
+            bool rsv1 = (flags & uWS::Group::RECORD_COMPRESSED) && !continuation;
+            compressed |= rsv1;
+
+            unsigned char header[14] = {(unsigned char) ((fin ? 128 : 0) | (rsv1 ? 64 : 0) | (continuation ? 0 : opCode))};
+            size_t payloadLength = socket.frame.length(), headerLength = 2;
+            if (payloadLength < 126) {
+                header[1] = 128 | (unsigned char) payloadLength;
+            } else if (payloadLength < 65536) {
+                header[1] = 128 | 126;
+                header[2] = (unsigned char) (payloadLength >> 8);
+                header[3] = (unsigned char) payloadLength;
+                headerLength = 4;
+            } else {
+                header[1] = 128 | 127;
+                for (int i = 0; i < 8; i++) {
+                    header[2 + i] = (unsigned char) (payloadLength >> (56 - 8 * i));
+                }
+                headerLength = 10;
+            }
+            events.push_back({at, (uint32_t) id - 1, false, frames.length(), headerLength + 4 + payloadLength});
+            frames.append((const char *) header, headerLength + 4);
+            frames += socket.frame;
+            socket.frame.clear();
+        }
+        return true;
+    }
+};
+
+// the simulated clients, on a thread of their own: sends each event when due and reads what the
+// server sends only to throw it away. A client with more than MAX_PENDING unsent holds up the replay
+struct Replayer {
+    static const size_t MAX_PENDING = 1024 * 1024;
+
+    struct Client {
+        int fd;
+        std::string pending;
+        bool closing = false, closed = false;
+    };
+
+    Options options;
+    Log *log;
+    std::vector<Client> clients;
+    std::vector<int64_t> lags;
+    int64_t start = 0, end = 0;
+    std::atomic<bool> done{false}, stop{false};
+
+    // false if it wrote nothing, for a full or closed socket
+    bool flush(Client &client) {
+        while (client.pending.length()) {
+            ssize_t sent = send(client.fd, client.pending.data(), client.pending.length(), MSG_NOSIGNAL);
+            if (sent <= 0) {
+                if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    client.closed = true;
+                    client.pending.clear();
+                }
+                break;
+            }
+            client.pending.erase(0, sent);
+        }
+        if (client.closing && client.pending.empty() && !client.closed) {
+            ::close(client.fd);
+            client.closed = true;
+        }
+        return client.pending.empty();
+    }
+
+    void run() {
+        int epfd = epoll_create1(0);
+        for (size_t i = 0; i < clients.size(); i++) {
+            epoll_event event = {};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            event.data.u64 = i;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &event);
+        }
+
+        char buffer[65536];
+        epoll_event events[256];
+        size_t next = 0;
+        start = now();
+        while (next < log->events.size() || std::any_of(clients.begin(), clients.end(), [](Client &client) {
+            return client.pending.length() && !client.closed;
+        })) {
+            int64_t time = now();
+            for (; next < log->events.size(); next++) {
+                Event &event = log->events[next];
+                int64_t due = options.speed > 0 ? start + (int64_t) (event.at * 1000 / options.speed) : time;
+                if (due > time) {
+                    break;
+                }
+                bool held = false;
+                for (int copy = 0; copy < options.copies; copy++) {
+                    held |= clients[event.socket * options.copies + copy].pending.length() > MAX_PENDING;
+                }
+                if (held) {
+                    break;
+                }
+
+                for (int copy = 0; copy < options.copies; copy++) {
+                    Client &client = clients[event.socket * options.copies + copy];
+                    if (client.closed) {
+                        continue;
+                    }
+                    if (event.close) {
+                        client.closing = true;
+                    } else {
+                        client.pending.append(log->frames, event.offset, event.length);
+                        lags.push_back(time - due);
+                    }
+                    flush(client);
+                }
+            }
+
+            int timeout = 10;
+            if (next < log->events.size() && options.speed > 0) {
+                int64_t due = start + (int64_t) (log->events[next].at * 1000 / options.speed);
+                timeout = (int) std::max<int64_t>(0, std::min<int64_t>(10, (due - now()) / 1000000));
+            }
+            int count = epoll_wait(epfd, events, 256, timeout);
+            for (int i = 0; i < count; i++) {
+                Client &client = clients[events[i].data.u64];
+                if (client.closed) {
+                    continue;
+                }
+                if (events[i].events & EPOLLIN) {
+                    ssize_t length;
+                    while ((length = recv(client.fd, buffer, sizeof(buffer), 0)) > 0);
+                }
+                if (events[i].events & EPOLLOUT) {
+                    flush(client);
+                }
+            }
+        }
+        end = now();
+        done = true;
+
+        // keeps reading, so that what the server still sends does not back up
+        while (!stop) {
+            int count = epoll_wait(epfd, events, 256, 10);
+            for (int i = 0; i < count; i++) {
+                Client &client = clients[events[i].data.u64];
+                while (!client.closed && recv(client.fd, buffer, sizeof(buffer), 0) > 0);
+            }
+        }
+        close(epfd);
+    }
+};
+
+static Options parseOptions(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        if (equals == std::string::npos) {
+            options.log = argument;
+            continue;
+        }
+
+        std::string key = argument.substr(0, equals), value = argument.substr(equals + 1);
+        if (key == "copies") {
+            options.copies = std::max(1, atoi(value.c_str()));
+        } else if (key == "speed") {
+            options.speed = std::max(0.0, atof(value.c_str()));
+        } else if (key == "handler") {
+            options.handler = value;
+        } else if (key == "compression") {
+            options.compression = value;
+        } else if (key == "record") {
+            options.record = value;
+        } else {
+            fprintf(stderr, "ignoring unknown option %s\n", key.c_str());
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[]) {
+    Replayer replayer;
+    Options &options = replayer.options = parseOptions(argc, argv);
+    if (options.log.empty()) {
+        fprintf(stderr, "usage: %s log [key=value ...]\n", argv[0]);
+        return 1;
+    }
+    if (options.handler != "echo" && options.handler != "broadcast" && options.handler != "none") {
+        fprintf(stderr, "unknown handler %s\n", options.handler.c_str());
+        return 1;
+    }
+
+    Log log;
+    if (!log.read(options.log)) {
+        fprintf(stderr, "%s is not a complete log of Group::startRecording\n", options.log.c_str());
+        return 1;
+    }
+    replayer.log = &log;
+    bool compression = options.compression == "auto" ? log.compressed : options.compression == "on";
+    if (log.compressed && !compression) {
+        fprintf(stderr, "the log has compressed frames, they need compression=on\n");
+        return 1;
+    }
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    size_t clientCount = (size_t) log.sockets * options.copies;
+    if (clientCount * 2 + 64 > limit.rlim_cur) {
+        fprintf(stderr, "%zu clients need %zu fds, the limit is %llu\n", clientCount, clientCount * 2 + 64, (unsigned long long) limit.rlim_cur);
+        return 1;
+    }
+
+    uWS::Hub hub(compression ? uWS::PERMESSAGE_DEFLATE : 0);
+    int64_t received = 0, lastMessage = 0;
+    hub.onMessage([&hub, &options, compression, &received, &lastMessage](uWS::WebSocket *ws, char *message, size_t length, uWS::OpCode opCode) {
+        received++;
+        lastMessage = now();
+        if (options.handler == "echo") {
+            ws->send(message, length, opCode, nullptr, nullptr, compression);
+        } else if (options.handler == "broadcast") {
+            hub.getDefaultGroup().broadcast(message, length, opCode, compression);
+        }
+    });
+    if (options.record.length() && !hub.getDefaultGroup().startRecording(options.record.c_str())) {
+        fprintf(stderr, "could not open %s\n", options.record.c_str());
+        return 1;
+    }
+
+    const char *extensions = compression ? DEFLATE_OFFER : "";
+    for (size_t i = 0; i < clientCount; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+            perror("socketpair");
+            return 1;
+        }
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        hub.upgrade(fds[1], SEC_KEY, nullptr, extensions, strlen(extensions), nullptr, 0);
+        replayer.clients.push_back({fds[0]});
+    }
+
+    int64_t expected = log.messages * options.copies;
+    int64_t cpuBefore = threadCpuTime();
+    std::thread replayerThread([&replayer]() {
+        replayer.run();
+    });
+
+    // after the last frame is sent, until its message is handled or nothing more comes for a second
+    int64_t idleSince = 0;
+    while (received < expected) {
+        int64_t before = received;
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+        if (!replayer.done || received != before) {
+            idleSince = 0;
+        } else if (!idleSince) {
+            idleSince = now();
+        } else if (now() - idleSince > 1000000000LL) {
+            break;
+        }
+    }
+    int64_t cpu = threadCpuTime() - cpuBefore;
+    int64_t end = std::max<int64_t>(lastMessage, replayer.end);
+
+    replayer.stop = true;
+    replayerThread.join();
+    if (options.record.length()) {
+        hub.getDefaultGroup().stopRecording();
+    }
+
+    std::vector<int64_t> &lags = replayer.lags;
+    std::sort(lags.begin(), lags.end());
+    auto percentile = [&lags](double p) {
+        return lags.empty() ? 0.0 : lags[std::min(lags.size() - 1, (size_t) (lags.size() * p))] / 1000.0;
+    };
+
+    double seconds = (end - replayer.start) / 1e9;
+    double logSeconds = log.events.empty() ? 0 : log.events.back().at / 1e6;
+    printf("log %s: %u sockets, %zu frames and closes, %lld messages over %.3f s%s\n", options.log.c_str(), log.sockets, log.events.size(),
+           (long long) log.messages, logSeconds, log.compressed ? ", compressed" : "");
+    printf("copies=%d speed=%g handler=%s compression=%s\n", options.copies, options.speed, options.handler.c_str(), compression ? "on" : "off");
+    printf("handled %lld of %lld messages in %.3f s: %.0f msg/s\n", (long long) received, (long long) expected, seconds, seconds > 0 ? received / seconds : 0.0);
+    printf("behind schedule p50 %.1f us, p99 %.1f us, max %.1f us\n", percentile(0.50), percentile(0.99), lags.empty() ? 0.0 : lags.back() / 1000.0);
+    printf("loop thread %.3f s CPU, %.2f us per message\n", cpu / 1e9, received ? cpu / 1e3 / received : 0.0);
+
+    for (Replayer::Client &client : replayer.clients) {
+        if (!client.closed) {
+            close(client.fd);
+        }
+    }
+    hub.getDefaultGroup().close();
+    for (int i = 0; i < 100; i++) {
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+    return received == expected ? 0 : 2;
+}
@@ -0,0 +1,461 @@
+/*
+ * TLS throughput and latency benchmark
+ *
+ * Drives a Hub with N loopback TLS clients and measures what TLS WebSocket traffic through
+ * sslIoHandler costs the server: loop thread CPU per GB of payload, throughput and p50/p99
+ * latency. Meant as the baseline kTLS and record packing changes are measured against, so
+ * run every scenario for both protocol versions and both ciphers.
+ *
+ * Build from the repository root (libuv, zlib and OpenSSL 1.1.1 or later required):
+ *
+ *   g++ -std=c++17 -O2 -DUSE_LIBUV -I uWebSockets/src benchmarks/tls.cpp uWebSockets/src/*.cpp \
+ *       -luv -lssl -lcrypto -lz -lpthread -o tls
+ *
+ * Usage: ./tls [key=value ...]
+ *
+ *   scenario=echo     echo (every client keeps one small frame in flight and the server
+ *                     echoes it, latency is the round trip), push (large frames sent to
+ *                     each client with WebSocket::send) or broadcast (Group::broadcast
+ *                     fan-out of small frames, latency is send to delivery)
+ *   clients=100       TLS clients (two fds each, mind ulimit -n)
+ *   messages=1000     frames per client: echoes, or rounds of push and broadcast
+ *   payload=0         frame size in bytes, 0 for the scenario's own: 64 for echo, 256 KB
+ *                     for push, 128 for broadcast
+ *   version=1.3       TLS protocol version, 1.2 or 1.3
+ *   cipher=aes        aes (AES-128-GCM) or chacha (ChaCha20-Poly1305)
+ *   release=1         SSL_MODE_RELEASE_BUFFERS on the server side, which sockets get by
+ *                     default. 0 keeps OpenSSL's buffers allocated between records
+ *
+ * The handshakes are done before the WebSockets are made and are not measured, see the
+ * handshake benchmark for those. CPU is that of the loop thread only, the clients decrypt
+ * on a thread of their own. push and broadcast keep at most a few frames per client queued
+ * on the server, so latency is not all queueing.
+ *
+ */
+
+#include "Hub.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options {
+    std::string scenario = "echo";
+    int clients = 100;
+    int messages = 1000;
+    size_t payload = 0;
+    std::string version = "1.3";
+    std::string cipher = "aes";
+    bool release = true;
+};
+
+static const char SEC_KEY[] = "dGhlIHNhbXBsZSBub25jZQ==";
+
+static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t threadCpuTime() {
+    rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000LL + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+// pins both sides to the one protocol version and cipher, ECDSA for TLS 1.2 to match the P-256 key
+static bool configure(SSL_CTX *context, const Options &options) {
+    bool tls13 = options.version == "1.3";
+    int version = tls13 ? TLS1_3_VERSION : TLS1_2_VERSION;
+    SSL_CTX_set_min_proto_version(context, version);
+    SSL_CTX_set_max_proto_version(context, version);
+    bool aes = options.cipher == "aes";
+    if (tls13) {
+        return SSL_CTX_set_ciphersuites(context, aes ? "TLS_AES_128_GCM_SHA256" : "TLS_CHACHA20_POLY1305_SHA256") == 1;
+    }
+    return SSL_CTX_set_cipher_list(context, aes ? "ECDHE-ECDSA-AES128-GCM-SHA256" : "ECDHE-ECDSA-CHACHA20-POLY1305") == 1;
+}
+
+// a throwaway self-signed P-256 certificate for the server side
+static SSL_CTX *createServerContext(const Options &options) {
+    EVP_PKEY *key = nullptr;
+    EVP_PKEY_CTX *keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    if (!keyContext || EVP_PKEY_keygen_init(keyContext) <= 0 || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(keyContext, &key) <= 0) {
+        EVP_PKEY_CTX_free(keyContext);
+        return nullptr;
+    }
+    EVP_PKEY_CTX_free(keyContext);
+
+    X509 *certificate = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+    X509_set_pubkey(certificate, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(certificate), "CN", MBSTRING_ASC, (const unsigned char *) "localhost", -1, -1, 0);
+    X509_set_issuer_name(certificate, X509_get_subject_name(certificate));
+    X509_sign(certificate, key, EVP_sha256());
+
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(context, certificate);
+    SSL_CTX_use_PrivateKey(context, key);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    if (!configure(context, options)) {
+        SSL_CTX_free(context);
+        return nullptr;
+    }
+    return context;
+}
+
+// one client as seen by the client thread: skips the 101 response, then walks server frames
+struct Client {
+    int fd;
+    SSL *ssl;
+    bool handshaken = false;
+    std::string buffer;
+    int received = 0;
+    // when the echo in flight was sent
+    int64_t sent = 0;
+};
+
+struct Reader {
+    Options options;
+    std::vector<Client> clients;
+    std::vector<std::atomic<int64_t>> *sendTimes;
+    std::string frame;
+    std::vector<int64_t> latencies;
+    std::atomic<int64_t> delivered{0};
+    std::atomic<int64_t> lastDelivery{0};
+    std::atomic<bool> stop{false};
+
+    // a masked binary frame with an all zero mask, which leaves the payload as it is
+    void buildFrame(size_t payload) {
+        unsigned char header[8] = {0x82};
+        size_t headerLength = 2;
+        if (payload < 126) {
+            header[1] = 0x80 | (unsigned char) payload;
+        } else {
+            header[1] = 0x80 | 126;
+            header[2] = (unsigned char) (payload >> 8);
+            header[3] = (unsigned char) payload;
+            headerLength = 4;
+        }
+        frame.assign((const char *) header, headerLength + 4);
+        for (size_t i = 0; i < payload; i++) {
+            frame += (char) ('a' + (i * 7) % 26);
+        }
+    }
+
+    // small frames on a loopback socket, the kernel has room for them
+    void sendEcho(Client &client) {
+        client.sent = now();
+        while (SSL_write(client.ssl, frame.data(), (int) frame.length()) <= 0) {
+            if (SSL_get_error(client.ssl, -1) != SSL_ERROR_WANT_WRITE) {
+                return;
+            }
+        }
+    }
+
+    // consumes complete frames from the front of the buffer
+    void parse(Client &client) {
+        size_t offset = 0;
+        if (!client.handshaken) {
+            size_t end = client.buffer.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                return;
+            }
+            client.handshaken = true;
+            offset = end + 4;
+            if (options.scenario == "echo") {
+                sendEcho(client);
+            }
+        }
+
+        int64_t arrival = now();
+        int frames = 0;
+        while (client.buffer.length() - offset >= 2) {
+            const unsigned char *header = (const unsigned char *) client.buffer.data() + offset;
+            size_t available = client.buffer.length() - offset;
+            uint64_t length = header[1] & 127;
+            size_t headerLength = 2;
+            if (length == 126) {
+                if (available < 4) {
+                    break;
+                }
+                length = (header[2] << 8) | header[3];
+                headerLength = 4;
+            } else if (length == 127) {
+                if (available < 10) {
+                    break;
+                }
+                length = 0;
+                for (int i = 0; i < 8; i++) {
+                    length = (length << 8) | header[2 + i];
+                }
+                headerLength = 10;
+            }
+
+            if (available < headerLength + length) {
+                break;
+            }
+            offset += headerLength + length;
+
+            if (options.scenario == "echo") {
+                latencies.push_back(arrival - client.sent);
+                if (client.received + 1 < options.messages) {
+                    sendEcho(client);
+                }
+            } else if (client.received < (int) sendTimes->size()) {
+                // frames arrive in send order, so the n-th frame of a client belongs to round n
+                latencies.push_back(arrival - (*sendTimes)[client.received].load(std::memory_order_relaxed));
+            }
+            client.received++;
+            frames++;
+        }
+
+        client.buffer.erase(0, offset);
+        if (frames) {
+            delivered += frames;
+            lastDelivery = arrival;
+        }
+    }
+
+    void run() {
+        int epfd = epoll_create1(0);
+        for (size_t i = 0; i < clients.size(); i++) {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.u64 = i;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &event);
+        }
+
+        char buffer[65536];
+        epoll_event events[256];
+        while (!stop) {
+            int count = epoll_wait(epfd, events, 256, 10);
+            for (int i = 0; i < count; i++) {
+                Client &client = clients[events[i].data.u64];
+                int length;
+                while ((length = SSL_read(client.ssl, buffer, sizeof(buffer))) > 0) {
+                    client.buffer.append(buffer, length);
+                }
+                parse(client);
+            }
+        }
+        close(epfd);
+    }
+};
+
+static Options parseOptions(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        if (equals == std::string::npos) {
+            fprintf(stderr, "ignoring %s, expected key=value\n", argv[i]);
+            continue;
+        }
+
+        std::string key = argument.substr(0, equals), value = argument.substr(equals + 1);
+        if (key == "scenario") {
+            options.scenario = value;
+        } else if (key == "clients") {
+            options.clients = std::max(1, atoi(value.c_str()));
+        } else if (key == "messages") {
+            options.messages = std::max(1, atoi(value.c_str()));
+        } else if (key == "payload") {
+            options.payload = strtoul(value.c_str(), nullptr, 10);
+        } else if (key == "version") {
+            options.version = value;
+        } else if (key == "cipher") {
+            options.cipher = value;
+        } else if (key == "release") {
+            options.release = atoi(value.c_str()) != 0;
+        } else {
+            fprintf(stderr, "ignoring unknown option %s\n", key.c_str());
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[]) {
+    Reader reader;
+    Options &options = reader.options = parseOptions(argc, argv);
+    if (options.scenario != "echo" && options.scenario != "push" && options.scenario != "broadcast") {
+        fprintf(stderr, "unknown scenario %s\n", options.scenario.c_str());
+        return 1;
+    }
+    if ((options.version != "1.2" && options.version != "1.3") || (options.cipher != "aes" && options.cipher != "chacha")) {
+        fprintf(stderr, "unknown version %s or cipher %s\n", options.version.c_str(), options.cipher.c_str());
+        return 1;
+    }
+    if (!options.payload) {
+        options.payload = options.scenario == "echo" ? 64 : options.scenario == "push" ? 256 * 1024 : 128;
+    }
+    if (options.scenario == "echo" && options.payload > 65535) {
+        fprintf(stderr, "echo frames are at most 65535 bytes\n");
+        return 1;
+    }
+
+    SSL_CTX *serverContext = createServerContext(options);
+    SSL_CTX *clientContext = SSL_CTX_new(TLS_client_method());
+    if (!serverContext || !clientContext || !configure(clientContext, options)) {
+        fprintf(stderr, "could not set up TLS %s with %s\n", options.version.c_str(), options.cipher.c_str());
+        return 1;
+    }
+
+    uWS::Hub hub;
+    std::vector<uWS::WebSocket *> webSockets;
+    hub.onConnection([&webSockets](uWS::WebSocket *ws) {
+        webSockets.push_back(ws);
+    });
+    hub.onMessage([](uWS::WebSocket *ws, char *message, size_t length, uWS::OpCode opCode) {
+        ws->send(message, length, opCode);
+    });
+
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    if (bind(listenFd, (sockaddr *) &address, sizeof(address)) || listen(listenFd, 512) || getsockname(listenFd, (sockaddr *) &address, &addressLength)) {
+        perror("listen");
+        return 1;
+    }
+
+    // both handshakes run blocking, the server's on a thread of its own, before the fds go non-blocking
+    for (int i = 0; i < options.clients; i++) {
+        int clientFd = socket(AF_INET, SOCK_STREAM, 0);
+        int enabled = 1;
+        setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+        if (connect(clientFd, (sockaddr *) &address, sizeof(address))) {
+            perror("connect");
+            return 1;
+        }
+        int serverFd = accept(listenFd, nullptr, nullptr);
+        if (serverFd == -1) {
+            perror("accept");
+            return 1;
+        }
+
+        SSL *serverSsl = SSL_new(serverContext), *clientSsl = SSL_new(clientContext);
+        SSL_set_fd(serverSsl, serverFd);
+        SSL_set_fd(clientSsl, clientFd);
+        int accepted = 0;
+        std::thread serverThread([serverSsl, &accepted]() {
+            accepted = SSL_accept(serverSsl);
+        });
+        int connected = SSL_connect(clientSsl);
+        serverThread.join();
+        if (accepted != 1 || connected != 1) {
+            fprintf(stderr, "TLS handshake failed\n");
+            return 1;
+        }
+
+        fcntl(serverFd, F_SETFL, fcntl(serverFd, F_GETFL) | O_NONBLOCK);
+        fcntl(clientFd, F_SETFL, fcntl(clientFd, F_GETFL) | O_NONBLOCK);
+        hub.upgrade(serverFd, SEC_KEY, serverSsl, "", 0, nullptr, 0);
+        if (!options.release) {
+            // the socket set it, the SSL stays ours to change
+            SSL_clear_mode(serverSsl, SSL_MODE_RELEASE_BUFFERS);
+        }
+
+        Client client;
+        client.fd = clientFd;
+        client.ssl = clientSsl;
+        reader.clients.push_back(std::move(client));
+    }
+    close(listenFd);
+
+    std::string payload(options.payload, 'x');
+    for (size_t i = 0; i < payload.length(); i++) {
+        payload[i] = 'a' + (i * 7) % 26;
+    }
+    reader.buildFrame(options.payload);
+    std::vector<std::atomic<int64_t>> sendTimes(options.scenario == "echo" ? 0 : options.messages);
+    reader.sendTimes = &sendTimes;
+    reader.latencies.reserve((size_t) options.clients * options.messages);
+
+    int64_t expected = (int64_t) options.clients * options.messages;
+    // payload bytes the server encrypts, and for echo also decrypts
+    double gigabytes = (double) expected * options.payload * (options.scenario == "echo" ? 2 : 1) / 1e9;
+    // pushes wait while this much is queued per client
+    size_t queueLimit = 4 * (options.payload + 14);
+
+    int64_t cpuBefore = threadCpuTime();
+    int64_t start = now();
+    int64_t deadline = start + 60 * 1000000000LL;
+    std::thread readerThread([&reader]() {
+        reader.run();
+    });
+
+    int round = 0;
+    while (reader.delivered < expected && now() < deadline) {
+        if (options.scenario != "echo" && round < options.messages && webSockets.size() == (size_t) options.clients) {
+            size_t buffered = 0;
+            for (uWS::WebSocket *ws : webSockets) {
+                buffered = std::max(buffered, ws->getBufferedAmount());
+            }
+            if (buffered < queueLimit) {
+                sendTimes[round++].store(now(), std::memory_order_relaxed);
+                if (options.scenario == "push") {
+                    for (uWS::WebSocket *ws : webSockets) {
+                        ws->send(payload.data(), payload.length(), uWS::OpCode::BINARY);
+                    }
+                } else {
+                    hub.getDefaultGroup().broadcast(payload.data(), payload.length(), uWS::OpCode::BINARY);
+                }
+            }
+        }
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+    int64_t cpu = threadCpuTime() - cpuBefore;
+    int64_t end = reader.lastDelivery ? (int64_t) reader.lastDelivery : now();
+
+    reader.stop = true;
+    readerThread.join();
+
+    std::vector<int64_t> &latencies = reader.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, (size_t) (latencies.size() * p))] / 1000.0;
+    };
+
+    double seconds = (end - start) / 1e9;
+    int64_t delivered = reader.delivered;
+    printf("scenario=%s clients=%d messages=%d payload=%zu version=%s cipher=%s release=%d\n",
+           options.scenario.c_str(), options.clients, options.messages, options.payload, options.version.c_str(), options.cipher.c_str(), options.release);
+    printf("delivered %lld of %lld in %.3f s: %.0f msg/s, %.1f MB/s of payload\n", (long long) delivered, (long long) expected,
+           seconds, seconds > 0 ? delivered / seconds : 0.0, seconds > 0 ? gigabytes * 1000 * delivered / expected / seconds : 0.0);
+    printf("latency p50 %.1f us, p99 %.1f us\n", percentile(0.50), percentile(0.99));
+    printf("loop thread %.3f s CPU, %.3f s per GB of payload\n", cpu / 1e9, gigabytes > 0 ? cpu / 1e9 / gigabytes : 0.0);
+
+    for (Client &client : reader.clients) {
+        SSL_free(client.ssl);
+        close(client.fd);
+    }
+    hub.getDefaultGroup().close();
+    for (int i = 0; i < 100; i++) {
+        uv_run(hub.getLoop(), UV_RUN_NOWAIT);
+    }
+    SSL_CTX_free(clientContext);
+    SSL_CTX_free(serverContext);
+    return delivered == expected ? 0 : 2;
+}
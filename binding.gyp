@@ -1,4 +1,10 @@
 {
+    'variables': {
+        # node-gyp rebuild --libdeflate=true deflates and inflates one-shot with libdeflate
+        'libdeflate%': 'false',
+        # node-gyp rebuild --usdt=true adds the USDT probes of uWebSockets/src/Trace.h, with systemtap's sys/sdt.h
+        'usdt%': 'false'
+    },
     "targets": [
         {
             "target_name": "uws",
@@ -9,11 +15,21 @@
                 'uWebSockets/src/Group.cpp',
                 'uWebSockets/src/Networking.cpp',
                 'uWebSockets/src/Hub.cpp',
+                'uWebSockets/src/HttpSocket.cpp',
                 'uWebSockets/src/Node.cpp',
                 'uWebSockets/src/WebSocket.cpp',
-                'uWebSockets/src/Socket.cpp'
+                'uWebSockets/src/Socket.cpp',
+                'uWebSockets/src/StreamWebSocket.cpp',
+                'uWebSockets/src/SharedBus.cpp'
             ],
             'conditions': [
+                ['libdeflate=="true"', {
+                    'defines': ['UWS_LIBDEFLATE'],
+                    'libraries': ['-ldeflate']
+                }],
+                ['usdt=="true"', {
+                    'defines': ['UWS_USDT']
+                }],
                 ['OS=="linux"', {
                     'cflags_cc': ['-std=c++17', '-DUSE_LIBUV'],
                     'cflags_cc!': ['-fno-exceptions', '-std=gnu++11', '-fno-rtti'],
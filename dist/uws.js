@@ -8,11 +8,30 @@ const DEFAULT_PAYLOAD_LIMIT = 16777216;
 var uws = {};
 uws.PERMESSAGE_DEFLATE = 1;
 uws.SLIDING_DEFLATE_WINDOW = 16;
+uws.NO_OUTBOUND_COMPRESSION = 32;
+uws.TRUSTED_PEERS = 64;
 uws.OPCODE_TEXT = 1;
 uws.OPCODE_BINARY = 2;
 uws.OPCODE_PING = 9;
 uws.OPEN = 1;
 uws.CLOSED = 0;
+uws.BACKPRESSURE_DROP = 0;
+uws.BACKPRESSURE_CLOSE = 1;
+uws.TRIM_BUFFERS = 0;
+uws.TRIM_ALL = 1;
+// what Server#metrics holds at each index, as uWS::Group::Metric
+uws.METRICS = ['readCalls', 'writeCalls', 'tlsReadCalls', 'tlsWriteCalls', 'acceptedSockets',
+    'blockMessages', 'heapMessages', 'queueingSockets', 'queueHighWater', 'expiredMessages',
+    'sockoptCalls', 'pollChanges',
+    'messagesIn', 'bytesIn', 'bytesOut',
+    'textFramesIn', 'binaryFramesIn', 'closeFramesIn', 'pingFramesIn', 'pongFramesIn',
+    'textSends', 'binarySends', 'closeSends', 'pingSends', 'pongSends',
+    'compressedSends', 'uncompressedSends', 'bytesBeforeCompression', 'bytesAfterCompression',
+    'slowByBytes', 'slowByAge',
+    'cpuParse', 'cpuHandlers', 'cpuCompression', 'cpuFlush'];
+// and then LATENCY_BUCKETS counts of each of these, bucket i of 2^i to 2^(i + 1) ns. See options.latencyHistograms
+uws.LATENCY_HISTOGRAMS = ['handlerLatency', 'queueLatency', 'deflateTime', 'inflateTime', 'upgradeTime'];
+uws.LATENCY_BUCKETS = 32;
 
 function noop() {}
 
@@ -20,6 +39,16 @@ function abortConnection(socket, code, message) {
     return socket.end(`HTTP/1.1 ${code} ${message}\r\n\r\n`);
 }
 
+// of the arrays native.getMemoryUsage and native.server.group.getMemoryStats return
+function memoryStats(bytes) {
+    return {
+        queuedMessages: bytes[0],
+        fragmentBuffers: bytes[1],
+        deflateWindows: bytes[2],
+        pooledBlocks: bytes[3]
+    };
+}
+
 const native = (() => {
     try {
         return require(`./uws_${process.platform}_${process.versions.modules}`);
@@ -31,11 +60,45 @@ const native = (() => {
 
 native.setNoop(noop);
 
+// send callbacks live in slots indexed by send id, native hands back every completed id once per loop iteration
+// the ring of options.bus, one per process for all servers on it
+let sharedBus = null;
+
+const sendCallbacks = [];
+const freeSendIds = [];
+
+function releaseSendId(id) {
+    const cb = sendCallbacks[id];
+    sendCallbacks[id] = undefined;
+    freeSendIds.push(id);
+    return cb;
+}
+
+native.setSendCompletion((completed, cancelled) => {
+    for (let i = 0; i < cancelled.length; i++) {
+        releaseSendId(cancelled[i]);
+    }
+    for (let i = 0; i < completed.length; i++) {
+        const cb = releaseSendId(completed[i]);
+        try {
+            cb();
+        } catch (e) {
+            // one throwing callback must not swallow the rest of the batch
+            process.nextTick(() => {
+                throw e;
+            });
+        }
+    }
+});
+
 class WebSocket {
     constructor(external) {
         this.external = external;
         this.internalOnMessage = noop;
         this.internalOnClose = noop;
+        this.internalOnDrain = noop;
+        this.internalOnChunk = noop;
+        this._socketInfo = null;
     }
 
     on(eventName, f) {
@@ -44,6 +107,16 @@ class WebSocket {
                 throw Error(EE_ERROR);
             }
             this.internalOnMessage = f;
+        } else if (eventName === 'drain') {
+            if (this.internalOnDrain !== noop) {
+                throw Error(EE_ERROR);
+            }
+            this.internalOnDrain = f;
+        } else if (eventName === 'chunk') {
+            if (this.internalOnChunk !== noop) {
+                throw Error(EE_ERROR);
+            }
+            this.internalOnChunk = f;
         }
         return this;
     }
@@ -61,13 +134,63 @@ class WebSocket {
         return this;
     }
 
+    // built on first access and kept, the address does not change and stays readable after close
     get _socket() {
-        const address = this.external ? native.getAddress(this.external) : new Array(3);
-        return {
-            remotePort: address[0],
-            remoteAddress: address[1],
-            remoteFamily: address[2]
-        };
+        if (!this._socketInfo) {
+            if (!this.external) {
+                return { remotePort: undefined, remoteAddress: undefined, remoteFamily: undefined };
+            }
+            const address = native.getAddress(this.external);
+            this._socketInfo = {
+                remotePort: address[0],
+                remoteAddress: address[1],
+                remoteFamily: address[2]
+            };
+        }
+        return this._socketInfo;
+    }
+
+    get bufferedAmount() {
+        return this.external ? native.getBufferedAmount(this.external) : 0;
+    }
+
+    // ms from a native ping (heartbeat, idle timeout or OPCODE_PING send) to its pong, averaged over the last few. 0 until measured
+    get rtt() {
+        return this.external ? native.getRtt(this.external) : 0;
+    }
+
+    // what the kernel said of the connection at the last sample of options.tcpInfoSampling: rtt in ms, cwnd and
+    // unacked in segments and notSent in bytes. All 0 until sampled, and always off Linux
+    get tcpInfo() {
+        const tcpInfo = this.external ? native.getTcpInfo(this.external) : [0, 0, 0, 0];
+        return { rtt: tcpInfo[0], cwnd: tcpInfo[1], unacked: tcpInfo[2], notSent: tcpInfo[3] };
+    }
+
+    // bytes held natively for this socket: messages allocated for sending and not sent yet, the buffer of a message
+    // still arriving and its compression windows. pooledBlocks is always 0, see WebSocketServer#memoryStats
+    get memoryUsage() {
+        return memoryStats(this.external ? native.getMemoryUsage(this.external) : [0, 0, 0, 0]);
+    }
+
+    // no more messages are read from the client until resume, TCP holds it back meanwhile
+    pause() {
+        if (this.external) {
+            native.setReadingPaused(this.external, true);
+        }
+    }
+
+    resume() {
+        if (this.external) {
+            native.setReadingPaused(this.external, false);
+        }
+    }
+
+    // as net.Socket#setNoDelay, for this client only and from then on instead of options.adaptiveNoDelay
+    setNoDelay(noDelay) {
+        if (this.external) {
+            native.setNoDelay(this.external, noDelay === undefined || !!noDelay);
+        }
+        return this;
     }
 
     removeListener() {
@@ -83,22 +206,287 @@ class WebSocket {
 
             const binary = options && typeof options.binary === 'boolean' ? options.binary : typeof message !== 'string';
 
-            native.server.send(this.external, message, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, cb ? (() => {
-                process.nextTick(cb);
-            }) : undefined, options && options.compress);
+            let sendId;
+            if (cb) {
+                sendId = freeSendIds.length ? freeSendIds.pop() : sendCallbacks.length;
+                sendCallbacks[sendId] = cb;
+            }
+
+            // options.conflationKey (a non-zero uint32) replaces a still unsent message of the same key,
+            // options.ttl drops it like a cancelled send if still unsent that many milliseconds later.
+            // options.pin sends a Buffer that must not change until cb from where it is instead of a copy,
+            // for large ones, not together with compress, conflationKey or ttl
+            native.server.send(this.external, message, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, sendId, options && options.compress, options && options.conflationKey,
+                options && options.ttl, options && options.pin);
+        } else if (cb) {
+            cb(new Error('not opened'));
+        }
+    }
+
+    // sends the messages as frames back to back in one write, nothing else comes between them, strings as
+    // text and buffers as binary. cb is called once for all of them. options.compress deflates those worth it
+    sendBatch(messages, options, cb) {
+        if (this.external) {
+            if (typeof options === 'function') {
+                cb = options;
+                options = null;
+            }
+
+            let sendId;
+            if (cb) {
+                sendId = freeSendIds.length ? freeSendIds.pop() : sendCallbacks.length;
+                sendCallbacks[sendId] = cb;
+            }
+            native.server.sendBatch(this.external, messages, sendId, !!(options && options.compress));
         } else if (cb) {
             cb(new Error('not opened'));
         }
     }
 
+    // sends one message in pieces without holding all of it. Other sends wait natively until endMessage.
+    // options are binary and compress like for send, false when a message is already being streamed
+    beginMessage(options) {
+        if (!this.external) {
+            return false;
+        }
+        const binary = options && options.binary;
+        return native.server.beginMessage(this.external, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, !!(options && options.compress));
+    }
+
+    sendFragment(chunk) {
+        if (this.external) {
+            native.server.sendFragment(this.external, chunk);
+        }
+    }
+
+    endMessage(chunk) {
+        if (this.external) {
+            native.server.endMessage(this.external, chunk);
+        }
+    }
+
+    cork(f) {
+        if (!this.external) {
+            return f();
+        }
+        const corked = native.server.cork(this.external, true);
+        try {
+            return f();
+        } finally {
+            if (corked && this.external) {
+                native.server.cork(this.external, false);
+            }
+        }
+    }
+
+    // prepared is what Server#prepareMessage, Server#prepareFile or uws.registerFrame returned
+    sendPrepared(prepared) {
+        if (this.external && prepared.external) {
+            if (prepared instanceof PreparedFile) {
+                native.server.sendFile(this.external, prepared.external);
+            } else if (prepared instanceof ConstantFrame) {
+                native.server.sendFrame(this.external, prepared.external);
+            } else {
+                native.server.sendPrepared(this.external, prepared.external);
+            }
+        }
+    }
+
+    // closes with 1001 after seconds without sending or receiving anything, checked natively once a
+    // second. With ping a ping gets another timeout to be answered first. 0 turns it off
+    setIdleTimeout(seconds, ping) {
+        if (this.external) {
+            native.server.setIdleTimeout(this.external, seconds >>> 0, !!ping);
+        }
+    }
+
+    // subscriptions are dropped natively when the socket closes
+    subscribe(topic) {
+        if (this.external) {
+            native.server.subscribe(this.external, topic);
+        }
+    }
+
+    unsubscribe(topic) {
+        if (this.external) {
+            native.server.unsubscribe(this.external, topic);
+        }
+    }
+
+    // an id for the client to come back with after a reconnect, see WebSocketServer option sessions. From here on
+    // messages sent to this client are counted from 1 and the last ones kept. '' with sessions off
+    openSession() {
+        return this.external ? native.server.openSession(this.external) : '';
+    }
+
+    // sends this client the messages of session id after the lastSequence-th, which it had received before, and
+    // keeps counting from there. False if the session expired or no longer keeps all of those, for the client to
+    // start over
+    resumeSession(id, lastSequence) {
+        return this.external ? native.server.resumeSession(this.external, String(id), lastSequence || 0) : false;
+    }
+
     close(code, data) {
         if (this.external) {
             native.server.close(this.external, code, data);
             this.external = null;
         }
     }
+
+    // ends the connection without a close frame. abortive resets it, freeing its kernel buffers and state at once,
+    // for kicking abusive or dead clients in bulk
+    terminate(abortive) {
+        if (this.external) {
+            native.server.terminate(this.external, !!abortive);
+            this.external = null;
+        }
+    }
 }
 
+// a message framed (and compressed) once for sending to many sockets, call finalize when done sending it
+class PreparedMessage {
+    constructor(external) {
+        this.external = external;
+    }
+
+    finalize() {
+        if (this.external) {
+            native.server.finalizeMessage(this.external);
+            this.external = null;
+        }
+    }
+}
+
+// a message whose payload is a range of a file, sent with sendfile where it can be, see Server#prepareFile
+class PreparedFile {
+    constructor(external) {
+        this.external = external;
+    }
+
+    finalize() {
+        if (this.external) {
+            native.server.finalizeFile(this.external);
+            this.external = null;
+        }
+    }
+}
+
+// a frame registered for good with uws.registerFrame, nothing to finalize
+class ConstantFrame {
+    constructor(external) {
+        this.external = external;
+    }
+}
+
+// frames message once for the life of the process, for WebSocket#sendPrepared to write as it is without a
+// copy, framing or allocation per send. For what never changes, like engine.io pongs or a heartbeat; binary
+// unless a string, never compressed
+uws.registerFrame = (message, options) => {
+    const binary = options && typeof options.binary === 'boolean' ? options.binary : typeof message !== 'string';
+    return new ConstantFrame(native.registerFrame(message, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT));
+};
+
+// a client on an HTTP/2 stream instead of a socket of its own, see Server#handleStream
+class StreamWebSocket {
+    constructor(stream, maxPayload) {
+        this.stream = stream;
+        this.external = native.server.stream.create(maxPayload, this);
+        this.internalOnMessage = noop;
+        this.internalOnClose = noop;
+        this._writeCallback = null;
+
+        stream.on('data', (data) => {
+            if (this.external) {
+                native.server.stream.consume(this.external, data);
+            }
+        });
+        stream.on('close', () => {
+            if (this.external) {
+                const external = this.external;
+                this.external = null;
+                native.server.stream.destroy(external);
+            }
+        });
+        stream.on('error', noop);
+    }
+
+    on(eventName, f) {
+        if (eventName === 'message') {
+            if (this.internalOnMessage !== noop) {
+                throw Error(EE_ERROR);
+            }
+            this.internalOnMessage = f;
+        }
+        return this;
+    }
+
+    once(eventName, f) {
+        if (eventName === 'close') {
+            if (this.internalOnClose !== noop) {
+                throw Error(EE_ERROR);
+            }
+            this.internalOnClose = (code, message) => {
+                this.internalOnClose = noop;
+                f(code, message);
+            };
+        }
+        return this;
+    }
+
+    get bufferedAmount() {
+        return this.stream.writableLength;
+    }
+
+    removeListener() {
+        return this;
+    }
+
+    send(message, options, cb) {
+        if (this.external) {
+            if (typeof options === 'function') {
+                cb = options;
+                options = null;
+            }
+
+            const binary = options && typeof options.binary === 'boolean' ? options.binary : typeof message !== 'string';
+            this._writeCallback = cb || null;
+            native.server.stream.send(this.external, message, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT);
+            this._writeCallback = null;
+        }
+    }
+
+    ping(message) {
+        if (this.external) {
+            native.server.stream.send(this.external, message, uws.OPCODE_PING);
+        }
+    }
+
+    close(code, data) {
+        if (this.external) {
+            native.server.stream.close(this.external, code === undefined ? 1000 : code, data);
+        }
+    }
+
+    // resets the stream, the client gets no close frame
+    terminate() {
+        if (this.external) {
+            this.stream.close(require('http2').constants.NGHTTP2_CANCEL);
+        }
+    }
+}
+
+native.server.stream.setHandlers((frame, webSocket) => {
+    webSocket.stream.write(frame, webSocket._writeCallback || undefined);
+}, (message, webSocket) => {
+    webSocket.internalOnMessage(message);
+}, (code, message, webSocket) => {
+    webSocket.internalOnClose(code, message);
+    // 1006 is a stream that is gone already
+    if (code !== 1006) {
+        webSocket.stream.end();
+    }
+});
+
 class Server {
     constructor(options) {
         if (!options) {
@@ -112,14 +500,291 @@ class Server {
             if (options.perMessageDeflate.serverNoContextTakeover === false) {
                 nativeOptions |= uws.SLIDING_DEFLATE_WINDOW;
             }
+
+            // outbound: false accepts compressed messages but never sends any, sparing the deflates of sends and broadcasts
+            if (options.perMessageDeflate.outbound === false) {
+                nativeOptions |= uws.NO_OUTBOUND_COMPRESSION;
+            }
         }
 
-        this.serverGroup = native.server.group.create(nativeOptions, options.maxPayload === undefined ? DEFAULT_PAYLOAD_LIMIT : options.maxPayload);
+        // trustedPeers: true for links between our own services, whose text is not validated and whose frames are
+        // not held against maxPayload
+        if (options.trustedPeers) {
+            nativeOptions |= uws.TRUSTED_PEERS;
+        }
+
+        // level, memLevel and strategy (a zlib.constants.Z_* value) of every compressor of the group
+        const deflateOptions = nativeOptions & uws.PERMESSAGE_DEFLATE ? options.perMessageDeflate : {};
+        this.serverGroup = native.server.group.create(nativeOptions, options.maxPayload === undefined ? DEFAULT_PAYLOAD_LIMIT : options.maxPayload,
+            deflateOptions.level, deflateOptions.memLevel, deflateOptions.strategy);
+
+        // compress only sends of at least threshold bytes, adaptive also skips those that stopped shrinking
+        if (nativeOptions & uws.PERMESSAGE_DEFLATE && (options.perMessageDeflate.threshold || options.perMessageDeflate.adaptive)) {
+            native.server.group.setCompressionThreshold(this.serverGroup, options.perMessageDeflate.threshold || 0, !!options.perMessageDeflate.adaptive);
+        }
+
+        // zlib state of each sliding window, the defaults of 15 and 8 cost about 256 KB per socket
+        if (nativeOptions & uws.SLIDING_DEFLATE_WINDOW && (options.perMessageDeflate.serverMaxWindowBits || options.perMessageDeflate.memLevel)) {
+            native.server.group.setDeflateWindow(this.serverGroup, options.perMessageDeflate.serverMaxWindowBits || 15, options.perMessageDeflate.memLevel || 8);
+        }
 
-        this._upgradeCallback = noop;
+        // at most maxWindows clients get a sliding window at once, the others share the compressor until some leave
+        if (nativeOptions & uws.SLIDING_DEFLATE_WINDOW && options.perMessageDeflate.maxWindows) {
+            native.server.group.setMaxDeflateWindows(this.serverGroup, options.perMessageDeflate.maxWindows >>> 0);
+        }
+
+        // clients holding more than backlog bytes unsent get what is queued for them deflated on the threadpool
+        if (nativeOptions & uws.PERMESSAGE_DEFLATE && options.perMessageDeflate.backlog) {
+            native.server.group.setBacklogCompression(this.serverGroup, options.perMessageDeflate.backlog);
+        }
+
+        // clients may keep their context within a memory budget, by default 64 MB of 32 KB windows
+        if (nativeOptions & uws.PERMESSAGE_DEFLATE && options.perMessageDeflate.clientNoContextTakeover === false) {
+            native.server.group.setInflateWindow(this.serverGroup, options.perMessageDeflate.clientMaxWindowBits || 15,
+                options.perMessageDeflate.inflateMemoryBudget === undefined ? 64 * 1024 * 1024 : options.perMessageDeflate.inflateMemoryBudget);
+        }
+
+        // sliding windows are allocated by the first compressed send, this frees them again after idle seconds
+        if (nativeOptions & uws.SLIDING_DEFLATE_WINDOW && options.perMessageDeflate.windowIdleTimeout) {
+            native.server.group.setDeflateWindowIdleTimeout(this.serverGroup, options.perMessageDeflate.windowIdleTimeout);
+        }
+
+        // a string or Buffer every message starts from on links to native uWS clients with the same dictionary, for
+        // small messages of a fixed schema. Anyone else gets plain permessage-deflate
+        if (nativeOptions & uws.PERMESSAGE_DEFLATE && options.perMessageDeflate.dictionary) {
+            native.server.group.setDeflateDictionary(this.serverGroup, options.perMessageDeflate.dictionary);
+        }
+
+        // pings natively every interval ms and terminates clients silent for timeout ms after, no JS sweep needed
+        if (options.heartbeat) {
+            native.server.group.setHeartbeat(this.serverGroup, options.heartbeat.interval | 0, (options.heartbeat.timeout || options.heartbeat.interval) | 0);
+        }
+
+        // { name, channel, capacity } also hands every broadcast and publish to the servers on channel of the other
+        // processes of this host, through a ring of capacity bytes in shared memory named name, and theirs to this
+        // one. Without a name it is the one of the workers of the same cluster master. Linux only, ignored elsewhere
+        if (options.bus) {
+            const bus = options.bus === true ? {} : options.bus;
+            if (!sharedBus) {
+                sharedBus = native.server.bus.join(bus.name || 'uws-bus-' + process.ppid, bus.capacity || 4 * 1024 * 1024);
+            }
+            if (sharedBus) {
+                this._busChannel = bus.channel >>> 0;
+                native.server.bus.attach(sharedBus, this._busChannel, this.serverGroup);
+            }
+        }
+
+        // keeps the last message published to each topic and sends it natively to whoever subscribes after, ahead
+        // of the next publish. Topics are kept until clearLastValue
+        if (options.lastValues) {
+            native.server.group.setLastValues(this.serverGroup, true);
+        }
+
+        // { ringSize, expiry } keeps the last ringSize messages sent to each client with a session, and those broadcast
+        // while it is away, for expiry seconds after it left. See WebSocket#openSession
+        if (options.sessions) {
+            native.server.group.setSessions(this.serverGroup, options.sessions.ringSize || 0, (options.sessions.expiry || 0) >>> 0);
+        }
+
+        // { rate, burst, maxConnections, maxPerAddress } upgrades past which get a 503 natively, 0 or unset is no limit
+        if (options.admission) {
+            const admission = options.admission;
+            native.server.group.setAdmission(this.serverGroup, admission.rate >>> 0, admission.burst >>> 0, admission.maxConnections || 0, admission.maxPerAddress >>> 0);
+        }
+
+        // messages answered natively instead of emitted, like { '2': '3' } for engine.io heartbeats
+        if (options.autoReply) {
+            for (const message in options.autoReply) {
+                native.server.group.setAutoReply(this.serverGroup, message, options.autoReply[message]);
+            }
+        }
+
+        // large plain sends go out in frames of at most this many bytes, natively pings and pongs come between
+        if (options.fragmentSize) {
+            native.server.group.setFragmentSize(this.serverGroup, options.fragmentSize);
+        }
+
+        // small messages to a client that is behind are copied into shared chunks of this many bytes
+        if (options.sendChunkSize) {
+            native.server.group.setSendChunkSize(this.serverGroup, options.sendChunkSize);
+        }
+
+        // clients making at least this many small sends a second have Nagle on, so that the kernel coalesces their
+        // bursts into fewer packets, the others keep options.noDelay. Looked at once a second
+        if (options.noDelay === false) {
+            native.server.group.setNoDelay(this.serverGroup, false);
+        }
+        if (options.adaptiveNoDelay) {
+            native.server.group.setAdaptiveNoDelay(this.serverGroup, options.adaptiveNoDelay >>> 0);
+        }
+
+        // about this many bytes wait in the kernel for a slow client, the rest stays queued for conflation and maxBackpressure
+        if (options.notSentLowat) {
+            native.server.group.setNotSentLowat(this.serverGroup, options.notSentLowat);
+        }
+
+        // bytes per second each client is sent at most, or { bytes, burst } with burst defaulting to a tenth of a
+        // second's worth. For clients on slow links, the excess waits queued where conflation and ttl still apply
+        if (options.rateLimit) {
+            const rateLimit = typeof options.rateLimit === 'object' ? options.rateLimit : { bytes: options.rateLimit };
+            native.server.group.setRateLimit(this.serverGroup, rateLimit.bytes || 0, rateLimit.burst || 0);
+        }
+
+        if (options.maxBackpressure) {
+            native.server.group.setMaxBackpressure(this.serverGroup, options.maxBackpressure,
+                options.backpressurePolicy === 'close' ? uws.BACKPRESSURE_CLOSE : uws.BACKPRESSURE_DROP);
+        }
+
+        // { messages, bytes, window } per client and window ms, past which messages are dropped natively
+        // (see inboundDropped) or, with policy 'close', the client is closed with 1008
+        if (options.inboundLimit) {
+            const limit = options.inboundLimit;
+            native.server.group.setInboundLimit(this.serverGroup, limit.messages >>> 0, limit.bytes || 0, limit.window || 1000,
+                limit.policy === 'close' ? uws.BACKPRESSURE_CLOSE : uws.BACKPRESSURE_DROP);
+        }
+
+        // { bytes, age, callback } calls callback(webSocket, bytes, age) once a client holds more than bytes queued
+        // for it or its oldest queued message is older than age ms, to drop or close laggards early. Once until it
+        // got back below both, checked every age / 2 ms (100 without an age)
+        if (options.slowConsumer) {
+            const slowConsumer = options.slowConsumer;
+            native.server.group.setSlowConsumer(this.serverGroup, slowConsumer.bytes || 0, slowConsumer.age >>> 0, (bytes, age, webSocket) => {
+                slowConsumer.callback(webSocket, bytes, age);
+            });
+        }
+
+        // samples TCP_INFO of clients with messages queued every tcpInfoSampling ms, see WebSocket#tcpInfo. Sends with
+        // compress then go uncompressed to clients sampled closer than compressionMinRtt ms, where deflating costs more
+        // than it saves
+        if (options.tcpInfoSampling) {
+            native.server.group.setTcpInfoSampling(this.serverGroup, options.tcpInfoSampling >>> 0);
+        }
+        if (options.compressionMinRtt) {
+            native.server.group.setCompressionMinRtt(this.serverGroup, Math.round(options.compressionMinRtt * 1000));
+        }
+
+        // a client whose messages leave more than this many bytes queued for it is not read from until they drained
+        if (options.readBackpressure) {
+            native.server.group.setReadBackpressure(this.serverGroup, options.readBackpressure);
+        }
+
+        // bytes all clients together may hold in partly received messages, the clients holding the most
+        // are closed with 1009 to stay under it
+        if (options.reassemblyBudget) {
+            native.server.group.setReassemblyBudget(this.serverGroup, options.reassemblyBudget);
+        }
+
+        // times each message from its read to the handler's return, each send until written, deflates, inflates
+        // and upgrades into the histograms of metrics. Two clock reads each, so off by default
+        if (options.latencyHistograms) {
+            native.server.group.setLatencyHistograms(this.serverGroup, true);
+        }
+
+        // times the loop's work for this server's clients into the cpu metrics, in ns: parsing, the handlers,
+        // compression and flushing. { topSockets, sampling } also estimates the clients costing the most, see topSockets
+        if (options.cpuAccounting) {
+            const cpuAccounting = typeof options.cpuAccounting === 'object' ? options.cpuAccounting : {};
+            native.server.group.setCpuAccounting(this.serverGroup, true, cpuAccounting.topSockets || 0, cpuAccounting.sampling || 16);
+        }
+
+        // times the native socket handlers into loopStats.callbackNanos, per process as well
+        if (options.callbackTiming) {
+            native.setCallbackTiming(true);
+        }
+
+        // writes are deferred per process, not per server, since all servers share one loop
+        if (options.deferWrites) {
+            native.setDeferredWrites(true);
+        }
+
+        // large plain TCP sends skip the kernel copy on Linux, also per process
+        if (options.zeroCopyThreshold) {
+            native.setZeroCopyThreshold(options.zeroCopyThreshold);
+        }
+
+        // compressed sends of at least this many bytes deflate on the libuv threadpool, also per process
+        if (options.compressionOffloadThreshold) {
+            native.setCompressionOffloadThreshold(options.compressionOffloadThreshold);
+        }
+
+        // compressed messages received of at least this many bytes inflate on the libuv threadpool, also per process
+        if (options.inflationOffloadThreshold) {
+            native.setInflationOffloadThreshold(options.inflationOffloadThreshold);
+        }
+
+        // binary messages of at least this many bytes that were reassembled or inflated arrive in the
+        // buffer they were put together in instead of a copy, also per process
+        if (options.zeroCopyMessageThreshold) {
+            native.setZeroCopyMessageThreshold(options.zeroCopyMessageThreshold);
+        }
+
+        // binary messages shorter than this, at most 8 KB, are views of a shared 64 KB slab instead of Buffers
+        // of their own, also per process. One kept holds on to its whole slab, copy those kept for long
+        if (options.messagePoolThreshold) {
+            native.setMessagePoolThreshold(options.messagePoolThreshold);
+        }
+
+        // pure ASCII text messages of at least this many bytes become external strings, not copied onto the JS heap
+        if (options.externalStringThreshold) {
+            native.setExternalStringThreshold(options.externalStringThreshold);
+        }
+
+        // text messages arrive as Buffers, for parsing JSON natively. Both also per process
+        if (options.textAsBuffer) {
+            native.setTextAsBuffer(true);
+        }
+
+        // busy sockets read until the kernel runs dry, up to { reads, bytes } per event, also per process
+        if (options.readBudget) {
+            native.setReadBudget(options.readBudget.reads || 1, options.readBudget.bytes === undefined ? 1024 * 1024 : options.readBudget.bytes);
+        }
+
+        // a client draining a big queue writes at most { bytes, messages } at a time and then lets the others
+        // write before it goes on, so their latency does not depend on the biggest one. Also per process
+        if (options.writeBudget) {
+            native.setWriteBudget(options.writeBudget.bytes || 0, options.writeBudget.messages >>> 0);
+        }
+
+        // 'realtime' clients are written to first each round and 'bulk' ones last, the latter sharing bulkShare
+        // bytes a round (256 KB by default, per process) and reading once per event, so that exports do not slow
+        // down trading or chat clients served by the same process
+        if (options.qos) {
+            const qos = ['realtime', 'interactive', 'bulk'].indexOf(options.qos);
+            native.server.group.setQos(this.serverGroup, qos === -1 ? 1 : qos);
+        }
+        if (options.bulkShare !== undefined) {
+            native.setBulkShare(options.bulkShare);
+        }
+
+        // compressed sends of at least { minLength } bytes keep their deflated frame, up to { budget } bytes for all
+        // of them, so that sending the same message again does not deflate it again. Also per process
+        if (options.compressedCache) {
+            native.setCompressedCache(options.compressedCache.budget || 0, options.compressedCache.minLength === undefined ? 1024 : options.compressedCache.minLength);
+        }
+
+        // sizes of the receive and zlib buffers, 300 KB by default, optionally on huge pages. Also per process
+        if (options.recvBufferSize || options.zlibBufferSize || options.hugePages) {
+            native.setBufferSettings(options.recvBufferSize || 300 * 1024, options.zlibBufferSize || 300 * 1024, !!options.hugePages);
+        }
+
+        // with batchUpgrades, the upgrades handleUpgrade gets within a loop iteration are made in one native call at its
+        // end, for reconnect storms. Their callbacks come a little later in exchange
+        this._batchUpgrades = !!options.batchUpgrades;
+        this._pendingUpgrades = [];
+
+        // with listen, upgrades not made by handleUpgrade or adopt go to _listenCallback
+        this._upgradeCallback = this._listenCallback = noop;
+        this._verifyClient = options.verifyClient;
+        this._verifyHeaders = options.verifyHeaders || [];
+        this._cert = options.cert;
+        this._key = options.key;
         this._noDelay = options.noDelay === undefined ? true : options.noDelay;
+        this._maxPayload = options.maxPayload === undefined ? DEFAULT_PAYLOAD_LIMIT : options.maxPayload;
 
+        // sockets by id, for the events of eventRing
+        const sockets = [];
         native.server.group.onDisconnection(this.serverGroup, (external, code, message, webSocket) => {
+            sockets[external] = undefined;
             webSocket.external = null;
             process.nextTick(() => {
                 webSocket.internalOnClose(code, message);
@@ -127,15 +792,62 @@ class Server {
             native.clearUserData(external);
         });
 
-        native.server.group.onMessage(this.serverGroup, (message, webSocket) => {
-            webSocket.internalOnMessage(message);
+        // with streamMessages, 'chunk' (chunk, remaining, fin, binary) fires for every piece as it arrives
+        // and 'message' never does
+        if (options.streamMessages) {
+            native.server.group.onMessageChunk(this.serverGroup, (chunk, remaining, fin, opCode, webSocket) => {
+                webSocket.internalOnChunk(chunk, remaining, fin, opCode === uws.OPCODE_BINARY);
+            });
+        } else if (options.batchMessages) {
+            // every message of one read crosses into JS in a single call, sliced out of one Buffer here
+            native.server.group.onMessageBatch(this.serverGroup, (data, descriptors, webSocket) => {
+                for (let i = 0; i < descriptors.length && webSocket.external; i += 3) {
+                    const offset = descriptors[i], length = descriptors[i + 1];
+                    // same filter as the unbatched native handler
+                    if (length === 1 && data[offset] === 65) {
+                        continue;
+                    }
+                    webSocket.internalOnMessage(descriptors[i + 2] === uws.OPCODE_BINARY ? data.slice(offset, offset + length) : data.toString('utf8', offset, offset + length));
+                }
+            });
+        } else {
+            native.server.group.onMessage(this.serverGroup, (message, webSocket) => {
+                webSocket.internalOnMessage(message);
+            });
+        }
+
+        native.server.group.onDrain(this.serverGroup, (webSocket) => {
+            webSocket.internalOnDrain();
         });
 
-        native.server.group.onConnection(this.serverGroup, (external) => {
+        this._connected = (external) => {
             const webSocket = new WebSocket(external);
             native.setUserData(external, webSocket);
-            this._upgradeCallback(webSocket);
+            if (options.eventRing) {
+                sockets[external] = webSocket;
+            }
+            return webSocket;
+        };
+        native.server.group.onConnection(this.serverGroup, (external) => {
+            this._upgradeCallback(this._connected(external));
         });
+
+        // with eventRing, the messages of a loop iteration reach JS in one call, read out of shared memory
+        // instead of passed one by one: { events, bytes } sizes the ring and the arena of their payloads
+        if (options.eventRing && !options.streamMessages && !options.batchMessages) {
+            const events = options.eventRing.events || 4096, bytes = options.eventRing.bytes || 1024 * 1024;
+            const ring = new Uint32Array(new SharedArrayBuffer(events * 16)), arena = Buffer.from(new SharedArrayBuffer(bytes));
+            native.server.group.setEventRing(this.serverGroup, ring.buffer, arena.buffer, (count) => {
+                for (let i = 0; i < count * 4; i += 4) {
+                    const webSocket = sockets[ring[i + 1]], offset = ring[i + 2], length = ring[i + 3];
+                    if (webSocket && webSocket.external) {
+                        // the arena is written over once this returns
+                        webSocket.internalOnMessage(ring[i] === uws.OPCODE_BINARY ?
+                            Buffer.from(arena.subarray(offset, offset + length)) : arena.toString('utf8', offset, offset + length));
+                    }
+                }
+            });
+        }
     }
 
     handleUpgrade(request, socket, upgradeHead, callback) {
@@ -144,23 +856,298 @@ class Server {
         if (socketHandle && secKey && secKey.length === 24) {
             const sslState = socket.ssl ? native.getSSLContext(socket.ssl) : null;
             socket.setNoDelay(this._noDelay);
-            const ticket = native.transfer(socketHandle.fd === -1 ? socketHandle : socketHandle.fd, sslState);
-            socket.on('close', () => {
-                if (this.serverGroup) {
-                    this._upgradeCallback = callback;
-                    native.upgrade(this.serverGroup, ticket, secKey, request.headers['sec-websocket-extensions'], request.headers['sec-websocket-protocol']);
+
+            // the fd is taken over right away where Node lets go of it, so the upgrade completes in this tick
+            if (socketHandle.fd !== -1 && this.serverGroup) {
+                if (this._batchUpgrades) {
+                    if (!this._pendingUpgrades.length) {
+                        setImmediate(() => this._upgradeBatch());
+                    }
+                    this._pendingUpgrades.push({ request, socket, socketHandle, sslState, secKey, callback });
+                    return;
                 }
-            });
-            setImmediate(() => {
-                socket.destroy();
-            });
+                this._upgradeCallback = callback;
+                const upgraded = native.upgradeSocket(this.serverGroup, socketHandle, sslState, secKey, request.headers['sec-websocket-extensions'], request.headers['sec-websocket-protocol']);
+                this._upgradeCallback = this._listenCallback;
+                if (upgraded) {
+                    socket.destroy();
+                    return;
+                }
+            }
+            this._transferUpgrade(request, socket, socketHandle, sslState, secKey, callback);
         } else {
             return abortConnection(socket, 400, 'Bad Request');
         }
     }
 
+    // for a handle whose fd cannot be taken: a dup of it is upgraded once Node closed its socket
+    _transferUpgrade(request, socket, socketHandle, sslState, secKey, callback) {
+        const ticket = native.transfer(socketHandle.fd === -1 ? socketHandle : socketHandle.fd, sslState);
+        socket.on('close', () => {
+            if (this.serverGroup) {
+                this._upgradeCallback = callback;
+                native.upgrade(this.serverGroup, ticket, secKey, request.headers['sec-websocket-extensions'], request.headers['sec-websocket-protocol']);
+                this._upgradeCallback = this._listenCallback;
+            }
+        });
+        setImmediate(() => {
+            socket.destroy();
+        });
+    }
+
+    // the upgrades queued by handleUpgrade, all in one native call whose result holds their sockets
+    _upgradeBatch() {
+        const pending = this._pendingUpgrades.filter((upgrade) => !upgrade.socket.destroyed);
+        this._pendingUpgrades = [];
+        if (!this.serverGroup || !pending.length) {
+            return;
+        }
+
+        const results = native.upgradeSockets(this.serverGroup, pending.map((upgrade) => upgrade.socketHandle), pending.map((upgrade) => upgrade.sslState),
+            pending.map((upgrade) => upgrade.secKey), pending.map((upgrade) => upgrade.request.headers['sec-websocket-extensions']),
+            pending.map((upgrade) => upgrade.request.headers['sec-websocket-protocol']));
+        // every socket is known before any callback can close one of the others
+        const webSockets = results.map((result) => result ? this._connected(result) : null);
+        for (let i = 0; i < pending.length; i++) {
+            const upgrade = pending[i];
+            if (results[i] === false) {
+                this._transferUpgrade(upgrade.request, upgrade.socket, upgrade.socketHandle, upgrade.sslState, upgrade.secKey, upgrade.callback);
+                continue;
+            }
+            upgrade.socket.destroy();
+            if (webSockets[i]) {
+                upgrade.callback(webSockets[i]);
+            }
+        }
+    }
+
+    // an extended CONNECT (RFC 8441) from the 'stream' event of an http2 server, which needs to be created with
+    // settings: { enableConnectProtocol: true }. Such clients share the connection they are on and are not in
+    // this server's group: no permessage-deflate, broadcast, publish, metrics nor clients list for them
+    handleStream(stream, headers, callback) {
+        if (headers[':method'] !== 'CONNECT' || headers[':protocol'] !== 'websocket' || headers['sec-websocket-version'] !== '13') {
+            stream.respond({ ':status': 400 });
+            stream.end();
+            return;
+        }
+
+        stream.respond({ ':status': 200 });
+        callback(new StreamWebSocket(stream, this._maxPayload));
+    }
+
+    // sends to every connected client in one native call, framing the message only once
+    broadcast(message, options) {
+        if (this.serverGroup) {
+            if (message instanceof PreparedFile) {
+                if (message.external) {
+                    native.server.group.broadcastFile(this.serverGroup, message.external);
+                }
+                return;
+            }
+            if (message instanceof PreparedMessage && !(message = message.external)) {
+                return;
+            }
+            const binary = options && typeof options.binary === 'boolean' ? options.binary : typeof message !== 'string';
+            native.server.group.broadcast(this.serverGroup, message, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, !!(options && options.compress), options && options.conflationKey, options && options.ttl);
+            if (this._busChannel !== undefined) {
+                native.server.bus.broadcast(sharedBus, this._busChannel, message, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, !!(options && options.compress));
+            }
+        }
+    }
+
+    // sends sockets[i] its own messages[i] in one native call. messages can also be one buffer
+    // holding them back to back, with options.offsets a Uint32Array of sockets.length + 1 boundaries
+    sendMany(sockets, messages, options) {
+        const externals = new Array(sockets.length);
+        for (let i = 0; i < sockets.length; i++) {
+            externals[i] = sockets[i].external || 0;
+        }
+        const binary = options && typeof options.binary === 'boolean' ? options.binary : !Array.isArray(messages) || typeof messages[0] !== 'string';
+        native.server.sendMany(externals, messages, options && options.offsets, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, !!(options && options.compress));
+    }
+
+    // rooms are topics joined with WebSocket#subscribe. Sends to everyone in any of rooms
+    // (all of them with options.intersect, every client if rooms is empty) who is in none of except
+    publishRooms(rooms, except, message, options) {
+        if (this.serverGroup) {
+            if (message instanceof PreparedMessage && !(message = message.external)) {
+                return;
+            }
+            const binary = options && typeof options.binary === 'boolean' ? options.binary : typeof message !== 'string';
+            native.server.group.publishRooms(this.serverGroup, rooms || [], except || [], !!(options && options.intersect), message,
+                binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, !!(options && options.compress));
+        }
+    }
+
+    // message is converted to UTF-8 and framed once, the result can be passed to broadcast,
+    // publish and publishRooms (or WebSocket#sendPrepared) any number of times until finalized.
+    // Meant for already encoded packets, like an engine.io packet emitted to a room
+    prepareMessage(message, options) {
+        const binary = options && typeof options.binary === 'boolean' ? options.binary : typeof message !== 'string';
+        return new PreparedMessage(native.server.group.prepareMessage(this.serverGroup, message, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, !!(options && options.compress)));
+    }
+
+    // length bytes of the open file fd from offset as one message, binary unless options.binary is false, for
+    // WebSocket#sendPrepared and broadcast until finalized. Their payload goes from the page cache to the socket
+    // without a copy on plain and kTLS sockets, and is read for each of the others. The range must not change and
+    // fd must stay open until finalize and every send of it is written
+    prepareFile(fd, offset, length, options) {
+        const binary = !(options && options.binary === false);
+        return new PreparedFile(native.server.prepareFile(fd, offset, length, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT));
+    }
+
+    // sends to every client subscribed to topic, merged with its other publishes of this iteration
+    publish(topic, message, options) {
+        if (this.serverGroup) {
+            if (message instanceof PreparedMessage && !(message = message.external)) {
+                return;
+            }
+            const binary = options && typeof options.binary === 'boolean' ? options.binary : typeof message !== 'string';
+            native.server.group.publish(this.serverGroup, topic, message, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, !!(options && options.compress), options && options.conflationKey, options && options.ttl);
+            if (this._busChannel !== undefined) {
+                native.server.bus.publish(sharedBus, this._busChannel, topic, message, binary ? uws.OPCODE_BINARY : uws.OPCODE_TEXT, !!(options && options.compress));
+            }
+        }
+    }
+
+    // forgets the last message of topic kept for options.lastValues
+    clearLastValue(topic) {
+        if (this.serverGroup) {
+            native.server.group.clearLastValue(this.serverGroup, topic);
+        }
+    }
+
+    // messages dropped for going over options.inboundLimit
+    get inboundDropped() {
+        return this.serverGroup ? native.server.group.getInboundDropped(this.serverGroup) : 0;
+    }
+
+    // counts of ping round trips of all clients, element i those of 2^i to 2^(i + 1) microseconds
+    get rttHistogram() {
+        return this.serverGroup ? native.server.group.getRttHistogram(this.serverGroup) : [];
+    }
+
+    // what memoryUsage is summed over all clients, kept as counters so it is cheap to poll. pooledBlocks is what
+    // the native allocator keeps of freed message blocks for reuse, shared by all servers of the process
+    get memoryStats() {
+        return memoryStats(this.serverGroup ? native.server.group.getMemoryStats(this.serverGroup) : [0, 0, 0, 0]);
+    }
+
+    // counters of this server since it was created, indexed as uws.METRICS: syscalls, message allocations from
+    // the block pool or the heap, frames in and sends per opcode and how well deflate did. queueingSockets is the
+    // clients with messages queued right now. The histograms of uws.LATENCY_HISTOGRAMS follow. One Float64Array
+    // refilled by each call, so it is cheap to poll
+    get metrics() {
+        if (!this._metrics) {
+            this._metrics = new Float64Array(uws.METRICS.length + uws.LATENCY_HISTOGRAMS.length * uws.LATENCY_BUCKETS);
+        }
+        if (this.serverGroup) {
+            native.server.group.getMetrics(this.serverGroup, this._metrics);
+        }
+        return this._metrics;
+    }
+
+    // the clients whose reads cost the most with options.cpuAccounting.topSockets, costliest first, each with its
+    // estimated nanoseconds and by how much that may be too high
+    get topSockets() {
+        return this.serverGroup ? native.server.group.getTopSockets(this.serverGroup).map(entry => ({ socket: entry[0], nanoseconds: entry[1], error: entry[2] })) : [];
+    }
+
+    // of the loop all servers of the process share: its iterations, wakeups from other threads and the ns spent
+    // in the native socket handlers while options.callbackTiming, split into the JS they called and the native
+    // work (parsing, compression, flushing). idleNanos is the time the loop was blocked for events, as in
+    // performance.eventLoopUtilization. All are cumulative, so saturation is the difference between two reads.
+    // The syscalls per server are in metrics
+    get loopStats() {
+        const stats = native.getLoopStats();
+        return { iterations: stats[0], wakeups: stats[1], callbackNanos: stats[2], jsNanos: stats[3], nativeNanos: stats[2] - stats[3], idleNanos: stats[4] };
+    }
+
+    // of options.compressedCache, per process like loopStats
+    get compressedCacheStats() {
+        const stats = native.getCompressedCacheStats();
+        return { entries: stats[0], bytes: stats[1], hits: stats[2], misses: stats[3] };
+    }
+
+    // gives back what the native side keeps for reuse, shared by all servers of the process like loopStats: with
+    // uws.TRIM_BUFFERS the spare message and deflate buffers, with uws.TRIM_ALL (the default) also the free message
+    // blocks and socket slots and the free pages of the heap. After a burst or on memory pressure. Returns the bytes
+    trim(level) {
+        return native.trim(level === undefined ? uws.TRIM_ALL : level);
+    }
+
+    // closes every client with 1001 spread over options.spread ms instead of all at once, refusing new
+    // ones meanwhile. Messages still queued are written first, whoever is left at options.deadline is
+    // terminated. progress is called with how many clients are left, 0 when done
+    drain(options, progress) {
+        if (this.serverGroup) {
+            const spread = options && options.spread || 0;
+            native.server.group.drain(this.serverGroup, spread, options && options.deadline || spread, progress);
+        }
+    }
+
+    // writes what clients send, frame by frame with its timing, to a log at path that benchmarks/replay.cpp plays
+    // back. One in sampling (1 by default) clients is recorded. Blocking writes, for a while at a time. Returns
+    // whether path could be opened
+    startRecording(path, sampling) {
+        return this.serverGroup ? native.server.group.startRecording(this.serverGroup, String(path), sampling >>> 0 || 1) : false;
+    }
+
+    stopRecording() {
+        if (this.serverGroup) {
+            native.server.group.stopRecording(this.serverGroup);
+        }
+    }
+
+    // for a deploy: passes the clients, connection and all, to the process at the other end of fd, a connected
+    // unix socket such as an extra 'pipe' of child_process.spawn, there taken up by adopt. Here they close with
+    // 1012, the peer notices nothing. Clients over TLS or keeping a compression context for what they send stay.
+    // Returns how many went. Stop listening first, it blocks until all is written. Same build on both ends
+    handOff(fd) {
+        return this.serverGroup ? native.server.group.handOff(this.serverGroup, fd) : 0;
+    }
+
+    // takes the clients handOff passes on fd as connections of this server, until the other end closes fd, calling
+    // callback with each WebSocket as handleUpgrade does
+    adopt(fd, callback) {
+        if (!this.serverGroup) {
+            return 0;
+        }
+        this._upgradeCallback = callback;
+        const adopted = native.server.group.adoptHandOff(this.serverGroup, fd);
+        this._upgradeCallback = this._listenCallback;
+        return adopted;
+    }
+
+    // accepts and upgrades connections on port of host (every address if left out) natively, without Node's http
+    // server or any JS object for a request. callback gets each WebSocket as with handleUpgrade. options.verifyClient,
+    // if given, is called with { url } plus those of options.verifyHeaders (lower case names) the request has, and
+    // returns true to let the client in, false for a 401 or a status to refuse it with. With options.cert and
+    // options.key (PEM file paths) it speaks TLS, resuming sessions on any worker. Returns whether the port could be bound
+    listen(port, host, callback) {
+        if (typeof host === 'function') {
+            callback = host;
+            host = undefined;
+        }
+        if (!this.serverGroup) {
+            return false;
+        }
+        this._upgradeCallback = this._listenCallback = callback || noop;
+        return native.server.group.listen(this.serverGroup, port, host, this._verifyClient, this._verifyHeaders, this._cert, this._key);
+    }
+
+    // times this process fell more than the ring of options.bus behind and skipped messages of its siblings
+    get busDropped() {
+        return sharedBus ? native.server.bus.getDropped(sharedBus) : 0;
+    }
+
     close() {
         if (this.serverGroup) {
+            if (this._busChannel !== undefined) {
+                native.server.bus.attach(sharedBus, this._busChannel, null);
+                this._busChannel = undefined;
+            }
+            native.server.group.stopListening(this.serverGroup);
             native.server.group.close(this.serverGroup);
             this.serverGroup = null;
         }
@@ -168,6 +1155,7 @@ class Server {
 }
 
 uws.Server = Server;
+uws.StreamWebSocket = StreamWebSocket;
 uws.native = native;
 
 module.exports = uws;
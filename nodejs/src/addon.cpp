@@ -1,18 +1,64 @@
 #include "../../uWebSockets/src/Hub.h"
+#include "../../uWebSockets/src/StreamWebSocket.h"
+#include "../../uWebSockets/src/SharedBus.h"
 #include "addon.h"
 
 void Main(Local<Object> exports)
 {
     Isolate *isolate = exports->GetIsolate();
+#if NODE_MAJOR_VERSION >= 10
+    addon = new AddonData(isolate, node::GetCurrentEventLoop(isolate));
+    node::AddEnvironmentCleanupHook(isolate, cleanupAddon, addon);
+#else
+    addon = new AddonData(isolate, uv_default_loop());
+#endif
     exports->Set(isolate->GetCurrentContext(), String::NewFromUtf8(isolate, "server", NewStringType::kNormal).ToLocalChecked(), Namespace(isolate).object);
     NODE_SET_METHOD(exports, "getSSLContext", getSSLContext);
     NODE_SET_METHOD(exports, "setUserData", setUserData);
     NODE_SET_METHOD(exports, "clearUserData", clearUserData);
     NODE_SET_METHOD(exports, "getAddress", getAddress);
+    NODE_SET_METHOD(exports, "getBufferedAmount", getBufferedAmount);
+    NODE_SET_METHOD(exports, "getRtt", getRtt);
+    NODE_SET_METHOD(exports, "getTcpInfo", getTcpInfo);
+    NODE_SET_METHOD(exports, "getMemoryUsage", getMemoryUsage);
+    NODE_SET_METHOD(exports, "setReadingPaused", setReadingPaused);
+    NODE_SET_METHOD(exports, "setNoDelay", setSocketNoDelay);
     NODE_SET_METHOD(exports, "transfer", transfer);
     NODE_SET_METHOD(exports, "upgrade", upgrade);
+    NODE_SET_METHOD(exports, "upgradeSocket", upgradeSocket);
+    NODE_SET_METHOD(exports, "upgradeSockets", upgradeSockets);
     NODE_SET_METHOD(exports, "setNoop", setNoop);
-    registerCheck(isolate);
+    NODE_SET_METHOD(exports, "setSendCompletion", setSendCompletion);
+    NODE_SET_METHOD(exports, "getLoopStats", getLoopStats);
+    NODE_SET_METHOD(exports, "setCallbackTiming", setCallbackTiming);
+    NODE_SET_METHOD(exports, "trim", trim);
+    NODE_SET_METHOD(exports, "setCompressedCache", setCompressedCache);
+    NODE_SET_METHOD(exports, "getCompressedCacheStats", getCompressedCacheStats);
+    NODE_SET_METHOD(exports, "setDeferredWrites", setDeferredWrites);
+    NODE_SET_METHOD(exports, "setZeroCopyThreshold", setZeroCopyThreshold);
+    NODE_SET_METHOD(exports, "setReadBudget", setReadBudget);
+    NODE_SET_METHOD(exports, "setWriteBudget", setWriteBudget);
+    NODE_SET_METHOD(exports, "setBulkShare", setBulkShare);
+    NODE_SET_METHOD(exports, "setCompressionOffloadThreshold", setCompressionOffloadThreshold);
+    NODE_SET_METHOD(exports, "setInflationOffloadThreshold", setInflationOffloadThreshold);
+    NODE_SET_METHOD(exports, "setZeroCopyMessageThreshold", setZeroCopyMessageThreshold);
+    NODE_SET_METHOD(exports, "setMessagePoolThreshold", setMessagePoolThreshold);
+    NODE_SET_METHOD(exports, "setExternalStringThreshold", setExternalStringThreshold);
+    NODE_SET_METHOD(exports, "setTextAsBuffer", setTextAsBuffer);
+    NODE_SET_METHOD(exports, "setBufferSettings", setBufferSettings);
+    NODE_SET_METHOD(exports, "registerFrame", registerFrame);
+    registerCheck(addon);
+#if NODE_MAJOR_VERSION >= 12
+    registerTracing();
+#endif
 }
 
+#if NODE_MAJOR_VERSION >= 10
+// context aware, so that every worker_thread loading it gets a hub of its own
+NODE_MODULE_INIT()
+{
+    Main(exports);
+}
+#else
 NODE_MODULE(uws, Main)
+#endif
@@ -4,6 +4,7 @@
 #include <openssl/ssl.h>
 #include <uv.h>
 #include <cstring>
+#include <deque>
 
 #if NODE_MAJOR_VERSION>=10
 #define NODE_WANT_INTERNALS 1
@@ -43,20 +44,152 @@ class TLSWrapSSLGetter : public node::TLSWrap {
 using namespace std;
 using namespace v8;
 
-uWS::Hub hub(0);
-uv_check_t check;
-Persistent<Function> noop;
+// what the addon has per isolate, the main thread's or that of a worker_thread, each running on a loop of its own
+struct AddonData {
+    Isolate *isolate;
+    uWS::Hub hub;
+    uv_check_t *check;
+    Persistent<Function> noop;
+
+    // sends given a numeric id instead of a function complete into these lists,
+    // which are handed to JS once per loop iteration instead of one call per send
+    std::vector<uint32_t> completedSends, cancelledSends;
+    Persistent<Function> sendCompletionHandler;
+
+    // binary messages of at least this many bytes that were reassembled or inflated are handed to JS in
+    // the buffer they are in instead of copied, 0 for never
+    size_t zeroCopyMessageThreshold = 0;
+    // binary messages shorter than this are copied into a slab shared by many, each a view of it, instead of
+    // a backing store of their own. As with Node's Buffer pool, one of them kept keeps its whole slab. 0 for never
+    size_t messagePoolThreshold = 0;
+    static const size_t MESSAGE_POOL_SIZE = 64 * 1024;
+    Persistent<ArrayBuffer> messagePool;
+    char *messagePoolData = nullptr;
+    size_t messagePoolOffset = 0;
+    // pure ASCII text messages of at least this many bytes become external strings, 0 for never
+    size_t externalStringThreshold = 0;
+    // text messages arrive as Buffers, for JSON parsers of their own
+    bool textAsBuffer = false;
+
+    // sockets as JS sees them: a small integer id, which is the slot plus one and kept as the socket's
+    // user data, instead of an External and a Persistent of their own each. Ids of disconnected sockets
+    // are reused, slots never move
+    struct SocketSlot {
+        uWS::WebSocket *webSocket = nullptr;
+        Persistent<Value> object;
+    };
+    std::deque<SocketSlot> socketSlots;
+    std::vector<uint32_t> freeSocketIds;
+
+    // of createGroup, their sockets are closed when the isolate goes away
+    std::vector<uWS::Group *> groups;
+
+    // of registerFrame, framed once and kept until the isolate goes away, as sockets may reference them
+    // while queued. Elements of a deque stay where they are
+    std::deque<std::string> constantFrames;
+
+    // of every StreamWebSocket, which has the JS object it was created for as user data
+    Persistent<Function> streamWriteHandler, streamMessageHandler, streamCloseHandler;
+
+    // JS was called since the check last ran, whose microtasks and nextTicks it then drains
+    bool calledJs = false;
+
+    AddonData(Isolate *isolate, uv_loop_t *loop) : isolate(isolate), hub(0, 16777216, uWS::CompressionSettings(), uWS::BufferSettings(), (uS::Loop *) loop) {}
+};
+
+// every isolate has a thread of its own
+thread_local AddonData *addon = nullptr;
+
+Local<Array> takeSendIds(Isolate *isolate, std::vector<uint32_t> &ids) {
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Array> array = Array::New(isolate, (int) ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        array->Set(context, (uint32_t) i, Integer::NewFromUnsigned(isolate, ids[i])).Check();
+    }
+    ids.clear();
+    return array;
+}
+
+// native events call JS through here, so that the check knows there is something to drain and the loop
+// stats tell the time in JS from the native work around it
+inline void callJs(Isolate *isolate, const Persistent<Function> &function, int argc, Local<Value> *argv) {
+    addon->calledJs = true;
+    uS::LoopStats::Foreign foreign = addon->hub.timeForeign();
+    Local<Function>::New(isolate, function)->Call(isolate->GetCurrentContext(), Null(isolate), argc, argv);
+}
+
+struct GroupData;
+void flushRing(Isolate *isolate, GroupData *groupData, bool fromCheck = false);
 
-void registerCheck(Isolate *isolate) {
-    uv_check_init((uv_loop_t *)hub.getLoop(), &check);
-    check.data = isolate;
-    uv_check_start(&check, [](uv_check_t *check) {
-        Isolate *isolate = (Isolate *)check->data;
+void registerCheck(AddonData *addonData) {
+    addonData->check = new uv_check_t;
+    uv_check_init((uv_loop_t *)addonData->hub.getLoop(), addonData->check);
+    addonData->check->data = addonData;
+    uv_check_start(addonData->check, [](uv_check_t *check) {
+        AddonData *addonData = (AddonData *)check->data;
+        Isolate *isolate = addonData->isolate;
         HandleScope hs(isolate);
-        // TODO: Check if we can use new callbback
-        node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), Local<Function>::New(isolate, noop), 0, nullptr);
+        for (uWS::Group *group : addonData->groups) {
+            flushRing(isolate, static_cast<GroupData *>(group->getUserData()), true);
+        }
+        if (!addonData->completedSends.empty() || !addonData->cancelledSends.empty()) {
+            // sends completing while this runs end up in the next batch, the call drains for both
+            addonData->calledJs = false;
+            Local<Value> argv[] = {takeSendIds(isolate, addonData->completedSends), takeSendIds(isolate, addonData->cancelledSends)};
+            node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), Local<Function>::New(isolate, addonData->sendCompletionHandler), 2, argv);
+            return;
+        }
+        // iterations that did not enter JS, like idle or HTTP-only ones, have nothing to drain
+        if (addonData->calledJs) {
+            addonData->calledJs = false;
+            node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), Local<Function>::New(isolate, addonData->noop), 0, nullptr);
+        }
+    });
+    uv_unref((uv_handle_t *)addonData->check);
+}
+
+#if NODE_MAJOR_VERSION >= 12
+// the tracepoints of uS::Trace as trace_events of category uws, for node --trace-event-categories uws or
+// trace_events.createTracing. Spans of a socket are nestable async events with its address as id
+v8::TracingController *tracingController;
+
+void traceEvent(uS::Trace::Event event, char phase, const void *id, uint64_t arg) {
+    // the phases and flags of trace_event_common.h
+    const unsigned int TRACE_EVENT_FLAG_HAS_ID = 1 << 1, TRACE_EVENT_SCOPE_THREAD = 2 << 3;
+    const uint8_t TRACE_VALUE_TYPE_UINT = 2;
+    static const char *argNames[uS::Trace::EVENTS] = {"fd", "fd", "length", "length", "length", "length", "fd", "fd"};
+    unsigned int flags = phase == 'b' || phase == 'e' ? TRACE_EVENT_FLAG_HAS_ID : (phase == 'I' ? TRACE_EVENT_SCOPE_THREAD : 0);
+    tracingController->AddTraceEvent(phase, uS::Trace::enabled, uS::Trace::names[event], nullptr, (uint64_t) (uintptr_t) id, 0,
+                                     1, &argNames[event], &TRACE_VALUE_TYPE_UINT, &arg, nullptr, flags);
+}
+
+// the same for every isolate, so workers loading the addon set it again to what it already is
+void registerTracing() {
+    if ((tracingController = node::GetTracingController())) {
+        uS::Trace::hook = traceEvent;
+        uS::Trace::enabled = tracingController->GetCategoryGroupEnabled("uws");
+    }
+}
+#endif
+
+// a worker_thread ending closes its loop, which has to be free of our handles by then. JS is not called anymore
+void cleanupAddon(void *data) {
+    AddonData *addonData = (AddonData *) data;
+    uv_loop_t *loop = (uv_loop_t *) addonData->hub.getLoop();
+    uv_close((uv_handle_t *) addonData->check, [](uv_handle_t *check) {
+        delete (uv_check_t *) check;
     });
-    uv_unref((uv_handle_t *)&check);
+    for (uWS::Group *group : addonData->groups) {
+        group->onDisconnection([](uWS::WebSocket *webSocket, int code, char *message, size_t length) {});
+        group->close(1001);
+    }
+    // the sockets finish closing before the hub goes, then so do its own handles
+    uv_run(loop, UV_RUN_NOWAIT);
+    if (addon == addonData) {
+        addon = nullptr;
+    }
+    delete addonData;
+    uv_run(loop, UV_RUN_NOWAIT);
 }
 
 class NativeString {
@@ -106,57 +239,268 @@ class NativeString {
 };
 
 struct GroupData {
-    Persistent<Function> connectionHandler, messageHandler, disconnectionHandler;
+    Persistent<Function> connectionHandler, messageHandler, disconnectionHandler, drainHandler, messageChunkHandler, messageBatchHandler, drainProgressHandler;
+    Persistent<Function> slowConsumerHandler;
+    // of listenGroup, and the headers it passes on
+    Persistent<Function> upgradeRequestHandler;
+    std::vector<std::string> upgradeRequestHeaders;
     int size = 0;
+    // of upgradeSockets, the sockets connected meanwhile, which JS gets from its return value instead.
+    // One disconnected before that is nulled
+    std::vector<uWS::WebSocket *> *batchedConnections = nullptr;
+
+    // of setEventRing: messages go into ring as RING_WORDS Uint32 each, the opCode, the socket's id and the
+    // offset and length of the message in arena, and reach ringHandler once per loop iteration, or earlier
+    // when either is full. While it runs, and for messages bigger than the arena, messageHandler is called
+    static const uint32_t RING_WORDS = 4;
+    Persistent<Function> ringHandler;
+    Persistent<Value> ringBuffer, arenaBuffer;
+    uint32_t *ring = nullptr;
+    char *arena = nullptr;
+    size_t ringCapacity = 0, ringEvents = 0, arenaCapacity = 0, arenaUsed = 0;
+    bool ringDraining = false;
 };
 
+// hands the events in the ring of groupData to JS, which reads them before it returns
+void flushRing(Isolate *isolate, GroupData *groupData, bool fromCheck) {
+    if (!groupData->ringEvents) {
+        return;
+    }
+    HandleScope hs(isolate);
+    Local<Value> argv[] = {Integer::NewFromUnsigned(isolate, (uint32_t) groupData->ringEvents)};
+    groupData->ringEvents = groupData->arenaUsed = 0;
+    groupData->ringDraining = true;
+    if (fromCheck) {
+        node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), Local<Function>::New(isolate, groupData->ringHandler), 1, argv);
+    } else {
+        callJs(isolate, groupData->ringHandler, 1, argv);
+    }
+    groupData->ringDraining = false;
+}
+
+// false if the message has to be called by itself
+bool pushRing(Isolate *isolate, GroupData *groupData, uint32_t opCode, uint32_t id, const char *message, size_t length) {
+    if (!groupData->ringCapacity || groupData->ringDraining || length > groupData->arenaCapacity) {
+        return false;
+    }
+    if (groupData->ringEvents == groupData->ringCapacity || groupData->arenaUsed + length > groupData->arenaCapacity) {
+        flushRing(isolate, groupData);
+    }
+    uint32_t *entry = groupData->ring + groupData->ringEvents++ * GroupData::RING_WORDS;
+    entry[0] = opCode;
+    entry[1] = id;
+    entry[2] = (uint32_t) groupData->arenaUsed;
+    entry[3] = (uint32_t) length;
+    memcpy(groupData->arena + groupData->arenaUsed, message, length);
+    groupData->arenaUsed += length;
+    return true;
+}
+
 void createGroup(const FunctionCallbackInfo<Value> &args) {
-    uWS::Group *group = hub.createGroup(args[0].As<Integer>()->Value(), args[1].As<Integer>()->Value());
+    // level, memLevel and strategy of its compressors, each optional
+    uWS::CompressionSettings compressionSettings;
+    if (args[2]->IsInt32()) {
+        compressionSettings.level = args[2].As<Int32>()->Value();
+    }
+    if (args[3]->IsInt32()) {
+        compressionSettings.memLevel = args[3].As<Int32>()->Value();
+    }
+    if (args[4]->IsInt32()) {
+        compressionSettings.strategy = args[4].As<Int32>()->Value();
+    }
+
+    uWS::Group *group = addon->hub.createGroup(args[0].As<Integer>()->Value(), args[1].As<Integer>()->Value(), compressionSettings);
     group->setUserData(new GroupData);
+    addon->groups.push_back(group);
     args.GetReturnValue().Set(External::New(args.GetIsolate(), group));
 }
 
-inline Local<External> wrapSocket(uWS::WebSocket *webSocket, Isolate *isolate) {
-    return External::New(isolate, webSocket);
+// the id of a socket, given one the first time
+inline Local<Value> wrapSocket(uWS::WebSocket *webSocket, Isolate *isolate) {
+    uint32_t id = (uint32_t) (uintptr_t) webSocket->getUserData();
+    if (!id) {
+        if (addon->freeSocketIds.size()) {
+            id = addon->freeSocketIds.back();
+            addon->freeSocketIds.pop_back();
+        } else {
+            addon->socketSlots.emplace_back();
+            id = (uint32_t) addon->socketSlots.size();
+        }
+        addon->socketSlots[id - 1].webSocket = webSocket;
+        webSocket->setUserData((void *) (uintptr_t) id);
+    }
+    return Integer::NewFromUnsigned(isolate, id);
+}
+
+inline AddonData::SocketSlot &socketSlot(Local<Value> id) {
+    return addon->socketSlots[id.As<Uint32>()->Value() - 1];
+}
+
+inline uWS::WebSocket *unwrapSocket(Local<Value> id) {
+    return socketSlot(id).webSocket;
+}
+
+// the pool gets the buffer back once JS lets go of it, unless the hub went with the isolate first
+void returnMessageBuffer(char *data, void *capacity) {
+    if (addon) {
+        addon->hub.returnMessageBuffer(data, (size_t) capacity);
+    } else {
+        uS::LargeBuffer::free(data, (size_t) capacity);
+    }
 }
 
-inline uWS::WebSocket *unwrapSocket(Local<External> external) {
-    return (uWS::WebSocket *)external->Value();
+// the characters of an external string, in a buffer of takeMessageBuffer or, with no capacity, a copy of its own
+class ExternalMessage : public String::ExternalOneByteStringResource {
+    char *buffer;
+    size_t bufferLength, capacity;
+
+    public:
+    ExternalMessage(char *buffer, size_t length, size_t capacity) : buffer(buffer), bufferLength(length), capacity(capacity) {}
+
+    const char *data() const override { return buffer; }
+
+    size_t length() const override { return bufferLength; }
+
+    ~ExternalMessage() {
+        if (capacity) {
+            returnMessageBuffer(buffer, (void *) capacity);
+        } else {
+            delete [] buffer;
+        }
+    }
+};
+
+// a view of the current slab, or of a new one once it is used up. Views start 8 byte aligned as those of Node's pool do
+inline Local<Value> poolMessage(const char *message, size_t length, Isolate *isolate) {
+    if (addon->messagePool.IsEmpty() || addon->messagePoolOffset + length > AddonData::MESSAGE_POOL_SIZE) {
+        Local<ArrayBuffer> slab = ArrayBuffer::New(isolate, AddonData::MESSAGE_POOL_SIZE);
+#if NODE_MAJOR_VERSION >= 14
+        addon->messagePoolData = (char *) slab->GetBackingStore()->Data();
+#else
+        addon->messagePoolData = (char *) slab->GetContents().Data();
+#endif
+        addon->messagePool.Reset(isolate, slab);
+        addon->messagePoolOffset = 0;
+    }
+
+    size_t offset = addon->messagePoolOffset;
+    memcpy(addon->messagePoolData + offset, message, length);
+    addon->messagePoolOffset = (offset + length + 7) & ~(size_t) 7;
+    return node::Buffer::New(isolate, Local<ArrayBuffer>::New(isolate, addon->messagePool), offset, length).ToLocalChecked();
 }
 
-inline Local<Value> wrapMessage(const char *message, size_t length, uWS::OpCode opCode, Isolate *isolate) {
-    if (opCode == uWS::OpCode::BINARY) {
+inline Local<Value> wrapMessage(const char *message, size_t length, uWS::OpCode opCode, Isolate *isolate, uWS::WebSocket *webSocket = nullptr) {
+    if (opCode == uWS::OpCode::BINARY || (opCode == uWS::OpCode::TEXT && addon->textAsBuffer)) {
+        size_t capacity;
+        char *buffer;
+        if (webSocket && addon->zeroCopyMessageThreshold && length >= addon->zeroCopyMessageThreshold &&
+                (buffer = webSocket->takeMessageBuffer(message, capacity))) {
+            // a buffer mostly empty would hold more memory than the copy costs
+            if (capacity <= length * 2) {
+                return node::Buffer::New(isolate, buffer, length, returnMessageBuffer, (void *) capacity).ToLocalChecked();
+            }
+            Local<Value> copy = node::Buffer::Copy(isolate, buffer, length).ToLocalChecked();
+            addon->hub.returnMessageBuffer(buffer, capacity);
+            return copy;
+        }
+        if (length < addon->messagePoolThreshold) {
+            return poolMessage(message, length, isolate);
+        }
         return node::Buffer::Copy(isolate, (char *)message, length).ToLocalChecked();
+    } else if (uWS::WebSocketProtocol<uWS::WebSocket>::isAscii((unsigned char *) message, length)) {
+        // validated already, so pure ASCII is taken as it is instead of decoded
+        if (webSocket && addon->externalStringThreshold && length >= addon->externalStringThreshold) {
+            size_t capacity = 0;
+            char *buffer = webSocket->takeMessageBuffer(message, capacity);
+            if (!buffer || capacity > length * 2) {
+                char *copy = new char[length];
+                memcpy(copy, message, length);
+                if (buffer) {
+                    addon->hub.returnMessageBuffer(buffer, capacity);
+                }
+                buffer = copy;
+                capacity = 0;
+            }
+            return String::NewExternalOneByte(isolate, new ExternalMessage(buffer, length, capacity)).ToLocalChecked();
+        }
+        return String::NewFromOneByte(isolate, (const uint8_t *) message, NewStringType::kNormal, (int) length).ToLocalChecked();
     } else {
         return String::NewFromUtf8(isolate, message, NewStringType::kNormal, length).ToLocalChecked();
     }
 }
 
 inline Local<Value> getDataV8(uWS::WebSocket *webSocket, Isolate *isolate) {
-    return webSocket->getUserData() ? Local<Value>::New(isolate, *(Persistent<Value> *)webSocket->getUserData()) : Local<Value>::Cast(Undefined(isolate));
+    uint32_t id = (uint32_t) (uintptr_t) webSocket->getUserData();
+    return id ? Local<Value>::New(isolate, addon->socketSlots[id - 1].object) : Local<Value>::Cast(Undefined(isolate));
 }
 
 void getUserData(const FunctionCallbackInfo<Value> &args) {
-    args.GetReturnValue().Set(getDataV8(unwrapSocket(args[0].As<External>()), args.GetIsolate()));
+    args.GetReturnValue().Set(Local<Value>::New(args.GetIsolate(), socketSlot(args[0]).object));
 }
 
+// the socket is disconnecting, its id is free from here on
 void clearUserData(const FunctionCallbackInfo<Value> &args) {
-    uWS::WebSocket *webSocket = unwrapSocket(args[0].As<External>());
-    ((Persistent<Value> *)webSocket->getUserData())->Reset();
-    delete (Persistent<Value> *)webSocket->getUserData();
+    AddonData::SocketSlot &slot = socketSlot(args[0]);
+    slot.object.Reset();
+    slot.webSocket->setUserData(nullptr);
+    slot.webSocket = nullptr;
+    addon->freeSocketIds.push_back(args[0].As<Uint32>()->Value());
 }
 
 void setUserData(const FunctionCallbackInfo<Value> &args) {
-    uWS::WebSocket *webSocket = unwrapSocket(args[0].As<External>());
-    if (webSocket->getUserData()) {
-        ((Persistent<Value> *)webSocket->getUserData())->Reset(args.GetIsolate(), args[1]);
+    socketSlot(args[0]).object.Reset(args.GetIsolate(), args[1]);
+}
+
+void getBufferedAmount(const FunctionCallbackInfo<Value> &args) {
+    args.GetReturnValue().Set(Number::New(args.GetIsolate(), (double) unwrapSocket(args[0])->getBufferedAmount()));
+}
+
+void getRtt(const FunctionCallbackInfo<Value> &args) {
+    args.GetReturnValue().Set(Number::New(args.GetIsolate(), unwrapSocket(args[0])->getRtt() / 1000.0));
+}
+
+// [rtt in ms, cwnd, unacked, notSent] of the last TCP_INFO sample, see uWS::Group::setTcpInfoSampling
+void getTcpInfo(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate();
+    uS::Context::TcpInfo tcpInfo = unwrapSocket(args[0])->getTcpInfo();
+    Local<Array> array = Array::New(isolate, 4);
+    array->Set(isolate->GetCurrentContext(), 0, Number::New(isolate, tcpInfo.rtt / 1000.0));
+    array->Set(isolate->GetCurrentContext(), 1, Integer::NewFromUnsigned(isolate, tcpInfo.cwnd));
+    array->Set(isolate->GetCurrentContext(), 2, Integer::NewFromUnsigned(isolate, tcpInfo.unacked));
+    array->Set(isolate->GetCurrentContext(), 3, Integer::NewFromUnsigned(isolate, tcpInfo.notSent));
+    args.GetReturnValue().Set(array);
+}
+
+// as queuedMessages, fragmentBuffers, deflateWindows and pooledBlocks, named in uws.js
+Local<Array> memoryStatsArray(Isolate *isolate, const uWS::MemoryStats &memory) {
+    Local<Array> array = Array::New(isolate, 4);
+    array->Set(isolate->GetCurrentContext(), 0, Number::New(isolate, (double) memory.queuedMessages));
+    array->Set(isolate->GetCurrentContext(), 1, Number::New(isolate, (double) memory.fragmentBuffers));
+    array->Set(isolate->GetCurrentContext(), 2, Number::New(isolate, (double) memory.deflateWindows));
+    array->Set(isolate->GetCurrentContext(), 3, Number::New(isolate, (double) memory.pooledBlocks));
+    return array;
+}
+
+void getMemoryUsage(const FunctionCallbackInfo<Value> &args) {
+    args.GetReturnValue().Set(memoryStatsArray(args.GetIsolate(), unwrapSocket(args[0])->getMemoryUsage()));
+}
+
+// of the socket, exported as setNoDelay. The group's is setNoDelay on native.server.group
+void setSocketNoDelay(const FunctionCallbackInfo<Value> &args) {
+    unwrapSocket(args[0])->setNoDelay(args[1]->IsTrue());
+}
+
+void setReadingPaused(const FunctionCallbackInfo<Value> &args) {
+    uWS::WebSocket *webSocket = unwrapSocket(args[0]);
+    if (args[1]->IsTrue()) {
+        webSocket->pauseReading();
     } else {
-        webSocket->setUserData(new Persistent<Value>(args.GetIsolate(), args[1]));
+        webSocket->resumeReading();
     }
 }
 
 void getAddress(const FunctionCallbackInfo<Value> &args) {
-    typename uWS::WebSocket::Address address = unwrapSocket(args[0].As<External>())->getAddress();
+    typename uWS::WebSocket::Address address = unwrapSocket(args[0])->getAddress();
     Isolate *isolate = args.GetIsolate();
     Local<Array> array = Array::New(isolate, 3);
     array->Set(isolate->GetCurrentContext(), 0, Integer::New(isolate, address.port));
@@ -165,15 +509,23 @@ void getAddress(const FunctionCallbackInfo<Value> &args) {
     args.GetReturnValue().Set(array);
 }
 
+inline bool isTcpHandleOf(volatile uv_handle_t *tcpHandle, void *handleWrap) {
+    return tcpHandle->type == UV_TCP && tcpHandle->data == handleWrap && tcpHandle->loop == (uv_loop_t *) addon->hub.getLoop();
+}
+
+// the uv_tcp_t is a member of the TCPWrap at an offset that differs between Node builds, so it is
+// searched for once and after that only checked
 uv_handle_t *getTcpHandle(void *handleWrap) {
+    static std::atomic<size_t> tcpHandleOffset {0};
     volatile char *memory = (volatile char *)handleWrap;
-    for (volatile uv_handle_t *tcpHandle = (volatile uv_handle_t *)memory;
-            tcpHandle->type != UV_TCP || tcpHandle->data != handleWrap ||
-            tcpHandle->loop != uv_default_loop();
-            tcpHandle = (volatile uv_handle_t *)memory) {
-        memory++;
+    size_t offset = tcpHandleOffset.load(std::memory_order_relaxed);
+    if (offset && isTcpHandleOf((volatile uv_handle_t *)(memory + offset), handleWrap)) {
+        return (uv_handle_t *)(memory + offset);
     }
-    return (uv_handle_t *)memory;
+
+    for (offset = 0; !isTcpHandleOf((volatile uv_handle_t *)(memory + offset), handleWrap); offset++);
+    tcpHandleOffset.store(offset, std::memory_order_relaxed);
+    return (uv_handle_t *)(memory + offset);
 }
 
 struct SendCallbackData {
@@ -185,28 +537,188 @@ void sendCallback(uWS::WebSocket *webSocket, void *data, bool cancelled, void *r
     SendCallbackData *sc = static_cast<SendCallbackData *>(data);
     if (!cancelled) {
         HandleScope hs(sc->isolate);
-        Local<Function>::New(sc->isolate, sc->jsCallback)->Call(sc->isolate->GetCurrentContext(), Null(sc->isolate), 0, nullptr);
+        callJs(sc->isolate, sc->jsCallback, 0, nullptr);
     }
     sc->jsCallback.Reset();
     delete sc;
 }
 
+// the send id travels as the callback data itself, so there is nothing to allocate or free
+void sendCompletion(uWS::WebSocket *webSocket, void *data, bool cancelled, void *reserved) {
+    (cancelled ? addon->cancelledSends : addon->completedSends).push_back((uint32_t) (uintptr_t) data);
+}
+
+// a Buffer sent without copying it, held until the send completes, which it then passes on
+struct PinnedSend {
+#if NODE_MAJOR_VERSION >= 14
+    std::shared_ptr<BackingStore> backingStore;
+#else
+    Persistent<Value> buffer;
+#endif
+    void (*callback)(uWS::WebSocket *, void *, bool, void *);
+    void *callbackData;
+
+    static void release(uWS::WebSocket *webSocket, void *data, bool cancelled, void *reserved) {
+        PinnedSend *pinnedSend = (PinnedSend *) data;
+        if (pinnedSend->callback) {
+            pinnedSend->callback(webSocket, pinnedSend->callbackData, cancelled, reserved);
+        }
+#if NODE_MAJOR_VERSION < 14
+        pinnedSend->buffer.Reset();
+#endif
+        delete pinnedSend;
+    }
+};
+
 void send(const FunctionCallbackInfo<Value> &args) {
     uWS::OpCode opCode = (uWS::OpCode)args[2].As<Integer>()->Value();
-    NativeString nativeString(args.GetIsolate(), args[1]);
 
-    SendCallbackData *sc = nullptr;
+    void *callbackData = nullptr;
     void (*callback)(uWS::WebSocket *, void *, bool, void *) = nullptr;
 
-    if (args[3]->IsFunction()) {
+    if (args[3]->IsUint32()) {
+        callback = sendCompletion;
+        callbackData = (void *) (uintptr_t) args[3].As<Uint32>()->Value();
+    } else if (args[3]->IsFunction()) {
         callback = sendCallback;
-        sc = new SendCallbackData;
+        SendCallbackData *sc = new SendCallbackData;
         sc->jsCallback.Reset(args.GetIsolate(), Local<Function>::Cast(args[3]));
         sc->isolate = args.GetIsolate();
+        callbackData = sc;
+    }
+
+    bool compress = args[4].As<Boolean>()->Value();
+    uint32_t conflationKey = args[5]->IsUint32() ? args[5].As<Uint32>()->Value() : 0;
+    unsigned int ttlMs = args[6]->IsUint32() ? args[6].As<Uint32>()->Value() : 0;
+
+    // a pinned buffer is written from where it is, only the frame header is queued
+    if (args[7]->IsTrue() && args[1]->IsArrayBufferView() && !compress && !conflationKey && !ttlMs) {
+        Local<ArrayBufferView> view = args[1].As<ArrayBufferView>();
+        PinnedSend *pinnedSend = new PinnedSend {{}, callback, callbackData};
+#if NODE_MAJOR_VERSION >= 14
+        pinnedSend->backingStore = view->Buffer()->GetBackingStore();
+        const char *data = (const char *) pinnedSend->backingStore->Data() + view->ByteOffset();
+#else
+        pinnedSend->buffer.Reset(args.GetIsolate(), view);
+        const char *data = (const char *) view->Buffer()->GetContents().Data() + view->ByteOffset();
+#endif
+        unwrapSocket(args[0])->sendReferenced(data, view->ByteLength(), opCode, PinnedSend::release, pinnedSend);
+        return;
+    }
+
+#if NODE_MAJOR_VERSION >= 12
+    // strings are encoded right into the frame instead of into a Utf8Value first
+    if (args[1]->IsString()) {
+        Isolate *isolate = args.GetIsolate();
+        Local<String> string = args[1].As<String>();
+        unwrapSocket(args[0])->sendWritten(string->Utf8Length(isolate), opCode, [](char *payload, size_t length, void *writeData) {
+            Local<String> &string = *(Local<String> *) writeData;
+            string->WriteUtf8(Isolate::GetCurrent(), payload, (int) length, nullptr, String::NO_NULL_TERMINATION | String::REPLACE_INVALID_UTF8);
+        }, &string, callback, callbackData, compress, conflationKey, ttlMs);
+        return;
+    }
+#endif
+
+    NativeString nativeString(args.GetIsolate(), args[1]);
+    unwrapSocket(args[0])->send(nativeString.getData(), nativeString.getLength(), opCode, callback, callbackData, compress, conflationKey, ttlMs);
+}
+
+// the payloads as frames back to back in one write, strings as TEXT and the rest as BINARY, deflated with args[3]
+void sendBatch(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Array> payloads = Local<Array>::Cast(args[1]);
+
+    void *callbackData = nullptr;
+    void (*callback)(uWS::WebSocket *, void *, bool, void *) = nullptr;
+    if (args[2]->IsUint32()) {
+        callback = sendCompletion;
+        callbackData = (void *) (uintptr_t) args[2].As<Uint32>()->Value();
+    }
+
+    std::vector<std::unique_ptr<NativeString>> nativeStrings;
+    std::vector<uWS::WebSocket::Frame> frames;
+    for (uint32_t i = 0; i < payloads->Length(); i++) {
+        Local<Value> payload = payloads->Get(context, i).ToLocalChecked();
+        nativeStrings.emplace_back(new NativeString(isolate, payload));
+        frames.push_back({nativeStrings.back()->getData(), nativeStrings.back()->getLength(), payload->IsString() ? uWS::OpCode::TEXT : uWS::OpCode::BINARY});
     }
+    unwrapSocket(args[0])->sendBatch(frames.data(), frames.size(), callback, callbackData, args[3].As<Boolean>()->Value());
+}
 
+// sockets[i] gets payloads[i], or with one buffer the bytes between offsets[i] and offsets[i + 1]
+// of a Uint32Array one longer than sockets. Closed sockets (0) are skipped
+void sendMany(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Array> sockets = Local<Array>::Cast(args[0]);
+    uWS::OpCode opCode = (uWS::OpCode)args[3].As<Integer>()->Value();
     bool compress = args[4].As<Boolean>()->Value();
-    unwrapSocket(args[0].As<External>())->send(nativeString.getData(), nativeString.getLength(), opCode, callback, sc, compress);
+    uint32_t length = sockets->Length();
+
+    if (args[1]->IsArray()) {
+        Local<Array> payloads = Local<Array>::Cast(args[1]);
+        for (uint32_t i = 0; i < length && i < payloads->Length(); i++) {
+            Local<Value> id = sockets->Get(context, i).ToLocalChecked();
+            if (id->IsUint32() && id.As<Uint32>()->Value()) {
+                NativeString nativeString(isolate, payloads->Get(context, i).ToLocalChecked());
+                unwrapSocket(id)->send(nativeString.getData(), nativeString.getLength(), opCode, nullptr, nullptr, compress);
+            }
+        }
+        return;
+    }
+
+    if (!args[2]->IsUint32Array()) {
+        return;
+    }
+    NativeString buffer(isolate, args[1]);
+    Local<Uint32Array> offsetArray = Local<Uint32Array>::Cast(args[2]);
+    uint32_t *offsets = (uint32_t *) ((char *) offsetArray->Buffer()->GetContents().Data() + offsetArray->ByteOffset());
+    length = std::min<uint32_t>(length, offsetArray->Length() ? offsetArray->Length() - 1 : 0);
+    for (uint32_t i = 0; i < length; i++) {
+        Local<Value> id = sockets->Get(context, i).ToLocalChecked();
+        if (id->IsUint32() && id.As<Uint32>()->Value() && offsets[i] <= offsets[i + 1] && offsets[i + 1] <= buffer.getLength()) {
+            unwrapSocket(id)->send(buffer.getData() + offsets[i], offsets[i + 1] - offsets[i], opCode, nullptr, nullptr, compress);
+        }
+    }
+}
+
+// a message sent in pieces, the chunks are framed (and deflated) as they come
+void beginMessage(const FunctionCallbackInfo<Value> &args) {
+    uWS::OpCode opCode = (uWS::OpCode)args[1].As<Integer>()->Value();
+    args.GetReturnValue().Set(unwrapSocket(args[0])->beginMessage(opCode, args[2].As<Boolean>()->Value()));
+}
+
+void sendFragment(const FunctionCallbackInfo<Value> &args) {
+    NativeString nativeString(args.GetIsolate(), args[1]);
+    unwrapSocket(args[0])->sendFragment(nativeString.getData(), nativeString.getLength());
+}
+
+void endMessage(const FunctionCallbackInfo<Value> &args) {
+    if (args[1]->IsUndefined()) {
+        unwrapSocket(args[0])->endMessage();
+        return;
+    }
+    NativeString nativeString(args.GetIsolate(), args[1]);
+    unwrapSocket(args[0])->endMessage(nativeString.getData(), nativeString.getLength());
+}
+
+void setSendCompletion(const FunctionCallbackInfo<Value> &args) {
+    addon->sendCompletionHandler.Reset(args.GetIsolate(), Local<Function>::Cast(args[0]));
+}
+
+void cork(const FunctionCallbackInfo<Value> &args) {
+    uWS::WebSocket *webSocket = unwrapSocket(args[0]);
+    if (args[1].As<Boolean>()->Value()) {
+        // nested corks (like one taken by the parser while delivering) are left to their owner
+        bool corked = !webSocket->isCorked();
+        if (corked) {
+            webSocket->cork(true);
+        }
+        args.GetReturnValue().Set(corked);
+    } else {
+        webSocket->cork(false);
+    }
 }
 
 struct Ticket {
@@ -224,7 +736,7 @@ void upgrade(const FunctionCallbackInfo<Value> &args) {
 
     // todo: move this check into core!
     if (ticket->fd != INVALID_SOCKET) {
-        hub.upgrade(ticket->fd, secKey.getData(), ticket->ssl, extensions.getData(), extensions.getLength(), subprotocol.getData(), subprotocol.getLength(), serverGroup);
+        addon->hub.upgrade(ticket->fd, secKey.getData(), ticket->ssl, extensions.getData(), extensions.getLength(), subprotocol.getData(), subprotocol.getLength(), serverGroup);
     } else {
         if (ticket->ssl) {
             SSL_free(ticket->ssl);
@@ -260,6 +772,113 @@ void transfer(const FunctionCallbackInfo<Value> &args) {
     args.GetReturnValue().Set(External::New(args.GetIsolate(), ticket));
 }
 
+// the fd of a TCP handle taken from the uv_tcp_t while Node still holds it, INVALID_SOCKET where it cannot be
+// taken, on Windows or with writes of Node still pending
+uv_os_sock_t takeTcpFd(Isolate *isolate, Local<Value> handle) {
+#ifdef _WIN32
+    return INVALID_SOCKET;
+#else
+    uv_tcp_t *tcp = (uv_tcp_t *) getTcpHandle(handle->ToObject(isolate->GetCurrentContext()).ToLocalChecked()->GetAlignedPointerFromInternalField(0));
+
+    // without reads or writes the loop forgets the fd, which our poll then registers anew
+    uv_read_stop((uv_stream_t *) tcp);
+    if (tcp->write_queue_size || tcp->io_watcher.pevents || tcp->io_watcher.fd == -1) {
+        return INVALID_SOCKET;
+    }
+    uv_os_sock_t fd = tcp->io_watcher.fd;
+    tcp->io_watcher.fd = -1;
+    return fd;
+#endif
+}
+
+/*
+ * Upgrades the socket of a TCP handle in one call: its fd is taken from the
+ * uv_tcp_t while Node still holds it, so the 101 goes out and the poll is
+ * registered in this very tick. Node's handle is left with an fd of -1, which
+ * closing it then skips, so no dup is needed either.
+ *
+ * Hints: Returns false where the fd cannot be taken, on Windows or with
+ * writes of Node still pending. transfer and upgrade remain for those.
+ *
+ */
+void upgradeSocket(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *serverGroup = (uWS::Group *)args[0].As<External>()->Value();
+    Isolate *isolate = args.GetIsolate();
+    uv_os_sock_t fd = takeTcpFd(isolate, args[1]);
+    if (fd == INVALID_SOCKET) {
+        args.GetReturnValue().Set(false);
+        return;
+    }
+
+    SSL *ssl = nullptr;
+    if (args[2]->IsExternal()) {
+        ssl = (SSL *)args[2].As<External>()->Value();
+        SSL_up_ref(ssl);
+    }
+
+    NativeString secKey(isolate, args[3]);
+    NativeString extensions(isolate, args[4]);
+    NativeString subprotocol(isolate, args[5]);
+    addon->hub.upgrade(fd, secKey.getData(), ssl, extensions.getData(), extensions.getLength(), subprotocol.getData(), subprotocol.getLength(), serverGroup);
+    args.GetReturnValue().Set(true);
+}
+
+/*
+ * upgradeSocket for the arrays of handles, SSL states, keys, extensions and
+ * protocols of a whole burst of upgrades, like those of a reconnect storm.
+ * Their connection events do not reach the connection handler but come back
+ * together: the result has for each handle the external of its socket, null
+ * where the upgrade was turned away or the socket closed right after, or false
+ * where the fd could not be taken, which transfer and upgrade remain for.
+ *
+ */
+void upgradeSockets(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *serverGroup = (uWS::Group *)args[0].As<External>()->Value();
+    GroupData *groupData = static_cast<GroupData *>(serverGroup->getUserData());
+    Isolate *isolate = args.GetIsolate();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Array> handles = Local<Array>::Cast(args[1]), sslStates = Local<Array>::Cast(args[2]), secKeys = Local<Array>::Cast(args[3]),
+                 extensionArray = Local<Array>::Cast(args[4]), subprotocols = Local<Array>::Cast(args[5]);
+    uint32_t count = handles->Length();
+    Local<Array> results = Array::New(isolate, (int) count);
+
+    std::vector<uWS::WebSocket *> connected;
+    std::vector<uint32_t> connectedIndices;
+    groupData->batchedConnections = &connected;
+    for (uint32_t i = 0; i < count; i++) {
+        uv_os_sock_t fd = takeTcpFd(isolate, handles->Get(context, i).ToLocalChecked());
+        if (fd == INVALID_SOCKET) {
+            results->Set(context, i, False(isolate)).Check();
+            continue;
+        }
+
+        SSL *ssl = nullptr;
+        Local<Value> sslState = sslStates->Get(context, i).ToLocalChecked();
+        if (sslState->IsExternal()) {
+            ssl = (SSL *)sslState.As<External>()->Value();
+            SSL_up_ref(ssl);
+        }
+
+        NativeString secKey(isolate, secKeys->Get(context, i).ToLocalChecked());
+        NativeString extensions(isolate, extensionArray->Get(context, i).ToLocalChecked());
+        NativeString subprotocol(isolate, subprotocols->Get(context, i).ToLocalChecked());
+        size_t before = connected.size();
+        addon->hub.upgrade(fd, secKey.getData(), ssl, extensions.getData(), extensions.getLength(), subprotocol.getData(), subprotocol.getLength(), serverGroup);
+        results->Set(context, i, Null(isolate)).Check();
+        if (connected.size() > before) {
+            connectedIndices.push_back(i);
+        }
+    }
+    groupData->batchedConnections = nullptr;
+
+    for (size_t i = 0; i < connected.size(); i++) {
+        if (connected[i]) {
+            results->Set(context, connectedIndices[i], wrapSocket(connected[i], isolate)).Check();
+        }
+    }
+    args.GetReturnValue().Set(results);
+}
+
 void onConnection(const FunctionCallbackInfo<Value> &args) {
     uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
     GroupData *groupData = static_cast<GroupData *>(group->getUserData());
@@ -269,9 +888,13 @@ void onConnection(const FunctionCallbackInfo<Value> &args) {
     connectionCallback->Reset(isolate, Local<Function>::Cast(args[1]));
     group->onConnection([isolate, connectionCallback, groupData](uWS::WebSocket *webSocket) {
         groupData->size++;
+        if (groupData->batchedConnections) {
+            groupData->batchedConnections->push_back(webSocket);
+            return;
+        }
         HandleScope hs(isolate);
         Local<Value> argv[] = {wrapSocket(webSocket, isolate)};
-        Local<Function>::New(isolate, *connectionCallback)->Call(isolate->GetCurrentContext(), Null(isolate), 1, argv);
+        callJs(isolate, *connectionCallback, 1, argv);
     });
 }
 
@@ -283,16 +906,60 @@ void onMessage(const FunctionCallbackInfo<Value> &args) {
     Persistent<Function> *messageCallback = &groupData->messageHandler;
 
     messageCallback->Reset(isolate, Local<Function>::Cast(args[1]));
-    group->onMessage([isolate, messageCallback, group](uWS::WebSocket *webSocket, const char *message, size_t length, uWS::OpCode opCode) {
+    group->onMessage([isolate, messageCallback, groupData](uWS::WebSocket *webSocket, const char *message, size_t length, uWS::OpCode opCode) {
         if(length != 1 || message[0] != 65) {
+            if (pushRing(isolate, groupData, opCode, (uint32_t) (uintptr_t) webSocket->getUserData(), message, length)) {
+                return;
+            }
             HandleScope hs(isolate);
-            Local<Value> argv[] = {wrapMessage(message, length, opCode, isolate),
+            Local<Value> argv[] = {wrapMessage(message, length, opCode, isolate, webSocket),
             getDataV8(webSocket, isolate)};
-            Local<Function>::New(isolate, *messageCallback)->Call(isolate->GetCurrentContext(), Null(isolate), 2, argv);
+            callJs(isolate, *messageCallback, 2, argv);
         }
     });
 }
 
+// chunks are always Buffers since text pieces may split a UTF-8 sequence
+void onMessageChunk(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    GroupData *groupData = static_cast<GroupData *>(group->getUserData());
+
+    Isolate *isolate = args.GetIsolate();
+    Persistent<Function> *messageChunkCallback = &groupData->messageChunkHandler;
+
+    messageChunkCallback->Reset(isolate, Local<Function>::Cast(args[1]));
+    group->onMessageChunk([isolate, messageChunkCallback](uWS::WebSocket *webSocket, char *data, size_t length, size_t remainingBytes, bool fin, uWS::OpCode opCode) {
+        HandleScope hs(isolate);
+        Local<Value> argv[] = {node::Buffer::Copy(isolate, data, length).ToLocalChecked(),
+                               Number::New(isolate, (double) remainingBytes),
+                               Boolean::New(isolate, fin),
+                               Integer::New(isolate, opCode),
+                               getDataV8(webSocket, isolate)};
+        callJs(isolate, *messageChunkCallback, 5, argv);
+    });
+}
+
+// one call per read: all message bytes in one Buffer, described by offset, length, opCode triples
+void onMessageBatch(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    GroupData *groupData = static_cast<GroupData *>(group->getUserData());
+
+    Isolate *isolate = args.GetIsolate();
+    Persistent<Function> *messageBatchCallback = &groupData->messageBatchHandler;
+
+    messageBatchCallback->Reset(isolate, Local<Function>::Cast(args[1]));
+    group->onMessageBatch([isolate, messageBatchCallback](uWS::WebSocket *webSocket, char *data, uWS::BatchedMessage *messages, size_t count) {
+        HandleScope hs(isolate);
+        size_t length = count ? messages[count - 1].offset + messages[count - 1].length : 0;
+        Local<ArrayBuffer> descriptors = ArrayBuffer::New(isolate, count * sizeof(uWS::BatchedMessage));
+        memcpy(descriptors->GetContents().Data(), messages, count * sizeof(uWS::BatchedMessage));
+        Local<Value> argv[] = {node::Buffer::Copy(isolate, data, length).ToLocalChecked(),
+                               Uint32Array::New(descriptors, 0, count * 3),
+                               getDataV8(webSocket, isolate)};
+        callJs(isolate, *messageBatchCallback, 3, argv);
+    });
+}
+
 void onDisconnection(const FunctionCallbackInfo<Value> &args) {
     uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
     GroupData *groupData = static_cast<GroupData *>(group->getUserData());
@@ -303,63 +970,867 @@ void onDisconnection(const FunctionCallbackInfo<Value> &args) {
 
     group->onDisconnection([isolate, disconnectionCallback, groupData]( uWS::WebSocket *webSocket, int code, char *message, size_t length) {
         groupData->size--;
+        if (groupData->batchedConnections) {
+            // JS is yet to hear of it
+            std::vector<uWS::WebSocket *>::iterator it = std::find(groupData->batchedConnections->begin(), groupData->batchedConnections->end(), webSocket);
+            if (it != groupData->batchedConnections->end()) {
+                *it = nullptr;
+                return;
+            }
+        }
+        // the socket's messages come first, and JS never gets the id of a socket that is gone already
+        flushRing(isolate, groupData);
         HandleScope hs(isolate);
         Local<Value> argv[] = {
         wrapSocket(webSocket, isolate), Integer::New(isolate, code),
         wrapMessage(message, length, uWS::OpCode::CLOSE, isolate),
         getDataV8(webSocket, isolate)};
-        Local<Function>::New(isolate, *disconnectionCallback)->Call(isolate->GetCurrentContext(), Null(isolate), 4, argv);
+        callJs(isolate, *disconnectionCallback, 4, argv);
     });
 }
 
-void closeSocket(const FunctionCallbackInfo<Value> &args) {
-    NativeString nativeString(args.GetIsolate(), args[2]);
-    unwrapSocket(args[0].As<External>())->close(args[1].As<Integer>()->Value(), nativeString.getData(), nativeString.getLength());
+// ring and arena are SharedArrayBuffers, the ring a multiple of RING_WORDS Uint32. The handler gets the number of
+// events in it and has to be done with them, and copy what it keeps of the arena, before it returns
+void setEventRing(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    GroupData *groupData = static_cast<GroupData *>(group->getUserData());
+
+    Isolate *isolate = args.GetIsolate();
+    flushRing(isolate, groupData);
+    SharedArrayBuffer::Contents ring = Local<SharedArrayBuffer>::Cast(args[1])->GetContents();
+    SharedArrayBuffer::Contents arena = Local<SharedArrayBuffer>::Cast(args[2])->GetContents();
+    groupData->ringBuffer.Reset(isolate, args[1]);
+    groupData->arenaBuffer.Reset(isolate, args[2]);
+    groupData->ringHandler.Reset(isolate, Local<Function>::Cast(args[3]));
+    groupData->ring = (uint32_t *) ring.Data();
+    groupData->ringCapacity = ring.ByteLength() / (GroupData::RING_WORDS * sizeof(uint32_t));
+    groupData->arena = (char *) arena.Data();
+    groupData->arenaCapacity = arena.ByteLength();
 }
 
-void closeGroup(const FunctionCallbackInfo<Value> &args) {
-    NativeString nativeString(args.GetIsolate(), args[2]);
+void onDrain(const FunctionCallbackInfo<Value> &args) {
     uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
-    group->close(args[1].As<Integer>()->Value(), nativeString.getData(), nativeString.getLength());
+    GroupData *groupData = static_cast<GroupData *>(group->getUserData());
+
+    Isolate *isolate = args.GetIsolate();
+    Persistent<Function> *drainCallback = &groupData->drainHandler;
+    drainCallback->Reset(isolate, Local<Function>::Cast(args[1]));
+
+    group->onDrain([isolate, drainCallback](uWS::WebSocket *webSocket) {
+        HandleScope hs(isolate);
+        Local<Value> argv[] = {getDataV8(webSocket, isolate)};
+        callJs(isolate, *drainCallback, 1, argv);
+    });
 }
 
-void getSSLContext(const FunctionCallbackInfo<Value> &args) {
-    Isolate* isolate = args.GetIsolate();
-    if(args.Length() < 1 || !args[0]->IsObject()){
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Error: One object expected", NewStringType::kNormal).ToLocalChecked()));
-        return;
-    }
-    Local<Context> context = isolate->GetCurrentContext();
-    Local<Object> obj = args[0]->ToObject(context).ToLocalChecked();
-#if NODE_MAJOR_VERSION < 10
-    Local<Value> ext = obj->Get(String::NewFromUtf8(isolate, "_external"));
-    args.GetReturnValue().Set(ext);
-#else
-    TLSWrapSSLGetter* tw;
-    ASSIGN_OR_RETURN_UNWRAP(&tw, obj);
-    tw->setSSL(args);
-#endif
+// the handler gets the bytes queued, the age in ms of the oldest queued message and the socket's data
+void setSlowConsumer(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    GroupData *groupData = static_cast<GroupData *>(group->getUserData());
+
+    Isolate *isolate = args.GetIsolate();
+    Persistent<Function> *slowConsumerCallback = &groupData->slowConsumerHandler;
+    slowConsumerCallback->Reset(isolate, Local<Function>::Cast(args[3]));
+
+    group->onSlowConsumer([isolate, slowConsumerCallback](uWS::WebSocket *webSocket, size_t bytes, unsigned int ageMs) {
+        HandleScope hs(isolate);
+        Local<Value> argv[] = {Number::New(isolate, (double) bytes), Integer::NewFromUnsigned(isolate, ageMs), getDataV8(webSocket, isolate)};
+        callJs(isolate, *slowConsumerCallback, 3, argv);
+    });
+    group->setSlowConsumer((size_t) args[1].As<Number>()->Value(), args[2].As<Uint32>()->Value());
 }
 
-void setNoop(const FunctionCallbackInfo<Value> &args) {
-    noop.Reset(args.GetIsolate(), Local<Function>::Cast(args[0]));
+void setTcpInfoSampling(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setTcpInfoSampling(args[1].As<Uint32>()->Value());
 }
 
-struct Namespace {
+// in microseconds
+void setCompressionMinRtt(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setCompressionMinRtt(args[1].As<Uint32>()->Value());
+}
+
+void setMaxBackpressure(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setMaxBackpressure((size_t) args[1].As<Number>()->Value(), (uWS::BackpressurePolicy) args[2].As<Integer>()->Value());
+}
+
+void setInboundLimit(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setInboundLimit(args[1].As<Uint32>()->Value(), (size_t) args[2].As<Number>()->Value(), args[3].As<Integer>()->Value(), (uWS::BackpressurePolicy) args[4].As<Integer>()->Value());
+}
+
+void getInboundDropped(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    args.GetReturnValue().Set(Number::New(args.GetIsolate(), (double) group->getInboundDropped()));
+}
+
+void getMemoryStats(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    args.GetReturnValue().Set(memoryStatsArray(args.GetIsolate(), group->getMemoryStats()));
+}
+
+void getRttHistogram(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    Isolate *isolate = args.GetIsolate();
+    const uint64_t *histogram = group->getRttHistogram();
+    Local<Array> array = Array::New(isolate, uWS::Group::RTT_BUCKETS);
+    for (int i = 0; i < uWS::Group::RTT_BUCKETS; i++) {
+        array->Set(isolate->GetCurrentContext(), i, Number::New(isolate, (double) histogram[i]));
+    }
+    args.GetReturnValue().Set(array);
+}
+
+// fills the Float64Array of args[1], which has room for uWS::Group::METRICS, so that polling allocates nothing
+void getMetrics(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    Local<Float64Array> array = Local<Float64Array>::Cast(args[1]);
+    double *values = (double *) ((char *) array->Buffer()->GetContents().Data() + array->ByteOffset());
+    uint64_t metrics[uWS::Group::METRICS];
+    group->getMetrics(metrics);
+    for (int i = 0; i < uWS::Group::METRICS; i++) {
+        values[i] = (double) metrics[i];
+    }
+}
+
+void setLatencyHistograms(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setLatencyHistograms(args[1].As<Boolean>()->Value());
+}
+
+void setCpuAccounting(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setCpuAccounting(args[1].As<Boolean>()->Value(), args[2].As<Uint32>()->Value(), args[3].As<Uint32>()->Value());
+}
+
+// [socket, nanoseconds, error] of each socket of the sketch, costliest first
+void getTopSockets(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    Isolate *isolate = args.GetIsolate();
+    Local<Context> context = isolate->GetCurrentContext();
+    std::vector<uWS::Group::SocketCost> topSockets = group->getTopSockets();
+    Local<Array> array = Array::New(isolate, (int) topSockets.size());
+    for (size_t i = 0; i < topSockets.size(); i++) {
+        Local<Array> entry = Array::New(isolate, 3);
+        entry->Set(context, 0, getDataV8(topSockets[i].webSocket, isolate)).Check();
+        entry->Set(context, 1, Number::New(isolate, (double) topSockets[i].nanoseconds)).Check();
+        entry->Set(context, 2, Number::New(isolate, (double) topSockets[i].error)).Check();
+        array->Set(context, (uint32_t) i, entry).Check();
+    }
+    args.GetReturnValue().Set(array);
+}
+
+void startRecording(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    // a string comes NUL terminated
+    NativeString path(args.GetIsolate(), args[1]);
+    args.GetReturnValue().Set(Boolean::New(args.GetIsolate(), group->startRecording(path.getData(), args[2].As<Uint32>()->Value())));
+}
+
+void stopRecording(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->stopRecording();
+}
+
+void setDeflateWindow(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setDeflateWindow(args[1].As<Integer>()->Value(), args[2].As<Integer>()->Value());
+}
+
+void setMaxDeflateWindows(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setMaxDeflateWindows(args[1].As<Uint32>()->Value());
+}
+
+void setBacklogCompression(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setBacklogCompression((size_t) args[1].As<Number>()->Value());
+}
+
+void setInflateWindow(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setInflateWindow(args[1].As<Integer>()->Value(), (size_t) args[2].As<Number>()->Value());
+}
+
+void setFragmentSize(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setFragmentSize((size_t) args[1].As<Number>()->Value());
+}
+
+void setReassemblyBudget(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setReassemblyBudget((size_t) args[1].As<Number>()->Value());
+}
+
+void setReadBackpressure(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setReadBackpressure((size_t) args[1].As<Number>()->Value());
+}
+
+void setSendChunkSize(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setSendChunkSize((size_t) args[1].As<Number>()->Value());
+}
+
+void setNoDelay(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setNoDelay(args[1]->IsTrue());
+}
+
+void setAdaptiveNoDelay(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setAdaptiveNoDelay(args[1].As<Uint32>()->Value());
+}
+
+void setNotSentLowat(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setNotSentLowat((unsigned int) args[1].As<Number>()->Value());
+}
+
+void setQos(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setQos((uS::NodeData::Qos) args[1].As<Uint32>()->Value());
+}
+
+void setRateLimit(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setRateLimit((size_t) args[1].As<Number>()->Value(), (size_t) args[2].As<Number>()->Value());
+}
+
+void setCompressionThreshold(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setCompressionThreshold((size_t) args[1].As<Number>()->Value(), args[2].As<Boolean>()->Value());
+}
+
+void setDeflateWindowIdleTimeout(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setDeflateWindowIdleTimeout(args[1].As<Integer>()->Value());
+}
+
+void setDeflateDictionary(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    NativeString dictionary(args.GetIsolate(), args[1]);
+    group->setDeflateDictionary(dictionary.getData(), dictionary.getLength());
+}
+
+void setAdmission(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setAdmission(args[1].As<Uint32>()->Value(), args[2].As<Uint32>()->Value(), (size_t) args[3].As<Number>()->Value(), args[4].As<Uint32>()->Value());
+}
+
+void setSessions(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setSessions((size_t) args[1].As<Number>()->Value(), args[2].As<Uint32>()->Value());
+}
+
+void setHeartbeat(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setHeartbeat(args[1].As<Integer>()->Value(), args[2].As<Integer>()->Value());
+}
+
+// without a reply every rule is cleared
+void setAutoReply(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    if (args[2]->IsUndefined()) {
+        group->clearAutoReplies();
+        return;
+    }
+    NativeString message(args.GetIsolate(), args[1]);
+    NativeString reply(args.GetIsolate(), args[2]);
+    group->setAutoReply(message.getData(), message.getLength(), reply.getData(), reply.getLength());
+}
+
+void closeSocket(const FunctionCallbackInfo<Value> &args) {
+    NativeString nativeString(args.GetIsolate(), args[2]);
+    unwrapSocket(args[0])->close(args[1].As<Integer>()->Value(), nativeString.getData(), nativeString.getLength());
+}
+
+void terminateSocket(const FunctionCallbackInfo<Value> &args) {
+    unwrapSocket(args[0])->terminate(args[1].As<Boolean>()->Value());
+}
+
+void setIdleTimeout(const FunctionCallbackInfo<Value> &args) {
+    unwrapSocket(args[0])->setIdleTimeout(args[1].As<Uint32>()->Value(), args[2].As<Boolean>()->Value());
+}
+
+void broadcast(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    uint32_t conflationKey = args[4]->IsUint32() ? args[4].As<Uint32>()->Value() : 0;
+    unsigned int ttlMs = args[5]->IsUint32() ? args[5].As<Uint32>()->Value() : 0;
+    if (args[1]->IsExternal()) {
+        group->broadcast((uWS::WebSocket::PreparedMessage *) args[1].As<External>()->Value(), conflationKey, ttlMs);
+        return;
+    }
+    NativeString nativeString(args.GetIsolate(), args[1]);
+    group->broadcast(nativeString.getData(), nativeString.getLength(), (uWS::OpCode) args[2].As<Integer>()->Value(), args[3].As<Boolean>()->Value(), conflationKey, ttlMs);
+}
+
+void subscribe(const FunctionCallbackInfo<Value> &args) {
+    uWS::WebSocket *webSocket = unwrapSocket(args[0]);
+    NativeString topic(args.GetIsolate(), args[1]);
+    uWS::Group::from(webSocket)->subscribe(webSocket, topic.getData(), topic.getLength());
+}
+
+void unsubscribe(const FunctionCallbackInfo<Value> &args) {
+    uWS::WebSocket *webSocket = unwrapSocket(args[0]);
+    NativeString topic(args.GetIsolate(), args[1]);
+    uWS::Group::from(webSocket)->unsubscribe(webSocket, topic.getData(), topic.getLength());
+}
+
+// ids go to and from JS as 16 hex digits, past what a Number holds exactly. Empty with sessions off
+void openSession(const FunctionCallbackInfo<Value> &args) {
+    uWS::WebSocket *webSocket = unwrapSocket(args[0]);
+    uint64_t id = uWS::Group::from(webSocket)->openSession(webSocket);
+    char hex[17] = {};
+    if (id) {
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) id);
+    }
+    args.GetReturnValue().Set(String::NewFromUtf8(args.GetIsolate(), hex).ToLocalChecked());
+}
+
+void resumeSession(const FunctionCallbackInfo<Value> &args) {
+    uWS::WebSocket *webSocket = unwrapSocket(args[0]);
+    NativeString id(args.GetIsolate(), args[1]);
+    std::string hex(id.getData(), id.getLength());
+    uint64_t lastSequence = (uint64_t) args[2].As<Number>()->Value();
+    args.GetReturnValue().Set(uWS::Group::from(webSocket)->resumeSession(webSocket, strtoull(hex.c_str(), nullptr, 16), lastSequence));
+}
+
+void publish(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    NativeString topic(args.GetIsolate(), args[1]);
+    uint32_t conflationKey = args[5]->IsUint32() ? args[5].As<Uint32>()->Value() : 0;
+    unsigned int ttlMs = args[6]->IsUint32() ? args[6].As<Uint32>()->Value() : 0;
+    if (args[2]->IsExternal()) {
+        group->publish(topic.getData(), topic.getLength(), (uWS::WebSocket::PreparedMessage *) args[2].As<External>()->Value(), conflationKey, ttlMs);
+        return;
+    }
+    NativeString nativeString(args.GetIsolate(), args[2]);
+    group->publish(topic.getData(), topic.getLength(), nativeString.getData(), nativeString.getLength(), (uWS::OpCode) args[3].As<Integer>()->Value(), args[4].As<Boolean>()->Value(), conflationKey, ttlMs);
+}
+
+void setLastValues(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->setLastValues(args[1]->IsTrue());
+}
+
+void clearLastValue(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    NativeString topic(args.GetIsolate(), args[1]);
+    group->clearLastValue(topic.getData(), topic.getLength());
+}
+
+void toStrings(Isolate *isolate, Local<Value> value, std::vector<std::string> &strings) {
+    if (!value->IsArray()) {
+        return;
+    }
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Array> array = Local<Array>::Cast(value);
+    for (uint32_t i = 0; i < array->Length(); i++) {
+        NativeString nativeString(isolate, array->Get(context, i).ToLocalChecked());
+        strings.emplace_back(nativeString.getData(), nativeString.getLength());
+    }
+}
+
+void publishRooms(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate();
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    uWS::RoomSelection selection;
+    toStrings(isolate, args[1], selection.rooms);
+    toStrings(isolate, args[2], selection.except);
+    selection.intersect = args[3].As<Boolean>()->Value();
+    if (args[4]->IsExternal()) {
+        group->publishRooms(selection, (uWS::WebSocket::PreparedMessage *) args[4].As<External>()->Value());
+        return;
+    }
+    NativeString nativeString(isolate, args[4]);
+    group->publishRooms(selection, nativeString.getData(), nativeString.getLength(), (uWS::OpCode) args[5].As<Integer>()->Value(), args[6].As<Boolean>()->Value());
+}
+
+void prepareMessage(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    NativeString nativeString(args.GetIsolate(), args[1]);
+    uWS::WebSocket::PreparedMessage *preparedMessage = group->prepareMessage(nativeString.getData(), nativeString.getLength(), (uWS::OpCode) args[2].As<Integer>()->Value(), args[3].As<Boolean>()->Value());
+    args.GetReturnValue().Set(External::New(args.GetIsolate(), preparedMessage));
+}
+
+// the frame of a message that never changes, like a heartbeat, for sendFrame to write without framing
+// or copying it. There is no unregistering
+void registerFrame(const FunctionCallbackInfo<Value> &args) {
+    NativeString nativeString(args.GetIsolate(), args[0]);
+    uWS::WebSocket::PreparedMessage *preparedMessage = uWS::WebSocket::prepareMessage(nativeString.getData(), nativeString.getLength(), (uWS::OpCode) args[1].As<Integer>()->Value(), false);
+    addon->constantFrames.emplace_back(preparedMessage->buffer, preparedMessage->length);
+    uWS::WebSocket::finalizeMessage(preparedMessage);
+    args.GetReturnValue().Set(External::New(args.GetIsolate(), &addon->constantFrames.back()));
+}
+
+void sendFrame(const FunctionCallbackInfo<Value> &args) {
+    std::string *frame = (std::string *) args[1].As<External>()->Value();
+    unwrapSocket(args[0])->sendFrame(frame->data(), frame->length());
+}
+
+void sendPrepared(const FunctionCallbackInfo<Value> &args) {
+    unwrapSocket(args[0])->sendPrepared((uWS::WebSocket::PreparedMessage *) args[1].As<External>()->Value());
+}
+
+void finalizeMessage(const FunctionCallbackInfo<Value> &args) {
+    uWS::WebSocket::finalizeMessage((uWS::WebSocket::PreparedMessage *) args[0].As<External>()->Value());
+}
+
+// fd, offset and length of a file range, see WebSocket::prepareFile
+void prepareFile(const FunctionCallbackInfo<Value> &args) {
+    uWS::WebSocket::FileMessage *fileMessage = uWS::WebSocket::prepareFile(args[0].As<Int32>()->Value(), (uint64_t) args[1].As<Number>()->Value(),
+                                                                           (size_t) args[2].As<Number>()->Value(), (uWS::OpCode) args[3].As<Integer>()->Value());
+    args.GetReturnValue().Set(External::New(args.GetIsolate(), fileMessage));
+}
+
+void sendFile(const FunctionCallbackInfo<Value> &args) {
+    unwrapSocket(args[0])->sendFile((uWS::WebSocket::FileMessage *) args[1].As<External>()->Value());
+}
+
+void broadcastFile(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->broadcast((uWS::WebSocket::FileMessage *) args[1].As<External>()->Value());
+}
+
+void finalizeFile(const FunctionCallbackInfo<Value> &args) {
+    uWS::WebSocket::finalizeFile((uWS::WebSocket::FileMessage *) args[0].As<External>()->Value());
+}
+
+void closeGroup(const FunctionCallbackInfo<Value> &args) {
+    NativeString nativeString(args.GetIsolate(), args[2]);
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    group->close(args[1].As<Integer>()->Value(), nativeString.getData(), nativeString.getLength());
+}
+
+void drainGroup(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    if (!args[3]->IsFunction()) {
+        group->drain(args[1].As<Integer>()->Value(), args[2].As<Integer>()->Value());
+        return;
+    }
+
+    GroupData *groupData = static_cast<GroupData *>(group->getUserData());
+    Isolate *isolate = args.GetIsolate();
+    Persistent<Function> *progressCallback = &groupData->drainProgressHandler;
+    progressCallback->Reset(isolate, Local<Function>::Cast(args[3]));
+    group->drain(args[1].As<Integer>()->Value(), args[2].As<Integer>()->Value(), [isolate, progressCallback](size_t remaining) {
+        HandleScope hs(isolate);
+        Local<Value> argv[] = {Number::New(isolate, (double) remaining)};
+        callJs(isolate, *progressCallback, 1, argv);
+    });
+}
+
+void handOff(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    size_t handedOff = uWS::Hub::handOff(group, args[1].As<Integer>()->Value());
+    args.GetReturnValue().Set(Number::New(args.GetIsolate(), (double) handedOff));
+}
+
+void adoptHandOff(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    size_t adopted = uWS::Hub::adoptHandOff(group, args[1].As<Integer>()->Value());
+    args.GetReturnValue().Set(Number::New(args.GetIsolate(), (double) adopted));
+}
+
+// accepts upgrades into the group natively on port of host, every address unless a string. Nothing of a request
+// reaches JS unless verify is a function, called with an object of its url and those of the (lower case) header
+// names it has. true or 0 lets the client in, a number is the status to refuse it with, anything else a 401
+void listenGroup(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = (uWS::Group *)args[0].As<External>()->Value();
+    GroupData *groupData = static_cast<GroupData *>(group->getUserData());
+    Isolate *isolate = args.GetIsolate();
+
+    if (args[3]->IsFunction()) {
+        groupData->upgradeRequestHandler.Reset(isolate, Local<Function>::Cast(args[3]));
+        groupData->upgradeRequestHeaders.clear();
+        if (args[4]->IsArray()) {
+            Local<Array> names = Local<Array>::Cast(args[4]);
+            for (uint32_t i = 0; i < names->Length(); i++) {
+                NativeString name(isolate, names->Get(isolate->GetCurrentContext(), i).ToLocalChecked());
+                groupData->upgradeRequestHeaders.emplace_back(name.getData(), name.getLength());
+            }
+        }
+        group->onUpgradeRequest([isolate, groupData](uWS::HttpRequest &request) {
+            HandleScope hs(isolate);
+            Local<Context> context = isolate->GetCurrentContext();
+            Local<Object> info = Object::New(isolate);
+            uWS::HttpRequest::Value url = request.getUrl();
+            info->Set(context, String::NewFromUtf8(isolate, "url", NewStringType::kNormal).ToLocalChecked(),
+                      String::NewFromUtf8(isolate, url.data ? url.data : "", NewStringType::kNormal, (int) url.length).ToLocalChecked());
+            for (const std::string &name : groupData->upgradeRequestHeaders) {
+                if (uWS::HttpRequest::Value value = request.getHeader(name.c_str())) {
+                    info->Set(context, String::NewFromUtf8(isolate, name.c_str(), NewStringType::kNormal).ToLocalChecked(),
+                              String::NewFromUtf8(isolate, value.data, NewStringType::kNormal, (int) value.length).ToLocalChecked());
+                }
+            }
+
+            addon->calledJs = true;
+            uS::LoopStats::Foreign foreign = addon->hub.timeForeign();
+            Local<Value> argv[] = {info};
+            Local<Value> result;
+            if (!Local<Function>::New(isolate, groupData->upgradeRequestHandler)->Call(context, Null(isolate), 1, argv).ToLocal(&result)) {
+                return 500;
+            }
+            if (result->IsNumber()) {
+                return (int) result.As<Number>()->Value();
+            }
+            return result->IsTrue() ? 0 : 401;
+        });
+    }
+
+    // a string comes NUL terminated
+    NativeString host(isolate, args[2]);
+
+    // TLS terminates natively given PEM files of the certificate chain (args[5]) and key (args[6]), all loops
+    // sharing one session cache. Each listener holds a reference of its own
+    SSL_CTX *sslContext = nullptr;
+    if (args[5]->IsString() && args[6]->IsString()) {
+        NativeString certChainFile(isolate, args[5]), keyFile(isolate, args[6]);
+        sslContext = uS::Context::createServerTlsContext(certChainFile.getData(), keyFile.getData());
+        if (!sslContext) {
+            args.GetReturnValue().Set(False(isolate));
+            return;
+        }
+    }
+
+    bool listening = addon->hub.listen(args[1].As<Integer>()->Value(), args[2]->IsString() ? host.getData() : nullptr, sslContext, 512, group);
+    if (sslContext) {
+        SSL_CTX_free(sslContext);
+    }
+    args.GetReturnValue().Set(Boolean::New(isolate, listening));
+}
+
+void stopListeningGroup(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.stopListening((uWS::Group *)args[0].As<External>()->Value());
+}
+
+void getSSLContext(const FunctionCallbackInfo<Value> &args) {
+    Isolate* isolate = args.GetIsolate();
+    if(args.Length() < 1 || !args[0]->IsObject()){
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Error: One object expected", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> obj = args[0]->ToObject(context).ToLocalChecked();
+#if NODE_MAJOR_VERSION < 10
+    Local<Value> ext = obj->Get(String::NewFromUtf8(isolate, "_external"));
+    args.GetReturnValue().Set(ext);
+#else
+    TLSWrapSSLGetter* tw;
+    ASSIGN_OR_RETURN_UNWRAP(&tw, obj);
+    tw->setSSL(args);
+#endif
+}
+
+// [iterations, wakeups, callbackNanos, jsNanos, idleNanos] of the loop, see uS::Node::getLoopStats. The JS is
+// what callJs ran from the socket handlers
+void getLoopStats(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate();
+    uS::LoopStats::Stats stats = addon->hub.getLoopStats();
+    Local<Array> array = Array::New(isolate, 5);
+    array->Set(isolate->GetCurrentContext(), 0, Number::New(isolate, (double) stats.iterations));
+    array->Set(isolate->GetCurrentContext(), 1, Number::New(isolate, (double) stats.wakeups));
+    array->Set(isolate->GetCurrentContext(), 2, Number::New(isolate, (double) stats.callbackNanos));
+    array->Set(isolate->GetCurrentContext(), 3, Number::New(isolate, (double) stats.foreignNanos));
+    array->Set(isolate->GetCurrentContext(), 4, Number::New(isolate, (double) stats.idleNanos));
+    args.GetReturnValue().Set(array);
+}
+
+void setCompressedCache(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.setCompressedCache((size_t) args[0].As<Number>()->Value(), (size_t) args[1].As<Number>()->Value());
+}
+
+void getCompressedCacheStats(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate();
+    uWS::Hub::CompressedCacheStats stats = addon->hub.getCompressedCacheStats();
+    Local<Array> array = Array::New(isolate, 4);
+    array->Set(isolate->GetCurrentContext(), 0, Number::New(isolate, (double) stats.entries));
+    array->Set(isolate->GetCurrentContext(), 1, Number::New(isolate, (double) stats.bytes));
+    array->Set(isolate->GetCurrentContext(), 2, Number::New(isolate, (double) stats.hits));
+    array->Set(isolate->GetCurrentContext(), 3, Number::New(isolate, (double) stats.misses));
+    args.GetReturnValue().Set(array);
+}
+
+void trim(const FunctionCallbackInfo<Value> &args) {
+    args.GetReturnValue().Set(Number::New(args.GetIsolate(), (double) addon->hub.trim((uWS::Hub::TrimLevel) args[0].As<Integer>()->Value())));
+}
+
+void setCallbackTiming(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.setCallbackTiming(args[0].As<Boolean>()->Value());
+}
+
+void setDeferredWrites(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.setDeferredWrites(args[0].As<Boolean>()->Value());
+}
+
+void setZeroCopyThreshold(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.setZeroCopyThreshold((size_t) args[0].As<Number>()->Value());
+}
+
+void setCompressionOffloadThreshold(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.setCompressionOffloadThreshold((size_t) args[0].As<Number>()->Value());
+}
+
+void setInflationOffloadThreshold(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.setInflationOffloadThreshold((size_t) args[0].As<Number>()->Value());
+}
+
+void setZeroCopyMessageThreshold(const FunctionCallbackInfo<Value> &args) {
+    addon->zeroCopyMessageThreshold = (size_t) args[0].As<Number>()->Value();
+}
+
+// at most an eighth of a slab, so that little of one goes unused
+void setMessagePoolThreshold(const FunctionCallbackInfo<Value> &args) {
+    addon->messagePoolThreshold = std::min<size_t>((size_t) args[0].As<Number>()->Value(), AddonData::MESSAGE_POOL_SIZE / 8);
+}
+
+void setExternalStringThreshold(const FunctionCallbackInfo<Value> &args) {
+    addon->externalStringThreshold = (size_t) args[0].As<Number>()->Value();
+}
+
+void setTextAsBuffer(const FunctionCallbackInfo<Value> &args) {
+    addon->textAsBuffer = args[0].As<Boolean>()->Value();
+}
+
+void setReadBudget(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.setReadBudget((int) args[0].As<Number>()->Value(), (size_t) args[1].As<Number>()->Value());
+}
+
+void setWriteBudget(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.setWriteBudget((size_t) args[0].As<Number>()->Value(), args[1].As<Uint32>()->Value());
+}
+
+void setBulkShare(const FunctionCallbackInfo<Value> &args) {
+    addon->hub.setBulkShare((size_t) args[0].As<Number>()->Value());
+}
+
+void setBufferSettings(const FunctionCallbackInfo<Value> &args) {
+    uWS::BufferSettings bufferSettings;
+    bufferSettings.recvBufferSize = (size_t) args[0].As<Number>()->Value();
+    bufferSettings.zlibBufferSize = (size_t) args[1].As<Number>()->Value();
+    bufferSettings.hugePages = args[2].As<Boolean>()->Value();
+    addon->hub.setBufferSettings(bufferSettings);
+}
+
+void setNoop(const FunctionCallbackInfo<Value> &args) {
+    addon->noop.Reset(args.GetIsolate(), Local<Function>::Cast(args[0]));
+}
+
+// the ring shared with the other processes of the host, null where there is none
+void joinBus(const FunctionCallbackInfo<Value> &args) {
+    NativeString name(args.GetIsolate(), args[0]);
+    uWS::SharedBus *bus = uWS::SharedBus::join(&addon->hub, std::string(name.getData(), name.getLength()).c_str(), (size_t) args[1].As<Number>()->Value());
+    if (bus) {
+        args.GetReturnValue().Set(External::New(args.GetIsolate(), bus));
+    } else {
+        args.GetReturnValue().SetNull();
+    }
+}
+
+void leaveBus(const FunctionCallbackInfo<Value> &args) {
+    ((uWS::SharedBus *) args[0].As<External>()->Value())->leave();
+}
+
+// a null group detaches the channel
+void attachBus(const FunctionCallbackInfo<Value> &args) {
+    uWS::Group *group = args[2]->IsExternal() ? (uWS::Group *) args[2].As<External>()->Value() : nullptr;
+    ((uWS::SharedBus *) args[0].As<External>()->Value())->attach(args[1].As<Uint32>()->Value(), group);
+}
+
+// a message or a prepared one, as for broadcast
+void broadcastBus(const FunctionCallbackInfo<Value> &args) {
+    uWS::SharedBus *bus = (uWS::SharedBus *) args[0].As<External>()->Value();
+    unsigned int channel = args[1].As<Uint32>()->Value();
+    if (args[2]->IsExternal()) {
+        args.GetReturnValue().Set(bus->broadcast(channel, (uWS::WebSocket::PreparedMessage *) args[2].As<External>()->Value()));
+        return;
+    }
+    NativeString nativeString(args.GetIsolate(), args[2]);
+    args.GetReturnValue().Set(bus->broadcast(channel, nativeString.getData(), nativeString.getLength(), (uWS::OpCode) args[3].As<Integer>()->Value(), args[4]->IsTrue()));
+}
+
+void publishBus(const FunctionCallbackInfo<Value> &args) {
+    uWS::SharedBus *bus = (uWS::SharedBus *) args[0].As<External>()->Value();
+    unsigned int channel = args[1].As<Uint32>()->Value();
+    NativeString topic(args.GetIsolate(), args[2]);
+    if (args[3]->IsExternal()) {
+        args.GetReturnValue().Set(bus->publish(channel, topic.getData(), topic.getLength(), (uWS::WebSocket::PreparedMessage *) args[3].As<External>()->Value()));
+        return;
+    }
+    NativeString nativeString(args.GetIsolate(), args[3]);
+    args.GetReturnValue().Set(bus->publish(channel, topic.getData(), topic.getLength(), nativeString.getData(), nativeString.getLength(), (uWS::OpCode) args[4].As<Integer>()->Value(), args[5]->IsTrue()));
+}
+
+void getBusDropped(const FunctionCallbackInfo<Value> &args) {
+    args.GetReturnValue().Set(Number::New(args.GetIsolate(), (double) ((uWS::SharedBus *) args[0].As<External>()->Value())->getDropped()));
+}
+
+// WebSockets on HTTP/2 streams, whose frames JS writes to the stream and whose input it hands to consume
+void setStreamHandlers(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate();
+    addon->streamWriteHandler.Reset(isolate, Local<Function>::Cast(args[0]));
+    addon->streamMessageHandler.Reset(isolate, Local<Function>::Cast(args[1]));
+    addon->streamCloseHandler.Reset(isolate, Local<Function>::Cast(args[2]));
+}
+
+inline Local<Value> getStreamDataV8(uWS::StreamWebSocket *streamWebSocket, Isolate *isolate) {
+    return Local<Value>::New(isolate, *(Persistent<Value> *) streamWebSocket->getUserData());
+}
+
+void createStream(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate();
+    uWS::StreamWebSocket *streamWebSocket = new uWS::StreamWebSocket(args[0]->IsUint32() ? args[0].As<Uint32>()->Value() : 16 * 1024 * 1024);
+    streamWebSocket->setUserData(new Persistent<Value>(isolate, args[1]));
+
+    streamWebSocket->onWrite([isolate](uWS::StreamWebSocket *streamWebSocket, const char *data, size_t length) {
+        HandleScope hs(isolate);
+        Local<Value> argv[] = {node::Buffer::Copy(isolate, data, length).ToLocalChecked(), getStreamDataV8(streamWebSocket, isolate)};
+        callJs(isolate, addon->streamWriteHandler, 2, argv);
+    });
+    streamWebSocket->onMessage([isolate](uWS::StreamWebSocket *streamWebSocket, char *message, size_t length, uWS::OpCode opCode) {
+        HandleScope hs(isolate);
+        Local<Value> argv[] = {wrapMessage(message, length, opCode, isolate), getStreamDataV8(streamWebSocket, isolate)};
+        callJs(isolate, addon->streamMessageHandler, 2, argv);
+    });
+    streamWebSocket->onClose([isolate](uWS::StreamWebSocket *streamWebSocket, int code, char *message, size_t length) {
+        HandleScope hs(isolate);
+        Local<Value> argv[] = {Integer::New(isolate, code), wrapMessage(message, length, uWS::OpCode::CLOSE, isolate),
+        getStreamDataV8(streamWebSocket, isolate)};
+        callJs(isolate, addon->streamCloseHandler, 3, argv);
+    });
+    args.GetReturnValue().Set(External::New(isolate, streamWebSocket));
+}
+
+void consumeStream(const FunctionCallbackInfo<Value> &args) {
+    NativeString nativeString(args.GetIsolate(), args[1]);
+    ((uWS::StreamWebSocket *) args[0].As<External>()->Value())->consume(nativeString.getData(), nativeString.getLength());
+}
+
+void sendStream(const FunctionCallbackInfo<Value> &args) {
+    NativeString nativeString(args.GetIsolate(), args[1]);
+    ((uWS::StreamWebSocket *) args[0].As<External>()->Value())->send(nativeString.getData(), nativeString.getLength(), (uWS::OpCode) args[2].As<Integer>()->Value());
+}
+
+void closeStream(const FunctionCallbackInfo<Value> &args) {
+    NativeString nativeString(args.GetIsolate(), args[2]);
+    ((uWS::StreamWebSocket *) args[0].As<External>()->Value())->close(args[1].As<Integer>()->Value(), nativeString.getData(), nativeString.getLength());
+}
+
+// once the stream is gone, onClose runs with 1006 if it did not yet
+void destroyStream(const FunctionCallbackInfo<Value> &args) {
+    uWS::StreamWebSocket *streamWebSocket = (uWS::StreamWebSocket *) args[0].As<External>()->Value();
+    streamWebSocket->terminate();
+    Persistent<Value> *object = (Persistent<Value> *) streamWebSocket->getUserData();
+    object->Reset();
+    delete object;
+    delete streamWebSocket;
+}
+
+struct Namespace {
     Local<Object> object;
     Namespace(Isolate *isolate) {
         object = Object::New(isolate);
         NODE_SET_METHOD(object, "send", send);
+        NODE_SET_METHOD(object, "sendMany", sendMany);
+        NODE_SET_METHOD(object, "sendBatch", sendBatch);
+        NODE_SET_METHOD(object, "beginMessage", beginMessage);
+        NODE_SET_METHOD(object, "sendFragment", sendFragment);
+        NODE_SET_METHOD(object, "endMessage", endMessage);
         NODE_SET_METHOD(object, "close", closeSocket);
+        NODE_SET_METHOD(object, "terminate", terminateSocket);
+        NODE_SET_METHOD(object, "cork", cork);
+        NODE_SET_METHOD(object, "setIdleTimeout", setIdleTimeout);
+        NODE_SET_METHOD(object, "sendPrepared", sendPrepared);
+        NODE_SET_METHOD(object, "sendFrame", sendFrame);
+        NODE_SET_METHOD(object, "finalizeMessage", finalizeMessage);
+        NODE_SET_METHOD(object, "prepareFile", prepareFile);
+        NODE_SET_METHOD(object, "sendFile", sendFile);
+        NODE_SET_METHOD(object, "finalizeFile", finalizeFile);
+        NODE_SET_METHOD(object, "subscribe", subscribe);
+        NODE_SET_METHOD(object, "unsubscribe", unsubscribe);
+        NODE_SET_METHOD(object, "openSession", openSession);
+        NODE_SET_METHOD(object, "resumeSession", resumeSession);
 
         Local<Object> group = Object::New(isolate);
         NODE_SET_METHOD(group, "onConnection", onConnection);
         NODE_SET_METHOD(group, "onMessage", onMessage);
+        NODE_SET_METHOD(group, "onMessageChunk", onMessageChunk);
+        NODE_SET_METHOD(group, "onMessageBatch", onMessageBatch);
         NODE_SET_METHOD(group, "onDisconnection", onDisconnection);
+        NODE_SET_METHOD(group, "onDrain", onDrain);
+        NODE_SET_METHOD(group, "setEventRing", setEventRing);
+        NODE_SET_METHOD(group, "setSlowConsumer", setSlowConsumer);
+        NODE_SET_METHOD(group, "setTcpInfoSampling", setTcpInfoSampling);
+        NODE_SET_METHOD(group, "setCompressionMinRtt", setCompressionMinRtt);
+        NODE_SET_METHOD(group, "setMaxBackpressure", setMaxBackpressure);
+        NODE_SET_METHOD(group, "setInboundLimit", setInboundLimit);
+        NODE_SET_METHOD(group, "getInboundDropped", getInboundDropped);
+        NODE_SET_METHOD(group, "getRttHistogram", getRttHistogram);
+        NODE_SET_METHOD(group, "getMemoryStats", getMemoryStats);
+        NODE_SET_METHOD(group, "getMetrics", getMetrics);
+        NODE_SET_METHOD(group, "setLatencyHistograms", setLatencyHistograms);
+        NODE_SET_METHOD(group, "setCpuAccounting", setCpuAccounting);
+        NODE_SET_METHOD(group, "getTopSockets", getTopSockets);
+        NODE_SET_METHOD(group, "startRecording", startRecording);
+        NODE_SET_METHOD(group, "stopRecording", stopRecording);
+        NODE_SET_METHOD(group, "setDeflateWindow", setDeflateWindow);
+        NODE_SET_METHOD(group, "setMaxDeflateWindows", setMaxDeflateWindows);
+        NODE_SET_METHOD(group, "setBacklogCompression", setBacklogCompression);
+        NODE_SET_METHOD(group, "setInflateWindow", setInflateWindow);
+        NODE_SET_METHOD(group, "setCompressionThreshold", setCompressionThreshold);
+        NODE_SET_METHOD(group, "setFragmentSize", setFragmentSize);
+        NODE_SET_METHOD(group, "setSendChunkSize", setSendChunkSize);
+        NODE_SET_METHOD(group, "setNotSentLowat", setNotSentLowat);
+        NODE_SET_METHOD(group, "setRateLimit", setRateLimit);
+        NODE_SET_METHOD(group, "setQos", setQos);
+        NODE_SET_METHOD(group, "setNoDelay", setNoDelay);
+        NODE_SET_METHOD(group, "setAdaptiveNoDelay", setAdaptiveNoDelay);
+        NODE_SET_METHOD(group, "setReassemblyBudget", setReassemblyBudget);
+        NODE_SET_METHOD(group, "setReadBackpressure", setReadBackpressure);
+        NODE_SET_METHOD(group, "setDeflateWindowIdleTimeout", setDeflateWindowIdleTimeout);
+        NODE_SET_METHOD(group, "setDeflateDictionary", setDeflateDictionary);
+        NODE_SET_METHOD(group, "setAutoReply", setAutoReply);
+        NODE_SET_METHOD(group, "setHeartbeat", setHeartbeat);
+        NODE_SET_METHOD(group, "setSessions", setSessions);
+        NODE_SET_METHOD(group, "setAdmission", setAdmission);
 
         NODE_SET_METHOD(group, "create", createGroup);
         NODE_SET_METHOD(group, "close", closeGroup);
+        NODE_SET_METHOD(group, "drain", drainGroup);
+        NODE_SET_METHOD(group, "handOff", handOff);
+        NODE_SET_METHOD(group, "adoptHandOff", adoptHandOff);
+        NODE_SET_METHOD(group, "listen", listenGroup);
+        NODE_SET_METHOD(group, "stopListening", stopListeningGroup);
+        NODE_SET_METHOD(group, "broadcast", broadcast);
+        NODE_SET_METHOD(group, "broadcastFile", broadcastFile);
+        NODE_SET_METHOD(group, "publish", publish);
+        NODE_SET_METHOD(group, "setLastValues", setLastValues);
+        NODE_SET_METHOD(group, "clearLastValue", clearLastValue);
+        NODE_SET_METHOD(group, "publishRooms", publishRooms);
+        NODE_SET_METHOD(group, "prepareMessage", prepareMessage);
 
         object->Set(isolate->GetCurrentContext(), String::NewFromUtf8(isolate, "group", NewStringType::kNormal).ToLocalChecked(), group);
+
+        Local<Object> stream = Object::New(isolate);
+        NODE_SET_METHOD(stream, "setHandlers", setStreamHandlers);
+        NODE_SET_METHOD(stream, "create", createStream);
+        NODE_SET_METHOD(stream, "consume", consumeStream);
+        NODE_SET_METHOD(stream, "send", sendStream);
+        NODE_SET_METHOD(stream, "close", closeStream);
+        NODE_SET_METHOD(stream, "destroy", destroyStream);
+
+        object->Set(isolate->GetCurrentContext(), String::NewFromUtf8(isolate, "stream", NewStringType::kNormal).ToLocalChecked(), stream);
+
+        Local<Object> bus = Object::New(isolate);
+        NODE_SET_METHOD(bus, "join", joinBus);
+        NODE_SET_METHOD(bus, "leave", leaveBus);
+        NODE_SET_METHOD(bus, "attach", attachBus);
+        NODE_SET_METHOD(bus, "broadcast", broadcastBus);
+        NODE_SET_METHOD(bus, "publish", publishBus);
+        NODE_SET_METHOD(bus, "getDropped", getBusDropped);
+
+        object->Set(isolate->GetCurrentContext(), String::NewFromUtf8(isolate, "bus", NewStringType::kNormal).ToLocalChecked(), bus);
     }
 };
@@ -0,0 +1,354 @@
+#ifndef COROUTINE_UWS_H
+#define COROUTINE_UWS_H
+
+#include "Hub.h"
+
+/*
+ * An optional layer for C++20 embedders, the library itself builds as C++17 without it:
+ *
+ *   uWS::Task stream(uWS::WebSocket *ws, Source &source) {
+ *       uWS::Inbox inbox(ws);
+ *       while (std::optional<uWS::InboxMessage> request = co_await inbox.next()) {
+ *           for (std::string_view piece : source.read(request->data)) {
+ *               if (!co_await uWS::sendAsync(ws, piece.data(), piece.length(), uWS::OpCode::BINARY)) {
+ *                   co_return;
+ *               }
+ *           }
+ *       }
+ *   }
+ *
+ * sendAsync goes on once its message was written to the socket and false if it was
+ * cancelled, without suspending at all while nothing is queued. drained goes on once
+ * at most lowWater bytes are queued. The callback data of each send is the awaiter in
+ * the coroutine frame, and frames come from a pool of the loop thread, so a producer
+ * allocates nothing per message. Coroutines are resumed in the check phase of the loop
+ * (after I/O and before it blocks), never from within a write or a handler.
+ *
+ * Inbox needs the handlers of the group to hand it messages and closes:
+ *
+ *   group->onMessage([](uWS::WebSocket *ws, char *message, size_t length, uWS::OpCode opCode) {
+ *       uWS::Inbox::deliver(ws, message, length, opCode);
+ *   });
+ *   group->onDisconnection([](uWS::WebSocket *ws, int code, char *message, size_t length) {
+ *       uWS::Inbox::close(ws);
+ *   });
+ *
+ * One loop per thread. Not thread safe, everything here is of the loop thread
+ *
+ */
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace uWS {
+    namespace coroutine {
+        // frames of finished coroutines by size, up to 4 KB, for the next ones of the thread
+        struct FramePool {
+            static const size_t GRANULE = 64, CLASSES = 64, MAX_FREE = 256;
+            std::vector<void *> free[CLASSES];
+
+            static FramePool &get() {
+                static thread_local FramePool pool;
+                return pool;
+            }
+
+            ~FramePool() {
+                for (std::vector<void *> &frames : free) {
+                    for (void *frame : frames) {
+                        ::operator delete(frame);
+                    }
+                }
+            }
+
+            void *allocate(size_t size) {
+                size_t sizeClass = (size + GRANULE - 1) / GRANULE - 1;
+                if (sizeClass >= CLASSES) {
+                    return ::operator new(size);
+                }
+                if (free[sizeClass].empty()) {
+                    return ::operator new((sizeClass + 1) * GRANULE);
+                }
+                void *frame = free[sizeClass].back();
+                free[sizeClass].pop_back();
+                return frame;
+            }
+
+            void release(void *frame, size_t size) {
+                size_t sizeClass = (size + GRANULE - 1) / GRANULE - 1;
+                if (sizeClass >= CLASSES || free[sizeClass].size() >= MAX_FREE) {
+                    ::operator delete(frame);
+                } else {
+                    free[sizeClass].push_back(frame);
+                }
+            }
+        };
+
+        struct DrainWait;
+
+        // the coroutines to go on, and those waiting for a socket to drain, which are looked at each check phase
+        struct Scheduler {
+            uS::Check *check = nullptr;
+            std::vector<std::coroutine_handle<>> ready, running;
+            std::vector<DrainWait *> drainWaits;
+
+            static Scheduler &get(uS::Loop *loop) {
+                static thread_local Scheduler scheduler;
+                if (!scheduler.check) {
+                    scheduler.check = new uS::Check(loop);
+                    scheduler.check->setData(&scheduler);
+                    scheduler.check->start(run);
+                }
+                return scheduler;
+            }
+
+            void schedule(std::coroutine_handle<> handle) {
+                ready.push_back(handle);
+            }
+
+            inline static void run(uS::Check *check);
+        };
+
+        struct DrainWait {
+            Group *group;
+            uint64_t id;
+            size_t lowWater;
+            std::coroutine_handle<> handle;
+            bool open = true;
+        };
+
+        inline void Scheduler::run(uS::Check *check) {
+            Scheduler *scheduler = (Scheduler *) check->getData();
+            for (size_t i = 0; i < scheduler->drainWaits.size(); ) {
+                DrainWait *drainWait = scheduler->drainWaits[i];
+                WebSocket *webSocket = drainWait->group->getWebSocket(drainWait->id);
+                if (webSocket && webSocket->getBufferedAmount() > drainWait->lowWater) {
+                    i++;
+                    continue;
+                }
+                drainWait->open = webSocket != nullptr;
+                scheduler->ready.push_back(drainWait->handle);
+                scheduler->drainWaits[i] = scheduler->drainWaits.back();
+                scheduler->drainWaits.pop_back();
+            }
+
+            // those resumed now may schedule more, which go in the same round
+            while (!scheduler->ready.empty()) {
+                scheduler->running.swap(scheduler->ready);
+                for (std::coroutine_handle<> handle : scheduler->running) {
+                    handle.resume();
+                }
+                scheduler->running.clear();
+            }
+        }
+
+        struct Sent {
+            WebSocket *webSocket;
+            const char *message;
+            size_t length;
+            OpCode opCode;
+            bool compress;
+            std::coroutine_handle<> handle;
+            bool done = false, cancelled = false, suspended = false;
+
+            bool await_ready() {
+                return false;
+            }
+
+            // the send may be done before it returns, the coroutine then goes on without suspending
+            bool await_suspend(std::coroutine_handle<> handle) {
+                this->handle = handle;
+                uS::Loop *loop = webSocket->getLoop();
+                webSocket->send(message, length, opCode, [](WebSocket *webSocket, void *data, bool cancelled, void *reserved) {
+                    Sent *sent = (Sent *) data;
+                    sent->done = true;
+                    sent->cancelled = cancelled;
+                    if (sent->suspended) {
+                        Scheduler::get(nullptr).schedule(sent->handle);
+                    }
+                }, this, compress);
+                if (done) {
+                    return false;
+                }
+                Scheduler::get(loop);
+                suspended = true;
+                return true;
+            }
+
+            bool await_resume() {
+                return !cancelled;
+            }
+        };
+
+        struct Drained {
+            WebSocket *webSocket;
+            DrainWait drainWait;
+
+            bool await_ready() {
+                return webSocket->getBufferedAmount() <= drainWait.lowWater;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) {
+                drainWait.group = Group::from(webSocket);
+                drainWait.id = drainWait.group->getId(webSocket);
+                drainWait.handle = handle;
+                Scheduler::get(webSocket->getLoop()).drainWaits.push_back(&drainWait);
+            }
+
+            bool await_resume() {
+                return drainWait.open;
+            }
+        };
+    }
+
+    // a coroutine that starts right away and frees itself when done, nobody awaits it. Exceptions
+    // escaping it terminate
+    struct Task {
+        struct promise_type {
+            Task get_return_object() {
+                return {};
+            }
+            std::suspend_never initial_suspend() noexcept {
+                return {};
+            }
+            std::suspend_never final_suspend() noexcept {
+                return {};
+            }
+            void return_void() {}
+            void unhandled_exception() {
+                std::terminate();
+            }
+
+            static void *operator new(size_t size) {
+                return coroutine::FramePool::get().allocate(size);
+            }
+            static void operator delete(void *frame, size_t size) {
+                coroutine::FramePool::get().release(frame, size);
+            }
+        };
+    };
+
+    // sends as WebSocket::send does, the message is copied before this suspends. True once it was written,
+    // false if it was dropped for backpressure or the socket closed first
+    inline coroutine::Sent sendAsync(WebSocket *webSocket, const char *message, size_t length, OpCode opCode = OpCode::TEXT, bool compress = false) {
+        return {webSocket, message, length, opCode, compress};
+    }
+
+    // true once at most lowWater bytes are queued, false if the socket closed or left its group first
+    inline coroutine::Drained drained(WebSocket *webSocket, size_t lowWater = 0) {
+        coroutine::Drained drained = {webSocket, {}};
+        drained.drainWait.lowWater = lowWater;
+        return drained;
+    }
+
+    struct InboxMessage {
+        std::string data;
+        OpCode opCode;
+    };
+
+    // the messages of a socket for the coroutine it lives in, copied out of the parser's buffer. Reading
+    // pauses while maxQueued of them wait to be taken, 0 for no limit. One per socket at a time
+    struct Inbox {
+        Inbox(WebSocket *webSocket, size_t maxQueued = 64) : webSocket(webSocket), maxQueued(maxQueued) {
+            inboxes()[webSocket] = this;
+        }
+
+        ~Inbox() {
+            if (webSocket) {
+                inboxes().erase(webSocket);
+                if (paused) {
+                    webSocket->resumeReading();
+                }
+            }
+        }
+
+        Inbox(const Inbox &) = delete;
+        Inbox &operator=(const Inbox &) = delete;
+
+        // the next message, none once the socket closed and everything before was taken
+        struct Next {
+            Inbox *inbox;
+
+            bool await_ready() {
+                return !inbox->messages.empty() || !inbox->webSocket;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) {
+                inbox->waiting = handle;
+            }
+
+            std::optional<InboxMessage> await_resume() {
+                return inbox->take();
+            }
+        };
+
+        Next next() {
+            return {this};
+        }
+
+        // for the message handler of the group, false if the socket has no inbox
+        static bool deliver(WebSocket *webSocket, const char *message, size_t length, OpCode opCode) {
+            std::unordered_map<WebSocket *, Inbox *>::iterator it = inboxes().find(webSocket);
+            if (it == inboxes().end()) {
+                return false;
+            }
+            Inbox *inbox = it->second;
+            inbox->messages.push_back({std::string(message, length), opCode});
+            if (inbox->maxQueued && inbox->messages.size() >= inbox->maxQueued && !inbox->paused) {
+                inbox->paused = true;
+                webSocket->pauseReading();
+            }
+            inbox->wake();
+            return true;
+        }
+
+        // for the disconnection handler of the group
+        static void close(WebSocket *webSocket) {
+            std::unordered_map<WebSocket *, Inbox *>::iterator it = inboxes().find(webSocket);
+            if (it != inboxes().end()) {
+                Inbox *inbox = it->second;
+                inboxes().erase(it);
+                inbox->wake();
+                inbox->webSocket = nullptr;
+            }
+        }
+
+    private:
+        WebSocket *webSocket;
+        size_t maxQueued;
+        bool paused = false;
+        std::deque<InboxMessage> messages;
+        std::coroutine_handle<> waiting;
+
+        static std::unordered_map<WebSocket *, Inbox *> &inboxes() {
+            static thread_local std::unordered_map<WebSocket *, Inbox *> inboxes;
+            return inboxes;
+        }
+
+        void wake() {
+            if (waiting) {
+                coroutine::Scheduler::get(webSocket->getLoop()).schedule(waiting);
+                waiting = nullptr;
+            }
+        }
+
+        std::optional<InboxMessage> take() {
+            if (messages.empty()) {
+                return std::nullopt;
+            }
+            InboxMessage message = std::move(messages.front());
+            messages.pop_front();
+            if (paused && messages.empty() && webSocket) {
+                paused = false;
+                webSocket->resumeReading();
+            }
+            return message;
+        }
+    };
+}
+#endif
+
+#endif // COROUTINE_UWS_H
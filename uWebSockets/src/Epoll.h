@@ -0,0 +1,1141 @@
+#ifndef EPOLL_H
+#define EPOLL_H
+
+// the loop of a Linux build without USE_LIBUV, on epoll itself, with USE_IO_URING on an io_uring (Linux 5.19+) or
+// with USE_MTCP on the epoll of mTCP, and of a macOS or FreeBSD build without USE_LIBUV, on kqueue. Same interface as Libuv.h, and the few libuv names
+// the rest of the tree uses directly (uv_run, uv_now, uv_hrtime, uv_queue_work) behave as they do there
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#define UWS_KQUEUE
+#endif
+
+#ifdef UWS_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <system_error>
+#endif
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#ifndef USE_IO_URING
+// Polls may register edge triggered, see Poll::edgeTriggered
+#define UWS_EDGE_TRIGGERED
+#endif
+
+typedef int uv_os_sock_t;
+#ifdef UWS_KQUEUE
+static const int UV_READABLE = 1;
+static const int UV_WRITABLE = 2;
+#else
+static const int UV_READABLE = EPOLLIN;
+static const int UV_WRITABLE = EPOLLOUT;
+#endif
+
+enum uv_run_mode {
+    UV_RUN_DEFAULT,
+    UV_RUN_ONCE,
+    UV_RUN_NOWAIT
+};
+
+namespace uS {
+    struct Loop;
+}
+
+// runs work on one of the threads of the pool, then after on the loop thread
+struct uv_work_t {
+    void *data;
+    uS::Loop *loop;
+    void (*work)(uv_work_t *);
+    void (*after)(uv_work_t *, int);
+};
+
+namespace uS {
+    struct Poll;
+    struct Timer;
+    struct Async;
+    struct Check;
+
+#ifdef USE_IO_URING
+    // one poll request in the ring, one-shot and armed again after each completion so that readiness stays level
+    // triggered: the socket code leaves data unread past its read budget. A Poll changing or stopping cancels its
+    // watch, which then completes for no Poll at all
+    struct Watch {
+        Poll *poll;
+        int events;
+    };
+#endif
+
+    struct Loop {
+        static const int MAX_READY_EVENTS = 1024;
+#ifdef UWS_KQUEUE
+        // what deliver takes besides UV_READABLE and UV_WRITABLE, as EPOLLERR and EPOLLHUP are for epoll
+        static const int ERROR_EVENTS = 4, HANGUP_EVENTS = 8;
+#else
+        static const int ERROR_EVENTS = EPOLLERR, HANGUP_EVENTS = EPOLLHUP;
+#endif
+
+#ifdef USE_IO_URING
+        static const unsigned RING_ENTRIES = 1024;
+        // user_data of the poll on wakeFd and of cancellations, no Watch is at either address
+        static const uint64_t WAKE_TAG = 0, CANCEL_TAG = 1;
+        int ringFd;
+        void *ringMemory;
+        size_t ringLength;
+        io_uring_sqe *sqes;
+        unsigned *sqHead, *sqTailShared, *sqArray, sqMask, sqEntries, sqTail;
+        unsigned *cqHead, *cqTail, cqMask;
+        io_uring_cqe *cqes;
+        io_uring_cqe readyCompletions[MAX_READY_EVENTS];
+        std::vector<Watch *> freeWatches;
+        // cancelled watches still to complete, they keep the loop alive like closing handles
+        int orphans = 0;
+
+        void openRing();
+        void closeRing();
+        io_uring_sqe *getSqe();
+        void enter(unsigned minComplete, int timeout);
+        void armWake();
+        void arm(Poll *poll, int events);
+        void cancel(Watch *watch);
+#elif defined(UWS_KQUEUE)
+        // at most this many changes go with the kevent that waits, which leaves room for an error of each
+        static const int MAX_CHANGES = MAX_READY_EVENTS / 2;
+        int kq;
+        struct kevent readyEvents[MAX_READY_EVENTS];
+        // filters to add and delete, handed to the kernel in order with the next wait rather than a kevent each
+        std::vector<struct kevent> changes;
+        // the Poll watching each fd, by which events are dispatched. What comes for an fd its Poll stopped
+        // watching or that another took over finds that one or none, never a Poll since freed
+        std::vector<Poll *> watchers;
+        // edge triggered polls that left data unread, called again as readable without asking the kernel
+        std::vector<Poll *> rereads;
+
+        void changeFilter(uv_os_sock_t fd, short filter, bool registered, bool wanted, unsigned short flags);
+        void dispatch(const struct kevent &event);
+#elif defined(USE_MTCP)
+        // at most this long a wait leaves Async::send unseen, which has no fd in mTCP's epoll to wake it by
+        static const int WAKE_INTERVAL_MS = 1;
+        // the mTCP stack of this loop's core, taken in the order loops are created
+        mctx_t mctx;
+        int epfd;
+        mtcp_epoll_event readyEvents[MAX_READY_EVENTS];
+        std::atomic<bool> woken {false};
+        // edge triggered polls that left data unread, called again as readable without asking the kernel
+        std::vector<Poll *> rereads;
+
+        // that of the loop the calling thread created or runs last, which every mTCP call of uS::Context is on
+        static mctx_t &mtcpContext() {
+            static thread_local mctx_t mctx = nullptr;
+            return mctx;
+        }
+#else
+        int epfd;
+        epoll_event readyEvents[MAX_READY_EVENTS];
+        // edge triggered polls that left data unread, called again as readable without asking the kernel
+        std::vector<Poll *> rereads;
+#endif
+#if !defined(UWS_KQUEUE) && !defined(USE_MTCP)
+        // the eventfd of Async::send and of finished work, polled with no Poll
+        int wakeFd;
+#endif
+        // in ms, taken once per iteration like uv_now
+        uint64_t now = 0;
+        // blocked in wait so far, for uv_metrics_idle_time
+        uint64_t idleNanos = 0;
+        void countIdle(uint64_t blockedAt) {
+            if (blockedAt) {
+                idleNanos += hrtime() - blockedAt;
+            }
+        }
+        // timers, polls with events, asyncs and work that keep the loop running
+        int activeHandles = 0;
+        std::vector<Timer *> timers;
+        std::vector<Async *> asyncs;
+        std::vector<Check *> checks;
+        // what close and detach call back once the iteration is done with the handle
+        std::vector<std::function<void()>> closing;
+        // work of uv_queue_work back from the pool
+        std::mutex completedMutex;
+        std::vector<uv_work_t *> completed;
+        int pendingWork = 0;
+        // set by Node::setBusyPoll, how long an iteration polls without blocking before it may sleep
+        int busyPollMicros = 0;
+
+        Loop() {
+#ifdef UWS_KQUEUE
+            // Async::send and finished work trigger the user event, which clears itself once reported
+            kq = kqueue();
+            struct kevent event;
+            EV_SET(&event, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+            kevent(kq, &event, 1, nullptr, 0, nullptr);
+#elif defined(USE_IO_URING)
+            wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            openRing();
+            armWake();
+#elif defined(USE_MTCP)
+            static std::atomic<int> nextCore {0};
+            int core = nextCore++;
+            mtcp_core_affinitize(core);
+            mctx = mtcp_create_context(core);
+            epfd = mtcp_epoll_create(mctx, MAX_READY_EVENTS);
+            mtcpContext() = mctx;
+#else
+            wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            epfd = epoll_create1(EPOLL_CLOEXEC);
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.ptr = nullptr;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &event);
+#endif
+            updateTime();
+        }
+
+        // the default loop, or one of its own for a thread to run
+        static Loop *createLoop(bool defaultLoop = true) {
+            if (defaultLoop) {
+                static Loop *loop = new Loop;
+                return loop;
+            }
+            return new Loop;
+        }
+
+        // lets what is still closing finish and frees a loop of its own, the default loop stays
+        void destroy() {
+            if (this != createLoop()) {
+                run(UV_RUN_DEFAULT);
+#ifdef USE_IO_URING
+                closeRing();
+#elif defined(UWS_KQUEUE)
+                ::close(kq);
+#elif defined(USE_MTCP)
+                mtcp_close(mctx, epfd);
+                mtcp_destroy_context(mctx);
+#else
+                ::close(epfd);
+#endif
+#if !defined(UWS_KQUEUE) && !defined(USE_MTCP)
+                ::close(wakeFd);
+#endif
+                delete this;
+            }
+        }
+
+        void updateTime() {
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            now = (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+        }
+
+        // in ns
+        static uint64_t hrtime() {
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+        }
+
+        void wake() {
+#ifdef UWS_KQUEUE
+            struct kevent event;
+            EV_SET(&event, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+            while (kevent(kq, &event, 1, nullptr, 0, nullptr) == -1 && errno == EINTR);
+#elif defined(USE_MTCP)
+            woken.store(true, std::memory_order_release);
+#else
+            uint64_t one = 1;
+            while (::write(wakeFd, &one, sizeof(one)) == -1 && errno == EINTR);
+#endif
+        }
+
+        bool isAlive() {
+#ifdef USE_IO_URING
+            if (orphans) {
+                return true;
+            }
+#endif
+            return activeHandles || pendingWork || !closing.empty();
+        }
+
+        int run(uv_run_mode mode);
+        int nextTimeout();
+        void runTimers();
+        void runChecks();
+        void runWakeups();
+        // what the kernel is to report of poll's fd, which it reported nothing of yet if poll->events is 0
+        void watch(Poll *poll, int events);
+        void unwatch(Poll *poll);
+        // blocks for I/O up to timeout ms, -1 for no limit, and dispatches it. Returns how many events came
+        int wait(int timeout);
+        // wait, preceded by up to busyPollMicros of polling without blocking
+        void spin(int timeout);
+        void deliver(Poll *poll, int events);
+        void runClosing();
+        void sweep();
+    };
+
+    struct Async {
+        Loop *loop;
+        void (*cb)(Async *) = nullptr;
+        void *data = nullptr;
+        std::atomic<bool> pending {false};
+        bool started = false, referenced = true, closed = false;
+
+        Async(Loop *loop) : loop(loop) {}
+
+        void start(void (*cb)(Async *)) {
+            this->cb = cb;
+            started = true;
+            loop->asyncs.push_back(this);
+            if (referenced) {
+                loop->activeHandles++;
+            }
+        }
+
+        // wakes the loop only once until the callback ran
+        void send() {
+            if (!pending.exchange(true)) {
+                loop->wake();
+            }
+        }
+
+        // does not keep the loop alive on its own
+        void unref() {
+            if (referenced && started) {
+                loop->activeHandles--;
+            }
+            referenced = false;
+        }
+
+        void close() {
+            closed = true;
+            if (referenced && started) {
+                loop->activeHandles--;
+            }
+            loop->closing.push_back([this]() {
+                delete this;
+            });
+        }
+
+        void setData(void *data) {
+            this->data = data;
+        }
+
+        void *getData() {
+            return data;
+        }
+    };
+
+    struct Timer {
+        Loop *loop;
+        void (*cb)(Timer *) = nullptr;
+        void *data = nullptr;
+        uint64_t due = 0;
+        int repeat = 0;
+        // in loop->timers, which it leaves only between iterations
+        bool active = false, listed = false, referenced = true;
+
+        Timer(Loop *loop) : loop(loop) {}
+
+        void start(void (*cb)(Timer *), int first, int repeat) {
+            this->cb = cb;
+            this->repeat = repeat;
+            due = loop->now + (uint64_t) std::max(first, 0);
+            if (!active) {
+                active = true;
+                if (referenced) {
+                    loop->activeHandles++;
+                }
+            }
+            if (!listed) {
+                listed = true;
+                loop->timers.push_back(this);
+            }
+        }
+
+        void stop() {
+            if (active) {
+                active = false;
+                if (referenced) {
+                    loop->activeHandles--;
+                }
+            }
+        }
+
+        // does not keep the loop alive on its own
+        void unref() {
+            if (referenced) {
+                if (active) {
+                    loop->activeHandles--;
+                }
+                referenced = false;
+            }
+        }
+
+        void close() {
+            stop();
+            loop->closing.push_back([this]() {
+                delete this;
+            });
+        }
+
+        void setData(void *data) {
+            this->data = data;
+        }
+
+        void *getData() {
+            return data;
+        }
+    };
+
+    // calls back once right after I/O has been processed and once before the loop blocks again
+    struct Check {
+        Loop *loop;
+        void (*cb)(Check *) = nullptr;
+        void *data = nullptr;
+        bool closed = false;
+
+        Check(Loop *loop) : loop(loop) {}
+
+        void start(void (*cb)(Check *)) {
+            this->cb = cb;
+            loop->checks.push_back(this);
+        }
+
+        void close() {
+            closed = true;
+            loop->closing.push_back([this]() {
+                delete this;
+            });
+        }
+
+        void setData(void *data) {
+            this->data = data;
+        }
+
+        void *getData() {
+            return data;
+        }
+    };
+
+    // level triggered like uv_poll_t. The loop knows of a Poll from its first start on, before that it can
+    // be moved from and destroyed freely; after, close lets the current iteration finish with it first
+    struct Poll {
+        Loop *loop;
+        void (*cb)(Poll *p, int status, int events) = nullptr;
+        uv_os_sock_t fd;
+        // what it waits for, 0 for nothing
+        int events = 0;
+        bool initialized = false, closing = false;
+#ifdef USE_IO_URING
+        Watch *watch = nullptr;
+#else
+        // registers EPOLLOUT for good with EPOLLET, so UV_WRITABLE coming and going around backpressure
+        // takes no epoll_ctl. Only for fds that arm UV_WRITABLE right after a short write, when an edge is
+        // sure to follow, and whose cb calls readAgain when it stops reading with data left
+        bool edgeTriggered = false;
+        bool reread = false;
+#endif
+
+        Poll(Loop *loop, uv_os_sock_t fd) : loop(loop), fd(fd) {}
+
+        // takes over the fd. The registration other polled with is dropped, other stays to its owner,
+        // who closes it, this one registers anew from its first start
+        Poll(Poll &&other) : loop(other.loop), cb(other.cb), fd(other.fd) {
+#ifndef USE_IO_URING
+            edgeTriggered = other.edgeTriggered;
+#endif
+            if (other.initialized) {
+                other.stop();
+            }
+        }
+
+        Poll(const Poll &other) = delete;
+
+        bool isClosed() {
+            return initialized && closing;
+        }
+
+        uv_os_sock_t getFd() const {
+            return fd;
+        }
+
+        void setCb(void (*cb)(Poll *p, int status, int events)) {
+            this->cb = cb;
+        }
+
+        void (*getCb())(Poll *, int, int) {
+            return cb;
+        }
+
+        // no events is a stop, as with uv_poll_start. True if the registration changed
+        bool start(Poll *self, int events) {
+            initialized = true;
+            if (!events) {
+                bool watched = this->events;
+                stop();
+                return watched;
+            }
+            if (events == this->events) {
+                return false;
+            }
+            if (!this->events) {
+                loop->activeHandles++;
+            }
+            loop->watch(this, events);
+            this->events = events;
+            return true;
+        }
+
+        bool change(Poll *self, int events) {
+            return start(self, events);
+        }
+
+        void stop() {
+#ifndef USE_IO_URING
+            if (reread) {
+                loop->rereads.erase(std::find(loop->rereads.begin(), loop->rereads.end(), this));
+                reread = false;
+            }
+#endif
+            if (events) {
+                loop->unwatch(this);
+                loop->activeHandles--;
+                events = 0;
+            }
+        }
+
+        // lets go of the loop but not of the fd. The loop is done with the Poll only once detached
+        // runs (on its thread), from then on attach can have it poll on another loop with cb as it was
+        void detach(void (*detached)(Poll *p, void *data), void *data) {
+            stop();
+            closing = true;
+            loop->closing.push_back([this, detached, data]() {
+                initialized = closing = false;
+                detached(this, data);
+            });
+        }
+
+        void attach(Loop *loop) {
+            this->loop = loop;
+        }
+
+        Loop *getLoop() {
+            return loop;
+        }
+
+#ifndef USE_IO_URING
+        void setEdgeTriggered(bool enable) {
+            edgeTriggered = enable;
+        }
+
+        // what an edge triggered poll left in the kernel gets no edge of its own, the next iteration delivers it
+        void readAgain() {
+            if (edgeTriggered && !reread) {
+                reread = true;
+                loop->rereads.push_back(this);
+            }
+        }
+#endif
+
+        // events the iteration still holds for it are dropped, cb runs once it is done
+        void close(void (*cb)(Poll *)) {
+            stop();
+            initialized = closing = true;
+            loop->closing.push_back([this, cb]() {
+                cb(this);
+            });
+        }
+    };
+
+    // runs uv_queue_work jobs, as many threads as libuv's default pool and started on first use. Never
+    // destroyed, its threads may still wait on it while the process exits
+    struct ThreadPool {
+        static const int THREADS = 4;
+        std::mutex mutex;
+        std::condition_variable available;
+        std::deque<uv_work_t *> queue;
+
+        static ThreadPool *get() {
+            static ThreadPool *threadPool = new ThreadPool;
+            return threadPool;
+        }
+
+        ThreadPool() {
+            for (int i = 0; i < THREADS; i++) {
+                std::thread([this]() {
+                    for (;;) {
+                        uv_work_t *req;
+                        {
+                            std::unique_lock<std::mutex> lock(mutex);
+                            available.wait(lock, [this]() {return !queue.empty();});
+                            req = queue.front();
+                            queue.pop_front();
+                        }
+                        req->work(req);
+                        {
+                            std::lock_guard<std::mutex> lock(req->loop->completedMutex);
+                            req->loop->completed.push_back(req);
+                        }
+                        req->loop->wake();
+                    }
+                }).detach();
+            }
+        }
+
+        void push(uv_work_t *req) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back(req);
+            }
+            available.notify_one();
+        }
+    };
+
+    inline int Loop::nextTimeout() {
+#ifndef USE_IO_URING
+        if (!rereads.empty()) {
+            return 0;
+        }
+#endif
+        if (!closing.empty()) {
+            return 0;
+        }
+        uint64_t due = UINT64_MAX;
+        for (Timer *timer : timers) {
+            if (timer->active) {
+                due = std::min(due, timer->due);
+            }
+        }
+        if (due == UINT64_MAX) {
+            return -1;
+        }
+        return due > now ? (int) std::min<uint64_t>(due - now, INT32_MAX) : 0;
+    }
+
+    // timers started by a callback with no delay run in the same pass, like libuv's
+    inline void Loop::runTimers() {
+        for (size_t i = 0; i < timers.size(); i++) {
+            Timer *timer = timers[i];
+            if (timer->active && timer->due <= now) {
+                if (timer->repeat) {
+                    timer->due = now + (uint64_t) timer->repeat;
+                } else {
+                    timer->stop();
+                }
+                timer->cb(timer);
+            }
+        }
+        sweep();
+    }
+
+    inline void Loop::runChecks() {
+        for (size_t i = 0; i < checks.size(); i++) {
+            if (!checks[i]->closed) {
+                checks[i]->cb(checks[i]);
+            }
+        }
+    }
+
+    inline void Loop::runWakeups() {
+#if !defined(UWS_KQUEUE) && !defined(USE_MTCP)
+        uint64_t count;
+        while (::read(wakeFd, &count, sizeof(count)) == -1 && errno == EINTR);
+#endif
+
+        for (size_t i = 0; i < asyncs.size(); i++) {
+            Async *async = asyncs[i];
+            if (!async->closed && async->pending.exchange(false)) {
+                async->cb(async);
+            }
+        }
+
+        std::vector<uv_work_t *> done;
+        {
+            std::lock_guard<std::mutex> lock(completedMutex);
+            done.swap(completed);
+        }
+        for (uv_work_t *req : done) {
+            pendingWork--;
+            req->after(req, 0);
+        }
+    }
+
+    // errors and hangups report what the Poll waits for, so its read or write sees them, and a socket
+    // error ends it with a negative status like libuv's UV_EBADF
+    inline void Loop::deliver(Poll *poll, int events) {
+        // stopped or closed by a callback earlier in this iteration
+        if (poll->closing || !poll->events) {
+            return;
+        }
+        if (events & ERROR_EVENTS) {
+            poll->stop();
+            poll->cb(poll, -1, 0);
+            return;
+        }
+        if (events & HANGUP_EVENTS) {
+            events |= poll->events;
+        }
+        events &= poll->events;
+        if (events) {
+            poll->cb(poll, 0, events);
+        }
+    }
+
+#ifdef USE_IO_URING
+    inline void Loop::openRing() {
+        io_uring_params params = {};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = RING_ENTRIES * 4;
+        ringFd = (int) syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+        if (ringFd == -1) {
+            throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+        }
+
+        // one mapping for both rings, IORING_FEAT_SINGLE_MMAP is older than what this needs anyway
+        ringLength = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ringMemory = mmap(nullptr, ringLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        sqes = (io_uring_sqe *) mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ringFd, IORING_OFF_SQES);
+        if (ringMemory == MAP_FAILED || sqes == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "io_uring mmap");
+        }
+
+        char *ring = (char *) ringMemory;
+        sqHead = (unsigned *) (ring + params.sq_off.head);
+        sqTailShared = (unsigned *) (ring + params.sq_off.tail);
+        sqArray = (unsigned *) (ring + params.sq_off.array);
+        sqMask = *(unsigned *) (ring + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqTail = *sqTailShared;
+        cqHead = (unsigned *) (ring + params.cq_off.head);
+        cqTail = (unsigned *) (ring + params.cq_off.tail);
+        cqMask = *(unsigned *) (ring + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (ring + params.cq_off.cqes);
+    }
+
+    inline void Loop::closeRing() {
+        munmap(sqes, sqEntries * sizeof(io_uring_sqe));
+        munmap(ringMemory, ringLength);
+        ::close(ringFd);
+        for (Watch *watch : freeWatches) {
+            delete watch;
+        }
+    }
+
+    // entries go to the kernel with the next enter, a full ring is handed over right away
+    inline io_uring_sqe *Loop::getSqe() {
+        if (sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+            __atomic_store_n(sqTailShared, sqTail, __ATOMIC_RELEASE);
+            syscall(__NR_io_uring_enter, ringFd, sqEntries, 0, 0, nullptr, 0);
+        }
+        unsigned index = sqTail++ & sqMask;
+        sqArray[index] = index;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(io_uring_sqe));
+        return sqe;
+    }
+
+    // submits what was queued and waits for minComplete completions up to timeout ms, -1 for no limit. With
+    // IORING_SETUP_COOP_TASKRUN completions are posted only in here, so even a poll without waiting enters
+    inline void Loop::enter(unsigned minComplete, int timeout) {
+        __atomic_store_n(sqTailShared, sqTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        __kernel_timespec ts = {timeout / 1000, (timeout % 1000) * 1000000LL};
+        io_uring_getevents_arg arg = {};
+        if (timeout >= 0) {
+            arg.ts = (uint64_t) &ts;
+        }
+        syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+
+    inline void Loop::armWake() {
+        io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = wakeFd;
+        sqe->poll32_events = EPOLLIN;
+        sqe->user_data = WAKE_TAG;
+    }
+
+    inline void Loop::arm(Poll *poll, int events) {
+        Watch *watch;
+        if (freeWatches.empty()) {
+            watch = new Watch;
+        } else {
+            watch = freeWatches.back();
+            freeWatches.pop_back();
+        }
+        watch->poll = poll;
+        watch->events = events;
+        poll->watch = watch;
+
+        io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = poll->fd;
+        sqe->poll32_events = (uint32_t) events;
+        sqe->user_data = (uint64_t) watch;
+    }
+
+    inline void Loop::cancel(Watch *watch) {
+        watch->poll->watch = nullptr;
+        watch->poll = nullptr;
+        orphans++;
+
+        io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = (uint64_t) watch;
+        sqe->user_data = CANCEL_TAG;
+    }
+
+    // an armed watch that already covers events is left be, what it reports beyond them is filtered out
+    inline void Loop::watch(Poll *poll, int events) {
+        if (poll->watch) {
+            if (!(events & ~poll->watch->events)) {
+                return;
+            }
+            cancel(poll->watch);
+        }
+        arm(poll, events);
+    }
+
+    inline void Loop::unwatch(Poll *poll) {
+        if (poll->watch) {
+            cancel(poll->watch);
+        }
+    }
+
+    inline int Loop::wait(int timeout) {
+        uint64_t blockedAt = timeout ? hrtime() : 0;
+        enter(timeout ? 1 : 0, timeout);
+        countIdle(blockedAt);
+
+        unsigned head = *cqHead, tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        int count = 0;
+        for (; head != tail && count < MAX_READY_EVENTS; head++) {
+            readyCompletions[count++] = cqes[head & cqMask];
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        updateTime();
+
+        for (int i = 0; i < count; i++) {
+            uint64_t userData = readyCompletions[i].user_data;
+            if (userData == WAKE_TAG) {
+                runWakeups();
+                armWake();
+                continue;
+            }
+            if (userData == CANCEL_TAG) {
+                continue;
+            }
+
+            Watch *watch = (Watch *) userData;
+            Poll *poll = watch->poll;
+            freeWatches.push_back(watch);
+            if (!poll) {
+                orphans--;
+                continue;
+            }
+            poll->watch = nullptr;
+            int result = readyCompletions[i].res;
+            deliver(poll, result < 0 ? EPOLLERR : result);
+            if (poll->events && !poll->closing && !poll->watch) {
+                arm(poll, poll->events);
+            }
+        }
+        return count;
+    }
+#elif defined(UWS_KQUEUE)
+    // udata of a change is whether it adds, so that a failed delete, of an fd that was closed first, is told
+    // apart from a failed add, which the Poll hears of as an error
+    inline void Loop::changeFilter(uv_os_sock_t fd, short filter, bool registered, bool wanted, unsigned short flags) {
+        if (registered != wanted) {
+            struct kevent change;
+            EV_SET(&change, fd, filter, wanted ? EV_ADD | flags : EV_DELETE, 0, 0, (void *) (uintptr_t) wanted);
+            changes.push_back(change);
+        }
+    }
+
+    // read and write are filters of their own, only what changes between them is queued
+    inline void Loop::watch(Poll *poll, int events) {
+        if (watchers.size() <= (size_t) poll->fd) {
+            watchers.resize(poll->fd + 1);
+        }
+        watchers[poll->fd] = poll;
+
+        int registered = poll->events;
+        unsigned short flags = 0;
+        if (poll->edgeTriggered) {
+            // EVFILT_WRITE stays from the first start on, whatever it brings that is not wanted deliver drops
+            flags = EV_CLEAR;
+            registered |= registered ? UV_WRITABLE : 0;
+            events |= UV_WRITABLE;
+        }
+        changeFilter(poll->fd, EVFILT_READ, registered & UV_READABLE, events & UV_READABLE, flags);
+        changeFilter(poll->fd, EVFILT_WRITE, registered & UV_WRITABLE, events & UV_WRITABLE, flags);
+    }
+
+    inline void Loop::unwatch(Poll *poll) {
+        int registered = poll->events | (poll->edgeTriggered ? UV_WRITABLE : 0);
+        changeFilter(poll->fd, EVFILT_READ, registered & UV_READABLE, false, 0);
+        changeFilter(poll->fd, EVFILT_WRITE, registered & UV_WRITABLE, false, 0);
+        if (watchers[poll->fd] == poll) {
+            watchers[poll->fd] = nullptr;
+        }
+    }
+
+    inline void Loop::dispatch(const struct kevent &event) {
+        if (event.filter == EVFILT_USER) {
+            runWakeups();
+            return;
+        }
+        Poll *poll = event.ident < watchers.size() ? watchers[event.ident] : nullptr;
+        if (!poll) {
+            return;
+        }
+        if (event.flags & EV_ERROR) {
+            if (event.data && event.udata) {
+                deliver(poll, ERROR_EVENTS);
+            }
+            return;
+        }
+        // a peer that hung up leaves the rest of what it sent to be read, the read or write that follows ends it
+        deliver(poll, event.filter == EVFILT_READ ? UV_READABLE : UV_WRITABLE);
+    }
+
+    inline int Loop::wait(int timeout) {
+        // changes past what the waiting kevent takes go ahead with receipts, which drain no events
+        static const timespec zero = {0, 0};
+        while (changes.size() > (size_t) MAX_CHANGES) {
+            size_t first = changes.size() - MAX_CHANGES;
+            int batch = (int) std::min<size_t>(first, MAX_READY_EVENTS);
+            for (int i = 0; i < batch; i++) {
+                changes[i].flags |= EV_RECEIPT;
+            }
+            int receipts = kevent(kq, changes.data(), batch, readyEvents, batch, &zero);
+            changes.erase(changes.begin(), changes.begin() + batch);
+            for (int i = 0; i < receipts; i++) {
+                dispatch(readyEvents[i]);
+            }
+        }
+
+        timespec ts = {timeout / 1000, (timeout % 1000) * 1000000L};
+        uint64_t blockedAt = timeout ? hrtime() : 0;
+        int count = kevent(kq, changes.data(), (int) changes.size(), readyEvents, MAX_READY_EVENTS, timeout >= 0 ? &ts : nullptr);
+        countIdle(blockedAt);
+        changes.clear();
+        updateTime();
+        for (int i = 0; i < count; i++) {
+            dispatch(readyEvents[i]);
+        }
+        count = std::max(count, 0);
+        if (!rereads.empty()) {
+            std::vector<Poll *> polls;
+            polls.swap(rereads);
+            for (Poll *poll : polls) {
+                poll->reread = false;
+            }
+            for (Poll *poll : polls) {
+                deliver(poll, UV_READABLE);
+                count++;
+            }
+        }
+        return count;
+    }
+#else
+#ifdef USE_MTCP
+    // mTCP's epoll is Linux's behind a context and a prefix
+    typedef mtcp_epoll_event PollEvent;
+    static const uint32_t WATCH_EDGE = MTCP_EPOLLET, WATCH_OUT = MTCP_EPOLLOUT;
+    static const int WATCH_ADD = MTCP_EPOLL_CTL_ADD, WATCH_MOD = MTCP_EPOLL_CTL_MOD, WATCH_DEL = MTCP_EPOLL_CTL_DEL;
+#define UWS_WATCH_CTL(op, fd, event) mtcp_epoll_ctl(mctx, epfd, op, fd, event)
+#else
+    typedef epoll_event PollEvent;
+    static const uint32_t WATCH_EDGE = EPOLLET, WATCH_OUT = EPOLLOUT;
+    static const int WATCH_ADD = EPOLL_CTL_ADD, WATCH_MOD = EPOLL_CTL_MOD, WATCH_DEL = EPOLL_CTL_DEL;
+#define UWS_WATCH_CTL(op, fd, event) epoll_ctl(epfd, op, fd, event)
+#endif
+
+    inline void Loop::watch(Poll *poll, int events) {
+        PollEvent event = {};
+        event.events = (uint32_t) events;
+        event.data.ptr = poll;
+        if (poll->edgeTriggered) {
+            // whatever EPOLLOUT brings that is not wanted deliver drops
+            if (poll->events && !((events ^ poll->events) & ~WATCH_OUT)) {
+                return;
+            }
+            event.events = (uint32_t) events | WATCH_OUT | WATCH_EDGE;
+        }
+        if (!poll->events) {
+            // an fd another (moved from) Poll still had registered is taken over
+            if (UWS_WATCH_CTL(WATCH_ADD, poll->fd, &event) == -1 && errno == EEXIST) {
+                UWS_WATCH_CTL(WATCH_MOD, poll->fd, &event);
+            }
+        } else {
+            UWS_WATCH_CTL(WATCH_MOD, poll->fd, &event);
+        }
+    }
+
+    inline void Loop::unwatch(Poll *poll) {
+        PollEvent event = {};
+        UWS_WATCH_CTL(WATCH_DEL, poll->fd, &event);
+    }
+#undef UWS_WATCH_CTL
+
+    inline int Loop::wait(int timeout) {
+#ifdef USE_MTCP
+        if (timeout < 0 || timeout > WAKE_INTERVAL_MS) {
+            timeout = WAKE_INTERVAL_MS;
+        }
+        uint64_t blockedAt = timeout ? hrtime() : 0;
+        int count = mtcp_epoll_wait(mctx, epfd, readyEvents, MAX_READY_EVENTS, timeout);
+        countIdle(blockedAt);
+        updateTime();
+        if (woken.exchange(false, std::memory_order_acquire)) {
+            runWakeups();
+        }
+#else
+        uint64_t blockedAt = timeout ? hrtime() : 0;
+        int count = epoll_wait(epfd, readyEvents, MAX_READY_EVENTS, timeout);
+        countIdle(blockedAt);
+        updateTime();
+#endif
+        for (int i = 0; i < count; i++) {
+            if (Poll *poll = (Poll *) readyEvents[i].data.ptr) {
+                deliver(poll, (int) readyEvents[i].events);
+            } else {
+                runWakeups();
+            }
+        }
+        count = std::max(count, 0);
+        if (!rereads.empty()) {
+            std::vector<Poll *> polls;
+            polls.swap(rereads);
+            for (Poll *poll : polls) {
+                poll->reread = false;
+            }
+            for (Poll *poll : polls) {
+                deliver(poll, UV_READABLE);
+                count++;
+            }
+        }
+        return count;
+    }
+#endif
+
+    // the spin ends early at the first event, or when a timer comes due
+    inline void Loop::spin(int timeout) {
+        if (busyPollMicros && timeout) {
+            uint64_t start = hrtime(), microsLeft = (uint64_t) busyPollMicros;
+            if (timeout > 0) {
+                microsLeft = std::min<uint64_t>(microsLeft, (uint64_t) timeout * 1000);
+            }
+            while (hrtime() - start < microsLeft * 1000) {
+                if (wait(0)) {
+                    return;
+                }
+            }
+            timeout = nextTimeout();
+        }
+        wait(timeout);
+    }
+
+    inline void Loop::sweep() {
+        timers.erase(std::remove_if(timers.begin(), timers.end(), [](Timer *timer) {
+            if (!timer->active) {
+                timer->listed = false;
+                return true;
+            }
+            return false;
+        }), timers.end());
+        asyncs.erase(std::remove_if(asyncs.begin(), asyncs.end(), [](Async *async) {return async->closed;}), asyncs.end());
+        checks.erase(std::remove_if(checks.begin(), checks.end(), [](Check *check) {return check->closed;}), checks.end());
+    }
+
+    // what is closed while these run waits for the next iteration
+    inline void Loop::runClosing() {
+        sweep();
+        std::vector<std::function<void()>> closed;
+        closed.swap(closing);
+        for (std::function<void()> &cb : closed) {
+            cb();
+        }
+    }
+
+    inline int Loop::run(uv_run_mode mode) {
+#ifdef USE_MTCP
+        mtcpContext() = mctx;
+#endif
+        updateTime();
+        bool alive = isAlive();
+        while (alive) {
+            runTimers();
+            runChecks();
+
+            spin(mode == UV_RUN_NOWAIT ? 0 : nextTimeout());
+
+            runChecks();
+            runClosing();
+            if (mode == UV_RUN_ONCE) {
+                // what came due while blocked, as libuv does
+                runTimers();
+            }
+
+            alive = isAlive();
+            if (mode != UV_RUN_DEFAULT) {
+                break;
+            }
+        }
+        return alive;
+    }
+}
+
+inline uS::Loop *uv_default_loop() {
+    return uS::Loop::createLoop();
+}
+
+inline int uv_run(uS::Loop *loop, uv_run_mode mode) {
+    return loop->run(mode);
+}
+
+inline uint64_t uv_now(uS::Loop *loop) {
+    return loop->now;
+}
+
+inline uint64_t uv_hrtime() {
+    return uS::Loop::hrtime();
+}
+
+inline uint64_t uv_metrics_idle_time(uS::Loop *loop) {
+    return loop->idleNanos;
+}
+
+inline int uv_queue_work(uS::Loop *loop, uv_work_t *req, void (*work)(uv_work_t *), void (*after)(uv_work_t *, int)) {
+    req->loop = loop;
+    req->work = work;
+    req->after = after;
+    loop->pendingWork++;
+    uS::ThreadPool::get()->push(req);
+    return 0;
+}
+
+#endif // EPOLL_H
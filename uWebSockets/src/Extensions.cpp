@@ -1,18 +1,40 @@
 #include "Extensions.h"
+#include <algorithm>
 
 namespace uWS {
 
     enum ExtensionTokens {
-        TOK_PERMESSAGE_DEFLATE = 1838,
-        TOK_SERVER_NO_CONTEXT_TAKEOVER = 2807,
-        TOK_CLIENT_NO_CONTEXT_TAKEOVER = 2783,
-        TOK_SERVER_MAX_WINDOW_BITS = 2372,
-        TOK_CLIENT_MAX_WINDOW_BITS = 2348
+        TOK_NONE,
+        TOK_PERMESSAGE_DEFLATE,
+        TOK_SERVER_NO_CONTEXT_TAKEOVER,
+        TOK_CLIENT_NO_CONTEXT_TAKEOVER,
+        TOK_SERVER_MAX_WINDOW_BITS,
+        TOK_CLIENT_MAX_WINDOW_BITS,
+        TOK_PRESET_DICTIONARY,
+        TOK_INTEGER,
+        TOK_UNKNOWN
     };
 
+    // the header as it is, one pass over it without copies. Tokens are runs of letters, digits, '-' and '_',
+    // anything else separates them, so quoted values read like bare ones
     class ExtensionsParser {
         private:
             int *lastInteger = nullptr;
+            int integer;
+            // the token getToken returned last, for values that are no integer
+            std::string_view text;
+
+            // of getToken: a table of what a token may consist of instead of isalnum, which
+            // depends on the locale. The known tokens differ in ((first ^ length) >> 2) & 7, so
+            // one compare of the slot it hashes to tells any of them from everything else
+            struct Token {
+                std::string_view name;
+                ExtensionTokens token;
+            };
+            static const Token tokens[8];
+            static const bool tokenCharacters[256];
+
+            ExtensionTokens getToken(const char *&in, const char *stop);
 
         public:
             bool perMessageDeflate = false;
@@ -20,35 +42,76 @@ namespace uWS {
             bool clientNoContextTakeover = false;
             int serverMaxWindowBits = 0;
             int clientMaxWindowBits = 0;
+            // the id of x-uws-preset-dictionary, see ExtensionsNegotiator::setDictionary
+            std::string_view presetDictionary;
+
+            ExtensionsParser(std::string_view header);
+    };
 
-            static int getToken(const char *&in, const char *stop);
-            ExtensionsParser(const char *data, size_t length);
+    const ExtensionsParser::Token ExtensionsParser::tokens[8] = {
+        {"permessage-deflate", TOK_PERMESSAGE_DEFLATE},
+        {"server_max_window_bits", TOK_SERVER_MAX_WINDOW_BITS},
+        {"server_no_context_takeover", TOK_SERVER_NO_CONTEXT_TAKEOVER},
+        {"x-uws-preset-dictionary", TOK_PRESET_DICTIONARY},
+        {},
+        {"client_max_window_bits", TOK_CLIENT_MAX_WINDOW_BITS},
+        {"client_no_context_takeover", TOK_CLIENT_NO_CONTEXT_TAKEOVER},
+        {}
     };
 
-    int ExtensionsParser::getToken(const char *&in, const char *stop) {
-        while (!isalnum(*in) && in != stop) {
+    const bool ExtensionsParser::tokenCharacters[256] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        // '-' and 0 to 9
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+        // A to Z and '_'
+        0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+        // a to z
+        0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+    };
+
+    // TOK_NONE at the end, TOK_INTEGER with integer set for a run of digits
+    ExtensionTokens ExtensionsParser::getToken(const char *&in, const char *stop) {
+        while (in != stop && !tokenCharacters[(unsigned char) *in]) {
             in++;
         }
+        if (in == stop) {
+            return TOK_NONE;
+        }
 
-        int hashedToken = 0;
-        while (isalnum(*in) || *in == '-' || *in == '_') {
-            if (isdigit(*in)) {
-                hashedToken = hashedToken * 10 - (*in - '0');
+        const char *begin = in;
+        bool digits = true;
+        integer = 0;
+        for (; in != stop && tokenCharacters[(unsigned char) *in]; in++) {
+            if (*in >= '0' && *in <= '9') {
+                // anything of more than 4 digits is out of range either way
+                integer = std::min(integer * 10 + (*in - '0'), 10000);
             } else {
-                hashedToken += *in;
+                digits = false;
             }
-            in++;
         }
-        return hashedToken;
+        text = std::string_view(begin, in - begin);
+        if (digits) {
+            return TOK_INTEGER;
+        }
+
+        const Token &candidate = tokens[(((unsigned char) text[0] ^ text.length()) >> 2) & 7];
+        return candidate.name == text ? candidate.token : TOK_UNKNOWN;
     }
 
-    ExtensionsParser::ExtensionsParser(const char *data, size_t length) {
-        const char *stop = data + length;
-        int token = 1;
-        for (; token && token != TOK_PERMESSAGE_DEFLATE; token = getToken(data, stop));
+    ExtensionsParser::ExtensionsParser(std::string_view header) {
+        const char *data = header.data(), *stop = data + header.length();
+        ExtensionTokens token;
+        while ((token = getToken(data, stop)) != TOK_NONE && token != TOK_PERMESSAGE_DEFLATE);
 
         perMessageDeflate = (token == TOK_PERMESSAGE_DEFLATE);
-        while ((token = getToken(data, stop))) {
+        bool dictionaryValue = false;
+        while ((token = getToken(data, stop)) != TOK_NONE) {
+            if (dictionaryValue && (token == TOK_INTEGER || token == TOK_UNKNOWN)) {
+                presetDictionary = text;
+                dictionaryValue = false;
+                continue;
+            }
+            dictionaryValue = false;
             switch (token) {
                 case TOK_PERMESSAGE_DEFLATE:
                     return;
@@ -66,58 +129,187 @@ namespace uWS {
                     clientMaxWindowBits = 1;
                     lastInteger = &clientMaxWindowBits;
                     break;
-                default:
-                    if (token < 0 && lastInteger) {
-                        *lastInteger = -token;
+                case TOK_PRESET_DICTIONARY:
+                    dictionaryValue = true;
+                    lastInteger = nullptr;
+                    break;
+                case TOK_INTEGER:
+                    if (lastInteger) {
+                        *lastInteger = integer;
                     }
                     break;
+                default:
+                    break;
             }
         }
     }
 
-    ExtensionsNegotiator::ExtensionsNegotiator(int wantedOptions) {
+    ExtensionsNegotiator::ExtensionsNegotiator(int wantedOptions, int maxWindowBits, int maxInflateWindowBits) {
         options = wantedOptions;
+        if (options & NO_OUTBOUND_COMPRESSION) {
+            options &= ~SLIDING_DEFLATE_WINDOW;
+        }
+        windowBits = (options & SLIDING_DEFLATE_WINDOW) ? maxWindowBits : 15;
+        inflateWindowBits = maxInflateWindowBits;
     }
 
-    std::string ExtensionsNegotiator::generateOffer() const {
-        std::string extensionsOffer;
-        if (options & Options::PERMESSAGE_DEFLATE) {
-            extensionsOffer += "permessage-deflate";
+    // every response there can be, built once: the client's part (none, client_no_context_takeover or
+    // client_max_window_bits 8 to 15) by server_no_context_takeover or not by server_max_window_bits (none or 8 to 15)
+    struct Offers {
+        static const int CLIENT_PARTS = 10, SERVER_WINDOW_BITS = 9;
+        std::string offers[CLIENT_PARTS][2][SERVER_WINDOW_BITS];
 
-            if (options & Options::CLIENT_NO_CONTEXT_TAKEOVER) {
-                extensionsOffer += "; client_no_context_takeover";
-            }
-            // we do not support accepting this yet
-            // todo: if we agree on this, do not allocate a compressor
-            // per socket!
-
-            // It is RECOMMENDED that a server supports the
-            // "server_no_context_takeover" extension parameter in an extension
-            // negotiation offer.
-            if (options & Options::SERVER_NO_CONTEXT_TAKEOVER) {
-                //extensionsOffer += "; server_no_context_takeover";
+        Offers() {
+            for (int client = 0; client < CLIENT_PARTS; client++) {
+                for (int serverNoContextTakeover = 0; serverNoContextTakeover < 2; serverNoContextTakeover++) {
+                    for (int serverWindowBits = 0; serverWindowBits < SERVER_WINDOW_BITS; serverWindowBits++) {
+                        std::string &offer = offers[client][serverNoContextTakeover][serverWindowBits];
+                        offer = "permessage-deflate";
+                        if (client == 1) {
+                            offer += "; client_no_context_takeover";
+                        } else if (client) {
+                            offer += "; client_max_window_bits=" + std::to_string(client + 6);
+                        }
+                        if (serverNoContextTakeover) {
+                            offer += "; server_no_context_takeover";
+                        }
+                        if (serverWindowBits) {
+                            offer += "; server_max_window_bits=" + std::to_string(serverWindowBits + 7);
+                        }
+                    }
+                }
             }
         }
-        return extensionsOffer;
+    };
+
+    std::string_view ExtensionsNegotiator::generateOffer() const {
+        static const Offers offers;
+        if (!(options & Options::PERMESSAGE_DEFLATE)) {
+            return {};
+        }
+
+        // client_max_window_bits is only allowed when the client offered it
+        int client = 0;
+        if (options & Options::CLIENT_NO_CONTEXT_TAKEOVER) {
+            client = 1;
+        } else if (offeredInflateWindowBits && inflateWindowBits >= 8) {
+            client = std::min(inflateWindowBits, 15) - 6;
+        }
+
+        // It is RECOMMENDED that a server supports the
+        // "server_no_context_takeover" extension parameter in an extension
+        // negotiation offer. We agree by using the shared compressor instead
+        // of a sliding window. server_max_window_bits is only allowed in
+        // response to the client asking for it
+        int serverWindowBits = requestedWindowBits ? std::max(8, std::min(windowBits, 15)) - 7 : 0;
+        const std::string &offer = offers.offers[client][bool(options & Options::SERVER_NO_CONTEXT_TAKEOVER)][serverWindowBits];
+        if (!dictionaryAgreed) {
+            return offer;
+        }
+        dictionaryResponse = offer + "; x-uws-preset-dictionary=" + std::string(dictionaryId);
+        return dictionaryResponse;
     }
 
-    void ExtensionsNegotiator::readOffer(std::string offer) {
-        ExtensionsParser extensionsParser(offer.data(), offer.length());
+    void ExtensionsNegotiator::readOffer(std::string_view offer) {
+        ExtensionsParser extensionsParser(offer);
         if ((options & PERMESSAGE_DEFLATE) && extensionsParser.perMessageDeflate) {
             if (extensionsParser.clientNoContextTakeover || (options & CLIENT_NO_CONTEXT_TAKEOVER)) {
                 options |= CLIENT_NO_CONTEXT_TAKEOVER;
             }
-            if (extensionsParser.serverNoContextTakeover) {
+
+            // a client keeping its context needs an inflate window of its own. Without client_max_window_bits
+            // it may use all 15 bits, so a smaller limit leaves it resetting per message like everyone else.
+            // So does a window of 8, which zlib based clients silently turn into 9
+            offeredInflateWindowBits = extensionsParser.clientMaxWindowBits;
+            if (inflateWindowBits && !extensionsParser.clientNoContextTakeover) {
+                if (offeredInflateWindowBits > 1) {
+                    inflateWindowBits = std::min(inflateWindowBits, offeredInflateWindowBits);
+                }
+                if ((offeredInflateWindowBits || inflateWindowBits == 15) && inflateWindowBits >= 9) {
+                    options &= ~CLIENT_NO_CONTEXT_TAKEOVER;
+                }
+            }
+            // a server that never compresses keeps no context either way, which it may always say
+            if (extensionsParser.serverNoContextTakeover || (options & NO_OUTBOUND_COMPRESSION)) {
                 options |= SERVER_NO_CONTEXT_TAKEOVER;
+                options &= ~SLIDING_DEFLATE_WINDOW;
+                windowBits = 15;
             } else {
                 options &= ~SERVER_NO_CONTEXT_TAKEOVER;
             }
+
+            // the shared compressor is fixed at 15 bits and zlib cannot do a raw window of 8,
+            // so a smaller limit we cannot keep declines compression
+            if (extensionsParser.serverMaxWindowBits) {
+                requestedWindowBits = extensionsParser.serverMaxWindowBits;
+                if (requestedWindowBits < 8 || requestedWindowBits > 15) {
+                    options &= ~PERMESSAGE_DEFLATE;
+                } else if (options & NO_OUTBOUND_COMPRESSION) {
+                    windowBits = requestedWindowBits;
+                } else if (requestedWindowBits < windowBits) {
+                    if (!(options & SLIDING_DEFLATE_WINDOW) || requestedWindowBits < 9) {
+                        options &= ~PERMESSAGE_DEFLATE;
+                    }
+                    windowBits = requestedWindowBits;
+                }
+            }
+
+            // every message starts over from the dictionary, so neither side may keep its context
+            dictionaryAgreed = dictionaryId.length() && extensionsParser.presetDictionary == dictionaryId && (options & PERMESSAGE_DEFLATE) &&
+                               (options & SERVER_NO_CONTEXT_TAKEOVER) && (options & CLIENT_NO_CONTEXT_TAKEOVER);
         } else {
             options &= ~PERMESSAGE_DEFLATE;
         }
     }
 
+    void ExtensionsNegotiator::readResponse(std::string_view response) {
+        ExtensionsParser extensionsParser(response);
+        if (!(options & PERMESSAGE_DEFLATE) || !extensionsParser.perMessageDeflate) {
+            options &= ~PERMESSAGE_DEFLATE;
+            return;
+        }
+
+        // the server resets its inflater per message, so our compressor has to as well
+        if (extensionsParser.clientNoContextTakeover) {
+            options &= ~SLIDING_DEFLATE_WINDOW;
+            windowBits = 15;
+        }
+
+        // the server may lower our window only if we offered client_max_window_bits, which we
+        // do for a sliding window alone. Anything we did not offer or cannot keep leaves compression off
+        if (extensionsParser.clientMaxWindowBits) {
+            if (!(options & SLIDING_DEFLATE_WINDOW) || extensionsParser.clientMaxWindowBits < 9 || extensionsParser.clientMaxWindowBits > 15) {
+                options &= ~PERMESSAGE_DEFLATE;
+                return;
+            }
+            windowBits = std::min(windowBits, extensionsParser.clientMaxWindowBits);
+        }
+
+        // offered along with both no_context_takeover, which the server cannot take back
+        dictionaryAgreed = dictionaryId.length() && extensionsParser.presetDictionary == dictionaryId;
+        if (dictionaryAgreed) {
+            options &= ~SLIDING_DEFLATE_WINDOW;
+            windowBits = 15;
+        }
+    }
+
+    void ExtensionsNegotiator::setDictionary(std::string_view id) {
+        dictionaryId = id;
+    }
+
+    bool ExtensionsNegotiator::getNegotiatedDictionary() const {
+        return dictionaryAgreed && (options & PERMESSAGE_DEFLATE);
+    }
+
     int ExtensionsNegotiator::getNegotiatedOptions() const {
         return options;
     }
+
+    int ExtensionsNegotiator::getNegotiatedWindowBits() const {
+        return (options & SLIDING_DEFLATE_WINDOW) ? windowBits : 0;
+    }
+
+    int ExtensionsNegotiator::getNegotiatedInflateWindowBits() const {
+        return ((options & PERMESSAGE_DEFLATE) && !(options & CLIENT_NO_CONTEXT_TAKEOVER)) ? inflateWindowBits : 0;
+    }
 }
@@ -2,6 +2,7 @@
 #define EXTENSIONS_UWS_H
 
 #include <string>
+#include <string_view>
 
 namespace uWS {
     enum Options : unsigned int {
@@ -10,17 +11,49 @@ namespace uWS {
         SERVER_NO_CONTEXT_TAKEOVER = 2, // remove this
         CLIENT_NO_CONTEXT_TAKEOVER = 4, // remove this
         NO_DELAY = 8,
-        SLIDING_DEFLATE_WINDOW = 16
+        SLIDING_DEFLATE_WINDOW = 16,
+        // with PERMESSAGE_DEFLATE, compressed messages are accepted and inflated but nothing is ever sent
+        // compressed, whatever a send asks for. Any server_max_window_bits is agreed to and no deflate window
+        // is kept. The other way round cannot be negotiated: once the extension is agreed RFC 7692 lets either
+        // side compress, so a group deflating what it sends inflates what its clients compress
+        NO_OUTBOUND_COMPRESSION = 32,
+        // not an extension: the group's clients are backends of our own, whose text is taken as valid UTF-8
+        // and whose frames are not held against maxPayload, see TrustedWebSocket
+        TRUSTED_PEERS = 64
     };
 
     class ExtensionsNegotiator {
         protected:
             int options;
+            // of our own compressor, requested is what server_max_window_bits asked us for
+            int windowBits;
+            int requestedWindowBits = 0;
+            // of the client's compressor when it keeps its context, offered is its client_max_window_bits
+            int inflateWindowBits;
+            int offeredInflateWindowBits = 0;
+            // of setDictionary, and the response naming it once agreed
+            std::string_view dictionaryId;
+            bool dictionaryAgreed = false;
+            mutable std::string dictionaryResponse;
         public:
-            ExtensionsNegotiator(int wantedOptions);
-            std::string generateOffer() const;
-            void readOffer(std::string offer);
+            // maxWindowBits caps the window of a sliding deflate window, 9 to 15. A nonzero
+            // maxInflateWindowBits lets the client keep its context with at most that window, 8 to 15
+            ExtensionsNegotiator(int wantedOptions, int maxWindowBits = 15, int maxInflateWindowBits = 0);
+            // the response to the offer read, one of a table built once. Empty when declined
+            std::string_view generateOffer() const;
+            void readOffer(std::string_view offer);
+            // client side, with the response to an offer made with the same options
+            void readResponse(std::string_view response);
+            // before readOffer or readResponse, the id of the preset dictionary of the group. It is agreed by a
+            // permessage-deflate offer carrying x-uws-preset-dictionary with the same id and both
+            // no_context_takeover, which only native uWS peers make, see Group::setDeflateDictionary
+            void setDictionary(std::string_view id);
+            bool getNegotiatedDictionary() const;
             int getNegotiatedOptions() const;
+            // of the sliding deflate window, 0 if the socket gets none
+            int getNegotiatedWindowBits() const;
+            // of the socket's own inflate window, 0 if the client resets its context per message
+            int getNegotiatedInflateWindowBits() const;
     };
 }
 
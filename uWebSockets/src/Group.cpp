@@ -1,7 +1,50 @@
 #include "Group.h"
 #include "Hub.h"
+#include <openssl/rand.h>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 
 namespace uWS {
+    struct Group::Sessions {
+        struct Session {
+            WebSocket *webSocket = nullptr;
+            // of the last message kept, the ring holds the ones up to it
+            uint64_t sequence = 0;
+            std::deque<WebSocket::PreparedMessage *> ring;
+            // the tick it expires at once detached
+            uint32_t expiresAt = 0;
+        };
+
+        size_t ringSize;
+        unsigned int expirySeconds;
+        std::unordered_map<uint64_t, Session> byId;
+        std::unordered_map<WebSocket *, uint64_t> bySocket;
+        std::unordered_set<uint64_t> detached;
+        // ids of detached sessions by the tick they expire at. One slot more than the expiry, so a slot
+        // is only ever looked at on that tick, and sessions resumed in between are skipped there
+        std::vector<std::vector<uint64_t>> wheel;
+        uint32_t tick = 0;
+        uS::Timer *timer;
+
+        void push(Session &session, WebSocket::PreparedMessage *preparedMessage) {
+            session.sequence++;
+            session.ring.push_back(preparedMessage);
+            if (session.ring.size() > ringSize) {
+                WebSocket::finalizeMessage(session.ring.front());
+                session.ring.pop_front();
+            }
+        }
+
+        void drop(Session &session) {
+            for (WebSocket::PreparedMessage *preparedMessage : session.ring) {
+                WebSocket::finalizeMessage(preparedMessage);
+            }
+        }
+    };
+
     void Group::setUserData(void *user) {
         this->userData = user;
     }
@@ -11,46 +54,262 @@ namespace uWS {
     }
 
     void Group::addWebSocket(WebSocket *webSocket) {
-        if (webSocketHead) {
-            webSocketHead->prev = webSocket;
-            webSocket->next = webSocketHead;
+        webSocket->tableIndex = (uint32_t) table.size();
+        table.push_back(webSocket);
+        if (freeHandles.empty()) {
+            webSocket->handle = (uint32_t) handles.size();
+            handles.push_back({webSocket, 0});
         } else {
-            webSocket->next = nullptr;
+            webSocket->handle = freeHandles.back();
+            freeHandles.pop_back();
+            handles[webSocket->handle].webSocket = webSocket;
+        }
+        hub->load++;
+        connections++;
+        if (maxPerAddress) {
+            countAddress(webSocket, 1);
+        }
+        if (draining) {
+            drainRemaining++;
+        }
+        if (heartbeatTimer) {
+            webSocket->heartbeatPinged = false;
+            scheduleHeartbeat(webSocket, heartbeatIntervalTicks);
+        }
+        if (webSocket->idleTimeout) {
+            webSocket->lastActivity = idleClock;
+            scheduleIdle(webSocket, webSocket->idleTimeout + 1);
+        }
+        if (recording) {
+            sampleRecording(webSocket);
+            if (webSocket->recordId == WebSocket::RECORD_PENDING) {
+                webSocket->recordId = ++recordIds;
+                writeRecord(webSocket->recordId, RECORD_OPEN, nullptr, 0);
+            }
         }
-        webSocketHead = webSocket;
-        webSocket->prev = nullptr;
     }
 
-    void Group::removeWebSocket(WebSocket *webSocket) {
-        if (iterators.size()) {
-            iterators.top() = webSocket->next;
+    void Group::removeWebSocket(WebSocket *webSocket, bool closing) {
+        hub->load--;
+        connections--;
+        if (maxPerAddress) {
+            countAddress(webSocket, -1);
+        }
+        unscheduleHeartbeat(webSocket);
+        unscheduleIdle(webSocket);
+        clearSlowConsumer(webSocket);
+        if (sessions) {
+            detachSession(webSocket);
+        }
+        if (rateLimit) {
+            rateLimit->buckets.erase(webSocket);
         }
-        if (webSocket->prev == webSocket->next) {
-            webSocketHead = nullptr;
+        for (size_t i = 0; i < topSockets.size(); i++) {
+            if (topSockets[i].webSocket == webSocket) {
+                topSockets.erase(topSockets.begin() + i);
+                break;
+            }
+        }
+        if (recording && webSocket->recordId && webSocket->recordId != WebSocket::RECORD_PENDING) {
+            writeRecord(webSocket->recordId, RECORD_CLOSE, nullptr, 0);
+        }
+        if (draining) {
+            drainRemaining--;
+        }
+        if (webSocket->topics) {
+            unsubscribeAll(webSocket, closing);
+        }
+
+        Handle &handle = handles[webSocket->handle];
+        handle.webSocket = nullptr;
+        handle.generation++;
+        freeHandles.push_back(webSocket->handle);
+        if (iterating || drainTimer) {
+            table[webSocket->tableIndex] = nullptr;
+            tableHoles++;
         } else {
-            if (webSocket->prev) {
-                (static_cast<WebSocket *>(webSocket->prev))->next = webSocket->next;
-            } else {
-                webSocketHead = static_cast<WebSocket *>(webSocket->next);
+            WebSocket *last = table.back();
+            table[webSocket->tableIndex] = last;
+            last->tableIndex = webSocket->tableIndex;
+            table.pop_back();
+        }
+    }
+
+    void Group::countHeld(WebSocket *webSocket, const MemoryStats &memory, int sign) {
+        messageMemory += sign * (ptrdiff_t) memory.queuedMessages;
+        counters[uS::NodeData::QUEUEING_SOCKETS] += sign * (int) (memory.queuedMessages != 0);
+        fragmentMemory += sign * (ptrdiff_t) memory.fragmentBuffers;
+        compressionMemory += sign * (ptrdiff_t) memory.deflateWindows;
+        if (webSocket->inflateWindowBits) {
+            inflateMemoryUsed += sign * (ptrdiff_t) inflateWindowMemory(webSocket->inflateWindowBits);
+        }
+        if (webSocket->slidingWindowBits) {
+            deflateWindowSockets += sign;
+        }
+    }
+
+    bool Group::adopt(WebSocket *webSocket) {
+        Group *group = Group::from(webSocket);
+        if (group == this) {
+            return true;
+        }
+        if (group->hub != hub || webSocket->isShuttingDown() || webSocket->isClosed()) {
+            return false;
+        }
+
+        std::vector<std::string> topicNames;
+        if (webSocket->topics) {
+            for (Topic *topic : *webSocket->topics) {
+                topicNames.push_back(topic->name);
+            }
+        }
+        group->removeWebSocket(webSocket, false);
+        MemoryStats memory = webSocket->getMemoryUsage();
+        group->countHeld(webSocket, memory, -1);
+
+        // everything the loop shares, like the cork buffer and the slot pool, is the same for both groups
+        webSocket->nodeData = this;
+        countHeld(webSocket, memory, 1);
+        addWebSocket(webSocket);
+        for (const std::string &topicName : topicNames) {
+            subscribe(webSocket, topicName.data(), topicName.length());
+        }
+        return true;
+    }
+
+    void Group::compactTable() {
+        size_t size = 0;
+        for (WebSocket *webSocket : table) {
+            if (webSocket) {
+                webSocket->tableIndex = (uint32_t) size;
+                table[size++] = webSocket;
+            }
+        }
+        table.resize(size);
+        tableHoles = 0;
+    }
+
+    void Group::ParallelBatch::send(WebSocket *webSocket, const char *message, size_t length, OpCode opCode) {
+        sends.push_back({webSocket->tableIndex, opCode, data.length(), length});
+        data.append(message, length);
+    }
+
+    void Group::parallelForEach(const std::function<void(WebSocket *, ParallelBatch &)> &work, unsigned int threads) {
+        // runs short enough that a thread stuck with slow sockets leaves the rest to the others
+        const size_t RUN = 64;
+        iterating++;
+        size_t size = table.size();
+        threads = std::max<unsigned int>(1, std::min<unsigned int>(threads, (unsigned int) ((size + RUN - 1) / RUN)));
+        std::vector<ParallelBatch> batches(threads);
+        std::atomic<size_t> next(0);
+
+        auto run = [this, &work, &next, size](ParallelBatch &batch) {
+            for (size_t begin; (begin = next.fetch_add(RUN, std::memory_order_relaxed)) < size; ) {
+                for (size_t i = begin, end = std::min(begin + RUN, size); i < end; i++) {
+                    if (WebSocket *webSocket = table[i]) {
+                        work(webSocket, batch);
+                    }
+                }
+            }
+        };
+
+        std::vector<std::thread> helpers;
+        for (unsigned int i = 1; i < threads; i++) {
+            helpers.emplace_back(run, std::ref(batches[i]));
+        }
+        run(batches[0]);
+        for (std::thread &helper : helpers) {
+            helper.join();
+        }
+
+        // a send may close its socket or one sent to before, which then leaves a hole instead of moving others
+        for (ParallelBatch &batch : batches) {
+            for (ParallelBatch::Send &send : batch.sends) {
+                if (WebSocket *webSocket = table[send.tableIndex]) {
+                    webSocket->send(batch.data.data() + send.offset, send.length, send.opCode);
+                }
             }
-            if (webSocket->next) {
-                (static_cast<WebSocket *>(webSocket->next))->prev = webSocket->prev;
+        }
+
+        if (!--iterating && tableHoles && !drainTimer) {
+            compactTable();
+        }
+    }
+
+    const std::string &Group::getUpgradeResponse(std::string_view extensions, std::string_view subprotocol) {
+        for (UpgradeResponse &upgradeResponse : upgradeResponses) {
+            if (upgradeResponse.extensions == extensions && upgradeResponse.subprotocol == subprotocol) {
+                return upgradeResponse.response;
             }
         }
+
+        if (upgradeResponses.size() == MAX_UPGRADE_RESPONSES) {
+            upgradeResponses.erase(upgradeResponses.begin());
+        }
+        upgradeResponses.push_back({std::string(extensions), std::string(subprotocol), std::string()});
+        std::string &response = upgradeResponses.back().response;
+        response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+        response.append(28, 'X');
+        response += "\r\n";
+        if (extensions.length() && extensions.length() < 200) {
+            response += "Sec-WebSocket-Extensions: ";
+            response += extensions;
+            response += "\r\n";
+        }
+        if (subprotocol.length() && subprotocol.length() < 200) {
+            response += "Sec-WebSocket-Protocol: ";
+            response += subprotocol;
+            response += "\r\n";
+        }
+        response += "Sec-WebSocket-Version: 13\r\nWebSocket-Server: uWebSockets\r\n\r\n";
+        return response;
+    }
+
+    uint64_t Group::getId(WebSocket *webSocket) const {
+        return ((uint64_t) handles[webSocket->handle].generation << 32) | webSocket->handle;
+    }
+
+    WebSocket *Group::getWebSocket(uint64_t id) const {
+        uint32_t index = (uint32_t) id;
+        if (index >= handles.size() || handles[index].generation != (uint32_t) (id >> 32)) {
+            return nullptr;
+        }
+        return handles[index].webSocket;
     }
 
-    Group::Group(int extensionOptions, unsigned int maxPayload, Hub *hub, uS::NodeData *nodeData) :
+    Group::Group(int extensionOptions, unsigned int maxPayload, Hub *hub, uS::NodeData *nodeData, const CompressionSettings &compressionSettings) :
         uS::NodeData(*nodeData),
         maxPayload(maxPayload),
         hub(hub),
         extensionOptions(extensionOptions) {
+#ifdef UWS_NO_COMPRESSION
+            this->extensionOptions &= ~PERMESSAGE_DEFLATE;
+#endif
             this->extensionOptions |= CLIENT_NO_CONTEXT_TAKEOVER | SERVER_NO_CONTEXT_TAKEOVER;
+            if (this->extensionOptions & NO_OUTBOUND_COMPRESSION) {
+                this->extensionOptions &= ~SLIDING_DEFLATE_WINDOW;
+            }
+            messageMemory = 0;
+            std::fill_n(counters, (int) COUNTERS, 0);
+            queueLatency = nullptr;
+            rateLimit = nullptr;
+            stampMessages = false;
+
+            this->compressionSettings.level = std::max(1, std::min(compressionSettings.level, 9));
+            this->compressionSettings.memLevel = std::max(1, std::min(compressionSettings.memLevel, 9));
+            if (compressionSettings.strategy >= Z_DEFAULT_STRATEGY && compressionSettings.strategy <= Z_FIXED) {
+                this->compressionSettings.strategy = compressionSettings.strategy;
+            }
         }
 
     void Group::onConnection(const std::function<void (WebSocket *)> &handler) {
         connectionHandler = handler;
     }
 
+    void Group::onUpgradeRequest(const std::function<int(HttpRequest &)> &handler) {
+        upgradeRequestHandler = handler;
+    }
+
     void Group::onMessage(const std::function<void (WebSocket *, char *, size_t, OpCode)> &handler) {
         messageHandler = handler;
     }
@@ -59,9 +318,1512 @@ namespace uWS {
         disconnectionHandler = handler;
     }
 
-    void Group::close(int code, char *message, size_t length) {
-        forEach([code, message, length](uWS::WebSocket *ws) {
-            ws->close(code, message, length);
+    void Group::onDrain(const std::function<void (WebSocket *)> &handler) {
+        drainHandler = handler;
+    }
+
+    void Group::onError(const std::function<void (void *)> &handler) {
+        errorHandler = handler;
+    }
+
+    void Group::onSlowConsumer(const std::function<void (WebSocket *, size_t, unsigned int)> &handler) {
+        slowConsumerHandler = handler;
+    }
+
+    void Group::onMessageChunk(const std::function<void (WebSocket *, char *, size_t, size_t, bool, OpCode)> &handler) {
+        messageChunkHandler = handler;
+    }
+
+    void Group::onMessageBatch(const std::function<void (WebSocket *, char *, BatchedMessage *, size_t)> &handler) {
+        messageBatchHandler = handler;
+    }
+
+    void Group::setMaxBackpressure(size_t maxBackpressure, BackpressurePolicy policy) {
+        this->maxBackpressure = maxBackpressure;
+        backpressurePolicy = policy;
+    }
+
+    void Group::setInboundLimit(unsigned int maxMessages, size_t maxBytes, int windowMs, BackpressurePolicy policy) {
+        inboundMaxMessages = maxMessages;
+        inboundMaxBytes = maxBytes;
+        inboundWindowMs = std::max(windowMs, 0);
+        inboundPolicy = policy;
+    }
+
+    MemoryStats Group::getMemoryStats() const {
+        return {messageMemory, fragmentMemory, compressionMemory, blockAllocator->getStats().cachedBytes};
+    }
+
+    void Group::setDeflateWindow(int windowBits, int memLevel) {
+        deflateWindowBits = std::max(9, std::min(windowBits, 15));
+        compressionSettings.memLevel = std::max(1, std::min(memLevel, 9));
+    }
+
+    void Group::setMaxDeflateWindows(unsigned int maxWindows) {
+        maxDeflateWindows = maxWindows;
+    }
+
+    void Group::setInflateWindow(int windowBits, size_t memoryBudget) {
+        inflateWindowBits = windowBits ? std::max(9, std::min(windowBits, 15)) : 0;
+        inflateMemoryBudget = memoryBudget;
+    }
+
+    void Group::setFragmentSize(size_t bytes) {
+        fragmentSize = bytes;
+    }
+
+    void Group::setReassemblyBudget(size_t bytes) {
+        reassemblyBudget = bytes;
+    }
+
+    void Group::setReadBackpressure(size_t bytes) {
+        readBackpressure = bytes;
+    }
+
+    void Group::setZeroCopyReceive(size_t bytes) {
+        zeroCopyReceive = bytes;
+    }
+
+    void Group::setSendChunkSize(size_t bytes) {
+        sendChunkSize = bytes ? std::max<size_t>(1024, std::min<size_t>(bytes, uS::NodeData::preAllocMaxSize)) : 0;
+    }
+
+    void Group::setNotSentLowat(unsigned int bytes) {
+        notSentLowat = bytes;
+    }
+
+    void Group::setQos(uS::NodeData::Qos qos) {
+        this->qos = qos;
+        if (qos != QOS_INTERACTIVE) {
+            loopOptions->qosClasses = true;
+        }
+    }
+
+    void Group::setRateLimit(size_t bytesPerSecond, size_t burst) {
+        if (rateLimit) {
+            rateLimitTimer->stop();
+            rateLimitTimer->close();
+            rateLimitTimer = nullptr;
+            // what starved goes out unlimited at the end of the iteration
+            rateLimit->refill(rateLimit->burst);
+            delete rateLimit;
+            rateLimit = nullptr;
+        }
+
+        if (bytesPerSecond) {
+            rateLimit = new RateLimit;
+            rateLimit->bytesPerSecond = std::max<size_t>(bytesPerSecond, 1000 / RATE_LIMIT_TICK_MS);
+            rateLimit->burst = std::max(burst ? burst : rateLimit->bytesPerSecond / 10, rateLimit->bytesPerSecond * RATE_LIMIT_TICK_MS / 1000);
+            rateLimitTimer = new uS::Timer(hub->getLoop());
+            rateLimitTimer->setData(this);
+            rateLimitTimer->start(refillRateLimit, RATE_LIMIT_TICK_MS, RATE_LIMIT_TICK_MS);
+            rateLimitTimer->unref();
+        }
+    }
+
+    void Group::refillRateLimit(uS::Timer *timer) {
+        RateLimit *rateLimit = static_cast<Group *>(timer->getData())->rateLimit;
+        rateLimit->refill(rateLimit->bytesPerSecond * RATE_LIMIT_TICK_MS / 1000);
+    }
+
+    void Group::setCompressionThreshold(size_t threshold, bool adaptive) {
+        compressionThreshold = threshold;
+        adaptiveCompression = adaptive;
+        compressionStats[0] = compressionStats[1] = CompressionStats();
+    }
+
+    void Group::setAutoReply(const char *message, size_t length, const char *reply, size_t replyLength) {
+        for (AutoReply &autoReply : autoReplies) {
+            if (autoReply.message.length() == length && !memcmp(autoReply.message.data(), message, length)) {
+                autoReply.reply.assign(reply, replyLength);
+                return;
+            }
+        }
+        autoReplies.push_back({std::string(message, length), std::string(reply, replyLength)});
+        autoReplyMaxLength = std::max(autoReplyMaxLength, length);
+    }
+
+    void Group::clearAutoReplies() {
+        autoReplies.clear();
+        autoReplyMaxLength = 0;
+    }
+
+    // true if the message was answered, longer ones than any rule are let through after one compare
+    bool Group::autoReply(WebSocket *webSocket, const char *message, size_t length, OpCode opCode) {
+        if (length > autoReplyMaxLength) {
+            return false;
+        }
+        for (AutoReply &autoReply : autoReplies) {
+            if (autoReply.message.length() == length && !memcmp(autoReply.message.data(), message, length)) {
+                if (autoReply.reply.length()) {
+                    webSocket->send(autoReply.reply.data(), autoReply.reply.length(), opCode);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool Group::shouldCompress(OpCode opCode, size_t length) {
+        // worse than this is not worth the deflate, and while it is so every 32nd message is still tried
+        const unsigned int SKIP_RATIO = 973, PROBE_INTERVAL = 32;
+        if (length < compressionThreshold) {
+            return false;
+        }
+
+        CompressionStats &stats = compressionStats[opCode == BINARY];
+        return !adaptiveCompression || stats.ratio < SKIP_RATIO || !(++stats.skipped % PROBE_INTERVAL);
+    }
+
+    // a moving average over roughly the last 8 messages
+    void Group::recordCompression(OpCode opCode, size_t length, size_t compressedLength) {
+        // the stats are the loop thread's, deflates of other threads leave them alone
+        if (tid != pthread_self()) {
+            return;
+        }
+        metrics[BYTES_BEFORE_COMPRESSION] += length;
+        metrics[BYTES_AFTER_COMPRESSION] += compressedLength;
+        if (adaptiveCompression && length) {
+            CompressionStats &stats = compressionStats[opCode == BINARY];
+            unsigned int ratio = (unsigned int) std::min<size_t>(compressedLength * 1024 / length, 2048);
+            stats.ratio = (stats.ratio * 7 + ratio) / 8;
+        }
+    }
+
+    void Group::getMetrics(uint64_t *metrics) const {
+        static_assert((int) uS::NodeData::COUNTERS == (int) MESSAGES_IN, "the counters of uS come first");
+        std::copy(counters, counters + COUNTERS, metrics);
+        std::copy(this->metrics + COUNTERS, this->metrics + METRICS, metrics + COUNTERS);
+    }
+
+    void Group::setCpuAccounting(bool enabled, unsigned int topSockets, unsigned int sampling) {
+        accountingCpu = enabled;
+        flushNanos = enabled ? &metrics[CPU_FLUSH] : nullptr;
+        topSocketsCapacity = enabled ? topSockets : 0;
+        cpuSampling = std::max(sampling, 1u);
+        this->topSockets.clear();
+        this->topSockets.shrink_to_fit();
+        this->topSockets.reserve(topSocketsCapacity);
+    }
+
+    // space-saving: a socket not in the sketch takes the place of the cheapest one once it is full, starting from
+    // that one's cost, which then is its error
+    void Group::sampleSocketCost(WebSocket *webSocket, uint64_t nanoseconds) {
+        if (++cpuSamples % cpuSampling) {
+            return;
+        }
+        nanoseconds *= cpuSampling;
+
+        SocketCost *cheapest = nullptr;
+        for (SocketCost &socketCost : topSockets) {
+            if (socketCost.webSocket == webSocket) {
+                socketCost.nanoseconds += nanoseconds;
+                return;
+            }
+            if (!cheapest || socketCost.nanoseconds < cheapest->nanoseconds) {
+                cheapest = &socketCost;
+            }
+        }
+        if (topSockets.size() < topSocketsCapacity) {
+            topSockets.push_back({webSocket, nanoseconds, 0});
+        } else {
+            *cheapest = {webSocket, cheapest->nanoseconds + nanoseconds, cheapest->nanoseconds};
+        }
+    }
+
+    std::vector<Group::SocketCost> Group::getTopSockets() const {
+        std::vector<SocketCost> sorted = topSockets;
+        std::sort(sorted.begin(), sorted.end(), [](const SocketCost &a, const SocketCost &b) {
+            return a.nanoseconds > b.nanoseconds;
+        });
+        return sorted;
+    }
+
+    void Group::setLatencyHistograms(bool enabled) {
+        timingLatencies = enabled;
+        queueLatency = enabled ? &metrics[LATENCY_HISTOGRAMS + QUEUE_LATENCY * LATENCY_BUCKETS] : nullptr;
+        stampMessages = queueLatency || slowConsumerAgeMs;
+    }
+
+    bool Group::startRecording(const char *path, unsigned int sampling) {
+        stopRecording();
+        recording = fopen(path, "wb");
+        if (!recording) {
+            return false;
+        }
+        setvbuf(recording, nullptr, _IOFBF, 1024 * 1024);
+        fwrite(RECORD_MAGIC, 1, 8, recording);
+        recordSampling = std::max(sampling, 1u);
+        recordSeen = recordIds = 0;
+        recordLastAt = uv_hrtime() / 1000;
+        forEach([this](WebSocket *webSocket) {
+            sampleRecording(webSocket);
+        });
+        return true;
+    }
+
+    void Group::stopRecording() {
+        if (recording) {
+            fclose(recording);
+            recording = nullptr;
+            forEach([](WebSocket *webSocket) {
+                webSocket->recordId = 0;
+            });
+        }
+    }
+
+    void Group::sampleRecording(WebSocket *webSocket) {
+        webSocket->recordId = recordSeen++ % recordSampling ? 0 : WebSocket::RECORD_PENDING;
+    }
+
+    // a record is the microseconds since the one before, the socket id and the length of data as LEB128 varints
+    // around the flags, then data. Opens and closes have no length
+    void Group::writeRecord(uint32_t id, unsigned char flags, const char *data, size_t length) {
+        uint64_t now = uv_hrtime() / 1000;
+        unsigned char header[32];
+        size_t headerLength = 0;
+        auto varint = [&header, &headerLength](uint64_t value) {
+            for (; value >= 128; value >>= 7) {
+                header[headerLength++] = (unsigned char) (value | 128);
+            }
+            header[headerLength++] = (unsigned char) value;
+        };
+        varint(now - recordLastAt);
+        varint(id);
+        header[headerLength++] = flags;
+        if (!(flags & RECORD_EVENT)) {
+            varint(length);
+        }
+        recordLastAt = now;
+        fwrite(header, 1, headerLength, recording);
+        if (length) {
+            fwrite(data, 1, length, recording);
+        }
+    }
+
+    // a socket that was connected when recording started comes in at a message boundary, so that the replay
+    // only ever sees whole messages. What it sends before is lost, rather than guessed at
+    void Group::record(WebSocket *webSocket, const char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin) {
+        if (!webSocket->recordId) {
+            return;
+        }
+        if (webSocket->recordId == WebSocket::RECORD_PENDING) {
+            if (!remainingBytes && fin && opCode < 3) {
+                webSocket->recordId = ++recordIds;
+                writeRecord(webSocket->recordId, RECORD_OPEN, nullptr, 0);
+            }
+            return;
+        }
+
+        unsigned char flags = opCode | (fin ? RECORD_FIN : 0) | (remainingBytes ? 0 : RECORD_FRAME_END);
+        if (webSocket->compressionStatus == WebSocket::CompressionStatus::COMPRESSED_FRAME) {
+            flags |= RECORD_COMPRESSED;
+        }
+        writeRecord(webSocket->recordId, flags, data, length);
+    }
+
+    void Group::recordRtt(uint32_t microseconds) {
+        int bucket = 0;
+        while (microseconds >>= 1) {
+            bucket++;
+        }
+        rttHistogram[std::min(bucket, RTT_BUCKETS - 1)]++;
+    }
+
+    void Group::setDeflateWindowIdleTimeout(int seconds) {
+        if (deflateWindowTimer) {
+            deflateWindowTimer->stop();
+            deflateWindowTimer->close();
+            deflateWindowTimer = nullptr;
+        }
+
+        if (seconds > 0) {
+            deflateWindowTimer = new uS::Timer(hub->getLoop());
+            deflateWindowTimer->setData(this);
+            deflateWindowTimer->start(releaseIdleDeflateWindows, seconds * 1000, seconds * 1000);
+            deflateWindowTimer->unref();
+        }
+    }
+
+    void Group::setDeflateDictionary(const char *dictionary, size_t length) {
+        deflateDictionary.assign(dictionary, length);
+        deflateDictionaryId.clear();
+        if (length) {
+            char id[9];
+            snprintf(id, sizeof(id), "%08lx", (unsigned long) adler32(adler32(0, nullptr, 0), (const Bytef *) dictionary, (uInt) length));
+            deflateDictionaryId = id;
+        }
+    }
+
+    // a window used since the last sweep is only marked unused, so it goes on the second idle sweep
+    void Group::releaseIdleDeflateWindows(uS::Timer *timer) {
+        Group *group = static_cast<Group *>(timer->getData());
+
+        group->forEach([](WebSocket *webSocket) {
+            if (webSocket->slidingWindowUsed) {
+                webSocket->slidingWindowUsed = false;
+            } else if (!webSocket->stream || !webSocket->stream->deflate) {
+                webSocket->releaseDeflateWindow();
+            }
+        });
+    }
+
+    void Group::setSlowConsumer(size_t bytes, unsigned int ageMs) {
+        if (slowConsumerTimer) {
+            slowConsumerTimer->stop();
+            slowConsumerTimer->close();
+            slowConsumerTimer = nullptr;
+            forEach([this](WebSocket *webSocket) {
+                clearSlowConsumer(webSocket);
+            });
+        }
+
+        slowConsumerBytes = bytes;
+        slowConsumerAgeMs = ageMs;
+        stampMessages = queueLatency || ageMs;
+        if (bytes || ageMs) {
+            int intervalMs = ageMs ? std::max<int>(ageMs / 2, 10) : 100;
+            slowConsumerTimer = new uS::Timer(hub->getLoop());
+            slowConsumerTimer->setData(this);
+            slowConsumerTimer->start(checkSlowConsumers, intervalMs, intervalMs);
+            slowConsumerTimer->unref();
+        }
+    }
+
+    void Group::setBacklogCompression(size_t bytes) {
+        if (backlogTimer) {
+            backlogTimer->stop();
+            backlogTimer->close();
+            backlogTimer = nullptr;
+        }
+
+        backlogCompressionBytes = bytes;
+        if (bytes && deflatesOutbound()) {
+            backlogTimer = new uS::Timer(hub->getLoop());
+            backlogTimer->setData(this);
+            backlogTimer->start(compressBacklogs, 100, 100);
+            backlogTimer->unref();
+        }
+    }
+
+    void Group::compressBacklogs(uS::Timer *timer) {
+        Group *group = static_cast<Group *>(timer->getData());
+        group->forEach([group](WebSocket *webSocket) {
+            if (webSocket->getBufferedAmount() > group->backlogCompressionBytes && webSocket->compresses() && !webSocket->client &&
+                !webSocket->slidingWindowBits && !webSocket->presetDictionary && !webSocket->isShuttingDown()) {
+                webSocket->compressBacklog();
+            }
+        });
+    }
+
+    void Group::setNoDelay(bool enable) {
+        noDelay = enable;
+    }
+
+    void Group::setAdaptiveNoDelay(unsigned int sendsPerSecond) {
+        if (noDelayTimer) {
+            noDelayTimer->stop();
+            noDelayTimer->close();
+            noDelayTimer = nullptr;
+        }
+
+        noDelaySendRate = sendsPerSecond;
+        if (sendsPerSecond) {
+            forEach([](WebSocket *webSocket) {
+                webSocket->smallSends = 0;
+            });
+            noDelayTimer = new uS::Timer(hub->getLoop());
+            noDelayTimer->setData(this);
+            noDelayTimer->start(adaptNoDelay, 1000, 1000);
+            noDelayTimer->unref();
+        }
+    }
+
+    void Group::adaptNoDelay(uS::Timer *timer) {
+        Group *group = static_cast<Group *>(timer->getData());
+        group->forEach([group](WebSocket *webSocket) {
+            if (!webSocket->noDelayFixed) {
+                webSocket->uS::Socket::setNoDelay(webSocket->smallSends < group->noDelaySendRate && group->noDelay);
+            }
+            webSocket->smallSends = 0;
+        });
+    }
+
+    void Group::setTcpInfoSampling(unsigned int intervalMs) {
+        if (tcpInfoTimer) {
+            tcpInfoTimer->stop();
+            tcpInfoTimer->close();
+            tcpInfoTimer = nullptr;
+        }
+
+#ifdef UWS_TCP_INFO
+        if (intervalMs) {
+            tcpInfoTimer = new uS::Timer(hub->getLoop());
+            tcpInfoTimer->setData(this);
+            tcpInfoTimer->start(sampleTcpInfo, intervalMs, intervalMs);
+            tcpInfoTimer->unref();
+        }
+#endif
+    }
+
+    // what is not queueing does not change much, its first sample is kept for setCompressionMinRtt to go by
+    void Group::sampleTcpInfo(uS::Timer *timer) {
+        Group *group = static_cast<Group *>(timer->getData());
+        group->forEach([](WebSocket *webSocket) {
+            if (!webSocket->tcpInfo) {
+                uS::Context::TcpInfo tcpInfo;
+                if (uS::Context::getTcpInfo(webSocket->getFd(), tcpInfo)) {
+                    webSocket->tcpInfo = new uS::Context::TcpInfo(tcpInfo);
+                }
+            } else if (!webSocket->hasEmptyQueue()) {
+                uS::Context::getTcpInfo(webSocket->getFd(), *webSocket->tcpInfo);
+            }
+        });
+    }
+
+    void Group::setCompressionMinRtt(unsigned int micros) {
+        compressionMinRtt = micros;
+    }
+
+    void Group::clearSlowConsumer(WebSocket *webSocket) {
+        metrics[SLOW_BY_BYTES] -= (webSocket->slowConsumer & WebSocket::SLOW_BY_BYTES) != 0;
+        metrics[SLOW_BY_AGE] -= (webSocket->slowConsumer & WebSocket::SLOW_BY_AGE) != 0;
+        webSocket->slowConsumer = 0;
+    }
+
+    // the age is of the front message, which is the oldest. Those allocated before an age was set have no stamp
+    void Group::checkSlowConsumers(uS::Timer *timer) {
+        Group *group = static_cast<Group *>(timer->getData());
+        uint32_t now = (uint32_t) (uv_hrtime() / 1000);
+
+        group->forEach([group, now](WebSocket *webSocket) {
+            size_t bytes = webSocket->getBufferedAmount();
+            unsigned int ageMs = 0;
+            if (!webSocket->hasEmptyQueue() && webSocket->messageQueue.front()->allocatedAt) {
+                ageMs = (now - webSocket->messageQueue.front()->allocatedAt) / 1000;
+            }
+
+            unsigned char slowConsumer = 0;
+            if (group->slowConsumerBytes && bytes > group->slowConsumerBytes) {
+                slowConsumer |= WebSocket::SLOW_BY_BYTES;
+            }
+            if (group->slowConsumerAgeMs && ageMs > group->slowConsumerAgeMs) {
+                slowConsumer |= WebSocket::SLOW_BY_AGE;
+            }
+            if (slowConsumer == webSocket->slowConsumer) {
+                return;
+            }
+
+            bool reported = webSocket->slowConsumer;
+            group->clearSlowConsumer(webSocket);
+            webSocket->slowConsumer = slowConsumer;
+            group->metrics[SLOW_BY_BYTES] += (slowConsumer & WebSocket::SLOW_BY_BYTES) != 0;
+            group->metrics[SLOW_BY_AGE] += (slowConsumer & WebSocket::SLOW_BY_AGE) != 0;
+            if (slowConsumer && !reported) {
+                group->slowConsumerHandler(webSocket, bytes, ageMs);
+            }
+        });
+    }
+
+    void Group::setHeartbeat(int intervalMs, int timeoutMs) {
+        if (heartbeatTimer) {
+            heartbeatTimer->stop();
+            heartbeatTimer->close();
+            heartbeatTimer = nullptr;
+            for (WebSocket *webSocket : heartbeatWheel) {
+                for (; webSocket; webSocket = webSocket->heartbeatNext) {
+                    webSocket->heartbeatSlot = -1;
+                }
+            }
+            heartbeatWheel.clear();
+        }
+
+        if (intervalMs > 0 && timeoutMs > 0) {
+            int tickMs = std::max(std::min(intervalMs, timeoutMs) / 8, 1);
+            heartbeatIntervalTicks = (intervalMs + tickMs - 1) / tickMs;
+            heartbeatTimeoutTicks = (timeoutMs + tickMs - 1) / tickMs;
+            heartbeatWheel.assign(std::max(heartbeatIntervalTicks, heartbeatTimeoutTicks) + 1, nullptr);
+            heartbeatTick = 0;
+
+            int spread = 0;
+            forEach([this, &spread](WebSocket *webSocket) {
+                webSocket->heartbeatPinged = false;
+                scheduleHeartbeat(webSocket, 1 + spread++ % heartbeatIntervalTicks);
+            });
+
+            heartbeatTimer = new uS::Timer(hub->getLoop());
+            heartbeatTimer->setData(this);
+            heartbeatTimer->start(checkHeartbeats, tickMs, tickMs);
+            heartbeatTimer->unref();
+        }
+    }
+
+    void Group::scheduleHeartbeat(WebSocket *webSocket, int ticks) {
+        int slot = (int) ((heartbeatTick + ticks) % heartbeatWheel.size());
+        webSocket->heartbeatSlot = slot;
+        webSocket->heartbeatPrev = nullptr;
+        webSocket->heartbeatNext = heartbeatWheel[slot];
+        if (webSocket->heartbeatNext) {
+            webSocket->heartbeatNext->heartbeatPrev = webSocket;
+        }
+        heartbeatWheel[slot] = webSocket;
+    }
+
+    void Group::unscheduleHeartbeat(WebSocket *webSocket) {
+        if (webSocket->heartbeatSlot == -1) {
+            return;
+        }
+        if (webSocket->heartbeatPrev) {
+            webSocket->heartbeatPrev->heartbeatNext = webSocket->heartbeatNext;
+        } else {
+            heartbeatWheel[webSocket->heartbeatSlot] = webSocket->heartbeatNext;
+        }
+        if (webSocket->heartbeatNext) {
+            webSocket->heartbeatNext->heartbeatPrev = webSocket->heartbeatPrev;
+        }
+        webSocket->heartbeatSlot = -1;
+    }
+
+    // the slot is emptied from its head since a disconnection handler may take any socket out of
+    // it, or change the heartbeat altogether
+    void Group::checkHeartbeats(uS::Timer *timer) {
+        Group *group = static_cast<Group *>(timer->getData());
+        size_t tick = group->heartbeatTick = (group->heartbeatTick + 1) % group->heartbeatWheel.size();
+
+        while (group->heartbeatTimer == timer && group->heartbeatWheel[tick]) {
+            WebSocket *webSocket = group->heartbeatWheel[tick];
+            group->unscheduleHeartbeat(webSocket);
+            if (!webSocket->heartbeatPinged) {
+                webSocket->heartbeatPinged = true;
+                webSocket->hasOutstandingPong = true;
+                group->scheduleHeartbeat(webSocket, group->heartbeatTimeoutTicks);
+                webSocket->send("", 0, OpCode::PING);
+            } else if (webSocket->hasOutstandingPong) {
+                // comes up again next tick should the socket not close right away
+                group->scheduleHeartbeat(webSocket, 1);
+                webSocket->terminate(true);
+            } else {
+                webSocket->heartbeatPinged = false;
+                group->scheduleHeartbeat(webSocket, std::max(group->heartbeatIntervalTicks - group->heartbeatTimeoutTicks, 1));
+            }
+        }
+    }
+
+    void Group::scheduleIdle(WebSocket *webSocket, unsigned int seconds) {
+        if (!idleTimer) {
+            idleWheel.assign(IDLE_WHEEL_SLOTS, nullptr);
+            idleTimer = new uS::Timer(hub->getLoop());
+            idleTimer->setData(this);
+            idleTimer->start(checkIdle, 1000, 1000);
+            idleTimer->unref();
+        }
+
+        int slot = (int) ((idleClock + std::min<unsigned int>(seconds, IDLE_WHEEL_SLOTS - 1)) % IDLE_WHEEL_SLOTS);
+        webSocket->idleSlot = slot;
+        webSocket->idlePrev = nullptr;
+        webSocket->idleNext = idleWheel[slot];
+        if (webSocket->idleNext) {
+            webSocket->idleNext->idlePrev = webSocket;
+        }
+        idleWheel[slot] = webSocket;
+    }
+
+    void Group::unscheduleIdle(WebSocket *webSocket) {
+        if (webSocket->idleSlot == -1) {
+            return;
+        }
+        if (webSocket->idlePrev) {
+            webSocket->idlePrev->idleNext = webSocket->idleNext;
+        } else {
+            idleWheel[webSocket->idleSlot] = webSocket->idleNext;
+        }
+        if (webSocket->idleNext) {
+            webSocket->idleNext->idlePrev = webSocket->idlePrev;
+        }
+        webSocket->idleSlot = -1;
+    }
+
+    // a socket that was active since it got here moves on to where its timeout now ends, at most
+    // once per timeout. Emptied from the head like checkHeartbeats
+    void Group::checkIdle(uS::Timer *timer) {
+        Group *group = static_cast<Group *>(timer->getData());
+        int slot = (int) (++group->idleClock % IDLE_WHEEL_SLOTS);
+
+        while (group->idleTimer == timer && group->idleWheel[slot]) {
+            WebSocket *webSocket = group->idleWheel[slot];
+            group->unscheduleIdle(webSocket);
+            // activity stamped during a second counts as its start, so idle is one more than for sure
+            unsigned int idle = group->idleClock - webSocket->lastActivity;
+            if (idle <= webSocket->idleTimeout) {
+                webSocket->idlePinged = false;
+                group->scheduleIdle(webSocket, webSocket->idleTimeout + 1 - idle);
+            } else if (webSocket->idlePing && !webSocket->idlePinged) {
+                webSocket->idlePinged = true;
+                group->scheduleIdle(webSocket, webSocket->idleTimeout);
+                webSocket->send("", 0, OpCode::PING);
+            } else {
+                // comes up again next second should the socket not close right away
+                group->scheduleIdle(webSocket, 1);
+                webSocket->close(1001);
+            }
+        }
+    }
+
+    // sends the plain or, for sockets that can take a shared compressed frame, the deflated
+    // framing of the message. Each is prepared at most once into preparedMessages
+    void Group::sendPrepared(WebSocket *webSocket, const char *message, size_t length, OpCode opCode, bool compress, WebSocket::PreparedMessage *preparedMessages[2], bool defer, uint32_t conflationKey, unsigned int ttlMs) {
+        if (compress && webSocket->compresses() && !webSocket->slidingWindowBits) {
+            if (!preparedMessages[1]) {
+                size_t compressedLength = length;
+                uint64_t startedAt = latencyClock();
+                CpuSpan cpuSpan = startCpu();
+                UWS_TRACE(deflate__start, DEFLATE, 'B', this, length);
+                char *deflated = hub->deflate((char *) message, compressedLength, nullptr, compressionSettings);
+                UWS_TRACE(deflate__done, DEFLATE, 'E', this, compressedLength);
+                chargeCpu(CPU_COMPRESSION, cpuSpan);
+                recordLatency(DEFLATE_TIME, startedAt);
+                recordCompression(opCode, length, compressedLength);
+                if (compressedLength < length) {
+                    preparedMessages[1] = WebSocket::prepareMessage(deflated, compressedLength, opCode, true);
+                } else {
+                    // did not shrink, so everyone gets the plain frame
+                    if (!preparedMessages[0]) {
+                        preparedMessages[0] = WebSocket::prepareMessage((char *) message, length, opCode, false);
+                    }
+                    preparedMessages[1] = preparedMessages[0];
+                    preparedMessages[0]->references++;
+                }
+            }
+            webSocket->sendPrepared(preparedMessages[1], nullptr, defer, conflationKey, ttlMs);
+        } else {
+            if (!preparedMessages[0]) {
+                preparedMessages[0] = WebSocket::prepareMessage((char *) message, length, opCode, false);
+            }
+            webSocket->sendPrepared(preparedMessages[0], nullptr, defer, conflationKey, ttlMs);
+        }
+    }
+
+    // the compressed frame is identical for every socket without a sliding window since the shared
+    // compressor is reset after each message, the plain frame rides along for everyone else
+    WebSocket::PreparedMessage *Group::prepareMessage(const char *message, size_t length, OpCode opCode, bool compress, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved)) {
+        WebSocket::PreparedMessage *preparedMessage = WebSocket::prepareMessage((char *) message, length, opCode, false, callback);
+        if (!compress || !deflatesOutbound() || opCode >= 3 || !shouldCompress(opCode, length)) {
+            return preparedMessage;
+        }
+
+        size_t compressedLength = length;
+        uint64_t startedAt = latencyClock();
+        CpuSpan cpuSpan = startCpu();
+        UWS_TRACE(deflate__start, DEFLATE, 'B', this, length);
+        char *deflated = hub->deflate((char *) message, compressedLength, nullptr, compressionSettings);
+        UWS_TRACE(deflate__done, DEFLATE, 'E', this, compressedLength);
+        chargeCpu(CPU_COMPRESSION, cpuSpan);
+        recordLatency(DEFLATE_TIME, startedAt);
+        recordCompression(opCode, length, compressedLength);
+        if (compressedLength >= length) {
+            return preparedMessage;
+        }
+        WebSocket::PreparedMessage *compressedMessage = WebSocket::prepareMessage(deflated, compressedLength, opCode, true, callback);
+        compressedMessage->uncompressed = preparedMessage;
+        return compressedMessage;
+    }
+
+    // frames the message once (and deflates it once) for every socket of the group. Slow sockets
+    // still holding an unsent message of the same non-zero conflationKey get it replaced instead, and
+    // drop it if it is still unsent after a non-zero ttlMs
+    void Group::broadcast(const char *message, size_t length, OpCode opCode, bool compress, uint32_t conflationKey, unsigned int ttlMs) {
+#ifdef UWS_THREADSAFE
+        // other threads frame and deflate it here with a compressor of their own, the loop thread does the rest
+        if (tid != pthread_self()) {
+            WebSocket::PreparedMessage *preparedMessage = prepareMessage(message, length, opCode, compress);
+            broadcast(preparedMessage, conflationKey, ttlMs);
+            WebSocket::finalizeMessage(preparedMessage);
+            return;
+        }
+#endif
+
+        WebSocket::PreparedMessage *preparedMessages[2] = {};
+        compress = compress && deflatesOutbound() && opCode < 3 && shouldCompress(opCode, length);
+        bool defer = table.size() > DEFERRED_BROADCAST_SOCKETS;
+        forEach([this, message, length, opCode, compress, &preparedMessages, defer, conflationKey, ttlMs](uWS::WebSocket *ws) {
+            sendPrepared(ws, message, length, opCode, compress, preparedMessages, defer, conflationKey, ttlMs);
+        });
+
+        // sessions whose client is away get it uncompressed, whatever they come back with
+        if (sessions && opCode < 3) {
+            for (uint64_t id : sessions->detached) {
+                if (!preparedMessages[0]) {
+                    preparedMessages[0] = WebSocket::prepareMessage((char *) message, length, opCode, false);
+                }
+                preparedMessages[0]->references++;
+                sessions->push(sessions->byId[id], preparedMessages[0]);
+            }
+        }
+
+        for (WebSocket::PreparedMessage *preparedMessage : preparedMessages) {
+            if (preparedMessage) {
+                WebSocket::finalizeMessage(preparedMessage);
+            }
+        }
+    }
+
+    // sends an already prepared message to every socket of the group
+    void Group::broadcast(WebSocket::PreparedMessage *preparedMessage, uint32_t conflationKey, unsigned int ttlMs) {
+#ifdef UWS_THREADSAFE
+        if (tid != pthread_self()) {
+            preparedMessage->references++;
+            Hub::CrossThreadBroadcast *crossThreadBroadcast = new Hub::CrossThreadBroadcast;
+            crossThreadBroadcast->group = this;
+            crossThreadBroadcast->preparedMessage = preparedMessage;
+            crossThreadBroadcast->conflationKey = conflationKey;
+            crossThreadBroadcast->ttlMs = ttlMs;
+            hub->broadcastInbox.push(crossThreadBroadcast);
+            hub->broadcastAsync->send();
+            return;
+        }
+#endif
+
+        bool defer = table.size() > DEFERRED_BROADCAST_SOCKETS;
+        forEach([preparedMessage, defer, conflationKey, ttlMs](uWS::WebSocket *ws) {
+            ws->sendPrepared(preparedMessage, nullptr, defer, conflationKey, ttlMs);
+        });
+
+        if (sessions && (preparedMessage->buffer[0] & 15) < 3) {
+            for (uint64_t id : sessions->detached) {
+                preparedMessage->references++;
+                sessions->push(sessions->byId[id], preparedMessage);
+            }
+        }
+    }
+
+    void Group::broadcast(WebSocket::FileMessage *fileMessage) {
+        forEach([fileMessage](uWS::WebSocket *ws) {
+            ws->sendFile(fileMessage);
+        });
+    }
+
+    // a node per level of the wildcard topics, '+' and '#' are keys like any other
+    struct TopicTree {
+        std::unordered_map<std::string, std::unique_ptr<TopicTree>> children;
+        // the wildcard topic ending here
+        Topic *pattern = nullptr;
+    };
+
+    static std::vector<std::string_view> splitLevels(std::string_view name) {
+        std::vector<std::string_view> levels;
+        for (size_t start = 0; ; ) {
+            size_t end = name.find('/', start);
+            levels.push_back(name.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start));
+            if (end == std::string_view::npos) {
+                return levels;
+            }
+            start = end + 1;
+        }
+    }
+
+    // '+' or '#' as a level of its own, '#' the last. Anything else is a topic like any other
+    static bool isPattern(const std::vector<std::string_view> &levels) {
+        bool wildcard = false;
+        for (size_t i = 0; i < levels.size(); i++) {
+            if (levels[i] == "#" && i + 1 < levels.size()) {
+                return false;
+            }
+            wildcard = wildcard || levels[i] == "+" || levels[i] == "#";
+        }
+        return wildcard;
+    }
+
+    // a first level of '$', like $SYS, is only ever named
+    static bool matchesPattern(const std::vector<std::string_view> &pattern, const std::vector<std::string_view> &levels) {
+        if (levels[0].length() && levels[0][0] == '$' && (pattern[0] == "+" || pattern[0] == "#")) {
+            return false;
+        }
+        for (size_t i = 0; i < pattern.size(); i++) {
+            if (pattern[i] == "#") {
+                return true;
+            }
+            if (i == levels.size() || (pattern[i] != "+" && pattern[i] != levels[i])) {
+                return false;
+            }
+        }
+        return pattern.size() == levels.size();
+    }
+
+    static void collectPatterns(TopicTree *node, const std::vector<std::string_view> &levels, size_t i, std::vector<Topic *> &matched) {
+        bool wildcards = i || !levels[0].length() || levels[0][0] != '$';
+        std::unordered_map<std::string, std::unique_ptr<TopicTree>>::iterator it;
+        if (wildcards && (it = node->children.find("#")) != node->children.end() && it->second->pattern) {
+            matched.push_back(it->second->pattern);
+        }
+        if (i == levels.size()) {
+            if (node->pattern) {
+                matched.push_back(node->pattern);
+            }
+            return;
+        }
+        if ((it = node->children.find(std::string(levels[i]))) != node->children.end()) {
+            collectPatterns(it->second.get(), levels, i + 1, matched);
+        }
+        if (wildcards && levels[i] != "+" && (it = node->children.find("+")) != node->children.end()) {
+            collectPatterns(it->second.get(), levels, i + 1, matched);
+        }
+    }
+
+    // true once node holds nothing anymore
+    static bool prunePattern(TopicTree *node, const std::vector<std::string_view> &levels, size_t i) {
+        if (i == levels.size()) {
+            node->pattern = nullptr;
+        } else {
+            std::unordered_map<std::string, std::unique_ptr<TopicTree>>::iterator it = node->children.find(std::string(levels[i]));
+            if (it != node->children.end() && prunePattern(it->second.get(), levels, i + 1)) {
+                node->children.erase(it);
+            }
+        }
+        return !node->pattern && node->children.empty();
+    }
+
+    Topic *Group::createTopic(const char *topic, size_t topicLength) {
+        Topic *&topicPtr = topics[std::string(topic, topicLength)];
+        if (!topicPtr) {
+            topicPtr = new Topic;
+            topicPtr->name.assign(topic, topicLength);
+
+            std::vector<std::string_view> levels = splitLevels(topicPtr->name);
+            if (isPattern(levels)) {
+                topicPtr->pattern = true;
+                if (!topicTree) {
+                    topicTree = new TopicTree;
+                }
+                TopicTree *node = topicTree;
+                for (std::string_view level : levels) {
+                    std::unique_ptr<TopicTree> &child = node->children[std::string(level)];
+                    if (!child) {
+                        child.reset(new TopicTree);
+                    }
+                    node = child.get();
+                }
+                node->pattern = topicPtr;
+                patternMatches.clear();
+            }
+            if (topicObserver) {
+                topicObserver(topicPtr, 1);
+            }
+        }
+        settle(topicPtr);
+        return topicPtr;
+    }
+
+    // with the wildcard topic of the same name, if it is one
+    void Group::eraseTopic(Topic *topic) {
+        if (topicObserver) {
+            topicObserver(topic, -1);
+        }
+        if (topic->pattern) {
+            if (prunePattern(topicTree, splitLevels(topic->name), 0)) {
+                delete topicTree;
+                topicTree = nullptr;
+            }
+            patternMatches.clear();
+        }
+        topics.erase(topic->name);
+        delete topic;
+    }
+
+    const std::vector<Topic *> *Group::matchPatterns(const std::string &name) {
+        if (!topicTree) {
+            return nullptr;
+        }
+        std::unordered_map<std::string, std::vector<Topic *>>::iterator it = patternMatches.find(name);
+        if (it == patternMatches.end()) {
+            if (patternMatches.size() >= MAX_PATTERN_MATCHES) {
+                patternMatches.clear();
+            }
+            // a published '+' level is named by the pattern it also is
+            std::vector<Topic *> matched;
+            collectPatterns(topicTree, splitLevels(name), 0, matched);
+            std::sort(matched.begin(), matched.end());
+            matched.erase(std::unique(matched.begin(), matched.end()), matched.end());
+            it = patternMatches.emplace(name, std::move(matched)).first;
+        }
+        return it->second.empty() ? nullptr : &it->second;
+    }
+
+    // subscribers are sorted, so merging keeps receivers sorted for dropping those in several
+    void Group::gatherReceivers(Topic *topic, const std::vector<Topic *> &patterns, std::vector<WebSocket *> &receivers) {
+        if (topic) {
+            receivers = topic->subscribers;
+        }
+        for (Topic *pattern : patterns) {
+            settle(pattern);
+            std::vector<WebSocket *>::iterator middle = receivers.insert(receivers.end(), pattern->subscribers.begin(), pattern->subscribers.end());
+            std::inplace_merge(receivers.begin(), middle, receivers.end());
+        }
+        receivers.erase(std::unique(receivers.begin(), receivers.end()), receivers.end());
+    }
+
+    void Group::subscribe(WebSocket *webSocket, const char *topic, size_t topicLength) {
+        Topic *topicPtr = createTopic(topic, topicLength);
+
+        std::vector<WebSocket *> &subscribers = topicPtr->subscribers;
+        std::vector<WebSocket *>::iterator it = std::lower_bound(subscribers.begin(), subscribers.end(), webSocket);
+        if (it != subscribers.end() && *it == webSocket) {
+            return;
+        }
+        subscribers.insert(it, webSocket);
+
+        if (!webSocket->topics) {
+            webSocket->topics = new std::vector<Topic *>;
+        }
+        webSocket->topics->push_back(topicPtr);
+
+        // deferred like the publishes, so it goes out ahead of those of this iteration. A wildcard topic gets those
+        // of every topic it matches
+        if (topicPtr->lastValue) {
+            webSocket->sendPrepared(topicPtr->lastValue, nullptr, true);
+        }
+        if (topicPtr->pattern && lastValues) {
+            std::vector<std::string_view> pattern = splitLevels(topicPtr->name);
+            for (std::pair<const std::string, Topic *> &named : topics) {
+                if (named.second->lastValue && !named.second->pattern && matchesPattern(pattern, splitLevels(named.first))) {
+                    webSocket->sendPrepared(named.second->lastValue, nullptr, true);
+                }
+            }
+        }
+    }
+
+    // drops webSocket from the topic, erasing the topic once nobody is left
+    void Group::removeSubscriber(Topic *topic, WebSocket *webSocket) {
+        settle(topic);
+        std::vector<WebSocket *> &subscribers = topic->subscribers;
+        std::vector<WebSocket *>::iterator it = std::lower_bound(subscribers.begin(), subscribers.end(), webSocket);
+        if (it != subscribers.end() && *it == webSocket) {
+            subscribers.erase(it);
+        }
+        if (subscribers.empty() && !topic->publishing && !topic->lastValue) {
+            eraseTopic(topic);
+        }
+    }
+
+    void Group::unsubscribe(WebSocket *webSocket, const char *topic, size_t topicLength) {
+        if (!webSocket->topics) {
+            return;
+        }
+
+        std::vector<Topic *> &webSocketTopics = *webSocket->topics;
+        for (size_t i = 0; i < webSocketTopics.size(); i++) {
+            if (webSocketTopics[i]->name.length() == topicLength && !webSocketTopics[i]->name.compare(0, topicLength, topic, topicLength)) {
+                Topic *topicPtr = webSocketTopics[i];
+                webSocketTopics[i] = webSocketTopics.back();
+                webSocketTopics.pop_back();
+                removeSubscriber(topicPtr, webSocket);
+                return;
+            }
+        }
+    }
+
+    void Group::unsubscribeAll(WebSocket *webSocket, bool closing) {
+        for (Topic *topic : *webSocket->topics) {
+            if (!closing) {
+                removeSubscriber(topic, webSocket);
+                continue;
+            }
+            // erasing from the middle of a big topic once per closing subscriber is quadratic in a mass disconnect
+            topic->departed.push_back(webSocket);
+            if (topic->departed.size() == topic->subscribers.size() && !topic->publishing && !topic->lastValue) {
+                eraseTopic(topic);
+            }
+        }
+        delete webSocket->topics;
+        webSocket->topics = nullptr;
+    }
+
+    // takes the departed out of subscribers in one pass, before anything reads or changes them.
+    // Their pointers are only compared, the sockets may be freed by now
+    void Group::settle(Topic *topic) {
+        if (topic->departed.empty()) {
+            return;
+        }
+        std::vector<WebSocket *> &departed = topic->departed;
+        std::sort(departed.begin(), departed.end());
+        topic->subscribers.erase(std::remove_if(topic->subscribers.begin(), topic->subscribers.end(), [&departed](WebSocket *ws) {
+            return std::binary_search(departed.begin(), departed.end(), ws);
+        }), topic->subscribers.end());
+        departed.clear();
+    }
+
+    Topic *Group::findTopic(const std::string &name) {
+        std::unordered_map<std::string, Topic *>::iterator it = topics.find(name);
+        if (it == topics.end()) {
+            return nullptr;
+        }
+        settle(it->second);
+        return it->second;
+    }
+
+    // receivers are resolved into one sorted vector up front, so merging rooms, dropping the
+    // excepted and sockets closing while sending all work on a snapshot. False if nobody can match
+    bool Group::selectRooms(const RoomSelection &selection, std::vector<WebSocket *> &receivers) {
+        if (selection.rooms.empty()) {
+            forEach([&receivers](WebSocket *ws) {
+                receivers.push_back(ws);
+            });
+            std::sort(receivers.begin(), receivers.end());
+        } else if (selection.intersect) {
+            std::vector<Topic *> rooms;
+            for (const std::string &name : selection.rooms) {
+                Topic *topic = findTopic(name);
+                if (!topic) {
+                    return false;
+                }
+                rooms.push_back(topic);
+            }
+            std::sort(rooms.begin(), rooms.end(), [](Topic *a, Topic *b) {
+                return a->subscribers.size() < b->subscribers.size();
+            });
+            for (WebSocket *ws : rooms[0]->subscribers) {
+                bool everywhere = true;
+                for (size_t i = 1; i < rooms.size() && everywhere; i++) {
+                    everywhere = std::binary_search(rooms[i]->subscribers.begin(), rooms[i]->subscribers.end(), ws);
+                }
+                if (everywhere) {
+                    receivers.push_back(ws);
+                }
+            }
+        } else {
+            for (const std::string &name : selection.rooms) {
+                if (Topic *topic = findTopic(name)) {
+                    std::vector<WebSocket *>::iterator middle = receivers.insert(receivers.end(), topic->subscribers.begin(), topic->subscribers.end());
+                    std::inplace_merge(receivers.begin(), middle, receivers.end());
+                }
+            }
+            receivers.erase(std::unique(receivers.begin(), receivers.end()), receivers.end());
+        }
+
+        for (const std::string &name : selection.except) {
+            if (Topic *topic = findTopic(name)) {
+                receivers.erase(std::remove_if(receivers.begin(), receivers.end(), [topic](WebSocket *ws) {
+                    return std::binary_search(topic->subscribers.begin(), topic->subscribers.end(), ws);
+                }), receivers.end());
+            }
+        }
+        return true;
+    }
+
+    void Group::publishRooms(const RoomSelection &selection, const char *message, size_t length, OpCode opCode, bool compress) {
+        std::vector<WebSocket *> receivers;
+        if (!selectRooms(selection, receivers)) {
+            return;
+        }
+
+        WebSocket::PreparedMessage *preparedMessages[2] = {};
+        compress = compress && deflatesOutbound() && opCode < 3 && shouldCompress(opCode, length);
+        for (WebSocket *ws : receivers) {
+            // closed ones are still allocated until the end of the iteration
+            if (!ws->isClosed()) {
+                sendPrepared(ws, message, length, opCode, compress, preparedMessages, true);
+            }
+        }
+
+        for (WebSocket::PreparedMessage *preparedMessage : preparedMessages) {
+            if (preparedMessage) {
+                WebSocket::finalizeMessage(preparedMessage);
+            }
+        }
+    }
+
+    // sends are deferred to the end of the loop iteration so that everything published
+    // to one socket during an iteration goes out in a single write
+    void Group::publish(const char *topic, size_t topicLength, const char *message, size_t length, OpCode opCode, bool compress, uint32_t conflationKey, unsigned int ttlMs) {
+        WebSocket::PreparedMessage *preparedMessages[2] = {};
+        std::string name(topic, topicLength);
+        Topic *topicPtr;
+        if (lastValues && opCode < 3) {
+            // kept before sending, which may erase a topic it empties otherwise
+            preparedMessages[0] = WebSocket::prepareMessage((char *) message, length, opCode, false);
+            topicPtr = createTopic(topic, topicLength);
+            keepLastValue(topicPtr, preparedMessages[0]);
+        } else {
+            topicPtr = findTopic(name);
+        }
+        const std::vector<Topic *> *patterns = matchPatterns(name);
+        if (!topicPtr && !patterns) {
+            return;
+        }
+
+        compress = compress && deflatesOutbound() && opCode < 3 && shouldCompress(opCode, length);
+        auto send = [this, message, length, opCode, compress, &preparedMessages, conflationKey, ttlMs](WebSocket *ws) {
+            sendPrepared(ws, message, length, opCode, compress, preparedMessages, true, conflationKey, ttlMs);
+        };
+        if (patterns) {
+            forEachReceiver(topicPtr, *patterns, send);
+        } else {
+            forEachSubscriber(topicPtr, send);
+        }
+
+        for (WebSocket::PreparedMessage *preparedMessage : preparedMessages) {
+            if (preparedMessage) {
+                WebSocket::finalizeMessage(preparedMessage);
+            }
+        }
+    }
+
+    void Group::publish(const char *topic, size_t topicLength, WebSocket::PreparedMessage *preparedMessage, uint32_t conflationKey, unsigned int ttlMs) {
+        std::string name(topic, topicLength);
+        Topic *topicPtr;
+        if (lastValues && (preparedMessage->buffer[0] & 15) < 3) {
+            topicPtr = createTopic(topic, topicLength);
+            keepLastValue(topicPtr, preparedMessage);
+        } else {
+            topicPtr = findTopic(name);
+        }
+        const std::vector<Topic *> *patterns = matchPatterns(name);
+        if (!topicPtr && !patterns) {
+            return;
+        }
+
+        auto send = [preparedMessage, conflationKey, ttlMs](WebSocket *ws) {
+            ws->sendPrepared(preparedMessage, nullptr, true, conflationKey, ttlMs);
+        };
+        if (patterns) {
+            forEachReceiver(topicPtr, *patterns, send);
+        } else {
+            forEachSubscriber(topicPtr, send);
+        }
+    }
+
+    // takes a reference of its own
+    void Group::keepLastValue(Topic *topic, WebSocket::PreparedMessage *preparedMessage) {
+        preparedMessage->references++;
+        if (topic->lastValue) {
+            WebSocket::finalizeMessage(topic->lastValue);
+        }
+        topic->lastValue = preparedMessage;
+    }
+
+    void Group::setLastValues(bool enabled) {
+        // keeping last values takes every publish, subscribed to or not
+        if (topicObserver && enabled != lastValues) {
+            topicObserver(nullptr, enabled ? 1 : -1);
+        }
+        lastValues = enabled;
+        if (!enabled) {
+            for (std::unordered_map<std::string, Topic *>::iterator it = topics.begin(); it != topics.end(); ) {
+                Topic *topic = it->second;
+                if (topic->lastValue) {
+                    WebSocket::finalizeMessage(topic->lastValue);
+                    topic->lastValue = nullptr;
+                }
+                settle(topic);
+                it++;
+                if (topic->subscribers.empty() && !topic->publishing) {
+                    eraseTopic(topic);
+                }
+            }
+        }
+    }
+
+    void Group::clearLastValue(const char *topic, size_t topicLength) {
+        Topic *topicPtr = findTopic(std::string(topic, topicLength));
+        if (topicPtr && topicPtr->lastValue) {
+            WebSocket::finalizeMessage(topicPtr->lastValue);
+            topicPtr->lastValue = nullptr;
+            if (topicPtr->subscribers.empty() && !topicPtr->publishing) {
+                eraseTopic(topicPtr);
+            }
+        }
+    }
+
+    void Group::publishRooms(const RoomSelection &selection, WebSocket::PreparedMessage *preparedMessage) {
+        std::vector<WebSocket *> receivers;
+        if (!selectRooms(selection, receivers)) {
+            return;
+        }
+
+        for (WebSocket *ws : receivers) {
+            if (!ws->isClosed()) {
+                ws->sendPrepared(preparedMessage, nullptr, true);
+            }
+        }
+    }
+
+    void Group::setAdmission(unsigned int rate, unsigned int burst, size_t maxConnections, unsigned int maxPerAddress) {
+        admissionRate = rate;
+        admissionBurst = burst ? burst : rate;
+        admissionTokens = admissionBurst;
+        admissionRefilled = uv_now(hub->getLoop());
+        this->maxConnections = maxConnections;
+
+        // counted from scratch, since nothing was while the limit was off
+        this->maxPerAddress = maxPerAddress;
+        connectionsPerAddress.clear();
+        if (maxPerAddress) {
+            forEach([this](WebSocket *webSocket) {
+                countAddress(webSocket, 1);
+            });
+        }
+    }
+
+    void Group::countAddress(WebSocket *webSocket, int change) {
+        if (!webSocket->peerAddress.family) {
+            return;
+        }
+        std::string key = addressKey(webSocket->peerAddress);
+        if (change > 0) {
+            connectionsPerAddress[key]++;
+        } else {
+            std::unordered_map<std::string, unsigned int>::iterator it = connectionsPerAddress.find(key);
+            if (it != connectionsPerAddress.end() && !--it->second) {
+                connectionsPerAddress.erase(it);
+            }
+        }
+    }
+
+    // reads the peer address for the WebSocket either way, the limits only cost anything when set
+    bool Group::admit(uv_os_sock_t fd, WebSocket::PeerAddress &peerAddress) {
+        WebSocket::readPeerAddress(fd, peerAddress);
+        if (draining) {
+            return true;
+        }
+        if (maxConnections && connections >= maxConnections) {
+            return false;
+        }
+        if (maxPerAddress && peerAddress.family) {
+            std::unordered_map<std::string, unsigned int>::iterator it = connectionsPerAddress.find(addressKey(peerAddress));
+            if (it != connectionsPerAddress.end() && it->second >= maxPerAddress) {
+                return false;
+            }
+        }
+        if (admissionRate) {
+            uint64_t now = uv_now(hub->getLoop());
+            admissionTokens = std::min<double>(admissionBurst, admissionTokens + (double) (now - admissionRefilled) * admissionRate / 1000);
+            admissionRefilled = now;
+            if (admissionTokens < 1) {
+                return false;
+            }
+            admissionTokens--;
+        }
+        return true;
+    }
+
+    void Group::drain(int spreadMs, int deadlineMs, const std::function<void(size_t remaining)> &progress) {
+        stopDrain();
+        draining = true;
+        drainProgressHandler = progress;
+        drainCursor = 0;
+        drainEnd = table.size();
+        drainTotal = connections;
+        drainRemaining = drainReported = drainTotal;
+        drainAsked = 0;
+        drainTicks = 0;
+        drainSpreadMs = std::max(spreadMs, 0);
+        drainDeadlineMs = std::max(deadlineMs, drainSpreadMs);
+        drainTickMs = std::max(std::min((int) DRAIN_TICK_MS, drainSpreadMs), 1);
+
+        drainTimer = new uS::Timer(hub->getLoop());
+        drainTimer->setData(this);
+        drainTimer->start(continueDrain, 0, drainTickMs);
+    }
+
+    void Group::stopDrain() {
+        if (drainTimer) {
+            drainTimer->stop();
+            drainTimer->close();
+            drainTimer = nullptr;
+            if (!iterating && tableHoles) {
+                compactTable();
+            }
+        }
+    }
+
+    // asks as many sockets as are due by now, the first step (at 0 ms) already a share of them. Their
+    // disconnection handlers may close the group or drain it anew, which ends this round
+    void Group::continueDrain(uS::Timer *timer) {
+        Group *group = static_cast<Group *>(timer->getData());
+        int elapsedMs = group->drainTicks++ * group->drainTickMs;
+
+        if (elapsedMs >= group->drainDeadlineMs) {
+            group->forEach([](WebSocket *webSocket) {
+                webSocket->terminate(true);
+            });
+        } else {
+            size_t due = group->drainSpreadMs ? std::min(group->drainTotal, (size_t) ((double) group->drainTotal * (elapsedMs + group->drainTickMs) / group->drainSpreadMs)) : group->drainTotal;
+            while (group->drainTimer == timer && group->drainAsked < due && group->drainCursor < group->drainEnd) {
+                WebSocket *webSocket = group->table[group->drainCursor++];
+                if (!webSocket) {
+                    continue;
+                }
+                group->drainAsked++;
+                if (webSocket->hasEmptyQueue()) {
+                    webSocket->close(1001);
+                } else {
+                    webSocket->closeWhenDrained = true;
+                }
+            }
+        }
+
+        if (group->drainTimer != timer) {
+            return;
+        }
+        if (!group->drainRemaining || elapsedMs >= group->drainDeadlineMs) {
+            group->stopDrain();
+            group->drainRemaining = 0;
+        }
+        if (group->drainProgressHandler && (group->drainRemaining != group->drainReported || !group->drainTimer)) {
+            group->drainReported = group->drainRemaining;
+            std::function<void(size_t)> progress = group->drainProgressHandler;
+            progress(group->drainRemaining);
+        }
+    }
+
+    void Group::setSessions(size_t ringSize, unsigned int expirySeconds) {
+        if (sessions) {
+            sessions->timer->stop();
+            sessions->timer->close();
+            for (auto &session : sessions->byId) {
+                sessions->drop(session.second);
+            }
+            delete sessions;
+            sessions = nullptr;
+        }
+
+        if (ringSize && expirySeconds) {
+            sessions = new Sessions;
+            sessions->ringSize = ringSize;
+            sessions->expirySeconds = expirySeconds;
+            sessions->wheel.resize(expirySeconds + 1);
+            sessions->timer = new uS::Timer(hub->getLoop());
+            sessions->timer->setData(this);
+            sessions->timer->start(expireSessions, 1000, 1000);
+            sessions->timer->unref();
+        }
+    }
+
+    uint64_t Group::openSession(WebSocket *webSocket) {
+        if (!sessions) {
+            return 0;
+        }
+        std::unordered_map<WebSocket *, uint64_t>::iterator it = sessions->bySocket.find(webSocket);
+        if (it != sessions->bySocket.end()) {
+            return it->second;
+        }
+
+        uint64_t id = 0;
+        while (!id || sessions->byId.count(id)) {
+            RAND_bytes((unsigned char *) &id, sizeof(id));
+        }
+        sessions->byId[id].webSocket = webSocket;
+        sessions->bySocket[webSocket] = id;
+        return id;
+    }
+
+    bool Group::resumeSession(WebSocket *webSocket, uint64_t id, uint64_t lastSequence) {
+        if (!sessions) {
+            return false;
+        }
+        std::unordered_map<uint64_t, Sessions::Session>::iterator it = sessions->byId.find(id);
+        if (it == sessions->byId.end()) {
+            return false;
+        }
+        Sessions::Session &session = it->second;
+        uint64_t first = session.sequence - session.ring.size();
+        if (lastSequence < first || lastSequence > session.sequence) {
+            return false;
+        }
+
+        if (session.webSocket != webSocket) {
+            detachSession(webSocket);
+            if (session.webSocket) {
+                sessions->bySocket.erase(session.webSocket);
+            }
+
+            // without a session while replaying, its sends are not kept again. A send closing it on
+            // backpressure leaves the session detached
+            uint64_t handle = getId(webSocket);
+            session.webSocket = nullptr;
+            sessions->detached.insert(id);
+            for (size_t i = lastSequence - first; i < session.ring.size() && getWebSocket(handle) == webSocket; i++) {
+                webSocket->sendPrepared(session.ring[i]);
+            }
+            if (getWebSocket(handle) == webSocket) {
+                sessions->detached.erase(id);
+                session.webSocket = webSocket;
+                sessions->bySocket[webSocket] = id;
+            } else {
+                session.expiresAt = sessions->tick + sessions->expirySeconds;
+                sessions->wheel[session.expiresAt % sessions->wheel.size()].push_back(id);
+            }
+        }
+        return true;
+    }
+
+    void Group::recordSession(WebSocket *webSocket, WebSocket::PreparedMessage *preparedMessage) {
+        std::unordered_map<WebSocket *, uint64_t>::iterator it = sessions->bySocket.find(webSocket);
+        if (it != sessions->bySocket.end()) {
+            preparedMessage->references++;
+            sessions->push(sessions->byId[it->second], preparedMessage);
+        }
+    }
+
+    // framed as a prepared message of its own, only for sockets with a session
+    void Group::recordSession(WebSocket *webSocket, const char *message, size_t length, OpCode opCode) {
+        std::unordered_map<WebSocket *, uint64_t>::iterator it = sessions->bySocket.find(webSocket);
+        if (it != sessions->bySocket.end()) {
+            sessions->push(sessions->byId[it->second], WebSocket::prepareMessage((char *) message, length, opCode, false));
+        }
+    }
+
+    void Group::detachSession(WebSocket *webSocket) {
+        std::unordered_map<WebSocket *, uint64_t>::iterator it = sessions->bySocket.find(webSocket);
+        if (it == sessions->bySocket.end()) {
+            return;
+        }
+        Sessions::Session &session = sessions->byId[it->second];
+        session.webSocket = nullptr;
+        session.expiresAt = sessions->tick + sessions->expirySeconds;
+        sessions->wheel[session.expiresAt % sessions->wheel.size()].push_back(it->second);
+        sessions->detached.insert(it->second);
+        sessions->bySocket.erase(it);
+    }
+
+    void Group::expireSessions(uS::Timer *timer) {
+        Sessions *sessions = ((Group *) timer->getData())->sessions;
+        sessions->tick++;
+        std::vector<uint64_t> expiring;
+        expiring.swap(sessions->wheel[sessions->tick % sessions->wheel.size()]);
+        for (uint64_t id : expiring) {
+            std::unordered_map<uint64_t, Sessions::Session>::iterator it = sessions->byId.find(id);
+            if (it != sessions->byId.end() && !it->second.webSocket && it->second.expiresAt == sessions->tick) {
+                sessions->drop(it->second);
+                sessions->byId.erase(it);
+                sessions->detached.erase(id);
+            }
+        }
+    }
+
+    void Group::close(int code, char *message, size_t length) {
+        setSessions(0, 0);
+        stopDrain();
+        setDeflateWindowIdleTimeout(0);
+        setHeartbeat(0, 0);
+        setSlowConsumer(0, 0);
+        setBacklogCompression(0);
+        setRateLimit(0);
+        if (idleTimer) {
+            idleTimer->stop();
+            idleTimer->close();
+            idleTimer = nullptr;
+            for (WebSocket *webSocket : idleWheel) {
+                for (; webSocket; webSocket = webSocket->idleNext) {
+                    webSocket->idleSlot = -1;
+                }
+            }
+            idleWheel.clear();
+        }
+        // one close frame for all, referenced by the queue of any socket that cannot write it right away
+        WebSocket::PreparedMessage *closeFrame = WebSocket::prepareClose(code, message, length);
+        forEach([closeFrame, code, message, length](uWS::WebSocket *ws) {
+            ws->closeWith(closeFrame, code, message, length);
         });
+        WebSocket::finalizeMessage(closeFrame);
     }
 }
@@ -2,73 +2,844 @@
 #define GROUP_UWS_H
 
 #include "WebSocket.h"
+#include "HttpSocket.h"
 #include "Extensions.h"
+#include <cstdio>
 #include <functional>
-#include <stack>
+#include <unordered_map>
 
 namespace uWS {
     enum ListenOptions {
         TRANSFERS
     };
 
+    // what to do with a send that would queue more than maxBackpressure bytes
+    enum BackpressurePolicy {
+        DROP_MESSAGE,
+        // terminated abortively, see WebSocket::terminate
+        CLOSE_SOCKET
+    };
+
     struct Hub;
 
+    // one message of a batch, data is the batch buffer from offset on. Three uint32s so the
+    // descriptors can be handed on as they are
+    struct BatchedMessage {
+        uint32_t offset;
+        uint32_t length;
+        uint32_t opCode;
+    };
+
+    // one pub/sub topic of a Group, subscribers are kept sorted for binary search
+    struct Topic {
+        std::string name;
+        std::vector<WebSocket *> subscribers;
+        // a publish is walking subscribers, so an emptied topic is erased by it instead
+        bool publishing = false;
+        // closed subscribers still in subscribers, see Group::settle
+        std::vector<WebSocket *> departed;
+        // of Group::setLastValues, the last message published. A topic holding one stays when emptied
+        WebSocket::PreparedMessage *lastValue = nullptr;
+        // has wildcards among its levels, see Group::subscribe
+        bool pattern = false;
+    };
+
+    // the wildcard topics of a Group by level, see Group.cpp
+    struct TopicTree;
+
+    // rooms are topics: a publishRooms goes to the union (or intersection) of rooms minus
+    // everyone in except. No rooms means every socket of the group
+    struct RoomSelection {
+        std::vector<std::string> rooms, except;
+        bool intersect = false;
+    };
+
+    // zlib settings of the compressors deflating for a group. Level is 1 - 9, strategy one of
+    // Z_DEFAULT_STRATEGY (0), Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED
+    struct CompressionSettings {
+        int level = 1;
+        int memLevel = 8;
+        int strategy = 0;
+    };
+
     struct WIN32_EXPORT Group : protected uS::NodeData {
+        public:
+            // of getRttHistogram
+            static const int RTT_BUCKETS = 24;
+            // histograms of setLatencyHistograms
+            enum Latency {
+                HANDLER_LATENCY, QUEUE_LATENCY, DEFLATE_TIME, INFLATE_TIME, UPGRADE_TIME, LATENCIES
+            };
+            // of getMetrics, the first ones are uS::NodeData::Counter. Frames in count those of a fragmented
+            // message as its opcode, sends count messages and their payload as framed
+            enum Metric {
+                READ_CALLS, WRITE_CALLS, TLS_READ_CALLS, TLS_WRITE_CALLS, ACCEPTED_SOCKETS,
+                BLOCK_MESSAGES, HEAP_MESSAGES, QUEUEING_SOCKETS, QUEUE_HIGH_WATER, EXPIRED_MESSAGES,
+                SOCKOPT_CALLS, POLL_CHANGES,
+                MESSAGES_IN, BYTES_IN, BYTES_OUT,
+                TEXT_FRAMES_IN, BINARY_FRAMES_IN, CLOSE_FRAMES_IN, PING_FRAMES_IN, PONG_FRAMES_IN,
+                TEXT_SENDS, BINARY_SENDS, CLOSE_SENDS, PING_SENDS, PONG_SENDS,
+                COMPRESSED_SENDS, UNCOMPRESSED_SENDS, BYTES_BEFORE_COMPRESSION, BYTES_AFTER_COMPRESSION,
+                // sockets over each threshold of setSlowConsumer right now, as of its last sweep
+                SLOW_BY_BYTES, SLOW_BY_AGE,
+                // nanoseconds of the loop spent on this group, see setCpuAccounting
+                CPU_PARSE, CPU_HANDLERS, CPU_COMPRESSION, CPU_FLUSH,
+                // followed by the uS::NodeData::LATENCY_BUCKETS of each Latency in turn
+                LATENCY_HISTOGRAMS,
+                METRICS = LATENCY_HISTOGRAMS + LATENCIES * uS::NodeData::LATENCY_BUCKETS
+            };
+            // a socket of the sketch of setCpuAccounting with what it is estimated to have cost, which overcounts
+            // by at most error
+            struct SocketCost {
+                WebSocket *webSocket;
+                uint64_t nanoseconds, error;
+            };
+
         protected:
             friend struct Hub;
             friend struct WebSocket;
+            friend struct HttpSocket;
+            friend struct HttpServerSocket;
+            friend struct ShardedGroup;
+            friend struct SharedBus;
 
             std::function<void(WebSocket *)> connectionHandler = [](WebSocket *) {};
             std::function<void(WebSocket *, char *message, size_t length, OpCode opCode)> messageHandler = [](WebSocket *, char *, size_t, OpCode) {};
             std::function<void(WebSocket *, int code, char *message, size_t length)> disconnectionHandler = [](WebSocket *, int, char *, size_t) {};
+            std::function<void(WebSocket *)> drainHandler = [](WebSocket *) {};
+            // through UWS_STATIC_HANDLERS first, see the end of this file
+            inline void callConnection(WebSocket *webSocket);
+            inline void callMessage(WebSocket *webSocket, char *message, size_t length, OpCode opCode);
+            inline void callDisconnection(WebSocket *webSocket, int code, char *message, size_t length);
+            // a Hub::connect that never made it to a WebSocket, with the user pointer passed to it
+            std::function<void(void *user)> errorHandler = [](void *) {};
+            // empty unless streaming, which then replaces messageHandler
+            std::function<void(WebSocket *, char *data, size_t length, size_t remainingBytes, bool fin, OpCode opCode)> messageChunkHandler;
+            // empty unless batching, which then replaces messageHandler
+            std::function<void(WebSocket *, char *data, BatchedMessage *messages, size_t count)> messageBatchHandler;
+            // empty unless set, asked of every request Hub::listen takes for this group
+            std::function<int(HttpRequest &)> upgradeRequestHandler;
 
             unsigned int maxPayload;
+            size_t maxBackpressure = 0;
+            BackpressurePolicy backpressurePolicy = DROP_MESSAGE;
+            // of setInboundLimit, a window of 0 ms is no limit
+            unsigned int inboundMaxMessages = 0;
+            size_t inboundMaxBytes = 0, inboundDropped = 0;
+            int inboundWindowMs = 0;
+            BackpressurePolicy inboundPolicy = DROP_MESSAGE;
+            // of setFragmentSize, 0 sends every message as one frame
+            size_t fragmentSize = 0;
             Hub *hub;
             int extensionOptions;
-            std::stack<uS::Poll *> iterators;
+            // whether sends may be compressed at all, see NO_OUTBOUND_COMPRESSION
+            bool deflatesOutbound() const {
+                return (extensionOptions & (PERMESSAGE_DEFLATE | NO_OUTBOUND_COMPRESSION)) == PERMESSAGE_DEFLATE;
+            }
+            // of every sliding deflate window, what zlib keeps per socket is about 2^(windowBits + 2) + 2^(memLevel + 9) bytes
+            int deflateWindowBits = 15;
+            // sockets that negotiated a sliding deflate window, whether allocated yet or not, and how many may
+            // at once, 0 for any number. See setMaxDeflateWindows
+            unsigned int deflateWindowSockets = 0, maxDeflateWindows = 0;
+            // the shared compressors are brought to these before deflating for this group
+            CompressionSettings compressionSettings;
+            uS::Timer *deflateWindowTimer = nullptr;
+            // of the inflate window of each socket whose client keeps its context, reserved from
+            // inflateMemoryBudget for the life of the socket. 0 bits means no client may keep it
+            int inflateWindowBits = 0;
+            size_t inflateMemoryBudget = 0, inflateMemoryUsed = 0;
+            // of setDeflateDictionary, the id is the hex adler32 of the dictionary as zlib's FDICT has it
+            std::string deflateDictionary, deflateDictionaryId;
+            // what zlib keeps per window, about 2^windowBits + 7 KB
+            static size_t inflateWindowMemory(int windowBits) {
+                return ((size_t) 1 << windowBits) + 7168;
+            }
+            // and per deflate, about 2^(windowBits + 2) + 2^(memLevel + 9) + 6 KB
+            static size_t deflateWindowMemory(int windowBits, int memLevel) {
+                return ((size_t) 1 << (windowBits + 2)) + ((size_t) 1 << (memLevel + 9)) + 6144;
+            }
+            // of getMemoryStats, the messages are counted by uS::NodeData::messageMemory
+            size_t fragmentMemory = 0, compressionMemory = 0;
+            // of setReassemblyBudget, fragmentMemory may not grow past it. 0 is no budget
+            size_t reassemblyBudget = 0;
+            // of setReadBackpressure, 0 never pauses
+            size_t readBackpressure = 0;
+            // of setZeroCopyReceive, 0 is off
+            size_t zeroCopyReceive = 0;
+
+            // shorter sends go out uncompressed, and adaptively also those of an opcode whose recent
+            // messages did not shrink. Ratios are compressed to uncompressed in 1/1024ths
+            size_t compressionThreshold = 0;
+            bool adaptiveCompression = false;
+            struct CompressionStats {
+                unsigned int ratio = 0, skipped = 0;
+            } compressionStats[2];
+            bool shouldCompress(OpCode opCode, size_t length);
+            void recordCompression(OpCode opCode, size_t length, size_t compressedLength);
+            uint64_t rttHistogram[RTT_BUCKETS] = {};
+            void recordRtt(uint32_t microseconds);
+            // the Metrics past uS::NodeData::COUNTERS, the ones before are left unused
+            uint64_t metrics[METRICS] = {};
+            // the one of five consecutive metrics from first on, in the order TEXT, BINARY, CLOSE, PING, PONG
+            static int opCodeMetric(int opCode, Metric first) {
+                return first + (opCode < 3 ? opCode - 1 : opCode - 6);
+            }
+            // uv_hrtime on the loop thread while latencies are timed, else 0 which recordLatency leaves be
+            bool timingLatencies = false;
+            uint64_t latencyClock() const {
+                return timingLatencies && tid == pthread_self() ? uv_hrtime() : 0;
+            }
+            void recordLatency(Latency latency, uint64_t startedAt) {
+                if (startedAt) {
+                    uS::NodeData::recordLatency(&metrics[LATENCY_HISTOGRAMS + latency * LATENCY_BUCKETS], uv_hrtime() - startedAt);
+                }
+            }
+            // of the read being consumed, for HANDLER_LATENCY
+            uint64_t readStartedAt = 0;
+            // of setCpuAccounting. Spans nest, a read's handlers within it and compression within those, and each
+            // is charged its time less that of the spans within it. cpuCharged only ever grows by what was charged
+            bool accountingCpu = false;
+            uint64_t cpuCharged = 0;
+            struct CpuSpan {
+                uint64_t startedAt, chargedAt;
+            };
+            CpuSpan startCpu() const {
+                return accountingCpu && tid == pthread_self() ? CpuSpan {uv_hrtime(), cpuCharged} : CpuSpan {0, 0};
+            }
+            // returns the whole time of the span, nested ones included
+            uint64_t chargeCpu(Metric metric, const CpuSpan &span) {
+                if (!span.startedAt) {
+                    return 0;
+                }
+                uint64_t spent = uv_hrtime() - span.startedAt;
+                metrics[metric] += spent - (cpuCharged - span.chargedAt);
+                cpuCharged = span.chargedAt + spent;
+                return spent;
+            }
+            std::vector<SocketCost> topSockets;
+            unsigned int topSocketsCapacity = 0, cpuSampling = 1, cpuSamples = 0;
+            void sampleSocketCost(WebSocket *webSocket, uint64_t nanoseconds);
+            // sends counted by setAdaptiveNoDelay, about what fits in a segment along with others
+            static const size_t SMALL_SEND = 1024;
+            // a message, or with NONE a further frame of one, a socket sends length bytes of payload of
+            void countSend(WebSocket *webSocket, OpCode opCode, size_t length, bool compressed) {
+                webSocket->smallSends += length < SMALL_SEND && webSocket->smallSends != UINT16_MAX;
+                metrics[BYTES_OUT] += length;
+                if (opCode != NONE) {
+                    metrics[opCodeMetric(opCode, TEXT_SENDS)]++;
+                    if (opCode < 3) {
+                        metrics[compressed ? COMPRESSED_SENDS : UNCOMPRESSED_SENDS]++;
+                    }
+                }
+            }
+            // 101 responses as WebSocket::upgrade writes them, by negotiated extensions and subprotocol, with the
+            // accept key left to patch in at UPGRADE_ACCEPT_OFFSET. Only a few are kept, subprotocols are whatever
+            // clients ask for, and the oldest makes room
+            struct UpgradeResponse {
+                std::string extensions, subprotocol, response;
+            };
+            std::vector<UpgradeResponse> upgradeResponses;
+            static const size_t MAX_UPGRADE_RESPONSES = 16, UPGRADE_ACCEPT_OFFSET = 97;
+            const std::string &getUpgradeResponse(std::string_view extensions, std::string_view subprotocol);
+            // every socket of the group, densely for forEach, a WebSocket's tableIndex its place. A socket
+            // leaving while the table is iterated or drained leaves a nullptr instead of having the last
+            // one moved into its place, the holes are closed once neither is under way
+            std::vector<WebSocket *> table;
+            int iterating = 0;
+            size_t tableHoles = 0;
+            // what sending touches of a socket, loaded for the one PREFETCH_DISTANCE places ahead of forEach
+            // and forEachSubscriber so that the walk does not wait on a cache miss per socket
+            static const size_t PREFETCH_DISTANCE = 8;
+            static void prefetch(WebSocket *webSocket) {
+                if (webSocket) {
+                    UWS_PREFETCH(webSocket);
+                    UWS_PREFETCH(&webSocket->messageQueue);
+                    UWS_PREFETCH(&webSocket->compressionStatus);
+                }
+            }
+            // broadcasts to more sockets than this queue first and write at the end of the loop iteration,
+            // one pass touching memory only and one making the syscalls back to back
+            static const size_t DEFERRED_BROADCAST_SOCKETS = 1024;
+            void compactTable();
+            // of getId: the low 32 bits are the handle, the high ones its generation, counted up when the
+            // handle is given back so that an old id finds nothing
+            struct Handle {
+                WebSocket *webSocket;
+                uint32_t generation;
+            };
+            std::vector<Handle> handles;
+            std::vector<uint32_t> freeHandles;
+
+            // messages answered here instead of delivered, see setAutoReply. Few and short, so a list
+            struct AutoReply {
+                std::string message, reply;
+            };
+            std::vector<AutoReply> autoReplies;
+            size_t autoReplyMaxLength = 0;
+            bool autoReply(WebSocket *webSocket, const char *message, size_t length, OpCode opCode);
+
+            // of drain. Sockets of the table from drainCursor to drainEnd were not asked to close yet, those
+            // asked while they still had messages queued close from WebSocket::onDrain. A drained group takes
+            // no more upgrades
+            static const int DRAIN_TICK_MS = 10;
+            bool draining = false;
+            uS::Timer *drainTimer = nullptr;
+            size_t drainCursor = 0, drainEnd = 0;
+            size_t drainTotal = 0, drainAsked = 0, drainRemaining = 0, drainReported = 0;
+            int drainTickMs = 0, drainTicks = 0, drainSpreadMs = 0, drainDeadlineMs = 0;
+            std::function<void(size_t remaining)> drainProgressHandler;
+            static void continueDrain(uS::Timer *timer);
+            void stopDrain();
+
+            // of setAdmission. The bucket holds up to admissionBurst upgrades and refills by admissionRate a
+            // second, sockets per peer are counted by raw address only while maxPerAddress is set
+            unsigned int admissionRate = 0, admissionBurst = 0, maxPerAddress = 0;
+            size_t maxConnections = 0, connections = 0;
+            double admissionTokens = 0;
+            uint64_t admissionRefilled = 0;
+            std::unordered_map<std::string, unsigned int> connectionsPerAddress;
+            bool admit(uv_os_sock_t fd, WebSocket::PeerAddress &peerAddress);
+            static std::string addressKey(const WebSocket::PeerAddress &peerAddress) {
+                return std::string((const char *) peerAddress.ip, peerAddress.family == 4 ? 4 : (peerAddress.family == 6 ? 16 : 0));
+            }
+            void countAddress(WebSocket *webSocket, int change);
 
             // todo: cannot be named user, collides with parent!
             void *userData = nullptr;
 
-            WebSocket *webSocketHead = nullptr;
+            std::unordered_map<std::string, Topic *> topics;
+            // the wildcard topics by level, and for each topic published to the wildcard ones it reaches, all of
+            // which is dropped when one comes or goes. Null and empty while none is subscribed to
+            TopicTree *topicTree = nullptr;
+            std::unordered_map<std::string, std::vector<Topic *>> patternMatches;
+            static const size_t MAX_PATTERN_MATCHES = 64 * 1024;
+            // told of every topic made (1) and erased (-1), like the SharedBus this group is attached to. A null
+            // topic stands for all of them, while last values are kept
+            std::function<void(Topic *topic, int change)> topicObserver;
+            bool lastValues = false;
+            void keepLastValue(Topic *topic, WebSocket::PreparedMessage *preparedMessage);
 
             void addWebSocket(WebSocket *webSocket);
-            void removeWebSocket(WebSocket *webSocket);
+            // closing lets topics drop webSocket lazily, a socket moving to another group leaves them right away
+            void removeWebSocket(WebSocket *webSocket, bool closing = true);
+            // moves what webSocket holds from the memory counters of this group (sign -1) or into them (1)
+            void countHeld(WebSocket *webSocket, const MemoryStats &memory, int sign);
+            void unsubscribeAll(WebSocket *webSocket, bool closing = true);
+            Topic *findTopic(const std::string &name);
+            Topic *createTopic(const char *topic, size_t topicLength);
+            void eraseTopic(Topic *topic);
+            // null when no wildcard topic matches name
+            const std::vector<Topic *> *matchPatterns(const std::string &name);
+            void gatherReceivers(Topic *topic, const std::vector<Topic *> &patterns, std::vector<WebSocket *> &receivers);
+            void removeSubscriber(Topic *topic, WebSocket *webSocket);
+            void settle(Topic *topic);
+            void sendPrepared(WebSocket *webSocket, const char *message, size_t length, OpCode opCode, bool compress, WebSocket::PreparedMessage *preparedMessages[2], bool defer, uint32_t conflationKey = 0, unsigned int ttlMs = 0);
+            bool selectRooms(const RoomSelection &selection, std::vector<WebSocket *> &receivers);
+            static void releaseIdleDeflateWindows(uS::Timer *timer);
+
+            // of setHeartbeat, a list of sockets per tick through their heartbeatNext. Slots cover the
+            // longest a socket waits, so each comes up exactly once and the timer never walks the group
+            std::vector<WebSocket *> heartbeatWheel;
+            size_t heartbeatTick = 0;
+            int heartbeatIntervalTicks = 0, heartbeatTimeoutTicks = 0;
+            uS::Timer *heartbeatTimer = nullptr;
+            void scheduleHeartbeat(WebSocket *webSocket, int ticks);
+            void unscheduleHeartbeat(WebSocket *webSocket);
+            static void checkHeartbeats(uS::Timer *timer);
+
+            // of WebSocket::setIdleTimeout, seconds since the first idle timeout and a list of sockets
+            // per second to look at. Longer timeouts go round the wheel more than once
+            static const int IDLE_WHEEL_SLOTS = 64;
+            std::vector<WebSocket *> idleWheel;
+            unsigned int idleClock = 0;
+            uS::Timer *idleTimer = nullptr;
+            void scheduleIdle(WebSocket *webSocket, unsigned int seconds);
+            void unscheduleIdle(WebSocket *webSocket);
+            static void checkIdle(uS::Timer *timer);
+
+            // of setSlowConsumer, swept by the timer. A socket's WebSocket::slowConsumer has a bit per
+            // threshold it is over, cleared when it goes below
+            std::function<void(WebSocket *, size_t bytes, unsigned int ageMs)> slowConsumerHandler = [](WebSocket *, size_t, unsigned int) {};
+            size_t slowConsumerBytes = 0;
+            unsigned int slowConsumerAgeMs = 0;
+            uS::Timer *slowConsumerTimer = nullptr;
+            static void checkSlowConsumers(uS::Timer *timer);
+            void clearSlowConsumer(WebSocket *webSocket);
+            // of setBacklogCompression, swept by the timer
+            size_t backlogCompressionBytes = 0;
+            uS::Timer *backlogTimer = nullptr;
+            static void compressBacklogs(uS::Timer *timer);
+            // of setRateLimit, the buckets are those of uS::NodeData::rateLimit
+            static const int RATE_LIMIT_TICK_MS = 10;
+            uS::Timer *rateLimitTimer = nullptr;
+            static void refillRateLimit(uS::Timer *timer);
+            // of setNoDelay and setAdaptiveNoDelay
+            bool noDelay = true;
+            unsigned int noDelaySendRate = 0;
+            uS::Timer *noDelayTimer = nullptr;
+            static void adaptNoDelay(uS::Timer *timer);
+            // of setTcpInfoSampling and setCompressionMinRtt
+            uS::Timer *tcpInfoTimer = nullptr;
+            static void sampleTcpInfo(uS::Timer *timer);
+            unsigned int compressionMinRtt = 0;
+
+            // of setSessions, defined in Group.cpp. Sends look up their socket's session only while it is on
+            struct Sessions;
+            Sessions *sessions = nullptr;
+            void recordSession(WebSocket *webSocket, WebSocket::PreparedMessage *preparedMessage);
+            void recordSession(WebSocket *webSocket, const char *message, size_t length, OpCode opCode);
+            void detachSession(WebSocket *webSocket);
+            static void expireSessions(uS::Timer *timer);
+
+            // of startRecording: the log, how many sockets were considered for it and given an id in it, and
+            // the uv_hrtime in microseconds of its last record
+            FILE *recording = nullptr;
+            unsigned int recordSampling = 1;
+            uint32_t recordSeen = 0, recordIds = 0;
+            uint64_t recordLastAt = 0;
+            void sampleRecording(WebSocket *webSocket);
+            void writeRecord(uint32_t id, unsigned char flags, const char *data, size_t length);
+            void record(WebSocket *webSocket, const char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin);
+
+            // walking backwards keeps the index valid when a send terminates (and unsubscribes) its socket
+            template <class F>
+                void forEachSubscriber(Topic *topic, const F &cb) {
+                    topic->publishing = true;
+                    for (size_t i = topic->subscribers.size(); i--; ) {
+                        if (i >= PREFETCH_DISTANCE && i - PREFETCH_DISTANCE < topic->subscribers.size()) {
+                            prefetch(topic->subscribers[i - PREFETCH_DISTANCE]);
+                        }
+                        // closed ones are still allocated until the end of the iteration
+                        if (i < topic->subscribers.size() && !topic->subscribers[i]->isClosed()) {
+                            cb(topic->subscribers[i]);
+                        }
+                    }
+                    topic->publishing = false;
+
+                    settle(topic);
+                    if (topic->subscribers.empty() && !topic->lastValue) {
+                        eraseTopic(topic);
+                    }
+                }
+
+            // the subscribers of topic, which may be null, and of the wildcard topics matching it, each once. Those
+            // of several are merged into a snapshot first, which sockets closing while it is sent to stay in
+            template <class F>
+                void forEachReceiver(Topic *topic, const std::vector<Topic *> &patterns, const F &cb) {
+                    if (!topic && patterns.size() == 1) {
+                        forEachSubscriber(patterns[0], cb);
+                        return;
+                    }
+                    std::vector<WebSocket *> receivers;
+                    gatherReceivers(topic, patterns, receivers);
+                    for (WebSocket *ws : receivers) {
+                        if (!ws->isClosed()) {
+                            cb(ws);
+                        }
+                    }
+                }
 
-            Group(int extensionOptions, unsigned int maxPayload, Hub *hub, uS::NodeData *nodeData);
+            Group(int extensionOptions, unsigned int maxPayload, Hub *hub, uS::NodeData *nodeData, const CompressionSettings &compressionSettings = CompressionSettings());
 
         public:
             void onConnection(const std::function<void(WebSocket *)> &handler);
             void onMessage(const std::function<void(WebSocket *, char *, size_t, OpCode)> &handler);
             void onDisconnection(const std::function<void(WebSocket *, int code, char *message, size_t length)> &handler);
+            void onDrain(const std::function<void(WebSocket *)> &handler);
+            void onError(const std::function<void(void *)> &handler);
+            // see setSlowConsumer
+            void onSlowConsumer(const std::function<void(WebSocket *, size_t bytes, unsigned int ageMs)> &handler);
+
+            // delivers messages piece by piece as they arrive instead of reassembled. remainingBytes
+            // is what is left of the current frame, fin marks the last piece of the message.
+            // Compressed messages still arrive inflated, as one piece
+            void onMessageChunk(const std::function<void(WebSocket *, char *, size_t, size_t, bool, OpCode)> &handler);
+
+            // delivers every message completed by one read in a single call, copied back to back
+            // into one buffer. Comes before any disconnection of the socket. Streaming takes precedence
+            void onMessageBatch(const std::function<void(WebSocket *, char *, BatchedMessage *, size_t)> &handler);
+
+            // decides on upgrade requests Hub::listen takes for this group once they passed admission: 0 lets one in,
+            // anything else is the HTTP status it is turned away with, like 401. Not asked by Hub::upgrade, whose
+            // caller has seen the request already
+            void onUpgradeRequest(const std::function<int(HttpRequest &)> &handler);
+
+            // 0 means no limit
+            void setMaxBackpressure(size_t maxBackpressure, BackpressurePolicy policy = DROP_MESSAGE);
+
+            // plain sends of TEXT or BINARY messages longer than bytes go out as frames of at most bytes of payload,
+            // which pings and pongs can come between since those are queued ahead of data. Compressed, conflated,
+            // prepared and referenced sends stay in one frame. 0 turns it off
+            void setFragmentSize(size_t bytes);
+
+            // frames of at most a quarter of bytes sent to a socket that already has a queue are copied back to back
+            // into chunks of bytes (1 KB - 64 KB) instead of each getting a queued message, and drain in as many
+            // pieces as there are chunks. For many small messages to slow clients, at the cost of holding a whole
+            // chunk once anything queues. Sends with a callback or conflation key queue as usual. 0 turns it off
+            void setSendChunkSize(size_t bytes);
+
+            // sockets upgraded from here on have TCP_NOTSENT_LOWAT of bytes, and a drain of their queue writes at
+            // most bytes each time the kernel reports writable. So a slow client has about bytes waiting in the
+            // kernel and the rest queued, where conflation and the backpressure policy still get to it, instead
+            // of seconds of it in a large send buffer. User space TLS drains unpaced. 0 turns it off
+            void setNotSentLowat(unsigned int bytes);
+
+            // the class the sockets of this group are served in. Deferred writes of QOS_REALTIME groups go first in
+            // each pass and those of QOS_BULK ones last, which also share Node::setBulkShare for their queues and read
+            // once per readable event whatever the read budget. Readiness itself comes in the kernel's order. So a
+            // bulk export does not hold up interactive or realtime clients of the same loop. QOS_INTERACTIVE by default
+            void setQos(uS::NodeData::Qos qos);
+
+            // caps what each socket writes at bytesPerSecond (at least 100), with bursts of up to burst bytes, a tenth
+            // of a second's worth when 0. What goes over waits in its queue, where conflation, expiry and the slow
+            // consumer checks still get to it, and is topped up every 10 ms. Every send is deferred to the end of
+            // the iteration meanwhile. User space TLS drains unlimited. 0 turns it off
+            void setRateLimit(size_t bytesPerSecond, size_t burst = 0);
+
+            // TCP_NODELAY of sockets upgraded from here on, on by default. Off the kernel holds small writes back
+            // while earlier ones are unacked and sends them as one segment (Nagle)
+            void setNoDelay(bool enable);
+
+            // once a second, sockets that made at least sendsPerSecond small sends (under 1 KB) since the last time
+            // turn TCP_NODELAY off so that the kernel coalesces their bursts, the others go back to setNoDelay. One
+            // setsockopt per switch. Sockets given their own by WebSocket::setNoDelay are left be. 0 turns it off
+            void setAdaptiveNoDelay(unsigned int sendsPerSecond);
+
+            // at most maxMessages data messages and maxBytes of them (0 is any) per socket every windowMs. Past
+            // that messages are dropped, and counted in getInboundDropped, or with CLOSE_SOCKET the socket is
+            // closed with 1008. Streamed messages are only ever closed for, and so are compressed ones whose
+            // client keeps its context, which a dropped message would break. 0 ms turns it off
+            void setInboundLimit(unsigned int maxMessages, size_t maxBytes, int windowMs, BackpressurePolicy policy = DROP_MESSAGE);
+            size_t getInboundDropped() {
+                return inboundDropped;
+            }
+
+            // caps the memory all sockets of this group together hold for reassembling fragmented or partly received
+            // messages, which maxPayload only limits per socket. A socket whose buffer would grow the total past bytes
+            // makes room by closing those holding more than it would with 1009, and is closed itself once it holds
+            // the most. Control frames are not counted. 0 is no budget
+            void setReassemblyBudget(size_t bytes);
+
+            // reading from a socket pauses once what it read leaves more than bytes queued to send to it, under
+            // backpressure, and resumes when the queue has drained. For echoes and the like that answer what they
+            // read; a proxy pauses the reading side itself, see WebSocket::pauseReading. 0 turns it off
+            void setReadBackpressure(size_t bytes);
+
+            // while streaming, frames with at least bytes left to arrive reach onMessageChunk as pages mapped from the
+            // kernel's receive queue (TCP_ZEROCOPY_RECEIVE, Linux) instead of copied by recv. Those pieces are read
+            // only. For the ClientWebSocket of a big download without TLS or compression: servers have to unmask what
+            // they read, in place, so theirs are always copied. Pays only where the NIC splits headers off and payload
+            // lands page aligned, on loopback nothing maps and reads just get shorter. 0 turns it off
+            void setZeroCopyReceive(size_t bytes);
+
+            // what is held for the sockets of this group right now, from counters kept along as memory is taken and
+            // given back. Not thread safe
+            MemoryStats getMemoryStats() const;
+
+            // caps the window of each socket's sliding deflate window and sets the memory level of all
+            // compressors of this group, for example 10 and 4 takes a window from about 256 KB down to
+            // 12 KB. Clients may ask for a smaller window still. Windows allocated after the call are
+            // affected, windowBits is clamped to 9 - 15 and memLevel to 1 - 9
+            void setDeflateWindow(int windowBits, int memLevel);
+
+            // at most maxWindows sockets of a SLIDING_DEFLATE_WINDOW group negotiate a window at once, further
+            // clients get the shared compressor, as a group without them would, until sockets with one leave. Bounds
+            // what a spike of connections costs in zlib memory, see setDeflateWindow. 0 is no limit
+            void setMaxDeflateWindows(unsigned int maxWindows);
+
+            // for sends that mostly go uncompressed: a socket found holding more than bytes queued has the messages
+            // no write started on yet deflated on the threadpool, each text or binary frame of at least 64 bytes that
+            // shrinks goes out compressed. Only server sockets that negotiated permessage-deflate without a sliding
+            // window or preset dictionary, whose frames deflate on their own. Checked by a sweep of the group every
+            // 100 ms, 0 turns it off
+            void setBacklogCompression(size_t bytes);
+
+            // lets clients keep their compression context across messages, giving each such socket an
+            // inflate window of its own of at most windowBits (clamped to 9 - 15, 10 takes about 8 KB).
+            // Once those windows would add up to more than memoryBudget bytes, further clients reset per
+            // message as by default. Affects sockets connected after the call, 0 turns it off again
+            void setInflateWindow(int windowBits, size_t memoryBudget);
+
+            // sends of fewer than threshold bytes are not compressed even when asked to be. Adaptive also
+            // skips deflating TEXT or BINARY while their recent messages barely shrank, still trying
+            // one in a while to notice when they start to. Output that did not shrink always goes out as is
+            void setCompressionThreshold(size_t threshold, bool adaptive = false);
+
+            // releases the sliding deflate window of sockets that sent nothing compressed for between
+            // one and two times this many seconds, their next compressed send starts over with a new
+            // one. For groups of mostly idle subscribers. 0 keeps windows for the life of the socket
+            void setDeflateWindowIdleTimeout(int seconds);
+
+            // primes the deflate and inflate of every message with dictionary on links to native uWS peers whose
+            // group has the same one, for small messages of a fixed schema that barely compress on their own. Agreed
+            // as a private parameter of permessage-deflate with no context takeover on either side, anyone else gets
+            // plain permessage-deflate. Set it before connecting or listening, sockets keep what they negotiated, so
+            // it must stay the same for groups they transfer to. Such sockets are compressed on the loop and left
+            // out of the compressed cache, broadcasts reach them with the shared frames. Empty turns it off
+            void setDeflateDictionary(const char *dictionary, size_t length);
+
+            // pings each socket every intervalMs and terminates it abortively when nothing at all arrived within
+            // timeoutMs of the ping, from one timer of a granularity of an eighth of the shorter of the
+            // two. Sockets already connected get their first ping spread over one interval, 0 turns it off
+            void setHeartbeat(int intervalMs, int timeoutMs);
+
+            // turns upgrades away with a bare 503 before anything is allocated for them: past rate a second (in
+            // bursts of up to burst, 0 is rate), at maxConnections sockets in this group or at maxPerAddress
+            // sockets from one peer address. A limit of 0 is no limit
+            void setAdmission(unsigned int rate, unsigned int burst, size_t maxConnections, unsigned int maxPerAddress);
+
+            // a TEXT or BINARY message equal to message is answered with reply, in the same opcode, and never
+            // reaches a handler. For liveness traffic like engine.io's "2" ping and "3" pong; an empty reply just
+            // drops the message. Setting a message again replaces its reply
+            void setAutoReply(const char *message, size_t length, const char *reply, size_t replyLength);
+            void clearAutoReplies();
+
+            // ping to pong round trips of all sockets so far, see WebSocket::getRtt. Bucket i counts those of 2^i
+            // to 2^(i + 1) microseconds, the first also shorter and the last also longer ones. Not thread safe
+            const uint64_t *getRttHistogram() const {
+                return rttHistogram;
+            }
+
+            // copies the METRICS counters of this group into metrics, indexed by Metric. All of them count up from
+            // the group's creation but QUEUEING_SOCKETS, which is the sockets with send messages allocated right
+            // now. Sends and deflates of other threads are counted once on the loop, if at all. Not thread safe
+            void getMetrics(uint64_t *metrics) const;
+
+            // calls the slow consumer handler for each socket that came to hold more than bytes queued to send, or
+            // whose oldest queued message is older than ageMs, with what it holds and how old that is. Once per
+            // crossing, a socket is reported again only after it got back below both. Checked by a sweep of the
+            // group every ageMs / 2 (at least 10 ms), 100 ms without an age; a threshold of 0 is none, both 0
+            // turn it off. The handler may close, terminate or send to the socket
+            void setSlowConsumer(size_t bytes, unsigned int ageMs);
+
+            // reads TCP_INFO every intervalMs for each socket with messages queued, and once for each of the others,
+            // see WebSocket::getTcpInfo. Linux only, elsewhere and with 0 nothing is sampled
+            void setTcpInfoSampling(unsigned int intervalMs);
+
+            // sends asking for compression go uncompressed to sockets whose sampled rtt is below micros, peers on the
+            // LAN where deflating costs more CPU than it saves time on the wire. Those not sampled yet and farther ones
+            // compress as before. Broadcasts and publishes, prepared once for all, are left be. 0 turns it off
+            void setCompressionMinRtt(unsigned int micros);
+
+            // times the loop's work for this group into CPU_PARSE, CPU_HANDLERS, CPU_COMPRESSION and CPU_FLUSH of
+            // getMetrics, in nanoseconds and each without the others: reads taken apart, handlers called, deflates and
+            // inflates on the loop and queued sends written out. With topSockets, every sampling-th read of a socket
+            // goes into a space-saving sketch of that many sockets, scaled by sampling, for getTopSockets. One for a
+            // group of many tenants that has to tell which costs the loop. Off by default, then nothing is timed
+            void setCpuAccounting(bool enabled, unsigned int topSockets = 0, unsigned int sampling = 16);
+            // the sockets costing the most reads, costliest first. Sockets leave it as they close
+            std::vector<SocketCost> getTopSockets() const;
+
+            // keeps the latency histograms of getMetrics, in log2 buckets of nanoseconds from two uv_hrtime
+            // calls each: HANDLER_LATENCY from the read to the message handler returning, for each message of
+            // it; QUEUE_LATENCY, to the microsecond, from a send allocating its message to the last of it written;
+            // DEFLATE_TIME and INFLATE_TIME per call on the loop and UPGRADE_TIME from answering an upgrade to
+            // the connection handler returning. Off by default, then nothing is timed
+            void setLatencyHistograms(bool enabled);
+
+            // the log starts with RECORD_MAGIC. Each record has the opcode of a piece of a frame in its flags, with
+            // these bits for the rest, or else RECORD_OPEN or RECORD_CLOSE
+            static constexpr const char *RECORD_MAGIC = "uwsrec1\n";
+            enum RecordFlags : unsigned char {
+                RECORD_FIN = 16,
+                RECORD_FRAME_END = 32,
+                RECORD_COMPRESSED = 64,
+                RECORD_EVENT = 128,
+                RECORD_OPEN = RECORD_EVENT | 1,
+                RECORD_CLOSE = RECORD_EVENT | 2
+            };
+
+            // writes what clients send to a log at path, for benchmarks/replay.cpp to play back against a hub:
+            // every piece of a frame as it is unmasked, before anything is inflated, reassembled or delivered,
+            // with when it came and from which socket, and when that socket opened and closed. Every sampling-th
+            // socket is recorded, whole: from its upgrade, or from the end of its current message if it was
+            // connected already. False if path cannot be opened. Blocking writes on the loop, so for capturing
+            // a while, not for always. Not thread safe
+            bool startRecording(const char *path, unsigned int sampling = 1);
+            // flushes and closes the log. close leaves it open, for the closes to come
+            void stopRecording();
+
+            // keeps the last ringSize data messages sent to each socket given a session by openSession, and those
+            // broadcast while it is away, for a client that reconnects to pick up where it left off with
+            // resumeSession. A session whose socket closed is dropped after expirySeconds. 0 turns it off and
+            // drops all sessions. Not thread safe
+            void setSessions(size_t ringSize, unsigned int expirySeconds);
+
+            // a random id, never 0, for the client to resume with; the one it has if webSocket has a session
+            // already. From here on the data messages of WebSocket::send and sendPrepared (which broadcasts and
+            // publishes go through) are numbered from 1 and kept. A client counts the ones it received to know
+            // where it left off, so refused sends, fragmented, streamed and batched ones make it miss the count.
+            // 0 with sessions off. Not thread safe
+            uint64_t openSession(WebSocket *webSocket);
+
+            // attaches the session to webSocket, in place of the one it has, and sends it every message after
+            // lastSequence that was kept, the ones with a callback without callbackData. A socket still attached
+            // to it keeps its connection but no longer its session. False, with nothing sent or attached, if the
+            // session expired or its messages no longer go back to lastSequence. Not thread safe
+            bool resumeSession(WebSocket *webSocket, uint64_t id, uint64_t lastSequence);
 
             // Thread safe
             void setUserData(void *user);
             void *getUserData();
 
-            // Not thread safe
+            // frames once, and with compress also deflates once, for sending to any socket of this group.
+            // Other threads deflate with a compressor of their own, see Hub::deflateOnThread
+            WebSocket::PreparedMessage *prepareMessage(const char *message, size_t length, OpCode opCode, bool compress = false, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved) = nullptr);
+
+            // Thread safe. conflationKey and ttlMs are as for WebSocket::send. To more than DEFERRED_BROADCAST_SOCKETS
+            // sockets the writes go out at the end of the loop iteration, as with LoopOptions' deferral
+            void broadcast(const char *message, size_t length, OpCode opCode, bool compress = false, uint32_t conflationKey = 0, unsigned int ttlMs = 0);
+            void broadcast(WebSocket::PreparedMessage *preparedMessage, uint32_t conflationKey = 0, unsigned int ttlMs = 0);
+            // a message of WebSocket::prepareFile to every socket. Not thread safe
+            void broadcast(WebSocket::FileMessage *fileMessage);
+
+            // Not thread safe. Levels of a topic are separated by '/', and a subscription may use MQTT's wildcards
+            // as levels of their own: '+' stands for any one level, '#' as the last for any number of them, none
+            // included. Neither matches a first level starting with '$'. A publish looks the wildcard topics it
+            // reaches up by a hash of its topic, walking them by level only the first time
+            void subscribe(WebSocket *webSocket, const char *topic, size_t topicLength);
+            void unsubscribe(WebSocket *webSocket, const char *topic, size_t topicLength);
+            void publish(const char *topic, size_t topicLength, const char *message, size_t length, OpCode opCode, bool compress = false, uint32_t conflationKey = 0, unsigned int ttlMs = 0);
+            void publishRooms(const RoomSelection &selection, const char *message, size_t length, OpCode opCode, bool compress = false);
+
+            // keeps the last data message published to each topic, even one nobody subscribes to, and sends it to
+            // every socket subscribing from then on, ahead of anything published after. One prepared message per
+            // topic, uncompressed for publishes of a message and as given for the prepared ones; publishRooms
+            // are not kept. Off drops them all. Not thread safe
+            void setLastValues(bool enabled);
+            // drops the last value of topic, for topics that are done with
+            void clearLastValue(const char *topic, size_t topicLength);
+
+            // same as above with a message from prepareMessage, which stays owned by the caller
+            void publish(const char *topic, size_t topicLength, WebSocket::PreparedMessage *preparedMessage, uint32_t conflationKey = 0, unsigned int ttlMs = 0);
+            void publishRooms(const RoomSelection &selection, WebSocket::PreparedMessage *preparedMessage);
+
+            // closes every socket with the same close frame, framed once and shared by all of them. Each still
+            // gets its disconnection handler. Not thread safe
             void close(int code = 1000, char *message = nullptr, size_t length = 0);
 
+            // moves webSocket of another group of the same hub into this one in place, say from a group of
+            // unauthenticated sockets to one of logged in ones. Its queue, parser state and the extensions
+            // negotiated at upgrade stay as they are, handlers, limits and timers of this group take over from
+            // the next event on. Topics are subscribed to again here, its id changes (see getId). False if the
+            // socket is closing or of another hub, see Hub::migrate for those. Not thread safe
+            bool adopt(WebSocket *webSocket);
+
+            // for shutting down without every client reconnecting at once: takes no more upgrades, new ones
+            // are closed with 1001 right after the handshake, and closes every socket with 1001 spread evenly
+            // over spreadMs. A socket with messages still queued closes once they are written. What is open
+            // after deadlineMs is terminated abortively. progress gets the sockets left after each step, 0 when done
+            void drain(int spreadMs, int deadlineMs, const std::function<void(size_t remaining)> &progress = nullptr);
+
+            // an id of webSocket that stays the same while it is in this group and that no other socket of
+            // it gets, unless 2^32 sockets came and went through the same handle, for getWebSocket. Not thread safe
+            uint64_t getId(WebSocket *webSocket) const;
+            // the socket of id, nullptr once it left the group. Not thread safe
+            WebSocket *getWebSocket(uint64_t id) const;
+
+            // calls cb with every socket in the group when it starts, one array walk. cb may close, terminate
+            // or move any socket, also from a nested forEach, none is skipped or called twice. Sockets added
+            // meanwhile are not called
             template <class F>
                 void forEach(const F &cb) {
-                    uS::Poll *iterator = webSocketHead;
-                    iterators.push(iterator);
-                    while (iterator) {
-                        uS::Poll *lastIterator = iterator;
-                        cb(static_cast<WebSocket *>(iterator));
-                        iterator = iterators.top();
-                        if (lastIterator == iterator) {
-                            iterator = ((uS::Socket *) iterator)->next;
-                            iterators.top() = iterator;
+                    iterating++;
+                    for (size_t i = 0, size = table.size(); i < size; i++) {
+                        if (i + PREFETCH_DISTANCE < table.size()) {
+                            prefetch(table[i + PREFETCH_DISTANCE]);
                         }
+                        if (WebSocket *webSocket = table[i]) {
+                            cb(webSocket);
+                        }
+                    }
+                    if (!--iterating && tableHoles && !drainTimer) {
+                        compactTable();
                     }
-                    iterators.pop();
                 }
 
+            // what the work of parallelForEach sends, kept per thread and sent on the loop thread once
+            // every socket was called, in the order each thread added it
+            struct ParallelBatch {
+                void send(WebSocket *webSocket, const char *message, size_t length, OpCode opCode);
+
+            private:
+                struct Send {
+                    uint32_t tableIndex;
+                    OpCode opCode;
+                    size_t offset, length;
+                };
+                std::vector<Send> sends;
+                std::string data;
+                friend struct Group;
+            };
+
+            // as forEach, with work called on up to threads threads at once, the loop's own one of them,
+            // which claim sockets in small runs until none are left. Returns once all were called and their
+            // batches sent. The loop is held meanwhile, so no socket leaves or is freed under work. work may
+            // read its socket and user data but not send, close or otherwise touch a socket or the group,
+            // that is for the batch
+            void parallelForEach(const std::function<void(WebSocket *webSocket, ParallelBatch &batch)> &work, unsigned int threads);
+
             static Group *from(uS::Socket *s) {
                 return static_cast<Group *>(s->getNodeData());
             }
     };
 }
 
+/*
+ * For C++ embedders whose handlers are known at compile time: UWS_STATIC_HANDLERS names a header of
+ * theirs, like -DUWS_STATIC_HANDLERS='"handlers.h"', defining
+ *
+ *   namespace uWS {
+ *       struct StaticHandlers {
+ *           static bool onConnection(WebSocket *webSocket);
+ *           static bool onMessage(WebSocket *webSocket, char *message, size_t length, OpCode opCode);
+ *           static bool onDisconnection(WebSocket *webSocket, int code, char *message, size_t length);
+ *       };
+ *   }
+ *
+ * inline, for every group. Each is called where the group's own std::function would be and returns
+ * whether it took the event, the group's handler gets those it did not. With that the message handler
+ * compiles into the delivery path of the parser instead of behind an indirect call. It sees all groups,
+ * Group::from tells them apart
+ *
+ */
+#ifdef UWS_STATIC_HANDLERS
+#include UWS_STATIC_HANDLERS
+#endif
+
+namespace uWS {
+    inline void Group::callConnection(WebSocket *webSocket) {
+        CpuSpan cpuSpan = startCpu();
+#ifdef UWS_STATIC_HANDLERS
+        if (StaticHandlers::onConnection(webSocket)) {
+            chargeCpu(CPU_HANDLERS, cpuSpan);
+            return;
+        }
+#endif
+        connectionHandler(webSocket);
+        chargeCpu(CPU_HANDLERS, cpuSpan);
+    }
+
+    inline void Group::callMessage(WebSocket *webSocket, char *message, size_t length, OpCode opCode) {
+#ifdef UWS_STATIC_HANDLERS
+        if (StaticHandlers::onMessage(webSocket, message, length, opCode)) {
+            return;
+        }
+#endif
+        messageHandler(webSocket, message, length, opCode);
+    }
+
+    inline void Group::callDisconnection(WebSocket *webSocket, int code, char *message, size_t length) {
+        CpuSpan cpuSpan = startCpu();
+#ifdef UWS_STATIC_HANDLERS
+        if (StaticHandlers::onDisconnection(webSocket, code, message, length)) {
+            chargeCpu(CPU_HANDLERS, cpuSpan);
+            return;
+        }
+#endif
+        disconnectionHandler(webSocket, code, message, length);
+        chargeCpu(CPU_HANDLERS, cpuSpan);
+    }
+}
+
 #endif // GROUP_UWS_H
@@ -0,0 +1,363 @@
+#include "HttpSocket.h"
+#include "Group.h"
+#include "Hub.h"
+#include <openssl/sha.h>
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+namespace uWS {
+    static void base64(const unsigned char *src, size_t length, char *dst) {
+        static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (size_t i = 0; i < length; i += 3) {
+            unsigned int triple = src[i] << 16 | (i + 1 < length ? src[i + 1] << 8 : 0) | (i + 2 < length ? src[i + 2] : 0);
+            *dst++ = b64[(triple >> 18) & 63];
+            *dst++ = b64[(triple >> 12) & 63];
+            *dst++ = i + 1 < length ? b64[(triple >> 6) & 63] : '=';
+            *dst++ = i + 2 < length ? b64[triple & 63] : '=';
+        }
+    }
+
+    static bool equalsIgnoreCase(HttpRequest::Value value, const char *other) {
+        size_t length = strlen(other);
+        if (value.length != length) {
+            return false;
+        }
+        for (size_t i = 0; i < length; i++) {
+            if (::tolower((unsigned char) value.data[i]) != ::tolower((unsigned char) other[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // 16 bytes in base64, so 22 characters of which the last holds only 2 bits, then "=="
+    static bool isValidKey(HttpRequest::Value key) {
+        static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        if (key.length != 24 || key.data[22] != '=' || key.data[23] != '=' || !memchr("AQgw", key.data[21], 4)) {
+            return false;
+        }
+        for (int i = 0; i < 21; i++) {
+            if (!key.data[i] || !strchr(b64, key.data[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    HttpRequest::Value HttpRequest::getUrl() const {
+        const char *lineEnd = (const char *) memchr(headers, '\r', length);
+        const char *start = (const char *) memchr(headers, ' ', lineEnd - headers);
+        if (!start) {
+            return {};
+        }
+        start++;
+        const char *end = (const char *) memchr(start, ' ', lineEnd - start);
+        return {start, (size_t) ((end ? end : lineEnd) - start)};
+    }
+
+    HttpRequest::Value HttpRequest::getHeader(const char *name) const {
+        size_t nameLength = strlen(name);
+        const char *end = headers + length;
+        for (const char *line = (const char *) memchr(headers, '\n', length); line && ++line < end; ) {
+            const char *lineEnd = (const char *) memchr(line, '\n', end - line);
+            if (!lineEnd) {
+                break;
+            }
+            if ((size_t) (lineEnd - line) > nameLength && line[nameLength] == ':' && equalsIgnoreCase({line, nameLength}, name)) {
+                const char *value = line + nameLength + 1, *valueEnd = lineEnd;
+                while (value < valueEnd && (*value == ' ' || *value == '\t')) {
+                    value++;
+                }
+                while (valueEnd > value && (valueEnd[-1] == '\r' || valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+                    valueEnd--;
+                }
+                return {value, (size_t) (valueEnd - value)};
+            }
+            line = lineEnd;
+        }
+        return {};
+    }
+
+    // finds the value of a header in a lower cased header block, which has the same offsets as the original
+    static bool findHeader(const std::string &headers, const char *name, size_t &offset, size_t &length) {
+        size_t start = headers.find(std::string("\r\n") + name + ":");
+        if (start == std::string::npos) {
+            return false;
+        }
+        start += strlen(name) + 3;
+        size_t end = headers.find("\r\n", start);
+        start = std::min(headers.find_first_not_of(" \t", start), end);
+        while (end > start && (headers[end - 1] == ' ' || headers[end - 1] == '\t')) {
+            end--;
+        }
+        offset = start;
+        length = end - start;
+        return true;
+    }
+
+    static std::string headerValue(const std::string &headers, const char *name) {
+        size_t offset, length;
+        if (!findHeader(headers, name, offset, length)) {
+            return "";
+        }
+        return headers.substr(offset, length);
+    }
+
+    // headers is either empty or complete lines, extensions may be null
+    void HttpSocket::upgradeRequest(const std::string &host, const std::string &path, const std::string &headers, const char *extensions) {
+        unsigned char nonce[16];
+        std::random_device randomDevice;
+        for (unsigned char &byte : nonce) {
+            byte = (unsigned char) randomDevice();
+        }
+        char secKey[24];
+        base64(nonce, 16, secKey);
+
+        unsigned char shaInput[] = "XXXXXXXXXXXXXXXXXXXXXXXX258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        memcpy(shaInput, secKey, 24);
+        unsigned char shaDigest[SHA_DIGEST_LENGTH];
+        SHA1(shaInput, sizeof(shaInput) - 1, shaDigest);
+        base64(shaDigest, SHA_DIGEST_LENGTH, expectedAccept);
+
+        httpBuffer = "GET " + path + " HTTP/1.1\r\n"
+                     "Host: " + host + "\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Key: " + std::string(secKey, 24) + "\r\n"
+                     "Sec-WebSocket-Version: 13\r\n";
+        if (extensions) {
+            httpBuffer += std::string("Sec-WebSocket-Extensions: ") + extensions + "\r\n";
+            offeredDeflate = true;
+        }
+        httpBuffer += headers + "\r\n";
+    }
+
+    void HttpSocket::startConnecting(uS::Loop *loop, int timeoutMs) {
+        setCb(onConnected);
+        start(this, setPoll(UV_WRITABLE));
+        if (timeoutMs > 0) {
+            timeout = new uS::Timer(loop);
+            timeout->setData(this);
+            timeout->start(onTimeout, timeoutMs, 0);
+        }
+    }
+
+    void HttpSocket::cancelTimeout() {
+        if (timeout) {
+            timeout->stop();
+            timeout->close();
+            timeout = nullptr;
+        }
+    }
+
+    void HttpSocket::onConnected(uS::Poll *p, int status, int events) {
+        HttpSocket *httpSocket = static_cast<HttpSocket *>(p);
+
+        int error = 0;
+        socklen_t errorLength = sizeof(error);
+        if (status < 0 || getsockopt(httpSocket->getFd(), SOL_SOCKET, SO_ERROR, (char *) &error, &errorLength) || error) {
+            onEnd(httpSocket);
+            return;
+        }
+
+        httpSocket->setNoDelay(true);
+        httpSocket->template setState<HttpSocket>();
+        httpSocket->change(httpSocket, httpSocket->setPoll(UV_READABLE));
+
+        // over TLS this is what starts the handshake, the request goes out once it is done
+        Queue::Message *messagePtr = httpSocket->allocMessage(httpSocket->httpBuffer.length(), httpSocket->httpBuffer.data());
+        httpSocket->httpBuffer.clear();
+        bool waiting;
+        if (!httpSocket->write(messagePtr, waiting)) {
+            httpSocket->freeMessage(messagePtr);
+            onEnd(httpSocket);
+        } else if (!waiting) {
+            httpSocket->freeMessage(messagePtr);
+        }
+    }
+
+    void HttpSocket::onTimeout(uS::Timer *timer) {
+        onEnd(static_cast<HttpSocket *>(timer->getData()));
+    }
+
+    /*
+     * Collects the response to the upgrade request and, once it accepted our key,
+     * replaces this socket with a ClientWebSocket that takes over the fd.
+     *
+     * Hints: Anything the server sent right behind the response is passed on to
+     * the new WebSocket. Returns the socket which is to be read from next.
+     *
+     */
+    uS::Socket *HttpSocket::onData(uS::Socket *s, char *data, size_t length) {
+        HttpSocket *httpSocket = static_cast<HttpSocket *>(s);
+
+        httpSocket->httpBuffer.append(data, length);
+        size_t headersLength = httpSocket->httpBuffer.find("\r\n\r\n");
+        if (headersLength == std::string::npos) {
+            if (httpSocket->httpBuffer.length() > MAX_HEADER_BUFFER_SIZE) {
+                onEnd(httpSocket);
+            }
+            return httpSocket;
+        }
+        headersLength += 4;
+
+        std::string headers = httpSocket->httpBuffer.substr(0, headersLength);
+        std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+        // the accept value is case sensitive, so it is compared in the original
+        size_t acceptOffset, acceptLength;
+        if (headers.compare(0, 13, "http/1.1 101 ") || headerValue(headers, "upgrade") != "websocket" ||
+                !findHeader(headers, "sec-websocket-accept", acceptOffset, acceptLength) ||
+                acceptLength != 28 || httpSocket->httpBuffer.compare(acceptOffset, 28, httpSocket->expectedAccept, 28)) {
+            onEnd(httpSocket);
+            return httpSocket;
+        }
+        Group *group = Group::from(httpSocket);
+        ExtensionsNegotiator extensionsNegotiator(httpSocket->offeredDeflate ? group->extensionOptions : 0, group->deflateWindowBits);
+        extensionsNegotiator.setDictionary(group->deflateDictionaryId);
+        extensionsNegotiator.readResponse(headerValue(headers, "sec-websocket-extensions"));
+        bool perMessageDeflate = extensionsNegotiator.getNegotiatedOptions() & PERMESSAGE_DEFLATE;
+        httpSocket->cancelTimeout();
+
+        ClientWebSocket *webSocket = new (group) ClientWebSocket(perMessageDeflate, httpSocket, extensionsNegotiator.getNegotiatedWindowBits());
+        webSocket->presetDictionary = extensionsNegotiator.getNegotiatedDictionary();
+        WebSocket::readPeerAddress(webSocket->getFd(), webSocket->peerAddress);
+        webSocket->adoptKernelTls();
+        webSocket->template setState<ClientWebSocket>();
+        webSocket->change(webSocket, webSocket->setPoll(UV_READABLE));
+        uS::NodeData::clearPendingPollChanges(webSocket);
+
+        // at most what came with this read, so it fits the receive buffer it came in
+        size_t remainingLength = httpSocket->httpBuffer.length() - headersLength;
+        memcpy(webSocket->nodeData->recvBuffer->data, httpSocket->httpBuffer.data() + headersLength, remainingLength);
+        httpSocket->retire<HttpSocket>();
+
+        group->addWebSocket(webSocket);
+        group->callConnection(webSocket);
+        if (remainingLength && !webSocket->isClosed() && !webSocket->isShuttingDown()) {
+            ClientWebSocket::onData(webSocket, webSocket->nodeData->recvBuffer->data, remainingLength);
+        }
+        return webSocket;
+    }
+
+    void HttpSocket::onEnd(uS::Socket *s) {
+        HttpSocket *httpSocket = static_cast<HttpSocket *>(s);
+        Group *group = Group::from(httpSocket);
+        void *user = httpSocket->getUserData();
+
+        httpSocket->cancelTimeout();
+        httpSocket->template closeSocket<HttpSocket>();
+        while (!httpSocket->messageQueue.empty()) {
+            httpSocket->popMessage();
+        }
+        uS::NodeData::clearPendingPollChanges(httpSocket);
+
+        group->errorHandler(user);
+    }
+
+    HttpServerSocket::HttpServerSocket(uS::Socket *socket, uS::Loop *loop) : uS::Socket(std::move(*socket)) {
+        timeout = new uS::Timer(loop);
+        timeout->setData(this);
+        timeout->start(onTimeout, HANDSHAKE_TIMEOUT_MS, 0);
+    }
+
+    void HttpServerSocket::onTimeout(uS::Timer *timer) {
+        onEnd(static_cast<HttpServerSocket *>(timer->getData()));
+    }
+
+    /*
+     * Collects an upgrade request and answers it like Hub::upgrade into the
+     * group this socket was accepted for, the new WebSocket takes over the fd.
+     *
+     * Hints: Anything but a valid WebSocket upgrade request is closed without
+     * a response. Frames the client sent right behind the request are passed
+     * on to the new WebSocket. A request that came in one read, which is about
+     * every request, is parsed where it was read into, only one split over
+     * reads is put together in httpBuffer first.
+     *
+     */
+    uS::Socket *HttpServerSocket::onData(uS::Socket *s, char *data, size_t length) {
+        HttpServerSocket *httpServerSocket = static_cast<HttpServerSocket *>(s);
+        std::string &httpBuffer = httpServerSocket->httpBuffer;
+
+        static const char terminator[] = "\r\n\r\n";
+        size_t searchFrom = 0;
+        bool buffered = !httpBuffer.empty();
+        if (buffered) {
+            // the blank line may have started in the previous read
+            searchFrom = httpBuffer.length() - std::min<size_t>(httpBuffer.length(), 3);
+            httpBuffer.append(data, length);
+            data = (char *) httpBuffer.data();
+            length = httpBuffer.length();
+        }
+        char *headersEnd = std::search(data + searchFrom, data + length, terminator, terminator + 4);
+        if (headersEnd == data + length) {
+            if (!buffered) {
+                httpBuffer.assign(data, length);
+            }
+            if (httpBuffer.length() > MAX_HEADER_BUFFER_SIZE) {
+                onEnd(httpServerSocket);
+            }
+            return httpServerSocket;
+        }
+        size_t headersLength = headersEnd + 4 - data;
+
+        HttpRequest request(data, headersLength);
+        HttpRequest::Value secKey = request.getHeader("sec-websocket-key");
+        if (!equalsIgnoreCase({data, std::min<size_t>(headersLength, 4)}, "get ") || !equalsIgnoreCase(request.getHeader("upgrade"), "websocket") ||
+                !equalsIgnoreCase(request.getHeader("sec-websocket-version"), "13") || !isValidKey(secKey)) {
+            onEnd(httpServerSocket);
+            return httpServerSocket;
+        }
+        HttpRequest::Value subprotocol = request.getHeader("sec-websocket-protocol");
+        HttpRequest::Value extensions = request.getHeader("sec-websocket-extensions");
+
+        Group *group = Group::from(httpServerSocket);
+        WebSocket::PeerAddress peerAddress;
+        if (!group->admit(httpServerSocket->getFd(), peerAddress)) {
+            Hub::refuseUpgrade(httpServerSocket->getFd(), httpServerSocket->ssl);
+            onEnd(httpServerSocket);
+            return httpServerSocket;
+        }
+        if (group->upgradeRequestHandler) {
+            if (int status = group->upgradeRequestHandler(request)) {
+                Hub::refuseUpgrade(httpServerSocket->getFd(), httpServerSocket->ssl, status);
+                onEnd(httpServerSocket);
+                return httpServerSocket;
+            }
+        }
+
+        httpServerSocket->timeout->stop();
+        httpServerSocket->timeout->close();
+
+        // at most what came with this read, so it fits the receive buffer it came in. Unbuffered it
+        // is still there, behind the request the views point into
+        size_t remainingLength = length - headersLength;
+        char *remaining = data + headersLength;
+        if (buffered) {
+            memcpy(httpServerSocket->nodeData->recvBuffer->data, remaining, remainingLength);
+            remaining = httpServerSocket->nodeData->recvBuffer->data;
+        }
+
+        WebSocket *webSocket = group->hub->answerUpgrade(httpServerSocket, secKey.data, extensions ? extensions.data : "", extensions.length,
+                                                         subprotocol ? subprotocol.data : "", subprotocol.length, group, peerAddress);
+        httpServerSocket->retire<HttpServerSocket>();
+
+        if (remainingLength && !webSocket->isClosed() && !webSocket->isShuttingDown()) {
+            WebSocket::onData(webSocket, remaining, remainingLength);
+        }
+        return webSocket;
+    }
+
+    void HttpServerSocket::onEnd(uS::Socket *s) {
+        HttpServerSocket *httpServerSocket = static_cast<HttpServerSocket *>(s);
+
+        httpServerSocket->timeout->stop();
+        httpServerSocket->timeout->close();
+        httpServerSocket->template closeSocket<HttpServerSocket>();
+        while (!httpServerSocket->messageQueue.empty()) {
+            httpServerSocket->popMessage();
+        }
+        uS::NodeData::clearPendingPollChanges(httpServerSocket);
+    }
+}
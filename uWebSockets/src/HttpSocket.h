@@ -0,0 +1,81 @@
+#ifndef HTTPSOCKET_UWS_H
+#define HTTPSOCKET_UWS_H
+
+#include "Socket.h"
+#include <string>
+
+namespace uWS {
+    // the request line and headers of an upgrade request Hub::listen took, looked at where they were read into
+    // instead of copied out. Valid only during the call it is passed to
+    struct WIN32_EXPORT HttpRequest {
+        struct Value {
+            const char *data = nullptr;
+            size_t length = 0;
+
+            explicit operator bool() const {
+                return data != nullptr;
+            }
+        };
+
+        // from the request line up to and including the blank line
+        const char *headers;
+        size_t length;
+
+        HttpRequest(const char *headers, size_t length) : headers(headers), length(length) {}
+
+        // the target of the request line, like /chat?room=1
+        Value getUrl() const;
+        // the first header called name in any case, without the white space around it. Falsy if there is none
+        Value getHeader(const char *name) const;
+    };
+
+    // client side of the opening handshake, from Hub::connect until the 101 response makes it a ClientWebSocket
+    struct WIN32_EXPORT HttpSocket : uS::Socket {
+        protected:
+            static const int MAX_HEADER_BUFFER_SIZE = 4096;
+
+            // the upgrade request until it is sent, then the response as it arrives
+            std::string httpBuffer;
+            char expectedAccept[28];
+            bool offeredDeflate = false;
+            uS::Timer *timeout = nullptr;
+
+            HttpSocket(uS::Socket *socket) : uS::Socket(std::move(*socket)) {}
+
+            void upgradeRequest(const std::string &host, const std::string &path, const std::string &headers, const char *extensions);
+            // polls for the non-blocking connect to finish, a timeoutMs of 0 waits as long as the kernel does
+            void startConnecting(uS::Loop *loop, int timeoutMs);
+            void cancelTimeout();
+
+            static void onConnected(uS::Poll *p, int status, int events);
+            static void onTimeout(uS::Timer *timer);
+            static uS::Socket *onData(uS::Socket *s, char *data, size_t length);
+            static void onEnd(uS::Socket *s);
+            static void onDrain(uS::Socket *s) {}
+
+            friend struct Hub;
+            friend struct uS::Socket;
+    };
+
+    // server side of the opening handshake, from Hub::listen accepting it until the request is upgraded
+    struct WIN32_EXPORT HttpServerSocket : uS::Socket {
+        protected:
+            static const int MAX_HEADER_BUFFER_SIZE = 4096;
+            static const int HANDSHAKE_TIMEOUT_MS = 10000;
+
+            std::string httpBuffer;
+            uS::Timer *timeout;
+
+            HttpServerSocket(uS::Socket *socket, uS::Loop *loop);
+
+            static void onTimeout(uS::Timer *timer);
+            static uS::Socket *onData(uS::Socket *s, char *data, size_t length);
+            static void onEnd(uS::Socket *s);
+            static void onDrain(uS::Socket *s) {}
+
+            friend struct Hub;
+            friend struct uS::Socket;
+    };
+}
+
+#endif // HTTPSOCKET_UWS_H
@@ -1,23 +1,152 @@
 #include "Hub.h"
 #include <openssl/sha.h>
+#include <openssl/x509v3.h>
 #include <string>
+#include <future>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 namespace uWS {
-    z_stream *Hub::allocateDefaultCompressor(z_stream *zStream) {
-        deflateInit2(zStream, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    z_stream *Hub::allocateDefaultCompressor(z_stream *zStream, int windowBits, const CompressionSettings &settings) {
+        deflateInit2(zStream, settings.level, Z_DEFLATED, -windowBits, settings.memLevel, settings.strategy);
         return zStream;
     }
 
-    char *Hub::deflate(char *data, size_t &length, z_stream *slidingDeflateWindow) {
+    // level and strategy change in place, a different memLevel needs a new compressor
+    void Hub::matchCompressor(z_stream *zStream, CompressionSettings &settings, const CompressionSettings &wanted) {
+        if (settings.memLevel != wanted.memLevel) {
+            deflateEnd(zStream);
+            allocateDefaultCompressor(zStream, 15, wanted);
+        } else if (settings.level != wanted.level || settings.strategy != wanted.strategy) {
+            deflateParams(zStream, wanted.level, wanted.strategy);
+        }
+        settings = wanted;
+    }
+
+    // every thread deflating off the loop keeps a compressor of its own, reset after each message
+    struct ThreadCompressor {
+#ifdef UWS_LIBDEFLATE
+        libdeflate_compressor *compressor = libdeflate_alloc_compressor(1);
+        int level = 1;
+
+        ~ThreadCompressor() {
+            libdeflate_free_compressor(compressor);
+        }
+#else
+        z_stream zStream = {};
+        bool initialized = false;
+        CompressionSettings settings;
+
+        ~ThreadCompressor() {
+            if (initialized) {
+                deflateEnd(&zStream);
+            }
+        }
+#endif
+    };
+
+    size_t Hub::deflateOnThread(const char *data, size_t length, const CompressionSettings &settings, std::string &output) {
+        static thread_local ThreadCompressor threadCompressor;
+        size_t offset = output.length();
+#ifdef UWS_LIBDEFLATE
+        if (threadCompressor.level != settings.level) {
+            libdeflate_free_compressor(threadCompressor.compressor);
+            threadCompressor.compressor = libdeflate_alloc_compressor(settings.level);
+            threadCompressor.level = settings.level;
+        }
+
+        // with the final block and trailing byte of deflate
+        output.resize(offset + libdeflate_deflate_compress_bound(threadCompressor.compressor, length) + 1);
+        size_t compressedLength = libdeflate_deflate_compress(threadCompressor.compressor, data, length, &output[offset], output.length() - offset - 1);
+        output[offset + compressedLength++] = 0;
+#else
+        const size_t DEFLATE_OUTPUT_CHUNK = 64 * 1024;
+        z_stream *compressor = &threadCompressor.zStream;
+        if (!threadCompressor.initialized) {
+            allocateDefaultCompressor(compressor, 15, settings);
+            threadCompressor.settings = settings;
+            threadCompressor.initialized = true;
+        } else {
+            matchCompressor(compressor, threadCompressor.settings, settings);
+        }
+
+        compressor->next_in = (Bytef *) data;
+        compressor->avail_in = (unsigned int) length;
+        int err;
+        do {
+            size_t chunkOffset = output.length();
+            output.resize(chunkOffset + DEFLATE_OUTPUT_CHUNK);
+            compressor->next_out = (Bytef *) &output[chunkOffset];
+            compressor->avail_out = DEFLATE_OUTPUT_CHUNK;
+            err = ::deflate(compressor, Z_SYNC_FLUSH);
+            output.resize(chunkOffset + DEFLATE_OUTPUT_CHUNK - compressor->avail_out);
+        } while (err == Z_OK && !compressor->avail_out);
+        deflateReset(compressor);
+
+        // without the 4 byte empty block trailer of the sync flush
+        size_t compressedLength = output.length() - offset - 4;
+#endif
+        output.resize(offset + compressedLength);
+        return compressedLength;
+    }
+
+    char *Hub::deflate(char *data, size_t &length, z_stream *slidingDeflateWindow, const CompressionSettings &settings) {
+        // other threads, like those preparing a UWS_THREADSAFE broadcast, keep off the loop's compressor and buffers
+        if (!slidingDeflateWindow && nodeData->tid != pthread_self()) {
+            static thread_local std::string threadOutput;
+            threadOutput.clear();
+            length = deflateOnThread(data, length, settings, threadOutput);
+            return &threadOutput[0];
+        }
+
+        if (dynamicZlibBuffer.capacity() > MAX_RETAINED_ZLIB_BUFFER) {
+            std::string().swap(dynamicZlibBuffer);
+        }
         dynamicZlibBuffer.clear();
 
-        z_stream *compressor = slidingDeflateWindow ? slidingDeflateWindow : &deflationStream;
+        if (!zlibBuffer) {
+            zlibBuffer = uS::LargeBuffer::allocate(zlibBufferSize, hugePages);
+        }
+        if (!slidingDeflateWindow && !deflationReady) {
+            readyDeflation();
+        }
+
+#ifdef UWS_LIBDEFLATE
+        // ends in a final block instead of a sync flush (RFC 7692 7.2.3.5), the byte after is what
+        // is left of the empty block a sender appends and strips. 0 written means it did not fit
+        if (!slidingDeflateWindow) {
+            matchOneShotCompressor(settings.level);
+            size_t written = libdeflate_deflate_compress(oneShotCompressor, data, length, zlibBuffer, zlibBufferSize - 1);
+            if (written) {
+                zlibBuffer[written] = 0;
+                length = written + 1;
+                return zlibBuffer;
+            }
+        }
+#endif
+
+        // a sliding window was allocated with the settings of its socket's group
+        z_stream *compressor = slidingDeflateWindow;
+        if (!compressor) {
+            compressor = &deflationStream;
+            matchCompressor(compressor, deflationSettings, settings);
+        }
 
         compressor->next_in = (Bytef *) data;
         compressor->avail_in = (unsigned int) length;
 
         // note: zlib requires more than 6 bytes with Z_SYNC_FLUSH
-        const int DEFLATE_OUTPUT_CHUNK = LARGE_BUFFER_SIZE;
+        const size_t DEFLATE_OUTPUT_CHUNK = zlibBufferSize;
 
         int err;
         do {
@@ -49,65 +178,1373 @@ namespace uWS {
         return zlibBuffer;
     }
 
-    // todo: let's go through this code once more some time!
-    char *Hub::inflate(char *data, size_t &length, size_t maxPayload) {
-        dynamicZlibBuffer.clear();
+    void Hub::readyDeflation() {
+        allocateDefaultCompressor(&deflationStream);
+#ifdef UWS_LIBDEFLATE
+        oneShotCompressor = libdeflate_alloc_compressor(oneShotLevel);
+#endif
+        deflationReady = true;
+    }
+
+    void Hub::readyInflation() {
+        inflateInit2(&inflationStream, -15);
+#ifdef UWS_LIBDEFLATE
+        oneShotDecompressor = libdeflate_alloc_decompressor();
+#endif
+        inflationReady = true;
+    }
+
+    void Hub::setBufferSettings(const BufferSettings &bufferSettings) {
+#ifdef UWS_NO_COMPRESSION
+        hugePages = bufferSettings.hugePages;
+#else
+        if (zlibBuffer) {
+            uS::LargeBuffer::free(zlibBuffer, zlibBufferSize, hugePages);
+            zlibBuffer = nullptr;
+        }
+        zlibBufferSize = std::max<size_t>(bufferSettings.zlibBufferSize, 4096);
+        hugePages = bufferSettings.hugePages;
+#endif
+        setReceiveBuffer((int) std::max<size_t>(bufferSettings.recvBufferSize, 4096), hugePages);
+    }
+
+    /*
+     * Bounds what deflateInto writes for length bytes, readying the compressor it
+     * will use for the settings of the group deflating.
+     *
+     */
+    size_t Hub::deflateBound(size_t length, z_stream *slidingDeflateWindow, const CompressionSettings &settings, const std::string *dictionary) {
+        if (!slidingDeflateWindow && !deflationReady) {
+            readyDeflation();
+        }
+
+#ifdef UWS_LIBDEFLATE
+        // libdeflate takes no dictionary
+        if (!slidingDeflateWindow && !dictionary) {
+            matchOneShotCompressor(settings.level);
+            return libdeflate_deflate_compress_bound(oneShotCompressor, length) + 1;
+        }
+#endif
+
+        if (!slidingDeflateWindow) {
+            matchCompressor(&deflationStream, deflationSettings, settings);
+        }
+
+        // zlib's bound is for Z_FINISH, a sync flush may add an end of block code, a stored block header and padding
+        return ::deflateBound(slidingDeflateWindow ? slidingDeflateWindow : &deflationStream, (uLong) length) + 10;
+    }
+
+    // like deflate, but straight into dst of deflateBound bytes. Returns the length without the sync flush trailer
+    size_t Hub::deflateInto(const char *data, size_t length, char *dst, size_t capacity, z_stream *slidingDeflateWindow, const std::string *dictionary) {
+#ifdef UWS_LIBDEFLATE
+        if (!slidingDeflateWindow && !dictionary) {
+            size_t written = libdeflate_deflate_compress(oneShotCompressor, data, length, dst, capacity - 1);
+            dst[written] = 0;
+            return written + 1;
+        }
+#endif
+
+        z_stream *compressor = slidingDeflateWindow ? slidingDeflateWindow : &deflationStream;
+        if (dictionary) {
+            deflateSetDictionary(compressor, (const Bytef *) dictionary->data(), (uInt) dictionary->length());
+        }
+        compressor->next_in = (Bytef *) data;
+        compressor->avail_in = (unsigned int) length;
+        compressor->next_out = (Bytef *) dst;
+        compressor->avail_out = (unsigned int) capacity;
+        ::deflate(compressor, Z_SYNC_FLUSH);
+
+        if (!slidingDeflateWindow) {
+            deflateReset(compressor);
+        }
+        return capacity - compressor->avail_out - 4;
+    }
+
+#ifdef UWS_LIBDEFLATE
+    void Hub::matchOneShotCompressor(int level) {
+        if (oneShotLevel != level) {
+            libdeflate_free_compressor(oneShotCompressor);
+            oneShotCompressor = libdeflate_alloc_compressor(level);
+            oneShotLevel = level;
+        }
+    }
+#endif
+
+    // rounds capacity up to its size class
+    char *Hub::BufferPool::take(size_t &capacity) {
+        for (int i = 0; i < SIZE_CLASSES; i++) {
+            size_t size = (size_t) 1 << (MIN_SIZE_LOG2 + i);
+            if (capacity <= size) {
+                capacity = size;
+                if (freeBuffers[i].empty()) {
+                    return uS::LargeBuffer::allocate(size);
+                }
+                char *buffer = freeBuffers[i].back();
+                freeBuffers[i].pop_back();
+                return buffer;
+            }
+        }
+        return uS::LargeBuffer::allocate(capacity);
+    }
+
+    void Hub::BufferPool::give(char *buffer, size_t capacity) {
+        for (int i = 0; i < SIZE_CLASSES; i++) {
+            if (capacity == (size_t) 1 << (MIN_SIZE_LOG2 + i)) {
+                if (freeBuffers[i].size() < MAX_FREE) {
+                    freeBuffers[i].push_back(buffer);
+                    return;
+                }
+                break;
+            }
+        }
+        uS::LargeBuffer::free(buffer, capacity);
+    }
+
+    size_t Hub::BufferPool::trim() {
+        size_t released = 0;
+        for (int i = 0; i < SIZE_CLASSES; i++) {
+            for (char *buffer : freeBuffers[i]) {
+                uS::LargeBuffer::free(buffer, (size_t) 1 << (MIN_SIZE_LOG2 + i));
+                released += (size_t) 1 << (MIN_SIZE_LOG2 + i);
+            }
+            std::vector<char *>().swap(freeBuffers[i]);
+        }
+        return released;
+    }
+
+    WebSocket::PreparedMessage *Hub::CompressedCache::find(const char *message, size_t length, uint64_t key) {
+        size_t hash = std::hash<std::string_view>()(std::string_view(message, length));
+        auto range = index.equal_range(hash);
+        for (auto it = range.first; it != range.second; it++) {
+            Entry &entry = *it->second;
+            if (entry.key == key && entry.message.length() == length && !memcmp(entry.message.data(), message, length)) {
+                entries.splice(entries.begin(), entries, it->second);
+                hits++;
+                return entry.preparedMessage;
+            }
+        }
+        misses++;
+        return nullptr;
+    }
 
-        inflationStream.next_in = (Bytef *) data;
-        inflationStream.avail_in = (unsigned int) length;
+    void Hub::CompressedCache::insert(const char *message, size_t length, uint64_t key, const char *deflated, size_t deflatedLength) {
+        if (length + deflatedLength > budget) {
+            return;
+        }
+        WebSocket::PreparedMessage *preparedMessage = WebSocket::prepareMessage((char *) deflated, deflatedLength, (OpCode) (key & 15), true);
+        size_t size = length + preparedMessage->length;
+        evict(budget - std::min(budget, size));
+        entries.push_front({std::string(message, length), key, preparedMessage});
+        index.emplace(std::hash<std::string_view>()(std::string_view(message, length)), entries.begin());
+        bytes += size;
+    }
+
+    // sends still holding a frame keep it until they are written
+    size_t Hub::CompressedCache::evict(size_t budget) {
+        size_t released = 0;
+        while (bytes > budget && !entries.empty()) {
+            Entry &entry = entries.back();
+            auto range = index.equal_range(std::hash<std::string_view>()(entry.message));
+            for (auto it = range.first; it != range.second; it++) {
+                if (&*it->second == &entry) {
+                    index.erase(it);
+                    break;
+                }
+            }
+            size_t size = entry.message.length() + entry.preparedMessage->length;
+            bytes -= size;
+            released += size;
+            WebSocket::finalizeMessage(entry.preparedMessage);
+            entries.pop_back();
+        }
+        return released;
+    }
 
+    void Hub::setCompressedCache(size_t budget, size_t minLength) {
+        compressedCache.evict(budget);
+        compressedCache.budget = budget;
+        compressedCache.minLength = minLength;
+    }
+
+    // the scratch strings only hold something while a message is worked on, batchData also while its
+    // batch is delivered, which may be what calls this
+    size_t Hub::trim(TrimLevel level) {
+        size_t released = bufferPool.trim() + compressedCache.evict(0) + dynamicZlibBuffer.capacity();
+        std::string().swap(dynamicZlibBuffer);
+#ifdef UWS_LIBDEFLATE
+        released += inflationInput.capacity();
+        std::string().swap(inflationInput);
+#endif
+        if (batchData.empty()) {
+            released += batchData.capacity();
+            std::string().swap(batchData);
+        }
+
+        if (level == TRIM_ALL) {
+            // made again by the next deflate
+            if (zlibBuffer) {
+                released += zlibBufferSize;
+                uS::LargeBuffer::free(zlibBuffer, zlibBufferSize, hugePages);
+                zlibBuffer = nullptr;
+            }
+
+            uS::BlockAllocator *blockAllocator = nodeData->blockAllocator;
+            released += blockAllocator->getStats().cachedBytes;
+            int depth = blockAllocator->getDepth();
+            blockAllocator->setDepth(0);
+            blockAllocator->setDepth(depth);
+
+            uS::SlotPool *slotPool = nodeData->slotPool;
+            uS::SlotPool::Stats slotStats = slotPool->getStats();
+            released += slotStats.cachedSlots * slotStats.slotSize;
+            depth = slotPool->getDepth();
+            slotPool->setDepth(0);
+            slotPool->setDepth(depth);
+#ifdef __GLIBC__
+            malloc_trim(0);
+#endif
+        }
+        return released;
+    }
+
+    Hub::BufferPool::~BufferPool() {
+        for (int i = 0; i < SIZE_CLASSES; i++) {
+            for (char *buffer : freeBuffers[i]) {
+                uS::LargeBuffer::free(buffer, (size_t) 1 << (MIN_SIZE_LOG2 + i));
+            }
+        }
+    }
+
+    /*
+     * Inflates a whole message into a buffer of bufferPool, which stays ours until
+     * releaseInflationBuffer or the next inflate. It starts at a guess from the
+     * compressed length and doubles while output keeps coming, never past what
+     * maxPayload can use. Returns nullptr for bad data or output over maxPayload.
+     * A slidingInflateWindow of a client keeping its context is used instead of
+     * the shared inflater and kept as is for the next message.
+     *
+     */
+    char *Hub::inflate(char *data, size_t &length, size_t maxPayload, z_stream *slidingInflateWindow, const std::string *dictionary) {
+        releaseInflationBuffer();
+        if (!slidingInflateWindow && !inflationReady) {
+            readyInflation();
+        }
+
+#ifdef UWS_LIBDEFLATE
+        // the shared inflater never keeps context, so every message is one-shot. libdeflate wants a final
+        // block, so the stripped sync flush trailer is put back followed by an empty final block.
+        // Anything it cannot do, like output bigger than zlibBuffer, is left to zlib
+        if (!slidingInflateWindow && !dictionary && length < zlibBufferSize) {
+            inflationInput.assign(data, length);
+            inflationInput.append("\x00\x00\xff\xff\x01\x00\x00\xff\xff", 9);
+            inflationCapacity = std::min<size_t>(zlibBufferSize, maxPayload);
+            inflationBuffer = bufferPool.take(inflationCapacity);
+            size_t inflatedLength;
+            if (libdeflate_deflate_decompress(oneShotDecompressor, inflationInput.data(), inflationInput.length(), inflationBuffer,
+                                              std::min<size_t>(inflationCapacity, maxPayload), &inflatedLength) == LIBDEFLATE_SUCCESS) {
+                length = inflatedLength;
+                return inflationBuffer;
+            }
+            releaseInflationBuffer();
+        }
+#endif
+
+        z_stream &stream = slidingInflateWindow ? *slidingInflateWindow : inflationStream;
+        if (dictionary) {
+            inflateSetDictionary(&stream, (const Bytef *) dictionary->data(), (uInt) dictionary->length());
+        }
+        stream.next_in = (Bytef *) data;
+        stream.avail_in = (unsigned int) length;
+
+        // a kept context has to see the sync flush trailer the sender stripped, or the
+        // next message would start in the middle of its empty stored block
+        static unsigned char syncFlushTrailer[] = {0x00, 0x00, 0xff, 0xff};
+        bool trailerPending = slidingInflateWindow;
+
+        // one byte past maxPayload is enough to tell it went over
+        size_t inflatedLength = 0, capacity = std::min(std::max<size_t>(length * 4, 4096), maxPayload + 1);
+        char *buffer = bufferPool.take(capacity);
         int err;
-        do {
-            inflationStream.next_out = (Bytef *) zlibBuffer;
-            inflationStream.avail_out = LARGE_BUFFER_SIZE;
-            err = ::inflate(&inflationStream, Z_FINISH);
-            if (!inflationStream.avail_in) {
+        while (true) {
+            stream.next_out = (Bytef *) buffer + inflatedLength;
+            stream.avail_out = (unsigned int) (capacity - inflatedLength);
+            err = ::inflate(&stream, slidingInflateWindow ? Z_SYNC_FLUSH : Z_FINISH);
+            inflatedLength = capacity - stream.avail_out;
+
+            if (stream.avail_out && trailerPending && (err == Z_OK || err == Z_BUF_ERROR)) {
+                stream.next_in = syncFlushTrailer;
+                stream.avail_in = sizeof(syncFlushTrailer);
+                trailerPending = false;
+                continue;
+            }
+
+            // room left means zlib ran out of input, a sender may also end with a final block
+            if (stream.avail_out || inflatedLength > maxPayload || (err != Z_OK && err != Z_BUF_ERROR)) {
                 break;
             }
 
-            dynamicZlibBuffer.append(zlibBuffer, LARGE_BUFFER_SIZE - inflationStream.avail_out);
-        } while (err == Z_BUF_ERROR && dynamicZlibBuffer.length() <= maxPayload);
+            size_t grownCapacity = std::min(capacity * 2, maxPayload + 1);
+            char *grownBuffer = bufferPool.take(grownCapacity);
+            memcpy(grownBuffer, buffer, inflatedLength);
+            bufferPool.give(buffer, capacity);
+            buffer = grownBuffer;
+            capacity = grownCapacity;
+        }
 
-        inflateReset(&inflationStream);
+        // a final block ends the context of a client that keeps it
+        if (!slidingInflateWindow || err == Z_STREAM_END) {
+            inflateReset(&stream);
+        }
+        inflationBuffer = buffer;
+        inflationCapacity = capacity;
 
-        if ((err != Z_BUF_ERROR && err != Z_OK) || dynamicZlibBuffer.length() > maxPayload) {
+        if ((err != Z_BUF_ERROR && err != Z_OK && err != Z_STREAM_END) || inflatedLength > maxPayload) {
+            releaseInflationBuffer();
             length = 0;
             return nullptr;
         }
 
-        if (dynamicZlibBuffer.length()) {
-            dynamicZlibBuffer.append(zlibBuffer, LARGE_BUFFER_SIZE - inflationStream.avail_out);
+        length = inflatedLength;
+        return buffer;
+    }
 
-            length = dynamicZlibBuffer.length();
-            return (char *) dynamicZlibBuffer.data();
+    void Hub::releaseInflationBuffer() {
+        if (inflationBuffer) {
+            bufferPool.give(inflationBuffer, inflationCapacity);
+            inflationBuffer = nullptr;
+        }
+    }
+
+    /*
+     * Frames the message once and hands it to the loop of every group, each of
+     * which then broadcasts it to its own sockets. The only thing shared between
+     * threads is the prepared message, through its atomic reference count.
+     *
+     * Hints: Goes through a lock-free queue per Hub woken by its Async, so it
+     * never takes a lock. With compress it is deflated once, with a compressor
+     * of the calling thread (see deflateOnThread), and sockets that cannot take
+     * the shared compressed frame get the plain one.
+     *
+     * Thread safe
+     *
+     */
+    void Hub::broadcastAcross(const std::vector<Group *> &groups, const char *message, size_t length, OpCode opCode, bool compress) {
+        WebSocket::PreparedMessage *preparedMessage = WebSocket::prepareMessage((char *) message, length, opCode, false);
+        compress = compress && std::any_of(groups.begin(), groups.end(), [](Group *group) {
+            return group->deflatesOutbound();
+        });
+        if (compress && opCode < 3) {
+            std::string deflated;
+            size_t compressedLength = deflateOnThread(message, length, CompressionSettings(), deflated);
+            if (compressedLength < length) {
+                WebSocket::PreparedMessage *compressedMessage = WebSocket::prepareMessage(&deflated[0], compressedLength, opCode, true);
+                compressedMessage->uncompressed = preparedMessage;
+                preparedMessage = compressedMessage;
+            }
         }
+        for (Group *group : groups) {
+            preparedMessage->references++;
+            CrossThreadBroadcast *crossThreadBroadcast = new CrossThreadBroadcast;
+            crossThreadBroadcast->group = group;
+            crossThreadBroadcast->preparedMessage = preparedMessage;
+            group->hub->broadcastInbox.push(crossThreadBroadcast);
+            group->hub->broadcastAsync->send();
+        }
+        WebSocket::finalizeMessage(preparedMessage);
+    }
 
-        length = LARGE_BUFFER_SIZE - inflationStream.avail_out;
-        return zlibBuffer;
+    /*
+     * Sends to a socket known by its id only, from any thread, for example
+     * one consuming a message queue for the users of a server.
+     *
+     * Hints: The id is looked up on the loop thread of group's hub, where a
+     * socket that meanwhile went away simply is not found any more, so no
+     * WebSocket pointer ever crosses threads. The message is copied once, into
+     * a node of the same lock-free queue broadcastAcross goes through, and
+     * compressed with the socket's own window on arrival.
+     *
+     * Thread safe
+     *
+     */
+    void Hub::sendById(Group *group, uint64_t id, const char *message, size_t length, OpCode opCode, bool compress) {
+        group->hub->sendInbox.push(new CrossThreadSend {{nullptr}, group, id, std::string(message, length), opCode, compress});
+        group->hub->broadcastAsync->send();
+    }
+
+    void Hub::drainBroadcastInbox(uS::Async *async) {
+        Hub *hub = static_cast<Hub *>(async->getData());
+        hub->nodeData->loopStats->wakeups++;
+        while (CrossThreadBroadcast *crossThreadBroadcast = hub->broadcastInbox.pop()) {
+            crossThreadBroadcast->group->broadcast(crossThreadBroadcast->preparedMessage, crossThreadBroadcast->conflationKey, crossThreadBroadcast->ttlMs);
+            WebSocket::finalizeMessage(crossThreadBroadcast->preparedMessage);
+            delete crossThreadBroadcast;
+        }
+        while (CrossThreadSend *crossThreadSend = hub->sendInbox.pop()) {
+            if (WebSocket *webSocket = crossThreadSend->group->getWebSocket(crossThreadSend->id)) {
+                webSocket->send(&crossThreadSend->message[0], crossThreadSend->message.length(), crossThreadSend->opCode,
+                                nullptr, nullptr, crossThreadSend->compress);
+            }
+            delete crossThreadSend;
+        }
+    }
+
+    // pins the calling thread, where the OS lets it
+    static void pinThread(const std::vector<int> &cpus) {
+#ifdef __linux__
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &cpuSet);
+        }
+        sched_setaffinity(0, sizeof(cpuSet), &cpuSet);
+#endif
+    }
+
+    void Hub::startWorkers(int count, const std::function<void(Hub *)> &init, WorkerPlacement placement, const std::vector<std::vector<int>> &cpuSets) {
+        workerPlacement = placement;
+        BufferSettings bufferSettings;
+        bufferSettings.recvBufferSize = nodeData->recvBuffer->size;
+        bufferSettings.zlibBufferSize = zlibBufferSize;
+        bufferSettings.hugePages = hugePages;
+
+        for (int i = 0; i < count; i++) {
+            Worker *worker = new Worker;
+            if (cpuSets.size()) {
+                worker->cpus = cpuSets[i % cpuSets.size()];
+            }
+            std::promise<Hub *> started;
+            // this hub is left alone until the worker is started, so it can read the settings
+            worker->thread = std::thread([this, worker, &init, &started, bufferSettings]() {
+                if (worker->cpus.size()) {
+                    pinThread(worker->cpus);
+                }
+                uS::Loop *loop = uS::Loop::createLoop(false);
+                {
+                    Hub hub(extensionOptions, maxPayload, compressionSettings, bufferSettings, loop);
+                    hub.upgradeAsync = new uS::Async(loop);
+                    hub.upgradeAsync->start(drainUpgradeInbox);
+                    hub.upgradeAsync->setData(&hub);
+                    init(&hub);
+                    started.set_value(&hub);
+
+                    uv_run(loop, UV_RUN_DEFAULT);
+                }
+                loop->destroy();
+            });
+            worker->hub = started.get_future().get();
+            workers.push_back(worker);
+        }
+    }
+
+    void Hub::stopWorkers() {
+        setWorkerRebalancing(0);
+        for (Worker *worker : workers) {
+            worker->hub->stopping = true;
+            worker->hub->upgradeAsync->send();
+            worker->thread.join();
+            delete worker;
+        }
+        workers.clear();
+    }
+
+    Hub *Hub::pickWorker(uv_os_sock_t fd) {
+#ifdef SO_INCOMING_CPU
+        if (workerPlacement == INCOMING_CPU) {
+            int cpu;
+            socklen_t cpuLength = sizeof(cpu);
+            if (!getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpuLength) && cpu >= 0) {
+                for (Worker *worker : workers) {
+                    if (std::find(worker->cpus.begin(), worker->cpus.end(), cpu) != worker->cpus.end()) {
+                        return worker->hub;
+                    }
+                }
+            }
+        }
+#endif
+        if (workerPlacement == LEAST_LOADED) {
+            Hub *leastLoaded = workers[0]->hub;
+            for (Worker *worker : workers) {
+                if (worker->hub->load < leastLoaded->load) {
+                    leastLoaded = worker->hub;
+                }
+            }
+            return leastLoaded;
+        }
+        return workers[nextWorker++ % workers.size()]->hub;
+    }
+
+    // upgrades whatever the accepting hub handed over, on the worker's thread
+    void Hub::drainUpgradeInbox(uS::Async *async) {
+        Hub *hub = static_cast<Hub *>(async->getData());
+        hub->nodeData->loopStats->wakeups++;
+        while (CrossThreadUpgrade *crossThreadUpgrade = hub->upgradeInbox.pop()) {
+            hub->upgrade(crossThreadUpgrade->fd, crossThreadUpgrade->secKey.c_str(), crossThreadUpgrade->ssl,
+                         crossThreadUpgrade->extensions.data(), crossThreadUpgrade->extensions.length(),
+                         crossThreadUpgrade->subprotocol.data(), crossThreadUpgrade->subprotocol.length(), &hub->getDefaultGroup());
+            // the socket counts itself from now on
+            hub->load--;
+            delete crossThreadUpgrade;
+        }
+
+        // nothing but sockets of groups init made keep the loop running past this
+        if (hub->stopping) {
+            hub->stopListening();
+            hub->upgradeAsync->close();
+            hub->upgradeAsync = nullptr;
+            hub->getDefaultGroup().close(1001);
+        }
+    }
+
+    void Hub::postTask(std::function<void(Hub *)> run) {
+        taskInbox.push(new CrossThreadTask {{nullptr}, std::move(run)});
+        taskAsync->send();
+    }
+
+    void Hub::drainTaskInbox(uS::Async *async) {
+        Hub *hub = static_cast<Hub *>(async->getData());
+        hub->nodeData->loopStats->wakeups++;
+        while (CrossThreadTask *crossThreadTask = hub->taskInbox.pop()) {
+            crossThreadTask->run(hub);
+            delete crossThreadTask;
+        }
+    }
+
+    /*
+     * Moves a socket to the loop of another hub, for example from a busy
+     * worker to an idle one. On the socket's own thread it is taken out of
+     * its group and off its loop between two iterations, then the hub of
+     * targetGroup polls the very same fd on its thread.
+     *
+     * Hints: Nothing is copied. The queue, the parser state, fragments and
+     * the deflate and inflate windows are heap memory the other thread just
+     * carries on with; blocks of the old loop's allocator end up in the new
+     * one's when freed. The group's handlers are not called for the move.
+     *
+     * Thread safe
+     *
+     */
+    void Hub::migrate(WebSocket *webSocket, Group *targetGroup) {
+        webSocket->postToLoop([targetGroup](WebSocket *webSocket, bool cancelled) {
+            if (cancelled || webSocket->isShuttingDown() || webSocket->inflationJob || webSocket->flushMessageBatch()) {
+                return;
+            }
+            // jobs complete on this loop, a compression job into its place in the queue
+            for (WebSocket::Queue::Message *message = webSocket->messageQueue.front(); message; message = message->nextMessage) {
+                if (message->pending) {
+                    return;
+                }
+            }
+
+            Group *group = Group::from(webSocket);
+            if (group == targetGroup) {
+                return;
+            }
+#ifdef USE_MTCP
+            // a connection belongs to the mTCP context of the core it came in on
+            if (group->hub->getLoop() != targetGroup->hub->getLoop()) {
+                return;
+            }
+#endif
+            std::vector<std::string> topicNames;
+            if (webSocket->topics) {
+                for (Topic *topic : *webSocket->topics) {
+                    topicNames.push_back(topic->name);
+                }
+            }
+            group->removeWebSocket(webSocket, false);
+            // what the socket holds is counted by the group it lives in
+            MemoryStats memory = webSocket->getMemoryUsage();
+            group->countHeld(webSocket, memory, -1);
+            // the slot is counted by the pool of the loop the socket lives on, which also frees it
+            group->slotPool->transfer(-1);
+            webSocket->detachFromLoop([webSocket, targetGroup, topicNames, memory]() {
+                targetGroup->hub->postTask([webSocket, targetGroup, topicNames, memory](Hub *hub) {
+                    webSocket->attachToLoop(targetGroup, hub->getLoop());
+                    targetGroup->slotPool->transfer(1);
+                    targetGroup->countHeld(webSocket, memory, 1);
+                    targetGroup->addWebSocket(webSocket);
+                    for (const std::string &topicName : topicNames) {
+                        targetGroup->subscribe(webSocket, topicName.data(), topicName.length());
+                    }
+                });
+            });
+        });
+    }
+
+    void Hub::setWorkerRebalancing(int intervalMs, size_t tolerance) {
+        if (rebalanceTimer) {
+            rebalanceTimer->stop();
+            rebalanceTimer->close();
+            rebalanceTimer = nullptr;
+        }
+
+        rebalanceTolerance = tolerance;
+        if (intervalMs) {
+            rebalanceTimer = new uS::Timer(getLoop());
+            rebalanceTimer->setData(this);
+            rebalanceTimer->start(rebalanceWorkers, intervalMs, intervalMs);
+            rebalanceTimer->unref();
+        }
+    }
+
+    // loads are read racily, sockets on their way count for neither worker until they arrive
+    void Hub::rebalanceWorkers(uS::Timer *timer) {
+        Hub *hub = static_cast<Hub *>(timer->getData());
+        if (hub->workers.size() < 2) {
+            return;
+        }
+
+        Hub *mostLoaded = hub->workers[0]->hub, *leastLoaded = mostLoaded;
+        for (Worker *worker : hub->workers) {
+            if (worker->hub->load > mostLoaded->load) {
+                mostLoaded = worker->hub;
+            }
+            if (worker->hub->load < leastLoaded->load) {
+                leastLoaded = worker->hub;
+            }
+        }
+
+        size_t difference = mostLoaded->load - leastLoaded->load;
+        if (difference <= std::max<size_t>(hub->rebalanceTolerance, 1)) {
+            return;
+        }
+
+        Group *targetGroup = &leastLoaded->getDefaultGroup();
+        mostLoaded->postTask([difference, targetGroup](Hub *hub) {
+            size_t count = difference / 2;
+            // migrate only posts, nothing leaves the group while it is iterated
+            hub->getDefaultGroup().forEach([&count, targetGroup](WebSocket *webSocket) {
+                if (count) {
+                    count--;
+                    migrate(webSocket, targetGroup);
+                }
+            });
+        });
+    }
+
+    // raw memory of the same build on both ends, mismatched builds refuse each other by version
+    struct Hub::HandOffRecord {
+        static const uint32_t VERSION = 1;
+        uint32_t version = VERSION;
+        WebSocketState webSocketState;
+        WebSocket::PeerAddress peerAddress;
+        char compressionStatus;
+        unsigned char controlTipLength, hasOutstandingPong, utf8Tail[3], utf8TailLength;
+        unsigned char slidingWindowBits, inflateWindowBits, readPaused;
+        bool idlePing;
+        unsigned int idleTimeout;
+        // of what follows: the fragment buffer, the queue and the topic names, each of those after its uint32_t length
+        uint64_t fragmentLength, queuedLength, topicsLength;
+    };
+
+    // a deflate window is only dropped, the next compressed send starts over, an inflate window with history is a
+    // context the peer keeps compressing against
+    bool Hub::canHandOff(WebSocket *webSocket) {
+        if (webSocket->ssl || webSocket->client || webSocket->isShuttingDown() || webSocket->closeWhenDrained ||
+            webSocket->stream || webSocket->inflationJob || webSocket->slidingInflateWindow) {
+            return false;
+        }
+        for (WebSocket::Queue::Message *message = webSocket->messageQueue.front(); message; message = message->nextMessage) {
+            if (message->pending) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+#if !defined(_WIN32) && !defined(USE_MTCP)
+    // all of data, with passedFd riding along on its first byte unless it is -1. fd may be non-blocking
+    static bool writeHandOff(int fd, const char *data, size_t length, int passedFd) {
+        while (length) {
+            iovec vector = {(void *) data, length};
+            msghdr message = {};
+            message.msg_iov = &vector;
+            message.msg_iovlen = 1;
+            char control[CMSG_SPACE(sizeof(int))] = {};
+            if (passedFd != -1) {
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+                cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg), &passedFd, sizeof(int));
+            }
+
+            ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+            if (sent == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                pollfd writable = {fd, POLLOUT, 0};
+                if ((errno != EAGAIN && errno != EWOULDBLOCK) || ::poll(&writable, 1, -1) == -1) {
+                    return false;
+                }
+                continue;
+            }
+            passedFd = -1;
+            data += sent;
+            length -= (size_t) sent;
+        }
+        return true;
+    }
+
+    // all of length bytes, taking up a passed fd into passedFd if one comes along. False at the end of fd
+    static bool readHandOff(int fd, char *data, size_t length, int *passedFd) {
+        while (length) {
+            iovec vector = {data, length};
+            msghdr message = {};
+            message.msg_iov = &vector;
+            message.msg_iovlen = 1;
+            char control[CMSG_SPACE(sizeof(int))];
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            ssize_t received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+            if (received == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                pollfd readable = {fd, POLLIN, 0};
+                if ((errno != EAGAIN && errno != EWOULDBLOCK) || ::poll(&readable, 1, -1) == -1) {
+                    return false;
+                }
+                continue;
+            }
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                    int passed;
+                    memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+                    if (*passedFd == -1) {
+                        *passedFd = passed;
+                    } else {
+                        ::close(passed);
+                    }
+                }
+            }
+            if (!received) {
+                return false;
+            }
+            data += received;
+            length -= (size_t) received;
+        }
+        return true;
+    }
+
+    static void appendHandOff(std::string &payload, const char *data, size_t length) {
+        uint32_t length32 = (uint32_t) length;
+        payload.append((char *) &length32, sizeof(length32));
+        payload.append(data, length);
+    }
+#endif
+
+    size_t Hub::handOff(Group *group, int fd) {
+        size_t handedOff = 0;
+#if !defined(_WIN32) && !defined(USE_MTCP)
+        std::string payload;
+        bool failed = false;
+        group->forEach([&](WebSocket *webSocket) {
+            if (failed || !canHandOff(webSocket)) {
+                return;
+            }
+
+            // what the socket holds back is written or queued first, so that all it still owes is in the queue
+            if (webSocket->nodeData->corkBuffer->socket == webSocket) {
+                webSocket->flushCork();
+                webSocket->nodeData->corkBuffer->socket = nullptr;
+            }
+            if (webSocket->uS::Socket::state.deferred) {
+                webSocket->undefer();
+            }
+            if (!webSocket->messageQueue.empty() && (!webSocket->flushQueue() || webSocket->isClosed() || webSocket->isShuttingDown())) {
+                return;
+            }
+
+            HandOffRecord record;
+            record.webSocketState = *webSocket;
+            record.peerAddress = webSocket->peerAddress;
+            record.compressionStatus = webSocket->compressionStatus;
+            record.controlTipLength = webSocket->controlTipLength;
+            record.hasOutstandingPong = webSocket->hasOutstandingPong;
+            memcpy(record.utf8Tail, webSocket->utf8Tail, sizeof(record.utf8Tail));
+            record.utf8TailLength = webSocket->utf8TailLength;
+            record.slidingWindowBits = webSocket->slidingWindowBits;
+            record.inflateWindowBits = webSocket->inflateWindowBits;
+            record.readPaused = webSocket->readPaused & WebSocket::PAUSED_BY_USER;
+            record.idlePing = webSocket->idlePing;
+            record.idleTimeout = webSocket->idleTimeout;
+
+            payload.clear();
+            payload.append(webSocket->fragmentBuffer.data, webSocket->fragmentBuffer.length);
+            record.fragmentLength = webSocket->fragmentBuffer.length;
+            for (WebSocket::Queue::Message *message = webSocket->messageQueue.front(); message; message = message->nextMessage) {
+                payload.append(message->data, message->length);
+#ifdef UWS_SENDFILE
+                if (message->hasFile()) {
+                    size_t offset = payload.length();
+                    payload.resize(offset + message->extra->referencedLength);
+                    if (pread(message->extra->fileDescriptor, &payload[offset], message->extra->referencedLength, message->extra->fileOffset) != (ssize_t) message->extra->referencedLength) {
+                        payload.resize(offset);
+                    }
+                    continue;
+                }
+#endif
+                if (message->referencedLength()) {
+                    payload.append(message->extra->referencedData, message->extra->referencedLength);
+                }
+            }
+            record.queuedLength = payload.length() - record.fragmentLength;
+            if (webSocket->topics) {
+                for (Topic *topic : *webSocket->topics) {
+                    appendHandOff(payload, topic->name.data(), topic->name.length());
+                }
+            }
+            record.topicsLength = payload.length() - record.fragmentLength - record.queuedLength;
+
+            // a socket half written is lost to both processes, the successor refuses what does not arrive whole
+            if (!writeHandOff(fd, (char *) &record, sizeof(record), webSocket->getFd()) ||
+                !writeHandOff(fd, payload.data(), payload.length(), -1)) {
+                failed = true;
+                return;
+            }
+            handedOff++;
+
+            // the successor sends what was queued, no further send here reaches the peer
+            while (!webSocket->messageQueue.empty()) {
+                webSocket->messageQueue.front()->complete(nullptr, false);
+                webSocket->popMessage();
+            }
+            group->removeWebSocket(webSocket);
+            group->callDisconnection(webSocket, 1012, (char *) "Handed off", 10);
+            // closes this process' copy of the fd only, the connection stays open with the successor
+            webSocket->setShuttingDown(true);
+            WebSocket::onEnd(webSocket);
+        });
+#endif
+        return handedOff;
+    }
+
+    size_t Hub::adoptHandOff(Group *targetGroup, int fd) {
+        size_t adopted = 0;
+#if !defined(_WIN32) && !defined(USE_MTCP)
+        std::string payload;
+        for (;;) {
+            HandOffRecord record;
+            int passedFd = -1;
+            if (!readHandOff(fd, (char *) &record, sizeof(record), &passedFd) || record.version != HandOffRecord::VERSION ||
+                passedFd == -1) {
+                if (passedFd != -1) {
+                    ::close(passedFd);
+                }
+                break;
+            }
+            payload.resize(record.fragmentLength + record.queuedLength + record.topicsLength);
+            if (!readHandOff(fd, (char *) payload.data(), payload.length(), &passedFd)) {
+                ::close(passedFd);
+                break;
+            }
+
+            uS::Context::setNonBlocking(passedFd);
+            uS::Socket s((uS::NodeData *) targetGroup, targetGroup->hub->getLoop(), passedFd, nullptr);
+            WebSocket *webSocket = new (targetGroup) WebSocket(record.compressionStatus != WebSocket::CompressionStatus::DISABLED, &s,
+                                                               record.slidingWindowBits, record.inflateWindowBits);
+            static_cast<WebSocketState &>(*webSocket) = record.webSocketState;
+            webSocket->peerAddress = record.peerAddress;
+            webSocket->compressionStatus = (WebSocket::CompressionStatus) record.compressionStatus;
+            webSocket->controlTipLength = record.controlTipLength;
+            webSocket->hasOutstandingPong = record.hasOutstandingPong;
+            memcpy(webSocket->utf8Tail, record.utf8Tail, sizeof(record.utf8Tail));
+            webSocket->utf8TailLength = record.utf8TailLength;
+            webSocket->readPaused = record.readPaused;
+            webSocket->lastActivity = targetGroup->idleClock;
+
+            const char *data = payload.data();
+            if (record.fragmentLength) {
+                webSocket->appendFragment(data, record.fragmentLength, 0);
+            }
+            data += record.fragmentLength;
+            if (record.queuedLength) {
+                webSocket->enqueue(webSocket->allocMessage(record.queuedLength, data));
+            }
+            data += record.queuedLength;
+
+            if (Group::from(webSocket)->extensionOptions & TRUSTED_PEERS) {
+                webSocket->setState<TrustedWebSocket>();
+            } else {
+                webSocket->setState<WebSocket>();
+            }
+            int poll = (webSocket->readPaused ? 0 : UV_READABLE) | (record.queuedLength ? UV_WRITABLE : 0);
+            webSocket->setPoll(poll);
+            if (poll) {
+                webSocket->change(webSocket, poll);
+            }
+            uS::NodeData::clearPendingPollChanges(webSocket);
+
+            if (targetGroup->draining) {
+                webSocket->closeQuietly(1001, nullptr, 0);
+                continue;
+            }
+
+            targetGroup->addWebSocket(webSocket);
+            if (record.idleTimeout) {
+                webSocket->setIdleTimeout(record.idleTimeout, record.idlePing);
+            }
+            for (const char *end = data + record.topicsLength; data < end; ) {
+                uint32_t length;
+                memcpy(&length, data, sizeof(length));
+                targetGroup->subscribe(webSocket, data + sizeof(length), length);
+                data += sizeof(length) + length;
+            }
+            adopted++;
+            targetGroup->callConnection(webSocket);
+        }
+#endif
+        return adopted;
+    }
+
+    SSL_CTX *Hub::getClientContext() {
+        if (!clientContext) {
+            clientContext = SSL_CTX_new(SSLv23_client_method());
+            SSL_CTX_set_options(clientContext, SSL_OP_NO_SSLv3);
+            SSL_CTX_set_default_verify_paths(clientContext);
+            SSL_CTX_set_verify(clientContext, SSL_VERIFY_PEER, nullptr);
+        }
+        return clientContext;
+    }
+
+    /*
+     * Opens a WebSocket to a ws:// or wss:// uri. Ends in either the connection
+     * handler or the error handler of clientGroup (the default group if null),
+     * the socket carries user as its user data.
+     *
+     * Hints: Name resolution blocks, so pass numeric addresses when opening
+     * many connections. Only the first address resolved is tried. TLS verifies
+     * the server against the default trust store and the host of the uri.
+     * permessage-deflate is offered if the group has it enabled.
+     *
+     */
+    void Hub::connect(const std::string &uri, void *user, const std::map<std::string, std::string> &extraHeaders, int timeoutMs, Group *clientGroup) {
+        if (!clientGroup) {
+            clientGroup = &getDefaultGroup();
+        }
+
+        bool secure = !uri.compare(0, 6, "wss://");
+        size_t offset = secure ? 6 : 5;
+#ifdef USE_MTCP
+        // mTCP connects out only with a port its RSS steers back to this core (mtcp_init_rss), there is no client
+        clientGroup->errorHandler(user);
+        return;
+#endif
+#ifdef UWS_NO_TLS
+        if (secure || uri.compare(0, 5, "ws://")) {
+#else
+        if (!secure && uri.compare(0, 5, "ws://")) {
+#endif
+            clientGroup->errorHandler(user);
+            return;
+        }
+
+        // host or [IPv6 address], maybe a port, then the path
+        std::string hostname, port = secure ? "443" : "80", path = "/";
+        size_t hostEnd;
+        if (offset < uri.length() && uri[offset] == '[') {
+            hostEnd = uri.find(']', offset);
+            if (hostEnd == std::string::npos) {
+                clientGroup->errorHandler(user);
+                return;
+            }
+            hostname = uri.substr(offset + 1, hostEnd++ - offset - 1);
+        } else {
+            hostEnd = std::min(uri.find_first_of(":/?", offset), uri.length());
+            hostname = uri.substr(offset, hostEnd - offset);
+        }
+
+        size_t pathStart = std::min(uri.find_first_of("/?", hostEnd), uri.length());
+        if (hostEnd < uri.length() && uri[hostEnd] == ':') {
+            port = uri.substr(hostEnd + 1, pathStart - hostEnd - 1);
+        } else if (hostEnd != pathStart) {
+            hostname.clear();
+        }
+        if (pathStart < uri.length()) {
+            path = uri[pathStart] == '?' ? "/" + uri.substr(pathStart) : uri.substr(pathStart);
+        }
+
+        addrinfo hints = {}, *result;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (hostname.empty() || port.empty() || getaddrinfo(hostname.c_str(), port.c_str(), &hints, &result)) {
+            clientGroup->errorHandler(user);
+            return;
+        }
+
+        uv_os_sock_t fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        if (fd == INVALID_SOCKET) {
+            freeaddrinfo(result);
+            clientGroup->errorHandler(user);
+            return;
+        }
+
+        uS::Context::setNonBlocking(fd);
+        if (int busyPollMicros = nodeData->loopOptions->busyPollMicros) {
+            uS::Context::setBusyPoll(fd, busyPollMicros);
+        }
+#ifdef _WIN32
+        bool failed = ::connect(fd, result->ai_addr, (int) result->ai_addrlen) == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK;
+#else
+        bool failed = ::connect(fd, result->ai_addr, result->ai_addrlen) == SOCKET_ERROR && errno != EINPROGRESS;
+#endif
+        freeaddrinfo(result);
+        if (failed) {
+            uS::Context::closeSocket(fd);
+            clientGroup->errorHandler(user);
+            return;
+        }
+
+        SSL *ssl = nullptr;
+        if (secure) {
+            ssl = SSL_new(getClientContext());
+            SSL_set_connect_state(ssl);
+            SSL_set_tlsext_host_name(ssl, hostname.c_str());
+            X509_VERIFY_PARAM *verifyParam = SSL_get0_param(ssl);
+            if (!X509_VERIFY_PARAM_set1_ip_asc(verifyParam, hostname.c_str())) {
+                X509_VERIFY_PARAM_set1_host(verifyParam, hostname.c_str(), 0);
+            }
+        }
+
+        std::string headers;
+        for (const std::pair<const std::string, std::string> &header : extraHeaders) {
+            headers += header.first + ": " + header.second + "\r\n";
+        }
+
+        // without a sliding window our compressor starts over with every message. A dictionary is offered first,
+        // with the usual offer as the alternative for servers that decline the parameter they do not know
+        std::string extensions;
+        if (clientGroup->extensionOptions & PERMESSAGE_DEFLATE) {
+            extensions = clientGroup->extensionOptions & SLIDING_DEFLATE_WINDOW ? "permessage-deflate; server_no_context_takeover; client_max_window_bits" :
+                                                                               "permessage-deflate; client_no_context_takeover; server_no_context_takeover";
+            if (clientGroup->deflateDictionaryId.length()) {
+                extensions = "permessage-deflate; client_no_context_takeover; server_no_context_takeover; x-uws-preset-dictionary=" +
+                             clientGroup->deflateDictionaryId + ", " + extensions;
+            }
+        }
+
+        uS::Socket s((uS::NodeData *) clientGroup, getLoop(), fd, ssl);
+        HttpSocket *httpSocket = new HttpSocket(&s);
+        httpSocket->setUserData(user);
+        httpSocket->upgradeRequest(uri.substr(offset, pathStart - offset), path, headers, extensions.length() ? extensions.c_str() : nullptr);
+        httpSocket->startConnecting(getLoop(), timeoutMs);
     }
 
     void Hub::upgrade(uv_os_sock_t fd, const char *secKey, SSL *ssl, const char *extensions, size_t extensionsLength, const char *subprotocol, size_t subprotocolLength, Group *serverGroup) {
         if (!serverGroup) {
+            // the worker answers the handshake, the fd is all that crosses over
+            if (workers.size()) {
+                Hub *worker = pickWorker(fd);
+                worker->load++;
+                worker->upgradeInbox.push(new CrossThreadUpgrade {{nullptr}, fd, ssl, secKey, std::string(extensions, extensionsLength),
+                                                                  std::string(subprotocol, subprotocolLength)});
+                worker->upgradeAsync->send();
+                return;
+            }
             serverGroup = &getDefaultGroup();
         }
 
+#ifdef UWS_NO_TLS
+        // a build without TLS sockets has nowhere to put the handshake that was done
+        if (ssl) {
+            SSL_free(ssl);
+            uS::Context::closeSocket(fd);
+            return;
+        }
+#endif
+
+        // turned away before a socket, let alone a WebSocket, exists for it
+        WebSocket::PeerAddress peerAddress;
+        if (!serverGroup->admit(fd, peerAddress)) {
+            refuseUpgrade(fd, ssl);
+            if (ssl) {
+                SSL_free(ssl);
+            }
+            uS::Context::closeSocket(fd);
+            return;
+        }
+
         uS::Socket s((uS::NodeData *) serverGroup, this->getLoop(), fd, ssl);
-        s.setNoDelay(true);
+        answerUpgrade(&s, secKey, extensions, extensionsLength, subprotocol, subprotocolLength, serverGroup, peerAddress);
+    }
+
+    void Hub::refuseUpgrade(uv_os_sock_t fd, SSL *ssl, int status) {
+        const char *reason;
+        switch (status) {
+            case 400: reason = "Bad Request"; break;
+            case 401: reason = "Unauthorized"; break;
+            case 403: reason = "Forbidden"; break;
+            case 404: reason = "Not Found"; break;
+            case 429: reason = "Too Many Requests"; break;
+            case 503: reason = "Service Unavailable"; break;
+            default: reason = "Refused";
+        }
+        char response[128];
+        int length = snprintf(response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status, reason);
+        if (ssl) {
+#ifdef UWS_SSL_ASYNC
+            // no job may outlive response, the engine then does its part synchronously
+            SSL_clear_mode(ssl, SSL_MODE_ASYNC);
+#endif
+            SSL_write(ssl, response, length);
+        } else {
+            uS::Context::send(fd, response, length);
+        }
+    }
+
+    WebSocket *Hub::answerUpgrade(uS::Socket *socket, const char *secKey, const char *extensions, size_t extensionsLength, const char *subprotocol, size_t subprotocolLength, Group *serverGroup, const WebSocket::PeerAddress &peerAddress) {
+        uint64_t startedAt = serverGroup->latencyClock();
+        socket->setNoDelay(serverGroup->noDelay);
+        socket->setNotSentLowat(serverGroup->notSentLowat);
 
         bool perMessageDeflate = false;
-        ExtensionsNegotiator extensionsNegotiator(serverGroup->extensionOptions);
-        extensionsNegotiator.readOffer(std::string(extensions, extensionsLength));
-        std::string extensionsResponse = extensionsNegotiator.generateOffer();
+        // whatever the client settles for, the reserved window is never bigger than this one
+        int inflateWindowBits = serverGroup->inflateWindowBits;
+        if (serverGroup->inflateMemoryUsed + Group::inflateWindowMemory(inflateWindowBits) > serverGroup->inflateMemoryBudget) {
+            inflateWindowBits = 0;
+        }
+
+        // and past maxDeflateWindows it gets the shared compressor, as if the group had no sliding windows
+        int extensionOptions = serverGroup->extensionOptions;
+        if ((extensionOptions & SLIDING_DEFLATE_WINDOW) && serverGroup->maxDeflateWindows && serverGroup->deflateWindowSockets >= serverGroup->maxDeflateWindows) {
+            extensionOptions &= ~SLIDING_DEFLATE_WINDOW;
+        }
+
+        ExtensionsNegotiator extensionsNegotiator(extensionOptions, serverGroup->deflateWindowBits, inflateWindowBits);
+        extensionsNegotiator.setDictionary(serverGroup->deflateDictionaryId);
+        extensionsNegotiator.readOffer(std::string_view(extensions, extensionsLength));
+        std::string_view extensionsResponse = extensionsNegotiator.generateOffer();
         if (extensionsNegotiator.getNegotiatedOptions() & PERMESSAGE_DEFLATE) {
             perMessageDeflate = true;
         }
 
-        WebSocket *webSocket = new WebSocket(serverGroup->maxPayload, perMessageDeflate, &s);
+        WebSocket *webSocket = new (serverGroup) WebSocket(perMessageDeflate, socket, extensionsNegotiator.getNegotiatedWindowBits(),
+                                             extensionsNegotiator.getNegotiatedInflateWindowBits());
+        webSocket->presetDictionary = extensionsNegotiator.getNegotiatedDictionary();
+        webSocket->peerAddress = peerAddress;
+        UWS_TRACE(upgrade, UPGRADE, 'I', webSocket, webSocket->getFd());
+        // the 101 and what the connection handler sends go out in one write, unless someone else has the cork
+        // buffer. A close from the handler flushes and lets go of it
+        uS::CorkBuffer *corkBuffer = serverGroup->corkBuffer;
+        bool corked = !corkBuffer->socket;
+        if (corked) {
+            corkBuffer->socket = webSocket;
+        }
         webSocket->upgrade(secKey, extensionsResponse, subprotocol, subprotocolLength);
+        webSocket->adoptKernelTls();
 
-        webSocket->setState<WebSocket>();
+        if (serverGroup->extensionOptions & TRUSTED_PEERS) {
+            webSocket->setState<TrustedWebSocket>();
+        } else {
+            webSocket->setState<WebSocket>();
+        }
         webSocket->change(webSocket, webSocket->setPoll(UV_READABLE));
+        uS::NodeData::clearPendingPollChanges(webSocket);
+
+        // a draining group finishes the handshake only to say it is going away
+        if (serverGroup->draining) {
+            if (corked) {
+                webSocket->cork(false);
+            }
+            webSocket->closeQuietly(1001, nullptr, 0);
+            return webSocket;
+        }
+
         serverGroup->addWebSocket(webSocket);
-        serverGroup->connectionHandler(webSocket);
+        serverGroup->callConnection(webSocket);
+        if (corked && corkBuffer->socket == webSocket) {
+            webSocket->cork(false);
+        }
+        serverGroup->recordLatency(Group::UPGRADE_TIME, startedAt);
+        return webSocket;
+    }
+
+    bool Hub::listenOnLoop(int port, const char *host, SSL_CTX *sslContext, int backlog, bool reusePort, Group *serverGroup) {
+#if defined(USE_MTCP) || defined(UWS_NO_TLS)
+        // OpenSSL reads and writes kernel fds, so TLS terminates in front
+        if (sslContext) {
+            return false;
+        }
+#endif
+        uv_os_sock_t fd = uS::Context::createListenSocket(host, port, backlog, reusePort);
+        if (fd == INVALID_SOCKET) {
+            return false;
+        }
+
+        Listener *listener = new Listener(getLoop(), fd);
+        listener->hub = this;
+        listener->group = serverGroup ? serverGroup : &getDefaultGroup();
+        listener->sslContext = sslContext;
+        if (sslContext) {
+            SSL_CTX_up_ref(sslContext);
+        }
+        listener->setCb(onAccept);
+        listener->start(listener, UV_READABLE);
+        listeners.push_back(listener);
+        return true;
+    }
+
+    // takes a few connections per wakeup so that one busy listener does not starve the sockets of its loop
+    void Hub::onAccept(uS::Poll *p, int status, int events) {
+        Listener *listener = static_cast<Listener *>(p);
+        if (status < 0) {
+            return;
+        }
+
+        for (int i = 0; i < Listener::ACCEPTS_PER_WAKEUP; i++) {
+            uv_os_sock_t fd = uS::Context::acceptSocket(listener->getFd());
+            if (fd == INVALID_SOCKET) {
+                return;
+            }
+            listener->group->counters[uS::NodeData::ACCEPTED_SOCKETS]++;
+
+            Hub *hub = listener->hub;
+            if (int busyPollMicros = hub->nodeData->loopOptions->busyPollMicros) {
+                uS::Context::setBusyPoll(fd, busyPollMicros);
+            }
+
+            SSL *ssl = nullptr;
+            if (listener->sslContext) {
+                ssl = SSL_new(listener->sslContext);
+                SSL_set_accept_state(ssl);
+            }
+
+            uS::Socket s((uS::NodeData *) listener->group, hub->getLoop(), fd, ssl);
+            HttpServerSocket *httpServerSocket = new HttpServerSocket(&s, hub->getLoop());
+            httpServerSocket->template setState<HttpServerSocket>();
+            httpServerSocket->start(httpServerSocket, httpServerSocket->setPoll(UV_READABLE));
+        }
+    }
+
+    bool Hub::listen(int port, const char *host, SSL_CTX *sslContext, int backlog, Group *serverGroup) {
+        if (workers.empty()) {
+            return listenOnLoop(port, host, sslContext, backlog, false, serverGroup);
+        }
+        if (serverGroup && serverGroup != &getDefaultGroup()) {
+            return false;
+        }
+
+        bool listening = true;
+        for (Worker *worker : workers) {
+            std::promise<bool> listened;
+            worker->hub->postTask([&](Hub *hub) {
+                listened.set_value(hub->listenOnLoop(port, host, sslContext, backlog, true, nullptr));
+            });
+            listening = listened.get_future().get() && listening;
+        }
+        return listening;
+    }
+
+    ShardedGroup::ShardedGroup(Hub *hub) : hub(hub) {
+        for (Hub::Worker *worker : hub->workers) {
+            shards.push_back(&worker->hub->getDefaultGroup());
+        }
+        if (shards.empty()) {
+            shards.push_back(&hub->getDefaultGroup());
+        }
+        // the count runs from the start, whether handlers are given or not
+        onConnection([](WebSocket *webSocket) {});
+        onDisconnection([](WebSocket *webSocket, int code, char *message, size_t length) {});
+    }
+
+    void ShardedGroup::eachShard(const std::function<void(Group *)> &f) {
+        if (hub->workers.empty()) {
+            f(shards[0]);
+            return;
+        }
+        for (Group *shard : shards) {
+            std::promise<void> ran;
+            shard->hub->postTask([&](Hub *) {
+                f(shard);
+                ran.set_value();
+            });
+            ran.get_future().get();
+        }
+    }
+
+    void ShardedGroup::onConnection(const std::function<void(WebSocket *)> &handler) {
+        eachShard([this, &handler](Group *shard) {
+            shard->onConnection([this, handler](WebSocket *webSocket) {
+                size.fetch_add(1, std::memory_order_relaxed);
+                handler(webSocket);
+            });
+        });
+    }
+
+    void ShardedGroup::onMessage(const std::function<void(WebSocket *, char *, size_t, OpCode)> &handler) {
+        eachShard([&handler](Group *shard) {
+            shard->onMessage(handler);
+        });
+    }
+
+    void ShardedGroup::onDisconnection(const std::function<void(WebSocket *, int, char *, size_t)> &handler) {
+        eachShard([this, &handler](Group *shard) {
+            shard->onDisconnection([this, handler](WebSocket *webSocket, int code, char *message, size_t length) {
+                size.fetch_sub(1, std::memory_order_relaxed);
+                handler(webSocket, code, message, length);
+            });
+        });
+    }
+
+    void ShardedGroup::forEach(const std::function<void(WebSocket *)> &cb, const std::function<void()> &done) {
+        if (hub->workers.empty()) {
+            shards[0]->forEach(cb);
+            if (done) {
+                done();
+            }
+            return;
+        }
+        std::shared_ptr<std::atomic<size_t>> remaining = std::make_shared<std::atomic<size_t>>(shards.size());
+        for (Group *shard : shards) {
+            shard->hub->postTask([shard, cb, done, remaining](Hub *) {
+                shard->forEach(cb);
+                if (remaining->fetch_sub(1) == 1 && done) {
+                    done();
+                }
+            });
+        }
+    }
+
+    void ShardedGroup::close(int code, const char *message, size_t length) {
+        std::string reason(message ? message : "", message ? length : 0);
+        for (Group *shard : shards) {
+            if (hub->workers.empty()) {
+                shard->close(code, &reason[0], reason.length());
+            } else {
+                shard->hub->postTask([shard, code, reason](Hub *) mutable {
+                    shard->close(code, &reason[0], reason.length());
+                });
+            }
+        }
+    }
+
+    void ShardedGroup::broadcast(const char *message, size_t length, OpCode opCode, bool compress) {
+        Hub::broadcastAcross(shards, message, length, opCode, compress);
+    }
+
+    void Hub::stopListening(Group *serverGroup) {
+        std::vector<Listener *> remaining;
+        for (Listener *listener : listeners) {
+            if (serverGroup && listener->group != serverGroup) {
+                remaining.push_back(listener);
+                continue;
+            }
+            uv_os_sock_t fd = listener->getFd();
+            listener->stop();
+            listener->close([](uS::Poll *p) {
+                Listener *listener = static_cast<Listener *>(p);
+                if (listener->sslContext) {
+                    SSL_CTX_free(listener->sslContext);
+                }
+                delete listener;
+            });
+            uS::Context::closeSocket(fd);
+        }
+        listeners.swap(remaining);
     }
 }
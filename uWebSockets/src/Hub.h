@@ -3,12 +3,39 @@
 
 #include "Group.h"
 #include "Node.h"
+#include "HttpSocket.h"
+#include "MpscQueue.h"
 #include <string>
 #include <zlib.h>
+#ifdef UWS_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include <mutex>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <thread>
+#include <functional>
 
 namespace uWS {
+    // the hub's big buffers: the receive buffer every read goes into, and zlibBuffer, which compressed output
+    // and one-shot inflation go through. Either is at least 4 KB, hugePages backs both as uS::LargeBuffer does
+    struct BufferSettings {
+        size_t recvBufferSize = 300 * 1024;
+        size_t zlibBufferSize = 300 * 1024;
+        bool hugePages = false;
+    };
+
+    // how upgrades are spread over the workers of Hub::startWorkers
+    enum WorkerPlacement {
+        ROUND_ROBIN,
+        // the worker with the fewest sockets, counting upgrades it has not picked up yet
+        LEAST_LOADED,
+        // the worker pinned to the CPU the socket's packets came in on (SO_INCOMING_CPU, Linux), which with
+        // RSS is the one of its NIC queue. Round-robin for sockets no worker is pinned for
+        INCOMING_CPU
+    };
+
     struct WIN32_EXPORT Hub : protected uS::Node, public Group {
         protected:
             struct ConnectionData {
@@ -16,46 +43,442 @@ namespace uWS {
                 void *user;
             };
 
-            static z_stream *allocateDefaultCompressor(z_stream *zStream);
+            static z_stream *allocateDefaultCompressor(z_stream *zStream, int windowBits = 15, const CompressionSettings &settings = CompressionSettings());
+            // between messages, brings a compressor shared by groups from the settings it has to those wanted
+            static void matchCompressor(z_stream *zStream, CompressionSettings &settings, const CompressionSettings &wanted);
 
             z_stream inflationStream = {}, deflationStream = {};
-            char *deflate(char *data, size_t &length, z_stream *slidingDeflateWindow);
-            char *inflate(char *data, size_t &length, size_t maxPayload);
-            char *zlibBuffer;
+            CompressionSettings deflationSettings;
+#ifdef UWS_LIBDEFLATE
+            // one-shot backend for everything deflated without a sliding window and for all
+            // inflation, zlib stays the fallback for what does not fit zlibBuffer. It only has
+            // levels, no memLevel or strategy
+            libdeflate_compressor *oneShotCompressor;
+            int oneShotLevel = 1;
+            void matchOneShotCompressor(int level);
+            libdeflate_decompressor *oneShotDecompressor;
+            std::string inflationInput;
+#endif
+            char *deflate(char *data, size_t &length, z_stream *slidingDeflateWindow, const CompressionSettings &settings);
+            // deflates like deflate without a sliding window, appending to output, but with a compressor of the
+            // calling thread. For threadpool jobs and threads other than the loop's, which keep off deflationStream
+            static size_t deflateOnThread(const char *data, size_t length, const CompressionSettings &settings, std::string &output);
+            // a dictionary, see Group::setDeflateDictionary, primes the shared zlib compressor or inflater for the message
+            size_t deflateBound(size_t length, z_stream *slidingDeflateWindow, const CompressionSettings &settings, const std::string *dictionary = nullptr);
+            size_t deflateInto(const char *data, size_t length, char *dst, size_t capacity, z_stream *slidingDeflateWindow, const std::string *dictionary = nullptr);
+            char *inflate(char *data, size_t &length, size_t maxPayload, z_stream *slidingInflateWindow = nullptr, const std::string *dictionary = nullptr);
+            // what the last inflate returned, from bufferPool
+            char *inflationBuffer = nullptr;
+            size_t inflationCapacity = 0;
+            void releaseInflationBuffer();
+            // the shared compressor and inflater are made by the first message that needs them, zlibBuffer by the
+            // first deflate, so a hub whose groups never compress carries none of them
+            bool deflationReady = false, inflationReady = false;
+            void readyDeflation();
+            void readyInflation();
+            char *zlibBuffer = nullptr;
+            size_t zlibBufferSize;
+            bool hugePages;
             std::string dynamicZlibBuffer;
-            static const int LARGE_BUFFER_SIZE = 300 * 1024;
+            // deflate output past zlibBuffer grows dynamicZlibBuffer, which keeps no more than this between messages
+            static const size_t MAX_RETAINED_ZLIB_BUFFER = 1024 * 1024;
+
+            // deflated frames of messages sent before without a sliding window, most recently used first and
+            // found by a hash of the message and what it was deflated with, see setCompressedCache. Loop thread only
+            struct CompressedCache {
+                struct Entry {
+                    std::string message;
+                    uint64_t key;
+                    WebSocket::PreparedMessage *preparedMessage;
+                };
+                std::list<Entry> entries;
+                std::unordered_multimap<size_t, std::list<Entry>::iterator> index;
+                size_t budget = 0, minLength = 0, bytes = 0;
+                uint64_t hits = 0, misses = 0;
+
+                static uint64_t getKey(OpCode opCode, const CompressionSettings &settings) {
+                    return (uint64_t) opCode | (uint64_t) (settings.level & 255) << 8 | (uint64_t) (settings.memLevel & 255) << 16 |
+                           (uint64_t) (settings.strategy & 255) << 24;
+                }
+                WebSocket::PreparedMessage *find(const char *message, size_t length, uint64_t key);
+                void insert(const char *message, size_t length, uint64_t key, const char *deflated, size_t deflatedLength);
+                // drops the least recently used until bytes fits budget, returns what was freed
+                size_t evict(size_t budget);
+            } compressedCache;
+
+            // one prepared message for one group of this hub, posted from any thread
+            struct CrossThreadBroadcast {
+                std::atomic<CrossThreadBroadcast *> next;
+                Group *group = nullptr;
+                WebSocket::PreparedMessage *preparedMessage = nullptr;
+                uint32_t conflationKey = 0;
+                unsigned int ttlMs = 0;
+            };
+
+            // reassembly and inflation buffers for the sockets of this hub in power of two size classes, bigger
+            // ones are allocated to size and freed right away
+            struct BufferPool {
+                static const int MIN_SIZE_LOG2 = 12, SIZE_CLASSES = 9, MAX_FREE = 4;
+                std::vector<char *> freeBuffers[SIZE_CLASSES];
+
+                char *take(size_t &capacity);
+                void give(char *buffer, size_t capacity);
+                // frees the buffers kept, returns their bytes
+                size_t trim();
+                ~BufferPool();
+            } bufferPool;
+
+            // compressed sends of at least this many bytes deflate on the libuv threadpool, 0 for never
+            size_t compressionOffloadThreshold = 0;
+            // compressed messages received of at least this many bytes inflate on the libuv threadpool, 0 for never
+            size_t inflationOffloadThreshold = 0;
+
+            // messages of the socket being read, for Group::messageBatchHandler
+            std::string batchData;
+            std::vector<BatchedMessage> batchMessages;
+            WebSocket *batchSocket = nullptr;
+
+            // for wss:// connects, created on first use
+            SSL_CTX *clientContext = nullptr;
+            SSL_CTX *getClientContext();
+
+            // one message for the socket of id in group, posted from any thread, see sendById
+            struct CrossThreadSend {
+                std::atomic<CrossThreadSend *> next;
+                Group *group;
+                uint64_t id;
+                std::string message;
+                OpCode opCode;
+                bool compress;
+            };
+
+            // both inboxes are drained by broadcastAsync
+            uS::MpscQueue<CrossThreadBroadcast> broadcastInbox;
+            uS::MpscQueue<CrossThreadSend> sendInbox;
+            uS::Async *broadcastAsync;
+            static void drainBroadcastInbox(uS::Async *async);
+
+            // what Hub::upgrade needs of a socket it hands to a worker
+            struct CrossThreadUpgrade {
+                std::atomic<CrossThreadUpgrade *> next;
+                uv_os_sock_t fd;
+                SSL *ssl;
+                std::string secKey, extensions, subprotocol;
+            };
+
+            // a thread running a hub of its own loop
+            struct Worker {
+                std::thread thread;
+                Hub *hub;
+                // pinned to these, any CPU if empty
+                std::vector<int> cpus;
+            };
+            std::vector<Worker *> workers;
+            WorkerPlacement workerPlacement = ROUND_ROBIN;
+            size_t nextWorker = 0;
+            Hub *pickWorker(uv_os_sock_t fd);
+
+            // as a worker: upgrades handed over, and an async that keeps the loop running until stopWorkers
+            uS::MpscQueue<CrossThreadUpgrade> upgradeInbox;
+            uS::Async *upgradeAsync = nullptr;
+            std::atomic<bool> stopping {false};
+            // sockets of all groups plus upgrades still in upgradeInbox. Kept up by the loop thread and read by
+            // the accepting one, on a line of its own
+            alignas(uS::CACHE_LINE) std::atomic<size_t> load {0};
+            static void drainUpgradeInbox(uS::Async *async);
+
+            // work for the loop thread of this hub, posted from any thread
+            struct CrossThreadTask {
+                std::atomic<CrossThreadTask *> next;
+                std::function<void(Hub *)> run;
+            };
+            uS::MpscQueue<CrossThreadTask> taskInbox;
+            uS::Async *taskAsync;
+            static void drainTaskInbox(uS::Async *async);
+            void postTask(std::function<void(Hub *)> run);
+
+            // a socket of listen, accepting into group of hub
+            struct Listener : uS::Poll {
+                static const int ACCEPTS_PER_WAKEUP = 64;
+                Hub *hub;
+                Group *group;
+                SSL_CTX *sslContext;
+
+                Listener(uS::Loop *loop, uv_os_sock_t fd) : uS::Poll(loop, fd) {}
+            };
+            std::vector<Listener *> listeners;
+            bool listenOnLoop(int port, const char *host, SSL_CTX *sslContext, int backlog, bool reusePort, Group *serverGroup);
+            static void onAccept(uS::Poll *p, int status, int events);
+
+            // answers the upgrade request of socket, which the new WebSocket is moved from. Group::admit
+            // has let it in and read its peer address
+            WebSocket *answerUpgrade(uS::Socket *socket, const char *secKey, const char *extensions, size_t extensionsLength,
+                                     const char *subprotocol, size_t subprotocolLength, Group *serverGroup, const WebSocket::PeerAddress &peerAddress);
+            // a bare 503 for an upgrade Group::admit turned away, or whatever status the group's upgrade request
+            // handler gave, as far as the kernel takes it right away
+            static void refuseUpgrade(uv_os_sock_t fd, SSL *ssl, int status = 503);
+
+            // moves sockets from the most to the least loaded worker, see setWorkerRebalancing
+            uS::Timer *rebalanceTimer = nullptr;
+            size_t rebalanceTolerance = 0;
+            static void rebalanceWorkers(uS::Timer *timer);
+
+            // what handOff writes ahead of each socket, see Hub.cpp
+            struct HandOffRecord;
+            static bool canHandOff(WebSocket *webSocket);
 
         public:
-            Group *createGroup(int extensionOptions = 0, unsigned int maxPayload = 16777216) {
-                return new Group(extensionOptions, maxPayload, this, nodeData);
+            // compressionSettings apply to everything this group deflates, for example {6} for bulk
+            // snapshots or {1, 8, Z_RLE} for streams of small ticks. TRUSTED_PEERS among extensionOptions
+            // is for links between our own services, see TrustedWebSocket
+            Group *createGroup(int extensionOptions = 0, unsigned int maxPayload = 16777216, const CompressionSettings &compressionSettings = CompressionSettings()) {
+                return new Group(extensionOptions, maxPayload, this, nodeData, compressionSettings);
             }
 
             Group &getDefaultGroup() {
                 return static_cast<Group &>(*this);
             }
 
+            void connect(const std::string &uri, void *user = nullptr, const std::map<std::string, std::string> &extraHeaders = {}, int timeoutMs = 5000, Group *clientGroup = nullptr);
             void upgrade(uv_os_sock_t fd, const char *secKey, SSL *ssl, const char *extensions, size_t extensionsLength, const char *subprotocol, size_t subprotocolLength, Group *serverGroup = nullptr);
 
-            Hub(int extensionOptions = 0, unsigned int maxPayload = 16777216) :
-                uS::Node(LARGE_BUFFER_SIZE, WebSocketProtocol<WebSocket>::CONSUME_PRE_PADDING, WebSocketProtocol<WebSocket>::CONSUME_POST_PADDING),
-                Group(extensionOptions, maxPayload, this, nodeData) {
-                    inflateInit2(&inflationStream, -15);
-                    zlibBuffer = new char[LARGE_BUFFER_SIZE];
-                    allocateDefaultCompressor(&deflationStream);
+            // accepts connections on port of host, every address if null, and answers their upgrade requests
+            // itself into the default group, over TLS if sslContext is given. With workers started, each of
+            // them listens on a socket of its own (SO_REUSEPORT) and so accepts on its own thread; without,
+            // this hub does. Requests that are no WebSocket upgrade are closed. serverGroup, one of this hub's,
+            // takes the upgrades instead of the default group, which with workers is the only one there is.
+            // See Group::onUpgradeRequest for a say in which get in, and uS::Context::createServerTlsContext
+            // for a sslContext whose sessions resume on any of the workers
+            // With USE_MTCP only plain TCP over IPv4 is taken, each loop on its own core's mTCP stack.
+            // Hint: call it after startWorkers
+            bool listen(int port, const char *host = nullptr, SSL_CTX *sslContext = nullptr, int backlog = 512, Group *serverGroup = nullptr);
+
+            // closes the sockets of listen on this hub, only those accepting into serverGroup if given.
+            // Connections already accepted stay
+            void stopListening(Group *serverGroup = nullptr);
+
+            // runs on loop, the default loop if null, like one of Loop::createLoop(false) for a thread of its own
+            // or the one node::GetCurrentEventLoop gives a worker_thread. See uS::Node
+            Hub(int extensionOptions = 0, unsigned int maxPayload = 16777216, const CompressionSettings &compressionSettings = CompressionSettings(),
+                const BufferSettings &bufferSettings = BufferSettings(), uS::Loop *loop = nullptr) :
+                uS::Node((int) std::max<size_t>(bufferSettings.recvBufferSize, 4096), WebSocketProtocol<WebSocket>::CONSUME_PRE_PADDING,
+                         WebSocketProtocol<WebSocket>::CONSUME_POST_PADDING, bufferSettings.hugePages, loop),
+                Group(extensionOptions, maxPayload, this, nodeData, compressionSettings) {
+                    hugePages = bufferSettings.hugePages;
+#ifdef UWS_NO_COMPRESSION
+                    // nothing is ever deflated or inflated, see WebSocket::compresses
+                    zlibBufferSize = 0;
+#else
+                    zlibBufferSize = std::max<size_t>(bufferSettings.zlibBufferSize, 4096);
+#endif
+
+                    broadcastAsync = new uS::Async(getLoop());
+                    broadcastAsync->start(drainBroadcastInbox);
+                    broadcastAsync->setData(this);
+                    broadcastAsync->unref();
+
+                    taskAsync = new uS::Async(getLoop());
+                    taskAsync->start(drainTaskInbox);
+                    taskAsync->setData(this);
+                    taskAsync->unref();
                 }
 
+            // for a hub that already exists, like the one of the Node addon. zlibBuffer is released right
+            // away and made again by the next deflate, the receive buffer is replaced on the next loop iteration
+            void setBufferSettings(const BufferSettings &bufferSettings);
+
+            // keeps large compressed sends from stalling the loop, see WebSocket::send
+            void setCompressionOffloadThreshold(size_t threshold) {
+                compressionOffloadThreshold = threshold;
+            }
+
+            // keeps a few large compressed uploads from stalling everyone else: their inflation and UTF-8
+            // validation run on the threadpool while reads of the socket pause, so messages still arrive
+            // in order
+            void setInflationOffloadThreshold(size_t threshold) {
+                inflationOffloadThreshold = threshold;
+            }
+
+            // keeps the deflated frames of compressed sends of at least minLength bytes, without a sliding window,
+            // for up to budget bytes (messages and frames), so that sending the same message again deflates nothing.
+            // For snapshots, configuration and the like sent to every client joining. 0 turns it off and empties it
+            void setCompressedCache(size_t budget, size_t minLength = 1024);
+
+            struct CompressedCacheStats {
+                size_t entries, bytes;
+                uint64_t hits, misses;
+            };
+            CompressedCacheStats getCompressedCacheStats() const {
+                return {compressedCache.entries.size(), compressedCache.bytes, compressedCache.hits, compressedCache.misses};
+            }
+
+            // for buffers of WebSocket::takeMessageBuffer
+            void returnMessageBuffer(char *buffer, size_t capacity) {
+                bufferPool.give(buffer, capacity);
+            }
+
+            // what trim releases: TRIM_BUFFERS the buffers the hub keeps for reuse, like the pooled reassembly and
+            // inflation buffers, the grown deflate output and the compressed cache, TRIM_ALL also zlibBuffer, the free message blocks
+            // and socket slots of the loop and, with glibc, the free pages of the heap. The pools fill up again with use
+            enum TrimLevel {
+                TRIM_BUFFERS,
+                TRIM_ALL
+            };
+
+            // after a burst or on memory pressure. Returns the bytes released, not counting those of the heap
+            size_t trim(TrimLevel level = TRIM_ALL);
+
+            // starts count threads, each running a hub of its own loop made with the settings of this one. From
+            // then on upgrades into the default group go to the default group of a worker picked by placement,
+            // and the socket stays on that thread along with its handlers. init runs on each worker's thread
+            // before it takes any upgrade, to set those handlers and anything else on the worker hub.
+            // Worker i is pinned to cpuSets[i % cpuSets.size()] (Linux) before its hub is made, so its buffers,
+            // blocks and sockets are first touched and so allocated on that CPU's NUMA node.
+            // Hint: handlers run on the worker threads, use broadcastAcross to reach sockets of other threads
+            void startWorkers(int count, const std::function<void(Hub *)> &init, WorkerPlacement placement = ROUND_ROBIN,
+                              const std::vector<std::vector<int>> &cpuSets = {});
+
+            // closes the sockets of every worker's default group and waits for the threads to end
+            void stopWorkers();
+
+            // every intervalMs, moves sockets of the most loaded worker's default group to the least loaded
+            // one, half the difference at a time, whenever the two are more than tolerance sockets apart.
+            // 0 turns it off. Sockets move with migrate, so busy ones are simply left for the next round
+            void setWorkerRebalancing(int intervalMs, size_t tolerance = 16);
+
+            // moves the socket, with its queue, parser state and compression windows, to targetGroup and so
+            // to the loop thread of its hub, where handlers of that group take over. Topics are subscribed to
+            // again in targetGroup. A socket with a job on the threadpool or closing stays put.
+            // Hint: no thread but the socket's own may send to it until the move is done
+            // Thread safe
+            static void migrate(WebSocket *webSocket, Group *targetGroup);
+
+            // for a deploy: passes the WebSockets of group to the process at the other end of fd, a connected
+            // AF_UNIX stream socket, to be taken up by adoptHandOff there. Each goes as its fd (SCM_RIGHTS) with its
+            // parser state, what arrived of a fragmented message, what is still unsent of its queue and its topics,
+            // so the peer notices nothing. Here it leaves through the disconnection handler with 1012, the callbacks
+            // of its queued sends run as sent. Sockets over TLS, client sockets, those whose inflate window holds
+            // history, and those busy streaming, on the threadpool or closing stay. Returns how many went.
+            // Hint: call it on the loop thread of group after stopListening, it blocks until all is written. Both
+            // processes must run the same build
+            static size_t handOff(Group *group, int fd);
+
+            // takes the sockets handOff passes on fd into targetGroup until the other end closes it, without any
+            // handshake, calling the connection handler of targetGroup for each. Returns how many came.
+            // Hint: blocks until then, call it on the loop thread of targetGroup
+            static size_t adoptHandOff(Group *targetGroup, int fd);
+
+            // sends a copy of message to the socket Group::getId gave id for, on the loop thread of group's hub.
+            // Dropped without a word if the socket has left group by then, closed or migrated. Sends by id to
+            // one socket arrive in the order they were made on one thread, not with respect to broadcastAcross
+            // Thread safe
+            static void sendById(Group *group, uint64_t id, const char *message, size_t length, OpCode opCode, bool compress = false);
+
+            // Thread safe
+            static void broadcastAcross(const std::vector<Group *> &groups, const char *message, size_t length, OpCode opCode, bool compress = false);
+
             ~Hub() {
-                inflateEnd(&inflationStream);
-                deflateEnd(&deflationStream);
-                delete [] zlibBuffer;
+                stopWorkers();
+                stopListening();
+                compressedCache.evict(0);
+                drainBroadcastInbox(broadcastAsync);
+                broadcastAsync->close();
+                // sockets still on their way here are dropped with the hub
+                while (CrossThreadTask *crossThreadTask = taskInbox.pop()) {
+                    delete crossThreadTask;
+                }
+                taskAsync->close();
+#ifndef UWS_NO_COMPRESSION
+                releaseInflationBuffer();
+                if (inflationReady) {
+                    inflateEnd(&inflationStream);
+#ifdef UWS_LIBDEFLATE
+                    libdeflate_free_decompressor(oneShotDecompressor);
+#endif
+                }
+                if (deflationReady) {
+                    deflateEnd(&deflationStream);
+#ifdef UWS_LIBDEFLATE
+                    libdeflate_free_compressor(oneShotCompressor);
+#endif
+                }
+                if (zlibBuffer) {
+                    uS::LargeBuffer::free(zlibBuffer, zlibBufferSize, hugePages);
+                }
+#endif
+                if (clientContext) {
+                    SSL_CTX_free(clientContext);
+                }
             }
 
             using uS::Node::getLoop;
+            using uS::Node::setMemoryBlockDepth;
+            using uS::Node::getMemoryBlockStats;
+            using uS::Node::setSocketPoolDepth;
+            using uS::Node::getSocketPoolStats;
+            using uS::Node::getLoopStats;
+            using uS::Node::setCallbackTiming;
+            using uS::Node::timeForeign;
+            using uS::Node::setDeferredWrites;
+            using uS::Node::setZeroCopyThreshold;
+            using uS::Node::setReadBudget;
+            using uS::Node::setWriteBudget;
+            using uS::Node::setBulkShare;
+            using uS::Node::setKernelTls;
+            using uS::Node::setTlsReadAhead;
+            using uS::Node::setBusyPoll;
+            using uS::Node::setEdgeTriggeredWrites;
             using Group::onConnection;
             using Group::onMessage;
+            using Group::onMessageChunk;
+            using Group::onMessageBatch;
             using Group::onDisconnection;
+            using Group::onError;
 
             friend struct WebSocket;
+            friend struct Group;
+            friend struct HttpSocket;
+            friend struct HttpServerSocket;
+            friend struct ShardedGroup;
+    };
+
+    // one logical group over the default groups of the workers of hub, each a shard on its own loop thread, or
+    // over hub itself if it has no workers. Handlers are given once and run on the thread of the shard whose
+    // socket it is, so they must be thread safe. Make it after Hub::startWorkers and before Hub::listen, from
+    // the thread of hub, and keep it until Hub::stopWorkers. Not thread safe unless said otherwise
+    struct WIN32_EXPORT ShardedGroup {
+        private:
+            Hub *hub;
+            std::vector<Group *> shards;
+            std::atomic<size_t> size {0};
+
+            // runs f with each shard on that shard's thread and returns once all have
+            void eachShard(const std::function<void(Group *)> &f);
+
+        public:
+            ShardedGroup(Hub *hub);
+
+            void onConnection(const std::function<void(WebSocket *)> &handler);
+            void onMessage(const std::function<void(WebSocket *, char *, size_t, OpCode)> &handler);
+            void onDisconnection(const std::function<void(WebSocket *, int code, char *message, size_t length)> &handler);
+
+            // calls cb with every socket of every shard, the shards in parallel each on its own thread, then done
+            // once, on the thread of the last shard to finish. Returns right away with workers
+            void forEach(const std::function<void(WebSocket *)> &cb, const std::function<void()> &done = nullptr);
+            // closes the sockets of every shard, each on its own thread
+            void close(int code = 1000, const char *message = nullptr, size_t length = 0);
+            // Thread safe
+            void broadcast(const char *message, size_t length, OpCode opCode, bool compress = false);
+
+            // sockets of all shards, counted as their connection and disconnection handlers run
+            // Thread safe
+            size_t getSize() const {
+                return size.load(std::memory_order_relaxed);
+            }
+
+            const std::vector<Group *> &getShards() const {
+                return shards;
+            }
     };
 }
 
@@ -2,12 +2,28 @@
 #define LIBUV_H
 
 #include <uv.h>
+#include <climits>
 static_assert (UV_VERSION_MINOR >= 3, "µWebSockets requires libuv >=1.3.0");
 
 namespace uS {
     struct Loop : uv_loop_t {
-        static Loop *createLoop() {
-            return static_cast<Loop *>(uv_default_loop());
+        // the default loop, or one of its own for a thread to run
+        static Loop *createLoop(bool defaultLoop = true) {
+            if (defaultLoop) {
+                return static_cast<Loop *>(uv_default_loop());
+            }
+            Loop *loop = new Loop;
+            uv_loop_init(loop);
+            return loop;
+        }
+
+        // lets what is still closing finish and frees a loop of its own, the default loop stays
+        void destroy() {
+            if (this != uv_default_loop()) {
+                uv_run(this, UV_RUN_DEFAULT);
+                uv_loop_close(this);
+                delete this;
+            }
         }
     };
 
@@ -26,6 +42,11 @@ namespace uS {
             uv_async_send(&uv_async);
         }
 
+        // does not keep the loop alive on its own
+        void unref() {
+            uv_unref((uv_handle_t *) &uv_async);
+        }
+
         void close() {
             uv_close((uv_handle_t *) &uv_async, [](uv_handle_t *a) {
                 delete reinterpret_cast<Async *>(a);
@@ -41,40 +62,121 @@ namespace uS {
         }
     };
 
-    struct Poll {
-        uv_poll_t *uv_poll;
-        void (*cb)(Poll *p, int status, int events);
+    struct Timer {
+        uv_timer_t uv_timer;
 
-        Poll(Loop *loop, uv_os_sock_t fd) {
-            uv_poll = new uv_poll_t;
-            uv_poll_init_socket(loop, uv_poll, fd);
-            cb = nullptr;
+        Timer(Loop *loop) {
+            uv_timer_init(loop, &uv_timer);
         }
 
-        Poll(Poll &&other) {
-            uv_poll = other.uv_poll;
-            cb = other.cb;
-            other.uv_poll = nullptr;
+        void start(void (*cb)(Timer *), int first, int repeat) {
+            uv_timer_start(&uv_timer, (uv_timer_cb) cb, first, repeat);
         }
 
-        Poll(const Poll &other) = delete;
+        void stop() {
+            uv_timer_stop(&uv_timer);
+        }
+
+        // does not keep the loop alive on its own
+        void unref() {
+            uv_unref((uv_handle_t *) &uv_timer);
+        }
+
+        void close() {
+            uv_close((uv_handle_t *) &uv_timer, [](uv_handle_t *t) {
+                delete reinterpret_cast<Timer *>(t);
+            });
+        }
 
-        ~Poll() {
-            delete uv_poll;
+        void setData(void *data) {
+            uv_timer.data = data;
+        }
+
+        void *getData() {
+            return uv_timer.data;
+        }
+    };
+
+    // calls back once right after I/O has been processed and once before the loop blocks again
+    struct Check {
+        uv_check_t uv_check;
+        uv_prepare_t uv_prepare;
+        void (*cb)(Check *) = nullptr;
+        void *data = nullptr;
+
+        Check(Loop *loop) {
+            uv_check_init(loop, &uv_check);
+            uv_prepare_init(loop, &uv_prepare);
+            uv_check.data = uv_prepare.data = this;
         }
 
+        void start(void (*cb)(Check *)) {
+            this->cb = cb;
+            uv_check_start(&uv_check, [](uv_check_t *c) {
+                Check *check = static_cast<Check *>(c->data);
+                check->cb(check);
+            });
+            uv_prepare_start(&uv_prepare, [](uv_prepare_t *p) {
+                Check *check = static_cast<Check *>(p->data);
+                check->cb(check);
+            });
+            uv_unref((uv_handle_t *) &uv_check);
+            uv_unref((uv_handle_t *) &uv_prepare);
+        }
+
+        void close() {
+            uv_close((uv_handle_t *) &uv_prepare, nullptr);
+            uv_close((uv_handle_t *) &uv_check, [](uv_handle_t *c) {
+                delete static_cast<Check *>(c->data);
+            });
+        }
+
+        void setData(void *data) {
+            this->data = data;
+        }
+
+        void *getData() {
+            return data;
+        }
+    };
+
+    // the handle is embedded, so a socket is one allocation. Libuv knows of it from the first start on,
+    // before that a Poll can be moved from and destroyed freely
+    struct Poll {
+        uv_poll_t uv_poll;
+        void (*cb)(Poll *p, int status, int events) = nullptr;
+        uv_os_sock_t fd;
+        // what libuv was last given, so starting with the same again costs no uv_poll_start (which
+        // always takes an epoll_ctl on Linux). Errors stop the handle, which forgets it
+        unsigned char armed = 0;
+        bool initialized = false;
+
+        Poll(Loop *loop, uv_os_sock_t fd) : fd(fd) {
+            uv_poll.loop = loop;
+        }
+
+        // takes over the fd. A handle other already polled with is stopped and stays with other,
+        // whose owner closes it, this one polls with a handle of its own from its first start
+        Poll(Poll &&other) : cb(other.cb), fd(other.fd) {
+            uv_poll.loop = other.uv_poll.loop;
+            if (other.initialized) {
+                other.stop();
+#ifndef _WIN32
+                // closing other must leave the fd alone, which this handle may poll by then: libuv would take it out
+                // of epoll (and a debug build like Node's would assert, seeing another watcher on it)
+                other.uv_poll.io_watcher.fd = INT_MAX;
+#endif
+            }
+        }
+
+        Poll(const Poll &other) = delete;
+
         bool isClosed() {
-            return uv_is_closing(reinterpret_cast<uv_handle_t *>(uv_poll));
+            return initialized && uv_is_closing(reinterpret_cast<uv_handle_t *>(&uv_poll));
         }
 
         uv_os_sock_t getFd() const {
-#ifdef _WIN32
-            uv_os_sock_t fd;
-            uv_fileno(static_cast<uv_handle_t *>(uv_poll), static_cast<uv_os_fd_t *>(&fd));
             return fd;
-#else
-            return uv_poll->io_watcher.fd;
-#endif
         }
 
         void setCb(void (*cb)(Poll *p, int status, int events)) {
@@ -85,26 +187,72 @@ namespace uS {
             return cb;
         }
 
-        void start(Poll *self, int events) {
-            uv_poll->data = self;
-            uv_poll_start(uv_poll, events, [](uv_poll_t *p, int status, int events) {
-                Poll *self = static_cast<Poll *>(p->data);
+        // the handle is at the start of the Poll, its data is left to detach
+        // true if it called uv_poll_start, not for what is armed already
+        bool start(Poll *self, int events) {
+            if (!initialized) {
+                uv_poll_init_socket(uv_poll.loop, &uv_poll, fd);
+                initialized = true;
+            } else if (events == armed) {
+                return false;
+            }
+            armed = (unsigned char) events;
+            uv_poll_start(&uv_poll, events, [](uv_poll_t *p, int status, int events) {
+                Poll *self = reinterpret_cast<Poll *>(p);
+                if (status < 0) {
+                    self->armed = 0;
+                }
                 self->cb(self, status, events);
             });
+            return true;
         }
 
-        void change(Poll *self, int events) {
-            start(self, events);
+        bool change(Poll *self, int events) {
+            return start(self, events);
         }
 
         void stop() {
-            uv_poll_stop(uv_poll);
+            if (initialized) {
+                uv_poll_stop(&uv_poll);
+                armed = 0;
+            }
+        }
+
+        // lets go of the loop but not of the fd. The loop is done with the handle only once detached
+        // runs (on its thread), from then on attach can have it poll on another loop with cb as it was
+        void detach(void (*detached)(Poll *p, void *data), void *data) {
+            struct Detach {
+                void (*detached)(Poll *p, void *data);
+                void *data;
+            };
+            uv_poll.data = new Detach {detached, data};
+            uv_close((uv_handle_t *) &uv_poll, [](uv_handle_t *p) {
+                Poll *poll = reinterpret_cast<Poll *>(p);
+                Detach *detach = static_cast<Detach *>(p->data);
+                poll->initialized = false;
+                poll->armed = 0;
+                detach->detached(poll, detach->data);
+                delete detach;
+            });
+        }
+
+        void attach(Loop *loop) {
+            uv_poll.loop = loop;
+        }
+
+        Loop *getLoop() {
+            return static_cast<Loop *>(uv_poll.loop);
         }
 
+        // a Poll libuv never knew of is made known first, so cb still runs from the loop
         void close(void (*cb)(Poll *)) {
+            if (!initialized) {
+                uv_poll_init_socket(uv_poll.loop, &uv_poll, fd);
+                initialized = true;
+            }
             this->cb = (void(*)(Poll *, int, int)) cb;
-            uv_close((uv_handle_t *) uv_poll, [](uv_handle_t *p) {
-                Poll *poll = static_cast<Poll *>(p->data);
+            uv_close((uv_handle_t *) &uv_poll, [](uv_handle_t *p) {
+                Poll *poll = reinterpret_cast<Poll *>(p);
                 void (*cb)(Poll *) = (void(*)(Poll *)) poll->cb;
                 cb(poll);
             });
@@ -0,0 +1,64 @@
+#ifndef MPSCQUEUE_UWS_H
+#define MPSCQUEUE_UWS_H
+
+#include <atomic>
+
+namespace uS {
+    // what state written by different threads is kept apart by, so that one does not keep taking the line
+    // of the other's away (false sharing)
+    static const int CACHE_LINE = 64;
+
+    // intrusive lock-free queue any thread can push to and one thread (the loop owning it) pops from.
+    // T needs a std::atomic<T *> next member and a default constructor (for the stub). The head pushers
+    // exchange and the tail the consumer walks are on lines of their own
+    template <class T>
+    struct MpscQueue {
+        alignas(CACHE_LINE) std::atomic<T *> head;
+        alignas(CACHE_LINE) T *tail;
+        T stub;
+
+        MpscQueue() : head(&stub), tail(&stub) {
+            stub.next.store(nullptr, std::memory_order_relaxed);
+        }
+
+        // Thread safe
+        void push(T *node) {
+            node->next.store(nullptr, std::memory_order_relaxed);
+            T *previous = head.exchange(node, std::memory_order_acq_rel);
+            previous->next.store(node, std::memory_order_release);
+        }
+
+        // returns nullptr when empty, or when a push is only half way through. The
+        // producer wakes the consumer again once it is done, so nothing gets stuck
+        T *pop() {
+            T *tail = this->tail;
+            T *next = tail->next.load(std::memory_order_acquire);
+            if (tail == &stub) {
+                if (!next) {
+                    return nullptr;
+                }
+                this->tail = tail = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+
+            if (next) {
+                this->tail = next;
+                return tail;
+            }
+
+            if (tail != head.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+
+            push(&stub);
+            next = tail->next.load(std::memory_order_acquire);
+            if (next) {
+                this->tail = next;
+                return tail;
+            }
+            return nullptr;
+        }
+    };
+}
+
+#endif // MPSCQUEUE_UWS_H
@@ -1,6 +1,96 @@
 #include "Networking.h"
+#include <cstdlib>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 namespace uS {
+    const char *Trace::names[EVENTS] = {"upgrade", "close", "receive", "deliver", "deflate", "inflate", "backpressure", "transfer"};
+    static const uint8_t traceDisabled = 0;
+    void (*Trace::hook)(Trace::Event event, char phase, const void *id, uint64_t arg) = nullptr;
+    const uint8_t *Trace::enabled = &traceDisabled;
+
+#ifdef __linux__
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+#endif
+
+    char *LargeBuffer::allocate(size_t size, bool hugePages) {
+#ifdef __linux__
+        if (hugePages) {
+            size_t mappedSize = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+            void *memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory != MAP_FAILED) {
+                return (char *) memory;
+            }
+#endif
+
+            // no huge pages reserved, so one huge page more is mapped to cut an aligned range out of
+            char *unaligned = (char *) mmap(nullptr, mappedSize + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (unaligned == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            char *aligned = (char *) (((uintptr_t) unaligned + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+            if (aligned != unaligned) {
+                munmap(unaligned, aligned - unaligned);
+            }
+            munmap(aligned + mappedSize, unaligned + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+            madvise(aligned, mappedSize, MADV_HUGEPAGE);
+#endif
+            return aligned;
+        }
+        if (size >= MAP_THRESHOLD) {
+            void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            return (char *) memory;
+        }
+#endif
+        return new char[size];
+    }
+
+    void LargeBuffer::free(char *buffer, size_t size, bool hugePages) {
+#ifdef __linux__
+        if (hugePages) {
+            munmap(buffer, (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+            return;
+        }
+        if (size >= MAP_THRESHOLD) {
+            munmap(buffer, size);
+            return;
+        }
+#endif
+        delete [] buffer;
+    }
+
+    void *SlotPool::allocateAligned(size_t size) {
+#ifdef _WIN32
+        void *memory = _aligned_malloc(size, CACHE_LINE);
+        if (!memory) {
+            throw std::bad_alloc();
+        }
+#else
+        void *memory;
+        if (posix_memalign(&memory, CACHE_LINE, size)) {
+            throw std::bad_alloc();
+        }
+#endif
+        return memory;
+    }
+
+    void SlotPool::freeAligned(void *memory) {
+#ifdef _WIN32
+        _aligned_free(memory);
+#else
+        ::free(memory);
+#endif
+    }
+
 #ifndef _WIN32
     struct Init {
         Init() {signal(SIGPIPE, SIG_IGN);}
@@ -53,50 +53,178 @@ inline int setsockopt(SOCKET fd, int level, int optname, const void *optval, soc
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <climits>
 #include <cstring>
 #define SOCKET_ERROR -1
 #define INVALID_SOCKET -1
 #define WIN32_EXPORT
 #endif
 
-#if !defined(__linux__) || defined(USE_LIBUV)
+// the sockets of a USE_MTCP build live in mTCP's user space stack on DPDK, which has its own epoll. Standalone
+// Linux builds only: the loop is the one of Epoll.h, and mTCP itself is set up (mtcp_init) before the first Hub
+#ifdef USE_MTCP
+#if !defined(__linux__) || defined(USE_LIBUV) || defined(USE_IO_URING)
+#error "USE_MTCP needs the epoll loop of a Linux build without USE_LIBUV and USE_IO_URING"
+#endif
+#include <mtcp_api.h>
+#include <mtcp_epoll.h>
+#endif
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && !defined(USE_MTCP)
+#include <linux/errqueue.h>
+#define UWS_ZEROCOPY
+#endif
+
+// whole pages of the receive queue mapped into user space instead of copied by recv
+#if defined(__linux__) && defined(TCP_ZEROCOPY_RECEIVE) && !defined(USE_MTCP)
+#include <sys/mman.h>
+#define UWS_ZEROCOPY_RECEIVE
+#endif
+
+// the loop spins only on the backends of Epoll.h, libuv has nowhere to do it
+#if defined(__linux__) && !defined(USE_LIBUV) && defined(SO_BUSY_POLL) && !defined(USE_MTCP)
+#define UWS_BUSY_POLL
+#endif
+
+#if defined(__linux__) && defined(TCP_INFO) && !defined(USE_MTCP)
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#define UWS_TCP_INFO
+#endif
+
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) && !defined(USE_MTCP)
+#define UWS_KTLS
+#endif
+
+#if defined(__linux__) && !defined(USE_MTCP)
+#include <sys/sendfile.h>
+#define UWS_SENDFILE
+#endif
+
+// a hint to start loading the line at p, for walks over sockets that each sit on cold lines of their own
+#if defined(__GNUC__) || defined(__clang__)
+#define UWS_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define UWS_PREFETCH(p) ((void) (p))
+#endif
+
+#if defined(USE_LIBUV) || !(defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
 #include "Libuv.h"
+#else
+#include "Epoll.h"
 #endif
+#include "MpscQueue.h"
+#include "Trace.h"
 #include <openssl/ssl.h>
+
+// TLS crypto as OpenSSL async jobs (SSL_MODE_ASYNC), for engines like QAT that finish it off the loop. Not on
+// Windows, where the fds engines signal on are no SOCKETs, nor with mTCP, whose loop polls only its own sockets
+#if !defined(UWS_NO_TLS) && !defined(_WIN32) && !defined(USE_MTCP) && defined(SSL_MODE_ASYNC) && !defined(OPENSSL_NO_ASYNC)
+#define UWS_SSL_ASYNC
+#endif
+
 #include <csignal>
 #include <vector>
 #include <string>
 #include <mutex>
 #include <algorithm>
 #include <memory>
+#include <unordered_map>
 
 namespace uS {
     // todo: mark sockets nonblocking in these functions
     // todo: probably merge this Context with the TLS::Context for same interface for SSL and non-SSL!
+    // every socket call of the tree goes through here. With USE_MTCP they are mTCP's, on the context of the loop
+    // the calling thread runs, see Loop::mtcpContext
     struct Context {
+        static void closeSocket(uv_os_sock_t fd) {
+#ifdef USE_MTCP
+            mtcp_close(Loop::mtcpContext(), fd);
+#elif defined(_WIN32)
+            closesocket(fd);
+#else
+            close(fd);
+#endif
+        }
 
+        static ssize_t send(uv_os_sock_t fd, const char *data, size_t length, int flags = 0) {
 #ifdef USE_MTCP
-        mtcp_context *mctx;
+            return mtcp_write(Loop::mtcpContext(), fd, data, length);
+#elif defined(_WIN32)
+            return ::send(fd, data, (int) length, 0);
+#else
+            return ::send(fd, data, length, MSG_NOSIGNAL | flags);
 #endif
+        }
 
-        Context() {
-            // mtcp_create_context
+        static ssize_t recv(uv_os_sock_t fd, char *data, size_t length) {
 #ifdef USE_MTCP
-            mctx = mtcp_create_context(0); // cpu index?
+            return mtcp_read(Loop::mtcpContext(), fd, data, length);
+#elif defined(_WIN32)
+            return ::recv(fd, data, (int) length, 0);
+#else
+            return ::recv(fd, data, length, 0);
 #endif
         }
 
-        ~Context() {
+        // mTCP takes few options, what it does not know of is left be
+        static int setOption(uv_os_sock_t fd, int level, int name, int value) {
 #ifdef USE_MTCP
-            mtcp_destroy_context(mctx);
+            return mtcp_setsockopt(Loop::mtcpContext(), fd, level, name, &value, sizeof(int));
+#else
+            return setsockopt(fd, level, name, &value, sizeof(int));
 #endif
         }
 
-        static void closeSocket(uv_os_sock_t fd) {
-#ifdef _WIN32
-            closesocket(fd);
+        // SO_LINGER of 0, so that closing fd resets the connection and the kernel drops what it holds of it at once,
+        // unsent data and FIN_WAIT or TIME_WAIT included
+        static void setAbortiveClose(uv_os_sock_t fd) {
+#ifndef USE_MTCP
+            linger abortive = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, (const char *) &abortive, sizeof(abortive));
+#endif
+        }
+
+        // mTCP has no half close, the peer answering a close frame closes in full
+        static void shutdownWrite(uv_os_sock_t fd) {
+#ifndef USE_MTCP
+            ::shutdown(fd, SHUT_WR);
+#endif
+        }
+
+        // what the kernel knows of a connection: the smoothed rtt in microseconds, the congestion window and the
+        // segments sent but not acked, and the bytes it holds not sent yet. All 0 until sampled
+        struct TcpInfo {
+            uint32_t rtt = 0, cwnd = 0, unacked = 0, notSent = 0;
+        };
+
+        // a getsockopt and an ioctl, false where there is no TCP_INFO
+        static bool getTcpInfo(uv_os_sock_t fd, TcpInfo &info) {
+#ifdef UWS_TCP_INFO
+            tcp_info kernelInfo;
+            socklen_t length = sizeof(kernelInfo);
+            if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &kernelInfo, &length) == -1) {
+                return false;
+            }
+            int notSent = 0;
+            ioctl(fd, SIOCOUTQNSD, &notSent);
+            info.rtt = std::max<uint32_t>(kernelInfo.tcpi_rtt, 1);
+            info.cwnd = kernelInfo.tcpi_snd_cwnd;
+            info.unacked = kernelInfo.tcpi_unacked;
+            info.notSent = (uint32_t) std::max(notSent, 0);
+            return true;
 #else
-            close(fd);
+            return false;
+#endif
+        }
+
+        static int getPeerName(uv_os_sock_t fd, sockaddr *addr, socklen_t *addrLength) {
+#ifdef USE_MTCP
+            return mtcp_getpeername(Loop::mtcpContext(), fd, addr, addrLength);
+#else
+            return getpeername(fd, addr, addrLength);
 #endif
         }
 
@@ -107,59 +235,749 @@ namespace uS {
             return errno == EWOULDBLOCK;// || errno == EAGAIN;
 #endif
         }
+
+        // one element of a gather write, laid out as the platform wants it
+        struct IoVector {
+#ifdef _WIN32
+            WSABUF buf;
+            void set(const char *data, size_t length) {
+                buf.buf = (CHAR *) data;
+                buf.len = (ULONG) length;
+            }
+#else
+            iovec buf;
+            void set(const char *data, size_t length) {
+                buf.iov_base = (void *) data;
+                buf.iov_len = length;
+            }
+#endif
+        };
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+        static const int MAX_IO_VECTORS = IOV_MAX;
+#else
+        static const int MAX_IO_VECTORS = 1024;
+#endif
+
+        static ssize_t sendv(uv_os_sock_t fd, IoVector *vectors, int count, int flags = 0) {
+#ifdef _WIN32
+            DWORD sent;
+            if (WSASend(fd, (WSABUF *) vectors, count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) {
+                return SOCKET_ERROR;
+            }
+            return sent;
+#elif defined(USE_MTCP)
+            return mtcp_writev(Loop::mtcpContext(), fd, (const iovec *) vectors, count);
+#else
+            msghdr msg = {};
+            msg.msg_iov = (iovec *) vectors;
+            msg.msg_iovlen = count;
+            return sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+#endif
+        }
+
+        // up to length bytes of fileDescriptor from offset, which it moves past them, straight from the page cache
+        static ssize_t sendFile(uv_os_sock_t fd, int fileDescriptor, uint64_t &offset, size_t length) {
+#ifdef UWS_SENDFILE
+            off_t position = (off_t) offset;
+            ssize_t sent = sendfile(fd, fileDescriptor, &position, length);
+            offset = (uint64_t) position;
+            return sent;
+#else
+            return SOCKET_ERROR;
+#endif
+        }
+
+        // best effort: above net.core.busy_read SO_BUSY_POLL needs CAP_NET_ADMIN, and older kernels lack the preference
+        static void setBusyPoll(uv_os_sock_t fd, int micros) {
+#ifdef UWS_BUSY_POLL
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &micros, sizeof(int));
+#ifdef SO_PREFER_BUSY_POLL
+            int prefer = 1;
+            setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(int));
+#endif
+#endif
+        }
+
+        static void setNonBlocking(uv_os_sock_t fd) {
+#ifdef _WIN32
+            u_long nonBlocking = 1;
+            ioctlsocket(fd, FIONBIO, &nonBlocking);
+#elif defined(USE_MTCP)
+            mtcp_setsock_nonblock(Loop::mtcpContext(), fd);
+#else
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+        }
+
+        // a non-blocking socket listening on port of host, or of every address if null. With reusePort
+        // each listener of the same port gets its share of the connections from the kernel (SO_REUSEPORT)
+        static uv_os_sock_t createListenSocket(const char *host, int port, int backlog, bool reusePort) {
+            addrinfo hints = {}, *result;
+            hints.ai_flags = AI_PASSIVE;
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(host, std::to_string(port).c_str(), &hints, &result)) {
+                return INVALID_SOCKET;
+            }
+
+#ifdef USE_MTCP
+            // IPv4 is all mTCP speaks, and each core's stack listens on its own share of the NIC (RSS)
+            addrinfo *address = result;
+            while (address && address->ai_family != AF_INET) {
+                address = address->ai_next;
+            }
+            mctx_t mctx = Loop::mtcpContext();
+            uv_os_sock_t fd = address ? mtcp_socket(mctx, AF_INET, SOCK_STREAM, 0) : INVALID_SOCKET;
+            if (fd != INVALID_SOCKET) {
+                if (mtcp_bind(mctx, fd, address->ai_addr, (socklen_t) address->ai_addrlen) || mtcp_listen(mctx, fd, backlog)) {
+                    closeSocket(fd);
+                    fd = INVALID_SOCKET;
+                } else {
+                    setNonBlocking(fd);
+                }
+            }
+            freeaddrinfo(result);
+            return fd;
+#else
+            // without a host, IPv6 takes IPv4 connections along
+            addrinfo *address = result;
+            for (addrinfo *a = result; a && !host; a = a->ai_next) {
+                if (a->ai_family == AF_INET6) {
+                    address = a;
+                    break;
+                }
+            }
+
+            uv_os_sock_t fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (fd != INVALID_SOCKET) {
+                int enabled = 1, disabled = 0;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+#ifdef SO_REUSEPORT
+                if (reusePort) {
+                    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled));
+                }
+#endif
+                if (address->ai_family == AF_INET6) {
+                    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &disabled, sizeof(disabled));
+                }
+                if (bind(fd, address->ai_addr, (socklen_t) address->ai_addrlen) || listen(fd, backlog)) {
+                    closeSocket(fd);
+                    fd = INVALID_SOCKET;
+                } else {
+                    setNonBlocking(fd);
+                }
+            }
+            freeaddrinfo(result);
+            return fd;
+#endif
+        }
+
+        // INVALID_SOCKET once there is nothing left to accept
+        static uv_os_sock_t acceptSocket(uv_os_sock_t fd) {
+#ifdef USE_MTCP
+            uv_os_sock_t acceptedFd = mtcp_accept(Loop::mtcpContext(), fd, nullptr, nullptr);
+            if (acceptedFd != INVALID_SOCKET) {
+                setNonBlocking(acceptedFd);
+            }
+            return acceptedFd;
+#elif defined(__linux__) && defined(SOCK_NONBLOCK)
+            return accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+            uv_os_sock_t acceptedFd = accept(fd, nullptr, nullptr);
+            if (acceptedFd != INVALID_SOCKET) {
+                setNonBlocking(acceptedFd);
+            }
+            return acceptedFd;
+#endif
+        }
+
+#ifdef UWS_ZEROCOPY
+        static bool enableZeroCopy(uv_os_sock_t fd) {
+            int enable = 1;
+            return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+        }
+
+        // drains MSG_ZEROCOPY notifications from the error queue, upTo is the highest completed send
+        static bool readZeroCopyCompletions(uv_os_sock_t fd, uint32_t &upTo) {
+            bool completed = false;
+            while (true) {
+                char control[128];
+                msghdr msg = {};
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+                    return completed;
+                }
+
+                for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                    if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                        (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                        sock_extended_err *serr = (sock_extended_err *) CMSG_DATA(cmsg);
+                        if (serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                            if (!completed || (int32_t) (serr->ee_data - upTo) > 0) {
+                                upTo = serr->ee_data;
+                            }
+                            completed = true;
+                        }
+                    }
+                }
+            }
+        }
+#endif
+
+#ifdef UWS_ZEROCOPY_RECEIVE
+        // mappedLength is what releaseMapped unmaps, skip what recv has to take first when nothing could be mapped
+        struct MappedReceive {
+            char *data = nullptr;
+            size_t length = 0, mappedLength = 0, skip = 0;
+        };
+
+        // up to length bytes of fd's receive queue, in whole pages, mapped read only and taken off the queue
+        // as recv would. Only a queue whose next byte starts a page of the kernel maps, short of that skip
+        // says how many bytes come before one
+        static MappedReceive receiveMapped(uv_os_sock_t fd, size_t length) {
+            static const size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+            MappedReceive mapped;
+            length = std::min<size_t>(length, MAX_MAPPED_RECEIVE) & ~(pageSize - 1);
+            if (!length) {
+                return mapped;
+            }
+
+            void *address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) {
+                return mapped;
+            }
+            tcp_zerocopy_receive zeroCopy = {};
+            zeroCopy.address = (uint64_t) (uintptr_t) address;
+            zeroCopy.length = (uint32_t) length;
+            socklen_t zeroCopyLength = sizeof(zeroCopy);
+            if (getsockopt(fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zeroCopy, &zeroCopyLength) || !zeroCopy.length) {
+                munmap(address, length);
+                mapped.skip = zeroCopy.recv_skip_hint;
+                return mapped;
+            }
+            mapped.data = (char *) address;
+            mapped.length = zeroCopy.length;
+            mapped.mappedLength = length;
+            return mapped;
+        }
+
+        static void releaseMapped(MappedReceive &mapped) {
+            if (mapped.data) {
+                munmap(mapped.data, mapped.mappedLength);
+            }
+        }
+
+        static const size_t MAX_MAPPED_RECEIVE = 16 * 1024 * 1024;
+#endif
+
+#ifndef UWS_NO_TLS
+        // a server context for Hub::listen from PEM files, null if they do not load. The reference is the caller's to
+        // SSL_CTX_free. Every loop listening with it shares its session cache (OpenSSL locks it) and its ticket keys,
+        // so a client resumes whichever worker it lands on. sessionCacheSize is in sessions, sessionTimeout in seconds
+        static SSL_CTX *createServerTlsContext(const char *certChainFile, const char *keyFile, long sessionCacheSize = 20 * 1024, long sessionTimeout = 300) {
+            SSL_CTX *sslContext = SSL_CTX_new(SSLv23_server_method());
+            if (!sslContext) {
+                return nullptr;
+            }
+            SSL_CTX_set_options(sslContext, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+            if (SSL_CTX_use_certificate_chain_file(sslContext, certChainFile) != 1 ||
+                SSL_CTX_use_PrivateKey_file(sslContext, keyFile, SSL_FILETYPE_PEM) != 1 ||
+                SSL_CTX_check_private_key(sslContext) != 1) {
+                SSL_CTX_free(sslContext);
+                return nullptr;
+            }
+
+            // session IDs resume in the cache, tickets with the keys, both of the context and not of a loop
+            static const unsigned char SESSION_ID_CONTEXT[] = "uWS";
+            SSL_CTX_set_session_id_context(sslContext, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+            SSL_CTX_set_session_cache_mode(sslContext, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(sslContext, sessionCacheSize);
+            SSL_CTX_set_timeout(sslContext, sessionTimeout);
+            return sslContext;
+        }
+
+        // replaces the ticket keys OpenSSL made up for sslContext, so that processes given the same keys (or one
+        // taking over from another, see Hub::handOff) resume each other's tickets. 80 bytes from OpenSSL 1.1, 48 before
+        static bool setSessionTicketKeys(SSL_CTX *sslContext, const unsigned char *keys, size_t length) {
+            return SSL_CTX_set_tlsext_ticket_keys(sslContext, (void *) keys, (long) length) == 1;
+        }
+#endif
     };
 
     struct Socket;
 
-    // NodeData is like a Context, maybe merge them?
+    // long lived buffers too big for the block allocator, like the receive buffer. With hugePages they are
+    // mapped from reserved huge pages (MAP_HUGETLB) on Linux, or else 2 MB aligned and advised for
+    // transparent huge pages. Elsewhere hugePages is ignored. Freeing takes what allocating did.
+    // Also for huge messages: from MAP_THRESHOLD on a buffer is a mapping of its own on Linux, unmapped
+    // when freed, where the heap would keep the pages of one long after (glibc raises its own threshold)
+    struct WIN32_EXPORT LargeBuffer {
+        static const size_t MAP_THRESHOLD = 1024 * 1024;
+        static char *allocate(size_t size, bool hugePages = false);
+        static void free(char *buffer, size_t size, bool hugePages = false);
+    };
+
+    // slab of per size class free lists, shared by a Node and every Group copying its NodeData
+    struct WIN32_EXPORT BlockAllocator {
+        // 16 byte apart classes up to 1 KB, then powers of two up to MAX_BLOCK_SIZE
+        static const int FINE_BLOCK_SIZE = 1024;
+        static const int MAX_BLOCK_SIZE = 64 * 1024;
+        static const int SIZE_CLASSES = (FINE_BLOCK_SIZE >> 4) + 7;
+
+        struct Stats {
+            size_t hits, misses, cachedBlocks, cachedBytes;
+        };
+
+        BlockAllocator(int depth = 32) : depth(depth) {}
+
+        ~BlockAllocator() {
+            setDepth(0);
+        }
+
+        static int getIndex(size_t length) {
+            if (length <= FINE_BLOCK_SIZE) {
+                return (int) ((length >> 4) + bool(length & 15));
+            }
+            int index = FINE_BLOCK_SIZE >> 4;
+            for (size_t size = FINE_BLOCK_SIZE; size < length; size <<= 1) {
+                index++;
+            }
+            return index;
+        }
+
+        static size_t getSize(int index) {
+            if (index <= FINE_BLOCK_SIZE >> 4) {
+                return index << 4;
+            }
+            return (size_t) FINE_BLOCK_SIZE << (index - (FINE_BLOCK_SIZE >> 4));
+        }
+
+        char *allocate(int index) {
+            SizeClass &sizeClass = sizeClasses[index];
+            if (sizeClass.head) {
+                FreeBlock *block = sizeClass.head;
+                sizeClass.head = block->next;
+                sizeClass.count--;
+                stats.hits++;
+                stats.cachedBlocks--;
+                stats.cachedBytes -= getSize(index);
+                return (char *) block;
+            }
+            stats.misses++;
+            return new char[std::max<size_t>(getSize(index), sizeof(FreeBlock))];
+        }
+
+        void free(char *memory, int index) {
+            SizeClass &sizeClass = sizeClasses[index];
+            if (sizeClass.count < depth) {
+                FreeBlock *block = (FreeBlock *) memory;
+                block->next = sizeClass.head;
+                sizeClass.head = block;
+                sizeClass.count++;
+                stats.cachedBlocks++;
+                stats.cachedBytes += getSize(index);
+            } else {
+                delete [] memory;
+            }
+        }
+
+        // how many free blocks each size class keeps, lowering it releases the excess
+        void setDepth(int depth) {
+            this->depth = depth;
+            for (int i = 0; i < SIZE_CLASSES; i++) {
+                SizeClass &sizeClass = sizeClasses[i];
+                while (sizeClass.count > depth) {
+                    FreeBlock *block = sizeClass.head;
+                    sizeClass.head = block->next;
+                    sizeClass.count--;
+                    stats.cachedBlocks--;
+                    stats.cachedBytes -= getSize(i);
+                    delete [] (char *) block;
+                }
+            }
+        }
+
+        int getDepth() const {
+            return depth;
+        }
+
+        // the cached counts are kept along, so this is cheap enough to poll
+        Stats getStats() const {
+            return stats;
+        }
+
+    private:
+        struct FreeBlock {
+            FreeBlock *next;
+        };
+
+        struct SizeClass {
+            FreeBlock *head = nullptr;
+            int count = 0;
+        } sizeClasses[SIZE_CLASSES];
+
+        int depth;
+        Stats stats = {};
+    };
+
+    // cache line aligned slots of one size for the WebSockets of a Node, the size of the first one asked for.
+    // A slot goes back once the socket's close has completed. Like the blocks above each slot is its own
+    // allocation, so one freed on another loop after a migration simply joins that loop's pool
+    struct WIN32_EXPORT SlotPool {
+        // inUse and highWater count what this pool handed out or took over (see transfer) and not got back
+        struct Stats {
+            size_t inUse, highWater, cachedSlots, slotSize, hits, misses;
+        };
+
+        SlotPool(int depth = 1024) : depth(depth) {}
+
+        ~SlotPool() {
+            setDepth(0);
+        }
+
+        void *allocate(size_t size) {
+            if (!stats.slotSize) {
+                stats.slotSize = (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+            }
+            transfer(1);
+            if (FreeSlot *slot = head) {
+                head = slot->next;
+                count--;
+                stats.hits++;
+                return slot;
+            }
+            stats.misses++;
+            return allocateAligned(stats.slotSize);
+        }
+
+        void free(void *memory) {
+            transfer(-1);
+            if (count < depth) {
+                FreeSlot *slot = (FreeSlot *) memory;
+                slot->next = head;
+                head = slot;
+                count++;
+            } else {
+                freeAligned(memory);
+            }
+        }
+
+        // a socket migrating to this pool's loop (1) or away from it (-1), whose slot one of them frees
+        void transfer(int sockets) {
+            stats.inUse += sockets;
+            stats.highWater = std::max(stats.highWater, stats.inUse);
+        }
+
+        // how many free slots are kept, lowering it releases the excess
+        void setDepth(int depth) {
+            this->depth = depth;
+            while (count > depth) {
+                FreeSlot *slot = head;
+                head = slot->next;
+                count--;
+                freeAligned(slot);
+            }
+        }
+
+        int getDepth() const {
+            return depth;
+        }
+
+        Stats getStats() const {
+            Stats result = stats;
+            result.cachedSlots = count;
+            return result;
+        }
+
+    private:
+        struct FreeSlot {
+            FreeSlot *next;
+        };
+        FreeSlot *head = nullptr;
+        int count = 0, depth;
+        Stats stats = {};
+
+        static void *allocateAligned(size_t size);
+        static void freeAligned(void *memory);
+    };
+
+    // per loop buffer collecting everything sent to the one socket currently corked in user space
+    struct CorkBuffer {
+        static const int SIZE = 16 * 1024;
+        char data[SIZE];
+        size_t length = 0;
+        Socket *socket = nullptr;
+    };
+
+    // per loop scratch buffer packing consecutive queued messages into one TLS record
+    struct RecordBuffer {
+        // largest TLS plaintext record
+        static const int SIZE = 16 * 1024;
+        char data[SIZE];
+    };
+
+    // the buffer every read goes into, shared by the Node and every Group copying its NodeData so
+    // that a replaced one reaches all of them. data is memoryBlock past its pre padding
+    struct ReceiveBuffer {
+        char *memoryBlock;
+        char *data;
+        int length;
+        // of memoryBlock, as LargeBuffer::free wants it
+        int size;
+        bool hugePages;
+    };
+
+    // per loop tunables, shared by the Node and every Group copying its NodeData
+    struct LoopOptions {
+        // sends of at least this many bytes use MSG_ZEROCOPY where available, 0 disables it
+        size_t zeroCopyThreshold = 0;
+        // plain TCP sockets read again within one readable event until the kernel runs dry,
+        // up to this many reads or bytes whichever comes first. 1 read is one recv per event
+        int readBudgetReads = 1;
+        size_t readBudgetBytes = 1024 * 1024;
+        // a writable plain TCP socket writes at most this many bytes or completes this many messages before it
+        // yields to the others and goes on from the deferred writes. 0 is no limit
+        size_t writeBudgetBytes = 0;
+        unsigned int writeBudgetMessages = 0;
+        // TLS handshakes made here ask OpenSSL to hand the record layer to the kernel when the cipher allows it
+        bool kernelTls = false;
+        // the read buffer of TLS sockets made from now on, which OpenSSL fills with as many records as the kernel
+        // has. 0 reads record by record, see Node::setTlsReadAhead
+        size_t tlsReadAhead = 64 * 1024;
+        // accepted and connecting sockets busy poll their NIC queue this long instead of waiting for its interrupt
+        int busyPollMicros = 0;
+        // plain TCP sockets made from now on register edge triggered, see Poll::edgeTriggered in Epoll.h
+        bool edgeTriggeredWrites = false;
+        // TLS sockets made from now on run their crypto as async jobs, see Socket::waitAsync
+        bool asyncCrypto = false;
+        // what the queues of QOS_BULK sockets write in all per pass of the deferred writes, 0 is no limit. See
+        // Node::setBulkShare
+        size_t bulkShareBytes = 256 * 1024;
+        // some group is not QOS_INTERACTIVE, so flushDeferredWrites serves the sockets class by class
+        bool qosClasses = false;
+    };
+
+    // what the loop did so far, shared like LoopOptions. Plain increments on the loop thread
+    struct LoopStats {
+        // foreignNanos is the part of callbackNanos spent in the embedder's code, like the JS of the Node addon,
+        // so callbackNanos less foreignNanos is what the sockets cost natively: parsing, compression and flushing.
+        // idleNanos is what the loop spent blocked waiting for events
+        struct Stats {
+            uint64_t iterations, wakeups, callbackNanos, foreignNanos, idleNanos;
+        };
+
+        // calls of NodeData::flushDeferredWrites, which both loops run twice per iteration
+        uint64_t checkPasses = 0;
+        // Asyncs handled, of poll changes and mail as well as the inboxes of the Hub
+        uint64_t wakeups = 0;
+        // spent in the io handlers of sockets while timeCallbacks, two clock reads per event so off by default
+        uint64_t callbackNanos = 0, foreignNanos = 0;
+        bool timeCallbacks = false;
+        // of io handlers running, a handler called from inside another one is timed as part of it. Likewise
+        // for the embedder's code, which may call back into it
+        int depth = 0, foreignDepth = 0;
+
+        Stats getStats() const {
+            return {checkPasses / 2, wakeups, callbackNanos, foreignNanos, 0};
+        }
+
+        // times the io handler it is made at the start of into callbackNanos
+        struct Timing {
+            LoopStats *stats;
+            uint64_t start = 0;
+
+            Timing(LoopStats *stats) : stats(stats->timeCallbacks ? stats : nullptr) {
+                if (this->stats && !this->stats->depth++) {
+                    start = uv_hrtime();
+                }
+            }
+
+            ~Timing() {
+                if (stats && !--stats->depth) {
+                    stats->callbackNanos += uv_hrtime() - start;
+                }
+            }
+        };
+
+        // made by the embedder around the code of its own it calls from the handlers of the sockets, times it into
+        // foreignNanos. Outside of an io handler it counts nothing, that time is not in callbackNanos either
+        struct Foreign {
+            LoopStats *stats;
+            uint64_t start = 0;
+
+            Foreign(LoopStats *stats) : stats(stats->timeCallbacks && stats->depth ? stats : nullptr) {
+                if (this->stats && !this->stats->foreignDepth++) {
+                    start = uv_hrtime();
+                }
+            }
+
+            ~Foreign() {
+                if (stats && !--stats->foreignDepth) {
+                    stats->foreignNanos += uv_hrtime() - start;
+                }
+            }
+        };
+    };
+
+    // sockets whose writes are held back until the end of the loop iteration,
+    // either all writes when enabled or only the ones asking for it (like publishes)
+    struct DeferredWrites {
+        bool enabled = false;
+        std::vector<Socket *> sockets;
+        Check *check = nullptr;
+        // of LoopOptions::bulkShareBytes, what is left of it until the next pass
+        size_t bulkLeft = (size_t) -1;
+    };
+
+    // NodeData is like a Context, maybe merge them? What belongs to the loop is allocated once by the Node and
+    // only pointed to, so a Group copying its NodeData shares it. The pointers and the rest read by any thread
+    // come first, what the loop thread keeps writing starts a cache line of its own
     struct WIN32_EXPORT NodeData {
-        char *recvBufferMemoryBlock;
-        char *recvBuffer;
-        int recvLength;
+        ReceiveBuffer *recvBuffer;
         uS::Context *netContext;
         void *user = nullptr;
-        static const int preAllocMaxSize = 1024;
-        char **preAlloc;
+        static const int preAllocMaxSize = BlockAllocator::MAX_BLOCK_SIZE;
+        BlockAllocator *blockAllocator;
+        SlotPool *slotPool;
+        CorkBuffer *corkBuffer;
+        RecordBuffer *recordBuffer;
+        DeferredWrites *deferredWrites;
+        LoopOptions *loopOptions;
+        LoopStats *loopStats;
 
         Async *async = nullptr;
         pthread_t tid;
 
-        std::recursive_mutex *asyncMutex;
-        std::vector<Poll *> transferQueue;
-        std::vector<Poll *> changePollQueue;
+        // bytes of the send messages allocated by the sockets of this NodeData and not freed yet, see
+        // Socket::messageMemory. A Group counts its own from zero
+        alignas(CACHE_LINE) size_t messageMemory = 0;
+        // what the sockets of this NodeData did so far, plain increments on the loop thread. QUEUEING_SOCKETS
+        // is those holding messages right now, QUEUE_HIGH_WATER the most bytes one held, EXPIRED_MESSAGES those
+        // dropped unsent past their Socket::setExpiry. SOCKOPT_CALLS counts setsockopt, TCP_CORK both ways included,
+        // POLL_CHANGES the polls actually re-armed. A Group counts its own from zero, see uWS::Group::getMetrics
+        enum Counter {
+            READ_CALLS, WRITE_CALLS, TLS_READ_CALLS, TLS_WRITE_CALLS, ACCEPTED_SOCKETS,
+            BLOCK_MESSAGES, HEAP_MESSAGES, QUEUEING_SOCKETS, QUEUE_HIGH_WATER, EXPIRED_MESSAGES,
+            SOCKOPT_CALLS, POLL_CHANGES, COUNTERS
+        };
+        uint64_t counters[COUNTERS] = {};
+        // log2 buckets of nanoseconds, bucket i counts 2^i to 2^(i + 1), the last also longer ones
+        static const int LATENCY_BUCKETS = 32;
+        static void recordLatency(uint64_t *histogram, uint64_t nanoseconds) {
+            int bucket = 0;
+            while (nanoseconds >>= 1) {
+                bucket++;
+            }
+            histogram[std::min(bucket, LATENCY_BUCKETS - 1)]++;
+        }
+        // the histogram of how long messages stay allocated, from send to their last byte written, while
+        // uWS::Group::setLatencyHistograms has it on. nullptr takes no timestamps
+        uint64_t *queueLatency = nullptr;
+        // where the nanoseconds of flushing queues on writable go while uWS::Group::setCpuAccounting has it on
+        uint64_t *flushNanos = nullptr;
+        // stamps messages with their time of allocation, for queueLatency and uWS::Group::setSlowConsumer
+        bool stampMessages = false;
+        // small frames queued behind others are appended to a chunk of this many bytes, 0 for a message each.
+        // See Group::setSendChunkSize
+        size_t sendChunkSize = 0;
+        // of TCP_NOTSENT_LOWAT on its sockets, and what Socket::flushQueue writes per writable event. 0 is
+        // neither. See Group::setNotSentLowat
+        unsigned int notSentLowat = 0;
+        // of uWS::Group::setQos. Deferred writes of realtime sockets go first and those of bulk ones last, whose
+        // queues also share LoopOptions::bulkShareBytes per pass and who read once per readable event
+        enum Qos : unsigned char {
+            QOS_REALTIME,
+            QOS_INTERACTIVE,
+            QOS_BULK
+        };
+        Qos qos = QOS_INTERACTIVE;
+        // of uWS::Group::setRateLimit, a bucket of bytes per socket that Socket::flushQueue draws on, leaving
+        // the rest queued. A socket is in it only while its bucket is short of full. nullptr is no limit
+        struct RateLimit {
+            struct Bucket {
+                size_t tokens;
+                // left with a queue for want of tokens, to be deferred again by the refill
+                bool starved;
+            };
+            size_t bytesPerSecond, burst;
+            std::unordered_map<Socket *, Bucket> buckets;
+
+            size_t tokens(Socket *socket) {
+                auto it = buckets.find(socket);
+                return it == buckets.end() ? burst : it->second.tokens;
+            }
+
+            void charge(Socket *socket, size_t bytes) {
+                if (bytes) {
+                    Bucket &bucket = buckets.emplace(socket, Bucket {burst, false}).first->second;
+                    bucket.tokens -= std::min(bytes, bucket.tokens);
+                }
+            }
+
+            // adds bytes to every bucket, up to burst. Starved sockets are deferred to write again, full
+            // buckets leave. Defined in Socket.cpp
+            void refill(size_t bytes);
+        };
+        RateLimit *rateLimit = nullptr;
+
+        // a socket whose poll was changed or that got mail off the loop thread, handled by asyncCallback.
+        // Cancelling clears socket, the node stays queued until then
+        struct PollChange {
+            std::atomic<PollChange *> next;
+            std::atomic<Socket *> socket {nullptr};
+        };
+        // an atomic pointer held by a socket, which moves along with it
+        template <class T>
+        struct MovablePointer : std::atomic<T *> {
+            MovablePointer() : std::atomic<T *>(nullptr) {}
+            MovablePointer(MovablePointer &&other) : std::atomic<T *>(other.exchange(nullptr)) {}
+        };
+        struct ChangePollQueue : MpscQueue<PollChange> {
+            // from the first wakeup until asyncCallback takes the queue, later ones skip the Async. Written
+            // by both sides, so off the line of the tail
+            alignas(CACHE_LINE) std::atomic<bool> wakeupPending {false};
+        };
+        // shared by all groups of the node like the buffers above
+        ChangePollQueue *changePollQueue;
         static void asyncCallback(Async *async);
+        // wakes the loop for what was just queued, or leaves that to the WakeupBatch of this thread
+        void wakeLoop();
+        static void flushDeferredWrites(Check *check);
 
         static int getMemoryBlockIndex(size_t length) {
-            return (int) ((length >> 4) + bool(length & 15));
+            return BlockAllocator::getIndex(length);
         }
 
         char *getSmallMemoryBlock(int index) {
-            if (preAlloc[index]) {
-                char *memory = preAlloc[index];
-                preAlloc[index] = nullptr;
-                return memory;
-            } else {
-                return new char[index << 4];
-            }
+            return blockAllocator->allocate(index);
         }
 
         void freeSmallMemoryBlock(char *memory, int index) {
-            if (!preAlloc[index]) {
-                preAlloc[index] = memory;
-            } else {
-                delete [] memory;
-            }
+            blockAllocator->free(memory, index);
         }
 
         public:
-        void clearPendingPollChanges(Poll *p) {
-            asyncMutex->lock();
-            changePollQueue.erase(
-                std::remove(changePollQueue.begin(), changePollQueue.end(), p),
-                changePollQueue.end()
-            );
-            asyncMutex->unlock();
-        }
+        // cancels the poll change and mail another thread left for a closing socket, and drops its bucket of
+        // rateLimit. Loop thread only, takes no lock
+        static void clearPendingPollChanges(Socket *socket);
+    };
+
+    // held by a producer thread around a burst of cross-thread sends, which then wake each loop they
+    // went to once when it is submitted, instead of once per send. Batches nest, the outermost submits
+    struct WIN32_EXPORT WakeupBatch {
+        WakeupBatch();
+        ~WakeupBatch();
+
+        // wakes every loop queued to since the last submit, the batch stays open
+        void submit();
+
+    private:
+        std::vector<NodeData *> nodes;
+        WakeupBatch *outer;
+
+        friend struct NodeData;
     };
 }
 
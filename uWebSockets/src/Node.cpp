@@ -1,37 +1,134 @@
 #include "Node.h"
 
 namespace uS {
-    Node::Node(int recvLength, int prePadding, int postPadding) {
+    Node::Node(int recvLength, int prePadding, int postPadding, bool hugePages, Loop *loop) : prePadding(prePadding), postPadding(postPadding) {
         nodeData = new NodeData;
-        nodeData->recvBufferMemoryBlock = new char[recvLength];
-        nodeData->recvBuffer = nodeData->recvBufferMemoryBlock + prePadding;
-        nodeData->recvLength = recvLength - prePadding - postPadding;
+        nodeData->recvBuffer = new ReceiveBuffer;
+        allocateReceiveBuffer(recvLength, hugePages);
 
         nodeData->tid = pthread_self();
-        loop = Loop::createLoop();
+        this->loop = loop = loop ? loop : Loop::createLoop();
 
         // each node has a context
         nodeData->netContext = new Context();
-        nodeData->asyncMutex = &asyncMutex;
+        nodeData->changePollQueue = new NodeData::ChangePollQueue();
+        nodeData->async = new Async(loop);
+        nodeData->async->start(NodeData::asyncCallback);
+        nodeData->async->setData(nodeData);
+        nodeData->async->unref();
 
-        int indices = NodeData::getMemoryBlockIndex(NodeData::preAllocMaxSize) + 1;
-        nodeData->preAlloc = new char*[indices];
-        for (int i = 0; i < indices; i++) {
-            nodeData->preAlloc[i] = nullptr;
+        nodeData->blockAllocator = new BlockAllocator();
+        nodeData->slotPool = new SlotPool();
+        nodeData->corkBuffer = new CorkBuffer();
+        nodeData->recordBuffer = new RecordBuffer();
+        nodeData->deferredWrites = new DeferredWrites();
+        nodeData->deferredWrites->check = new Check(loop);
+        nodeData->deferredWrites->check->setData(nodeData);
+        nodeData->deferredWrites->check->start(NodeData::flushDeferredWrites);
+        nodeData->loopOptions = new LoopOptions();
+        nodeData->loopStats = new LoopStats();
+    }
+
+    void Node::setZeroCopyThreshold(size_t threshold) {
+#ifdef UWS_ZEROCOPY
+        nodeData->loopOptions->zeroCopyThreshold = threshold;
+#endif
+    }
+
+    void Node::setKernelTls(bool enable) {
+#ifdef UWS_KTLS
+        nodeData->loopOptions->kernelTls = enable;
+#endif
+    }
+
+    void Node::setAsyncCrypto(bool enable) {
+#ifdef UWS_SSL_ASYNC
+        nodeData->loopOptions->asyncCrypto = enable;
+#endif
+    }
+
+    void Node::setBusyPoll(int micros) {
+#ifdef UWS_BUSY_POLL
+        nodeData->loopOptions->busyPollMicros = std::max(micros, 0);
+        loop->busyPollMicros = std::max(micros, 0);
+#endif
+    }
+
+    void Node::setEdgeTriggeredWrites(bool enable) {
+#ifdef UWS_EDGE_TRIGGERED
+        nodeData->loopOptions->edgeTriggeredWrites = enable;
+#endif
+    }
+
+    void Node::setReadBudget(int reads, size_t bytes) {
+        nodeData->loopOptions->readBudgetReads = std::max(reads, 1);
+        nodeData->loopOptions->readBudgetBytes = bytes;
+    }
+
+    void Node::setWriteBudget(size_t bytes, unsigned int messages) {
+        nodeData->loopOptions->writeBudgetBytes = bytes;
+        nodeData->loopOptions->writeBudgetMessages = messages;
+    }
+
+    void Node::setDeferredWrites(bool enable) {
+        DeferredWrites *deferredWrites = nodeData->deferredWrites;
+        if (!enable) {
+            NodeData::flushDeferredWrites(deferredWrites->check);
         }
+        deferredWrites->enabled = enable;
+    }
+
+    void Node::allocateReceiveBuffer(int size, bool hugePages) {
+        ReceiveBuffer *recvBuffer = nodeData->recvBuffer;
+        recvBuffer->memoryBlock = LargeBuffer::allocate(size, hugePages);
+        recvBuffer->data = recvBuffer->memoryBlock + prePadding;
+        recvBuffer->length = size - prePadding - postPadding;
+        recvBuffer->size = size;
+        recvBuffer->hugePages = hugePages;
+    }
+
+    // what setReceiveBuffer swaps in once its timer fires
+    struct Node::ReceiveBufferReplacement {
+        Node *node;
+        int size;
+        bool hugePages;
+    };
+
+    void Node::setReceiveBuffer(int recvLength, bool hugePages) {
+        Timer *timer = new Timer(loop);
+        timer->setData(new ReceiveBufferReplacement {this, std::max(recvLength, prePadding + postPadding + 4096), hugePages});
+        timer->start(replaceReceiveBuffer, 0, 0);
+    }
+
+    void Node::replaceReceiveBuffer(Timer *timer) {
+        ReceiveBufferReplacement *replacement = (ReceiveBufferReplacement *) timer->getData();
+        ReceiveBuffer *recvBuffer = replacement->node->nodeData->recvBuffer;
+        LargeBuffer::free(recvBuffer->memoryBlock, recvBuffer->size, recvBuffer->hugePages);
+        replacement->node->allocateReceiveBuffer(replacement->size, replacement->hugePages);
+
+        delete replacement;
+        timer->stop();
+        timer->close();
     }
 
     Node::~Node() {
-        delete [] nodeData->recvBufferMemoryBlock;
+        LargeBuffer::free(nodeData->recvBuffer->memoryBlock, nodeData->recvBuffer->size, nodeData->recvBuffer->hugePages);
+        delete nodeData->recvBuffer;
 
-        int indices = NodeData::getMemoryBlockIndex(NodeData::preAllocMaxSize) + 1;
-        for (int i = 0; i < indices; i++) {
-            if (nodeData->preAlloc[i]) {
-                delete [] nodeData->preAlloc[i];
-            }
-        }
-        delete [] nodeData->preAlloc;
+        delete nodeData->blockAllocator;
+        delete nodeData->slotPool;
+        delete nodeData->corkBuffer;
+        delete nodeData->recordBuffer;
+        nodeData->deferredWrites->check->close();
+        delete nodeData->deferredWrites;
+        delete nodeData->loopOptions;
+        delete nodeData->loopStats;
         delete nodeData->netContext;
+        nodeData->async->close();
+        while (NodeData::PollChange *pollChange = nodeData->changePollQueue->pop()) {
+            delete pollChange;
+        }
+        delete nodeData->changePollQueue;
         delete nodeData;
     }
 }
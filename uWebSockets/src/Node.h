@@ -3,22 +3,115 @@
 
 #include "Socket.h"
 #include <vector>
-#include <mutex>
 
 namespace uS {
     class WIN32_EXPORT Node {
         protected:
             Loop *loop;
             NodeData *nodeData;
-            std::recursive_mutex asyncMutex;
+            // kept around the receive buffer's data
+            int prePadding, postPadding;
+            void allocateReceiveBuffer(int size, bool hugePages);
+            struct ReceiveBufferReplacement;
+            static void replaceReceiveBuffer(Timer *timer);
 
         public:
-            Node(int recvLength = 1024, int prePadding = 0, int postPadding = 0);
+            // runs on loop, the default loop if null. A loop of Loop::createLoop(false) is for its creator to destroy after the node
+            Node(int recvLength = 1024, int prePadding = 0, int postPadding = 0, bool hugePages = false, Loop *loop = nullptr);
             ~Node();
 
             Loop *getLoop() {
                 return loop;
             }
+
+            // free blocks kept per size class of the message allocator
+            void setMemoryBlockDepth(int depth) {
+                nodeData->blockAllocator->setDepth(depth);
+            }
+
+            BlockAllocator::Stats getMemoryBlockStats() const {
+                return nodeData->blockAllocator->getStats();
+            }
+
+            // free WebSocket slots kept for the next connections
+            void setSocketPoolDepth(int depth) {
+                nodeData->slotPool->setDepth(depth);
+            }
+
+            // WebSockets alive on this node's loop, the most there were at once and the slots kept
+            SlotPool::Stats getSocketPoolStats() const {
+                return nodeData->slotPool->getStats();
+            }
+
+            // loop iterations, Async wakeups and nanoseconds spent in the io handlers of sockets so far, and of that
+            // in the embedder's code, the latter two only while setCallbackTiming has it on. Then the nanoseconds the
+            // loop was blocked, with libuv only if the loop was configured with UV_METRICS_IDLE_TIME, as Node's is
+            LoopStats::Stats getLoopStats() const {
+                LoopStats::Stats stats = nodeData->loopStats->getStats();
+#if !defined(UV_VERSION_HEX) || UV_VERSION_HEX >= 0x012700
+                stats.idleNanos = uv_metrics_idle_time(loop);
+#endif
+                return stats;
+            }
+
+            // held by the embedder while its own code runs from a handler, see LoopStats::Foreign
+            LoopStats::Foreign timeForeign() {
+                return LoopStats::Foreign(nodeData->loopStats);
+            }
+
+            // two clock reads per socket event, so off by default
+            void setCallbackTiming(bool enable) {
+                nodeData->loopStats->timeCallbacks = enable;
+            }
+
+            // holds writes back until the end of the loop iteration so each socket gets one write per iteration
+            void setDeferredWrites(bool enable);
+
+            // plain TCP sends of at least threshold bytes use MSG_ZEROCOPY on Linux, 0 turns it off
+            void setZeroCopyThreshold(size_t threshold);
+
+            // how much one readable event may read from a plain TCP socket before yielding to the others
+            void setReadBudget(int reads, size_t bytes);
+
+            // how much one writable plain TCP socket may write before the others get their turn. The rest of its
+            // queue goes on at the end of the loop iteration, round robin with the other sockets past their budget.
+            // 0 for either is no limit, both 0 (the default) write until the kernel is full
+            void setWriteBudget(size_t bytes, unsigned int messages);
+
+            // what the queues of all sockets of QOS_BULK groups write in all per pass of the deferred writes, twice
+            // an iteration, before the rest waits for the next one (256 KB by default). 0 is no limit, see Group::setQos
+            void setBulkShare(size_t bytes) {
+                nodeData->loopOptions->bulkShareBytes = bytes;
+            }
+
+            // TLS sockets made from now on read ahead into an OpenSSL buffer of bytes (64 KB by default), one read
+            // syscall for as many records as the kernel holds instead of two per record, and have every record
+            // decrypted by a read handed to the parser at once. 0 turns it off. Not with kTLS, which reads for itself
+            void setTlsReadAhead(size_t bytes) {
+                nodeData->loopOptions->tlsReadAhead = bytes;
+            }
+
+            // lets OpenSSL hand TLS records to the kernel (kTLS) after handshakes made from now on, WebSockets
+            // with both directions offloaded then send and receive as plain TCP. Without kernel support it does nothing
+            void setKernelTls(bool enable);
+
+            // has OpenSSL run the TLS crypto of sockets made from now on as async jobs (SSL_MODE_ASYNC), so that an
+            // engine loaded beforehand, like QAT's, does it off the loop. A paused socket waits on the engine's fd
+            // among the others. Their writes always go through the queue then. Without OpenSSL 1.1 it does nothing
+            void setAsyncCrypto(bool enable);
+
+            // low latency at the cost of a core: sockets accepted or connected from now on busy poll their NIC queue
+            // (SO_BUSY_POLL, SO_PREFER_BUSY_POLL) and the loop polls without blocking for up to micros before it sleeps.
+            // Only on the epoll and io_uring loops, 0 turns it off
+            void setBusyPoll(int micros);
+
+            // plain TCP sockets made from now on keep UV_WRITABLE registered edge triggered, so arming and disarming
+            // it around backpressure costs no epoll_ctl. Only on the epoll loop, the others do nothing with it
+            void setEdgeTriggeredWrites(bool enable);
+
+            // swaps in a receive buffer of recvLength bytes, backed as described at LargeBuffer. That happens
+            // on the next loop iteration, which no read can be in the middle of
+            void setReceiveBuffer(int recvLength, bool hugePages);
     };
 }
 
@@ -0,0 +1,455 @@
+#include "SharedBus.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#endif
+
+namespace uWS {
+    // a process on the ring and what it may want: a bit per hash of a channel and a topic it has, one per channel
+    // it has a group on (for broadcasts) and one per channel with a wildcard topic or last values (for any publish).
+    // Counted locally, so a bit goes when its last topic does. A record goes into the ring only if some process
+    // may want it, and wakes only those. Pending is one past where the first record for it since it last drained
+    // starts, 0 for none. What comes before that it may skip
+    static const uint32_t INTEREST_BITS = 64 * 1024;
+    struct SharedBus::Slot {
+        std::atomic<uint32_t> pid;
+        std::atomic<uint32_t> futex;
+        std::atomic<uint64_t> pending;
+        std::atomic<uint64_t> interest[INTEREST_BITS / 64];
+
+        bool wants(uint32_t bit) const {
+            return interest[bit / 64].load(std::memory_order_relaxed) & ((uint64_t) 1 << (bit % 64));
+        }
+    };
+
+    // the header of the mapping, the messages follow it. Head counts every byte ever appended, so a record
+    // is at head % capacity and a reader knows it fell behind once head is more than capacity past it.
+    // Reserved runs ahead of head while a record is copied in, for readers to see what may be torn
+    struct SharedBus::Ring {
+        static const uint64_t MAGIC = 0x3273756273777575;
+        static const int MAX_PROCESSES = 64;
+        std::atomic<uint64_t> magic;
+        uint64_t capacity;
+        std::atomic<uint64_t> head, reserved;
+#ifdef __linux__
+        pthread_mutex_t mutex;
+#endif
+        Slot slots[MAX_PROCESSES];
+
+        char *data() {
+            return (char *) (this + 1);
+        }
+    };
+
+    // followed by the topic and the payload, padded to 8 bytes in all. None crosses the end of the ring:
+    // the space left before it goes to a PADDING record, or is skipped when too short for one
+    struct SharedBus::Record {
+        enum : unsigned char {
+            PUBLISH = 1,
+            COMPRESS = 2,
+            DEFLATED = 4,
+            PADDING = 8
+        };
+        uint32_t length;
+        uint32_t pid;
+        uint32_t channel;
+        uint16_t topicLength;
+        unsigned char opCode;
+        unsigned char flags;
+        uint64_t payloadLength;
+    };
+
+    // FNV-1a of the channel and the topic, a broadcast hashes the channel alone from another basis
+    static uint32_t interestBit(unsigned int channel, const char *topic, size_t topicLength) {
+        uint64_t hash = topic ? 14695981039346656037ULL : 1469598103934665603ULL;
+        for (int i = 0; i < 4; i++) {
+            hash = (hash ^ ((channel >> (i * 8)) & 255)) * 1099511628211ULL;
+        }
+        for (size_t i = 0; i < topicLength; i++) {
+            hash = (hash ^ (unsigned char) topic[i]) * 1099511628211ULL;
+        }
+        return (uint32_t) (hash ^ (hash >> 32)) % INTEREST_BITS;
+    }
+
+    // the bit of every publish on channel
+    static uint32_t anyTopicBit(unsigned int channel) {
+        return interestBit(channel, "#", 1);
+    }
+
+    SharedBus *SharedBus::join(Hub *hub, const char *name, size_t capacity) {
+#ifdef __linux__
+        std::string path = std::string("/") + name;
+        capacity = std::max<size_t>((capacity + 7) & ~(size_t) 7, 64 * 1024);
+        size_t mappedLength = sizeof(Ring) + capacity;
+
+        bool created = true;
+        int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1 && errno == EEXIST) {
+            created = false;
+            fd = shm_open(path.c_str(), O_RDWR, 0600);
+        }
+        if (fd == -1) {
+            return nullptr;
+        }
+
+        if (created) {
+            if (ftruncate(fd, mappedLength)) {
+                close(fd);
+                shm_unlink(path.c_str());
+                return nullptr;
+            }
+        } else {
+            // the process creating it may still be sizing it
+            struct stat st = {};
+            for (int i = 0; i < 1000 && !fstat(fd, &st) && (size_t) st.st_size < sizeof(Ring); i++) {
+                usleep(1000);
+            }
+            if ((size_t) st.st_size < sizeof(Ring)) {
+                close(fd);
+                return nullptr;
+            }
+            mappedLength = st.st_size;
+        }
+
+        void *memory = mmap(nullptr, mappedLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) {
+            return nullptr;
+        }
+
+        Ring *ring = (Ring *) memory;
+        if (created) {
+            // a process dying with the mutex leaves it to the next one instead of deadlocking the host
+            pthread_mutexattr_t attributes;
+            pthread_mutexattr_init(&attributes);
+            pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&ring->mutex, &attributes);
+            pthread_mutexattr_destroy(&attributes);
+            ring->capacity = capacity;
+            ring->magic.store(Ring::MAGIC, std::memory_order_release);
+        } else {
+            for (int i = 0; i < 1000 && ring->magic.load(std::memory_order_acquire) != Ring::MAGIC; i++) {
+                usleep(1000);
+            }
+            if (ring->magic.load(std::memory_order_acquire) != Ring::MAGIC || sizeof(Ring) + ring->capacity > mappedLength) {
+                munmap(memory, mappedLength);
+                return nullptr;
+            }
+        }
+
+        // that of a process gone without leaving is taken over
+        uint32_t pid = (uint32_t) getpid();
+        Slot *slot = nullptr;
+        for (Slot &candidate : ring->slots) {
+            uint32_t owner = candidate.pid.load(std::memory_order_acquire);
+            if ((!owner || (kill((pid_t) owner, 0) == -1 && errno == ESRCH)) && candidate.pid.compare_exchange_strong(owner, pid)) {
+                for (std::atomic<uint64_t> &word : candidate.interest) {
+                    word.store(0, std::memory_order_relaxed);
+                }
+                candidate.pending.store(0, std::memory_order_relaxed);
+                slot = &candidate;
+                break;
+            }
+        }
+        if (!slot) {
+            munmap(memory, mappedLength);
+            return nullptr;
+        }
+
+        SharedBus *bus = new SharedBus;
+        bus->ring = ring;
+        bus->slot = slot;
+        bus->mappedLength = mappedLength;
+        bus->hub = hub;
+        bus->pid = pid;
+        bus->tail = ring->head.load(std::memory_order_acquire);
+        bus->async = new uS::Async(hub->getLoop());
+        bus->async->setData(bus);
+        bus->async->start(drain);
+        bus->async->unref();
+
+        // wakes up now and then to see whether it is to stop, the futex is its own but shared memory cannot
+        // be waited on privately
+        bus->waiter = std::thread([bus]() {
+            uint32_t seen = bus->slot->futex.load(std::memory_order_acquire);
+            timespec timeout = {0, 100 * 1000 * 1000};
+            while (!bus->stopping.load(std::memory_order_relaxed)) {
+                syscall(SYS_futex, &bus->slot->futex, FUTEX_WAIT, seen, &timeout, nullptr, 0);
+                uint32_t now = bus->slot->futex.load(std::memory_order_acquire);
+                if (now != seen) {
+                    seen = now;
+                    bus->async->send();
+                }
+            }
+        });
+        return bus;
+#else
+        return nullptr;
+#endif
+    }
+
+    void SharedBus::leave() {
+        for (unsigned int channel = 0; channel < channels.size(); channel++) {
+            if (channels[channel]) {
+                channels[channel]->topicObserver = nullptr;
+            }
+        }
+#ifdef __linux__
+        stopping = true;
+        waiter.join();
+        async->close();
+        for (std::atomic<uint64_t> &word : slot->interest) {
+            word.store(0, std::memory_order_relaxed);
+        }
+        slot->pid.store(0, std::memory_order_release);
+        munmap(ring, mappedLength);
+#endif
+        delete this;
+    }
+
+    // the group tells of its topics from here on, for every channel it is attached to
+    void SharedBus::attach(unsigned int channel, Group *group) {
+        if (channel >= channels.size()) {
+            channels.resize(channel + 1);
+        }
+        Group *previous = channels[channel];
+        if (previous == group) {
+            return;
+        }
+        if (previous) {
+            countGroup(channel, previous, -1);
+        }
+        channels[channel] = group;
+        if (previous && std::find(channels.begin(), channels.end(), previous) == channels.end()) {
+            previous->topicObserver = nullptr;
+        }
+
+        if (group) {
+            countGroup(channel, group, 1);
+            group->topicObserver = [this, group](Topic *topic, int change) {
+                for (unsigned int channel = 0; channel < channels.size(); channel++) {
+                    if (channels[channel] == group) {
+                        countTopic(channel, topic, change);
+                    }
+                }
+            };
+        }
+    }
+
+    void SharedBus::countGroup(unsigned int channel, Group *group, int change) {
+        countBit(interestBit(channel, nullptr, 0), change);
+        if (group->lastValues) {
+            countTopic(channel, nullptr, change);
+        }
+        for (std::pair<const std::string, Topic *> &topic : group->topics) {
+            countTopic(channel, topic.second, change);
+        }
+    }
+
+    // wildcard topics and last values (a null topic) want every publish of the channel
+    void SharedBus::countTopic(unsigned int channel, Topic *topic, int change) {
+        if (!topic || topic->pattern) {
+            countBit(anyTopicBit(channel), change);
+        } else {
+            countBit(interestBit(channel, topic->name.data(), topic->name.length()), change);
+        }
+    }
+
+    void SharedBus::countBit(uint32_t bit, int change) {
+        if (interestCounts.empty()) {
+            interestCounts.resize(INTEREST_BITS);
+        }
+        uint32_t &count = interestCounts[bit];
+        uint64_t mask = (uint64_t) 1 << (bit % 64);
+        if (change > 0 && !count++) {
+            slot->interest[bit / 64].fetch_or(mask, std::memory_order_release);
+        } else if (change < 0 && !--count) {
+            slot->interest[bit / 64].fetch_and(~mask, std::memory_order_release);
+        }
+    }
+
+    bool SharedBus::broadcast(unsigned int channel, const char *message, size_t length, OpCode opCode, bool compress) {
+        return append(channel, nullptr, 0, message, length, opCode, compress ? Record::COMPRESS : 0);
+    }
+
+    bool SharedBus::publish(unsigned int channel, const char *topic, size_t topicLength, const char *message, size_t length, OpCode opCode, bool compress) {
+        return append(channel, topic, topicLength, message, length, opCode, Record::PUBLISH | (compress ? Record::COMPRESS : 0));
+    }
+
+    bool SharedBus::broadcast(unsigned int channel, WebSocket::PreparedMessage *preparedMessage) {
+        return appendPrepared(channel, nullptr, 0, preparedMessage);
+    }
+
+    bool SharedBus::publish(unsigned int channel, const char *topic, size_t topicLength, WebSocket::PreparedMessage *preparedMessage) {
+        return appendPrepared(channel, topic, topicLength, preparedMessage);
+    }
+
+    // the plain payload when there is one, which receivers deflate for themselves
+    bool SharedBus::appendPrepared(unsigned int channel, const char *topic, size_t topicLength, WebSocket::PreparedMessage *preparedMessage) {
+        unsigned char flags = topic ? Record::PUBLISH : 0;
+        if (preparedMessage->compressed) {
+            if (preparedMessage->uncompressed) {
+                preparedMessage = preparedMessage->uncompressed;
+                flags |= Record::COMPRESS;
+            } else {
+                flags |= Record::DEFLATED;
+            }
+        }
+        unsigned char lengthCode = preparedMessage->buffer[1] & 127;
+        size_t headerLength = lengthCode < 126 ? 2 : (lengthCode == 126 ? 4 : 10);
+        return append(channel, topic, topicLength, preparedMessage->buffer + headerLength, preparedMessage->length - headerLength, (OpCode) (preparedMessage->buffer[0] & 15), flags);
+    }
+
+    bool SharedBus::append(unsigned int channel, const char *topic, size_t topicLength, const char *message, size_t length, OpCode opCode, unsigned char flags) {
+#ifdef __linux__
+        uint64_t capacity = ring->capacity;
+        size_t recordLength = (sizeof(Record) + topicLength + length + 7) & ~(size_t) 7;
+        if (recordLength > capacity / 4 || topicLength > UINT16_MAX) {
+            return false;
+        }
+
+        // nobody who may want it, nothing to append
+        uint32_t bit = interestBit(channel, topic, topicLength);
+        uint32_t anyBit = topic ? anyTopicBit(channel) : bit;
+        uint64_t receivers = 0;
+        for (int i = 0; i < Ring::MAX_PROCESSES; i++) {
+            Slot &other = ring->slots[i];
+            uint32_t owner = other.pid.load(std::memory_order_acquire);
+            if (owner && owner != pid && (other.wants(bit) || other.wants(anyBit))) {
+                receivers |= (uint64_t) 1 << i;
+            }
+        }
+        if (!receivers) {
+            return true;
+        }
+
+        if (pthread_mutex_lock(&ring->mutex) == EOWNERDEAD) {
+            // its record was never counted in head, this one goes over it
+            pthread_mutex_consistent(&ring->mutex);
+        }
+
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t left = capacity - head % capacity;
+        uint64_t skipped = left < recordLength ? left : 0;
+        ring->reserved.store(head + skipped + recordLength, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        if (skipped >= sizeof(Record)) {
+            Record padding = {};
+            padding.length = (uint32_t) skipped;
+            padding.flags = Record::PADDING;
+            memcpy(ring->data() + head % capacity, &padding, sizeof(Record));
+        }
+        head += skipped;
+
+        Record header = {};
+        header.length = (uint32_t) recordLength;
+        header.pid = pid;
+        header.channel = channel;
+        header.topicLength = (uint16_t) topicLength;
+        header.opCode = (unsigned char) opCode;
+        header.flags = flags;
+        header.payloadLength = length;
+        char *data = ring->data() + head % capacity;
+        memcpy(data, &header, sizeof(Record));
+        memcpy(data + sizeof(Record), topic, topicLength);
+        memcpy(data + sizeof(Record) + topicLength, message, length);
+
+        ring->head.store(head + recordLength, std::memory_order_release);
+        pthread_mutex_unlock(&ring->mutex);
+
+        for (int i = 0; receivers; i++, receivers >>= 1) {
+            if (receivers & 1) {
+                Slot &other = ring->slots[i];
+                uint64_t pending = other.pending.load(std::memory_order_relaxed);
+                while ((!pending || pending > head + 1) && !other.pending.compare_exchange_weak(pending, head + 1, std::memory_order_release)) {}
+                other.futex.fetch_add(1, std::memory_order_release);
+                syscall(SYS_futex, &other.futex, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+            }
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void SharedBus::deliver(const Record &header, const char *topic, const char *payload) {
+        Group *group = header.channel < channels.size() ? channels[header.channel] : nullptr;
+        if (!group) {
+            return;
+        }
+
+        OpCode opCode = (OpCode) header.opCode;
+        if (header.flags & Record::DEFLATED) {
+            WebSocket::PreparedMessage *preparedMessage = WebSocket::prepareMessage((char *) payload, header.payloadLength, opCode, true);
+            if (header.flags & Record::PUBLISH) {
+                group->publish(topic, header.topicLength, preparedMessage);
+            } else {
+                group->broadcast(preparedMessage);
+            }
+            WebSocket::finalizeMessage(preparedMessage);
+        } else if (header.flags & Record::PUBLISH) {
+            group->publish(topic, header.topicLength, payload, header.payloadLength, opCode, header.flags & Record::COMPRESS);
+        } else {
+            group->broadcast(payload, header.payloadLength, opCode, header.flags & Record::COMPRESS);
+        }
+    }
+
+    // each record is copied out before it is looked at, and dropped if a writer may have gone over it meanwhile
+    void SharedBus::drain(uS::Async *async) {
+        SharedBus *bus = (SharedBus *) async->getData();
+        Ring *ring = bus->ring;
+        uint64_t capacity = ring->capacity;
+
+        // no record before the first one for this process was
+        uint64_t pending = bus->slot->pending.exchange(0, std::memory_order_acquire);
+        if (pending && pending - 1 > bus->tail) {
+            bus->tail = pending - 1;
+        }
+
+        for (uint64_t head = ring->head.load(std::memory_order_acquire); bus->tail < head; ) {
+            if (head - bus->tail > capacity) {
+                bus->dropped++;
+                bus->tail = head;
+                break;
+            }
+
+            uint64_t left = capacity - bus->tail % capacity;
+            if (left < sizeof(Record)) {
+                bus->tail += left;
+                continue;
+            }
+
+            Record header;
+            memcpy(&header, ring->data() + bus->tail % capacity, sizeof(Record));
+            bool valid = header.length >= sizeof(Record) && header.length <= left && !(header.length & 7);
+            if (valid && !(header.flags & Record::PADDING)) {
+                bus->record.assign(ring->data() + bus->tail % capacity, header.length);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (ring->reserved.load(std::memory_order_relaxed) > bus->tail + capacity || !valid) {
+                bus->dropped++;
+                bus->tail = ring->head.load(std::memory_order_acquire);
+                break;
+            }
+            bus->tail += header.length;
+
+            if (!(header.flags & Record::PADDING) && header.pid != bus->pid) {
+                const char *topic = bus->record.data() + sizeof(Record);
+                bus->deliver(header, topic, topic + header.topicLength);
+            }
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef SHAREDBUS_UWS_H
+#define SHAREDBUS_UWS_H
+
+#include "Hub.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace uWS {
+    /*
+     * A bus for the processes of one host, like the workers of Node's cluster, on which a
+     * broadcast or publish reaches the sockets of every sibling without a round trip through
+     * Redis. Every process appends to one ring in POSIX shared memory found by its name, under a
+     * robust process-shared mutex. Each process exports a bitmap of hashes of the topics of its
+     * attached groups next to it, and a message goes into the ring and wakes a process only if
+     * that may have a group or topic for it. A thread of each process sleeps on a futex of its
+     * own and wakes its loop, which hands what the others appended to the groups attached to its
+     * channels, as their own broadcast or publish.
+     *
+     * A process more than the ring behind skips to the newest message, see getDropped. At most 64
+     * processes at once. Linux only, join returns null elsewhere. Not thread safe but for the ring
+     * itself
+     *
+     */
+    struct WIN32_EXPORT SharedBus {
+        // maps the ring named name, created with capacity bytes for messages by the first process to
+        // join. The name is without the leading slash of shm_open. Null if it cannot be opened or is full
+        static SharedBus *join(Hub *hub, const char *name, size_t capacity = 4 * 1024 * 1024);
+        // stops the thread, unmaps the ring and deletes this. The ring stays for the processes still on it
+        void leave();
+
+        // what other processes send on channel goes to group here, nullptr detaches it. Its topics, wildcard ones and
+        // last values are exported to the others from now on, a group on the bus tells it of each
+        void attach(unsigned int channel, Group *group);
+
+        // to the group on channel of every other process that has one, and for a publish a topic that may match,
+        // not of this one, which broadcasts or publishes to itself as it always did. compress is left to the
+        // receivers. False if it takes more than a quarter of the ring
+        bool broadcast(unsigned int channel, const char *message, size_t length, OpCode opCode, bool compress = false);
+        bool publish(unsigned int channel, const char *topic, size_t topicLength, const char *message, size_t length, OpCode opCode, bool compress = false);
+        // the payload of preparedMessage, compressed or not, is framed again by each receiver. A compressed one
+        // without an uncompressed variant is cancelled for the sockets that cannot take it, as sendPrepared does
+        bool broadcast(unsigned int channel, WebSocket::PreparedMessage *preparedMessage);
+        bool publish(unsigned int channel, const char *topic, size_t topicLength, WebSocket::PreparedMessage *preparedMessage);
+
+        // times this process fell more than the ring behind and skipped what it had not read yet
+        uint64_t getDropped() const {
+            return dropped;
+        }
+
+    private:
+        struct Ring;
+        struct Record;
+        struct Slot;
+        Ring *ring;
+        // this process's, the counts behind each of its bits are kept here
+        Slot *slot;
+        std::vector<uint32_t> interestCounts;
+        size_t mappedLength;
+        Hub *hub;
+        uS::Async *async;
+        std::thread waiter;
+        std::atomic<bool> stopping {false};
+        // how far into the ring this process has read
+        uint64_t tail;
+        uint64_t dropped = 0;
+        uint32_t pid;
+        std::vector<Group *> channels;
+        // a record as copied out of the ring, before it is handed on
+        std::string record;
+
+        SharedBus() {}
+        bool append(unsigned int channel, const char *topic, size_t topicLength, const char *message, size_t length, OpCode opCode, unsigned char flags);
+        bool appendPrepared(unsigned int channel, const char *topic, size_t topicLength, WebSocket::PreparedMessage *preparedMessage);
+        void deliver(const Record &header, const char *topic, const char *payload);
+        void countGroup(unsigned int channel, Group *group, int change);
+        void countTopic(unsigned int channel, Topic *topic, int change);
+        void countBit(uint32_t bit, int change);
+        static void drain(uS::Async *async);
+    };
+}
+
+#endif // SHAREDBUS_UWS_H
@@ -1,12 +1,126 @@
 #include "Socket.h"
 
 namespace uS {
+    void NodeData::flushDeferredWrites(Check *check) {
+        NodeData *nodeData = static_cast<NodeData *>(check->getData());
+        nodeData->loopStats->checkPasses++;
+        DeferredWrites *deferredWrites = nodeData->deferredWrites;
+        LoopOptions *loopOptions = nodeData->loopOptions;
+        deferredWrites->bulkLeft = loopOptions->bulkShareBytes ? loopOptions->bulkShareBytes : (size_t) -1;
+        if (deferredWrites->sockets.empty()) {
+            return;
+        }
+
+        // writes happening while flushing are picked up by the next call
+        std::vector<Socket *> sockets;
+        sockets.swap(deferredWrites->sockets);
+        for (Socket *socket : sockets) {
+            socket->state.deferred = false;
+        }
+        // one walk per class once there are classes, each in the order they deferred
+        int lastQos = loopOptions->qosClasses ? QOS_BULK : QOS_REALTIME;
+        for (int qos = QOS_REALTIME; qos <= lastQos; qos++) {
+            for (size_t i = 0; i < sockets.size(); i++) {
+                if (i + 8 < sockets.size()) {
+                    UWS_PREFETCH(&sockets[i + 8]->messageQueue);
+                }
+                Socket *socket = sockets[i];
+                // a socket closed by an earlier callback is still allocated until the loop's close phase
+                if ((!loopOptions->qosClasses || socket->nodeData->qos == qos) && !socket->isClosed() && !socket->hasEmptyQueue()) {
+                    socket->getCb()(socket, 0, UV_WRITABLE);
+                }
+            }
+        }
+    }
+
+    // the innermost batch of this thread
+    static thread_local WakeupBatch *currentBatch = nullptr;
+
+    WakeupBatch::WakeupBatch() : outer(currentBatch) {
+        currentBatch = this;
+    }
+
+    WakeupBatch::~WakeupBatch() {
+        submit();
+        currentBatch = outer;
+    }
+
+    // with an outer batch still open the loops go to that one
+    void WakeupBatch::submit() {
+        WakeupBatch *batch = currentBatch;
+        currentBatch = outer;
+        for (NodeData *nodeData : nodes) {
+            nodeData->wakeLoop();
+        }
+        currentBatch = batch;
+        nodes.clear();
+    }
+
+    void NodeData::wakeLoop() {
+        if (currentBatch) {
+            // groups share the queue, so one of their nodes per loop is enough
+            for (NodeData *nodeData : currentBatch->nodes) {
+                if (nodeData->changePollQueue == changePollQueue) {
+                    return;
+                }
+            }
+            currentBatch->nodes.push_back(this);
+        } else if (!changePollQueue->wakeupPending.exchange(true)) {
+            async->send();
+        }
+    }
+
+    void NodeData::asyncCallback(Async *async) {
+        NodeData *nodeData = static_cast<NodeData *>(async->getData());
+        nodeData->loopStats->wakeups++;
+        // cleared before taking the queue, so anything queued from here on wakes the loop again
+        nodeData->changePollQueue->wakeupPending.store(false);
+        while (PollChange *pollChange = nodeData->changePollQueue->pop()) {
+            if (Socket *socket = pollChange->socket.load()) {
+                // cleared before reading the poll and mailbox, so anything after this queues again
+                socket->pendingPollChange.store(nullptr);
+                socket->change(socket, socket->getPoll());
+                socket->takeMail(false);
+            }
+            delete pollChange;
+        }
+    }
+
+    void NodeData::clearPendingPollChanges(Socket *socket) {
+        // nothing pending is the common case, which a plain load answers without a locked exchange
+        if (socket->pendingPollChange.load(std::memory_order_relaxed)) {
+            if (PollChange *pollChange = socket->pendingPollChange.exchange(nullptr)) {
+                pollChange->socket.store(nullptr);
+            }
+        }
+        socket->takeMail(true);
+        if (socket->nodeData->rateLimit) {
+            socket->nodeData->rateLimit->buckets.erase(socket);
+        }
+    }
+
+    void NodeData::RateLimit::refill(size_t bytes) {
+        for (auto it = buckets.begin(); it != buckets.end(); ) {
+            Bucket &bucket = it->second;
+            bucket.tokens = bytes >= burst - bucket.tokens ? burst : bucket.tokens + bytes;
+            if (bucket.starved) {
+                bucket.starved = false;
+                it->first->deferWrite(true);
+            }
+            if (bucket.tokens == burst) {
+                it = buckets.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
     Socket::Address Socket::getAddress() const {
         uv_os_sock_t fd = getFd();
 
         sockaddr_storage addr;
         socklen_t addrLength = sizeof(addr);
-        if (getpeername(fd, (sockaddr *) &addr, &addrLength) == -1) {
+        if (Context::getPeerName(fd, (sockaddr *) &addr, &addrLength) == -1) {
             return {0, "", ""};
         }
 
@@ -2,40 +2,137 @@
 #define SOCKET_UWS_H
 
 #include "Networking.h"
+#include <functional>
 
 namespace uS {
-    // perfectly 64 bytes (4 + 60)
     struct WIN32_EXPORT Socket : Poll {
         protected:
             struct {
                 int poll : 4;
                 int shuttingDown : 4;
-            } state = {0, false};
+                unsigned int kernelCorked : 1;
+                unsigned int deferred : 1;
+                // plaintext of the record the last SSL_write sealed but could not write, which its retry has to
+                // start with byte for byte. What follows may differ, see packRecord
+                unsigned int sslRetryLength : 15;
+                // UV_READABLE or UV_WRITABLE for the SSL_read or SSL_write an async job paused in, see waitAsync
+                unsigned int asyncOp : 2;
+                // TCP_NODELAY as last set, off as the kernel starts out. See setNoDelay
+                unsigned int noDelay : 1;
+            } state = {0, false, false, false, 0, 0, false};
+            // where in deferredWrites->sockets this is while state.deferred, so leaving it is a swap and pop
+            uint32_t deferredIndex = 0;
 
+            // what every read and write touches, right after the poll handle. The rest is for other threads
+            // and the user. A UWS_NO_TLS build has no TLS socket, so every branch on ssl folds away
+#ifdef UWS_NO_TLS
+            static constexpr SSL *ssl = nullptr;
+#else
             SSL *ssl;
-            void *user = nullptr;
+#endif
             NodeData *nodeData;
-            const int HEADER_LENGTH = 10;
+            // largest frame header, the one of a masked client frame
+            static const int HEADER_LENGTH = 14;
 
             struct Queue {
                 struct Message {
+                    // what few messages need, allocated along on first need, see Socket::extendMessage. A heap
+                    // allocated message always has one, in its own allocation
+                    struct Extra {
+                        // optional payload sent after data without having been copied, see sendReferenced
+                        const char *referencedData = nullptr;
+                        size_t referencedLength = 0;
+                        void (*callback)(void *socket, void *data, bool cancelled, void *reserved) = nullptr;
+                        void *callbackData = nullptr, *reserved = nullptr;
+                        // bytes of the heap allocated message holding this, 0 for one of its own
+                        size_t memoryLength = 0;
+                        // size class of the block of one of its own, -1 if part of the message
+                        int memoryIndex = -1;
+                        // uv_hrtime past which the message is dropped unsent, 0 for never, see Socket::setExpiry
+                        uint64_t expiresAt = 0;
+                        // a range of a file sent after data with sendfile instead of referencedData, referencedLength
+                        // being what is left of it. -1 for none, see WebSocket::sendFile
+                        int fileDescriptor = -1;
+                        uint64_t fileOffset = 0;
+                    };
+
+                    // 64 bytes on 64 bit, so a small frame queued under backpressure costs its payload rounded up
+                    // to a size class and one line of header. Prepared messages need no Extra either
                     const char *data;
                     size_t length;
                     Message *nextMessage = nullptr;
-                    void (*callback)(void *socket, void *data, bool cancelled, void *reserved) = nullptr;
-                    void *callbackData = nullptr, *reserved = nullptr;
+                    Extra *extra = nullptr;
+                    // refcounted buffer data points into instead of the message's own memory, released on free
+                    void *sharedBuffer = nullptr;
+                    void (*release)(void *sharedBuffer) = nullptr;
+                    // 1 + id of the last MSG_ZEROCOPY send reading from this message, 0 if none did
+                    uint32_t zeroCopyId = 0;
+                    // a newer message with the same key replaces this one while unsent, 0 for none.
+                    // Cleared once any of it has been written, see started
+                    uint32_t conflationKey = 0;
+                    // size class of the BlockAllocator block holding this message, -1 if heap allocated
+                    int16_t memoryIndex = -1;
+                    // placeholder whose data is still being produced off the loop, see enqueuePending.
+                    // Nothing queued behind it is written before it is completed
+                    bool pending = false;
+                    // a frame enqueuePriority put ahead of what was queued before it
+                    bool priority = false;
+                    // uv_hrtime in microseconds of allocation while NodeData::stampMessages, else 0
+                    uint32_t allocatedAt = 0;
+
+                    bool hasFile() const {
+                        return extra && extra->fileDescriptor != -1;
+                    }
+
+                    size_t referencedLength() const {
+                        return extra ? extra->referencedLength : 0;
+                    }
+
+                    // bytes still to be written of data and the referenced payload
+                    size_t queuedLength() const {
+                        return length + referencedLength();
+                    }
+
+                    // the block or heap allocation of the message and that of an Extra of its own
+                    size_t memoryLength() const {
+                        size_t memoryLength = memoryIndex != -1 ? BlockAllocator::getSize(memoryIndex) : extra->memoryLength;
+                        if (extra && extra->memoryIndex != -1) {
+                            memoryLength += BlockAllocator::getSize(extra->memoryIndex);
+                        }
+                        return memoryLength;
+                    }
+
+                    // some of it was written, so it has to go out in full, neither conflated nor expired
+                    void started() {
+                        conflationKey = 0;
+                        if (extra) {
+                            extra->expiresAt = 0;
+                        }
+                    }
+
+                    bool expired(uint64_t now) const {
+                        return extra && extra->expiresAt && now >= extra->expiresAt;
+                    }
+
+                    // calls back the sender, if it asked for it
+                    void complete(void *socket, bool cancelled) {
+                        if (extra && extra->callback) {
+                            extra->callback(socket, extra->callbackData, cancelled, extra->reserved);
+                        }
+                    }
                 };
+                static_assert(sizeof(Message) <= 8 * sizeof(void *), "uS::Socket::Queue::Message grew");
 
                 Message *head = nullptr, *tail = nullptr;
+                // bytes still to be written over all queued messages
+                size_t bytes = 0;
+
+                // unlinks the front message, freeing it is up to the caller
                 void pop()
                 {
-                    Message *nextMessage;
-                    if ((nextMessage = head->nextMessage)) {
-                        delete [] (char *) head;
-                        head = nextMessage;
-                    } else {
-                        delete [] (char *) head;
-                        head = tail = nullptr;
+                    bytes -= head->queuedLength();
+                    if (!(head = head->nextMessage)) {
+                        tail = nullptr;
                     }
                 }
 
@@ -44,6 +141,7 @@ namespace uS {
 
                 void push(Message *message)
                 {
+                    bytes += message->queuedLength();
                     message->nextMessage = nullptr;
                     if (tail) {
                         tail->nextMessage = message;
@@ -55,6 +153,52 @@ namespace uS {
                 }
             } messageQueue;
 
+            void *user = nullptr;
+            NodeData::MovablePointer<NodeData::PollChange> pendingPollChange;
+
+            // work another thread leaves for the loop thread, run does it or only frees it when cancelled
+            struct Mail {
+                Mail *next;
+                void (*run)(Socket *socket, Mail *mail, bool cancelled);
+            };
+            // pushed onto by any thread, newest first
+            NodeData::MovablePointer<Mail> mailbox;
+
+#ifdef UWS_ZEROCOPY
+            // messages the kernel still reads from after MSG_ZEROCOPY sends, completed in send order
+            struct ZeroCopy {
+                Queue inFlight;
+                uint32_t nextId = 0;
+            };
+#endif
+
+#ifdef UWS_SSL_ASYNC
+            // polls the fd the engine of a paused job signals on, made on the first pause and kept until close
+            struct AsyncWait : Poll {
+                Socket *socket;
+                AsyncWait(Loop *loop, uv_os_sock_t fd) : Poll(loop, fd) {}
+            };
+#endif
+
+#if defined(UWS_ZEROCOPY) || defined(UWS_SSL_ASYNC)
+            // one pointer for both, zeroCopy is only ever of a plain TCP socket and asyncWait of a TLS one
+            union {
+#ifdef UWS_ZEROCOPY
+                ZeroCopy *zeroCopy = nullptr;
+#endif
+#if defined(UWS_SSL_ASYNC) && defined(UWS_ZEROCOPY)
+                AsyncWait *asyncWait;
+#elif defined(UWS_SSL_ASYNC)
+                AsyncWait *asyncWait = nullptr;
+#endif
+            };
+#endif
+
+            // bytes of the messages this socket allocated and did not free yet, queued or in flight. Its
+            // NodeData counts the same, Hub::migrate moves them along with the socket. Last, so that it
+            // shares the line of whatever derives from Socket, touched by every send
+            size_t messageMemory = 0;
+
             int getPoll() {
                 return state.poll;
             }
@@ -68,43 +212,165 @@ namespace uS {
                 state.shuttingDown = shuttingDown;
             }
 
+            // queues the socket for the loop thread once, however often it is called until then
+            void wakeLoop() {
+                if (pendingPollChange.load()) {
+                    return;
+                }
+                NodeData::PollChange *pollChange = new NodeData::PollChange;
+                pollChange->socket.store(this, std::memory_order_relaxed);
+                NodeData::PollChange *expected = nullptr;
+                if (pendingPollChange.compare_exchange_strong(expected, pollChange)) {
+                    nodeData->changePollQueue->push(pollChange);
+                    nodeData->wakeLoop();
+                } else {
+                    delete pollChange;
+                }
+            }
+
+            // Thread safe
+            void postMail(Mail *mail) {
+                Mail *head = mailbox.load();
+                do {
+                    mail->next = head;
+                } while (!mailbox.compare_exchange_weak(head, mail));
+                wakeLoop();
+            }
+
+            // runs or cancels all mail in the order it was posted
+            void takeMail(bool cancelled) {
+                // a plain load first, most sockets never get mail and closing thousands should not lock the bus for each
+                if (!mailbox.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                Mail *mail = mailbox.exchange(nullptr), *oldest = nullptr;
+                while (mail) {
+                    Mail *next = mail->next;
+                    mail->next = oldest;
+                    oldest = mail;
+                    mail = next;
+                }
+                while (oldest) {
+                    Mail *next = oldest->next;
+                    oldest->run(this, oldest, cancelled);
+                    oldest = next;
+                }
+            }
+
+            // those of Poll, counting what re-armed the poll into POLL_CHANGES
+            void start(Poll *self, int events) {
+                nodeData->counters[NodeData::POLL_CHANGES] += Poll::start(self, events);
+            }
+
+            void change(Poll *self, int events) {
+                nodeData->counters[NodeData::POLL_CHANGES] += Poll::change(self, events);
+            }
+
+            // off the loop thread the loop applies whatever poll the socket has by the time it gets to it
             void changePoll(Socket *socket) {
                 if (socket->nodeData->tid != pthread_self()) {
-                    socket->nodeData->asyncMutex->lock();
-                    socket->nodeData->changePollQueue.push_back(socket);
-                    socket->nodeData->asyncMutex->unlock();
-                    socket->nodeData->async->send();
+                    socket->wakeLoop();
                 } else {
                     change(socket, socket->getPoll());
                 }
             }
 
+            // takes the socket off its loop, on its thread and from outside its handlers. Once the loop has let
+            // go of its handle detached runs, on the same thread, and attachToLoop may follow. Everything else,
+            // the fd and the queue included, is memory that goes along as it is
+            void detachFromLoop(std::function<void()> detached) {
+                if (nodeData->corkBuffer->socket == this) {
+                    flushCork();
+                    nodeData->corkBuffer->socket = nullptr;
+                }
+                if (state.deferred) {
+                    // the new loop writes it as backpressure, UV_WRITABLE is armed there
+                    undefer();
+                }
+                if (NodeData::PollChange *pollChange = pendingPollChange.exchange(nullptr)) {
+                    pollChange->socket.store(nullptr);
+                }
+
+                UWS_TRACE(transfer__leave, TRANSFER, 'I', this, getFd());
+                stop();
+                Poll::detach([](Poll *p, void *data) {
+                    std::function<void()> *detached = (std::function<void()> *) data;
+                    (*detached)();
+                    delete detached;
+                }, new std::function<void()>(std::move(detached)));
+            }
+
+            // polls the fd again, on the thread of the loop of nodeData
+            void attachToLoop(NodeData *nodeData, Loop *loop) {
+                this->nodeData = nodeData;
+                Poll::attach(loop);
+                UWS_TRACE(transfer__arrive, TRANSFER, 'I', this, getFd());
+                if (!messageQueue.empty()) {
+                    setPoll(getPoll() | UV_WRITABLE);
+                }
+                start(this, getPoll());
+            }
+
             template <class STATE>
                 static void sslIoHandler(Poll *p, int status, int events) {
                     Socket *socket = static_cast<Socket *>(p);
+                    LoopStats::Timing timing(socket->nodeData->loopStats);
 
                     if (status < 0) {
                         STATE::onEnd(static_cast<Socket *>(p));
                         return;
                     }
 
-                    if (!socket->messageQueue.empty() && ((events & UV_WRITABLE) || SSL_want(socket->ssl) == SSL_READING)) {
+#ifdef UWS_SSL_ASYNC
+                    // while a job is paused only its engine's fd moves the socket on, see waitAsync
+                    if (socket->state.asyncOp) {
+                        socket->stop();
+                        return;
+                    }
+#endif
+
+                    if (!socket->messageQueue.empty() && !socket->messageQueue.front()->pending && ((events & UV_WRITABLE) || SSL_want(socket->ssl) == SSL_READING)) {
+                        // only a queue built up under backpressure drains, not a deferred one
+                        bool backpressured = socket->getPoll() & UV_WRITABLE;
                         socket->cork(true);
                         while (true) {
-                            Queue::Message *messagePtr = socket->messageQueue.front();
-                            ssize_t sent = SSL_write(socket->ssl, messagePtr->data, (int) messagePtr->length);
-                            if (sent == (ssize_t) messagePtr->length) {
-                                if (messagePtr->callback) {
-                                    messagePtr->callback(p, messagePtr->callbackData, false, messagePtr->reserved);
+                            if (!socket->state.sslRetryLength && !socket->dropExpired()) {
+                                if (socket->isClosed()) {
+                                    return;
+                                }
+                                if ((socket->state.poll & UV_WRITABLE) && SSL_want(socket->ssl) != SSL_WRITING) {
+                                    socket->change(socket, socket->setPoll(socket->getPoll() & ~UV_WRITABLE));
+                                }
+                                break;
+                            }
+                            size_t length;
+                            const char *data = socket->packRecord(length);
+                            ssize_t sent = SSL_write(socket->ssl, data, (int) length);
+                            socket->nodeData->counters[NodeData::TLS_WRITE_CALLS]++;
+                            if (sent > 0) {
+                                // with partial writes only a message larger than a record is ever left in part
+                                socket->state.sslRetryLength = 0;
+                                for (size_t remaining = (size_t) sent; remaining; ) {
+                                    Queue::Message *messagePtr = socket->messageQueue.front();
+                                    if (remaining < messagePtr->length) {
+                                        messagePtr->started();
+                                        messagePtr->length -= remaining;
+                                        messagePtr->data += remaining;
+                                        socket->messageQueue.bytes -= remaining;
+                                        break;
+                                    }
+                                    remaining -= messagePtr->length;
+                                    messagePtr->complete(p, false);
+                                    socket->popMessage();
                                 }
-                                socket->messageQueue.pop();
-                                if (socket->messageQueue.empty()) {
+                                if (socket->messageQueue.empty() || socket->messageQueue.front()->pending) {
                                     if ((socket->state.poll & UV_WRITABLE) && SSL_want(socket->ssl) != SSL_WRITING) {
-                                        socket->change(socket, socket->setPoll(UV_READABLE));
+                                        socket->change(socket, socket->setPoll(socket->getPoll() & ~UV_WRITABLE));
                                     }
                                     break;
                                 }
-                            } else if (sent <= 0) {
+                            } else {
+                                socket->state.sslRetryLength = (unsigned int) std::min<size_t>(length, RecordBuffer::SIZE);
                                 switch (SSL_get_error(socket->ssl, sent)) {
                                     case SSL_ERROR_WANT_READ:
                                         break;
@@ -113,6 +379,12 @@ namespace uS {
                                             socket->change(socket, socket->setPoll(socket->getPoll() | UV_WRITABLE));
                                         }
                                         break;
+#ifdef UWS_SSL_ASYNC
+                                    case SSL_ERROR_WANT_ASYNC:
+                                        if (socket->waitAsync(UV_WRITABLE)) {
+                                            break;
+                                        }
+#endif
                                     default:
                                         STATE::onEnd(static_cast<Socket *>(p));
                                         return;
@@ -121,33 +393,65 @@ namespace uS {
                             }
                         }
                         socket->cork(false);
+                        if (backpressured && socket->messageQueue.empty()) {
+                            STATE::onDrain(socket);
+                            if (socket->isClosed()) {
+                                return;
+                            }
+                        }
                     }
 
-                    if (events & UV_READABLE) {
+                    // an SSL_read now would resume the paused SSL_write with the arguments of the read
+                    if ((events & UV_READABLE) && !socket->state.asyncOp) {
                         do {
-                            int length = SSL_read(socket->ssl, socket->nodeData->recvBuffer, socket->nodeData->recvLength);
-                            if (length <= 0) {
-                                switch (SSL_get_error(socket->ssl, length)) {
-                                    case SSL_ERROR_WANT_READ:
-                                        break;
-                                    case SSL_ERROR_WANT_WRITE:
-                                        if ((socket->getPoll() & UV_WRITABLE) == 0) {
-                                            socket->change(socket, socket->setPoll(socket->getPoll() | UV_WRITABLE));
-                                        }
-                                        break;
-                                    default:
-                                        STATE::onEnd(static_cast<Socket *>(p));
-                                        return;
-                                }
-                                break;
-                            } else {
+                            // records OpenSSL holds are decrypted back to back, so that the parser takes as many as fit at once
+                            char *data = socket->nodeData->recvBuffer->data;
+                            int capacity = socket->nodeData->recvBuffer->length, length = 0, read;
+                            do {
+                                read = SSL_read(socket->ssl, data + length, capacity - length);
+                                socket->nodeData->counters[NodeData::TLS_READ_CALLS]++;
+                                length += std::max(read, 0);
+                            } while (read > 0 && length < capacity && SSL_has_pending(socket->ssl));
+                            // taken before onData makes calls of its own on the SSL
+                            int error = read > 0 ? SSL_ERROR_NONE : SSL_get_error(socket->ssl, read);
+
+                            if (length) {
                                 // Warning: onData can delete the socket! Happens when WebSocket upgrades
-                                socket = STATE::onData(static_cast<Socket *>(p), socket->nodeData->recvBuffer, length);
+                                socket = STATE::onData(static_cast<Socket *>(p), data, length);
                                 if (socket->isClosed() || socket->isShuttingDown()) {
                                     return;
                                 }
+                                if (socket != p) {
+                                    // what is left of the record is for the state we upgraded to
+                                    if (SSL_has_pending(socket->ssl)) {
+                                        socket->getCb()(socket, 0, UV_READABLE);
+                                    }
+                                    return;
+                                }
                             }
-                        } while (SSL_pending(socket->ssl));
+
+                            switch (error) {
+                                case SSL_ERROR_NONE:
+                                    continue;
+                                case SSL_ERROR_WANT_READ:
+                                    break;
+                                case SSL_ERROR_WANT_WRITE:
+                                    if ((socket->getPoll() & UV_WRITABLE) == 0) {
+                                        socket->change(socket, socket->setPoll(socket->getPoll() | UV_WRITABLE));
+                                    }
+                                    break;
+#ifdef UWS_SSL_ASYNC
+                                case SSL_ERROR_WANT_ASYNC:
+                                    if (socket->waitAsync(UV_READABLE)) {
+                                        break;
+                                    }
+#endif
+                                default:
+                                    STATE::onEnd(static_cast<Socket *>(p));
+                                    return;
+                            }
+                            break;
+                        } while (SSL_has_pending(socket->ssl) && (socket->getPoll() & UV_READABLE));
                     }
                 }
 
@@ -155,62 +459,134 @@ namespace uS {
                 static void ioHandler(Poll *p, int status, int events) {
                     Socket *socket = static_cast<Socket *>(p);
                     NodeData *nodeData = socket->nodeData;
+                    LoopStats::Timing timing(nodeData->loopStats);
                     Context *netContext = nodeData->netContext;
 
+#ifdef UWS_ZEROCOPY
+                    if (socket->zeroCopy && !socket->zeroCopy->inFlight.empty()) {
+                        uint32_t completed;
+                        if (Context::readZeroCopyCompletions(socket->getFd(), completed)) {
+                            socket->completeZeroCopy(completed);
+                            if (socket->isClosed()) {
+                                return;
+                            }
+                        }
+                    }
+
+                    if (status < 0 && socket->zeroCopy) {
+                        // completions on the error queue show up as POLLERR, which libuv reports as an error
+                        // and stops polling on. Only a pending SO_ERROR means the socket really is broken
+                        int error = 0;
+                        socklen_t errorLength = sizeof(error);
+                        if (!getsockopt(socket->getFd(), SOL_SOCKET, SO_ERROR, &error, &errorLength) && !error) {
+                            socket->change(socket, socket->getPoll());
+                            return;
+                        }
+                    }
+#endif
+
                     if (status < 0) {
                         STATE::onEnd(static_cast<Socket *>(p));
                         return;
                     }
 
                     if (events & UV_WRITABLE) {
-                        if (!socket->messageQueue.empty() && (events & UV_WRITABLE)) {
-                            socket->cork(true);
-                            while (true) {
-                                Queue::Message *messagePtr = socket->messageQueue.front();
-                                ssize_t sent = ::send(socket->getFd(), messagePtr->data, messagePtr->length, MSG_NOSIGNAL);
-                                if (sent == (ssize_t) messagePtr->length) {
-                                    if (messagePtr->callback) {
-                                        messagePtr->callback(p, messagePtr->callbackData, false, messagePtr->reserved);
-                                    }
-                                    socket->messageQueue.pop();
-                                    if (socket->messageQueue.empty()) {
-                                        // todo, remove bit, don't set directly
-                                        socket->change(socket, socket->setPoll(UV_READABLE));
-                                        break;
-                                    }
-                                } else if (sent == SOCKET_ERROR) {
-                                    if (!netContext->wouldBlock()) {
-                                        STATE::onEnd(static_cast<Socket *>(p));
-                                        return;
-                                    }
-                                    break;
-                                } else {
-                                    messagePtr->length -= sent;
-                                    messagePtr->data += sent;
-                                    break;
+                        if (!socket->messageQueue.empty()) {
+                            // only a queue built up under backpressure drains, not a deferred one
+                            bool backpressured = socket->getPoll() & UV_WRITABLE;
+                            uint64_t flushStartedAt = nodeData->flushNanos ? uv_hrtime() : 0;
+                            bool flushed = socket->flushQueue();
+                            if (flushStartedAt) {
+                                *nodeData->flushNanos += uv_hrtime() - flushStartedAt;
+                            }
+                            if (!flushed) {
+                                STATE::onEnd(static_cast<Socket *>(p));
+                                return;
+                            }
+                            if (socket->isClosed()) {
+                                return;
+                            }
+                            if (backpressured && socket->messageQueue.empty()) {
+                                STATE::onDrain(socket);
+                                if (socket->isClosed()) {
+                                    return;
                                 }
                             }
-                            socket->cork(false);
                         }
                     }
 
                     if (events & UV_READABLE) {
-                        int length = (int) recv(socket->getFd(), nodeData->recvBuffer, nodeData->recvLength, 0);
-                        if (length > 0) {
-                            STATE::onData(static_cast<Socket *>(p), nodeData->recvBuffer, length);
-                        } else if (length <= 0 || (length == SOCKET_ERROR && !netContext->wouldBlock())) {
-                            STATE::onEnd(static_cast<Socket *>(p));
+                        // a short read means the kernel is drained, which saves waiting for EAGAIN
+                        LoopOptions *loopOptions = nodeData->loopOptions;
+                        size_t bytes = 0;
+                        for (int reads = 1; ; reads++) {
+                            char *data = nodeData->recvBuffer->data;
+                            int capacity = nodeData->recvBuffer->length, length;
+#ifdef UWS_ZEROCOPY_RECEIVE
+                            // pages the state wants mapped rather than copied, or recv up to where they start
+                            Context::MappedReceive mapped;
+                            if (size_t mappable = STATE::mappableBytes(socket)) {
+                                mapped = Context::receiveMapped(socket->getFd(), mappable);
+                                if (mapped.data) {
+                                    data = mapped.data;
+                                    capacity = INT_MAX;
+                                } else if (mapped.skip) {
+                                    capacity = (int) std::min<size_t>(capacity, mapped.skip);
+                                }
+                            }
+                            if (mapped.data) {
+                                length = (int) mapped.length;
+                            } else
+#endif
+                            length = (int) Context::recv(socket->getFd(), data, capacity);
+                            nodeData->counters[NodeData::READ_CALLS]++;
+                            if (length > 0) {
+                                // an upgrade can delete the socket, so it is compared before anything else
+                                bool gone = STATE::onData(socket, data, length) != socket || socket->isClosed();
+#ifdef UWS_ZEROCOPY_RECEIVE
+                                Context::releaseMapped(mapped);
+#endif
+                                if (gone) {
+                                    return;
+                                }
+                                bytes += length;
+                                // reads can pause from within onData, see Hub::setInflationOffloadThreshold
+                                if (length < capacity || !(socket->getPoll() & UV_READABLE)) {
+                                    return;
+                                }
+                                if (socket->isShuttingDown() || reads >= loopOptions->readBudgetReads || bytes >= loopOptions->readBudgetBytes || socket->nodeData->qos == NodeData::QOS_BULK) {
+#ifdef UWS_EDGE_TRIGGERED
+                                    socket->readAgain();
+#endif
+                                    return;
+                                }
+                            } else {
+                                if (length == 0 || !netContext->wouldBlock()) {
+                                    STATE::onEnd(socket);
+                                }
+                                return;
+                            }
                         }
                     }
                 }
 
+#ifdef UWS_ZEROCOPY_RECEIVE
+            // how much of what comes next a STATE would take as mapped pages, see Context::receiveMapped. None by
+            // default, a state wanting them hides this
+            static size_t mappableBytes(Socket *) {
+                return 0;
+            }
+#endif
+
             template<class STATE>
                 void setState() {
+#ifndef UWS_NO_TLS
                     if (ssl) {
                         setCb(sslIoHandler<STATE>);
-                    } else {
-                        setCb(ioHandler<STATE>);
+                        return;
                     }
+#endif
+                    setCb(ioHandler<STATE>);
                 }
 
             bool hasEmptyQueue() const {
@@ -218,14 +594,267 @@ namespace uS {
             }
 
             void enqueue(Queue::Message *message) {
+                if (messageQueue.empty()) {
+                    UWS_TRACE(backpressure__start, BACKPRESSURE, 'b', this, getFd());
+                }
                 messageQueue.push(message);
             }
 
+            // gather-writes as much of the queue as the kernel takes, one syscall per MAX_IO_VECTORS messages.
+            // completed messages have their callbacks fired in order, returns false on socket error. Paced, it
+            // writes at most NodeData::notSentLowat bytes and waits for UV_WRITABLE with the rest, and past the
+            // write budget of LoopOptions defers the rest so that every writable socket gets its turn. A NodeData::RateLimit
+            // out of tokens leaves the rest to its refill
+            bool flushQueue(bool paced = true) {
+                Context::IoVector vectors[Context::MAX_IO_VECTORS];
+                LoopOptions *loopOptions = nodeData->loopOptions;
+                size_t lowatBudget = paced && nodeData->notSentLowat ? nodeData->notSentLowat : (size_t) -1;
+                size_t writeBudget = paced && loopOptions->writeBudgetBytes ? loopOptions->writeBudgetBytes : (size_t) -1;
+                unsigned int messageBudget = paced && loopOptions->writeBudgetMessages ? loopOptions->writeBudgetMessages : UINT_MAX;
+                NodeData::RateLimit *rateLimit = paced ? nodeData->rateLimit : nullptr;
+                // bulk ones write what their class has left of this pass, as the rest of a budget
+                size_t *bulkLeft = paced && nodeData->qos == NodeData::QOS_BULK ? &nodeData->deferredWrites->bulkLeft : nullptr;
+                if (bulkLeft) {
+                    writeBudget = std::min(writeBudget, *bulkLeft);
+                }
+                size_t written = 0;
+                unsigned int completed = 0;
+                uint64_t now = 0;
+                while (dropExpired(&now)) {
+                    size_t tokens = rateLimit ? rateLimit->tokens(this) : (size_t) -1;
+                    if (!tokens) {
+                        // the refill defers it again, the queue waits without UV_WRITABLE
+                        rateLimit->buckets[this].starved = true;
+                        if (getPoll() & UV_WRITABLE) {
+                            change(this, setPoll(getPoll() & ~UV_WRITABLE));
+                        }
+                        return true;
+                    }
+                    if (written >= lowatBudget) {
+                        // TCP_NOTSENT_LOWAT reports writable again once the kernel is through most of it
+                        if ((getPoll() & UV_WRITABLE) == 0) {
+                            setPoll(getPoll() | UV_WRITABLE);
+                            changePoll(this);
+                        }
+                        return true;
+                    }
+                    if (written >= writeBudget || completed >= messageBudget) {
+                        deferWrite(true);
+                        return true;
+                    }
+
+#ifdef UWS_SENDFILE
+                    // the header went out with what came before it, the file goes on its own. One ending short of
+                    // the range leaves the frame unfinishable, which is an error like any other
+                    Queue::Message *front = messageQueue.front();
+                    if (!front->length && front->hasFile()) {
+                        size_t part = std::min(front->extra->referencedLength, std::min(std::min(lowatBudget, writeBudget) - written, tokens));
+                        ssize_t sent = Context::sendFile(getFd(), front->extra->fileDescriptor, front->extra->fileOffset, part);
+                        nodeData->counters[NodeData::WRITE_CALLS]++;
+                        if (sent == SOCKET_ERROR) {
+                            if (!nodeData->netContext->wouldBlock()) {
+                                return false;
+                            }
+                            sent = 0;
+                        } else if (!sent) {
+                            return false;
+                        }
+                        if (sent) {
+                            front->started();
+                            if (rateLimit) {
+                                rateLimit->charge(this, sent);
+                            }
+                            if (bulkLeft) {
+                                *bulkLeft -= std::min<size_t>(sent, *bulkLeft);
+                            }
+                        }
+                        front->extra->referencedLength -= sent;
+                        messageQueue.bytes -= sent;
+                        if (!front->extra->referencedLength) {
+                            front->complete(this, false);
+                            popMessage();
+                            completed++;
+                            if (isClosed()) {
+                                return true;
+                            }
+                        } else if ((size_t) sent < part) {
+                            if ((getPoll() & UV_WRITABLE) == 0) {
+                                setPoll(getPoll() | UV_WRITABLE);
+                                changePoll(this);
+                            }
+                            return true;
+                        }
+                        written += sent;
+                        continue;
+                    }
+#endif
+
+                    int count = 0;
+                    size_t length = 0, budget = std::min(std::min(lowatBudget, writeBudget) - written, tokens);
+                    unsigned int gathered = 0;
+                    for (Queue::Message *messagePtr = messageQueue.front(); messagePtr && !messagePtr->pending && count < Context::MAX_IO_VECTORS - 1 && length < budget && gathered < messageBudget - completed; messagePtr = messagePtr->nextMessage, gathered++) {
+                        // expired ones are dropped once at the front, in the next round
+                        if (count && messagePtr->extra && messagePtr->extra->expiresAt) {
+                            now = now ? now : uv_hrtime();
+                            if (messagePtr->expired(now)) {
+                                break;
+                            }
+                        }
+                        if (messagePtr->length) {
+                            size_t part = std::min(messagePtr->length, budget - length);
+                            vectors[count++].set(messagePtr->data, part);
+                            length += part;
+                        }
+                        if (messagePtr->hasFile()) {
+                            break;
+                        }
+                        if (messagePtr->referencedLength() && length < budget) {
+                            size_t part = std::min(messagePtr->extra->referencedLength, budget - length);
+                            vectors[count++].set(messagePtr->extra->referencedData, part);
+                            length += part;
+                        }
+                    }
+
+                    int flags = zeroCopyFlags(length);
+                    ssize_t sent = Context::sendv(getFd(), vectors, count, flags);
+                    nodeData->counters[NodeData::WRITE_CALLS]++;
+                    if (sent == SOCKET_ERROR) {
+                        if (!nodeData->netContext->wouldBlock()) {
+                            return false;
+                        }
+                        sent = 0;
+                    }
+                    if (rateLimit) {
+                        rateLimit->charge(this, sent);
+                    }
+                    if (bulkLeft) {
+                        *bulkLeft -= std::min<size_t>(sent, *bulkLeft);
+                    }
+
+                    uint32_t zeroCopyId = 0;
+#ifdef UWS_ZEROCOPY
+                    if (flags && sent) {
+                        zeroCopyId = 1 + zeroCopy->nextId++;
+                    }
+#endif
+
+                    for (size_t remaining = (size_t) sent; !messageQueue.empty() && !messageQueue.front()->pending; ) {
+                        Queue::Message *messagePtr = messageQueue.front();
+                        if (remaining < messagePtr->length) {
+                            if (remaining) {
+                                messagePtr->started();
+                                if (zeroCopyId) {
+                                    messagePtr->zeroCopyId = zeroCopyId;
+                                }
+                            }
+                            messagePtr->length -= remaining;
+                            messagePtr->data += remaining;
+                            messageQueue.bytes -= remaining;
+                            break;
+                        } else if (remaining < messagePtr->queuedLength()) {
+                            if (remaining) {
+                                messagePtr->started();
+                                if (zeroCopyId) {
+                                    messagePtr->zeroCopyId = zeroCopyId;
+                                }
+                            }
+                            messageQueue.bytes -= remaining;
+                            remaining -= messagePtr->length;
+                            messagePtr->length = 0;
+                            messagePtr->extra->referencedLength -= remaining;
+                            messagePtr->extra->referencedData += remaining;
+                            break;
+                        }
+                        remaining -= messagePtr->queuedLength();
+                        if (zeroCopyId) {
+                            messagePtr->zeroCopyId = zeroCopyId;
+                        }
+                        if (retireZeroCopy(messagePtr)) {
+                            continue;
+                        }
+                        messagePtr->complete(this, false);
+                        popMessage();
+                        completed++;
+                        if (isClosed()) {
+                            return true;
+                        }
+                    }
+
+                    if ((size_t) sent < length) {
+                        // deferred flushes run without UV_WRITABLE armed
+                        if ((getPoll() & UV_WRITABLE) == 0) {
+                            setPoll(getPoll() | UV_WRITABLE);
+                            changePoll(this);
+                        }
+                        return true;
+                    }
+                    written += length;
+                }
+
+                if (isClosed()) {
+                    return true;
+                }
+                if (getPoll() & UV_WRITABLE) {
+                    change(this, setPoll(getPoll() & ~UV_WRITABLE));
+                }
+                return true;
+            }
+
+            // cancels the messages at the front that outlived their setExpiry, reading the clock into now the first
+            // time one has an expiry. Not for a TLS record awaiting its retry. False if nothing can be written now
+            bool dropExpired(uint64_t *now = nullptr) {
+                uint64_t clock = 0;
+                now = now ? now : &clock;
+                while (!messageQueue.empty() && !messageQueue.front()->pending) {
+                    Queue::Message *message = messageQueue.front();
+                    if (!message->extra || !message->extra->expiresAt) {
+                        return true;
+                    }
+                    if (!*now) {
+                        *now = uv_hrtime();
+                    }
+                    if (!message->expired(*now)) {
+                        return true;
+                    }
+                    nodeData->counters[NodeData::EXPIRED_MESSAGES]++;
+                    message->complete(this, true);
+                    popMessage();
+                    if (isClosed()) {
+                        return false;
+                    }
+                }
+                return false;
+            }
+
+            // message blocks come from the BlockAllocator up to its largest size class, the heap above that
             Queue::Message *allocMessage(size_t length, const char *data = 0) {
-                Queue::Message *messagePtr = (Queue::Message *) new char[sizeof(Queue::Message) + length];
+                Queue::Message *messagePtr;
+                size_t memoryLength = sizeof(Queue::Message) + length;
+                if (memoryLength <= (size_t) NodeData::preAllocMaxSize) {
+                    int memoryIndex = nodeData->getMemoryBlockIndex(memoryLength);
+                    messagePtr = new (nodeData->getSmallMemoryBlock(memoryIndex)) Queue::Message;
+                    messagePtr->memoryIndex = (int16_t) memoryIndex;
+                    messagePtr->data = ((char *) messagePtr) + sizeof(Queue::Message);
+                    memoryLength = BlockAllocator::getSize(memoryIndex);
+                    nodeData->counters[NodeData::BLOCK_MESSAGES]++;
+                } else {
+                    // the Extra goes in between, it holds the length of the allocation
+                    memoryLength += sizeof(Queue::Message::Extra);
+                    char *memory = LargeBuffer::allocate(memoryLength);
+                    messagePtr = new (memory) Queue::Message;
+                    messagePtr->extra = new (memory + sizeof(Queue::Message)) Queue::Message::Extra;
+                    messagePtr->extra->memoryLength = memoryLength;
+                    messagePtr->data = memory + sizeof(Queue::Message) + sizeof(Queue::Message::Extra);
+                    nodeData->counters[NodeData::HEAP_MESSAGES]++;
+                }
+                nodeData->counters[NodeData::QUEUEING_SOCKETS] += !messageMemory;
+                messageMemory += memoryLength;
+                nodeData->messageMemory += memoryLength;
+                nodeData->counters[NodeData::QUEUE_HIGH_WATER] = std::max<uint64_t>(nodeData->counters[NodeData::QUEUE_HIGH_WATER], messageMemory);
                 messagePtr->length = length;
-                messagePtr->data = ((char *) messagePtr) + sizeof(Queue::Message);
-                messagePtr->nextMessage = nullptr;
+                if (nodeData->stampMessages) {
+                    messagePtr->allocatedAt = std::max<uint32_t>((uint32_t) (uv_hrtime() / 1000), 1);
+                }
 
                 if (data) {
                     memcpy((char *) messagePtr->data, data, messagePtr->length);
@@ -234,133 +863,621 @@ namespace uS {
                 return messagePtr;
             }
 
-            static void freeMessage(Queue::Message *message) {
-                delete [] (char *) message;
+            // the Extra of message, from a block of its own unless it has one already
+            Queue::Message::Extra *extendMessage(Queue::Message *message) {
+                if (!message->extra) {
+                    int memoryIndex = nodeData->getMemoryBlockIndex(sizeof(Queue::Message::Extra));
+                    message->extra = new (nodeData->getSmallMemoryBlock(memoryIndex)) Queue::Message::Extra;
+                    message->extra->memoryIndex = memoryIndex;
+                    messageMemory += BlockAllocator::getSize(memoryIndex);
+                    nodeData->messageMemory += BlockAllocator::getSize(memoryIndex);
+                }
+                return message->extra;
+            }
+
+            // most sends come without a callback and so without an Extra
+            void setCallback(Queue::Message *message, void(*callback)(void *socket, void *data, bool cancelled, void *reserved), void *callbackData, void *reserved = nullptr) {
+                if (callback) {
+                    Queue::Message::Extra *extra = extendMessage(message);
+                    extra->callback = callback;
+                    extra->callbackData = callbackData;
+                    extra->reserved = reserved;
+                }
+            }
+
+            // a message still queued unsent ttlMs from now is dropped and cancelled instead of written, 0 for never.
+            // Only for a message about to be queued that nothing of has been written yet
+            void setExpiry(Queue::Message *message, unsigned int ttlMs) {
+                if (ttlMs) {
+                    extendMessage(message)->expiresAt = uv_hrtime() + ttlMs * (uint64_t) 1000000;
+                }
             }
 
-            bool write(Queue::Message *message, bool &waiting) {
+            void freeMessage(Queue::Message *message) {
+                if (message->release) {
+                    message->release(message->sharedBuffer);
+                }
+                size_t memoryLength = message->memoryLength();
+                messageMemory -= memoryLength;
+                nodeData->messageMemory -= memoryLength;
+                nodeData->counters[NodeData::QUEUEING_SOCKETS] -= !messageMemory;
+                // wraps every 71 minutes, which the difference does not mind
+                if (message->allocatedAt && nodeData->queueLatency) {
+                    NodeData::recordLatency(nodeData->queueLatency, (uint64_t) ((uint32_t) (uv_hrtime() / 1000) - message->allocatedAt) * 1000);
+                }
+                if (message->extra && message->extra->memoryIndex != -1) {
+                    nodeData->freeSmallMemoryBlock((char *) message->extra, message->extra->memoryIndex);
+                }
+                if (message->memoryIndex != -1) {
+                    nodeData->freeSmallMemoryBlock((char *) message, message->memoryIndex);
+                } else {
+                    LargeBuffer::free((char *) message, message->extra->memoryLength);
+                }
+            }
+
+            // copies consecutive small messages from the front of the queue into one TLS record. The messages a failed
+            // SSL_write packed are still at the front in the same order, so a retry packs at least them again. With
+            // partial writes and moving buffers that is all OpenSSL asks of it, whatever got queued behind them since
+            const char *packRecord(size_t &length) {
+                Queue::Message *messagePtr = messageQueue.front();
+                length = messagePtr->length;
+                // the record buffer is the loop's, other sockets write over it while a job of this one is paused
+                if (length >= RecordBuffer::SIZE || asyncCrypto() || !messagePtr->nextMessage || messagePtr->nextMessage->pending ||
+                    length + messagePtr->nextMessage->length > RecordBuffer::SIZE) {
+                    return messagePtr->data;
+                }
+
+                char *record = nodeData->recordBuffer->data;
+                memcpy(record, messagePtr->data, length);
+                // a retry packs what failed again, expired or not
+                uint64_t now = state.sslRetryLength ? 0 : uv_hrtime();
+                for (messagePtr = messagePtr->nextMessage; messagePtr && !messagePtr->pending && length + messagePtr->length <= RecordBuffer::SIZE &&
+                     !(now && messagePtr->expired(now)); messagePtr = messagePtr->nextMessage) {
+                    memcpy(record + length, messagePtr->data, messagePtr->length);
+                    length += messagePtr->length;
+                }
+                return record;
+            }
+
+            // the link behind the messages the record awaiting a retry was packed from, the head if there is none
+            Queue::Message **pastRetry() {
+                Queue::Message **link = &messageQueue.head;
+                for (size_t retry = ssl ? state.sslRetryLength : 0; *link && retry; link = &(*link)->nextMessage) {
+                    retry -= std::min<size_t>(retry, (*link)->length);
+                }
+                return link;
+            }
+
+            void popMessage() {
+                Queue::Message *message = messageQueue.front();
+                messageQueue.pop();
                 if (messageQueue.empty()) {
-                    ssize_t sent = 0;
-                    if (ssl) {
-                        sent = SSL_write(ssl, message->data, (int) message->length);
-                        if (sent == (ssize_t) message->length) {
-                            waiting = false;
-                            return true;
-                        } else if (sent < 0) {
+                    UWS_TRACE(backpressure__done, BACKPRESSURE, 'e', this, getFd());
+                }
+                freeMessage(message);
+            }
+
+            // MSG_ZEROCOPY only pays off for large plain TCP sends, SO_ZEROCOPY is set on first use
+            int zeroCopyFlags(size_t length) {
+#ifdef UWS_ZEROCOPY
+                LoopOptions *loopOptions = nodeData->loopOptions;
+                if (!ssl && loopOptions->zeroCopyThreshold && length >= loopOptions->zeroCopyThreshold) {
+                    if (!zeroCopy) {
+                        if (!Context::enableZeroCopy(getFd())) {
+                            // kernel without SO_ZEROCOPY, stop trying for the whole loop
+                            loopOptions->zeroCopyThreshold = 0;
+                            return 0;
+                        }
+                        zeroCopy = new ZeroCopy;
+                    }
+                    return MSG_ZEROCOPY;
+                }
+#endif
+                return 0;
+            }
+
+            // moves a fully sent front message the kernel still reads from over to the in flight queue
+            bool retireZeroCopy(Queue::Message *message) {
+#ifdef UWS_ZEROCOPY
+                if (message->zeroCopyId) {
+                    messageQueue.pop();
+                    if (messageQueue.empty()) {
+                        UWS_TRACE(backpressure__done, BACKPRESSURE, 'e', this, getFd());
+                    }
+                    zeroCopy->inFlight.push(message);
+                    return true;
+                }
+#endif
+                return false;
+            }
+
+#ifdef UWS_ZEROCOPY
+            // releases every in flight message whose last send is covered by the completion
+            void completeZeroCopy(uint32_t upTo) {
+                Queue &inFlight = zeroCopy->inFlight;
+                while (!inFlight.empty() && (int32_t) (inFlight.front()->zeroCopyId - 1 - upTo) <= 0) {
+                    Queue::Message *message = inFlight.front();
+                    inFlight.pop();
+                    message->complete(this, false);
+                    freeMessage(message);
+                    if (isClosed()) {
+                        return;
+                    }
+                }
+            }
+#endif
+
+            // whether OpenSSL runs the crypto of this socket as async jobs, see Node::setAsyncCrypto
+            bool asyncCrypto() {
+#ifdef UWS_SSL_ASYNC
+                return ssl && (SSL_get_mode(ssl) & SSL_MODE_ASYNC);
+#else
+                return false;
+#endif
+            }
+
+#ifdef UWS_SSL_ASYNC
+            // SSL_ERROR_WANT_ASYNC: the job of the SSL_read or SSL_write op stays paused until the engine signals
+            // its fd, and until then the socket is not polled. Then op runs again, the same call being what resumes
+            // the job. False if the engine left no single fd to wait on
+            bool waitAsync(int op) {
+                size_t fds;
+                OSSL_ASYNC_FD fd;
+                if (!SSL_get_all_async_fds(ssl, nullptr, &fds) || fds != 1 || !SSL_get_all_async_fds(ssl, &fd, &fds)) {
+                    return false;
+                }
+
+                if (asyncWait && asyncWait->getFd() != fd) {
+                    closeAsyncWait();
+                }
+                if (!asyncWait) {
+                    asyncWait = new AsyncWait(getLoop(), fd);
+                    asyncWait->setCb(onAsyncReady);
+                }
+                // whatever this socket was moved into since last time waits now
+                asyncWait->socket = this;
+                asyncWait->start(asyncWait, UV_READABLE);
+                state.asyncOp = op;
+                stop();
+                return true;
+            }
+
+            // the engine's fd is the engine's to close
+            void closeAsyncWait() {
+                if (ssl && asyncWait) {
+                    asyncWait->close([](Poll *p) {
+                        delete (AsyncWait *) p;
+                    });
+                    asyncWait = nullptr;
+                }
+            }
+
+            static void onAsyncReady(Poll *p, int status, int events) {
+                AsyncWait *asyncWait = static_cast<AsyncWait *>(p);
+                asyncWait->stop();
+                Socket *socket = asyncWait->socket;
+                int op = socket->state.asyncOp;
+                socket->state.asyncOp = 0;
+                socket->start(socket, socket->getPoll());
+                // an engine error fails the op itself, which ends the socket
+                socket->getCb()(socket, 0, op);
+            }
+#endif
+
+            // writes what the kernel takes right now and arms UV_WRITABLE for the rest,
+            // returns the number of bytes taken or SOCKET_ERROR if the socket is broken
+            ssize_t writeImmediately(const char *data, size_t length, int flags = 0) {
+                ssize_t sent;
+                if (ssl) {
+                    if (asyncCrypto()) {
+                        // a paused job goes on reading from where it was given, which only queued messages outlive
+                        if ((getPoll() & UV_WRITABLE) == 0) {
+                            setPoll(getPoll() | UV_WRITABLE);
+                            if (!state.asyncOp) {
+                                changePoll(this);
+                            }
+                        }
+                        return 0;
+                    }
+                    // with partial writes it returns after every record, what is left gets queued as one message
+                    size_t written = 0;
+                    while (written < length) {
+                        sent = SSL_write(ssl, data + written, (int) (length - written));
+                        nodeData->counters[NodeData::TLS_WRITE_CALLS]++;
+                        if (sent <= 0) {
+                            state.sslRetryLength = (unsigned int) std::min<size_t>(length - written, RecordBuffer::SIZE);
                             switch (SSL_get_error(ssl, (int) sent)) {
                                 case SSL_ERROR_WANT_READ:
-                                    break;
+                                    return written;
                                 case SSL_ERROR_WANT_WRITE:
                                     if ((getPoll() & UV_WRITABLE) == 0) {
                                         setPoll(getPoll() | UV_WRITABLE);
                                         changePoll(this);
                                     }
-                                    break;
+                                    return written;
                                 default:
-                                    return false;
+                                    return SOCKET_ERROR;
                             }
                         }
-                    } else {
-                        sent = ::send(getFd(), message->data, message->length, MSG_NOSIGNAL);
+                        written += sent;
+                    }
+                    return written;
+                }
+
+                sent = Context::send(getFd(), data, length, flags);
+                nodeData->counters[NodeData::WRITE_CALLS]++;
+                if (sent == SOCKET_ERROR) {
+                    if (!nodeData->netContext->wouldBlock()) {
+                        return SOCKET_ERROR;
+                    }
+                    sent = 0;
+                }
+
+                if ((size_t) sent < length && (getPoll() & UV_WRITABLE) == 0) {
+                    setPoll(getPoll() | UV_WRITABLE);
+                    changePoll(this);
+                }
+                return sent;
+            }
+
+            // writes out what this socket has in the cork buffer, queueing whatever the kernel does not take
+            bool flushCork() {
+                CorkBuffer *corkBuffer = nodeData->corkBuffer;
+                size_t length = corkBuffer->length;
+                corkBuffer->length = 0;
+                if (!length) {
+                    return true;
+                }
+
+                ssize_t sent = writeImmediately(corkBuffer->data, length);
+                if (sent == SOCKET_ERROR) {
+                    return false;
+                } else if ((size_t) sent < length) {
+                    enqueue(allocMessage(length - sent, corkBuffer->data + sent));
+                }
+                return true;
+            }
+
+            // queues the write for the end of the loop iteration instead of writing now
+            bool deferWrite(bool force = false) {
+                if (!force && !nodeData->deferredWrites->enabled && !nodeData->rateLimit) {
+                    return false;
+                }
+                if (!state.deferred) {
+                    state.deferred = true;
+                    deferredIndex = (uint32_t) nodeData->deferredWrites->sockets.size();
+                    nodeData->deferredWrites->sockets.push_back(this);
+                }
+                return true;
+            }
+
+            // takes this out of the deferred writes in constant time, a mass close would otherwise search for each
+            void undefer() {
+                std::vector<Socket *> &sockets = nodeData->deferredWrites->sockets;
+                Socket *last = sockets.back();
+                sockets[deferredIndex] = last;
+                last->deferredIndex = deferredIndex;
+                sockets.pop_back();
+                state.deferred = false;
+            }
+
+            // defer holds this write back until the end of the loop iteration even if deferral is off
+            bool write(Queue::Message *message, bool &waiting, bool defer = false) {
+                if (messageQueue.empty() && deferWrite(defer)) {
+                    enqueue(message);
+                    waiting = true;
+                    return true;
+                }
+
+                if (messageQueue.empty() && nodeData->corkBuffer->socket == this) {
+                    CorkBuffer *corkBuffer = nodeData->corkBuffer;
+                    if (corkBuffer->length + message->length <= CorkBuffer::SIZE) {
+                        memcpy(corkBuffer->data + corkBuffer->length, message->data, message->length);
+                        corkBuffer->length += message->length;
+                        waiting = false;
+                        return true;
+                    } else if (!flushCork()) {
+                        return false;
+                    }
+                }
+
+                if (messageQueue.empty()) {
+                    int flags = zeroCopyFlags(message->length);
+                    ssize_t sent = writeImmediately(message->data, message->length, flags);
+                    if (sent == SOCKET_ERROR) {
+                        return false;
+                    }
+#ifdef UWS_ZEROCOPY
+                    if (flags && sent) {
+                        message->zeroCopyId = 1 + zeroCopy->nextId++;
                         if (sent == (ssize_t) message->length) {
-                            waiting = false;
+                            // the kernel still reads from it, the callback fires on completion
+                            zeroCopy->inFlight.push(message);
+                            waiting = true;
                             return true;
-                        } else if (sent == SOCKET_ERROR) {
-                            if (!nodeData->netContext->wouldBlock()) {
-                                return false;
-                            }
-                        } else {
-                            message->length -= sent;
-                            message->data += sent;
-                        }
-
-                        if ((getPoll() & UV_WRITABLE) == 0) {
-                            setPoll(getPoll() | UV_WRITABLE);
-                            changePoll(this);
                         }
                     }
+#endif
+                    if (sent == (ssize_t) message->length) {
+                        waiting = false;
+                        return true;
+                    }
+                    if (sent) {
+                        message->started();
+                    }
+                    message->length -= sent;
+                    message->data += sent;
                 }
-                messageQueue.push(message);
+                enqueue(message);
                 waiting = true;
                 return true;
             }
 
+            // queues an empty placeholder for a message produced elsewhere (like on a worker thread), which keeps
+            // its place in line for when completePending fills it in. Whatever is corked goes out before it
+            Queue::Message *enqueuePending() {
+                if (nodeData->corkBuffer->socket == this) {
+                    flushCork();
+                }
+                Queue::Message *messagePtr = allocMessage(0);
+                messagePtr->pending = true;
+                enqueue(messagePtr);
+                return messagePtr;
+            }
+
+            // data has to stay valid until the message is freed, which is what its release hook is for
+            void completePending(Queue::Message *messagePtr, const char *data, size_t length) {
+                messagePtr->data = data;
+                messagePtr->length = length;
+                messagePtr->pending = false;
+                messageQueue.bytes += length;
+                if (messageQueue.front() == messagePtr) {
+                    getCb()(this, 0, UV_WRITABLE);
+                }
+            }
+
+            // link to the queued, not yet started message with this conflation key, nullptr if there is none.
+            // What a TLS record awaiting its retry was packed from counts as started
+            Queue::Message **findConflated(uint32_t conflationKey) {
+                if (!conflationKey) {
+                    return nullptr;
+                }
+                for (Queue::Message **link = pastRetry(); *link; link = &(*link)->nextMessage) {
+                    if ((*link)->conflationKey == conflationKey) {
+                        return link;
+                    }
+                }
+                return nullptr;
+            }
+
+            // puts message in place of the one behind link, which is cancelled
+            void replaceConflated(Queue::Message **link, Queue::Message *message) {
+                Queue::Message *replaced = *link;
+                message->nextMessage = replaced->nextMessage;
+                *link = message;
+                if (messageQueue.tail == replaced) {
+                    messageQueue.tail = message;
+                }
+                messageQueue.bytes += message->queuedLength();
+                messageQueue.bytes -= replaced->queuedLength();
+
+                replaced->complete(this, true);
+                freeMessage(replaced);
+            }
+
+            // queues ahead of what is buffered, at the next message boundary: behind the front message, which a
+            // partial write may have to finish, behind those an SSL retry has to pack again, and behind what was
+            // queued this way before. For control frames, which may come between the fragments of a message
+            void enqueuePriority(Queue::Message *message) {
+                message->priority = true;
+                Queue::Message **link = pastRetry();
+                if (link == &messageQueue.head && *link) {
+                    link = &(*link)->nextMessage;
+                }
+                while (*link && (*link)->priority) {
+                    link = &(*link)->nextMessage;
+                }
+                message->nextMessage = *link;
+                *link = message;
+                if (!message->nextMessage) {
+                    messageQueue.tail = message;
+                }
+                messageQueue.bytes += message->queuedLength();
+            }
+
+            // queues behind what is buffered, replacing a message of the same conflation key if there is one
+            void enqueueConflated(Queue::Message *message) {
+                if (Queue::Message **link = findConflated(message->conflationKey)) {
+                    replaceConflated(link, message);
+                } else {
+                    enqueue(message);
+                }
+            }
+
+            // the tail of the queue if it is a plain message of its own block with room for length more bytes,
+            // NodeData::sendChunkSize permitting. Sends appended to it go out in one piece with what it holds.
+            // Not one an SSL retry has to pack again, which growing could push out of the record
+            Queue::Message *appendableTail(size_t length) {
+                Queue::Message *tail = messageQueue.tail;
+                if (!nodeData->sendChunkSize || !tail || tail->extra || tail->sharedBuffer || tail->pending || tail->priority ||
+                    tail->conflationKey || tail->memoryIndex == -1 || (ssl && state.sslRetryLength && !*pastRetry())) {
+                    return nullptr;
+                }
+                const char *end = (const char *) tail + BlockAllocator::getSize(tail->memoryIndex);
+                return tail->data + tail->length + length <= end ? tail : nullptr;
+            }
+
+            // copies a small frame without callback into the chunk at the tail of a queue that is not empty,
+            // or into a new one. False leaves it to the caller to queue as usual
+            bool queueInChunk(const char *data, size_t length) {
+                if (!nodeData->sendChunkSize || length > nodeData->sendChunkSize / 4 || hasEmptyQueue()) {
+                    return false;
+                }
+                if (Queue::Message *tail = appendableTail(length)) {
+                    memcpy((char *) tail->data + tail->length, data, length);
+                    tail->length += length;
+                    messageQueue.bytes += length;
+                } else {
+                    Queue::Message *messagePtr = allocMessage(nodeData->sendChunkSize - sizeof(Queue::Message));
+                    memcpy((char *) messagePtr->data, data, length);
+                    messagePtr->length = length;
+                    enqueue(messagePtr);
+                }
+                return true;
+            }
+
             template <class T, class D>
-                void sendTransformed(const char *message, size_t length, void(*callback)(void *socket, void *data, bool cancelled, void *reserved), void *callbackData, D transformData) {
-                    size_t estimatedLength = length + HEADER_LENGTH + sizeof(Queue::Message);
-
-                    if (hasEmptyQueue()) {
-                        if (estimatedLength <= uS::NodeData::preAllocMaxSize) {
-                            int memoryLength = (int) estimatedLength;
-                            int memoryIndex = nodeData->getMemoryBlockIndex(memoryLength);
-
-                            Queue::Message *messagePtr = (Queue::Message *) nodeData->getSmallMemoryBlock(memoryIndex);
-                            messagePtr->data = ((char *) messagePtr) + sizeof(Queue::Message);
-                            messagePtr->length = T::transform(message, (char *) messagePtr->data, length, transformData);
-
-                            bool waiting;
-                            if (write(messagePtr, waiting)) {
-                                if (!waiting) {
-                                    nodeData->freeSmallMemoryBlock((char *) messagePtr, memoryIndex);
-                                    if (callback) {
-                                        callback(this, callbackData, false, nullptr);
-                                    }
-                                } else {
-                                    messagePtr->callback = callback;
-                                    messagePtr->callbackData = callbackData;
-                                }
-                            } else {
-                                nodeData->freeSmallMemoryBlock((char *) messagePtr, memoryIndex);
-                                if (callback) {
-                                    callback(this, callbackData, true, nullptr);
-                                }
+                void sendTransformed(const char *message, size_t length, void(*callback)(void *socket, void *data, bool cancelled, void *reserved), void *callbackData, D transformData, uint32_t conflationKey = 0, unsigned int ttlMs = 0) {
+                    size_t estimatedLength = length + HEADER_LENGTH;
+
+                    // behind a queue a small frame goes into the chunk at its tail, or starts the next one
+                    size_t allocLength = estimatedLength;
+                    if (!callback && !conflationKey && !ttlMs && !hasEmptyQueue() && nodeData->sendChunkSize) {
+                        if (Queue::Message *tail = appendableTail(estimatedLength)) {
+                            size_t frameLength = T::transform(message, (char *) tail->data + tail->length, length, transformData);
+                            tail->length += frameLength;
+                            messageQueue.bytes += frameLength;
+                            return;
+                        }
+                        if (estimatedLength <= nodeData->sendChunkSize / 4) {
+                            allocLength = nodeData->sendChunkSize - sizeof(Queue::Message);
+                        }
+                    }
+
+                    Queue::Message *messagePtr = allocMessage(allocLength);
+                    messagePtr->length = T::transform(message, (char *) messagePtr->data, length, transformData);
+                    messagePtr->conflationKey = conflationKey;
+                    sendMessage(messagePtr, callback, callbackData, ttlMs);
+                }
+
+            // writes what it can of a message from allocMessage and queues the rest, the message is ours from here on
+            void sendMessage(Queue::Message *messagePtr, void(*callback)(void *socket, void *data, bool cancelled, void *reserved), void *callbackData, unsigned int ttlMs = 0) {
+                if (hasEmptyQueue()) {
+                    bool waiting;
+                    size_t length = messagePtr->length;
+                    if (write(messagePtr, waiting)) {
+                        if (!waiting) {
+                            freeMessage(messagePtr);
+                            if (callback) {
+                                callback(this, callbackData, false, nullptr);
                             }
                         } else {
-                            Queue::Message *messagePtr = allocMessage(estimatedLength - sizeof(Queue::Message));
-                            messagePtr->length = T::transform(message, (char *) messagePtr->data, length, transformData);
-
-                            bool waiting;
-                            if (write(messagePtr, waiting)) {
-                                if (!waiting) {
-                                    freeMessage(messagePtr);
-                                    if (callback) {
-                                        callback(this, callbackData, false, nullptr);
-                                    }
-                                } else {
-                                    messagePtr->callback = callback;
-                                    messagePtr->callbackData = callbackData;
-                                }
-                            } else {
-                                freeMessage(messagePtr);
-                                if (callback) {
-                                    callback(this, callbackData, true, nullptr);
-                                }
+                            setCallback(messagePtr, callback, callbackData);
+                            if (messagePtr->length == length) {
+                                setExpiry(messagePtr, ttlMs);
                             }
                         }
                     } else {
-                        Queue::Message *messagePtr = allocMessage(estimatedLength - sizeof(Queue::Message));
-                        messagePtr->length = T::transform(message, (char *) messagePtr->data, length, transformData);
-                        messagePtr->callback = callback;
-                        messagePtr->callbackData = callbackData;
-                        enqueue(messagePtr);
+                        freeMessage(messagePtr);
+                        if (callback) {
+                            callback(this, callbackData, true, nullptr);
+                        }
                     }
+                } else {
+                    setCallback(messagePtr, callback, callbackData);
+                    setExpiry(messagePtr, ttlMs);
+                    enqueueConflated(messagePtr);
                 }
+            }
+
+            // sends header followed by payload, only the header is ever copied. Payload has to stay
+            // valid until the callback is called, which is also what happens when it gets cancelled
+            void sendReferenced(const char *header, size_t headerLength, const char *payload, size_t payloadLength, void(*callback)(void *socket, void *data, bool cancelled, void *reserved), void *callbackData) {
+                size_t sent = 0;
+                if (nodeData->corkBuffer->socket == this && !flushCork()) {
+                    if (callback) {
+                        callback(this, callbackData, true, nullptr);
+                    }
+                    return;
+                }
+
+                if (hasEmptyQueue() && !deferWrite()) {
+                    Context::IoVector vectors[2];
+                    vectors[0].set(header, headerLength);
+                    vectors[1].set(payload, payloadLength);
+                    ssize_t result = Context::sendv(getFd(), vectors, 2);
+                    nodeData->counters[NodeData::WRITE_CALLS]++;
+                    if (result == (ssize_t) (headerLength + payloadLength)) {
+                        if (callback) {
+                            callback(this, callbackData, false, nullptr);
+                        }
+                        return;
+                    } else if (result == SOCKET_ERROR) {
+                        if (!nodeData->netContext->wouldBlock()) {
+                            if (callback) {
+                                callback(this, callbackData, true, nullptr);
+                            }
+                            return;
+                        }
+                    } else {
+                        sent = (size_t) result;
+                    }
+
+                    if ((getPoll() & UV_WRITABLE) == 0) {
+                        setPoll(getPoll() | UV_WRITABLE);
+                        changePoll(this);
+                    }
+                }
+
+                size_t headerSent = std::min<size_t>(sent, headerLength);
+                Queue::Message *messagePtr = allocMessage(headerLength - headerSent, header + headerSent);
+                Queue::Message::Extra *extra = extendMessage(messagePtr);
+                extra->referencedData = payload + (sent - headerSent);
+                extra->referencedLength = payloadLength - (sent - headerSent);
+                setCallback(messagePtr, callback, callbackData);
+                enqueue(messagePtr);
+            }
 
         public:
+            // ssl is null in a UWS_NO_TLS build, whose callers refuse TLS before a socket exists
+#ifdef UWS_NO_TLS
+            Socket(NodeData *nodeData, Loop *loop, uv_os_sock_t fd, SSL *) : Poll(loop, fd), nodeData(nodeData) {
+#else
             Socket(NodeData *nodeData, Loop *loop, uv_os_sock_t fd, SSL *ssl) : Poll(loop, fd), ssl(ssl), nodeData(nodeData) {
+#endif
                 if (ssl) {
-                    // OpenSSL treats SOCKETs as int
-                    SSL_set_fd(ssl, (int) fd);
+                    // OpenSSL treats SOCKETs as int. An SSL already on this fd keeps its BIO, and with it
+                    // what the handshake set up on it
+                    if (SSL_get_fd(ssl) != (int) fd) {
+                        SSL_set_fd(ssl, (int) fd);
+                    }
+                    size_t readAhead = nodeData->loopOptions->tlsReadAhead;
+#ifdef UWS_KTLS
+                    if (nodeData->loopOptions->kernelTls) {
+                        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+                        // the kernel decrypts, records are to stay with it
+                        readAhead = 0;
+                    }
+#endif
+                    // whatever the kernel holds goes into one read of up to readAhead bytes, rather than two per record
+                    if (readAhead) {
+                        SSL_set_read_ahead(ssl, 1);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+                        SSL_set_default_read_buffer_len(ssl, readAhead);
+#endif
+                    }
                     SSL_set_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+                    // corked and queued data may be retried from a different buffer than it was first written from,
+                    // and longer, as SSL_write returns once any record is out
+                    SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE);
+#ifdef UWS_SSL_ASYNC
+                    if (nodeData->loopOptions->asyncCrypto) {
+                        SSL_set_mode(ssl, SSL_MODE_ASYNC);
+                    }
+#endif
                 }
+#ifdef UWS_EDGE_TRIGGERED
+                // not with SSL, which leaves records in the kernel that no readable edge is left for
+                else if (nodeData->loopOptions->edgeTriggeredWrites) {
+                    setEdgeTriggered(true);
+                }
+#endif
             }
 
             NodeData *getNodeData() {
                 return nodeData;
             }
 
-            Poll *next = nullptr, *prev = nullptr;
-
             void *getUserData() {
                 return user;
             }
@@ -369,6 +1486,11 @@ namespace uS {
                 this->user = user;
             }
 
+            // bytes queued for writing because the kernel did not take them yet
+            size_t getBufferedAmount() const {
+                return messageQueue.bytes;
+            }
+
             struct Address {
                 unsigned int port;
                 const char *address;
@@ -377,53 +1499,179 @@ namespace uS {
 
             Address getAddress() const;
 
-            void setNoDelay(int enable) const {
-                setsockopt(getFd(), IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+            // a no-op when it is what was last set, which switching it back and forth adaptively relies on
+            void setNoDelay(bool enable) {
+                if (state.noDelay != enable) {
+                    Context::setOption(getFd(), IPPROTO_TCP, TCP_NODELAY, enable);
+                    nodeData->counters[NodeData::SOCKOPT_CALLS]++;
+                    state.noDelay = enable;
+                }
             }
 
+            bool isNoDelay() const {
+                return state.noDelay;
+            }
+
+            // the kernel reports writable only once less than bytes of what it holds are unsent, 0 leaves it be
+            void setNotSentLowat(int bytes) const {
+#ifdef TCP_NOTSENT_LOWAT
+                if (bytes) {
+                    Context::setOption(getFd(), IPPROTO_TCP, TCP_NOTSENT_LOWAT, bytes);
+                    nodeData->counters[NodeData::SOCKOPT_CALLS]++;
+                }
+#endif
+            }
+
+            bool isCorked() const {
+                return nodeData->corkBuffer->socket == this || state.kernelCorked;
+            }
+
+            // corks in user space through the loop's cork buffer, unless another socket holds it.
+            // only then does it fall back to TCP_CORK / TCP_NOPUSH
             void cork(int enable) {
+                CorkBuffer *corkBuffer = nodeData->corkBuffer;
+                if (enable) {
+                    if (!corkBuffer->socket) {
+                        corkBuffer->socket = this;
+                        return;
+                    } else if (corkBuffer->socket == this || state.kernelCorked) {
+                        return;
+                    }
+                } else {
+                    if (corkBuffer->socket == this) {
+                        flushCork();
+                        corkBuffer->socket = nullptr;
+                        return;
+                    } else if (!state.kernelCorked) {
+                        return;
+                    }
+                }
+
+                state.kernelCorked = enable;
 #if defined(TCP_CORK)
                 // Linux & SmartOS have proper TCP_CORK
-                setsockopt(getFd(), IPPROTO_TCP, TCP_CORK, &enable, sizeof(int));
+                Context::setOption(getFd(), IPPROTO_TCP, TCP_CORK, enable);
+                nodeData->counters[NodeData::SOCKOPT_CALLS]++;
 #elif defined(TCP_NOPUSH)
                 // Mac OS X & FreeBSD have TCP_NOPUSH
-                setsockopt(getFd(), IPPROTO_TCP, TCP_NOPUSH, &enable, sizeof(int));
+                Context::setOption(getFd(), IPPROTO_TCP, TCP_NOPUSH, enable);
+                nodeData->counters[NodeData::SOCKOPT_CALLS]++;
+#ifdef __APPLE__
                 if (!enable) {
-                    // Tested on OS X, FreeBSD situation is unclear
-                    ::send(getFd(), "", 0, MSG_NOSIGNAL);
+                    // OS X sends what it held only with the next write, FreeBSD does as the option is cleared
+                    Context::send(getFd(), "", 0);
                 }
+#endif
 #endif
             }
 
             void shutdown() {
-                if (ssl) {
+                if (nodeData->corkBuffer->socket == this) {
+                    flushCork();
+                }
+                // a paused job would take SSL_shutdown for its own op
+                if (ssl && !state.asyncOp) {
                     SSL_shutdown(ssl);
                 }
-                ::shutdown(getFd(), SHUT_WR);
+                Context::shutdownWrite(getFd());
             }
 
             template <class T>
                 void closeSocket() {
+                    if (nodeData->corkBuffer->socket == this) {
+                        flushCork();
+                        nodeData->corkBuffer->socket = nullptr;
+                    }
+
+                    if (state.deferred) {
+                        // writes held back by us are not lost to a close in the same iteration, as far as the kernel takes them
+                        if (!ssl) {
+                            flushQueue(false);
+                        }
+                        undefer();
+                    }
+
+#ifdef UWS_ZEROCOPY
+                    if (!ssl && zeroCopy) {
+                        // sends still in flight are cancelled along with the fd, just like the queue in onEnd
+                        while (!zeroCopy->inFlight.empty()) {
+                            Queue::Message *message = zeroCopy->inFlight.front();
+                            zeroCopy->inFlight.pop();
+                            message->complete(nullptr, true);
+                            freeMessage(message);
+                        }
+                        delete zeroCopy;
+                        zeroCopy = nullptr;
+                    }
+#endif
+
+#ifdef UWS_SSL_ASYNC
+                    closeAsyncWait();
+#endif
+
                     uv_os_sock_t fd = getFd();
                     Context *netContext = nodeData->netContext;
                     if (ssl) {
                         SSL_free(ssl);
                     }
-                    netContext->closeSocket(fd);
 
+                    // the loop lets go of the fd before it is closed
                     stop();
                     Poll::close([](Poll *p) {
-                       delete (T *) p;
+                       T::destroy((T *) p);
                     });
+                    netContext->closeSocket(fd);
+                }
+
+            // deletes a socket another was moved from, once the loop is done with the handle it polled with
+            template <class T>
+                void retire() {
+                    if (!initialized) {
+                        T::destroy((T *) this);
+                        return;
+                    }
+                    Poll::close([](Poll *p) {
+                       T::destroy((T *) p);
+                    });
+                }
+
+            // how closeSocket and retire end a T, WebSocket hides it to give its slot back to the pool
+            template <class T>
+                static void destroy(T *socket) {
+                    delete socket;
                 }
 
             bool isShuttingDown() {
                 return state.shuttingDown;
             }
 
+            // a TLS socket whose handshake left both directions of its record layer to the kernel goes on as a plain one,
+            // so reads, writev, corking and MSG_ZEROCOPY all work on the fd. Anything still half way through OpenSSL
+            // (buffered records, a write to retry, queued data) keeps it on the SSL path, which works as before
+            void adoptKernelTls() {
+#if defined(UWS_KTLS) && !defined(UWS_NO_TLS)
+                if (ssl && BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) &&
+                        !SSL_has_pending(ssl) && !state.sslRetryLength && messageQueue.empty()) {
+                    // the socket BIO does not own the fd
+#ifdef UWS_SSL_ASYNC
+                    closeAsyncWait();
+#endif
+                    SSL_free(ssl);
+                    ssl = nullptr;
+                }
+#endif
+            }
+
             friend class Node;
             friend struct NodeData;
     };
+
+    // the handle with a callback, the fd and a flag, and the socket 88 bytes more on 64 bit, which ends it one
+    // counter past a cache line of its slot on x86-64 Linux (see WebSocket). Every connection pays for what is added here
+#ifdef LIBUV_H
+    static_assert(sizeof(Poll) <= sizeof(uv_poll_t) + 16, "uS::Poll grew");
+#endif
+    static_assert(sizeof(Socket) <= sizeof(Poll) + 11 * sizeof(void *), "uS::Socket grew");
 }
 
 #endif // SOCKET_UWS_H
@@ -0,0 +1,113 @@
+#include "StreamWebSocket.h"
+
+namespace uWS {
+    typedef WebSocketProtocol<StreamWebSocket> Protocol;
+
+    // the parser reads a spilled header back in front of the piece and unmasks up to 4 bytes past it
+    void StreamWebSocket::consume(const char *data, size_t length) {
+        while (length && !closed) {
+            size_t piece = std::min<size_t>(length, 1024 * 1024);
+            input.resize(Protocol::CONSUME_PRE_PADDING + piece + Protocol::CONSUME_POST_PADDING);
+            memcpy(&input[Protocol::CONSUME_PRE_PADDING], data, piece);
+            Protocol::consume(&input[Protocol::CONSUME_PRE_PADDING], (unsigned int) piece, this);
+            data += piece;
+            length -= piece;
+        }
+    }
+
+    void StreamWebSocket::send(const char *message, size_t length, OpCode opCode) {
+        if (closed) {
+            return;
+        }
+
+        std::string frame(Protocol::LONG_MESSAGE_HEADER + length, '\0');
+        frame.resize(Protocol::formatMessage(&frame[0], message, length, opCode, length, false));
+        writeHandler(this, frame.data(), frame.length());
+    }
+
+    // done as soon as the frame is written, as WebSocket::close is. 1005 stands for no code and is not sent
+    void StreamWebSocket::close(int code, const char *message, size_t length) {
+        if (closed) {
+            return;
+        }
+
+        length = std::min<size_t>(length, MAX_CLOSE_REASON);
+        char closePayload[MAX_CLOSE_REASON + 2];
+        size_t closePayloadLength = Protocol::formatClosePayload(closePayload, code == 1005 ? 0 : (uint16_t) code, message, length);
+        send(closePayload, closePayloadLength, CLOSE);
+        finish(code, (char *) message, length);
+    }
+
+    void StreamWebSocket::terminate() {
+        finish(1006, nullptr, 0);
+    }
+
+    void StreamWebSocket::finish(int code, char *message, size_t length) {
+        if (!closed) {
+            closed = true;
+            fragments.clear();
+            control.clear();
+            closeHandler(this, code, message, length);
+        }
+    }
+
+    bool StreamWebSocket::refusePayloadLength(uint64_t length, WebSocketState *webSocketState) {
+        return length > static_cast<StreamWebSocket *>(webSocketState)->maxPayload;
+    }
+
+    void StreamWebSocket::forceClose(WebSocketState *webSocketState) {
+        static_cast<StreamWebSocket *>(webSocketState)->terminate();
+    }
+
+    // a close is answered with the same code
+    bool StreamWebSocket::handleControl(char *data, size_t length, OpCode opCode) {
+        if (opCode == CLOSE) {
+            Protocol::CloseFrame closeFrame = Protocol::parseClosePayload(data, length);
+            close(closeFrame.code, closeFrame.message, closeFrame.length);
+            return true;
+        } else if (opCode == PING) {
+            send(data, length, PONG);
+        }
+        return closed;
+    }
+
+    bool StreamWebSocket::handleFragment(char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin, WebSocketState *webSocketState) {
+        StreamWebSocket *webSocket = static_cast<StreamWebSocket *>(webSocketState);
+        bool textValidated = webSocketState->state.textValidated;
+        webSocketState->state.textValidated = false;
+        bool last = !remainingBytes && fin;
+
+        if (opCode < 3) {
+            if (opCode == TEXT && !textValidated && !Protocol::isValidUtf8Piece(webSocket->utf8Tail, webSocket->utf8TailLength, (unsigned char *) data, length, last)) {
+                forceClose(webSocketState);
+                return true;
+            }
+
+            if (last && webSocket->fragments.empty()) {
+                webSocket->messageHandler(webSocket, data, length, (OpCode) opCode);
+            } else {
+                if (webSocket->fragments.length() + length > webSocket->maxPayload) {
+                    forceClose(webSocketState);
+                    return true;
+                }
+                webSocket->fragments.append(data, length);
+                if (last) {
+                    webSocket->messageHandler(webSocket, &webSocket->fragments[0], webSocket->fragments.length(), (OpCode) opCode);
+                    webSocket->fragments.clear();
+                }
+            }
+            return webSocket->closed;
+        }
+
+        if (!remainingBytes && webSocket->control.empty()) {
+            return webSocket->handleControl(data, length, (OpCode) opCode);
+        }
+        webSocket->control.append(data, length);
+        if (!remainingBytes) {
+            std::string control;
+            control.swap(webSocket->control);
+            return webSocket->handleControl(&control[0], control.length(), (OpCode) opCode);
+        }
+        return false;
+    }
+}
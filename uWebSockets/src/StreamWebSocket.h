@@ -0,0 +1,94 @@
+#ifndef STREAMWEBSOCKET_UWS_H
+#define STREAMWEBSOCKET_UWS_H
+
+#include "WebSocketProtocol.h"
+#include <functional>
+#include <string>
+
+namespace uWS {
+    /*
+     * A server WebSocket carried by a stream of someone else's instead of a
+     * socket of its own, like an HTTP/2 stream opened by an extended CONNECT
+     * (RFC 8441) on Node's http2. It runs the parser and framing of
+     * WebSocket: consume takes what arrived on the stream, and every frame
+     * to send goes to onWrite. Many of them share one connection, whose
+     * TLS, flow control and backpressure are the stream's business.
+     *
+     * Not permessage-deflate, which RFC 8441 leaves to the extension
+     * headers that are not negotiated here. Not thread safe
+     *
+     */
+    struct WIN32_EXPORT StreamWebSocket : WebSocketState {
+        // messages longer than maxPayload close the stream with 1006 as WebSocket does
+        StreamWebSocket(size_t maxPayload = 16 * 1024 * 1024) : maxPayload(maxPayload) {}
+
+        // whole frames, in order, for the stream
+        void onWrite(std::function<void(StreamWebSocket *, const char *data, size_t length)> handler) {
+            writeHandler = std::move(handler);
+        }
+
+        // text is valid UTF-8. Pings are answered before this sees anything
+        void onMessage(std::function<void(StreamWebSocket *, char *message, size_t length, OpCode opCode)> handler) {
+            messageHandler = std::move(handler);
+        }
+
+        // once, whoever closed it: the code and reason of the close frame, 1006 when terminated. The stream
+        // can be ended from here on
+        void onClose(std::function<void(StreamWebSocket *, int code, char *message, size_t length)> handler) {
+            closeHandler = std::move(handler);
+        }
+
+        // what the stream delivered, any piece of it. Nothing is taken once closed
+        void consume(const char *data, size_t length);
+
+        // a data frame or a ping. Nothing is sent once closed
+        void send(const char *message, size_t length, OpCode opCode);
+
+        // sends a close frame and calls onClose right away, as WebSocket::close does
+        void close(int code = 1000, const char *message = nullptr, size_t length = 0);
+
+        // for a stream that ended or was reset, onClose gets 1006 unless it already ran
+        void terminate();
+
+        bool isClosed() const {
+            return closed;
+        }
+
+        void *getUserData() const {
+            return userData;
+        }
+
+        void setUserData(void *userData) {
+            this->userData = userData;
+        }
+
+    private:
+        std::function<void(StreamWebSocket *, const char *, size_t)> writeHandler = [](StreamWebSocket *, const char *, size_t) {};
+        std::function<void(StreamWebSocket *, char *, size_t, OpCode)> messageHandler = [](StreamWebSocket *, char *, size_t, OpCode) {};
+        std::function<void(StreamWebSocket *, int, char *, size_t)> closeHandler = [](StreamWebSocket *, int, char *, size_t) {};
+        void *userData = nullptr;
+        size_t maxPayload;
+        // consume's copy of a piece, with the room around it that the parser writes into
+        std::string input;
+        // the data message being reassembled and a control frame split between pieces
+        std::string fragments, control;
+        unsigned char utf8Tail[3], utf8TailLength = 0;
+        bool closed = false;
+        static const size_t MAX_CLOSE_REASON = 123;
+
+        void finish(int code, char *message, size_t length);
+        bool handleControl(char *data, size_t length, OpCode opCode);
+
+        // of WebSocketProtocol
+        static const bool IS_SERVER = true;
+        static bool refusePayloadLength(uint64_t length, WebSocketState *webSocketState);
+        static bool setCompressed(WebSocketState *) {
+            return false;
+        }
+        static void forceClose(WebSocketState *webSocketState);
+        static bool handleFragment(char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin, WebSocketState *webSocketState);
+        friend class WebSocketProtocol<StreamWebSocket>;
+    };
+}
+
+#endif // STREAMWEBSOCKET_UWS_H
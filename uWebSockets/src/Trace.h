@@ -0,0 +1,49 @@
+#ifndef TRACE_UWS_H
+#define TRACE_UWS_H
+
+#include <cstdint>
+
+// static tracepoints at the upgrade and close of sockets, messages received and delivered, backpressure,
+// deflates and inflates and sockets moving between threads. With UWS_USDT (Linux, <sys/sdt.h> of systemtap)
+// each is also a USDT probe of provider uws with the id and arg below, a nop until bpftrace or perf attach
+#ifdef UWS_USDT
+#include <sys/sdt.h>
+#define UWS_PROBE(name, id, arg) DTRACE_PROBE2(uws, name, id, arg)
+#else
+#define UWS_PROBE(name, id, arg)
+#endif
+
+namespace uS {
+    // what an embedder gets of the tracepoints, like the Node addon for its trace_events. The hook is called
+    // only while *enabled, one load and branch otherwise. Set both before any loop runs
+    struct WIN32_EXPORT Trace {
+        enum Event {
+            // instants of a WebSocket upgraded and closed, id the socket and arg its fd
+            UPGRADE, CLOSE,
+            // instant of a complete message read, id the socket and arg its length
+            RECEIVE,
+            // spans of the thread, around the message handler and each deflate or inflate. arg is the length
+            DELIVER, DEFLATE, INFLATE,
+            // span of the socket, from a message first queued to the queue empty again. arg is the fd
+            BACKPRESSURE,
+            // instants of a socket leaving its loop and arriving on another, arg the fd
+            TRANSFER,
+            EVENTS
+        };
+        // the names of the events, also those of the probes
+        static const char *names[EVENTS];
+
+        // phase as in trace_events: 'B' and 'E' of a span of the thread, 'b' and 'e' of one of id, 'I' an instant
+        static void (*hook)(Event event, char phase, const void *id, uint64_t arg);
+        static const uint8_t *enabled;
+    };
+}
+
+#define UWS_TRACE(name, event, phase, id, arg) do {\
+    UWS_PROBE(name, id, arg);\
+    if (*uS::Trace::enabled) {\
+        uS::Trace::hook(uS::Trace::event, phase, id, (uint64_t) (arg));\
+    }\
+} while (0)
+
+#endif // TRACE_UWS_H
@@ -1,92 +1,1427 @@
 #include "WebSocket.h"
 #include "Group.h"
 #include "Hub.h"
+#include <openssl/evp.h>
 
 namespace uWS {
-    WebSocket::WebSocket(unsigned int maxP, bool perMessageDeflate, uS::Socket *socket) :
+    // frames of a ClientWebSocket carry a mask
+    static inline size_t formatFrame(bool client, char *dst, const char *src, size_t length, OpCode opCode, bool compressed) {
+        if (client) {
+            return WebSocketProtocol<ClientWebSocket>::formatMessage(dst, src, length, opCode, length, compressed);
+        }
+        return WebSocketProtocol<WebSocket>::formatMessage(dst, src, length, opCode, length, compressed);
+    }
+
+    // frames a payload written behind room for the largest header, which is filled in right aligned
+    // and for a client masks the payload in place. Returns where the frame starts
+    static inline char *formatFrameInPlace(bool client, char *payload, size_t length, OpCode opCode, bool compressed, size_t &frameLength) {
+        size_t headerLength = (length < 126 ? 2 : (length <= UINT16_MAX ? 4 : 10)) + (client ? 4 : 0);
+        char *frame = payload - headerLength;
+        if (client) {
+            frameLength = WebSocketProtocol<ClientWebSocket>::formatMessage(frame, payload, length, opCode, length, compressed);
+        } else {
+            frameLength = WebSocketProtocol<WebSocket>::formatHeader(frame, opCode, length, compressed) + length;
+        }
+        return frame;
+    }
+
+    WebSocket::WebSocket(bool perMessageDeflate, uS::Socket *socket, int slidingWindowBits, int inflateWindowBits) :
         uS::Socket(std::move(*socket)) {
-        maxPayload = maxP;
         compressionStatus = perMessageDeflate ? CompressionStatus::ENABLED : CompressionStatus::DISABLED;
 
-        // if we are created in a group with sliding deflate window allocate it here
-        if (Group::from(this)->extensionOptions & SLIDING_DEFLATE_WINDOW) {
-            slidingDeflateWindow = Hub::allocateDefaultCompressor(new z_stream{});
+        // a negotiated sliding deflate window is allocated by the first compressed send, but counts from now on
+        this->slidingWindowBits = perMessageDeflate ? slidingWindowBits : 0;
+        if (this->slidingWindowBits) {
+            Group::from(this)->deflateWindowSockets++;
+        }
+        slidingWindowUsed = false;
+        presetDictionary = false;
+
+        // and the inflate window of a client keeping its context by the first compressed message,
+        // its memory is reserved from the group's budget right away
+        this->inflateWindowBits = perMessageDeflate ? inflateWindowBits : 0;
+        if (this->inflateWindowBits) {
+            Group::from(this)->inflateMemoryUsed += Group::inflateWindowMemory(inflateWindowBits);
+        }
+    }
+
+    bool WebSocket::refusePayloadLength(uint64_t length, WebSocketState *webSocketState) {
+        return length > Group::from(static_cast<WebSocket *>(webSocketState))->maxPayload;
+    }
+
+    struct WebSocket::Mail : uS::Socket::Mail {
+        std::function<void(WebSocket *webSocket, bool cancelled)> work;
+    };
+
+    void WebSocket::postToLoop(std::function<void(WebSocket *webSocket, bool cancelled)> work) {
+        Mail *mail = new Mail;
+        mail->work = std::move(work);
+        mail->run = [](uS::Socket *socket, uS::Socket::Mail *mail, bool cancelled) {
+            static_cast<Mail *>(mail)->work(static_cast<WebSocket *>(socket), cancelled);
+            delete static_cast<Mail *>(mail);
+        };
+        postMail(mail);
+    }
+
+    /*
+     * Frames and sends a WebSocket message.
+     *
+     * Hints: Consider using any of the prepare function if any of their
+     * use cases match what you are trying to achieve (pub/sub, broadcast).
+     * A non-zero conflationKey replaces a still unsent queued message of the
+     * same key (cancelling it) instead of queueing behind it, for feeds where
+     * only the latest update per key matters. Compressed sends of at least
+     * Hub::setCompressionOffloadThreshold bytes are deflated on the libuv
+     * threadpool, keeping their place in line but not their conflationKey
+     * or ttlMs. A non-zero ttlMs drops the message, cancelling it, if it is
+     * still queued without any of it written that many milliseconds later,
+     * for updates that are worthless once stale. With UWS_THREADSAFE other threads post a copy to the socket's mailbox,
+     * which the loop thread sends in posting order. Whatever is still there
+     * when the socket closes is cancelled, past the disconnection handler
+     * the socket must not be used from them anymore.
+     *
+     * Thread safe
+     *
+     */
+    void WebSocket::send(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData, bool compress, uint32_t conflationKey, unsigned int ttlMs) {
+        compress = compress && Group::from(this)->deflatesOutbound();
+
+#ifdef UWS_THREADSAFE
+        // other threads leave a copy in the mailbox, the loop thread sends without any lock
+        if (nodeData->tid != pthread_self()) {
+            std::string copy(message, length);
+            postToLoop([copy, opCode, callback, callbackData, compress, conflationKey, ttlMs](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    webSocket->send(copy.data(), copy.length(), opCode, callback, callbackData, compress, conflationKey, ttlMs);
+                } else if (callback) {
+                    callback(webSocket, callbackData, true, nullptr);
+                }
+            });
+            return;
+        }
+#endif
+
+        // data may not come between the frames of a streamed message, see beginMessage
+        if (stream && opCode < 3) {
+            std::string copy(message, length);
+            holdForStream([copy, opCode, callback, callbackData, compress, conflationKey, ttlMs](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    webSocket->send(copy.data(), copy.length(), opCode, callback, callbackData, compress, conflationKey, ttlMs);
+                } else if (callback) {
+                    callback(webSocket, callbackData, true, nullptr);
+                }
+            });
+            return;
+        }
+
+        // control frames, like pings to find out whether the socket is idle, are no activity
+        Group *group = Group::from(this);
+        if (opCode < 3) {
+            lastActivity = group->idleClock;
+        }
+
+        if (refuseBackpressure(length, conflationKey)) {
+            if (callback) {
+                callback(this, callbackData, true, nullptr);
+            }
+            return;
+        }
+        if (group->sessions && opCode < 3) {
+            group->recordSession(this, message, length, opCode);
+        }
+        if (opCode == PING && !pingSentAt) {
+            pingSentAt = std::max<uint32_t>((uint32_t) (uv_hrtime() / 1000), 1);
+        }
+
+        // pings and pongs go ahead of queued data, a client in the middle of a download still gets its pong in time
+        if (opCode > CLOSE && !hasEmptyQueue()) {
+            group->countSend(this, opCode, length, false);
+            Queue::Message *messagePtr = allocMessage(HEADER_LENGTH + length);
+            messagePtr->length = formatFrame(client, (char *) messagePtr->data, message, length, opCode, false);
+            setCallback(messagePtr, (void(*)(void *, void *, bool, void *)) callback, callbackData);
+            setExpiry(messagePtr, ttlMs);
+            enqueuePriority(messagePtr);
+            return;
+        }
+
+        struct TransformData {
+            OpCode opCode;
+            bool compressed;
+            WebSocket *s;
+        } transformData = {opCode, compress && compresses() && opCode < 3 && !nearPeer() && group->shouldCompress(opCode, length), this};
+
+        // the same message deflated before goes out as the frame kept then, see Hub::setCompressedCache
+        Hub::CompressedCache &compressedCache = group->hub->compressedCache;
+        uint64_t cacheKey = 0;
+        if (transformData.compressed && !slidingWindowBits && !presetDictionary && compressedCache.budget && length >= compressedCache.minLength) {
+            cacheKey = Hub::CompressedCache::getKey(opCode, group->compressionSettings);
+            if (PreparedMessage *preparedMessage = compressedCache.find(message, length, cacheKey)) {
+                if (!callback) {
+                    sendPrepared(preparedMessage, nullptr, false, conflationKey, ttlMs);
+                    return;
+                }
+                // the callback is this send's, not one of the prepared message
+                unsigned char lengthCode = preparedMessage->buffer[1] & 127;
+                size_t headerLength = lengthCode < 126 ? 2 : (lengthCode == 126 ? 4 : 10);
+                group->countSend(this, opCode, preparedMessage->length - headerLength, true);
+                Queue::Message *messagePtr = allocMessage(preparedMessage->length + 4);
+                messagePtr->length = formatFrame(client, (char *) messagePtr->data, preparedMessage->buffer + headerLength,
+                                                 preparedMessage->length - headerLength, opCode, true);
+                messagePtr->conflationKey = conflationKey;
+                sendMessage(messagePtr, (void(*)(void *, void *, bool, void *)) callback, callbackData, ttlMs);
+                return;
+            }
+        }
+
+        // a sliding window has to deflate in order, on the loop, and a dictionary is primed only there
+        size_t offloadThreshold = group->hub->compressionOffloadThreshold;
+        if (transformData.compressed && offloadThreshold && length >= offloadThreshold && !slidingWindowBits && !presetDictionary && nodeData->tid == pthread_self()) {
+            sendOffloaded(message, length, opCode, callback, callbackData);
+            return;
+        }
+
+        // deflated straight into the message, behind room for the header. Output that did not shrink is
+        // framed as is instead, unless a sliding window already took it into its context
+        if (transformData.compressed) {
+            if (slidingWindowBits) {
+                getDeflateWindow();
+                slidingWindowUsed = true;
+            }
+
+            Hub *hub = group->hub;
+            size_t capacity = std::max(length, hub->deflateBound(length, (z_stream *) slidingDeflateWindow, group->compressionSettings, getDictionary()));
+            Queue::Message *messagePtr = allocMessage(HEADER_LENGTH + capacity);
+            char *payload = (char *) messagePtr->data + HEADER_LENGTH;
+            uint64_t startedAt = group->latencyClock();
+            Group::CpuSpan cpuSpan = group->startCpu();
+            UWS_TRACE(deflate__start, DEFLATE, 'B', this, length);
+            size_t compressedLength = hub->deflateInto(message, length, payload, capacity, (z_stream *) slidingDeflateWindow, getDictionary());
+            UWS_TRACE(deflate__done, DEFLATE, 'E', this, compressedLength);
+            group->chargeCpu(Group::CPU_COMPRESSION, cpuSpan);
+            group->recordLatency(Group::DEFLATE_TIME, startedAt);
+            group->recordCompression(opCode, length, compressedLength);
+            if (compressedLength < length || slidingDeflateWindow) {
+                if (cacheKey && compressedLength < length) {
+                    compressedCache.insert(message, length, cacheKey, payload, compressedLength);
+                }
+                group->countSend(this, opCode, compressedLength, true);
+                messagePtr->data = formatFrameInPlace(client, payload, compressedLength, opCode, true, messagePtr->length);
+            } else {
+                group->countSend(this, opCode, length, false);
+                messagePtr->length = formatFrame(client, (char *) messagePtr->data, message, length, opCode, false);
+            }
+
+            messagePtr->conflationKey = conflationKey;
+            sendMessage(messagePtr, (void(*)(void *, void *, bool, void *)) callback, callbackData, ttlMs);
+            return;
+        }
+
+        group->countSend(this, opCode, length, false);
+        if (group->fragmentSize && length > group->fragmentSize && opCode < 3 && !conflationKey && !ttlMs) {
+            sendFragmented(message, length, opCode, callback, callbackData);
+            return;
+        }
+
+        struct WebSocketTransformer {
+            static size_t transform(const char *src, char *dst, size_t length, TransformData transformData) {
+                return formatFrame(transformData.s->client, dst, src, length, transformData.opCode, transformData.compressed);
+            }
+        };
+
+        sendTransformed<WebSocketTransformer>((char *) message, length, (void(*)(void *, void *, bool, void *)) callback, callbackData, transformData, conflationKey, ttlMs);
+    }
+
+    // one queued message per frame of at most Group::setFragmentSize bytes, the callback comes with the last. A frame
+    // that fails to write is dropped like any other send, the ones after it then fail as well
+    void WebSocket::sendFragmented(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData) {
+        size_t fragmentSize = Group::from(this)->fragmentSize;
+        for (size_t offset = 0; offset < length; offset += fragmentSize) {
+            size_t fragmentLength = std::min(fragmentSize, length - offset);
+            bool fin = offset + fragmentLength == length;
+            Queue::Message *messagePtr = allocMessage(HEADER_LENGTH + fragmentLength);
+            messagePtr->length = formatFrame(client, (char *) messagePtr->data, message + offset, fragmentLength, offset ? NONE : opCode, false);
+            if (!fin) {
+                ((char *) messagePtr->data)[0] &= 127;
+            }
+            sendMessage(messagePtr, fin ? (void(*)(void *, void *, bool, void *)) callback : nullptr, fin ? callbackData : nullptr);
+        }
+    }
+
+    bool WebSocket::nearPeer() {
+        return tcpInfo && tcpInfo->rtt < Group::from(this)->compressionMinRtt;
+    }
+
+    bool WebSocket::beginMessage(OpCode opCode, bool compress) {
+        if (stream || opCode == NONE || opCode > BINARY || isClosed() || isShuttingDown()) {
+            return false;
+        }
+        stream = new Stream;
+        stream->opCode = opCode;
+
+        // a socket without a sliding window resets its context per message anyway, so this message gets one of its own
+        if (compress && compresses() && !nearPeer() && Group::from(this)->deflatesOutbound()) {
+            Group *group = Group::from(this);
+            if (slidingWindowBits) {
+                slidingWindowUsed = true;
+                stream->deflate = getDeflateWindow();
+            } else {
+                stream->deflate = Hub::allocateDefaultCompressor(new z_stream{}, 15, group->compressionSettings);
+                stream->deflateMemory = Group::deflateWindowMemory(15, group->compressionSettings.memLevel);
+                group->compressionMemory += stream->deflateMemory;
+            }
+        }
+        return true;
+    }
+
+    void WebSocket::sendFragment(const char *data, size_t length, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData) {
+        sendStreamFrame(data, length, false, callback, callbackData);
+    }
+
+    void WebSocket::endMessage(const char *data, size_t length, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData) {
+        if (!stream) {
+            if (callback) {
+                callback(this, callbackData, true, nullptr);
+            }
+            return;
+        }
+        sendStreamFrame(data, length, true, callback, callbackData);
+        finishStream(isClosed() || isShuttingDown());
+    }
+
+    // the first frame carries the opcode and, compressed, RSV1, the others are continuations
+    void WebSocket::sendStreamFrame(const char *data, size_t length, bool fin, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData) {
+        if (!stream || isClosed() || isShuttingDown()) {
+            if (callback) {
+                callback(this, callbackData, true, nullptr);
+            }
+            return;
+        }
+
+        lastActivity = Group::from(this)->idleClock;
+        OpCode opCode = stream->started ? NONE : stream->opCode;
+        stream->started = true;
+
+        Queue::Message *messagePtr;
+        if (stream->deflate) {
+            z_stream *compressor = (z_stream *) stream->deflate;
+            if (stream->deflate == slidingDeflateWindow) {
+                slidingWindowUsed = true;
+            }
+            // like Hub::deflateBound, room for what a sync flush adds
+            size_t capacity = ::deflateBound(compressor, (uLong) length) + 10;
+            messagePtr = allocMessage(HEADER_LENGTH + capacity);
+            char *payload = (char *) messagePtr->data + HEADER_LENGTH;
+            compressor->next_in = (Bytef *) data;
+            compressor->avail_in = (unsigned int) length;
+            compressor->next_out = (Bytef *) payload;
+            compressor->avail_out = (unsigned int) capacity;
+            ::deflate(compressor, Z_SYNC_FLUSH);
+            size_t compressedLength = capacity - compressor->avail_out;
+
+            // only the message as a whole drops the empty block trailer, those of earlier pieces stay in. A flush
+            // right after another writes nothing
+            if (fin && compressedLength >= 4 && !memcmp(payload + compressedLength - 4, "\0\0\xff\xff", 4)) {
+                compressedLength -= 4;
+            }
+            messagePtr->data = formatFrameInPlace(client, payload, compressedLength, opCode, opCode != NONE, messagePtr->length);
+            Group::from(this)->countSend(this, opCode, compressedLength, true);
+        } else {
+            messagePtr = allocMessage(HEADER_LENGTH + length);
+            messagePtr->length = formatFrame(client, (char *) messagePtr->data, data, length, opCode, false);
+            Group::from(this)->countSend(this, opCode, length, false);
+        }
+        if (!fin) {
+            ((char *) messagePtr->data)[0] &= 127;
+        }
+        sendMessage(messagePtr, (void(*)(void *, void *, bool, void *)) callback, callbackData);
+    }
+
+    void WebSocket::holdForStream(std::function<void(WebSocket *webSocket, bool cancelled)> work) {
+        stream->held.push_back(std::move(work));
+    }
+
+    // closes the streamed message and sends what waited for it, or cancels that when the socket closed
+    void WebSocket::finishStream(bool cancelled) {
+        Stream *finished = stream;
+        stream = nullptr;
+        if (finished->deflate && finished->deflate != slidingDeflateWindow) {
+            deflateEnd((z_stream *) finished->deflate);
+            delete (z_stream *) finished->deflate;
+            Group::from(this)->compressionMemory -= finished->deflateMemory;
+        }
+
+        // a held send may begin the next streamed message, anything after it is held for that one
+        for (std::function<void(WebSocket *webSocket, bool cancelled)> &work : finished->held) {
+            work(this, cancelled || isClosed() || isShuttingDown());
+        }
+        delete finished;
+    }
+
+    /*
+     * Frames and sends a WebSocket message of length bytes that write puts
+     * straight into the queued message, behind room for the header.
+     *
+     * Hints: For payloads that would otherwise have to be converted into a
+     * buffer of their own first, like a V8 string as UTF-8. Compressed
+     * messages and sends from other threads are written into a copy and
+     * sent as usual, write is always called before this returns.
+     *
+     * Thread safe
+     *
+     */
+    void WebSocket::sendWritten(size_t length, OpCode opCode, void (*write)(char *payload, size_t length, void *writeData), void *writeData, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData, bool compress, uint32_t conflationKey, unsigned int ttlMs) {
+        compress = compress && Group::from(this)->deflatesOutbound();
+        bool copy = (compress && compresses() && opCode < 3) || (stream && opCode < 3);
+#ifdef UWS_THREADSAFE
+        copy = copy || nodeData->tid != pthread_self();
+#endif
+        if (copy) {
+            std::string payload(length, '\0');
+            write(&payload[0], length, writeData);
+            send(payload.data(), length, opCode, callback, callbackData, compress, conflationKey, ttlMs);
+            return;
+        }
+
+        if (opCode < 3) {
+            lastActivity = Group::from(this)->idleClock;
+        }
+        if (refuseBackpressure(length, conflationKey)) {
+            if (callback) {
+                callback(this, callbackData, true, nullptr);
+            }
+            return;
+        }
+
+        Queue::Message *messagePtr = allocMessage(HEADER_LENGTH + length);
+        char *payload = (char *) messagePtr->data + HEADER_LENGTH;
+        write(payload, length, writeData);
+        messagePtr->data = formatFrameInPlace(client, payload, length, opCode, false, messagePtr->length);
+        Group::from(this)->countSend(this, opCode, length, false);
+        messagePtr->conflationKey = conflationKey;
+        sendMessage(messagePtr, (void(*)(void *, void *, bool, void *)) callback, callbackData, ttlMs);
+    }
+
+    /*
+     * Sends count frames back to back as one message of the queue, nothing
+     * sent meanwhile comes between them, with one callback for all.
+     *
+     * Hints: For a sequence that only makes sense whole, like a socket.io
+     * event and its binary attachments. The frames are framed into one buffer
+     * and written with one call. Backpressure refuses or takes them all.
+     * Control frames are sent in place like data.
+     *
+     * With compress, data frames worth it are deflated one after the other
+     * straight into that buffer, through the sliding window if the socket has
+     * one, each ending in its own sync flush.
+     *
+     * Thread safe
+     *
+     */
+    void WebSocket::sendBatch(const Frame *frames, size_t count, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData, bool compress) {
+        size_t length = 0;
+        bool hasData = false;
+        for (size_t i = 0; i < count; i++) {
+            length += frames[i].length;
+            hasData = hasData || frames[i].opCode < 3;
+        }
+
+        bool copy = stream && hasData;
+#ifdef UWS_THREADSAFE
+        copy = copy || nodeData->tid != pthread_self();
+#endif
+        if (copy) {
+            std::vector<std::string> payloads;
+            std::vector<OpCode> opCodes;
+            for (size_t i = 0; i < count; i++) {
+                payloads.emplace_back(frames[i].data, frames[i].length);
+                opCodes.push_back(frames[i].opCode);
+            }
+            auto work = [payloads, opCodes, callback, callbackData, compress](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    std::vector<Frame> frames;
+                    for (size_t i = 0; i < payloads.size(); i++) {
+                        frames.push_back({payloads[i].data(), payloads[i].length(), opCodes[i]});
+                    }
+                    webSocket->sendBatch(frames.data(), frames.size(), callback, callbackData, compress);
+                } else if (callback) {
+                    callback(webSocket, callbackData, true, nullptr);
+                }
+            };
+#ifdef UWS_THREADSAFE
+            if (nodeData->tid != pthread_self()) {
+                postToLoop(work);
+                return;
+            }
+#endif
+            holdForStream(work);
+            return;
+        }
+
+        Group *group = Group::from(this);
+        if (hasData) {
+            lastActivity = group->idleClock;
+        }
+        if (refuseBackpressure(length)) {
+            if (callback) {
+                callback(this, callbackData, true, nullptr);
+            }
+            return;
+        }
+
+        if (!count) {
+            if (callback) {
+                callback(this, callbackData, false, nullptr);
+            }
+            return;
+        }
+        // room for every frame that may be deflated at its bound, which for the shared compressor also readies it for the group
+        compress = compress && compresses() && !nearPeer();
+        Hub *hub = group->hub;
+        size_t capacity = length + count * HEADER_LENGTH;
+        if (compress) {
+            if (slidingWindowBits) {
+                getDeflateWindow();
+                slidingWindowUsed = true;
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (frames[i].opCode < 3 && frames[i].length >= group->compressionThreshold) {
+                    capacity += hub->deflateBound(frames[i].length, (z_stream *) slidingDeflateWindow, group->compressionSettings, getDictionary());
+                }
+            }
+        }
+
+        Queue::Message *messagePtr = allocMessage(capacity);
+        char *dst = (char *) messagePtr->data;
+        for (size_t i = 0; i < count; i++) {
+            const Frame &frame = frames[i];
+            if (compress && frame.opCode < 3 && group->shouldCompress(frame.opCode, frame.length)) {
+                // deflated behind room for the header, then moved up against the frame before it
+                char *payload = dst + HEADER_LENGTH;
+                size_t bound = (char *) messagePtr->data + capacity - payload;
+                Group::CpuSpan cpuSpan = group->startCpu();
+                size_t compressedLength = hub->deflateInto(frame.data, frame.length, payload, bound, (z_stream *) slidingDeflateWindow, getDictionary());
+                group->chargeCpu(Group::CPU_COMPRESSION, cpuSpan);
+                group->recordCompression(frame.opCode, frame.length, compressedLength);
+                if (compressedLength < frame.length || slidingDeflateWindow) {
+                    size_t frameLength;
+                    char *formatted = formatFrameInPlace(client, payload, compressedLength, frame.opCode, true, frameLength);
+                    memmove(dst, formatted, frameLength);
+                    dst += frameLength;
+                    group->countSend(this, frame.opCode, compressedLength, true);
+                    continue;
+                }
+            }
+            dst += formatFrame(client, dst, frame.data, frame.length, frame.opCode, false);
+            group->countSend(this, frame.opCode, frame.length, false);
+        }
+        messagePtr->length = dst - messagePtr->data;
+        sendMessage(messagePtr, (void(*)(void *, void *, bool, void *)) callback, callbackData);
+    }
+
+    // one send being deflated on the threadpool, it outlives its socket if that closes meanwhile
+    struct WebSocket::CompressionJob {
+        uv_work_t work;
+        std::string input, output;
+        size_t frameOffset, frameLength, compressedLength;
+        OpCode opCode;
+        bool client;
+        // of the socket's group when queued
+        CompressionSettings settings;
+        // cleared when the placeholder is freed before the job is done
+        WebSocket *webSocket;
+        Queue::Message *placeholder;
+        bool done = false;
+    };
+
+    struct WebSocket::InflationJob {
+        uv_work_t work;
+        std::string input, output;
+        OpCode opCode;
+        size_t maxPayload;
+        // of a client keeping its context, the job's to free if the socket closes first
+        z_stream *slidingInflateWindow;
+        bool inflated = false, valid = false;
+        // text of a trusted peer, which is not validated once inflated either
+        bool textValidated = false;
+        // cleared when the socket closes before the job is done
+        WebSocket *webSocket;
+        // what the read that completed the message held behind it, handled once it is delivered
+        struct Frame {
+            std::string payload;
+            OpCode opCode;
+            bool compressed, textValidated;
+        };
+        std::vector<Frame> backlog;
+    };
+
+    void WebSocket::deflateJob(uv_work_t *work) {
+        CompressionJob *job = (CompressionJob *) work->data;
+
+        // the payload goes behind room for the largest header, which is then filled in right aligned
+        const size_t HEADER_ROOM = 14;
+        job->output.resize(HEADER_ROOM);
+        size_t length = Hub::deflateOnThread(job->input.data(), job->input.length(), job->settings, job->output);
+
+        // like WebSocket::send, what did not shrink goes out as is
+        job->compressedLength = length;
+        bool compressed = length < job->input.length();
+        if (!compressed) {
+            length = job->input.length();
+            job->output.replace(HEADER_ROOM, std::string::npos, job->input);
+        }
+
+        char *frame = formatFrameInPlace(job->client, &job->output[HEADER_ROOM], length, job->opCode, compressed, job->frameLength);
+        job->frameOffset = frame - job->output.data();
+    }
+
+    void WebSocket::completeJob(uv_work_t *work, int status) {
+        CompressionJob *job = (CompressionJob *) work->data;
+        if (!job->webSocket) {
+            delete job;
+            return;
+        }
+
+        // writing it out can free the placeholder, and with it the job
+        job->done = true;
+        Group *group = Group::from(job->webSocket);
+        group->recordCompression(job->opCode, job->input.length(), job->compressedLength);
+        group->countSend(job->webSocket, job->opCode, std::min(job->compressedLength, job->input.length()), job->compressedLength < job->input.length());
+        job->webSocket->completePending(job->placeholder, job->output.data() + job->frameOffset, job->frameLength);
+    }
+
+    // queues a placeholder right away so that everything sent after this goes out after it
+    void WebSocket::sendOffloaded(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData) {
+        CompressionJob *job = new CompressionJob;
+        job->work.data = job;
+        job->input.assign(message, length);
+        job->opCode = opCode;
+        job->client = client;
+        job->settings = Group::from(this)->compressionSettings;
+        job->webSocket = this;
+
+        job->placeholder = enqueuePending();
+        setCallback(job->placeholder, (void(*)(void *, void *, bool, void *)) callback, callbackData);
+        job->placeholder->sharedBuffer = job;
+        job->placeholder->release = [](void *sharedBuffer) {
+            CompressionJob *job = (CompressionJob *) sharedBuffer;
+            if (job->done) {
+                delete job;
+            } else {
+                job->webSocket = nullptr;
+            }
+        };
+
+        uv_queue_work(Group::from(this)->hub->getLoop(), &job->work, deflateJob, completeJob);
+    }
+
+    // a queued message of whole frames deflated again on the threadpool, see Group::setBacklogCompression.
+    // It outlives its socket if that closes meanwhile, as a CompressionJob does
+    struct WebSocket::BacklogJob {
+        uv_work_t work;
+        std::string input, output;
+        CompressionSettings settings;
+        // of each frame that shrank, for the group's compression stats
+        struct Deflated {
+            OpCode opCode;
+            size_t length, compressedLength;
+        };
+        std::vector<Deflated> deflated;
+        // cleared when the message is freed before the job is done
+        WebSocket *webSocket;
+        Queue::Message *message;
+        bool done = false;
+    };
+
+    // the length of the frame at data, 0 unless it is an unmasked one that fits in length
+    static size_t frameLength(const char *data, size_t length, size_t &headerLength, uint64_t &payloadLength) {
+        if (length < 2 || (data[1] & 128)) {
+            return 0;
+        }
+        unsigned char lengthCode = data[1] & 127;
+        headerLength = lengthCode < 126 ? 2 : (lengthCode == 126 ? 4 : 10);
+        if (length < headerLength) {
+            return 0;
+        }
+        if (lengthCode < 126) {
+            payloadLength = lengthCode;
+        } else if (lengthCode == 126) {
+            payloadLength = ((unsigned char) data[2] << 8) | (unsigned char) data[3];
+        } else {
+            payloadLength = 0;
+            for (int i = 2; i < 10; i++) {
+                payloadLength = (payloadLength << 8) | (unsigned char) data[i];
+            }
+        }
+        return payloadLength <= length - headerLength ? headerLength + payloadLength : 0;
+    }
+
+    // a message deflate takes on its own: final, text or binary and not compressed already. Fragments stay as
+    // they are, RSV1 would only go on the first of them
+    static bool deflatableFrame(const char *frame, uint64_t payloadLength) {
+        const uint64_t MIN_DEFLATED_FRAME = 64;
+        unsigned char opCode = frame[0] & 15;
+        return (frame[0] & 0xC0) == 0x80 && (opCode == TEXT || opCode == BINARY) && payloadLength >= MIN_DEFLATED_FRAME;
+    }
+
+    // behind the front message, which a partial write may have left mid frame, and what an SSL retry has to
+    // pack again. Each message goes pending while its job runs, so nothing behind it is written before it
+    void WebSocket::compressBacklog() {
+        // only what holds nothing but whole frames of its own, something of which is worth deflating
+        auto deflatable = [](const Queue::Message *message) {
+            if (message->pending || message->priority || message->sharedBuffer || message->zeroCopyId ||
+                (message->extra && (message->extra->referencedLength || message->extra->fileDescriptor != -1 || message->extra->expiresAt))) {
+                return false;
+            }
+            bool deflatable = false;
+            size_t headerLength;
+            uint64_t payloadLength;
+            for (size_t offset = 0, length; offset < message->length; offset += length) {
+                if (!(length = frameLength(message->data + offset, message->length - offset, headerLength, payloadLength))) {
+                    return false;
+                }
+                deflatable = deflatable || deflatableFrame(message->data + offset, payloadLength);
+            }
+            return deflatable;
+        };
+
+        Queue::Message **link = pastRetry();
+        if (link == &messageQueue.head && *link) {
+            link = &(*link)->nextMessage;
+        }
+        for (; *link; link = &(*link)->nextMessage) {
+            Queue::Message *message = *link;
+            if (!deflatable(message)) {
+                continue;
+            }
+
+            BacklogJob *job = new BacklogJob;
+            job->work.data = job;
+            job->input.assign(message->data, message->length);
+            job->settings = Group::from(this)->compressionSettings;
+            job->webSocket = this;
+            job->message = message;
+
+            messageQueue.bytes -= message->length;
+            message->length = 0;
+            message->pending = true;
+            message->sharedBuffer = job;
+            message->release = [](void *sharedBuffer) {
+                BacklogJob *job = (BacklogJob *) sharedBuffer;
+                if (job->done) {
+                    delete job;
+                } else {
+                    job->webSocket = nullptr;
+                }
+            };
+            uv_queue_work(Group::from(this)->hub->getLoop(), &job->work, deflateBacklog, completeBacklog);
+        }
+    }
+
+    // like WebSocket::send, what did not shrink goes out as is
+    void WebSocket::deflateBacklog(uv_work_t *work) {
+        BacklogJob *job = (BacklogJob *) work->data;
+        const char *data = job->input.data();
+        std::string deflated;
+        size_t headerLength;
+        uint64_t payloadLength;
+        for (size_t offset = 0, length; offset < job->input.length(); offset += length) {
+            length = frameLength(data + offset, job->input.length() - offset, headerLength, payloadLength);
+            const char *frame = data + offset;
+            if (deflatableFrame(frame, payloadLength)) {
+                OpCode opCode = (OpCode) (frame[0] & 15);
+                deflated.clear();
+                size_t compressedLength = Hub::deflateOnThread(frame + headerLength, payloadLength, job->settings, deflated);
+                if (compressedLength < payloadLength) {
+                    char header[10];
+                    job->output.append(header, WebSocketProtocol<WebSocket>::formatHeader(header, opCode, compressedLength, true));
+                    job->output.append(deflated);
+                    job->deflated.push_back({opCode, payloadLength, compressedLength});
+                    continue;
+                }
+            }
+            job->output.append(frame, length);
+        }
+    }
+
+    void WebSocket::completeBacklog(uv_work_t *work, int status) {
+        BacklogJob *job = (BacklogJob *) work->data;
+        if (!job->webSocket) {
+            delete job;
+            return;
+        }
+
+        // writing it out can free the message, and with it the job
+        job->done = true;
+        Group *group = Group::from(job->webSocket);
+        for (BacklogJob::Deflated &deflated : job->deflated) {
+            group->recordCompression(deflated.opCode, deflated.length, deflated.compressedLength);
+        }
+        job->webSocket->completePending(job->message, job->output.data(), job->output.length());
+    }
+
+    /*
+     * Frames and sends a WebSocket message without copying its payload, only
+     * the frame header is buffered. The message has to stay valid until the
+     * callback is called (cancelled or not), it is the release hook.
+     *
+     * Hints: Falls back to a regular copying send for SSL sockets, client
+     * sockets (which mask the payload) and compressed messages since none of
+     * them can send from caller memory.
+     *
+     * Thread safe
+     *
+     */
+    void WebSocket::sendReferenced(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData, bool compress) {
+        compress = compress && Group::from(this)->deflatesOutbound();
+        if (ssl || client || (compress && compresses() && opCode < 3)) {
+            send(message, length, opCode, callback, callbackData, compress);
+            return;
+        }
+
+#ifdef UWS_THREADSAFE
+        // the message stays valid until the callback anyway, so only the pointer goes in the mailbox
+        if (nodeData->tid != pthread_self()) {
+            postToLoop([message, length, opCode, callback, callbackData, compress](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    webSocket->sendReferenced(message, length, opCode, callback, callbackData, compress);
+                } else if (callback) {
+                    callback(webSocket, callbackData, true, nullptr);
+                }
+            });
+            return;
+        }
+#endif
+
+        if (stream && opCode < 3) {
+            holdForStream([message, length, opCode, callback, callbackData, compress](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    webSocket->sendReferenced(message, length, opCode, callback, callbackData, compress);
+                } else if (callback) {
+                    callback(webSocket, callbackData, true, nullptr);
+                }
+            });
+            return;
+        }
+
+        lastActivity = Group::from(this)->idleClock;
+        if (refuseBackpressure(length)) {
+            if (callback) {
+                callback(this, callbackData, true, nullptr);
+            }
+            return;
+        }
+
+        Group::from(this)->countSend(this, opCode, length, false);
+        char header[10];
+        size_t headerLength = WebSocketProtocol<WebSocket>::formatHeader(header, opCode, length, false);
+        uS::Socket::sendReferenced(header, headerLength, message, length, (void(*)(void *, void *, bool, void *)) callback, callbackData);
+    }
+
+    void WebSocket::sendFrame(const char *frame, size_t length) {
+        unsigned char lengthCode = frame[1] & 127;
+        size_t headerLength = lengthCode < 126 ? 2 : (lengthCode == 126 ? 4 : 10);
+        OpCode opCode = (OpCode) (frame[0] & 15);
+        // pings and pongs jump the queue in send, and what sessions keep is a copy anyway
+        if (ssl || client || stream || opCode > CLOSE || Group::from(this)->sessions) {
+            send(frame + headerLength, length - headerLength, opCode);
+            return;
+        }
+
+#ifdef UWS_THREADSAFE
+        if (nodeData->tid != pthread_self()) {
+            postToLoop([frame, length](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    webSocket->sendFrame(frame, length);
+                }
+            });
+            return;
+        }
+#endif
+
+        if (opCode < 3) {
+            lastActivity = Group::from(this)->idleClock;
+        }
+        if (refuseBackpressure(length)) {
+            return;
+        }
+
+        Group::from(this)->countSend(this, opCode, length - headerLength, false);
+        uS::Socket::sendReferenced(nullptr, 0, frame, length, nullptr, nullptr);
+    }
+
+    /*
+     * Frames a message once so that it can be sent to any number of sockets
+     * with sendPrepared, each of which only references the framed buffer.
+     *
+     * Hints: Pass compressed when data already is a permessage-deflate payload,
+     * Group::prepareMessage does the deflating for you. The callback is called once
+     * per sendPrepared with reserved set when that was the last reference.
+     * Call finalizeMessage when done sending to drop the initial reference.
+     *
+     */
+    WebSocket::PreparedMessage *WebSocket::prepareMessage(char *data, size_t length, OpCode opCode, bool compressed, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved)) {
+        PreparedMessage *preparedMessage = new PreparedMessage;
+        preparedMessage->capacity = length + 10;
+        preparedMessage->buffer = uS::LargeBuffer::allocate(preparedMessage->capacity);
+        preparedMessage->length = WebSocketProtocol<WebSocket>::formatMessage(preparedMessage->buffer, data, length, opCode, length, compressed);
+        preparedMessage->references = 1;
+        preparedMessage->callback = (void(*)(void *, void *, bool, void *)) callback;
+        preparedMessage->compressed = compressed;
+        preparedMessage->uncompressed = nullptr;
+        return preparedMessage;
+    }
+
+    static void freePreparedMessage(WebSocket::PreparedMessage *preparedMessage) {
+        if (preparedMessage->uncompressed) {
+            WebSocket::finalizeMessage(preparedMessage->uncompressed);
+        }
+        uS::LargeBuffer::free(preparedMessage->buffer, preparedMessage->capacity);
+        delete preparedMessage;
+    }
+
+    /*
+     * Sends a message framed by prepareMessage without copying it.
+     *
+     * Hints: Sockets that did not negotiate permessage-deflate or that keep their
+     * own sliding window cannot take a compressed frame, since it was not deflated
+     * with their context. They get its uncompressed variant if it has one (see
+     * Group::prepareMessage), otherwise the send is cancelled. Deferred sends are written
+     * at the end of the loop iteration together with everything else queued by then.
+     * Client sockets send a masked copy, prepared frames are framed for servers.
+     * ttlMs is as for send.
+     *
+     * Thread safe
+     *
+     */
+    void WebSocket::sendPrepared(WebSocket::PreparedMessage *preparedMessage, void *callbackData, bool defer, uint32_t conflationKey, unsigned int ttlMs) {
+#ifdef UWS_THREADSAFE
+        // the mail holds a reference of its own until the loop thread is done with it
+        if (nodeData->tid != pthread_self()) {
+            preparedMessage->references++;
+            postToLoop([preparedMessage, callbackData, defer, conflationKey, ttlMs](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    webSocket->sendPrepared(preparedMessage, callbackData, defer, conflationKey, ttlMs);
+                } else if (preparedMessage->callback) {
+                    preparedMessage->callback(webSocket, callbackData, true, (void *) (preparedMessage->references == 1));
+                }
+                finalizeMessage(preparedMessage);
+            });
+            return;
+        }
+#endif
+
+        // held with a reference of its own like the mail above
+        if (stream && (preparedMessage->buffer[0] & 15) < 3) {
+            preparedMessage->references++;
+            holdForStream([preparedMessage, callbackData, defer, conflationKey, ttlMs](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    webSocket->sendPrepared(preparedMessage, callbackData, defer, conflationKey, ttlMs);
+                } else if (preparedMessage->callback) {
+                    preparedMessage->callback(webSocket, callbackData, true, (void *) (preparedMessage->references == 1));
+                }
+                finalizeMessage(preparedMessage);
+            });
+            return;
+        }
+
+        lastActivity = Group::from(this)->idleClock;
+        if (preparedMessage->uncompressed && (compressionStatus == DISABLED || slidingWindowBits || !Group::from(this)->deflatesOutbound())) {
+            sendPrepared(preparedMessage->uncompressed, callbackData, defer, conflationKey, ttlMs);
+            return;
+        }
+
+        // the queued message holds a reference which it releases when freed, the callback only notifies
+        preparedMessage->references++;
+        void(*callback)(void *webSocket, void *data, bool cancelled, void *reserved) = nullptr;
+        if (preparedMessage->callback) {
+            callback = [](void *webSocket, void *data, bool cancelled, void *reserved) {
+                PreparedMessage *preparedMessage = (PreparedMessage *) data;
+                preparedMessage->callback(webSocket, reserved, cancelled, (void *) (preparedMessage->references == 1));
+            };
+        }
+
+        if ((preparedMessage->compressed && (compressionStatus == DISABLED || slidingWindowBits)) || refuseBackpressure(preparedMessage->length, conflationKey)) {
+            if (callback) {
+                callback(this, preparedMessage, true, callbackData);
+            }
+            finalizeMessage(preparedMessage);
+            return;
+        }
+        if (Group::from(this)->sessions && (preparedMessage->buffer[0] & 15) < 3) {
+            Group::from(this)->recordSession(this, preparedMessage);
+        }
+
+        unsigned char lengthCode = preparedMessage->buffer[1] & 127;
+        size_t headerLength = lengthCode < 126 ? 2 : (lengthCode == 126 ? 4 : 10);
+        Group::from(this)->countSend(this, (OpCode) (preparedMessage->buffer[0] & 15), preparedMessage->length - headerLength, preparedMessage->compressed);
+
+        // small and without callback it is cheaper copied into a chunk of the queue than referenced
+        if (!client && !callback && !conflationKey && !ttlMs && queueInChunk(preparedMessage->buffer, preparedMessage->length)) {
+            finalizeMessage(preparedMessage);
+            return;
+        }
+
+        Queue::Message *messagePtr;
+        if (client) {
+            messagePtr = allocMessage(preparedMessage->length + 4);
+            messagePtr->length = formatFrame(true, (char *) messagePtr->data, preparedMessage->buffer + headerLength, preparedMessage->length - headerLength,
+                                             (OpCode) (preparedMessage->buffer[0] & 15), preparedMessage->compressed);
+        } else {
+            messagePtr = allocMessage(0);
+            messagePtr->data = preparedMessage->buffer;
+            messagePtr->length = preparedMessage->length;
+        }
+        messagePtr->sharedBuffer = preparedMessage;
+        messagePtr->release = [](void *sharedBuffer) {
+            finalizeMessage((PreparedMessage *) sharedBuffer);
+        };
+        setCallback(messagePtr, callback, preparedMessage, callbackData);
+        messagePtr->conflationKey = conflationKey;
+
+        if (hasEmptyQueue()) {
+            bool waiting;
+            size_t length = messagePtr->length;
+            if (write(messagePtr, waiting, defer)) {
+                if (!waiting) {
+                    if (callback) {
+                        callback(this, preparedMessage, false, callbackData);
+                    }
+                    freeMessage(messagePtr);
+                } else if (messagePtr->length == length) {
+                    setExpiry(messagePtr, ttlMs);
+                }
+            } else {
+                if (callback) {
+                    callback(this, preparedMessage, true, callbackData);
+                }
+                freeMessage(messagePtr);
+            }
+        } else {
+            setExpiry(messagePtr, ttlMs);
+            enqueueConflated(messagePtr);
+        }
+    }
+
+    /*
+     * Drops the reference prepareMessage started out with, the buffer is freed
+     * once every sendPrepared is done with it as well.
+     *
+     */
+    void WebSocket::finalizeMessage(WebSocket::PreparedMessage *preparedMessage) {
+        if (!--preparedMessage->references) {
+            freePreparedMessage(preparedMessage);
+        }
+    }
+
+    WebSocket::FileMessage *WebSocket::prepareFile(int fd, uint64_t offset, size_t length, OpCode opCode) {
+        FileMessage *fileMessage = new FileMessage;
+        fileMessage->fd = fd;
+        fileMessage->offset = offset;
+        fileMessage->length = length;
+        fileMessage->opCode = opCode;
+        fileMessage->headerLength = WebSocketProtocol<WebSocket>::formatHeader(fileMessage->header, opCode, length, false);
+        fileMessage->references = 1;
+        return fileMessage;
+    }
+
+    void WebSocket::finalizeFile(FileMessage *fileMessage) {
+        if (!--fileMessage->references) {
+            delete fileMessage;
         }
     }
 
     /*
-     * Frames and sends a WebSocket message.
+     * Sends a message prepared by prepareFile. Its header is queued like any
+     * frame, its payload goes from the page cache to the socket with sendfile
+     * once everything before it is written, without ever being copied into
+     * user space.
      *
-     * Hints: Consider using any of the prepare function if any of their
-     * use cases match what you are trying to achieve (pub/sub, broadcast)
+     * Hints: TLS sockets still on OpenSSL and client sockets (which mask the
+     * payload) read the range into a regular send instead. Sockets using
+     * kTLS for both directions are plain ones by then and take the sendfile
+     * path, the kernel encrypts. A file shorter than the range cancels the
+     * send if read here, or closes the socket half way through the frame.
      *
      * Thread safe
      *
      */
-    void WebSocket::send(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData, bool compress) {
-
+    void WebSocket::sendFile(FileMessage *fileMessage, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData) {
 #ifdef UWS_THREADSAFE
-        std::lock_guard<std::recursive_mutex> lockGuard(*nodeData->asyncMutex);
-        if (isClosed()) {
-            if (callback) {
-                callback(this, callbackData, true, nullptr);
-            }
+        if (nodeData->tid != pthread_self()) {
+            fileMessage->references++;
+            postToLoop([fileMessage, callback, callbackData](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    webSocket->sendFile(fileMessage, callback, callbackData);
+                } else if (callback) {
+                    callback(webSocket, callbackData, true, nullptr);
+                }
+                finalizeFile(fileMessage);
+            });
             return;
         }
 #endif
 
-        struct TransformData {
-            OpCode opCode;
-            bool compress;
-            WebSocket *s;
-        } transformData = {opCode, compress && compressionStatus == WebSocket::CompressionStatus::ENABLED && opCode < 3, this};
+        if (stream && fileMessage->opCode < 3) {
+            fileMessage->references++;
+            holdForStream([fileMessage, callback, callbackData](WebSocket *webSocket, bool cancelled) {
+                if (!cancelled) {
+                    webSocket->sendFile(fileMessage, callback, callbackData);
+                } else if (callback) {
+                    callback(webSocket, callbackData, true, nullptr);
+                }
+                finalizeFile(fileMessage);
+            });
+            return;
+        }
 
-        struct WebSocketTransformer {
-            static size_t transform(const char *src, char *dst, size_t length, TransformData transformData) {
-                if (transformData.compress) {
-                    char *deflated = Group::from(transformData.s)->hub->deflate((char *) src, length, (z_stream *) transformData.s->slidingDeflateWindow);
-                    return WebSocketProtocol<WebSocket>::formatMessage(dst, deflated, length, transformData.opCode, length, true);
+#ifdef UWS_SENDFILE
+        if (!ssl && !client) {
+            lastActivity = Group::from(this)->idleClock;
+            if (refuseBackpressure(fileMessage->length) || (nodeData->corkBuffer->socket == this && !flushCork())) {
+                if (callback) {
+                    callback(this, callbackData, true, nullptr);
                 }
-                return WebSocketProtocol<WebSocket>::formatMessage(dst, src, length, transformData.opCode, length, false);
+                return;
             }
-        };
+            Group::from(this)->countSend(this, fileMessage->opCode, fileMessage->length, false);
+
+            // written with the rest of the queue at the end of the iteration, by flushQueue
+            Queue::Message *messagePtr = allocMessage(fileMessage->headerLength, fileMessage->header);
+            Queue::Message::Extra *extra = extendMessage(messagePtr);
+            extra->fileDescriptor = fileMessage->fd;
+            extra->fileOffset = fileMessage->offset;
+            extra->referencedLength = fileMessage->length;
+            fileMessage->references++;
+            messagePtr->sharedBuffer = fileMessage;
+            messagePtr->release = [](void *sharedBuffer) {
+                finalizeFile((FileMessage *) sharedBuffer);
+            };
+            setCallback(messagePtr, (void(*)(void *, void *, bool, void *)) callback, callbackData);
+            enqueue(messagePtr);
+            deferWrite(true);
+            return;
+        }
 
-        sendTransformed<WebSocketTransformer>((char *) message, length, (void(*)(void *, void *, bool, void *)) callback, callbackData, transformData);
+        std::string payload(fileMessage->length, '\0');
+        size_t read = 0;
+        while (read < fileMessage->length) {
+            ssize_t result = pread(fileMessage->fd, &payload[read], fileMessage->length - read, fileMessage->offset + read);
+            if (result <= 0) {
+                break;
+            }
+            read += result;
+        }
+        if (read == fileMessage->length) {
+            send(payload.data(), payload.length(), fileMessage->opCode, callback, callbackData);
+            return;
+        }
+#endif
+        if (callback) {
+            callback(this, callbackData, true, nullptr);
+        }
     }
 
-    uS::Socket *WebSocket::onData(uS::Socket *s, char *data, size_t length) {
+    /*
+     * Applies the Group's backpressure limit to a message about to be queued
+     * behind buffered data. Returns true if the message must not be sent.
+     *
+     * Hints: With CLOSE_SOCKET the socket is terminated before returning. A
+     * message replacing a queued one of its conflation key is never refused,
+     * dropping it would leave the stale update in place.
+     *
+     */
+    bool WebSocket::refuseBackpressure(size_t length, uint32_t conflationKey) {
+        Group *group = Group::from(this);
+        if (!group->maxBackpressure || hasEmptyQueue() || getBufferedAmount() + length <= group->maxBackpressure || findConflated(conflationKey)) {
+            return false;
+        }
+
+        if (group->backpressurePolicy == CLOSE_SOCKET) {
+            terminate(true);
+        }
+        return true;
+    }
+
+    template <class Impl>
+    uS::Socket *WebSocket::consumeData(uS::Socket *s, char *data, size_t length) {
         WebSocket *webSocket = static_cast<WebSocket *>(s);
 
         webSocket->hasOutstandingPong = false;
+        webSocket->lastActivity = Group::from(webSocket)->idleClock;
         if (!webSocket->isShuttingDown()) {
+            Group *group = Group::from(webSocket);
+            group->readStartedAt = group->latencyClock();
+            Group::CpuSpan cpuSpan = group->startCpu();
             webSocket->cork(true);
-            WebSocketProtocol<WebSocket>::consume(data, (unsigned int) length, webSocket);
+            WebSocketProtocol<Impl>::consume(data, (unsigned int) length, webSocket);
+            webSocket->flushMessageBatch();
+            group->readStartedAt = 0;
+            // a socket closed meanwhile is out of the sketch already and stays out
+            uint64_t spent = group->chargeCpu(Group::CPU_PARSE, cpuSpan);
+            if (group->topSocketsCapacity && spent && !webSocket->isClosed()) {
+                group->sampleSocketCost(webSocket, spent);
+            }
             if (!webSocket->isClosed()) {
                 webSocket->cork(false);
+                size_t readBackpressure = Group::from(webSocket)->readBackpressure;
+                if (readBackpressure && webSocket->getBufferedAmount() > readBackpressure && (webSocket->getPoll() & UV_WRITABLE)) {
+                    webSocket->pauseReads(PAUSED_BY_BACKPRESSURE);
+                }
             }
         }
 
         return webSocket;
     }
 
+    uS::Socket *WebSocket::onData(uS::Socket *s, char *data, size_t length) {
+        return consumeData<WebSocket>(s, data, length);
+    }
+
+    uS::Socket *ClientWebSocket::onData(uS::Socket *s, char *data, size_t length) {
+        return consumeData<ClientWebSocket>(s, data, length);
+    }
+
+    uS::Socket *TrustedWebSocket::onData(uS::Socket *s, char *data, size_t length) {
+        return consumeData<TrustedWebSocket>(s, data, length);
+    }
+
+#ifdef UWS_ZEROCOPY_RECEIVE
+    // the rest of a long data frame, which the parser of a client hands on as it is, unmasked and uninflated
+    size_t WebSocket::mappableRemainder() {
+        Group *group = Group::from(this);
+        if (!group->zeroCopyReceive || !group->messageChunkHandler || WebSocketState::state.wantsHead || remainingBytes < group->zeroCopyReceive ||
+                compressionStatus == CompressionStatus::COMPRESSED_FRAME || isShuttingDown()) {
+            return 0;
+        }
+        return remainingBytes;
+    }
+#endif
+
+    // expected is how much more is known to follow, so a frame arriving in pieces is reserved
+    // once at its full size. Further fragments of the message grow it by at least doubling
+    void WebSocket::appendFragment(const char *data, size_t length, size_t expected) {
+        size_t needed = fragmentBuffer.length + length + expected;
+        if (needed > fragmentBuffer.capacity) {
+            Group *group = Group::from(this);
+            Hub *hub = group->hub;
+            size_t capacity = std::max(needed, fragmentBuffer.capacity * 2);
+            char *buffer = hub->bufferPool.take(capacity);
+            group->fragmentMemory += capacity - fragmentBuffer.capacity;
+            if (fragmentBuffer.data) {
+                memcpy(buffer, fragmentBuffer.data, fragmentBuffer.length);
+                hub->bufferPool.give(fragmentBuffer.data, fragmentBuffer.capacity);
+            }
+            fragmentBuffer.data = buffer;
+            fragmentBuffer.capacity = capacity;
+        }
+        memcpy(fragmentBuffer.data + fragmentBuffer.length, data, length);
+        fragmentBuffer.length += length;
+    }
+
+    // makes room in the reassembly budget of the group for what appendFragment(length, expected) would grow the
+    // fragment buffer by, closing whoever holds the most with 1009 until it fits. True if that was this socket
+    bool WebSocket::reserveReassembly(size_t length, size_t expected) {
+        size_t needed = fragmentBuffer.length + length + expected;
+        if (needed <= fragmentBuffer.capacity) {
+            return false;
+        }
+        Group *group = Group::from(this);
+        size_t capacity = std::max(needed, fragmentBuffer.capacity * 2);
+        while (group->fragmentMemory + capacity - fragmentBuffer.capacity > group->reassemblyBudget) {
+            WebSocket *largest = this;
+            size_t largestCapacity = capacity;
+            group->forEach([&largest, &largestCapacity](WebSocket *webSocket) {
+                if (webSocket->fragmentBuffer.capacity > largestCapacity) {
+                    largest = webSocket;
+                    largestCapacity = webSocket->fragmentBuffer.capacity;
+                }
+            });
+            // closing gives back its fragment buffer right away, what does not is no room made
+            static const char reason[] = "Reassembly budget exceeded";
+            size_t fragmentMemory = group->fragmentMemory;
+            largest->close(1009, reason, sizeof(reason) - 1);
+            if (largest == this || isShuttingDown()) {
+                return true;
+            }
+            if (group->fragmentMemory >= fragmentMemory) {
+                close(1009, reason, sizeof(reason) - 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WebSocket::releaseFragments() {
+        if (fragmentBuffer.data) {
+            Group *group = Group::from(this);
+            group->hub->bufferPool.give(fragmentBuffer.data, fragmentBuffer.capacity);
+            group->fragmentMemory -= fragmentBuffer.capacity;
+            fragmentBuffer = {};
+        }
+    }
+
+    void WebSocket::readPeerAddress(uv_os_sock_t fd, PeerAddress &peerAddress) {
+        sockaddr_storage addr;
+        socklen_t addrLength = sizeof(addr);
+        if (uS::Context::getPeerName(fd, (sockaddr *) &addr, &addrLength) == -1) {
+            return;
+        }
+
+        if (addr.ss_family == AF_INET) {
+            sockaddr_in *ipv4 = (sockaddr_in *) &addr;
+            peerAddress.family = 4;
+            peerAddress.port = ntohs(ipv4->sin_port);
+            memcpy(peerAddress.ip, &ipv4->sin_addr, 4);
+        } else if (addr.ss_family == AF_INET6) {
+            sockaddr_in6 *ipv6 = (sockaddr_in6 *) &addr;
+            peerAddress.family = 6;
+            peerAddress.port = ntohs(ipv6->sin6_port);
+            memcpy(peerAddress.ip, &ipv6->sin6_addr, 16);
+        }
+    }
+
+    WebSocket::Address WebSocket::getAddress() const {
+        if (!peerAddress.family) {
+            return uS::Socket::getAddress();
+        }
+
+        static __thread char buf[INET6_ADDRSTRLEN];
+        inet_ntop(peerAddress.family == 4 ? AF_INET : AF_INET6, peerAddress.ip, buf, sizeof(buf));
+        return {peerAddress.port, buf, peerAddress.family == 4 ? "IPv4" : "IPv6"};
+    }
+
+    MemoryStats WebSocket::getMemoryUsage() const {
+        size_t deflateWindows = deflateMemory + (stream ? stream->deflateMemory : 0);
+        if (slidingInflateWindow) {
+            deflateWindows += Group::inflateWindowMemory(inflateWindowBits);
+        }
+        return {messageMemory, fragmentBuffer.capacity, deflateWindows, 0};
+    }
+
+    char *WebSocket::takeMessageBuffer(const char *message, size_t &capacity) {
+        Hub *hub = Group::from(this)->hub;
+        char *buffer = nullptr;
+        if (message && message == hub->inflationBuffer) {
+            buffer = hub->inflationBuffer;
+            capacity = hub->inflationCapacity;
+            hub->inflationBuffer = nullptr;
+        } else if (message && message == fragmentBuffer.data && !controlTipLength) {
+            buffer = fragmentBuffer.data;
+            capacity = fragmentBuffer.capacity;
+            Group::from(this)->fragmentMemory -= capacity;
+            fragmentBuffer = {};
+        }
+        return buffer;
+    }
+
+    // hands a complete message to whichever message handler the group uses
+    void WebSocket::deliverMessage(WebSocket *webSocket, char *data, size_t length, OpCode opCode) {
+        Group *group = Group::from(webSocket);
+        if (group->autoReplyMaxLength && group->autoReply(webSocket, data, length, opCode)) {
+            return;
+        }
+        Group::CpuSpan cpuSpan = group->startCpu();
+        if (group->messageChunkHandler) {
+            UWS_TRACE(deliver__start, DELIVER, 'B', webSocket, length);
+            group->messageChunkHandler(webSocket, data, length, 0, true, opCode);
+            UWS_TRACE(deliver__done, DELIVER, 'E', webSocket, length);
+            group->recordLatency(Group::HANDLER_LATENCY, group->readStartedAt);
+        } else if (group->messageBatchHandler) {
+            Hub *hub = group->hub;
+            hub->batchSocket = webSocket;
+            hub->batchMessages.push_back({(uint32_t) hub->batchData.length(), (uint32_t) length, opCode});
+            hub->batchData.append(data, length);
+        } else {
+            UWS_TRACE(deliver__start, DELIVER, 'B', webSocket, length);
+            group->callMessage(webSocket, data, length, opCode);
+            UWS_TRACE(deliver__done, DELIVER, 'E', webSocket, length);
+            group->recordLatency(Group::HANDLER_LATENCY, group->readStartedAt);
+        }
+        group->chargeCpu(Group::CPU_HANDLERS, cpuSpan);
+    }
+
+    // delivers what the last read batched up for this socket, returns true if it got closed meanwhile
+    bool WebSocket::flushMessageBatch() {
+        Group *group = Group::from(this);
+        Hub *hub = group->hub;
+        if (hub->batchSocket != this) {
+            return false;
+        }
+
+        // a close from within the handler comes back here, and must find nothing left to flush
+        hub->batchSocket = nullptr;
+        UWS_TRACE(deliver__start, DELIVER, 'B', this, hub->batchData.length());
+        Group::CpuSpan cpuSpan = group->startCpu();
+        group->messageBatchHandler(this, (char *) hub->batchData.data(), hub->batchMessages.data(), hub->batchMessages.size());
+        group->chargeCpu(Group::CPU_HANDLERS, cpuSpan);
+        UWS_TRACE(deliver__done, DELIVER, 'E', this, hub->batchData.length());
+        group->recordLatency(Group::HANDLER_LATENCY, group->readStartedAt);
+        hub->batchMessages.clear();
+        hub->batchData.clear();
+        return isClosed() || isShuttingDown();
+    }
+
+    void WebSocket::onDrain(uS::Socket *s) {
+        WebSocket *webSocket = static_cast<WebSocket *>(s);
+        if (!webSocket->isShuttingDown()) {
+            if (webSocket->closeWhenDrained) {
+                webSocket->close(1001);
+                return;
+            }
+            webSocket->resumeReads(PAUSED_BY_BACKPRESSURE);
+            Group::from(webSocket)->drainHandler(webSocket);
+        }
+    }
+
     /*
      * Immediately terminates this WebSocket. Will call onDisconnection of its Group.
      *
      * Hints: Close code will be 1006 and message will be empty.
      *
      */
-    void WebSocket::terminate() {
+    void WebSocket::terminate(bool abortive) {
 
 #ifdef UWS_THREADSAFE
-        std::lock_guard<std::recursive_mutex> lockGuard(*nodeData->asyncMutex);
-        if (isClosed()) {
+        // a socket that closes first is already terminated
+        if (nodeData->tid != pthread_self()) {
+            if (abortive) {
+                postToLoop([](WebSocket *webSocket, bool cancelled) {
+                    if (!cancelled) {
+                        webSocket->terminate(true);
+                    }
+                });
+            } else {
+                postToLoop([](WebSocket *webSocket, bool cancelled) {
+                    if (!cancelled) {
+                        webSocket->terminate();
+                    }
+                });
+            }
             return;
         }
 #endif
 
+        if (abortive) {
+            uS::Context::setAbortiveClose(getFd());
+            nodeData->counters[uS::NodeData::SOCKOPT_CALLS]++;
+        }
         WebSocket::onEnd(this);
     }
 
+    void WebSocket::setIdleTimeout(unsigned int seconds, bool ping) {
+        Group *group = Group::from(this);
+        group->unscheduleIdle(this);
+        idleTimeout = seconds;
+        idlePing = ping;
+        idlePinged = false;
+        if (seconds) {
+            lastActivity = group->idleClock;
+            group->scheduleIdle(this, seconds + 1);
+        }
+    }
+
+    static const int MAX_CLOSE_PAYLOAD = 123;
+
     /*
      * Immediately calls onDisconnection of its Group and begins a passive
      * WebSocket closedown handshake in the background (might succeed or not,
@@ -97,147 +1432,485 @@ namespace uWS {
      */
 
     void WebSocket::close(int code, const char *message, size_t length) {
-        static const int MAX_CLOSE_PAYLOAD = 123;
+        closeWith(nullptr, code, message, length);
+    }
+
+    void WebSocket::closeWith(PreparedMessage *closeFrame, int code, const char *message, size_t length) {
         length = std::min<size_t>(MAX_CLOSE_PAYLOAD, length);
+        if (flushMessageBatch()) {
+            return;
+        }
         Group::from(this)->removeWebSocket(this);
-        Group::from(this)->disconnectionHandler(this, code, (char *) message, length);
+        Group::from(this)->callDisconnection(this, code, (char *) message, length);
+        closeQuietly(code, message, length, closeFrame);
+    }
 
+    // the close frame and what follows it, for a socket its group is done with or never had
+    void WebSocket::closeQuietly(int code, const char *message, size_t length, PreparedMessage *closeFrame) {
         setShuttingDown(true);
 
+        if (closeFrame) {
+            sendPrepared(closeFrame);
+        } else {
+            char closePayload[MAX_CLOSE_PAYLOAD + 2];
+            int closePayloadLength = (int) WebSocketProtocol<WebSocket>::formatClosePayload(closePayload, code, message, length);
+            send(closePayload, closePayloadLength, OpCode::CLOSE, [](WebSocket *p, void *data, bool cancelled, void *reserved) {
+                if (!cancelled) {
+                    p->shutdown();
+                }
+            });
+        }
+        WebSocket::onEnd(this);
+    }
+
+    // shuts the socket down once written, as the close frame of closeQuietly does
+    WebSocket::PreparedMessage *WebSocket::prepareClose(int code, const char *message, size_t length) {
         char closePayload[MAX_CLOSE_PAYLOAD + 2];
-        int closePayloadLength = (int) WebSocketProtocol<WebSocket>::formatClosePayload(closePayload, code, message, length);
-        send(closePayload, closePayloadLength, OpCode::CLOSE, [](WebSocket *p, void *data, bool cancelled, void *reserved) {
+        size_t closePayloadLength = WebSocketProtocol<WebSocket>::formatClosePayload(closePayload, code, message, std::min<size_t>(MAX_CLOSE_PAYLOAD, length));
+        return prepareMessage(closePayload, closePayloadLength, OpCode::CLOSE, false, [](WebSocket *p, void *data, bool cancelled, void *reserved) {
             if (!cancelled) {
                 p->shutdown();
             }
         });
-        WebSocket::onEnd(this);
     }
 
     void WebSocket::onEnd(uS::Socket *s) {
         WebSocket *webSocket = static_cast<WebSocket *>(s);
+        UWS_TRACE(close, CLOSE, 'I', webSocket, webSocket->getFd());
         if (!webSocket->isShuttingDown()) {
+            if (webSocket->flushMessageBatch()) {
+                return;
+            }
             Group::from(webSocket)->removeWebSocket(webSocket);
-            Group::from(webSocket)->disconnectionHandler(webSocket, 1006, nullptr, 0);
+            Group::from(webSocket)->callDisconnection(webSocket, 1006, nullptr, 0);
+        }
+
+        if (webSocket->topics) {
+            Group::from(webSocket)->unsubscribeAll(webSocket);
         }
 
-        webSocket->template closeSocket<WebSocket>();
+        webSocket->releaseFragments();
+        if (webSocket->stream) {
+            webSocket->finishStream(true);
+        }
+        if (webSocket->client) {
+            webSocket->template closeSocket<ClientWebSocket>();
+        } else {
+            webSocket->template closeSocket<WebSocket>();
+        }
 
         while (!webSocket->messageQueue.empty()) {
             Queue::Message *message = webSocket->messageQueue.front();
-            if (message->callback) {
-                message->callback(nullptr, message->callbackData, true, nullptr);
-            }
-            webSocket->messageQueue.pop();
+            message->complete(nullptr, true);
+            webSocket->popMessage();
         }
 
-        webSocket->nodeData->clearPendingPollChanges(webSocket);
+        uS::NodeData::clearPendingPollChanges(webSocket);
+        delete webSocket->tcpInfo;
+        webSocket->tcpInfo = nullptr;
 
         // remove any per-websocket zlib memory
-        if (webSocket->slidingDeflateWindow) {
+        webSocket->releaseDeflateWindow();
+        if (webSocket->slidingWindowBits) {
+            Group::from(webSocket)->deflateWindowSockets--;
+        }
+        if (webSocket->slidingInflateWindow) {
+            Group::from(webSocket)->compressionMemory -= Group::inflateWindowMemory(webSocket->inflateWindowBits);
+        }
+        if (webSocket->inflationJob) {
+            // the threadpool may still be inflating with the window, the job frees it when done
+            webSocket->inflationJob->webSocket = nullptr;
+            webSocket->inflationJob = nullptr;
+            webSocket->slidingInflateWindow = nullptr;
+        }
+        if (webSocket->inflateWindowBits) {
+            if (webSocket->slidingInflateWindow) {
+                inflateEnd((z_stream *) webSocket->slidingInflateWindow);
+                delete (z_stream *) webSocket->slidingInflateWindow;
+            }
+            Group::from(webSocket)->inflateMemoryUsed -= Group::inflateWindowMemory(webSocket->inflateWindowBits);
+        }
+    }
+
+    // the next compressed send starts over with a fresh context, the peer's inflater keeps its
+    // history but nothing refers back into it anymore
+    void WebSocket::releaseDeflateWindow() {
+        if (slidingDeflateWindow) {
             // this relates to Hub::allocateDefaultCompressor
-            deflateEnd((z_stream *) webSocket->slidingDeflateWindow);
-            delete (z_stream *) webSocket->slidingDeflateWindow;
-            webSocket->slidingDeflateWindow = nullptr;
+            deflateEnd((z_stream *) slidingDeflateWindow);
+            delete (z_stream *) slidingDeflateWindow;
+            slidingDeflateWindow = nullptr;
+            Group::from(this)->compressionMemory -= deflateMemory;
+            deflateMemory = 0;
+        }
+        slidingWindowUsed = false;
+    }
+
+    // allocated on first use, with the window negotiated and the memory level of the group as it is then
+    void *WebSocket::getDeflateWindow() {
+        if (!slidingDeflateWindow) {
+            Group *group = Group::from(this);
+            slidingDeflateWindow = Hub::allocateDefaultCompressor(new z_stream{}, slidingWindowBits, group->compressionSettings);
+            deflateMemory = (uint32_t) Group::deflateWindowMemory(slidingWindowBits, group->compressionSettings.memLevel);
+            group->compressionMemory += deflateMemory;
+        }
+        return slidingDeflateWindow;
+    }
+
+    // nullptr, for the shared inflater, unless the client keeps its context
+    void *WebSocket::getInflateWindow() {
+        if (inflateWindowBits && !slidingInflateWindow) {
+            z_stream *inflater = new z_stream{};
+            inflateInit2(inflater, -inflateWindowBits);
+            slidingInflateWindow = inflater;
+            Group::from(this)->compressionMemory += Group::inflateWindowMemory(inflateWindowBits);
+        }
+        return slidingInflateWindow;
+    }
+
+    // nullptr when the compressor and inflater start each message empty
+    const std::string *WebSocket::getDictionary() {
+        return presetDictionary ? &Group::from(this)->deflateDictionary : nullptr;
+    }
+
+
+    // every threadpool thread keeps its own inflater for messages without context, like Hub::inflationStream
+    struct WorkerInflater {
+        z_stream zStream = {};
+
+        WorkerInflater() {
+            inflateInit2(&zStream, -15);
+        }
+
+        ~WorkerInflater() {
+            inflateEnd(&zStream);
+        }
+    };
+
+    // the zlib half of Hub::inflate, into the job's own output
+    void WebSocket::inflateJob(uv_work_t *work) {
+        static thread_local WorkerInflater workerInflater;
+        InflationJob *job = (InflationJob *) work->data;
+
+        z_stream &stream = job->slidingInflateWindow ? *job->slidingInflateWindow : workerInflater.zStream;
+        stream.next_in = (Bytef *) job->input.data();
+        stream.avail_in = (unsigned int) job->input.length();
+
+        static unsigned char syncFlushTrailer[] = {0x00, 0x00, 0xff, 0xff};
+        bool trailerPending = job->slidingInflateWindow;
+
+        size_t inflatedLength = 0;
+        job->output.resize(std::min(std::max<size_t>(job->input.length() * 4, 4096), job->maxPayload + 1));
+        int err;
+        while (true) {
+            stream.next_out = (Bytef *) &job->output[inflatedLength];
+            stream.avail_out = (unsigned int) (job->output.length() - inflatedLength);
+            err = ::inflate(&stream, job->slidingInflateWindow ? Z_SYNC_FLUSH : Z_FINISH);
+            inflatedLength = job->output.length() - stream.avail_out;
+
+            if (stream.avail_out && trailerPending && (err == Z_OK || err == Z_BUF_ERROR)) {
+                stream.next_in = syncFlushTrailer;
+                stream.avail_in = sizeof(syncFlushTrailer);
+                trailerPending = false;
+                continue;
+            }
+
+            if (stream.avail_out || inflatedLength > job->maxPayload || (err != Z_OK && err != Z_BUF_ERROR)) {
+                break;
+            }
+            job->output.resize(std::min(job->output.length() * 2, job->maxPayload + 1));
+        }
+
+        if (!job->slidingInflateWindow || err == Z_STREAM_END) {
+            inflateReset(&stream);
+        }
+        job->output.resize(inflatedLength);
+        job->inflated = (err == Z_BUF_ERROR || err == Z_OK || err == Z_STREAM_END) && inflatedLength <= job->maxPayload;
+        job->valid = job->inflated && (job->opCode != TEXT || job->textValidated || WebSocketProtocol<WebSocket>::isValidUtf8((unsigned char *) job->output.data(), inflatedLength));
+    }
+
+    // delivers the message, then whatever arrived behind it, and reads again unless that started another job
+    void WebSocket::completeInflation(uv_work_t *work, int status) {
+        InflationJob *job = (InflationJob *) work->data;
+        WebSocket *webSocket = job->webSocket;
+        if (!webSocket) {
+            if (job->slidingInflateWindow) {
+                inflateEnd(job->slidingInflateWindow);
+                delete job->slidingInflateWindow;
+            }
+            delete job;
+            return;
+        }
+
+        webSocket->inflationJob = nullptr;
+        if (!job->valid) {
+            delete job;
+            forceClose(webSocket);
+            return;
+        }
+
+        webSocket->cork(true);
+        deliverMessage(webSocket, &job->output[0], job->output.length(), job->opCode);
+        for (InflationJob::Frame &frame : job->backlog) {
+            if (webSocket->isClosed() || webSocket->isShuttingDown()) {
+                break;
+            }
+            if (frame.opCode < 3) {
+                webSocket->handleMessage(&frame.payload[0], frame.payload.length(), frame.opCode, frame.compressed, frame.textValidated);
+            } else {
+                webSocket->handleControl(&frame.payload[0], frame.payload.length(), frame.opCode);
+            }
+        }
+        delete job;
+
+        if (webSocket->isClosed() || webSocket->flushMessageBatch()) {
+            return;
+        }
+        webSocket->cork(false);
+        if (!webSocket->inflationJob && !webSocket->readPaused && !webSocket->isShuttingDown()) {
+            webSocket->change(webSocket, webSocket->setPoll(webSocket->getPoll() | UV_READABLE));
+            // records SSL already read are not signalled again by the kernel
+            if (webSocket->ssl && SSL_has_pending(webSocket->ssl)) {
+                webSocket->getCb()(webSocket, 0, UV_READABLE);
+            }
+        }
+    }
+
+    void WebSocket::pauseReading() {
+        pauseReads(PAUSED_BY_USER);
+    }
+
+    void WebSocket::resumeReading() {
+        resumeReads(PAUSED_BY_USER);
+    }
+
+    // an inflation job already keeps reads off, it turns them back on only with no reason left
+    void WebSocket::pauseReads(unsigned char reason) {
+        if (!readPaused && !inflationJob && !isClosed() && !isShuttingDown()) {
+            change(this, setPoll(getPoll() & ~UV_READABLE));
+        }
+        readPaused |= reason;
+    }
+
+    void WebSocket::resumeReads(unsigned char reason) {
+        if (!(readPaused & reason)) {
+            return;
+        }
+        readPaused &= ~reason;
+        if (!readPaused && !inflationJob && !isClosed() && !isShuttingDown()) {
+            change(this, setPoll(getPoll() | UV_READABLE));
+            // records SSL already read are not signalled again by the kernel, they are read from the loop
+            // rather than from within whatever handler resumed
+            if (ssl && SSL_has_pending(ssl)) {
+                postToLoop([](WebSocket *webSocket, bool cancelled) {
+                    if (!cancelled && !webSocket->readPaused && !webSocket->inflationJob && !webSocket->isShuttingDown() && SSL_has_pending(webSocket->ssl)) {
+                        webSocket->getCb()(webSocket, 0, UV_READABLE);
+                    }
+                });
+            }
+        }
+    }
+
+    // a completed data message, true if the socket closed
+    bool WebSocket::handleMessage(char *data, size_t length, OpCode opCode, bool compressed, bool textValidated) {
+        UWS_TRACE(receive, RECEIVE, 'I', this, length);
+        if (inflationJob) {
+            inflationJob->backlog.push_back({std::string(data, length), opCode, compressed, textValidated});
+            return false;
+        }
+
+        Group *group = Group::from(this);
+        if (compressed) {
+            if (group->hub->inflationOffloadThreshold && length >= group->hub->inflationOffloadThreshold && !presetDictionary) {
+                InflationJob *job = new InflationJob;
+                job->work.data = job;
+                job->input.assign(data, length);
+                job->opCode = opCode;
+                job->textValidated = textValidated;
+                job->maxPayload = group->maxPayload;
+                job->slidingInflateWindow = (z_stream *) getInflateWindow();
+                job->webSocket = this;
+                inflationJob = job;
+
+                // nothing more is read until it is delivered, the rest of this read goes to the backlog
+                change(this, setPoll(getPoll() & ~UV_READABLE));
+                uv_queue_work(group->hub->getLoop(), &job->work, inflateJob, completeInflation);
+                return false;
+            }
+
+            uint64_t startedAt = group->latencyClock();
+            Group::CpuSpan cpuSpan = group->startCpu();
+            UWS_TRACE(inflate__start, INFLATE, 'B', this, length);
+            data = group->hub->inflate(data, length, group->maxPayload, (z_stream *) getInflateWindow(), getDictionary());
+            UWS_TRACE(inflate__done, INFLATE, 'E', this, length);
+            group->chargeCpu(Group::CPU_COMPRESSION, cpuSpan);
+            group->recordLatency(Group::INFLATE_TIME, startedAt);
+            if (!data) {
+                forceClose(this);
+                return true;
+            }
+        }
+
+        if (opCode == TEXT && !textValidated && !WebSocketProtocol<WebSocket>::isValidUtf8((unsigned char *) data, length)) {
+            forceClose(this);
+            return true;
+        }
+
+        deliverMessage(this, data, length, opCode);
+        group->hub->releaseInflationBuffer();
+        return isClosed() || isShuttingDown();
+    }
+
+    // a complete control frame, true if the socket closed
+    bool WebSocket::handleControl(char *data, size_t length, OpCode opCode) {
+        if (inflationJob) {
+            inflationJob->backlog.push_back({std::string(data, length), opCode, false, true});
+            return false;
+        }
+
+        if (opCode == CLOSE) {
+            typename WebSocketProtocol<WebSocket>::CloseFrame closeFrame = WebSocketProtocol<WebSocket>::parseClosePayload(data, length);
+            close(closeFrame.code, closeFrame.message, closeFrame.length);
+            return true;
+        } else if (opCode == PING) {
+            send(data, length, (OpCode) OpCode::PONG);
+        } else if (opCode == PONG && pingSentAt) {
+            // wraps every 71 minutes, which the difference does not mind
+            uint32_t sample = (uint32_t) (uv_hrtime() / 1000) - pingSentAt;
+            pingSentAt = 0;
+            rtt = rtt ? (uint32_t) (((uint64_t) rtt * 7 + sample) / 8) : std::max<uint32_t>(sample, 1);
+            Group::from(this)->recordRtt(sample);
+        }
+        return isClosed() || isShuttingDown();
+    }
+
+    // counts a piece of an incoming data message, true while this window is over the limit
+    bool WebSocket::overInboundLimit(size_t length, bool last) {
+        Group *group = Group::from(this);
+        uint32_t now = (uint32_t) uv_now(group->hub->getLoop());
+        if (now - inboundWindowStart >= (uint32_t) group->inboundWindowMs) {
+            inboundWindowStart = now;
+            inboundMessages = inboundBytes = 0;
         }
+        inboundBytes = (uint32_t) std::min<size_t>(inboundBytes + length, UINT32_MAX);
+        inboundMessages += last;
+        return (group->inboundMaxMessages && inboundMessages > group->inboundMaxMessages) ||
+               (group->inboundMaxBytes && inboundBytes > group->inboundMaxBytes);
     }
 
+    // a message over the inbound limit, piece by piece. True if the socket closed instead, else the last
+    // piece drops what was buffered of the message. Earlier pieces are buffered as usual until then
+    bool WebSocket::dropInbound(bool last) {
+        Group *group = Group::from(this);
+        bool compressed = compressionStatus == WebSocket::CompressionStatus::COMPRESSED_FRAME;
+        if (group->inboundPolicy == CLOSE_SOCKET || group->messageChunkHandler || (compressed && inflateWindowBits)) {
+            close(1008);
+            return true;
+        }
+        if (last) {
+            group->inboundDropped++;
+            if (compressed) {
+                compressionStatus = WebSocket::CompressionStatus::ENABLED;
+            }
+            utf8TailLength = 0;
+            releaseFragments();
+        }
+        return false;
+    }
 
     bool WebSocket::handleFragment(char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin, WebSocketState *webSocketState) {
         WebSocket *webSocket = static_cast<WebSocket *>(webSocketState);
         Group *group = Group::from(webSocket);
+        bool textValidated = webSocketState->state.textValidated;
+        webSocketState->state.textValidated = false;
+        if (group->recording) {
+            group->record(webSocket, data, length, remainingBytes, opCode, fin);
+        }
 
+        // counted, still compressed, and checked before anything is inflated, validated or delivered
+        bool last = !remainingBytes && fin;
+        if (!remainingBytes) {
+            group->metrics[Group::opCodeMetric(opCode, Group::TEXT_FRAMES_IN)]++;
+        }
         if (opCode < 3) {
-            if (!remainingBytes && fin && !webSocket->fragmentBuffer.length()) {
-                if (webSocket->compressionStatus == WebSocket::CompressionStatus::COMPRESSED_FRAME) {
-                    webSocket->compressionStatus = WebSocket::CompressionStatus::ENABLED;
-                    data = group->hub->inflate(data, length, group->maxPayload);
-                    if (!data) {
-                        forceClose(webSocketState);
-                        return true;
-                    }
-                }
+            group->metrics[Group::BYTES_IN] += length;
+            group->metrics[Group::MESSAGES_IN] += last;
+        }
+        if (opCode < 3 && group->inboundWindowMs && webSocket->overInboundLimit(length, last)) {
+            if (webSocket->dropInbound(last)) {
+                return true;
+            }
+            if (last) {
+                return false;
+            }
+        }
 
-                if (opCode == 1 && !WebSocketProtocol<WebSocket>::isValidUtf8((unsigned char *) data, length)) {
+        if (opCode < 3) {
+            if (group->messageChunkHandler && webSocket->compressionStatus != WebSocket::CompressionStatus::COMPRESSED_FRAME) {
+                // straight from the receive buffer, nothing is reassembled
+                if (opCode == 1 && !textValidated && !WebSocketProtocol<WebSocket>::isValidUtf8Piece(webSocket->utf8Tail, webSocket->utf8TailLength, (unsigned char *) data, length, last)) {
                     forceClose(webSocketState);
                     return true;
                 }
 
-                group->messageHandler(webSocket, data, length, (OpCode) opCode);
+                group->messageChunkHandler(webSocket, data, length, remainingBytes, last, (OpCode) opCode);
                 if (webSocket->isClosed() || webSocket->isShuttingDown()) {
                     return true;
                 }
+            } else if (!remainingBytes && fin && !webSocket->fragmentBuffer.length) {
+                bool compressed = webSocket->compressionStatus == WebSocket::CompressionStatus::COMPRESSED_FRAME;
+                if (compressed) {
+                    webSocket->compressionStatus = WebSocket::CompressionStatus::ENABLED;
+                }
+                if (webSocket->handleMessage(data, length, (OpCode) opCode, compressed, textValidated)) {
+                    return true;
+                }
             } else {
-                webSocket->fragmentBuffer.append(data, length);
+                // uncompressed text is validated as it arrives, so a bad message is refused before it is buffered
+                if (opCode == 1 && !textValidated && webSocket->compressionStatus != WebSocket::CompressionStatus::COMPRESSED_FRAME &&
+                        !WebSocketProtocol<WebSocket>::isValidUtf8Piece(webSocket->utf8Tail, webSocket->utf8TailLength, (unsigned char *) data, length, !remainingBytes && fin)) {
+                    forceClose(webSocketState);
+                    return true;
+                }
+
+                // room for the 4 bytes of inflate padding is always kept
+                if (group->reassemblyBudget && webSocket->reserveReassembly(length, remainingBytes + 4)) {
+                    return true;
+                }
+                webSocket->appendFragment(data, length, remainingBytes + 4);
                 if (!remainingBytes && fin) {
-                    length = webSocket->fragmentBuffer.length();
-                    if (webSocket->compressionStatus == WebSocket::CompressionStatus::COMPRESSED_FRAME) {
+                    length = webSocket->fragmentBuffer.length;
+                    bool compressed = webSocket->compressionStatus == WebSocket::CompressionStatus::COMPRESSED_FRAME;
+                    if (compressed) {
                         webSocket->compressionStatus = WebSocket::CompressionStatus::ENABLED;
-                        webSocket->fragmentBuffer.append("....");
-                        data = group->hub->inflate((char *) webSocket->fragmentBuffer.data(), length, group->maxPayload);
-                        if (!data) {
-                            forceClose(webSocketState);
-                            return true;
-                        }
-                    } else {
-                        data = (char *) webSocket->fragmentBuffer.data();
+                        webSocket->appendFragment("....", 4, 0);
                     }
-
-                    if (opCode == 1 && !WebSocketProtocol<WebSocket>::isValidUtf8((unsigned char *) data, length)) {
-                        forceClose(webSocketState);
-                        return true;
-                    }
-
-                    group->messageHandler(webSocket, data, length, (OpCode) opCode);
-                    if (webSocket->isClosed() || webSocket->isShuttingDown()) {
+                    if (webSocket->handleMessage(webSocket->fragmentBuffer.data, length, (OpCode) opCode, compressed, !compressed || textValidated)) {
                         return true;
                     }
-                    webSocket->fragmentBuffer.clear();
+                    webSocket->releaseFragments();
                 }
             }
         } else {
             if (!remainingBytes && fin && !webSocket->controlTipLength) {
-                if (opCode == CLOSE) {
-                    typename WebSocketProtocol<WebSocket>::CloseFrame closeFrame = WebSocketProtocol<WebSocket>::parseClosePayload(data, length);
-                    webSocket->close(closeFrame.code, closeFrame.message, closeFrame.length);
+                if (webSocket->handleControl(data, length, (OpCode) opCode)) {
                     return true;
-                } else {
-                    if (opCode == PING) {
-                        webSocket->send(data, length, (OpCode) OpCode::PONG);
-                        if (webSocket->isClosed() || webSocket->isShuttingDown()) {
-                            return true;
-                        }
-                    } else if (opCode == PONG) {
-                        if (webSocket->isClosed() || webSocket->isShuttingDown()) {
-                            return true;
-                        }
-                    }
                 }
             } else {
-                webSocket->fragmentBuffer.append(data, length);
+                webSocket->appendFragment(data, length, remainingBytes);
                 webSocket->controlTipLength += length;
 
                 if (!remainingBytes && fin) {
-                    char *controlBuffer = (char *) webSocket->fragmentBuffer.data() + webSocket->fragmentBuffer.length() - webSocket->controlTipLength;
-                    if (opCode == CLOSE) {
-                        typename WebSocketProtocol<WebSocket>::CloseFrame closeFrame = WebSocketProtocol<WebSocket>::parseClosePayload(controlBuffer, webSocket->controlTipLength);
-                        webSocket->close(closeFrame.code, closeFrame.message, closeFrame.length);
+                    char *controlBuffer = webSocket->fragmentBuffer.data + webSocket->fragmentBuffer.length - webSocket->controlTipLength;
+                    if (webSocket->handleControl(controlBuffer, webSocket->controlTipLength, (OpCode) opCode)) {
                         return true;
-                    } else {
-                        if (opCode == PING) {
-                            webSocket->send(controlBuffer, webSocket->controlTipLength, (OpCode) OpCode::PONG);
-                            if (webSocket->isClosed() || webSocket->isShuttingDown()) {
-                                return true;
-                            }
-                        } else if (opCode == PONG) {
-                            if (webSocket->isClosed() || webSocket->isShuttingDown()) {
-                                return true;
-                            }
-                        }
                     }
 
-                    webSocket->fragmentBuffer.resize(webSocket->fragmentBuffer.length() - webSocket->controlTipLength);
+                    webSocket->fragmentBuffer.length -= webSocket->controlTipLength;
                     webSocket->controlTipLength = 0;
+                    if (!webSocket->fragmentBuffer.length) {
+                        webSocket->releaseFragments();
+                    }
                 }
             }
         }
@@ -245,6 +1918,25 @@ namespace uWS {
         return false;
     }
 
+    // SHA1() of OpenSSL 3 looks the digest up by name on every call, which takes twice as long as the hashing
+    // (with SHA-NI) of a handshake. The digest is fetched once and each thread keeps a context instead
+    static void sha1(const unsigned char *data, size_t length, unsigned char *digest) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+        static EVP_MD *md = EVP_MD_fetch(nullptr, "SHA1", nullptr);
+#else
+        static const EVP_MD *md = EVP_sha1();
+#endif
+        static thread_local struct Context {
+            EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+            ~Context() {
+                EVP_MD_CTX_free(ctx);
+            }
+        } context;
+        EVP_DigestInit_ex(context.ctx, md, nullptr);
+        EVP_DigestUpdate(context.ctx, data, length);
+        EVP_DigestFinal_ex(context.ctx, digest, nullptr);
+    }
+
     static void base64(unsigned char *src, char *dst) {
         static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
         for (int i = 0; i < 18; i += 3) {
@@ -259,26 +1951,14 @@ namespace uWS {
         *dst++ = '=';
     }
 
-    void WebSocket::upgrade(const char *secKey, const std::string& extensionsResponse, const char *subprotocol, size_t subprotocolLength) {
+    void WebSocket::upgrade(const char *secKey, std::string_view extensionsResponse, const char *subprotocol, size_t subprotocolLength) {
         Queue::Message *messagePtr;
 
         unsigned char shaInput[] = "XXXXXXXXXXXXXXXXXXXXXXXX258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
         memcpy(shaInput, secKey, 24);
         unsigned char shaDigest[SHA_DIGEST_LENGTH];
-        SHA1(shaInput, sizeof(shaInput) - 1, shaDigest);
-
-        char upgradeBuffer[1024];
-        memcpy(upgradeBuffer, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ", 97);
-        base64(shaDigest, upgradeBuffer + 97);
-        memcpy(upgradeBuffer + 125, "\r\n", 2);
-        size_t upgradeResponseLength = 127;
+        sha1(shaInput, sizeof(shaInput) - 1, shaDigest);
 
-        if (extensionsResponse.length() && extensionsResponse.length() < 200) {
-            memcpy(upgradeBuffer + upgradeResponseLength, "Sec-WebSocket-Extensions: ", 26);
-            memcpy(upgradeBuffer + upgradeResponseLength + 26, extensionsResponse.data(), extensionsResponse.length());
-            memcpy(upgradeBuffer + upgradeResponseLength + 26 + extensionsResponse.length(), "\r\n", 2);
-            upgradeResponseLength += 26 + extensionsResponse.length() + 2;
-        }
         // select first protocol
         for (unsigned int i = 0; i < subprotocolLength; i++) {
             if (subprotocol[i] == ',') {
@@ -286,24 +1966,26 @@ namespace uWS {
                 break;
             }
         }
-        if (subprotocolLength && subprotocolLength < 200) {
-            memcpy(upgradeBuffer + upgradeResponseLength, "Sec-WebSocket-Protocol: ", 24);
-            memcpy(upgradeBuffer + upgradeResponseLength + 24, subprotocol, subprotocolLength);
-            memcpy(upgradeBuffer + upgradeResponseLength + 24 + subprotocolLength, "\r\n", 2);
-            upgradeResponseLength += 24 + subprotocolLength + 2;
+        const std::string &response = Group::from(this)->getUpgradeResponse(extensionsResponse, std::string_view(subprotocol, subprotocolLength));
+
+        // straight into the cork buffer Hub::answerUpgrade holds for us, so that what the connection handler
+        // sends goes out in the same write
+        uS::CorkBuffer *corkBuffer = nodeData->corkBuffer;
+        if (corkBuffer->socket == this && messageQueue.empty() && corkBuffer->length + response.length() <= uS::CorkBuffer::SIZE) {
+            char *data = corkBuffer->data + corkBuffer->length;
+            memcpy(data, response.data(), response.length());
+            base64(shaDigest, data + Group::UPGRADE_ACCEPT_OFFSET);
+            corkBuffer->length += response.length();
+            return;
         }
-        static char stamp[] = "Sec-WebSocket-Version: 13\r\nWebSocket-Server: uWebSockets\r\n\r\n";
-        memcpy(upgradeBuffer + upgradeResponseLength, stamp, sizeof(stamp) - 1);
-        upgradeResponseLength += sizeof(stamp) - 1;
 
-        messagePtr = allocMessage(upgradeResponseLength, upgradeBuffer);
+        messagePtr = allocMessage(response.length(), response.data());
+        base64(shaDigest, (char *) messagePtr->data + Group::UPGRADE_ACCEPT_OFFSET);
 
         bool waiting;
         if (write(messagePtr, waiting)) {
             if (!waiting) {
                 freeMessage(messagePtr);
-            } else {
-                messagePtr->callback = nullptr;
             }
         } else {
             freeMessage(messagePtr);
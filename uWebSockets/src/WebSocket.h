@@ -3,39 +3,209 @@
 
 #include "WebSocketProtocol.h"
 #include "Socket.h"
+#include <atomic>
+#include <functional>
 
 
 namespace uWS {
     struct Group;
+    struct Topic;
+
+    // bytes held for sockets, of WebSocket::getMemoryUsage and Group::getMemoryStats: messages allocated for sending,
+    // whether queued or in flight, the buffers of partially received messages and the compression windows of zlib, as
+    // zlib documents its usage. pooledBlocks are the free message blocks kept by the allocator a node shares with all
+    // of its groups, 0 for a socket
+    struct MemoryStats {
+        size_t queuedMessages, fragmentBuffers, deflateWindows, pooledBlocks;
+    };
 
     struct WIN32_EXPORT WebSocket : uS::Socket, WebSocketState {
         protected:
-            unsigned int maxPayload;
-            std::string fragmentBuffer;
+            // what reading and answering a small frame touches comes first, right after the WebSocketState,
+            // so that with uS::Socket ending one counter past a cache line (on x86-64 Linux, where slots are
+            // aligned to them) the parser and these share that line, only the capacity of the fragment buffer
+            // spills over. Then the per send and per message state, and last what only timers, groups and
+            // rarely used features look at
             enum CompressionStatus : char {
                 DISABLED,
                 ENABLED,
                 COMPRESSED_FRAME
             } compressionStatus;
             unsigned char controlTipLength = 0, hasOutstandingPong = false;
+            // a ClientWebSocket, which masks what it sends
+            bool client = false;
+            // end of the last fragment of a text message when it cut a UTF-8 sequence in two
+            unsigned char utf8Tail[3], utf8TailLength = 0;
+            // of setIdleTimeout, in seconds of its group's idleClock. Sends and reads only stamp
+            // lastActivity, the idle wheel moves a socket along when it finds it was active meanwhile
+            unsigned int lastActivity = 0;
+            // reassembly of fragmented or partially received messages (and control frames), taken from
+            // Hub::bufferPool and given back as soon as it empties so idle sockets hold no memory
+            struct FragmentBuffer {
+                char *data = nullptr;
+                size_t length = 0, capacity = 0;
+            } fragmentBuffer;
 
+            // of beginMessage, which allocates it and endMessage frees: the opcode of the message being
+            // streamed, whether its first frame went out, the compressor pieces are fed through (the sliding
+            // window or one of its own) and the data sends waiting for endMessage
+            struct Stream {
+                OpCode opCode;
+                bool started = false;
+                void *deflate = nullptr;
+                // of a deflate of its own, counted as the socket's while the message lasts
+                size_t deflateMemory = 0;
+                std::vector<std::function<void(WebSocket *webSocket, bool cancelled)>> held;
+            } *stream = nullptr;
+            void holdForStream(std::function<void(WebSocket *webSocket, bool cancelled)> work);
+            void sendStreamFrame(const char *data, size_t length, bool fin, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData);
+            void finishStream(bool cancelled);
+            // of a compressed message inflating on the threadpool, while the socket reads nothing
+            struct InflationJob;
+            InflationJob *inflationJob = nullptr;
+            // allocated on the first compressed send when slidingWindowBits were negotiated, and
+            // released again by Group::setDeflateWindowIdleTimeout when unused
             void *slidingDeflateWindow = nullptr;
+            // of a client that keeps its compression context, allocated by the first compressed message
+            void *slidingInflateWindow = nullptr;
+            unsigned char slidingWindowBits = 0, inflateWindowBits = 0;
+            // bits to leave room in the slot, both cleared by the constructor. presetDictionary is set when the
+            // dictionary of Group::setDeflateDictionary was agreed, every message deflated or inflated starts from it
+            bool slidingWindowUsed : 1;
+            bool presetDictionary : 1;
+            const std::string *getDictionary();
+            // asked to close by Group::drain while it still had messages queued
+            bool closeWhenDrained = false;
+            // of Group::setSlowConsumer, over its bytes and its age threshold
+            enum : unsigned char {
+                SLOW_BY_BYTES = 1,
+                SLOW_BY_AGE = 2
+            };
+            unsigned char slowConsumer = 0;
+            // why reads are paused besides an inflation job, see pauseReading and Group::setReadBackpressure
+            enum : unsigned char {
+                PAUSED_BY_USER = 1,
+                PAUSED_BY_BACKPRESSURE = 2
+            };
+            unsigned char readPaused = 0;
+            // shorter than Group::SMALL_SEND since the last look of Group::setAdaptiveNoDelay, which leaves alone
+            // a socket set by setNoDelay
+            uint16_t smallSends = 0;
+            void pauseReads(unsigned char reason);
+            void resumeReads(unsigned char reason);
+            // of Group::setInboundLimit, what arrived since inboundWindowStart (in loop ms)
+            uint32_t inboundWindowStart = 0, inboundMessages = 0, inboundBytes = 0;
+            bool overInboundLimit(size_t length, bool last);
+            // of Group::startRecording: 0 while not recorded, RECORD_PENDING until its next message boundary,
+            // then its id in the log
+            enum : uint32_t {
+                RECORD_PENDING = 0xffffffff
+            };
+            uint32_t recordId = 0;
+
+            // its place in its group's table and its handle there, see Group::getId
+            uint32_t tableIndex = 0, handle = 0;
+            // its place on the idle wheel, see lastActivity
+            WebSocket *idlePrev = nullptr, *idleNext = nullptr;
+            int idleSlot = -1;
+            unsigned int idleTimeout = 0;
+            bool idlePing = false, idlePinged = false;
+            // its place on the heartbeat wheel of its group (slot -1 is none), see Group::setHeartbeat.
+            // Pinged is set between a heartbeat ping and its check, hasOutstandingPong until data arrives
+            bool heartbeatPinged = false;
+            bool noDelayFixed = false;
+            int heartbeatSlot = -1;
+            WebSocket *heartbeatPrev = nullptr, *heartbeatNext = nullptr;
+            // uv_hrtime in microseconds of the ping in flight (0 is none) and the smoothed round trip of the
+            // earlier ones, see getRtt
+            uint32_t pingSentAt = 0, rtt = 0;
+            // as of the last sample of Group::setTcpInfoSampling, allocated on the first
+            uS::Context::TcpInfo *tcpInfo = nullptr;
+            // topics this socket is subscribed to, allocated on first subscribe
+            std::vector<Topic *> *topics = nullptr;
+            // of the sliding deflate window as allocated, the inflate window is always inflateWindowMemory
+            uint32_t deflateMemory = 0;
+            // of the peer, taken once when the socket becomes a WebSocket. Family is 4 or 6, 0 if it is not known
+            struct PeerAddress {
+                unsigned char family = 0;
+                uint16_t port = 0;
+                unsigned char ip[16];
+            } peerAddress;
+            static void readPeerAddress(uv_os_sock_t fd, PeerAddress &peerAddress);
 
-            WebSocket(unsigned int maxP, bool perMessageDeflate, uS::Socket *socket);
+            WebSocket(bool perMessageDeflate, uS::Socket *socket, int slidingWindowBits = 0, int inflateWindowBits = 0);
+
+            // WebSockets live in slots of the pool of their loop, nodeData being where they are made
+            static void *operator new(size_t size, uS::NodeData *nodeData) {
+                return nodeData->slotPool->allocate(size);
+            }
 
+            // only for a constructor that throws
+            static void operator delete(void *slot, uS::NodeData *nodeData) {
+                nodeData->slotPool->free(slot);
+            }
+
+            template <class T>
+                static void destroy(T *webSocket) {
+                    uS::NodeData *nodeData = webSocket->nodeData;
+                    webSocket->~T();
+                    nodeData->slotPool->free(webSocket);
+                }
+
+            template <class Impl>
+                static uS::Socket *consumeData(uS::Socket *s, char *data, size_t length);
             static uS::Socket *onData(uS::Socket *s, char *data, size_t length);
             static void onEnd(uS::Socket *s);
+            static void onDrain(uS::Socket *s);
+            static void deliverMessage(WebSocket *webSocket, char *data, size_t length, OpCode opCode);
+            void appendFragment(const char *data, size_t length, size_t expected);
+            bool reserveReassembly(size_t length, size_t expected);
+            void releaseFragments();
+            bool flushMessageBatch();
+            bool refuseBackpressure(size_t length, uint32_t conflationKey = 0);
+            bool dropInbound(bool last);
+            void releaseDeflateWindow();
+            void *getDeflateWindow();
+            void *getInflateWindow();
+            struct CompressionJob;
+            static void deflateJob(uv_work_t *work);
+            static void completeJob(uv_work_t *work, int status);
+            static void inflateJob(uv_work_t *work);
+            static void completeInflation(uv_work_t *work, int status);
+            bool handleMessage(char *data, size_t length, OpCode opCode, bool compressed, bool textValidated);
+            bool handleControl(char *data, size_t length, OpCode opCode);
+            // runs work on the loop thread once it gets to this socket's mail, or cancelled if it closes first
+            struct Mail;
+            void postToLoop(std::function<void(WebSocket *webSocket, bool cancelled)> work);
+            void sendOffloaded(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData);
+            void sendFragmented(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData);
+            // of Group::setBacklogCompression, deflates the queued messages no write has started on yet
+            struct BacklogJob;
+            void compressBacklog();
+            static void deflateBacklog(uv_work_t *work);
+            static void completeBacklog(uv_work_t *work, int status);
             using uS::Socket::closeSocket;
 
-            static bool refusePayloadLength(uint64_t length, WebSocketState *webSocketState) {
-                WebSocket *webSocket = static_cast<WebSocket *>(webSocketState);
-                return length > webSocket->maxPayload;
+            // against the maxPayload of its group
+            static bool refusePayloadLength(uint64_t length, WebSocketState *webSocketState);
+
+            // whether permessage-deflate is on, constant false in a UWS_NO_COMPRESSION build so that what
+            // deflates and inflates folds away
+            bool compresses() const {
+#ifdef UWS_NO_COMPRESSION
+                return false;
+#else
+                return compressionStatus == CompressionStatus::ENABLED;
+#endif
             }
 
+            // sampled closer than Group::setCompressionMinRtt, its sends asking for compression go uncompressed
+            bool nearPeer();
+
             static bool setCompressed(WebSocketState *webSocketState) {
                 WebSocket *webSocket = static_cast<WebSocket *>(webSocketState);
 
-                if (webSocket->compressionStatus == WebSocket::CompressionStatus::ENABLED) {
+                if (webSocket->compresses()) {
                     webSocket->compressionStatus = WebSocket::CompressionStatus::COMPRESSED_FRAME;
                     return true;
                 } else {
@@ -49,31 +219,201 @@ namespace uWS {
             }
 
             static bool handleFragment(char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin, WebSocketState *webSocketState);
+#ifdef UWS_ZEROCOPY_RECEIVE
+            // of a frame being streamed, what may come mapped, see Group::setZeroCopyReceive
+            size_t mappableRemainder();
+#endif
 
-            void upgrade(const char *secKey, const std::string& extensionsResponse, const char *subprotocol, size_t subprotocolLength);
+            void upgrade(const char *secKey, std::string_view extensionsResponse, const char *subprotocol, size_t subprotocolLength);
 
         public:
+            static const bool IS_SERVER = true;
+
             struct PreparedMessage {
                 char *buffer;
-                size_t length;
-                int references;
+                // framed and allocated, from a uS::LargeBuffer
+                size_t length, capacity;
+                // atomic since Hub::broadcastAcross shares one prepared message between loop threads
+                std::atomic<int> references;
                 void(*callback)(void *webSocket, void *data, bool cancelled, void *reserved);
+                // framed with RSV1 set, only sockets with a shared deflate context can take it
+                bool compressed;
+                // plain framing of the same message, sent instead to sockets that cannot take the compressed one
+                PreparedMessage *uncompressed;
+            };
+
+            // a message whose payload is a range of a file, see prepareFile
+            struct FileMessage {
+                int fd;
+                uint64_t offset;
+                size_t length;
+                OpCode opCode;
+                char header[10];
+                size_t headerLength;
+                std::atomic<int> references;
             };
 
+            // from within the message handler: the buffer message was reassembled or inflated into, which is then
+            // the caller's instead of going back to the pool, its size in capacity. nullptr for a message read in
+            // place. Give it back with Hub::returnMessageBuffer on the hub's loop thread, or uS::LargeBuffer::free it
+            // Not thread safe
+            char *takeMessageBuffer(const char *message, size_t &capacity);
+
+            // from what the socket was upgraded with, without asking the kernel again. The strings last until
+            // the next call on this thread
+            Address getAddress() const;
+
+            // closes the socket with 1001 once nothing was sent or received for seconds (up to one more),
+            // checked once a second. With ping it is pinged first and closed only if it stays silent for
+            // another timeout. 0 turns it off. Not thread safe
+            void setIdleTimeout(unsigned int seconds, bool ping = false);
+
+            // stops reading from the socket until resumeReading, so a client sending faster than it is handled
+            // is held back by TCP rather than buffered. Messages already read are still delivered, and
+            // Group::setReadBackpressure pauses on its own besides. Not thread safe
+            void pauseReading();
+            void resumeReading();
+            bool isReadingPaused() const {
+                return readPaused & PAUSED_BY_USER;
+            }
+
+            /*
+             * Starts a message of opCode to be sent piece by piece: sendFragment
+             * sends a frame per piece and endMessage the final one. With compress
+             * each piece is deflated through one stream with a sync flush, so a
+             * huge message never has to be in memory at once, let alone twice.
+             *
+             * Hints: TEXT and BINARY sends to this socket in the meantime, from
+             * a broadcast as well, wait until endMessage, pings and pongs do not.
+             * Pieces are never refused for backpressure, so pace big messages by
+             * getBufferedAmount and onDrain. False if a message is being streamed
+             * already or the socket is closing. Text may be split anywhere, it
+             * only has to be valid UTF-8 as a whole.
+             *
+             * Not thread safe
+             *
+             */
+            bool beginMessage(OpCode opCode, bool compress = false);
+            void sendFragment(const char *data, size_t length, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved) = nullptr, void *callbackData = nullptr);
+            void endMessage(const char *data = nullptr, size_t length = 0, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved) = nullptr, void *callbackData = nullptr);
+
+            // microseconds from a ping (of the heartbeat, the idle timeout or ping) to its pong, averaged over roughly
+            // the last 8. Only one ping at a time is timed. 0 until the first pong. Not thread safe
+            unsigned int getRtt() const {
+                return rtt;
+            }
+
+            // what the kernel said of the connection at the last sample of Group::setTcpInfoSampling, all 0 before
+            // the first. Not thread safe
+            uS::Context::TcpInfo getTcpInfo() const {
+                return tcpInfo ? *tcpInfo : uS::Context::TcpInfo();
+            }
+
+            // TCP_NODELAY of this socket from now on, no longer up to Group::setAdaptiveNoDelay. Not thread safe
+            void setNoDelay(bool enable) {
+                noDelayFixed = true;
+                uS::Socket::setNoDelay(enable);
+            }
+
+            // what is held for this socket right now, from counters kept along. Not thread safe
+            MemoryStats getMemoryUsage() const;
+
             // Not thread safe
             void close(int code = 1000, const char *message = nullptr, size_t length = 0);
 
-            // Thread safe
-            void terminate();
+            // Thread safe. Abortive resets the connection instead, which frees its kernel buffers and state right
+            // away rather than after sending what the kernel holds and waiting out FIN_WAIT and TIME_WAIT. For
+            // kicking abusive or dead clients in bulk, the peer sees ECONNRESET
+            void terminate(bool abortive = false);
             void ping(const char *message) {send(message, OpCode::PING);}
             void send(const char *message, OpCode opCode = OpCode::TEXT) {send(message, strlen(message), opCode);}
-            void send(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved) = nullptr, void *callbackData = nullptr, bool compress = false);
+            void send(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved) = nullptr, void *callbackData = nullptr, bool compress = false, uint32_t conflationKey = 0, unsigned int ttlMs = 0);
+            void sendWritten(size_t length, OpCode opCode, void (*write)(char *payload, size_t length, void *writeData), void *writeData, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved) = nullptr, void *callbackData = nullptr, bool compress = false, uint32_t conflationKey = 0, unsigned int ttlMs = 0);
+            void sendReferenced(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved), void *callbackData = nullptr, bool compress = false);
+            // a whole unmasked frame, like one of staticFrame, written from where it is and referenced while
+            // queued, so it has to outlive the socket. Never framed, copied or compressed here. Client and TLS
+            // sockets, pings and pongs, and groups with sessions send its payload as usual. Thread safe
+            void sendFrame(const char *frame, size_t length);
+            template <size_t N>
+            void send(const StaticFrame<N> &frame) {
+                sendFrame(frame.data, frame.length);
+            }
+            struct Frame {
+                const char *data;
+                size_t length;
+                OpCode opCode;
+            };
+            void sendBatch(const Frame *frames, size_t count, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved) = nullptr, void *callbackData = nullptr, bool compress = false);
+            static PreparedMessage *prepareMessage(char *data, size_t length, OpCode opCode, bool compressed, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved) = nullptr);
+            void sendPrepared(PreparedMessage *preparedMessage, void *callbackData = nullptr, bool defer = false, uint32_t conflationKey = 0, unsigned int ttlMs = 0);
+            static void finalizeMessage(PreparedMessage *preparedMessage);
+            // frames length bytes of fd from offset for sendFile to any number of sockets. The file is read as each send
+            // is written, so the range must not change meanwhile, and fd stays open until the message is finalized and
+            // every send of it done (see the callback). Closing it is up to the caller
+            static FileMessage *prepareFile(int fd, uint64_t offset, size_t length, OpCode opCode = OpCode::BINARY);
+            void sendFile(FileMessage *fileMessage, void(*callback)(WebSocket *webSocket, void *data, bool cancelled, void *reserved) = nullptr, void *callbackData = nullptr);
+            static void finalizeFile(FileMessage *fileMessage);
+
+        protected:
+            // closeFrame is of prepareClose, for closing many sockets with the same one
+            void closeWith(PreparedMessage *closeFrame, int code, const char *message, size_t length);
+            void closeQuietly(int code, const char *message, size_t length, PreparedMessage *closeFrame = nullptr);
+            static PreparedMessage *prepareClose(int code, const char *message, size_t length);
 
             friend struct Hub;
             friend struct Group;
             friend struct uS::Socket;
+            friend struct HttpServerSocket;
             friend class WebSocketProtocol<WebSocket>;
     };
+
+    // the WebSocket of Hub::connect, it parses unmasked frames and sends masked ones
+    struct WIN32_EXPORT ClientWebSocket : WebSocket {
+        protected:
+            ClientWebSocket(bool perMessageDeflate, uS::Socket *socket, int slidingWindowBits) : WebSocket(perMessageDeflate, socket, slidingWindowBits) {
+                client = true;
+            }
+
+            static uS::Socket *onData(uS::Socket *s, char *data, size_t length);
+#ifdef UWS_ZEROCOPY_RECEIVE
+            static size_t mappableBytes(uS::Socket *s) {
+                return static_cast<ClientWebSocket *>(s)->mappableRemainder();
+            }
+#endif
+
+        public:
+            static const bool IS_SERVER = false;
+
+            friend struct HttpSocket;
+            friend struct uS::Socket;
+            friend class WebSocketProtocol<ClientWebSocket>;
+    };
+
+    /*
+     * The state of the server WebSockets of a group created with TRUSTED_PEERS, whose
+     * clients are backends of our own behind mTLS or the like. Its parser takes text as
+     * valid UTF-8, also once inflated, and refuses no frame for maxPayload, only for more
+     * than 4 GB, so that a message costs little more than the handler call. Masks stay
+     * required: RFC 6455 clients always mask, and unmasking shares its pass with nothing
+     * else now. Never constructed, the sockets are WebSockets in every other respect
+     *
+     */
+    struct WIN32_EXPORT TrustedWebSocket : WebSocket {
+        protected:
+            static uS::Socket *onData(uS::Socket *s, char *data, size_t length);
+
+        public:
+            static const bool TRUSTED_PEER = true;
+
+            friend struct uS::Socket;
+            friend class WebSocketProtocol<TrustedWebSocket>;
+    };
+
+    // what an idle WebSocket costs besides the kernel's buffers: this one allocation (480 bytes in a 512 byte slot on x86-64 Linux)
+    static_assert(sizeof(WebSocket) <= sizeof(uS::Socket) + 28 * sizeof(void *), "uWS::WebSocket grew");
+    // both take slots of the same pool
+    static_assert(sizeof(ClientWebSocket) == sizeof(WebSocket), "ClientWebSocket needs a slot of its own size");
+    static_assert(sizeof(TrustedWebSocket) == sizeof(WebSocket), "TrustedWebSocket is only another state of a WebSocket");
 }
 
 #endif // WEBSOCKET_UWS_H
@@ -6,6 +6,19 @@
 
 #include <cstring>
 #include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <random>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#include <immintrin.h>
+#define UWS_CPU_DISPATCH
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace uWS {
     enum OpCode : unsigned char {
@@ -17,6 +30,40 @@ namespace uWS {
         PONG = 10
     };
 
+    // the bytes of an unmasked frame of a payload known at compile time, made by staticFrame into read-only
+    // memory for WebSocket::send to write as they are
+    template <size_t N>
+    struct StaticFrame {
+        char data[N + 10];
+        size_t length;
+    };
+
+    // frames payload, a string literal without its NUL, at compile time:
+    // static constexpr auto pong = uWS::staticFrame<uWS::TEXT>("3");
+    template <OpCode opCode, size_t N>
+    constexpr StaticFrame<N - 1> staticFrame(const char (&payload)[N]) {
+        StaticFrame<N - 1> frame {};
+        size_t length = N - 1, headerLength = 2;
+        frame.data[0] = (char) (128 | opCode);
+        if (length < 126) {
+            frame.data[1] = (char) length;
+        } else if (length <= UINT16_MAX) {
+            frame.data[1] = 126;
+            headerLength = 4;
+        } else {
+            frame.data[1] = 127;
+            headerLength = 10;
+        }
+        for (size_t i = 2; i < headerLength; i++) {
+            frame.data[i] = (char) (length >> (8 * (headerLength - 1 - i)));
+        }
+        for (size_t i = 0; i < length; i++) {
+            frame.data[headerLength + i] = payload[i];
+        }
+        frame.length = headerLength + length;
+        return frame;
+    }
+
     // 24 bytes perfectly
     struct WebSocketState {
         public:
@@ -30,6 +77,8 @@ namespace uWS {
                 unsigned int spillLength : 4;
                 int opStack : 2; // -1, 0, 1
                 unsigned int lastFin : 1;
+                // the pending message was already validated as UTF-8 while unmasking
+                unsigned int textValidated : 1;
 
                 // 15 bytes
                 unsigned char spill[LONG_MESSAGE_HEADER - 1] = { 0 };
@@ -40,6 +89,7 @@ namespace uWS {
                     spillLength = 0;
                     opStack = -1;
                     lastFin = true;
+                    textValidated = false;
                 }
 
             } state;
@@ -47,31 +97,101 @@ namespace uWS {
             // 8 bytes
             unsigned int remainingBytes = 0;
             char mask[4];
+
+            // an Impl whose peers are trusted hides this, see TrustedWebSocket
+            static const bool TRUSTED_PEER = false;
     };
 
     template <class Impl>
         class WIN32_EXPORT WebSocketProtocol {
             public:
-                static const unsigned int SHORT_MESSAGE_HEADER = 6;
-                static const unsigned int MEDIUM_MESSAGE_HEADER = 8;
-                static const unsigned int LONG_MESSAGE_HEADER = 14;
+                // servers receive masked frames and send unmasked ones, clients the other way around
+                static const bool isServer = Impl::IS_SERVER;
+                // text goes unvalidated and only lengths remainingBytes cannot hold are refused
+                static const bool isTrusted = Impl::TRUSTED_PEER;
+                static const unsigned int MASK_LENGTH = isServer ? 4 : 0;
+                static const unsigned int SHORT_MESSAGE_HEADER = 2 + MASK_LENGTH;
+                static const unsigned int MEDIUM_MESSAGE_HEADER = 4 + MASK_LENGTH;
+                static const unsigned int LONG_MESSAGE_HEADER = 10 + MASK_LENGTH;
 
             protected:
                 static inline bool isFin(char *frame) {return *((unsigned char *) frame) & 128;}
+                static inline bool isMasked(char *frame) {return ((unsigned char *) frame)[1] & 128;}
                 static inline unsigned char getOpCode(char *frame) {return *((unsigned char *) frame) & 15;}
                 static inline unsigned char payloadLength(char *frame) {return ((unsigned char *) frame)[1] & 127;}
                 static inline bool rsv23(char *frame) {return *((unsigned char *) frame) & 48;}
                 static inline bool rsv1(char *frame) {return *((unsigned char *) frame) & 64;}
 
-                static inline void unmaskImprecise(char *dst, char *src, char *mask, unsigned int length) {
-                    for (unsigned int n = (length >> 2) + 1; n; n--) {
-                        *(dst++) = *(src++) ^ mask[0];
-                        *(dst++) = *(src++) ^ mask[1];
-                        *(dst++) = *(src++) ^ mask[2];
-                        *(dst++) = *(src++) ^ mask[3];
+#ifdef UWS_CPU_DISPATCH
+                __attribute__((target("avx2")))
+                static size_t unmaskAvx2(char *dst, char *src, uint32_t mask, size_t length) {
+                    __m256i vectorMask = _mm256_set1_epi32((int) mask);
+                    size_t done = 0;
+                    for (; length - done >= 32; done += 32) {
+                        _mm256_storeu_si256((__m256i *) (dst + done), _mm256_xor_si256(_mm256_loadu_si256((__m256i *) (src + done)), vectorMask));
+                    }
+                    return done;
+                }
+
+                static bool hasAvx2() {
+                    static const bool avx2 = __builtin_cpu_supports("avx2");
+                    return avx2;
+                }
+
+                static bool hasSsse3() {
+                    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+                    return ssse3;
+                }
+#endif
+
+                // XORs length bytes, a multiple of 4, with the mask repeated. dst may sit below src
+                // in the same buffer (payloads get shifted left over their header) since every
+                // block is loaded before anything at or past it is stored
+                static inline void unmask(char *dst, char *src, uint32_t mask, size_t length) {
+#ifdef UWS_CPU_DISPATCH
+                    if (length >= 64 && hasAvx2()) {
+                        size_t done = unmaskAvx2(dst, src, mask, length);
+                        dst += done;
+                        src += done;
+                        length -= done;
+                    }
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+                    __m128i vectorMask = _mm_set1_epi32((int) mask);
+                    for (; length >= 16; length -= 16, dst += 16, src += 16) {
+                        _mm_storeu_si128((__m128i *) dst, _mm_xor_si128(_mm_loadu_si128((__m128i *) src), vectorMask));
+                    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+                    uint8x16_t vectorMask = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+                    for (; length >= 16; length -= 16, dst += 16, src += 16) {
+                        vst1q_u8((uint8_t *) dst, veorq_u8(vld1q_u8((uint8_t *) src), vectorMask));
+                    }
+#else
+                    uint64_t wideMask = ((uint64_t) mask << 32) | mask;
+                    for (; length >= 8; length -= 8, dst += 8, src += 8) {
+                        uint64_t word;
+                        memcpy(&word, src, 8);
+                        word ^= wideMask;
+                        memcpy(dst, &word, 8);
+                    }
+#endif
+
+                    for (; length; length -= 4, dst += 4, src += 4) {
+                        uint32_t word;
+                        memcpy(&word, src, 4);
+                        word ^= mask;
+                        memcpy(dst, &word, 4);
                     }
                 }
 
+                // unmasks up to 4 bytes past length, which CONSUME_POST_PADDING makes room for
+                static inline void unmaskImprecise(char *dst, char *src, char *mask, unsigned int length) {
+                    uint32_t wordMask;
+                    memcpy(&wordMask, mask, 4);
+                    unmask(dst, src, wordMask, (((size_t) length >> 2) + 1) * 4);
+                }
+
                 static inline void unmaskImpreciseCopyMask(char *dst, char *src, char *maskPtr, unsigned int length) {
                     char mask[4] = {maskPtr[0], maskPtr[1], maskPtr[2], maskPtr[3]};
                     unmaskImprecise(dst, src, mask, length);
@@ -85,13 +205,11 @@ namespace uWS {
                     mask[(3 + offset) & 3] = originalMask[3];
                 }
 
+                // stop is a multiple of 4 bytes past data
                 static inline void unmaskInplace(char *data, char *stop, char *mask) {
-                    while (data < stop) {
-                        *(data++) ^= mask[0];
-                        *(data++) ^= mask[1];
-                        *(data++) ^= mask[2];
-                        *(data++) ^= mask[3];
-                    }
+                    uint32_t wordMask;
+                    memcpy(&wordMask, mask, 4);
+                    unmask(data, data, wordMask, stop - data);
                 }
 
                 enum {
@@ -112,14 +230,29 @@ namespace uWS {
                         }
                         wState->state.lastFin = isFin(src);
 
-                        if (Impl::refusePayloadLength(payLength, wState)) {
+                        if (isTrusted ? (uint64_t) payLength > UINT32_MAX : Impl::refusePayloadLength(payLength, wState)) {
                             Impl::forceClose(wState);
                             return true;
                         }
+                        if (isTrusted) {
+                            wState->state.textValidated = true;
+                        }
 
                         if (payLength + MESSAGE_HEADER <= length) {
-                            unmaskImpreciseCopyMask(src + MESSAGE_HEADER - 4, src + MESSAGE_HEADER, src + MESSAGE_HEADER - 4, (unsigned int) payLength);
-                            if (Impl::handleFragment(src + MESSAGE_HEADER - 4, payLength, 0, wState->state.opCode[wState->state.opStack], isFin(src), wState)) {
+                            // masked payloads are unmasked over their mask, 4 bytes to the left
+                            if (isServer) {
+                                // a whole uncompressed text message is validated in the same pass that unmasks it
+                                if (!isTrusted && getOpCode(src) == TEXT && isFin(src) && !rsv1(src)) {
+                                    if (!unmaskImpreciseValidateUtf8(src + MESSAGE_HEADER - 4, src + MESSAGE_HEADER, src + MESSAGE_HEADER - 4, (unsigned int) payLength)) {
+                                        Impl::forceClose(wState);
+                                        return true;
+                                    }
+                                    wState->state.textValidated = true;
+                                } else {
+                                    unmaskImpreciseCopyMask(src + MESSAGE_HEADER - 4, src + MESSAGE_HEADER, src + MESSAGE_HEADER - 4, (unsigned int) payLength);
+                                }
+                            }
+                            if (Impl::handleFragment(src + MESSAGE_HEADER - MASK_LENGTH, payLength, 0, wState->state.opCode[wState->state.opStack], isFin(src), wState)) {
                                 return true;
                             }
 
@@ -136,20 +269,104 @@ namespace uWS {
                             wState->state.wantsHead = false;
                             wState->remainingBytes = (unsigned int) (payLength - length + MESSAGE_HEADER);
                             bool fin = isFin(src);
-                            memcpy(wState->mask, src + MESSAGE_HEADER - 4, 4);
-                            unmaskImprecise(src, src + MESSAGE_HEADER, wState->mask, length - MESSAGE_HEADER);
-                            rotateMask(4 - ((length - MESSAGE_HEADER) & 3), wState->mask);
-                            Impl::handleFragment(src, length - MESSAGE_HEADER, wState->remainingBytes, wState->state.opCode[wState->state.opStack], fin, wState);
+                            if (isServer) {
+                                memcpy(wState->mask, src + MESSAGE_HEADER - 4, 4);
+                                unmaskImprecise(src, src + MESSAGE_HEADER, wState->mask, length - MESSAGE_HEADER);
+                                rotateMask(4 - ((length - MESSAGE_HEADER) & 3), wState->mask);
+                                Impl::handleFragment(src, length - MESSAGE_HEADER, wState->remainingBytes, wState->state.opCode[wState->state.opStack], fin, wState);
+                            } else {
+                                Impl::handleFragment(src + MESSAGE_HEADER, length - MESSAGE_HEADER, wState->remainingBytes, wState->state.opCode[wState->state.opStack], fin, wState);
+                            }
+                            return true;
+                        }
+                    }
+
+                // a masked unfragmented text or binary frame of at most TINY_PAYLOAD bytes, nothing reserved
+                static const unsigned int TINY_PAYLOAD = 16, TINY_RUN = 32;
+                static inline bool isTiny(char *frame) {
+                    return (unsigned char) (frame[0] - 0x81) < 2 && (unsigned char) (frame[1] - 0x80) <= TINY_PAYLOAD;
+                }
+
+                /*
+                 * Floods of tiny frames, like the readings of sensors, are taken apart up to TINY_RUN at
+                 * a time: their headers are checked in one pass, which ends at the first frame that is not
+                 * tiny or not all there, and every payload is unmasked with one 16 byte XOR into a slot of
+                 * its own before any is delivered. What consumeMessage does per frame beyond that, the op
+                 * stack and the splitting of payloads, a tiny frame does not need. Returns true once the
+                 * handler closed, or a frame was refused, like consumeMessage
+                 *
+                 */
+                static inline bool consumeTinyRun(char *&src, unsigned int &length, WebSocketState *wState) {
+                    char payloads[TINY_RUN * TINY_PAYLOAD];
+                    unsigned char lengths[TINY_RUN], opCodes[TINY_RUN];
+                    unsigned int count = 0;
+                    bool refused = false;
+
+                    // padded like the receive buffer, 16 bytes may be loaded from a payload that ends well before
+                    char *end = src + length, *frame = src;
+                    for (; count < TINY_RUN && end - frame >= (long) SHORT_MESSAGE_HEADER && isTiny(frame) &&
+                           (unsigned int) (end - frame) >= SHORT_MESSAGE_HEADER + payloadLength(frame); count++) {
+                        unsigned int payLength = payloadLength(frame);
+                        if (!isTrusted && Impl::refusePayloadLength(payLength, wState)) {
+                            refused = true;
+                            break;
+                        }
+
+                        uint32_t mask;
+                        memcpy(&mask, frame + 2, 4);
+                        char *payload = frame + SHORT_MESSAGE_HEADER, *dst = payloads + count * TINY_PAYLOAD;
+#if defined(__x86_64__) || defined(_M_X64)
+                        if (payload + TINY_PAYLOAD <= end + CONSUME_POST_PADDING) {
+                            _mm_storeu_si128((__m128i *) dst, _mm_xor_si128(_mm_loadu_si128((__m128i *) payload), _mm_set1_epi32((int) mask)));
+                        } else
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+                        if (payload + TINY_PAYLOAD <= end + CONSUME_POST_PADDING) {
+                            vst1q_u8((uint8_t *) dst, veorq_u8(vld1q_u8((uint8_t *) payload), vreinterpretq_u8_u32(vdupq_n_u32(mask))));
+                        } else
+#endif
+                        {
+                            unmask(dst, payload, mask, (payLength + 3) & ~3u);
+                        }
+                        lengths[count] = (unsigned char) payLength;
+                        opCodes[count] = getOpCode(frame);
+                        frame += SHORT_MESSAGE_HEADER + payLength;
+                    }
+
+                    wState->state.spillLength = 0;
+                    for (unsigned int i = 0; i < count; i++) {
+                        char *payload = payloads + i * TINY_PAYLOAD;
+                        if (opCodes[i] == TEXT) {
+                            if (!isTrusted && !isValidUtf8Scalar((unsigned char *) payload, lengths[i])) {
+                                Impl::forceClose(wState);
+                                return true;
+                            }
+                            wState->state.textValidated = true;
+                        }
+                        if (Impl::handleFragment(payload, lengths[i], 0, opCodes[i], true, wState)) {
                             return true;
                         }
+                        src += SHORT_MESSAGE_HEADER + lengths[i];
+                        length -= SHORT_MESSAGE_HEADER + lengths[i];
                     }
 
+                    if (refused) {
+                        Impl::forceClose(wState);
+                        return true;
+                    }
+                    return false;
+                }
+
                 static inline bool consumeContinuation(char *&src, unsigned int &length, WebSocketState *wState) {
+                    if (isTrusted) {
+                        wState->state.textValidated = true;
+                    }
                     if (wState->remainingBytes <= length) {
-                        int n = wState->remainingBytes >> 2;
-                        unmaskInplace(src, src + n * 4, wState->mask);
-                        for (int i = 0, s = wState->remainingBytes & 3; i < s; i++) {
-                            src[n * 4 + i] ^= wState->mask[i];
+                        if (isServer) {
+                            int n = wState->remainingBytes >> 2;
+                            unmaskInplace(src, src + n * 4, wState->mask);
+                            for (int i = 0, s = wState->remainingBytes & 3; i < s; i++) {
+                                src[n * 4 + i] ^= wState->mask[i];
+                            }
                         }
 
                         if (Impl::handleFragment(src, wState->remainingBytes, 0, wState->state.opCode[wState->state.opStack], wState->state.lastFin, wState)) {
@@ -165,20 +382,269 @@ namespace uWS {
                         wState->state.wantsHead = true;
                         return true;
                     } else {
-                        unmaskInplace(src, src + ((length >> 2) + 1) * 4, wState->mask);
+                        if (isServer) {
+                            unmaskInplace(src, src + ((length >> 2) + 1) * 4, wState->mask);
+                        }
 
                         wState->remainingBytes -= length;
                         if (Impl::handleFragment(src, length, wState->remainingBytes, wState->state.opCode[wState->state.opStack], wState->state.lastFin, wState)) {
                             return false;
                         }
 
-                        if (length & 3) {
+                        if (isServer && (length & 3)) {
                             rotateMask(4 - (length & 3), wState->mask);
                         }
                         return false;
                     }
                 }
 
+                // Lookup table validation from "Validating UTF-8 In Less Than One Instruction Per Byte"
+                // by John Keiser and Daniel Lemire, 2020. Every byte pair is classified by the high nibble
+                // of the first byte, its low nibble and the high nibble of the second, and the three
+                // lookups ANDed together are non-zero exactly where the pair is malformed. Rows are
+                // byte 1 high nibble, byte 1 low nibble, byte 2 high nibble, then the per-position
+                // maximum of a block's last 3 bytes that leaves no sequence unfinished
+                static const unsigned char *utf8Tables() {
+                    enum : unsigned char {
+                        TOO_SHORT = 1, TOO_LONG = 2, OVERLONG_3 = 4, TOO_LARGE = 8, SURROGATE = 16,
+                        OVERLONG_2 = 32, TOO_LARGE_1000 = 64, OVERLONG_4 = 64, TWO_CONTS = 128,
+                        CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS
+                    };
+
+                    static const unsigned char tables[64] = {
+                        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+                        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+                        TOO_SHORT | OVERLONG_2,
+                        TOO_SHORT,
+                        TOO_SHORT | OVERLONG_3 | SURROGATE,
+                        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+
+                        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+                        CARRY | OVERLONG_2,
+                        CARRY, CARRY,
+                        CARRY | TOO_LARGE,
+                        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+                        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+                        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+                        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+                        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+                        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+
+                        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+                        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+                        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+                        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+
+                        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+                    };
+                    return tables;
+                }
+
+#ifdef UWS_CPU_DISPATCH
+                __attribute__((target("ssse3")))
+                static inline void validateUtf8Block(__m128i input, __m128i &previous, __m128i &previousIncomplete, __m128i &error) {
+                    if (!_mm_movemask_epi8(input)) {
+                        // ascii only, so whatever the last block left open is an error
+                        error = _mm_or_si128(error, previousIncomplete);
+                        previousIncomplete = _mm_setzero_si128();
+                        previous = input;
+                        return;
+                    }
+
+                    const unsigned char *tables = utf8Tables();
+                    __m128i lowNibble = _mm_set1_epi8(0x0f);
+                    __m128i previous1 = _mm_alignr_epi8(input, previous, 15);
+                    __m128i byte1High = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) tables), _mm_and_si128(_mm_srli_epi16(previous1, 4), lowNibble));
+                    __m128i byte1Low = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (tables + 16)), _mm_and_si128(previous1, lowNibble));
+                    __m128i byte2High = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (tables + 32)), _mm_and_si128(_mm_srli_epi16(input, 4), lowNibble));
+                    __m128i specialCases = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+                    // the third and fourth bytes of a sequence have to be continuations too
+                    __m128i thirdByte = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 14), _mm_set1_epi8(0xe0 - 0x80));
+                    __m128i fourthByte = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 13), _mm_set1_epi8((char) (0xf0 - 0x80)));
+                    __m128i mustBeContinuation = _mm_and_si128(_mm_or_si128(thirdByte, fourthByte), _mm_set1_epi8((char) 0x80));
+
+                    error = _mm_or_si128(error, _mm_xor_si128(mustBeContinuation, specialCases));
+                    previousIncomplete = _mm_subs_epu8(input, _mm_loadu_si128((__m128i *) (tables + 48)));
+                    previous = input;
+                }
+
+                // the tail goes through a zero padded block, so it also catches a sequence cut off at the end
+                __attribute__((target("ssse3")))
+                static bool isValidUtf8Ssse3(unsigned char *s, size_t length) {
+                    __m128i previous = _mm_setzero_si128(), previousIncomplete = _mm_setzero_si128(), error = _mm_setzero_si128();
+                    size_t i = 0;
+                    for (; i + 16 <= length; i += 16) {
+                        validateUtf8Block(_mm_loadu_si128((__m128i *) (s + i)), previous, previousIncomplete, error);
+                    }
+
+                    unsigned char tail[16] = {};
+                    memcpy(tail, s + i, length - i);
+                    validateUtf8Block(_mm_loadu_si128((__m128i *) tail), previous, previousIncomplete, error);
+                    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+                }
+
+                __attribute__((target("avx2")))
+                static inline void validateUtf8Block(__m256i input, __m256i &previous, __m256i &previousIncomplete, __m256i &error) {
+                    if (!_mm256_movemask_epi8(input)) {
+                        error = _mm256_or_si256(error, previousIncomplete);
+                        previousIncomplete = _mm256_setzero_si256();
+                        previous = input;
+                        return;
+                    }
+
+                    // alignr works per 128 bit lane, so the lane boundary comes from the crossed pair
+                    const unsigned char *tables = utf8Tables();
+                    __m256i lowNibble = _mm256_set1_epi8(0x0f);
+                    __m256i crossed = _mm256_permute2x128_si256(previous, input, 0x21);
+                    __m256i previous1 = _mm256_alignr_epi8(input, crossed, 15);
+                    __m256i byte1High = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) tables)), _mm256_and_si256(_mm256_srli_epi16(previous1, 4), lowNibble));
+                    __m256i byte1Low = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) (tables + 16))), _mm256_and_si256(previous1, lowNibble));
+                    __m256i byte2High = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) (tables + 32))), _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble));
+                    __m256i specialCases = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+                    __m256i thirdByte = _mm256_subs_epu8(_mm256_alignr_epi8(input, crossed, 14), _mm256_set1_epi8(0xe0 - 0x80));
+                    __m256i fourthByte = _mm256_subs_epu8(_mm256_alignr_epi8(input, crossed, 13), _mm256_set1_epi8((char) (0xf0 - 0x80)));
+                    __m256i mustBeContinuation = _mm256_and_si256(_mm256_or_si256(thirdByte, fourthByte), _mm256_set1_epi8((char) 0x80));
+
+                    error = _mm256_or_si256(error, _mm256_xor_si256(mustBeContinuation, specialCases));
+                    // only the upper lane ends the block
+                    __m256i maxValue = _mm256_inserti128_si256(_mm256_set1_epi8((char) 255), _mm_loadu_si128((__m128i *) (tables + 48)), 1);
+                    previousIncomplete = _mm256_subs_epu8(input, maxValue);
+                    previous = input;
+                }
+
+                __attribute__((target("avx2")))
+                static bool isValidUtf8Avx2(unsigned char *s, size_t length) {
+                    __m256i previous = _mm256_setzero_si256(), previousIncomplete = _mm256_setzero_si256(), error = _mm256_setzero_si256();
+                    size_t i = 0;
+                    for (; i + 32 <= length; i += 32) {
+                        validateUtf8Block(_mm256_loadu_si256((__m256i *) (s + i)), previous, previousIncomplete, error);
+                    }
+
+                    unsigned char tail[32] = {};
+                    memcpy(tail, s + i, length - i);
+                    validateUtf8Block(_mm256_loadu_si256((__m256i *) tail), previous, previousIncomplete, error);
+                    return _mm256_testz_si256(error, error);
+                }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+                static inline void validateUtf8Block(uint8x16_t input, uint8x16_t &previous, uint8x16_t &previousIncomplete, uint8x16_t &error) {
+                    if (vmaxvq_u8(input) < 0x80) {
+                        error = vorrq_u8(error, previousIncomplete);
+                        previousIncomplete = vdupq_n_u8(0);
+                        previous = input;
+                        return;
+                    }
+
+                    const unsigned char *tables = utf8Tables();
+                    uint8x16_t previous1 = vextq_u8(previous, input, 15);
+                    uint8x16_t byte1High = vqtbl1q_u8(vld1q_u8(tables), vshrq_n_u8(previous1, 4));
+                    uint8x16_t byte1Low = vqtbl1q_u8(vld1q_u8(tables + 16), vandq_u8(previous1, vdupq_n_u8(0x0f)));
+                    uint8x16_t byte2High = vqtbl1q_u8(vld1q_u8(tables + 32), vshrq_n_u8(input, 4));
+                    uint8x16_t specialCases = vandq_u8(vandq_u8(byte1High, byte1Low), byte2High);
+
+                    uint8x16_t thirdByte = vqsubq_u8(vextq_u8(previous, input, 14), vdupq_n_u8(0xe0 - 0x80));
+                    uint8x16_t fourthByte = vqsubq_u8(vextq_u8(previous, input, 13), vdupq_n_u8(0xf0 - 0x80));
+                    uint8x16_t mustBeContinuation = vandq_u8(vorrq_u8(thirdByte, fourthByte), vdupq_n_u8(0x80));
+
+                    error = vorrq_u8(error, veorq_u8(mustBeContinuation, specialCases));
+                    previousIncomplete = vqsubq_u8(input, vld1q_u8(tables + 48));
+                    previous = input;
+                }
+
+                static bool isValidUtf8Neon(unsigned char *s, size_t length) {
+                    uint8x16_t previous = vdupq_n_u8(0), previousIncomplete = vdupq_n_u8(0), error = vdupq_n_u8(0);
+                    size_t i = 0;
+                    for (; i + 16 <= length; i += 16) {
+                        validateUtf8Block(vld1q_u8(s + i), previous, previousIncomplete, error);
+                    }
+
+                    unsigned char tail[16] = {};
+                    memcpy(tail, s + i, length - i);
+                    validateUtf8Block(vld1q_u8(tail), previous, previousIncomplete, error);
+                    return vmaxvq_u8(error) == 0;
+                }
+#endif
+
+                // unmaskImprecise and UTF-8 validation in one pass, every block is validated straight
+                // from the register it was unmasked into. The imprecise bytes past length are unmasked
+                // but not validated. dst may sit below src, like for unmask
+#ifdef UWS_CPU_DISPATCH
+                __attribute__((target("ssse3")))
+                static bool unmaskValidateUtf8Ssse3(char *dst, char *src, uint32_t mask, size_t length) {
+                    __m128i vectorMask = _mm_set1_epi32((int) mask);
+                    __m128i previous = _mm_setzero_si128(), previousIncomplete = _mm_setzero_si128(), error = _mm_setzero_si128();
+                    size_t i = 0;
+                    for (; i + 16 <= length; i += 16) {
+                        __m128i block = _mm_xor_si128(_mm_loadu_si128((__m128i *) (src + i)), vectorMask);
+                        _mm_storeu_si128((__m128i *) (dst + i), block);
+                        validateUtf8Block(block, previous, previousIncomplete, error);
+                    }
+
+                    unmask(dst + i, src + i, mask, ((length - i) / 4 + 1) * 4);
+                    unsigned char tail[16] = {};
+                    memcpy(tail, dst + i, length - i);
+                    validateUtf8Block(_mm_loadu_si128((__m128i *) tail), previous, previousIncomplete, error);
+                    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+                }
+
+                __attribute__((target("avx2")))
+                static bool unmaskValidateUtf8Avx2(char *dst, char *src, uint32_t mask, size_t length) {
+                    __m256i vectorMask = _mm256_set1_epi32((int) mask);
+                    __m256i previous = _mm256_setzero_si256(), previousIncomplete = _mm256_setzero_si256(), error = _mm256_setzero_si256();
+                    size_t i = 0;
+                    for (; i + 32 <= length; i += 32) {
+                        __m256i block = _mm256_xor_si256(_mm256_loadu_si256((__m256i *) (src + i)), vectorMask);
+                        _mm256_storeu_si256((__m256i *) (dst + i), block);
+                        validateUtf8Block(block, previous, previousIncomplete, error);
+                    }
+
+                    unmask(dst + i, src + i, mask, ((length - i) / 4 + 1) * 4);
+                    unsigned char tail[32] = {};
+                    memcpy(tail, dst + i, length - i);
+                    validateUtf8Block(_mm256_loadu_si256((__m256i *) tail), previous, previousIncomplete, error);
+                    return _mm256_testz_si256(error, error);
+                }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+                static bool unmaskValidateUtf8Neon(char *dst, char *src, uint32_t mask, size_t length) {
+                    uint8x16_t vectorMask = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+                    uint8x16_t previous = vdupq_n_u8(0), previousIncomplete = vdupq_n_u8(0), error = vdupq_n_u8(0);
+                    size_t i = 0;
+                    for (; i + 16 <= length; i += 16) {
+                        uint8x16_t block = veorq_u8(vld1q_u8((uint8_t *) (src + i)), vectorMask);
+                        vst1q_u8((uint8_t *) (dst + i), block);
+                        validateUtf8Block(block, previous, previousIncomplete, error);
+                    }
+
+                    unmask(dst + i, src + i, mask, ((length - i) / 4 + 1) * 4);
+                    unsigned char tail[16] = {};
+                    memcpy(tail, dst + i, length - i);
+                    validateUtf8Block(vld1q_u8(tail), previous, previousIncomplete, error);
+                    return vmaxvq_u8(error) == 0;
+                }
+#endif
+
+                static bool unmaskImpreciseValidateUtf8(char *dst, char *src, char *maskPtr, unsigned int length) {
+                    // the mask may be overwritten by the first block, so it is read up front
+                    uint32_t mask;
+                    memcpy(&mask, maskPtr, 4);
+                    if (length >= 32) {
+#ifdef UWS_CPU_DISPATCH
+                        if (hasAvx2()) {
+                            return unmaskValidateUtf8Avx2(dst, src, mask, length);
+                        } else if (hasSsse3()) {
+                            return unmaskValidateUtf8Ssse3(dst, src, mask, length);
+                        }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+                        return unmaskValidateUtf8Neon(dst, src, mask, length);
+#endif
+                    }
+                    unmask(dst, src, mask, (((size_t) length >> 2) + 1) * 4);
+                    return isValidUtf8Scalar((unsigned char *) dst, length);
+                }
+
             public:
                 WebSocketProtocol() {
 
@@ -188,7 +654,7 @@ namespace uWS {
                 // https://www.cl.cam.ac.uk/~mgk25/ucs/utf8_check.c
                 // Optimized for predominantly 7-bit content by Alex Hultman, 2016
                 // Licensed as Zlib, like the rest of this project
-                static bool isValidUtf8(unsigned char *s, size_t length)
+                static bool isValidUtf8Scalar(unsigned char *s, size_t length)
                 {
                     for (unsigned char *e = s + length; s != e; ) {
                         if (s + 4 <= e && ((*(uint32_t *) s) & 0x80808080) == 0) {
@@ -225,6 +691,104 @@ namespace uWS {
                     return true;
                 }
 
+                static inline size_t utf8SequenceLength(unsigned char lead) {
+                    return lead >= 0xf0 ? 4 : (lead >= 0xe0 ? 3 : 2);
+                }
+
+                // an unfinished sequence is fine if some continuation could still complete it: fill in
+                // the smallest valid continuations and check the whole sequence
+                static bool isValidUtf8Prefix(unsigned char *s, size_t length) {
+                    unsigned char sequence[4] = {s[0], 0x80, 0x80, 0x80};
+                    if (s[0] == 0xe0) {
+                        sequence[1] = 0xa0;
+                    } else if (s[0] == 0xf0) {
+                        sequence[1] = 0x90;
+                    }
+                    memcpy(sequence, s, length);
+                    return isValidUtf8Scalar(sequence, utf8SequenceLength(s[0]));
+                }
+
+                // validates a text message one piece at a time as it arrives. A sequence split between
+                // pieces is carried over in tail (at most 3 bytes), last means no piece follows
+                static bool isValidUtf8Piece(unsigned char *tail, unsigned char &tailLength, unsigned char *s, size_t length, bool last)
+                {
+                    if (tailLength) {
+                        unsigned char sequence[4];
+                        size_t sequenceLength = utf8SequenceLength(tail[0]);
+                        size_t taken = std::min<size_t>(sequenceLength - tailLength, length);
+                        memcpy(sequence, tail, tailLength);
+                        memcpy(sequence + tailLength, s, taken);
+
+                        if (tailLength + taken < sequenceLength) {
+                            memcpy(tail, sequence, tailLength + taken);
+                            tailLength += (unsigned char) taken;
+                            return !last && isValidUtf8Prefix(tail, tailLength);
+                        }
+
+                        tailLength = 0;
+                        if (!isValidUtf8Scalar(sequence, sequenceLength)) {
+                            return false;
+                        }
+                        s += taken;
+                        length -= taken;
+                    }
+
+                    // split off a sequence that continues in the next piece
+                    size_t end = length;
+                    for (size_t i = length; i-- > 0 && i + 3 >= length; ) {
+                        if (s[i] >= 0xc0) {
+                            if (i + utf8SequenceLength(s[i]) > length) {
+                                end = i;
+                            }
+                            break;
+                        } else if (s[i] < 0x80) {
+                            break;
+                        }
+                    }
+
+                    if (!isValidUtf8(s, end)) {
+                        return false;
+                    }
+
+                    if (end < length) {
+                        tailLength = (unsigned char) (length - end);
+                        memcpy(tail, s + end, tailLength);
+                        return !last && isValidUtf8Prefix(tail, tailLength);
+                    }
+                    return true;
+                }
+
+                // short strings like close reasons are not worth setting up vectors for
+                static bool isValidUtf8(unsigned char *s, size_t length)
+                {
+                    if (length >= 32) {
+#ifdef UWS_CPU_DISPATCH
+                        if (hasAvx2()) {
+                            return isValidUtf8Avx2(s, length);
+                        } else if (hasSsse3()) {
+                            return isValidUtf8Ssse3(s, length);
+                        }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+                        return isValidUtf8Neon(s, length);
+#endif
+                    }
+                    return isValidUtf8Scalar(s, length);
+                }
+
+                // the 7-bit fast path of isValidUtf8 on its own, for validated text that may be kept one byte per character
+                static bool isAscii(const unsigned char *s, size_t length)
+                {
+                    uint64_t highBits = 0;
+                    const unsigned char *e = s + length;
+                    for (; s + 8 <= e; s += 8) {
+                        highBits |= *(uint64_t *) s;
+                    }
+                    for (; s != e; s++) {
+                        highBits |= *s;
+                    }
+                    return !(highBits & 0x8080808080808080ull);
+                }
+
                 struct CloseFrame {
                     uint16_t code;
                     char const *message;
@@ -268,8 +832,7 @@ namespace uWS {
                     return 0;
                 }
 
-                static inline size_t formatMessage(char *dst, const char *src, size_t length, OpCode opCode, size_t reportedLength, bool compressed) {
-                    size_t messageLength;
+                static inline size_t formatHeader(char *dst, OpCode opCode, size_t reportedLength, bool compressed) {
                     size_t headerLength;
                     if (reportedLength < 126) {
                         headerLength = 2;
@@ -285,11 +848,43 @@ namespace uWS {
                     }
 
                     dst[0] = 128 | (compressed ? SND_COMPRESSED : 0) | opCode;
+                    if (!isServer) {
+                        dst[1] |= 128;
+                    }
+                    return headerLength;
+                }
 
-                    messageLength = headerLength + length;
-                    memcpy(dst + headerLength, src, length);
+                // masks of outbound client frames. Masking only keeps scripts from choosing the bytes
+                // intermediaries see, which a native client has no need for, so a seeded xorshift will do
+                static inline uint32_t nextMask() {
+                    static __thread uint32_t state = 0;
+                    if (!state) {
+                        state = std::random_device()() | 1;
+                    }
+                    state ^= state << 13;
+                    state ^= state >> 17;
+                    state ^= state << 5;
+                    return state;
+                }
 
-                    return messageLength;
+                // dst needs room for the header, the mask of a client frame and length bytes
+                static inline size_t formatMessage(char *dst, const char *src, size_t length, OpCode opCode, size_t reportedLength, bool compressed) {
+                    size_t headerLength = formatHeader(dst, opCode, reportedLength, compressed);
+                    if (isServer) {
+                        memcpy(dst + headerLength, src, length);
+                        return headerLength + length;
+                    }
+
+                    uint32_t mask = nextMask();
+                    char *maskBytes = dst + headerLength;
+                    memcpy(maskBytes, &mask, 4);
+                    headerLength += 4;
+                    size_t aligned = length & ~(size_t) 3;
+                    unmask(dst + headerLength, (char *) src, mask, aligned);
+                    for (size_t i = aligned; i < length; i++) {
+                        dst[headerLength + i] = src[i] ^ maskBytes[i & 3];
+                    }
+                    return headerLength + length;
                 }
 
                 static inline void consume(char *src, unsigned int length, WebSocketState *wState) {
@@ -302,8 +897,16 @@ namespace uWS {
 parseNext:
                         while (length >= SHORT_MESSAGE_HEADER) {
 
+                            // not while a fragmented message is open, whose continuations a tiny frame would be out of order with
+                            if (isServer && wState->state.opStack == -1 && isTiny(src) && length >= SHORT_MESSAGE_HEADER + payloadLength(src)) {
+                                if (consumeTinyRun(src, length, wState)) {
+                                    return;
+                                }
+                                continue;
+                            }
+
                             // invalid reserved bits / invalid opcodes / invalid control frames / set compressed frame
-                            if ((rsv1(src) && !Impl::setCompressed(wState)) || rsv23(src) || (getOpCode(src) > 2 && getOpCode(src) < 8) ||
+                            if (isMasked(src) != isServer || (rsv1(src) && !Impl::setCompressed(wState)) || rsv23(src) || (getOpCode(src) > 2 && getOpCode(src) < 8) ||
                                     getOpCode(src) > 10 || (getOpCode(src) > 2 && (!isFin(src) || payloadLength(src) > 125))) {
                                 Impl::forceClose(wState);
                                 return;